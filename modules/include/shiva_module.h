@@ -1,5 +1,7 @@
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "../../shiva_trace_ring.h"
 
 /*
  * In the future we will use clang/gcc plugin to create custom attributes
@@ -9,12 +11,40 @@
 #define SHIVA_T_SPLICE_FUNC_ID "__shiva_splice_fn_name_"
 #define SHIVA_T_SPLICE_INSERT_ID "__shiva_splice_insert_"
 #define SHIVA_T_SPLICE_EXTEND_ID "__shiva_splice_extend_"
+#define SHIVA_T_SPLICE_AT_ID "__shiva_splice_n"
+#define SHIVA_T_EMIT_ID "__shiva_emit_n"
 
 #define SHIVA_T_SPLICE_FUNCTION(fn_name, insert, extend)	\
 	static uint64_t __shiva_splice_insert_##fn_name __attribute__((section(".shiva.transform"))) = insert; \
 	static uint64_t __shiva_splice_extend_##fn_name __attribute__((section(".shiva.transform"))) = extend; \
 	void * __shiva_splice_fn_name_##fn_name(void)
 
+/*
+ * Like SHIVA_T_SPLICE_FUNCTION, for functions that are spliced at more
+ * than one place. Each splice of fn_name is given a different n.
+ */
+#define SHIVA_T_SPLICE_FUNCTION_AT(fn_name, n, insert, extend)	\
+	static uint64_t __shiva_splice_n##n##_insert_##fn_name __attribute__((section(".shiva.transform"))) = insert; \
+	static uint64_t __shiva_splice_n##n##_extend_##fn_name __attribute__((section(".shiva.transform"))) = extend; \
+	void * __shiva_splice_n##n##_fn_name_##fn_name(void)
+
+/*
+ * Replace len bytes of code at offset within fn_name with the raw
+ * instruction words that follow, e.g. to change a constant or flip a
+ * condition without copying the function:
+ *
+ * SHIVA_T_EMIT_BYTECODE(parse_hdr, 0, 0x24, 4, 0x7100411f); // cmp w8, #0x10
+ *
+ * The words are written in place if they fit within len, and are
+ * encoded for the address they are written to. Otherwise they run from
+ * a branch island and return to offset + len, see shiva_transform.c.
+ * Each emit into fn_name is given a different n.
+ */
+#define SHIVA_T_EMIT_BYTECODE(fn_name, n, offset, len, ...)	\
+	static uint64_t __shiva_emit_n##n##_offset_##fn_name __attribute__((section(".shiva.transform"), used)) = offset; \
+	static uint64_t __shiva_emit_n##n##_len_##fn_name __attribute__((section(".shiva.transform"), used)) = len; \
+	uint32_t __shiva_emit_n##n##_code_##fn_name[] __attribute__((section(".shiva.transform"))) = { __VA_ARGS__ }
+
 #define SHIVA_T_PAIR_X0(var) register int64_t var asm("x0");
 #define SHIVA_T_PAIR_X1(var) register int64_t var asm("x1");
 #define SHIVA_T_PAIR_X2(var) register int64_t var asm("x2");
@@ -120,10 +150,41 @@
 #define SHIVA_HELPER_CALL_EXTERNAL_ARGS7(name, arg1, arg2, arg3, arg4, arg5, arg6, arg7)  \
         __shiva_helper_orig_func_##name(arg1, arg2, arg3, arg4, arg5, arg6, arg7);
 
+/*
+ * HWCAP dispatched variants of a patch function. Wherever the patch
+ * replaces fn_name within the target, a variant is linked in instead
+ * if the CPU has every bit of hwcap and hwcap2 (AT_HWCAP and AT_HWCAP2,
+ * i.e. HWCAP_ATOMICS from <asm/hwcap.h>). The choice is made once, when
+ * the patch is linked. The variants of a function are tried in order
+ * of n, so the most demanding one should come first. The plain
+ * definition of fn_name is used when none of them fit, and must always
+ * be there.
+ *
+ *	SHIVA_VARIANT(int, foo, 0, HWCAP_ATOMICS, 0)(int *p)
+ *	{
+ *		...
+ *	}
+ */
+#define SHIVA_VARIANT_ID "__shiva_variant_n"
+#define SHIVA_VARIANT_HWCAP_ID "__shiva_variant_hwcap_n"
 
+#define SHIVA_VARIANT(ret, fn_name, n, hwcap, hwcap2)	\
+	static uint64_t __shiva_variant_hwcap_n##n##_##fn_name[2] __attribute__((section(".shiva.variant"), used)) = \
+	    { (hwcap), (hwcap2) };	\
+	ret __shiva_variant_n##n##_##fn_name
 
+/*
+ * Trace records, drained by tools/shiva-trace when Shiva runs with
+ * SHIVA_TRACE_RING=<path>. Lock-free and without system calls, so they
+ * may be used from handlers of hot functions. They evaluate to false
+ * when the record was dropped.
+ */
+bool shiva_trace_ring_write(uint32_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 
+#define SHIVA_TRACE_RING_ENTRY(fn, a0, a1, a2, a3)		\
+	shiva_trace_ring_write(SHIVA_TRACE_REC_ENTRY, (uint64_t)(fn),	\
+	    (uint64_t)(a0), (uint64_t)(a1), (uint64_t)(a2), (uint64_t)(a3))
 
-
-
-
+#define SHIVA_TRACE_RING_EXIT(fn, retval)				\
+	shiva_trace_ring_write(SHIVA_TRACE_REC_EXIT, (uint64_t)(fn),	\
+	    (uint64_t)(retval), 0, 0, 0)
@@ -6,10 +6,22 @@ void
 shiva_init_lists(struct shiva_ctx *ctx)
 {
 	TAILQ_INIT(&ctx->tailq.mmap_tqlist);
-	TAILQ_INIT(&ctx->tailq.thread_tqlist);
-	TAILQ_INIT(&ctx->tailq.branch_tqlist);
-	TAILQ_INIT(&ctx->tailq.xref_tqlist);
-	TAILQ_INIT(&ctx->tailq.trace_handlers_tqlist);
+	memset(&ctx->analysis, 0, sizeof(ctx->analysis));
+	memset(&ctx->maps, 0, sizeof(ctx->maps));
+	TAILQ_INIT(&ctx->maps.freelist);
+	memset(&ctx->so, 0, sizeof(ctx->so));
+	memset(&ctx->prefetch, 0, sizeof(ctx->prefetch));
+	memset(&ctx->gnu_hash, 0, sizeof(ctx->gnu_hash));
+	TAILQ_INIT(&ctx->module.list);
+	TAILQ_INIT(&ctx->trace_rcu.retired);
+	ctx->trace_rcu.epoch = 1;
+	shiva_arena_init(&ctx->arena.analysis, "analysis");
+	shiva_arena_init(&ctx->arena.module, "module");
+	shiva_arena_init(&ctx->arena.trace, "trace");
+	shiva_stats_init(ctx);
+	(void) shiva_fork_init(ctx);
+	(void) shiva_trace_ring_init(ctx);
+	(void) shiva_hook_stats_init(ctx);
 	return;
 }
 
@@ -19,6 +31,7 @@ shiva_build_trace_data(struct shiva_ctx *ctx)
 	elf_error_t error;
 	struct elf_section section;
 	int bits;
+	shiva_stats_mark_t t0 = SHIVA_STATS_START(ctx);
 
 	if (elf_open_object(ctx->path, &ctx->elfobj, ELF_LOAD_F_FORENSICS,
 	    &error) == false) {
@@ -26,6 +39,7 @@ shiva_build_trace_data(struct shiva_ctx *ctx)
 		elf_error_msg(&error));
 		return false;
 	}
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_ELF_OPEN, t0);
 	if (elf_section_by_name(&ctx->elfobj, ".text", &section) == false) {
 		fprintf(stderr, "elf_section_by_name failed to find \".text\"\n");
 		return false;
@@ -87,7 +101,6 @@ bool
 shiva_interp_mode(struct shiva_ctx *ctx)
 {
 	struct elf_section section;
-	elf_error_t error;
 	uint64_t *rsp;
 	shiva_auxv_iterator_t auxv_iter;
 	struct shiva_auxv_entry auxv_entry;
@@ -95,10 +108,8 @@ shiva_interp_mode(struct shiva_ctx *ctx)
 	bool res;
 	shiva_maps_iterator_t maps_iter;
 	struct shiva_mmap_entry mmap_entry;
-	uint8_t *o_stack, *n_stack;
-	uint64_t o_stack_addr;
-	size_t copy_len;
 	uint64_t o_stack_end = 0;
+	shiva_stats_mark_t t0;
 
 	ctx_global = ctx;
 	shiva_init_lists(ctx);
@@ -113,11 +124,7 @@ shiva_interp_mode(struct shiva_ctx *ctx)
 		fprintf(stderr, "Warning: Found .text relocations in '%s'. This may alter"
 		    " the effects of breakpoints/instrumentation\n", elf_pathname(&ctx->elfobj));
 	}
-	
-	if (shiva_analyze_run(ctx) == false) {
-		fprintf(stderr, "Failed to run the analyzers\n");
-		return false;
-	}
+
 	if (shiva_maps_build_list(ctx) == false) {
 		fprintf(stderr, "shiva_maps_build_list() failed\n");
 		return false;
@@ -151,16 +158,19 @@ shiva_interp_mode(struct shiva_ctx *ctx)
 	shiva_debug("Setting target base: %#lx\n", ctx->ulexec.base_vaddr);
 
 	if (shiva_target_has_prelinking(ctx) == true) {
-		if (shiva_target_get_module_path(ctx, ctx->module_path) == false) {
-			fprintf(stderr, "shiva_target_get_module_path() failed\n");
+		if (shiva_target_get_module_paths(ctx) == false) {
+			fprintf(stderr, "shiva_target_get_module_paths() failed\n");
 			return false;
 		}
 	} else {
+		/*
+		 * SHIVA_MODULE_PATH may list several patches separated by ':'
+		 */
 		char *mpath = getenv("SHIVA_MODULE_PATH");
-		if (mpath != NULL) {
-			strcpy(ctx->module_path, mpath);
-		} else {
-			strcpy(ctx->module_path, SHIVA_DEFAULT_MODULE_PATH);
+		if (shiva_module_set_paths(ctx, NULL, mpath != NULL ? mpath :
+		    SHIVA_DEFAULT_MODULE_PATH) == false) {
+			fprintf(stderr, "shiva_module_set_paths() failed\n");
+			return false;
 		}
 	}
 
@@ -179,10 +189,46 @@ shiva_interp_mode(struct shiva_ctx *ctx)
                         break;
                 }
         }
-	if (shiva_module_loader(ctx, ctx->module_path,
-	    &ctx->module.runtime, SHIVA_MODULE_F_RUNTIME) == false) {
-		fprintf(stderr, "shiva_module_loader failed\n");
-		return false;
+	/*
+	 * A cached patch image for this exact target and patch object
+	 * replaces both the analysis and the linking of the patch.
+	 */
+	t0 = SHIVA_STATS_START(ctx);
+	res = shiva_module_cache_load(ctx, ctx->module_path, &ctx->module.runtime);
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_MODULE_CACHE, t0);
+	if (res == false) {
+		/*
+		 * The patch modules, LDSO and the shared objects of the
+		 * target are read while the target is analyzed.
+		 */
+		if (shiva_prefetch_start(ctx) == false) {
+			fprintf(stderr, "shiva_prefetch_start() failed\n");
+			return false;
+		}
+		/*
+		 * The analyzers run once the module path is known, so that
+		 * SHIVA_ANALYZE_LAZY can limit them to the symbols the patch
+		 * overrides.
+		 */
+		if (shiva_analyze_run(ctx) == false) {
+			fprintf(stderr, "Failed to run the analyzers\n");
+			return false;
+		}
+		t0 = SHIVA_STATS_START(ctx);
+		if (shiva_module_load_list(ctx, SHIVA_MODULE_F_RUNTIME) == false) {
+			fprintf(stderr, "shiva_module_load_list failed\n");
+			return false;
+		}
+		SHIVA_STATS_STOP(ctx, SHIVA_STATS_MODULE_LOAD, t0);
+		if (shiva_analyze_wait(ctx) == false) {
+			fprintf(stderr, "Failed to run the analyzers\n");
+			return false;
+		}
+		/*
+		 * A patch that imports nothing from the shared objects never
+		 * waited for them.
+		 */
+		shiva_prefetch_wait(ctx);
 	}
 	shiva_debug("Target base after module: %#lx\n", ctx->ulexec.base_vaddr);
 	if (elf_type(&ctx->elfobj) != ET_DYN) {
@@ -190,63 +236,30 @@ shiva_interp_mode(struct shiva_ctx *ctx)
 		return false;
 	}
 
-	if (elf_open_object(SHIVA_LDSO_PATH, &ctx->ldsobj, ELF_LOAD_F_STRICT, &error) == false) {
-		fprintf(stderr, "elf_open_object(%s, ...) failed: %s\n",
-		    SHIVA_LDSO_PATH, elf_error_msg(&error));
-		return false;
-	}
 	/*
 	 * NOTE: In interpreter mode don't need to userland-execve the
-	 * target, but we will borrow one of the functions from shiva_ulexec.c
-	 * to load the real dynamic linker into the address space for execution :)
-	 */
-	if (shiva_ulexec_load_elf_binary(ctx, &ctx->ldsobj, true) == false) {
-		fprintf(stderr, "shiva_ulexec_load_elf_binary(%p, %s, true) failed\n",
-		    ctx, elf_pathname(&ctx->ldsobj));
-		return false;
-	}
-	/*
-	 * We must create a new stack before passing control to LDSO. Normally in interpreter
-	 * mode it wouldn't matter since we can just re-use the stack, auxv, etc. In our case
-	 * though we call back to various data structures, symbols and code within the Shiva
-	 * interpreter, and the Shiva stack data will be corrupted if we don't use a separate
-	 * stack for the target executable.
+	 * target, we only load the real dynamic linker into the address
+	 * space for execution :) Only its program headers are needed,
+	 * so it isn't opened with libelfmaster.
 	 */
-	n_stack = shiva_ulexec_allocstack(ctx);
-	if (n_stack == NULL) {
-		fprintf(stderr, "shiva_ulexec_allocstack failed\n");
+	t0 = SHIVA_STATS_START(ctx);
+	if (shiva_ulexec_load_ldso(ctx, SHIVA_LDSO_PATH) == false) {
+		fprintf(stderr, "shiva_ulexec_load_ldso(%p, %s) failed\n",
+		    ctx, SHIVA_LDSO_PATH);
 		return false;
 	}
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_ELF_OPEN, t0);
 	/*
-	 * Set rsp to near the top of the stack at &argc
+	 * The target runs on the stack the kernel made for it, starting
+	 * right at &argc, so that it keeps RLIMIT_STACK and the kernels
+	 * stack guard gap. The Shiva stack frames below &argc are dead once
+	 * control is passed to LDSO: the shiva_ctx that we call back into
+	 * from handlers, the post linker, etc. lives in the .bss (See main),
+	 * and not on the stack.
 	 */
 	rsp = (uint64_t *)ctx->argv;
 	rsp--;
-
-	/*
-	 * COPY THE TOP OF OLD STACK TO TOP OF NEW STACK
-	 * We want to copy the top-most page of the old stack onto the top-most
-	 * page of the new stack. To be more specific we're copying less than
-	 * a page, starting at &argc and then copying everything after that.
-	 */
-	o_stack = (uint8_t *)rsp;
-	o_stack_addr = (uint64_t)o_stack;
-	copy_len = o_stack_end - o_stack_addr;
-	
-	shiva_debug("o_stack_addr: %#lx o_stack_end: %#lx\n", o_stack_addr, o_stack_end);
-	/*
-	 * shiva_ulexec_allocstack() returns a pointer that points to the very
-	 * end of the stack (Top of the stack really).
-	 */
-	shiva_debug("copy_len: %d\n", copy_len);
-	shiva_debug("Copying to %p from %p\n", n_stack - copy_len, o_stack);
-	n_stack = n_stack - copy_len;
-	memcpy(n_stack, o_stack, copy_len);
-
-	/*
-	 * rsp must now point to our new stack, right at &argc
-	 */
-	rsp = (uint64_t *)n_stack;
+	shiva_debug("rsp: %p o_stack_end: %#lx\n", rsp, o_stack_end);
 	shiva_debug("Target entry point: %#lx\n", entry_point);
 	shiva_debug("LDSO entry point: %#lx\n", ctx->ulexec.ldso.entry_point);
 
@@ -265,19 +278,35 @@ shiva_interp_mode(struct shiva_ctx *ctx)
 	(void) shiva_target_dynamic_set(ctx, DT_FLAGS_1, 0);
 #endif
 	/*
-	 * NEW Solution-- works.
 	 * STRICT LINKING (flags: PIE NOW) can be a problem for us since it
-	 * will overwrite any PLT hooks that are set.
-	 *
-	 * Our solution is to create an alternate .rela.plt that excludes the
-	 * JUMP_SLOT relocation entry for the symbol we are hooking.
-	 *
-	 * Update DT_JMPREL to point to our new symbol table.
-	 *
-	 * These steps are to be carried out from within the shiva_trace API,
-	 * specifically shiva_trace_set_breakpoint case PLTGOT_HOOK 
+	 * will overwrite any PLT hooks that are set. The shiva_trace API
+	 * therefore defers PLTGOT hooks to shiva_post_linker(), which runs
+	 * once RTLD has applied the JUMP_SLOT relocations, and which writes
+	 * the hooked GOT entries with shiva_trace_pltgot_commit().
 	 */
 	test_mark(); /* Used for debugging Shiva with GDB. I set a breakpoint on test_mark() */
+	shiva_mem_release(ctx);
+	/*
+	 * The analysis products are only read from here on out, i.e. by
+	 * the trace API. Make sure the target can't modify them.
+	 */
+	if (shiva_arena_protect(&ctx->arena.analysis, PROT_READ) == false) {
+		fprintf(stderr, "shiva_arena_protect() failed\n");
+		return false;
+	}
+	if (shiva_live_init(ctx) == false) {
+		fprintf(stderr, "shiva_live_init() failed\n");
+		return false;
+	}
+	if (shiva_profile_start(ctx) == false) {
+		fprintf(stderr, "shiva_profile_start() failed\n");
+		return false;
+	}
+	if (shiva_coverage_start(ctx) == false) {
+		fprintf(stderr, "shiva_coverage_start() failed\n");
+		return false;
+	}
+	shiva_stats_report(ctx);
 	uint64_t *ptr = (void *)rsp;
 	SHIVA_ULEXEC_LDSO_TRANSFER(rsp, ctx->ulexec.ldso.entry_point, entry_point);
 
@@ -287,11 +316,17 @@ shiva_interp_mode(struct shiva_ctx *ctx)
 
 int main(int argc, char **argv, char **envp)
 {
-	shiva_ctx_t ctx;
+	/*
+	 * In interp mode the target reuses the stack that we are
+	 * running on, so the context must outlive our stack frames.
+	 */
+	static shiva_ctx_t ctx;
 	struct elf_section section;
 	shiva_maps_iterator_t maps_iter;
 	struct shiva_mmap_entry mmap_entry;
 	char *p, *target_path;
+	shiva_stats_mark_t t0;
+	bool res;
 
 	/*
 	 * Initialize everything in the context.
@@ -307,7 +342,7 @@ int main(int argc, char **argv, char **envp)
 		exit(EXIT_FAILURE);
 	}
 	p = strrchr(target_path, '/') + 1;
-	if (strcmp(p, "shiva") != 0) {
+	if (strcmp(p, SHIVA_EXE_NAME) != 0) {
 		shiva_debug("Running in interpreter mode\n");
 
 		ctx.envp = envp;
@@ -325,10 +360,37 @@ int main(int argc, char **argv, char **envp)
 	 * mode (On the command line).
 	 */
 
+	/*
+	 * shiva -l <pid> <patch.o> links a patch into a process that is
+	 * already running under Shiva, see shiva_live.c. With -s <slot>
+	 * it replaces the version of the patch in slot, -r <slot> rolls
+	 * it back.
+	 */
+	if (argc == 4 && strcmp(argv[1], "-l") == 0)
+		exit(shiva_live_request(atoi(argv[2]), argv[3]) == 0 ?
+		    EXIT_SUCCESS : EXIT_FAILURE);
+	if (argc == 6 && strcmp(argv[1], "-l") == 0 && strcmp(argv[3], "-s") == 0)
+		exit(shiva_live_swap_request(atoi(argv[2]), argv[4], argv[5]) == 0 ?
+		    EXIT_SUCCESS : EXIT_FAILURE);
+	if (argc == 5 && strcmp(argv[1], "-l") == 0 && strcmp(argv[3], "-r") == 0)
+		exit(shiva_live_swap_request(atoi(argv[2]), argv[4], NULL) == 0 ?
+		    EXIT_SUCCESS : EXIT_FAILURE);
+	/*
+	 * shiva -z <socket> <argv0> [args] runs the target of the zygote
+	 * listening on socket, see shiva_zygote.c
+	 */
+	if (argc >= 4 && strcmp(argv[1], "-z") == 0)
+		exit(shiva_zygote_request(argv[2], argc - 3, &argv[3], envp));
+
 	if (argc < 2 || (argc == 2 && argv[1][0] == '-')) {
 		printf("Usage: %s [-u] <prog> [<prog> args]\n", argv[0]);
+		printf("       %s -l <pid> <patch.o>\n", argv[0]);
+		printf("       %s -l <pid> -s <slot> <patch.o> | -r <slot>\n", argv[0]);
+		printf("       %s -z <socket> <argv0> [args]\n", argv[0]);
 		printf("-u	userland-exec mode. shiva simply loads and executes the target program\n");
 		printf("-s	static ELF binary (Doesn't use an RTLD)\n");
+		printf("-l	link a patch into a running process that was started with SHIVA_LIVE=1\n");
+		printf("-z	spawn the target of a Shiva started with SHIVA_ZYGOTE=<socket>\n");
 		printf("example: shiva -u /some/program <program args>\n");
 		exit(EXIT_FAILURE);
 	}
@@ -408,15 +470,6 @@ int main(int argc, char **argv, char **envp)
 	}
 	ctx.shiva.base = mmap_entry.base;
 
-	/*
-	 * Now that we've got the target binary (The debugee) loaded
-	 * into memory, we can run some analyzers on it to acquire
-	 * information (i.e. callsite locations).
-	 */
-	if (shiva_analyze_run(&ctx) == false) {
-		fprintf(stderr, "Failed to run the analyzers\n");
-		exit(EXIT_FAILURE);
-	}
 	/*
 	 * shiva_module_loader will load modules/shakti_module.o
 	 * into an executable region within our address space.
@@ -426,14 +479,17 @@ int main(int argc, char **argv, char **envp)
 		goto transfer_control;
 
 	if (shiva_target_has_prelinking(&ctx) == true) {
-		if (shiva_target_get_module_path(&ctx, ctx.module_path) == false) {
-			fprintf(stderr, "shiva_target_get_module_path() failed\n");
+		if (shiva_target_get_module_paths(&ctx) == false) {
+			fprintf(stderr, "shiva_target_get_module_paths() failed\n");
 			return false;
 		}
 	} else {
 		char *mpath = getenv("SHIVA_MODULE_PATH");
 		if (mpath != NULL) {
-			strcpy(ctx.module_path, mpath);
+			if (shiva_module_set_paths(&ctx, NULL, mpath) == false) {
+				fprintf(stderr, "shiva_module_set_paths() failed\n");
+				exit(EXIT_FAILURE);
+			}
 		} else {
 			/*
 			 * If the target binary has no shiva-prelinking
@@ -449,10 +505,33 @@ int main(int argc, char **argv, char **envp)
 	if (ctx.flags & SHIVA_OPTS_F_ULEXEC_ONLY)
 		goto transfer_control;
 
-	if (shiva_module_loader(&ctx, ctx.module_path,
-	    &ctx.module.runtime, SHIVA_MODULE_F_RUNTIME) == false) {
-		fprintf(stderr, "shiva_module_loader failed\n");
-		exit(EXIT_FAILURE);
+	/*
+	 * A cached patch image for this exact target and patch object
+	 * replaces both the analysis and the linking of the patch.
+	 */
+	t0 = SHIVA_STATS_START(&ctx);
+	res = shiva_module_cache_load(&ctx, ctx.module_path, &ctx.module.runtime);
+	SHIVA_STATS_STOP(&ctx, SHIVA_STATS_MODULE_CACHE, t0);
+	if (res == false) {
+		/*
+		 * Now that we've got the target binary (The debugee) loaded
+		 * into memory, we can run some analyzers on it to acquire
+		 * information (i.e. callsite locations).
+		 */
+		if (shiva_analyze_run(&ctx) == false) {
+			fprintf(stderr, "Failed to run the analyzers\n");
+			exit(EXIT_FAILURE);
+		}
+		t0 = SHIVA_STATS_START(&ctx);
+		if (shiva_module_load_list(&ctx, SHIVA_MODULE_F_RUNTIME) == false) {
+			fprintf(stderr, "shiva_module_load_list failed\n");
+			exit(EXIT_FAILURE);
+		}
+		SHIVA_STATS_STOP(&ctx, SHIVA_STATS_MODULE_LOAD, t0);
+		if (shiva_analyze_wait(&ctx) == false) {
+			fprintf(stderr, "Failed to run the analyzers\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	/*
@@ -472,6 +551,36 @@ int main(int argc, char **argv, char **envp)
 	 */
 transfer_control:
 	test_mark();
+	/*
+	 * Free what was only needed to link the patches, before a zygote
+	 * hands the image to its children.
+	 */
+	shiva_mem_release(&ctx);
+	if (shiva_arena_protect(&ctx.arena.analysis, PROT_READ) == false) {
+		fprintf(stderr, "shiva_arena_protect() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	/*
+	 * With SHIVA_ZYGOTE set we only get past here within a child that
+	 * was spawned from the warm image, see shiva_zygote.c
+	 */
+	if (shiva_zygote_serve(&ctx) == false) {
+		fprintf(stderr, "shiva_zygote_serve() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (shiva_live_init(&ctx) == false) {
+		fprintf(stderr, "shiva_live_init() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (shiva_profile_start(&ctx) == false) {
+		fprintf(stderr, "shiva_profile_start() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (shiva_coverage_start(&ctx) == false) {
+		fprintf(stderr, "shiva_coverage_start() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	shiva_stats_report(&ctx);
 	shiva_debug("Passing control to entry point: %#lx\n", ctx.ulexec.entry_point);
 	shiva_debug("LDSO entry point: %#lx\n", ctx.ulexec.ldso.entry_point);
 	SHIVA_ULEXEC_LDSO_TRANSFER(ctx.ulexec.rsp_start, ctx.ulexec.ldso.entry_point,
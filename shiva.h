@@ -20,9 +20,19 @@
 #include <errno.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #include "hsearch.h"
+/*
+ * SHIVA_RT is the minimal runtime interpreter (make shiva-rt). It has no
+ * disassembler, the branch and xref sites of a target come from the
+ * table that shiva-ld prelinks into it (See shiva_analyze.c).
+ */
+#ifndef SHIVA_RT
 #include "include/capstone/capstone.h"
+#elif defined DEBUG
+#error "shiva-rt has no debug build"
+#endif
 
 #if defined(__ANDROID__) || defined(ANDROID)
 	#include "include/libelfmaster.h"
@@ -32,6 +42,9 @@
 
 #include "shiva_debug.h"
 #include "shiva_misc.h"
+#include "shiva_prelink.h"
+#include "shiva_trace_ring.h"
+#include "shiva_hook_stats.h"
 
 #define SHIVA_SIGNATURE 0x31f64
 
@@ -50,10 +63,16 @@
 #define SHIVA_OPTS_F_ULEXEC_ONLY		(1UL << 1)
 #define SHIVA_OPTS_F_INTERP_MODE		(1UL << 2)
 #define SHIVA_OPTS_F_STATIC_ELF			(1UL << 3)
+#define SHIVA_OPTS_F_LIVE_ANALYSIS		(1UL << 4) /* analyzing from within the running target */
 
 #define SHIVA_F_ULEXEC_LDSO_NEEDED	(1UL << 0)
 
+/*
+ * Size of the ulexec stack when RLIMIT_STACK can't be used, and the
+ * upper bound of it when it can (i.e. RLIM_INFINITY).
+ */
 #define SHIVA_STACK_SIZE	(PAGE_SIZE * 1000)
+#define SHIVA_STACK_MAX		(PAGE_SIZE * 65536)
 
 #define SHIVA_LDSO_BASE		0x1000000
 #if defined(__x86_64__)
@@ -72,6 +91,17 @@
 #define SHIVA_MODULE_F_TRANSFORM	(1UL << 3) /* Module has transform records */
 #define SHIVA_MODULE_F_DELAYED_RELOCS	(1UL << 4) /* Module has delayed relocs to process */
 #define SHIVA_MODULE_F_HELPERS		(1UL << 5) /* Module has helper records */
+#define SHIVA_MODULE_F_PACKED		(1UL << 6) /* Segments are carved from a shared image */
+#define SHIVA_MODULE_F_LIVE		(1UL << 7) /* Linked into an already running target */
+#define SHIVA_MODULE_F_VENEERS		(1UL << 8) /* adrp pairs are relinked through veneers */
+
+/*
+ * SHIVA_PATCH_REDIRECT, how calls to an overridden function are linked
+ * to the patch (See choose_patch_redirects() in shiva_module.c)
+ */
+#define SHIVA_REDIRECT_AUTO	0
+#define SHIVA_REDIRECT_CALLSITE	1
+#define SHIVA_REDIRECT_DETOUR	2
 
 #define SHIVA_DT_NEEDED	(DT_LOOS + 10)
 #define SHIVA_DT_SEARCH (DT_LOOS + 11)
@@ -79,6 +109,15 @@
 
 #define SHIVA_DEFAULT_MODULE_PATH "/opt/shiva/modules/shakti.o"
 
+/*
+ * Run under any other name, Shiva is the program interpreter of its target
+ */
+#ifdef SHIVA_RT
+#define SHIVA_EXE_NAME "shiva-rt"
+#else
+#define SHIVA_EXE_NAME "shiva"
+#endif
+
 /*
  * Path to real dynamic linker.
  * XXX this should be configurable via environment.
@@ -130,6 +169,13 @@
 #define MAP_32BIT 0x40
 #endif
 
+/*
+ * Older musl headers lack this one.
+ */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE	0x100000
+#endif
+
 typedef struct shiva_addr_struct {
 	uint64_t addr;
 	TAILQ_ENTRY(shiva_addr_struct) _linkage;
@@ -141,18 +187,20 @@ typedef enum shiva_iterator_res {
 	SHIVA_ITER_ERROR
 } shiva_iterator_res_t;
 
+#define SHIVA_MAPS_SO_BASES_MAX 1024
+
 typedef struct shiva_maps_iterator {
 	struct shiva_ctx *ctx;
 	struct shiva_mmap_entry *current;
 } shiva_maps_iterator_t;
 
 typedef struct shiva_xref_iterator {
-	struct shiva_xref_site *current;
+	size_t index;
 	struct shiva_ctx *ctx;
 } shiva_xref_iterator_t;
 
 typedef struct shiva_callsite_iterator {
-	struct shiva_branch_site *current;
+	size_t index;
 	struct shiva_ctx *ctx;
 } shiva_callsite_iterator_t;
 
@@ -186,19 +234,232 @@ typedef enum shiva_branch_type {
 #define SHIVA_BRANCH_F_DST_SYMINFO	(1UL << 2) /* symbol info of the dest function is present  */
 #define SHIVA_BRANCH_F_INDIRECT		(1UL << 3) /* Indirect jmp or call (i.e. func pointer) */
 
+/*
+ * Interpreter-lifetime allocations are made from per-phase arenas
+ * (See shiva_arena.c), rather than individually from the heap.
+ */
+#define SHIVA_ARENA_BLOCK_SIZE	(PAGE_SIZE * 16)
+#define SHIVA_ARENA_ALIGN	16
+
+struct shiva_arena_block {
+	struct shiva_arena_block *next;
+	size_t size; /* size of the mapping, including this header */
+	size_t used;
+};
+
+struct shiva_arena {
+	const char *name;
+	struct shiva_arena_block *head; /* block currently being allocated from */
+	size_t total;
+	int prot;
+	bool lock;
+};
+
+/*
+ * String keyed hash table (See shiva_htab.c)
+ */
+struct shiva_htab_entry {
+	const char *key;
+	void *data;
+	uint32_t hash;
+};
+
+struct shiva_htab {
+	struct shiva_htab_entry *vec;
+	size_t size; /* a power of 2 */
+	size_t count;
+};
+
+/*
+ * Parsed DT_GNU_HASH table of an ELF object (See shiva_gnu_hash.c)
+ */
+#define SHIVA_GNU_HASH_UNINIT	0
+#define SHIVA_GNU_HASH_READY	1
+#define SHIVA_GNU_HASH_ABSENT	2
+
+struct shiva_gnu_hash {
+	int state;
+	uint32_t nbuckets;
+	uint32_t symoffset;
+	uint32_t bloom_size;
+	uint32_t bloom_shift;
+	uint32_t symcount;
+	uint64_t *bloom;
+	uint32_t *buckets;
+	uint32_t *chain;
+	Elf64_Sym *dynsym;
+	char *dynstr;
+};
+
+/*
+ * Per-phase timers and counters of the interpreter, reported once
+ * control is passed to LDSO when SHIVA_STATS is set (See shiva_stats.c)
+ * Phases may nest, i.e. SHIVA_STATS_MODULE_LOAD includes the time spent
+ * relocating the module and relinking the target. The bytes allocated
+ * with shiva_malloc() and from the arenas are accounted to each phase
+ * that was running at the time as well.
+ */
+typedef enum shiva_stats_phase {
+	SHIVA_STATS_ELF_OPEN = 0,
+	SHIVA_STATS_MAPS,
+	SHIVA_STATS_ANALYZE,
+	SHIVA_STATS_MODULE_CACHE,
+	SHIVA_STATS_MODULE_LOAD,
+	SHIVA_STATS_RELOCATE,
+	SHIVA_STATS_SO_RESOLVE,
+	SHIVA_STATS_RELINK,
+	SHIVA_STATS_LAYOUT,		/* sizing the module segments, incl. GC */
+	SHIVA_STATS_IMAGE,		/* mapping and filling the module segments */
+	SHIVA_STATS_PLTGOT,		/* PLT stubs and GOT entries of modules */
+	SHIVA_STATS_PHASE_COUNT
+} shiva_stats_phase_t;
+
+typedef enum shiva_stats_counter {
+	SHIVA_STATS_INSNS = 0,		/* instructions scanned by the analyzers */
+	SHIVA_STATS_BRANCH_SITES,
+	SHIVA_STATS_XREF_SITES,
+	SHIVA_STATS_SITE_BYTES,		/* peak size of the branch and xref arrays */
+	SHIVA_STATS_RELOCS,		/* relocations applied to patch modules */
+	SHIVA_STATS_SYM_MODULE,		/* symbols resolved within the patch itself */
+	SHIVA_STATS_SYM_TARGET,		/* ... within the target executable */
+	SHIVA_STATS_SYM_SO,		/* ... within its shared objects */
+	SHIVA_STATS_SYM_SHIVA,		/* ... within the Shiva binary */
+	SHIVA_STATS_PATCH_WRITES,	/* writes into the target */
+	SHIVA_STATS_MPROTECT_PAGES,
+	SHIVA_STATS_RELAXED_CALLS,	/* module calls that bypass their PLT stub */
+	SHIVA_STATS_GOT_ENTRIES,	/* PLTGOT entries of patch modules */
+	SHIVA_STATS_COUNTER_COUNT
+} shiva_stats_counter_t;
+
+struct shiva_stats {
+	bool enabled;
+	char *path; /* SHIVA_STATS, "-" is stderr */
+	uint64_t start; /* CLOCK_MONOTONIC ns */
+	uint64_t phase_ns[SHIVA_STATS_PHASE_COUNT];
+	uint64_t phase_alloc[SHIVA_STATS_PHASE_COUNT];
+	uint64_t counters[SHIVA_STATS_COUNTER_COUNT];
+	uint64_t alloc; /* bytes allocated so far, updated atomically */
+};
+
+/*
+ * Where a phase began, returned by SHIVA_STATS_START()
+ */
+typedef struct shiva_stats_mark {
+	uint64_t ns;
+	uint64_t alloc;
+} shiva_stats_mark_t;
+
+/*
+ * Each of these is a single predictable branch when SHIVA_STATS is
+ * unset. SHIVA_STATS_START() evaluates to a zero mark then, and no clock
+ * is read.
+ */
+#define SHIVA_STATS_START(ctx) \
+	((ctx)->stats.enabled == true ? shiva_stats_mark(ctx) :		\
+	    (shiva_stats_mark_t){ 0, 0 })
+
+#define SHIVA_STATS_STOP(ctx, phase, start) do {				\
+	if ((ctx)->stats.enabled == true) {					\
+		(ctx)->stats.phase_ns[(phase)] += shiva_stats_now() - (start).ns; \
+		(ctx)->stats.phase_alloc[(phase)] += __atomic_load_n(		\
+		    &(ctx)->stats.alloc, __ATOMIC_RELAXED) - (start).alloc;	\
+	}									\
+} while (0)
+
+/*
+ * Called by the allocators, ctx_global is NULL until main() has set
+ * it up.
+ */
+#define SHIVA_STATS_ALLOC(len) do {						\
+	if (ctx_global != NULL && ctx_global->stats.enabled == true)		\
+		__atomic_fetch_add(&ctx_global->stats.alloc, (len),		\
+		    __ATOMIC_RELAXED);						\
+} while (0)
+
+#define SHIVA_STATS_ADD(ctx, counter, n) do {				\
+	if ((ctx)->stats.enabled == true)					\
+		(ctx)->stats.counters[(counter)] += (n);			\
+} while (0)
+
+/*
+ * Memory that Shiva adds to the target, by subsystem (See shiva_mem.c)
+ * Pages are those of the bytes that are resident.
+ */
+typedef enum shiva_mem_subsys {
+	SHIVA_MEM_ANALYSIS = 0,		/* analysis arena */
+	SHIVA_MEM_MODULE_ARENA,		/* module arena, i.e. linker state */
+	SHIVA_MEM_MODULE_IMAGE,		/* text, islands and data of the patch modules */
+	SHIVA_MEM_MODULE_ELF,		/* elfobj of each patch module */
+	SHIVA_MEM_TARGET_ELF,		/* elfobj of the target, incl. the .text analyzed */
+	SHIVA_MEM_SO_ELF,		/* elfobj of each cached shared object */
+	SHIVA_MEM_SHIVA_ELF,		/* elfobj of the Shiva binary */
+	SHIVA_MEM_TRACE,		/* trace arena, island, ring and hook stats */
+	SHIVA_MEM_STACK,		/* stack built for the target by ulexec */
+	SHIVA_MEM_HTAB,			/* linker and shared object caches, hsearch tables */
+	SHIVA_MEM_MAPS,			/* /proc/self/maps buffer and index */
+	SHIVA_MEM_SUBSYS_COUNT
+} shiva_mem_subsys_t;
+
+struct shiva_mem_usage {
+	uint64_t bytes;
+	uint64_t pages;
+};
+
+struct shiva_mem_footprint {
+	struct shiva_mem_usage subsys[SHIVA_MEM_SUBSYS_COUNT];
+	uint64_t bytes; /* sum of every subsystem */
+	uint64_t pages;
+	uint64_t released; /* bytes freed by shiva_mem_release() */
+};
+
+/*
+ * The shared objects of the target are opened once, and the symbols that
+ * modules import from them are resolved in batches into ctx->so.symbols
+ * (See shiva_so.c)
+ */
+struct shiva_so_object {
+	elfobj_t elfobj;
+	char *path; /* realpath */
+	struct shiva_gnu_hash gnu_hash;
+};
+
+struct shiva_so_symbol {
+	struct elf_symbol symbol;
+	struct shiva_so_object *so; /* NULL until resolved */
+	bool missing; /* no shared object defines it */
+};
+
+/*
+ * Instruction writes made while relinking the target are queued in a
+ * patch transaction (See shiva_patch.c) and applied together, so that
+ * each page is only made writable once.
+ */
+#define SHIVA_PATCH_WRITE_MAX	8
+
+struct shiva_patch_write {
+	uint64_t addr;
+	uint32_t len;
+	uint32_t seq; /* keeps overlapping writes in the order they were queued */
+	uint8_t data[SHIVA_PATCH_WRITE_MAX];
+};
+
+struct shiva_patch_txn {
+	struct shiva_ctx *ctx;
+	struct shiva_patch_write *writes;
+	size_t count;
+	size_t size;
+};
+
+/*
+ * The symbols referenced by branch and xref sites are stored once in
+ * ctx->analysis.symbols, and each site holds an index into it. Use
+ * shiva_analyze_symbol() to retrieve one. Index 0 is an empty symbol.
+ */
+#define SHIVA_SYMBOL_NONE	0
+
 struct shiva_branch_site {
-	/* Original instruction */
-#if __x86_64__
-	uint8_t o_insn[15];
-#elif __aarch64__
-	uint32_t o_insn;
-#endif
-	struct elf_symbol current_function; // source function of the branch
-	struct elf_symbol symbol; // symbol/func that is being called
-	shiva_branch_type_t branch_type;
-	uint64_t branch_flags;
-	uint64_t target_vaddr;
 	uint64_t branch_site;
+	uint64_t target_vaddr;
 	uint64_t retaddr; /*
 			   * If this is a SHIVA_BRANCH_CALL then
 			   * retaddr will point to the return address
@@ -207,7 +468,16 @@ struct shiva_branch_site {
 			   * site type.
 			   */
 	char *insn_string; /* mnemonic string + op string */
-	TAILQ_ENTRY(shiva_branch_site) _linkage;
+	uint32_t symbol; // symbol/func that is being called
+	uint32_t current_function; // source function of the branch
+	uint32_t branch_flags;
+	shiva_branch_type_t branch_type;
+	/* Original instruction */
+#if __x86_64__
+	uint8_t o_insn[15];
+#elif __aarch64__
+	uint32_t o_insn;
+#endif
 };
 
 /*
@@ -238,21 +508,23 @@ struct shiva_branch_site {
 #define SHIVA_XREF_F_DEREF_SYMINFO	(1UL << 3)
 #define SHIVA_XREF_F_TO_SECTION		(1UL << 4) /* xref to a section (i.e. .rodata) with no syminfo */
 
+/*
+ * The add/str/ldr instruction always follows the adrp, at
+ * adrp_site + 4. Indirect xrefs use the .got entry at target_vaddr
+ * to hold the symbol value.
+ */
 struct shiva_xref_site {
-	int type;
-	uint64_t flags;
-	uint64_t *got; // indirect xrefs use a .got to hold a symbol value.
-	uint64_t adrp_imm; /* imm value of adrp */
 	uint64_t adrp_site; /* site address of adrp */
-	uint64_t adrp_o_insn; /* original instruction bytes of adrp */
+	uint64_t adrp_imm; /* imm value of adrp */
 	uint64_t next_imm; /* imm value of the add/str/ldr instruction */
-	uint64_t next_site; /* site address of the add/str/ldr instruction */
-	uint64_t next_o_insn; /* original instruction bytes of instruction after adrp */
 	uint64_t target_vaddr; /* addr that is being xref'd. add to base_vaddr at runtime */
-	struct elf_symbol deref_symbol; /* Indirect symbol value pointed to by symbol.value */
-	struct elf_symbol symbol; /* symbol info for the symbol the xref goes to */
-	struct elf_symbol current_function; /* syminfo for src function if syminfo flag is set */
-	TAILQ_ENTRY(shiva_xref_site) _linkage;
+	uint32_t adrp_o_insn; /* original instruction bytes of adrp */
+	uint32_t next_o_insn; /* original instruction bytes of instruction after adrp */
+	uint32_t symbol; /* symbol info for the symbol the xref goes to */
+	uint32_t deref_symbol; /* Indirect symbol value pointed to by symbol.value */
+	uint32_t current_function; /* syminfo for src function if syminfo flag is set */
+	uint16_t type;
+	uint16_t flags;
 } shiva_xref_site_t;
 /*
  * TODO: Change naming convention, LP_ may be
@@ -276,7 +548,6 @@ struct shiva_module_section_mapping {
 	TAILQ_ENTRY(shiva_module_section_mapping) _linkage;
 };
 
-#define SHIVA_MODULE_MAX_PLT_COUNT 4096
 
 struct shiva_module_plt_entry {
 	char *symname;
@@ -286,13 +557,38 @@ struct shiva_module_plt_entry {
 	TAILQ_ENTRY(shiva_module_plt_entry) _linkage;
 };
 
+/*
+ * A bl within the module text that was linked to the PLT stub of symname,
+ * see shiva_module.c:relax_module_calls()
+ */
+struct shiva_module_call26 {
+	uint8_t *rel_unit;
+	uint64_t rel_addr;
+	int64_t addend;
+	char *symname;
+};
+
 struct shiva_module_got_entry {
 	char *symname;
 	uint64_t gotaddr; // address of GOT entry
 	uint64_t gotoff; // offset of GOT entry
+	bool lazy; // bound on first call, see shiva_module_lazy.c
 	TAILQ_ENTRY(shiva_module_got_entry) _linkage;
 };
 
+/*
+ * Resolution of a relocation symbol, see shiva_module.c:relocate_module()
+ */
+struct shiva_module_symres {
+	bool defined; /* symbol is within the module's symtab */
+	bool resolved; /* a STT_NOTYPE symbol that internal_symresolve() found */
+	struct elf_symbol symbol; /* from the module */
+	struct elf_symbol target; /* from wherever internal_symresolve() found it */
+	uint64_t e_type;
+	uint64_t type;
+	char *so_path;
+};
+
 struct shiva_module_bss_entry {
 	char *symname;
 	uint64_t addr; // address of bss variable
@@ -319,6 +615,12 @@ typedef struct shiva_mmap_entry {
 	TAILQ_ENTRY(shiva_mmap_entry) _linkage;
 } shiva_mmap_entry_t;
 
+typedef enum shiva_module_index_res {
+	SHIVA_MODULE_INDEX_NONE = 0, /* the directory has no usable index */
+	SHIVA_MODULE_INDEX_HIT,
+	SHIVA_MODULE_INDEX_MISS
+} shiva_module_index_res_t;
+
 typedef enum shiva_linking_mode {
 	SHIVA_LINKING_MICROCODE_PATCH = 0,
 	SHIVA_LINKING_MODULE,
@@ -343,6 +645,17 @@ typedef struct shiva_helper {
 	TAILQ_ENTRY(shiva_helper) _linkage;
 } shiva_helper_t;
 
+/*
+ * The variant of a patch function that is linked in on this CPU (See
+ * SHIVA_VARIANT in modules/include/shiva_module.h)
+ */
+struct shiva_module_variant {
+	struct elf_symbol symbol;
+	unsigned long n;
+	uint64_t hwcap;
+	uint64_t hwcap2;
+};
+
 typedef struct shiva_transform {
 	shiva_transform_type_t type;
 	struct elf_symbol target_symbol;
@@ -357,17 +670,30 @@ typedef struct shiva_transform {
 #define SHIVA_TRANSFORM_F_INJECT		(1UL << 1)
 #define SHIVA_TRANSFORM_F_NOP_PAD		(1UL << 2)
 #define SHIVA_TRANSFORM_F_EXTEND		(1UL << 3)
+#define SHIVA_TRANSFORM_F_INPLACE		(1UL << 4) /* written over the target function */
 	uint64_t flags; /* flags describe behavior, such as ovewrite, extend, etc. */
 	uint8_t *ptr; /* points to the new code or data that is apart of the transform */
 	char *name; /* simply points to target_symbol.name */
 	size_t segment_offset;
+	uint64_t island; /* out of line code of an emit that didn't fit, or 0 */
 	struct {
-		size_t copy_len1;
-		size_t copy_len2;
-		size_t copy_len3;
+		/*
+		 * The splice with the lowest offset into the same
+		 * target function, which makes the copy of it.
+		 */
+		struct shiva_transform *primary;
+		uint64_t new_offset; /* of the patch code within the copy */
+		uint64_t ext_offset; /* of the .text encoded data within the copy */
 	} splice;
-	TAILQ_HEAD(, shiva_branch_site) branch_list;
-	TAILQ_HEAD(, shiva_xref_site) xref_list;
+	/*
+	 * Sites within the target function. These are slices of the
+	 * address sorted ctx->analysis.branches and ctx->analysis.xrefs,
+	 * not copies.
+	 */
+	struct shiva_branch_site *branches;
+	size_t branch_count;
+	struct shiva_xref_site *xrefs;
+	size_t xref_count;
 	TAILQ_ENTRY(shiva_transform) _linkage;
 } shiva_transform_t;
 
@@ -376,10 +702,15 @@ typedef struct shiva_transform {
  * after ld-linux.so is completely done and passes
  * control back to Shiva AT_ENTRY, if needed.
  */
+#define SHIVA_DELAYED_RELOC_F_BY_NAME	(1UL << 0) /* Ignore symval and so_path, resolve symname */
+#define SHIVA_DELAYED_RELOC_F_IFUNC	(1UL << 1) /* Symbol is an IFUNC resolver, bind what it returns */
+#define SHIVA_DELAYED_RELOC_F_TARGET	(1UL << 2) /* symval is relative to the target, not so_path */
+
 struct shiva_module_delayed_reloc {
 	uint8_t *rel_unit;
 	uint64_t rel_addr;
 	uint64_t symval;	   /* The symbols value */
+	uint64_t symval_final;	   /* symval + base of so_path, see shiva_post_linker.c */
 	struct elf_relocation rel; /* Original relocation: (May be updated/modified by Transforms though) */
 	uint64_t flags;
 	char *symname;
@@ -387,6 +718,37 @@ struct shiva_module_delayed_reloc {
 	TAILQ_ENTRY(shiva_module_delayed_reloc) _linkage;
 } shiva_module_delayed_reloc_t;
 
+/*
+ * Index of the patch symbols that can be linked into the target
+ * executable, keyed by the symbol name within the target. Built once
+ * per module by apply_external_patch_links().
+ */
+struct shiva_module_link {
+	char *name; /* name of the symbol in the target */
+	uint64_t target_vaddr; /* value of the symbol in the target */
+#define SHIVA_MODULE_LINK_F_CALL	(1UL << 0)
+#define SHIVA_MODULE_LINK_F_XREF	(1UL << 1)
+#define SHIVA_MODULE_LINK_F_DETOUR	(1UL << 2) /* branch at the entry of target_vaddr */
+	uint64_t flags;
+	uint64_t target_size;
+	size_t callsites; /* callsites of target_vaddr, and the text pages they span */
+	size_t callsite_pages;
+	uint64_t last_page;
+	struct elf_symbol call_symbol; /* STT_FUNC (or transform source) in patch */
+	struct elf_symbol xref_symbol; /* STT_OBJECT in patch */
+	struct shiva_transform *transform;
+	uint64_t veneer; /* branch island veneer to call_symbol, if one was needed */
+	uint64_t stats_stub; /* counting stub of call_symbol, see shiva_hook_stats.c */
+	uint64_t numa_veneer; /* steering veneer of call_symbol, see shiva_module_numa.c */
+};
+
+#define SHIVA_NUMA_MAX_NODES	64
+
+struct shiva_module_replica {
+	uint8_t *mem; /* copy of text_mem, bound to node */
+	int node;
+};
+
 struct shiva_module {
 	int fd;
 	uint64_t flags;
@@ -401,6 +763,7 @@ struct shiva_module {
 	size_t pltgot_off;
 	size_t bss_off;
 	size_t text_size;
+	size_t text_map_size; /* of text_mem when rounded up to huge pages, 0 otherwise */
 	size_t data_size;
 	size_t bss_size;
 	uint64_t text_vaddr;
@@ -409,9 +772,36 @@ struct shiva_module {
 	uint64_t shiva_base; /* base address of shiva executable at runtime */
 	uint64_t target_base; /* base address of target executable at runtime */
 	size_t tf_text_offset; /* Offset of .text in module runtime image after transforms */
+	struct {
+		struct shiva_module_call26 *vec; /* at most plt_count */
+		size_t count;
+	} calls;
+	struct {
+		uint8_t *mem; /* lazy binding stubs, see shiva_module_lazy.c */
+		size_t size;
+		size_t count;
+	} lazy;
+	struct {
+		uint8_t *mem; /* branch veneers, see shiva_module.c:shiva_module_island_alloc() */
+		size_t size;
+		size_t used;
+	} island;
+	struct {
+		uint8_t *mem; /* relocated .eh_frame within text_mem, see shiva_eh_frame.c */
+		size_t size; /* without the terminator */
+		bool registered;
+	} eh_frame;
+	struct {
+		struct shiva_module_replica *vec; /* per NUMA node, see shiva_module_numa.c */
+		size_t count;
+		uint8_t *veneers;
+		size_t veneers_size;
+		size_t veneers_used;
+		bool ready; /* the veneers steer by rseq node_id */
+	} numa;
 	elfobj_t elfobj; /* elfobj to the module */
-	elfobj_t self; /* elfobj to self (Shiva binary) */
 	elfobj_t *target_elfobj; /* elfobj of target executable */
+	struct shiva_gnu_hash self_gnu_hash; /* DT_GNU_HASH of self, if any */
 	struct {
 		TAILQ_HEAD(, shiva_module_bss_entry) bss_list;
 		TAILQ_HEAD(, shiva_module_got_entry) got_list;
@@ -422,12 +812,42 @@ struct shiva_module {
 		TAILQ_HEAD(, shiva_helper) helper_list;
 	} tailq;
 	struct {
-		struct hsearch_data bss;
-		struct hsearch_data got;
-		struct hsearch_data helpers;
+		struct shiva_htab bss;
+		struct shiva_htab got;
+		struct shiva_htab helpers;
+		struct shiva_htab variants; /* function name -> struct shiva_module_variant */
+		struct shiva_htab links;
+		struct shiva_htab sections; /* section name -> struct shiva_module_section_mapping */
+		struct shiva_htab symres; /* symbol name -> struct shiva_module_symres */
+		struct shiva_htab gc; /* section name -> its byte in gc.live */
 	} cache;
+	struct {
+		uint8_t *live; /* per section index, see module_gc_sections() */
+		size_t dead; /* SHF_ALLOC sections that aren't mapped */
+	} gc;
+	struct {
+		struct shiva_module_link *vec;
+		size_t count;
+		uint64_t *addrs; /* sorted target_vaddr of each link */
+		size_t addr_count;
+	} links;
+	/*
+	 * Recorded while linking a microcode patch so that the result
+	 * can be stored in the patch cache (See shiva_module_cache.c)
+	 */
+	struct {
+		bool enabled;
+		bool uncacheable;
+		uint64_t *fixups; /* address of each base dependent qword */
+		size_t fixup_count;
+		size_t fixup_size;
+		struct shiva_patch_write *writes; /* writes into the target */
+		size_t write_count;
+		size_t write_size;
+	} mcache;
 	shiva_linking_mode_t mode;
 	struct shiva_ctx *ctx; /* this is a pointer back to the main context */
+	TAILQ_ENTRY(shiva_module) _linkage;
 };
 
 typedef struct shiva_trace_regset_x86_64 {
@@ -440,6 +860,78 @@ typedef struct shiva_trace_regset_x86_64 {
 
 typedef struct shiva_trace_regset_x86_64 shiva_trace_jumpbuf_t;
 
+/*
+ * Saved by the AArch64 hook stubs of the shiva_trace API right before
+ * the handler is entered. Only x0-x9, x29, x30 and sp are saved.
+ */
+typedef struct shiva_trace_regset_aarch64 {
+	uint64_t x[31];
+	uint64_t sp;
+} shiva_trace_regset_aarch64_t;
+
+#define SHIVA_TRACE_AARCH64_X_OFF(n)	((n) * 8)
+#define SHIVA_TRACE_AARCH64_SP_OFF	248
+
+/*
+ * A hook stub invocation, on the stack of the thread that hit the
+ * hook. Each thread has a struct shiva_trace_tls, found through its
+ * thread pointer, that points to the innermost frame it is in.
+ */
+struct shiva_trace_tls;
+
+typedef struct shiva_trace_frame {
+	struct shiva_trace_regset_aarch64 regs;
+	struct shiva_trace_frame *prev;
+	struct shiva_trace_tls *tls;
+	struct shiva_hook_stats_entry *stats; /* See shiva_hook_stats.c */
+	uint64_t t0;
+} shiva_trace_frame_t;
+
+#define SHIVA_TRACE_TLS_SLOTS	1024 /* power of 2, see shiva_trace_tls_self() */
+#define SHIVA_FORK_HANDLERS_MAX	8
+
+/*
+ * A thread of the target, see shiva_trace_thread.c. The fields from name
+ * on are only valid with SHIVA_TRACE_THREAD_F_STATUS set.
+ */
+typedef struct shiva_trace_thread {
+	uint64_t tp; /* thread pointer of the thread the record belongs to */
+	pid_t pid; /* tid */
+	pid_t ptid; /* thread that created it, 0 if unknown */
+	uint64_t flags;
+	uint64_t grace_seq; /* last live patch grace period it was quiescent in (See shiva_live.c) */
+	char name[16];
+	uid_t uid;
+	gid_t gid;
+	pid_t ppid;
+	pid_t external_tracer_pid;
+} shiva_trace_thread_t;
+
+typedef struct shiva_trace_tls {
+	uint64_t tp; /* thread pointer, 0 if the slot is free */
+	struct shiva_trace_frame *frame;
+	struct shiva_trace_ring *ring; /* See shiva_trace_ring.c */
+	struct shiva_trace_thread thread;
+	uint64_t rcu_epoch; /* epoch of the current lookup, 0 if none (See shiva_trace_rcu.c) */
+	uint32_t rcu_nest;
+} shiva_trace_tls_t;
+
+/*
+ * Passed to the handler of a SHIVA_TRACE_BP_FAST breakpoint, and saved
+ * on the stack of the thread that hit it. pc is the breakpoint address.
+ */
+typedef struct shiva_trace_fast_regs {
+	uint64_t x[31];
+	uint64_t sp;
+	uint64_t nzcv;
+	uint64_t pc;
+	__uint128_t q[32];
+} shiva_trace_fast_regs_t;
+
+#define SHIVA_TRACE_FAST_NZCV_OFF	256
+#define SHIVA_TRACE_FAST_PC_OFF		264
+#define SHIVA_TRACE_FAST_Q_OFF(n)	(272 + (n) * 16)
+
 #define RAX_OFF 0
 #define RBX_OFF 8
 #define RCX_OFF 16
@@ -460,13 +952,14 @@ typedef struct shiva_trace_regset_x86_64 shiva_trace_jumpbuf_t;
 
 typedef struct shiva_ctx {
 	char *path; // path to target executable
-	char module_path[PATH_MAX]; // TODO in the future add linked list of modules.
+	char module_path[PATH_MAX]; // path of the first patch module
 	int argc;
 	char **args;
 	char **argv;
 	char **envp;
 	int argcount;
-	elfobj_t shiva_elfobj; // shiva executable
+	elfobj_t shiva_elfobj; // shiva executable, opened on demand (See module_self)
+	bool shiva_elfobj_loaded;
 	elfobj_t elfobj;	// target executable
 	elfobj_t ldsobj;	// ldso executable
 	uint64_t flags;
@@ -479,17 +972,24 @@ typedef struct shiva_ctx {
 		struct shiva_trace_regset_x86_64 regset_x86_64;
 	} regs;
 	struct {
-		struct shiva_module *runtime;
+		struct shiva_module *runtime; /* the first patch module */
 		struct shiva_module *initcode;
+		char **paths; /* every patch module, in link order */
+		uint64_t *hashes; /* content hash of paths[i] from the module index, or 0 */
+		size_t count;
+		uint64_t window_off; /* bytes of the module window in use */
+		struct {
+			bool init;
+			char dir[PATH_MAX];
+			uint8_t *mem; /* modules.idx of dir, NULL if it has none */
+			size_t size;
+		} index;
+		TAILQ_HEAD(, shiva_module) list; /* every linked patch module */
 	} module;
-	struct {
-		Elf64_Rela *jmprel;
-		size_t jmprel_count;
-	} altrelocs;
 	struct {
 #if __x86_64__
 		ud_t ud_obj;
-#elif __aarch64__
+#elif __aarch64__ && !defined(SHIVA_RT)
 		csh handle;
 		cs_insn *insn;
 #endif
@@ -504,7 +1004,8 @@ typedef struct shiva_ctx {
 		 * basic runtime data created during
 		 * userland exec.
 		 */
-		uint8_t *stack;
+		uint8_t *stack; /* lowest address, above the guard page */
+		size_t stack_size;
 		uint8_t *mem;
 		uint64_t rsp_start;
 		uint64_t heap_vaddr;
@@ -532,16 +1033,120 @@ typedef struct shiva_ctx {
 		uint64_t flags; // SHIVA_F_ULEXEC_* flags
 	} ulexec;
 	struct {
-		TAILQ_HEAD(, shiva_trace_thread) thread_tqlist;
 		TAILQ_HEAD(, shiva_mmap_entry) mmap_tqlist;
-		TAILQ_HEAD(, shiva_branch_site) branch_tqlist;
-		TAILQ_HEAD(, shiva_xref_site) xref_tqlist;
-		TAILQ_HEAD(, shiva_trace_handler) trace_handlers_tqlist;
 	} tailq;
+	/*
+	 * Analysis products from shiva_analyze.c. Both site
+	 * arrays are sorted by site address.
+	 */
+	struct {
+		struct shiva_branch_site *branches;
+		size_t branch_count;
+		struct shiva_xref_site *xrefs;
+		size_t xref_count;
+		struct elf_symbol *symbols;
+		size_t symbol_count;
+		size_t site_bytes; /* peak size of the site arrays, see merge_chunks */
+		bool lazy; /* SHIVA_ANALYZE_LAZY left out unrelated sites */
+		bool pending; /* SHIVA_ANALYZE_ASYNC scan not joined yet */
+		bool res;
+		pthread_t thread;
+		shiva_stats_mark_t t0;
+	} analysis;
+	/*
+	 * Address index over tailq.mmap_tqlist that is kept up to date by
+	 * shiva_maps_refresh(), and a cache of shared object
+	 * base addresses used by shiva_maps_get_so_base().
+	 */
+	struct {
+		struct shiva_mmap_entry **vec; /* sorted by base */
+		size_t count;
+		struct hsearch_data so_bases; /* realpath -> base of r-xp mapping */
+		bool so_bases_init;
+		char *buf; /* /proc/self/maps contents, reused by each refresh */
+		size_t buf_size;
+		TAILQ_HEAD(, shiva_mmap_entry) freelist; /* entries for unmapped regions */
+	} maps;
+	struct shiva_gnu_hash gnu_hash; /* DT_GNU_HASH of the target */
+	/*
+	 * DT_RELA entries of the target sorted by r_addend, so that the
+	 * R_AARCH64_RELATIVE relocations of an indirect xref are found with
+	 * a bsearch (See shiva_module.c:install_aarch64_xref_patch())
+	 */
+	struct {
+		bool init;
+		Elf64_Rela **vec;
+		size_t count;
+	} rela_index;
+	/*
+	 * Helper thread that builds ctx->so while .text is analyzed (See
+	 * shiva_prefetch.c)
+	 */
+	struct {
+		pthread_t thread;
+		bool pending;
+		bool res;
+	} prefetch;
+	struct {
+		bool init;
+		struct shiva_so_object **objects; /* in LDSO search order */
+		size_t count;
+		struct shiva_htab symbols; /* name -> struct shiva_so_symbol */
+	} so;
+	struct {
+		struct shiva_arena analysis; /* read-only once control is passed to LDSO */
+		struct shiva_arena module; /* module linking, and the maps list */
+		struct shiva_arena trace; /* shiva_trace API */
+	} arena;
+	struct shiva_stats stats;
+	struct {
+		uint64_t released; /* See shiva_mem_release() */
+	} mem;
+	/*
+	 * Executable island within b/bl range of the target .text that
+	 * holds the hook stubs of the shiva_trace API (See shiva_trace.c)
+	 */
+	struct {
+		uint8_t *mem;
+		size_t size;
+		size_t used;
+	} trace_island;
+	struct shiva_trace_tls *trace_tls; /* per-thread hook frames (See shiva_trace.c) */
+	struct {
+		uint64_t *gen; /* MADV_WIPEONFORK page, NULL if unsupported */
+		void (*child[SHIVA_FORK_HANDLERS_MAX])(struct shiva_ctx *);
+		size_t count;
+	} fork; /* See shiva_fork.c */
+	size_t trace_pltgot_pending; /* PLTGOT hooks awaiting shiva_trace_pltgot_commit() */
+	struct {
+		struct shiva_trace_bp *create_bp; /* GOT hook of pthread_create() */
+		struct shiva_trace_thread_spawn *spawn;
+	} trace_thread; /* See shiva_trace_thread.c */
+	struct {
+		struct shiva_trace_handler_table *handlers;
+		uint64_t epoch; /* starts at 1, 0 means not reading */
+		uint64_t overflow; /* readers in the overflow trace_tls slot */
+		uint32_t lock; /* serializes writers */
+		TAILQ_HEAD(, shiva_trace_rcu_retired) retired;
+	} trace_rcu; /* See shiva_trace_rcu.c */
+	struct {
+		struct shiva_trace_ring_hdr *hdr; /* NULL unless SHIVA_TRACE_RING is set */
+		size_t len;
+	} trace_ring;
+	struct {
+		struct shiva_hook_stats_hdr *hdr; /* NULL unless SHIVA_HOOK_STATS is set */
+		size_t len;
+	} hook_stats;
 } shiva_ctx_t;
 
 extern struct shiva_ctx *ctx_global;
 
+/*
+ * shiva.c
+ */
+void shiva_init_lists(struct shiva_ctx *);
+bool shiva_build_trace_data(struct shiva_ctx *);
+
 /*
  * util.c
  */
@@ -549,6 +1154,41 @@ extern struct shiva_ctx *ctx_global;
 char * shiva_strdup(const char *);
 char * shiva_xfmtstrdup(char *, ...);
 void * shiva_malloc(size_t);
+void * shiva_realloc(void *, size_t);
+
+/*
+ * shiva_arena.c
+ */
+void shiva_arena_init(struct shiva_arena *, const char *);
+void * shiva_arena_alloc(struct shiva_arena *, size_t);
+char * shiva_arena_strdup(struct shiva_arena *, const char *);
+char * shiva_arena_xfmtstrdup(struct shiva_arena *, char *, ...);
+void shiva_arena_adopt(struct shiva_arena *, struct shiva_arena *);
+bool shiva_arena_protect(struct shiva_arena *, int);
+void shiva_arena_destroy(struct shiva_arena *);
+
+/*
+ * shiva_mem.c
+ */
+const char * shiva_mem_subsys_name(shiva_mem_subsys_t);
+void shiva_mem_footprint(struct shiva_ctx *, struct shiva_mem_footprint *);
+void shiva_mem_release(struct shiva_ctx *);
+
+/*
+ * shiva_patch.c
+ */
+void shiva_patch_txn_begin(struct shiva_ctx *, struct shiva_patch_txn *);
+bool shiva_patch_txn_write(struct shiva_patch_txn *, uint64_t, const void *, size_t,
+    shiva_error_t *);
+bool shiva_patch_txn_commit(struct shiva_patch_txn *, shiva_error_t *);
+bool shiva_patch_txn_atomic_ok(struct shiva_patch_txn *, shiva_error_t *);
+bool shiva_patch_txn_commit_atomic(struct shiva_patch_txn *, shiva_error_t *);
+bool shiva_patch_sync_cores(void);
+void shiva_patch_txn_abort(struct shiva_patch_txn *);
+bool shiva_patch_txn_undo(struct shiva_patch_txn *, struct shiva_patch_txn *,
+    struct shiva_patch_txn *, shiva_error_t *);
+bool shiva_patch_txn_append(struct shiva_patch_txn *, struct shiva_patch_txn *,
+    shiva_error_t *);
 
 /*
  * signal.c
@@ -562,17 +1202,71 @@ void shiva_sighandle(int);
 bool shiva_auxv_iterator_init(struct shiva_ctx *, struct shiva_auxv_iterator *, void *);
 shiva_iterator_res_t shiva_auxv_iterator_next(struct shiva_auxv_iterator *, struct shiva_auxv_entry *);
 bool shiva_auxv_set_value(struct shiva_auxv_iterator *, long);
+bool shiva_auxv_hwcap(struct shiva_ctx *, uint64_t *, uint64_t *);
 
 /*
  * shiva_ulexec.c
  */
 bool shiva_ulexec_prep(shiva_ctx_t *);
 bool shiva_ulexec_load_elf_binary(struct shiva_ctx *, elfobj_t *, bool);
+bool shiva_ulexec_load_ldso(struct shiva_ctx *, const char *);
 uint8_t * shiva_ulexec_allocstack(struct shiva_ctx *);
+bool shiva_ulexec_respawn(struct shiva_ctx *);
 /*
  * shiva_module.c
  */
 bool shiva_module_loader(shiva_ctx_t *, const char *, struct shiva_module **, uint64_t);
+bool shiva_module_enable_post_linker(struct shiva_module *);
+bool shiva_module_set_paths(struct shiva_ctx *, const char *, const char *);
+bool shiva_module_load_list(struct shiva_ctx *, uint64_t);
+bool shiva_module_live_link(struct shiva_ctx *, const char *, uint64_t, uint64_t, uint64_t,
+    struct shiva_module **, struct shiva_patch_txn *);
+size_t shiva_module_live_ranges(struct shiva_module *, uint64_t (*)[2], size_t);
+void shiva_module_live_unlink(struct shiva_module *);
+size_t shiva_module_release_caches(struct shiva_module *);
+int shiva_module_redirect_mode(void);
+uint8_t * shiva_module_island_alloc(struct shiva_module *, size_t);
+
+/*
+ * shiva_module_cache.c
+ */
+void shiva_module_cache_init(struct shiva_module *);
+void shiva_module_cache_invalidate(struct shiva_module *, const char *);
+void shiva_module_cache_note_abs(struct shiva_module *, void *);
+void shiva_module_cache_note_write(struct shiva_module *, uint64_t, const void *, size_t);
+void shiva_module_cache_note_txn(struct shiva_module *, struct shiva_patch_txn *);
+bool shiva_module_cache_store(struct shiva_ctx *, struct shiva_module *, const char *);
+bool shiva_module_cache_load(struct shiva_ctx *, const char *, struct shiva_module **);
+
+/*
+ * shiva_module_index.c
+ */
+shiva_module_index_res_t shiva_module_index_lookup(struct shiva_ctx *, const char *,
+    const char *, char *, uint64_t *);
+bool shiva_module_index_get_hash(struct shiva_ctx *, const char *, uint64_t *);
+bool shiva_module_index_verify(struct shiva_ctx *, const char *, elfobj_t *);
+
+/*
+ * shiva_module_lazy.c
+ */
+bool shiva_module_lazy_enabled(struct shiva_module *);
+bool shiva_module_lazy_add(struct shiva_module *, struct shiva_module_got_entry *, uint64_t *);
+bool shiva_module_lazy_seal(struct shiva_module *);
+
+/*
+ * shiva_perf_map.c
+ */
+bool shiva_perf_map_write(struct shiva_module *, const char *);
+
+/*
+ * shiva_eh_frame.c
+ */
+bool shiva_eh_frame_enabled(struct shiva_module *);
+void shiva_eh_frame_drop(struct shiva_module *, const char *);
+void shiva_eh_frame_discard(struct shiva_module *, uint64_t);
+bool shiva_eh_frame_seal(struct shiva_module *);
+bool shiva_eh_frame_register(struct shiva_ctx *, struct shiva_module *);
+void shiva_eh_frame_deregister(struct shiva_ctx *, struct shiva_module *);
 
 /*
  * shiva_error.c
@@ -584,25 +1278,32 @@ const char * shiva_error_msg(shiva_error_t *);
  * shiva_maps.c
  */
 bool shiva_maps_prot_by_addr(struct shiva_ctx *, uint64_t, int *);
+bool shiva_maps_entry_by_addr(struct shiva_ctx *, uint64_t, struct shiva_mmap_entry *);
 bool shiva_maps_build_list(shiva_ctx_t *);
+bool shiva_maps_refresh(shiva_ctx_t *);
 bool shiva_maps_validate_addr(shiva_ctx_t *, uint64_t);
 void shiva_maps_iterator_init(shiva_ctx_t *, shiva_maps_iterator_t *);
 shiva_iterator_res_t shiva_maps_iterator_next(shiva_maps_iterator_t *, struct shiva_mmap_entry *);
 bool shiva_maps_get_base(shiva_ctx_t *, uint64_t *);
 bool shiva_maps_get_so_base(struct shiva_ctx *, char *,
     uint64_t *);
+bool shiva_maps_find_gap(struct shiva_ctx *, uint64_t, uint64_t, size_t, uint64_t *);
 
 /*
  * shiva_callsite.c
  */
 void shiva_callsite_iterator_init(struct shiva_ctx *, struct shiva_callsite_iterator *);
-shiva_iterator_res_t shiva_callsite_iterator_next(shiva_callsite_iterator_t *, struct shiva_branch_site *);
+shiva_iterator_res_t shiva_callsite_iterator_next(shiva_callsite_iterator_t *, struct shiva_branch_site **);
 
 /*
  * shiva_analyze.c
  */
 bool shiva_analyze_find_calls(shiva_ctx_t *);
 bool shiva_analyze_run(shiva_ctx_t *);
+bool shiva_analyze_wait(shiva_ctx_t *);
+struct elf_symbol * shiva_analyze_symbol(shiva_ctx_t *, uint32_t);
+size_t shiva_analyze_branch_index(shiva_ctx_t *, uint64_t);
+size_t shiva_analyze_xref_index(shiva_ctx_t *, uint64_t);
 
 /*
  * shiva_target.c
@@ -610,7 +1311,7 @@ bool shiva_analyze_run(shiva_ctx_t *);
 bool shiva_target_dynamic_set(struct shiva_ctx *, uint64_t, uint64_t);
 bool shiva_target_dynamic_get(struct shiva_ctx *, uint64_t, uint64_t *);
 bool shiva_target_copy_string(struct shiva_ctx *, char *, const char *, size_t *);
-bool shiva_target_get_module_path(struct shiva_ctx *, char *);
+bool shiva_target_get_module_paths(struct shiva_ctx *);
 bool shiva_target_has_prelinking(struct shiva_ctx *);
 
 /*
@@ -628,6 +1329,8 @@ bool shiva_proc_duplicate_image(shiva_ctx_t *ctx);
 #define SHIVA_TRACE_THREAD_F_EXTERN_TRACER	(1UL << 2) // thread is traced by ptrace
 #define SHIVA_TRACE_THREAD_F_COREDUMPING	(1UL << 3)
 #define SHIVA_TRACE_THREAD_F_NEW		(1UL << 4) // newly added into thread list
+#define SHIVA_TRACE_THREAD_F_STATUS		(1UL << 5) // /proc status fields were read
+#define SHIVA_TRACE_THREAD_F_CREATED		(1UL << 6) // seen through pthread_create()
 
 #define SHIVA_TRACE_HANDLER_F_CALL		(1UL << 0) // handler is invoked via  call
 #define SHIVA_TRACE_HANDLER_F_JMP		(1UL << 1) // handler is invoked via jmp
@@ -657,11 +1360,24 @@ bool shiva_proc_duplicate_image(shiva_ctx_t *ctx);
 	} while(0); \
 }
 #elif defined(__aarch64__)
+/*
+ * bp->o_target is the original callee for CALL and JMP hooks, and for
+ * TRAMPOLINE hooks a thunk that runs the displaced instruction of the
+ * function and branches back into it. x0-x7 are the arguments the hook
+ * stub saved, on the stack of the calling thread, on the way into the
+ * handler.
+ */
 #define SHIVA_TRACE_CALL_ORIGINAL(bp) { \
 	do {\
+		struct shiva_trace_regset_aarch64 *__regs = \
+		    shiva_trace_regs_current(); \
 		void * (*o_func)(void *, void *, void *, void *, \
-		    void *, void *, void *);	\
+		    void *, void *, void *, void *);	\
 		o_func = (void *)bp->o_target; \
+		return o_func((void *)__regs->x[0], (void *)__regs->x[1], \
+		    (void *)__regs->x[2], (void *)__regs->x[3], \
+		    (void *)__regs->x[4], (void *)__regs->x[5], \
+		    (void *)__regs->x[6], (void *)__regs->x[7]); \
 	} while(0); \
 }
 #endif
@@ -673,9 +1389,22 @@ typedef enum shiva_trace_bp_type {
 	SHIVA_TRACE_BP_SEGV,
 	SHIVA_TRACE_BP_SIGILL,
 	SHIVA_TRACE_BP_TRAMPOLINE,
-	SHIVA_TRACE_BP_PLTGOT
+	SHIVA_TRACE_BP_PLTGOT,
+	SHIVA_TRACE_BP_FAST, /* signal-free, see shiva_trace_aarch64_fast() */
+	SHIVA_TRACE_BP_WATCH /* hardware watchpoint, see shiva_trace_watch.c */
 } shiva_trace_bp_type_t;
 
+/*
+ * The option of a SHIVA_TRACE_BP_WATCH breakpoint. Without one, writes
+ * to the 8 bytes at bp_addr are watched.
+ */
+struct shiva_trace_watch {
+	size_t len; /* 1, 2, 4 or 8 bytes, within an aligned 8 bytes */
+#define SHIVA_TRACE_WATCH_R	(1U << 0)
+#define SHIVA_TRACE_WATCH_W	(1U << 1)
+	uint32_t access;
+};
+
 /*
  * Get the breakpoint struct that correlates to the handler
  * function that you are currently in.
@@ -683,20 +1412,8 @@ typedef enum shiva_trace_bp_type {
  */
 #define SHIVA_TRACE_BP_STRUCT(bp, handler) { \
 	do {\
-		void *__ret = __builtin_return_address(0); \
-		struct shiva_addr_struct *addr;			\
-		TAILQ_FOREACH(bp, &handler->bp_tqlist, _linkage)  { \
-			if (bp->bp_type == SHIVA_TRACE_BP_TRAMPOLINE) \
-				break;	\
-			if (bp->bp_type == SHIVA_TRACE_BP_PLTGOT) { \
-				TAILQ_FOREACH(addr, &bp->retaddr_list, _linkage) { \
-					if (addr->addr == __ret)	\
-						break;	\
-				}	\
-			}	\
-			if ((void *)bp->callsite_retaddr == __ret)	\
-				break;	\
-		} \
+		bp = shiva_trace_bp_lookup(handler, \
+		    (uint64_t)__builtin_return_address(0)); \
 	} while(0); \
 }
 
@@ -726,7 +1443,25 @@ typedef enum shiva_trace_bp_type {
 					"movq 120(%%rdx), %%rsp\n\t" \
 					"jmp %0" :: "r"(rip_target));
 #elif defined(__aarch64__)
-#define SHIVA_TRACE_LONGJMP_RETURN(regptr, rip_target) __asm __volatile__("");
+/*
+ * regptr is a struct shiva_trace_regset_aarch64 *, i.e. the one saved by
+ * a hook stub. x0-x9, x29, x30 and sp are restored before branching to
+ * rip_target.
+ */
+#define SHIVA_TRACE_LONGJMP_RETURN(regptr, rip_target) {		\
+	register uint64_t __x16 __asm__("x16") = (uint64_t)(regptr);	\
+	register uint64_t __x17 __asm__("x17") = (uint64_t)(rip_target); \
+	__asm__ __volatile__(						\
+		"ldr x9, [x16, #248]\n\t"				\
+		"mov sp, x9\n\t"					\
+		"ldp x0, x1, [x16, #0]\n\t"				\
+		"ldp x2, x3, [x16, #16]\n\t"				\
+		"ldp x4, x5, [x16, #32]\n\t"				\
+		"ldp x6, x7, [x16, #48]\n\t"				\
+		"ldp x8, x9, [x16, #64]\n\t"				\
+		"ldp x29, x30, [x16, #232]\n\t"			\
+		"br x17" :: "r"(__x16), "r"(__x17) : "memory");		\
+}
 #endif
 
 #if defined(__x86_64__)
@@ -748,7 +1483,8 @@ typedef enum shiva_trace_op {
 	SHIVA_TRACE_OP_SETREGS,
 	SHIVA_TRACE_OP_SETFPREGS,
 	SHIVA_TRACE_OP_GETSIGINFO,
-	SHIVA_TRACE_OP_SETSIGINFO
+	SHIVA_TRACE_OP_SETSIGINFO,
+	SHIVA_TRACE_OP_REFRESH_MAPS
 } shiva_trace_op_t;
 
 #define SHIVA_MAX_INST_LEN 15
@@ -767,6 +1503,7 @@ typedef struct shiva_trace_bp {
 	size_t bp_len;
 	uint8_t *inst_ptr;
 	uint64_t callsite_retaddr; // only used for CALL hooks
+	uint64_t stub_retaddr; // return address of the handler within its hook stub (aarch64)
 	uint64_t plt_addr; // Only used for PLTGOT hooks. This holds the corresponding PLT stub address.
 	uint64_t o_target; // for CALL/JMP hooks this holds original target. For PLTGOT hooks it holds original gotptr
 	int64_t o_call_offset; // if this is a call or jmp breakpoint, o_offset holds the original target offset
@@ -775,73 +1512,230 @@ typedef struct shiva_trace_bp {
 	bool symbol_location;	// true if bp->symbol gets set
 	struct shiva_trace_insn insn;
 	struct hsearch_data valid_plt_retaddrs; // only used for SHIVA_TRACE_BP_PLTGOT hooks
+	int watch_fd; // only used for SHIVA_TRACE_BP_WATCH, the perf event of the watchpoint
 	TAILQ_HEAD(, shiva_addr_struct) retaddr_list;
 	TAILQ_ENTRY(shiva_trace_bp) _linkage;
 } shiva_trace_bp_t;
 
+/*
+ * One slot of the per-handler breakpoint index, an open addressing
+ * hash table keyed by the return address that the handler sees (See
+ * shiva_trace_bp_lookup()). retaddr 0 marks a free slot.
+ */
+struct shiva_trace_bp_slot {
+	uint64_t retaddr;
+	struct shiva_trace_bp *bp;
+};
+
+struct shiva_trace_bp_index {
+	size_t size; /* power of 2 */
+	size_t count;
+	struct shiva_trace_bp *fallback; /* first TRAMPOLINE bp */
+	struct shiva_trace_bp_slot slots[];
+};
+
 typedef struct shiva_trace_handler {
 	shiva_trace_bp_type_t type;
 	void * (*handler_fn)(void *); // points to handler triggered by BP
 	struct sigaction sa;
 	TAILQ_HEAD(, shiva_trace_bp) bp_tqlist; // list of current bp's
-	TAILQ_ENTRY(shiva_trace_handler) _linkage;
+	struct shiva_trace_bp_index *bp_index; // NULL until the first bp
 } shiva_trace_handler_t;
 
+/*
+ * The registered handlers, replaced as a whole by a copy whenever one
+ * is added (See shiva_trace_rcu.c).
+ */
+struct shiva_trace_handler_table {
+	size_t count;
+	struct shiva_trace_handler *handlers[];
+};
+
 typedef struct shiva_trace_regs {
 	struct shiva_trace_regset_x86_64 x86_64;
 } shiva_trace_regs_t;
 
-typedef struct shiva_trace_thread {
-	char *name;
-	uid_t uid;
-	gid_t gid;
-	pid_t pid;
-	pid_t ppid;
-	pid_t external_tracer_pid;
-	uint64_t flags;
-	TAILQ_ENTRY(shiva_trace_thread) _linkage;
-} shiva_trace_thread_t;
-
 bool shiva_trace(shiva_ctx_t *, pid_t, shiva_trace_op_t, void *, void *, size_t, shiva_error_t *);
 bool shiva_trace_register_handler(shiva_ctx_t *, void * (*)(void *), shiva_trace_bp_type_t,
     shiva_error_t *);
 struct shiva_trace_handler * shiva_trace_find_handler(struct shiva_ctx *, void *);
 struct shiva_trace_bp * shiva_trace_bp_struct(void *);
+struct shiva_trace_bp * shiva_trace_bp_lookup(struct shiva_trace_handler *, uint64_t);
+void shiva_trace_bp_insert(struct shiva_ctx *, struct shiva_trace_handler *,
+    struct shiva_trace_bp *);
 bool shiva_trace_set_breakpoint(shiva_ctx_t *, void * (*)(void *), uint64_t, void *, shiva_error_t *);
 bool shiva_trace_write(struct shiva_ctx *, pid_t, void *, const void *, size_t, shiva_error_t *);
+bool shiva_trace_pltgot_commit(struct shiva_ctx *, shiva_error_t *);
 #if __x86_64__
 void __attribute__((naked)) shiva_trace_getregs_x86_64(struct shiva_trace_regset_x86_64 *);
 void __attribute__((naked)) shiva_trace_setjmp_x86_64(shiva_trace_jumpbuf_t *);
 void shiva_trace_longjmp_x86_64(shiva_trace_jumpbuf_t *jumpbuf, uint64_t ip);
 #endif
 uint64_t shiva_trace_base_addr(struct shiva_ctx *);
+struct shiva_trace_tls * shiva_trace_tls_self(struct shiva_ctx *, bool);
+void shiva_trace_tls_init(struct shiva_ctx *);
+#if __aarch64__
+struct shiva_trace_regset_aarch64 * shiva_trace_regs_current(void);
+uint8_t * shiva_trace_hit_stub(struct shiva_ctx *, uint64_t *, uint64_t, shiva_error_t *);
+#endif
+/*
+ * shiva_trace_watch.c
+ */
+bool shiva_trace_watch_set(struct shiva_ctx *, struct shiva_trace_handler *, uint64_t,
+    struct shiva_trace_watch *, shiva_error_t *);
+struct shiva_trace_bp * shiva_trace_watch_bp(struct shiva_ctx *, void *, uint64_t);
+
+/*
+ * shiva_trace_rcu.c
+ */
+void shiva_trace_rcu_enter(struct shiva_ctx *);
+void shiva_trace_rcu_exit(struct shiva_ctx *);
+void shiva_trace_rcu_lock(struct shiva_ctx *);
+void shiva_trace_rcu_unlock(struct shiva_ctx *);
+void shiva_trace_rcu_publish(struct shiva_ctx *, void **, void *);
+
 /*
  * shiva_trace_thread.c
  */
 bool shiva_trace_thread_insert(shiva_ctx_t *, pid_t, uint64_t *);
+void shiva_trace_thread_forked(struct shiva_trace_tls *);
+struct shiva_trace_thread * shiva_trace_thread_self(struct shiva_ctx *);
+struct shiva_trace_thread * shiva_trace_thread_self_tid(struct shiva_ctx *, pid_t);
+struct shiva_trace_thread * shiva_trace_thread_by_tid(struct shiva_ctx *, pid_t);
+bool shiva_trace_thread_status(struct shiva_ctx *, struct shiva_trace_thread *);
+bool shiva_trace_thread_hook(struct shiva_ctx *, shiva_error_t *);
 
 /*
  * shiva_xref.c (Iterator function for xrefs)
  */
 void shiva_xref_iterator_init(struct shiva_ctx *, struct shiva_xref_iterator *);
-shiva_iterator_res_t shiva_xref_iterator_next(struct shiva_xref_iterator *, struct shiva_xref_site *);
+shiva_iterator_res_t shiva_xref_iterator_next(struct shiva_xref_iterator *, struct shiva_xref_site **);
 
 /*
  * shiva_transform.c
  */
 bool shiva_tf_process_transforms(struct shiva_module *, uint8_t *,
     struct elf_section section, uint64_t *segment_offset);
+const char * shiva_tf_splice_target(const char *);
+const char * shiva_tf_emit_target(const char *);
+bool shiva_tf_plan_splices(struct shiva_module *);
+size_t shiva_tf_island_size(struct shiva_module *);
+bool shiva_tf_queue_inplace(struct shiva_module *, struct shiva_patch_txn *);
+
+/*
+ * shiva_htab.c
+ */
+void shiva_htab_init(struct shiva_htab *, size_t);
+void shiva_htab_destroy(struct shiva_htab *);
+void * shiva_htab_find(struct shiva_htab *, const char *);
+bool shiva_htab_insert(struct shiva_htab *, const char *, void *);
+
+/*
+ * shiva_gnu_hash.c
+ */
+bool shiva_symbol_by_name(struct shiva_gnu_hash *, elfobj_t *, const char *,
+    struct elf_symbol *);
+bool shiva_gnu_hash_setup(struct shiva_gnu_hash *, uint32_t *, Elf64_Sym *, char *);
+bool shiva_gnu_hash_lookup(struct shiva_gnu_hash *, const char *, struct elf_symbol *);
+bool shiva_gnu_hash_ready(struct shiva_gnu_hash *, elfobj_t *);
+
+/*
+ * shiva_link_map.c
+ */
+bool shiva_link_map_so_base(struct shiva_ctx *, const char *, uint64_t *);
+bool shiva_link_map_resolve_symbol(struct shiva_ctx *, const char *, struct elf_symbol *,
+    uint64_t *);
+uint64_t shiva_link_map_ifunc_resolve(struct shiva_ctx *, uint64_t);
 
 /*
  * shiva_so.c
  */
 bool shiva_so_resolve_symbol(struct shiva_module *, char *, struct elf_symbol *,
     char **);
+bool shiva_so_resolve_batch(struct shiva_module *, const char **, size_t);
+bool shiva_so_cache_build(struct shiva_ctx *, bool);
+size_t shiva_so_cache_release(struct shiva_ctx *);
+
+/*
+ * shiva_prefetch.c
+ */
+bool shiva_prefetch_start(struct shiva_ctx *);
+void shiva_prefetch_wait(struct shiva_ctx *);
+void shiva_prefetch_file(const char *);
 
 /*
  * shiva_post_linker.c
  */
 void shiva_post_linker(void);
+bool shiva_post_linker_enable(struct shiva_ctx *);
+bool shiva_post_linker_resolve(struct shiva_ctx *, struct shiva_module *);
+
+/*
+ * shiva_stats.c
+ */
+void shiva_stats_init(struct shiva_ctx *);
+uint64_t shiva_stats_now(void);
+shiva_stats_mark_t shiva_stats_mark(struct shiva_ctx *);
+void shiva_stats_report(struct shiva_ctx *);
+
+/*
+ * shiva_trace_ring.c
+ */
+bool shiva_trace_ring_init(struct shiva_ctx *);
+bool shiva_trace_ring_write(uint32_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+/*
+ * shiva_hook_stats.c
+ */
+bool shiva_hook_stats_init(struct shiva_ctx *);
+bool shiva_hook_stats_latency(struct shiva_ctx *);
+struct shiva_hook_stats_entry * shiva_hook_stats_alloc(struct shiva_ctx *, uint32_t,
+    uint32_t, uint64_t, uint64_t, const char *);
+uint64_t shiva_hook_stats_enter(struct shiva_hook_stats_entry *, uint64_t);
+void shiva_hook_stats_leave(struct shiva_hook_stats_entry *, uint64_t, uint64_t);
+uint64_t shiva_hook_stats_patch_link(struct shiva_module *, struct shiva_module_link *,
+    uint64_t);
+
+/*
+ * shiva_profile.c
+ */
+bool shiva_profile_start(struct shiva_ctx *);
+
+/*
+ * shiva_coverage.c
+ */
+bool shiva_coverage_start(struct shiva_ctx *);
+
+/*
+ * shiva_live.c
+ */
+bool shiva_live_init(struct shiva_ctx *);
+bool shiva_live_patch(struct shiva_ctx *, const char *, shiva_error_t *);
+bool shiva_live_swap(struct shiva_ctx *, const char *, const char *, shiva_error_t *);
+int shiva_live_request(pid_t, const char *);
+int shiva_live_swap_request(pid_t, const char *, const char *);
+
+/*
+ * shiva_zygote.c
+ */
+bool shiva_zygote_serve(struct shiva_ctx *);
+int shiva_zygote_request(const char *, int, char **, char **);
+
+/*
+ * shiva_module_numa.c
+ */
+bool shiva_module_numa_enabled(void);
+bool shiva_module_numa_replicate(struct shiva_module *, size_t);
+uint64_t shiva_module_numa_link(struct shiva_module *, struct shiva_module_link *, uint64_t);
+bool shiva_module_numa_seal(struct shiva_module *);
+bool shiva_module_numa_sync(struct shiva_ctx *, struct shiva_module *);
+
+/*
+ * shiva_fork.c
+ */
+bool shiva_fork_init(struct shiva_ctx *);
+bool shiva_atfork(struct shiva_ctx *, void (*)(struct shiva_ctx *));
+void shiva_fork_check(struct shiva_ctx *);
 #endif
 
 /*
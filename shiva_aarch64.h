@@ -1,5 +1,8 @@
+#ifndef _SHIVA_AARCH64_H_
+#define _SHIVA_AARCH64_H_
 
-static void shiva_aarch64_emit_insn(uint8_t *buf, uint32_t insn)
+
+static inline void shiva_aarch64_emit_insn(uint8_t *buf, uint32_t insn)
 {
 	*(uint32_t *)buf = insn;
 	return;
@@ -68,3 +71,194 @@ enum shiva_aarch64_br_opcodes
                      | shiva_aarch64_encode (offset >> 2, 14, 5)  \
                      | shiva_aarch64_encode (rt, 5, 0))
 
+/*
+ * Table driven decoder for the handful of instructions that Shiva
+ * needs to find during control flow and xref analysis. Instructions
+ * are classified with a mask/compare against the raw 32bit instruction
+ * word, and immediates are computed arithmetically.
+ */
+typedef enum shiva_aarch64_insn_type {
+	SHIVA_AARCH64_INSN_B = 0,	/* b imm26 */
+	SHIVA_AARCH64_INSN_BL,		/* bl imm26 */
+	SHIVA_AARCH64_INSN_BCOND,	/* b.cond imm19 */
+	SHIVA_AARCH64_INSN_CB,		/* cbz/cbnz imm19 */
+	SHIVA_AARCH64_INSN_TB,		/* tbz/tbnz imm14 */
+	SHIVA_AARCH64_INSN_ADRP,	/* adrp immhi:immlo */
+	SHIVA_AARCH64_INSN_ADD_IMM,	/* add (immediate) */
+	SHIVA_AARCH64_INSN_LDR_IMM,	/* ldr (immediate, unsigned offset) */
+	SHIVA_AARCH64_INSN_STR_IMM,	/* str (immediate, unsigned offset) */
+	SHIVA_AARCH64_INSN_UNKNOWN
+} shiva_aarch64_insn_type_t;
+
+struct shiva_aarch64_opcode {
+	uint32_t mask;
+	uint32_t value;
+	shiva_aarch64_insn_type_t type;
+};
+
+static const struct shiva_aarch64_opcode shiva_aarch64_opcode_table[] = {
+	{ 0xfc000000, 0x14000000, SHIVA_AARCH64_INSN_B },
+	{ 0xfc000000, 0x94000000, SHIVA_AARCH64_INSN_BL },
+	{ 0xff000010, 0x54000000, SHIVA_AARCH64_INSN_BCOND },
+	{ 0x7e000000, 0x34000000, SHIVA_AARCH64_INSN_CB },
+	{ 0x7e000000, 0x36000000, SHIVA_AARCH64_INSN_TB },
+	{ 0x9f000000, 0x90000000, SHIVA_AARCH64_INSN_ADRP },
+	{ 0x7f800000, 0x11000000, SHIVA_AARCH64_INSN_ADD_IMM },
+	{ 0xbfc00000, 0xb9400000, SHIVA_AARCH64_INSN_LDR_IMM }, /* ldr w/x */
+	{ 0xbfc00000, 0x39400000, SHIVA_AARCH64_INSN_LDR_IMM }, /* ldrb/ldrh */
+	{ 0x3fc00000, 0x3d400000, SHIVA_AARCH64_INSN_LDR_IMM }, /* ldr FP/SIMD b/h/s/d */
+	{ 0xbfc00000, 0xb9000000, SHIVA_AARCH64_INSN_STR_IMM }, /* str w/x */
+	{ 0xbfc00000, 0x39000000, SHIVA_AARCH64_INSN_STR_IMM }, /* strb/strh */
+	{ 0x3fc00000, 0x3d000000, SHIVA_AARCH64_INSN_STR_IMM }, /* str FP/SIMD b/h/s/d */
+	{ 0, 0, SHIVA_AARCH64_INSN_UNKNOWN }
+};
+
+struct shiva_aarch64_insn {
+	shiva_aarch64_insn_type_t type;
+	uint32_t raw;
+	/*
+	 * b/bl/b.cond/cb/tb: pc relative branch offset
+	 * adrp: offset of the target page from the page of the adrp
+	 * add/ldr/str: unscaled byte offset
+	 */
+	int64_t imm;
+	uint32_t rd; /* Rd/Rt */
+	uint32_t rn;
+	uint32_t cond; /* b.cond condition, tb bit number */
+	bool is64;
+	bool is_nz; /* cbnz/tbnz */
+};
+
+static inline int64_t
+shiva_aarch64_sext(uint64_t value, int bits)
+{
+	uint64_t m = 1ULL << (bits - 1);
+
+	value &= (1ULL << bits) - 1;
+	return (int64_t)((value ^ m) - m);
+}
+
+static inline bool
+shiva_aarch64_decode(uint32_t raw, struct shiva_aarch64_insn *insn)
+{
+	const struct shiva_aarch64_opcode *op;
+
+	for (op = shiva_aarch64_opcode_table; op->mask != 0; op++) {
+		if ((raw & op->mask) == op->value)
+			break;
+	}
+	insn->type = op->type;
+	if (op->type == SHIVA_AARCH64_INSN_UNKNOWN)
+		return false;
+	insn->raw = raw;
+	insn->rd = raw & 0x1f;
+	insn->rn = (raw >> 5) & 0x1f;
+	insn->is64 = (raw >> 31) & 0x1;
+	insn->is_nz = (raw >> 24) & 0x1;
+	insn->cond = 0;
+
+	switch(op->type) {
+	case SHIVA_AARCH64_INSN_B:
+	case SHIVA_AARCH64_INSN_BL:
+		insn->imm = shiva_aarch64_sext(raw, 26) << 2;
+		break;
+	case SHIVA_AARCH64_INSN_BCOND:
+		insn->imm = shiva_aarch64_sext(raw >> 5, 19) << 2;
+		insn->cond = raw & 0xf;
+		break;
+	case SHIVA_AARCH64_INSN_CB:
+		insn->imm = shiva_aarch64_sext(raw >> 5, 19) << 2;
+		break;
+	case SHIVA_AARCH64_INSN_TB:
+		insn->imm = shiva_aarch64_sext(raw >> 5, 14) << 2;
+		insn->cond = ((raw >> 26) & 0x20) | ((raw >> 19) & 0x1f);
+		break;
+	case SHIVA_AARCH64_INSN_ADRP:
+		insn->imm = shiva_aarch64_sext(((raw >> 29) & 0x3) |
+		    (((raw >> 5) & 0x7ffff) << 2), 21) << 12;
+		break;
+	case SHIVA_AARCH64_INSN_ADD_IMM:
+		insn->imm = ((raw >> 10) & 0xfff) << (((raw >> 22) & 0x1) ? 12 : 0);
+		break;
+	case SHIVA_AARCH64_INSN_LDR_IMM:
+	case SHIVA_AARCH64_INSN_STR_IMM:
+		/*
+		 * imm12 is scaled by the access size
+		 */
+		insn->imm = (int64_t)((raw >> 10) & 0xfff) << (raw >> 30);
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Re-encode the imm12 of an ldr/str (immediate, unsigned offset) with the
+ * byte offset off. imm12 is scaled by the access size, so off must be a
+ * multiple of it.
+ */
+static inline bool
+shiva_aarch64_ldst_set_imm(uint32_t raw, uint64_t off, uint32_t *out)
+{
+	uint32_t scale = raw >> 30;
+
+	if ((off & ((1UL << scale) - 1)) != 0 || (off >> scale) > 0xfff)
+		return false;
+	*out = (raw & ~(0xfffU << 10)) | (uint32_t)((off >> scale) << 10);
+	return true;
+}
+
+static inline bool
+shiva_aarch64_insn_is_branch(struct shiva_aarch64_insn *insn)
+{
+	return insn->type <= SHIVA_AARCH64_INSN_TB;
+}
+
+/*
+ * Builds a capstone style "mnemonic op_str" string for a decoded branch.
+ * i.e. "bl #0x10740". Other code (shiva_transform.c) relies on the
+ * "bl " prefix.
+ */
+static inline void
+shiva_aarch64_branch_string(struct shiva_aarch64_insn *insn, uint64_t pc,
+    char *buf, size_t len)
+{
+	static const char *cond_str[16] = {
+		"eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc",
+		"hi", "ls", "ge", "lt", "gt", "le", "al", "nv"
+	};
+	uint64_t target = pc + insn->imm;
+	char rc = insn->is64 ? 'x' : 'w';
+
+	switch(insn->type) {
+	case SHIVA_AARCH64_INSN_B:
+		snprintf(buf, len, "b #%#lx", target);
+		break;
+	case SHIVA_AARCH64_INSN_BL:
+		snprintf(buf, len, "bl #%#lx", target);
+		break;
+	case SHIVA_AARCH64_INSN_BCOND:
+		snprintf(buf, len, "b.%s #%#lx", cond_str[insn->cond], target);
+		break;
+	case SHIVA_AARCH64_INSN_CB:
+		if (insn->rd == 31)
+			snprintf(buf, len, "%s %czr, #%#lx",
+			    insn->is_nz ? "cbnz" : "cbz", rc, target);
+		else
+			snprintf(buf, len, "%s %c%u, #%#lx",
+			    insn->is_nz ? "cbnz" : "cbz", rc, insn->rd, target);
+		break;
+	case SHIVA_AARCH64_INSN_TB:
+		rc = insn->cond > 31 ? 'x' : 'w';
+		snprintf(buf, len, "%s %c%u, #%u, #%#lx",
+		    insn->is_nz ? "tbnz" : "tbz", rc, insn->rd, insn->cond, target);
+		break;
+	default:
+		snprintf(buf, len, "unknown");
+		break;
+	}
+	return;
+}
+
+#endif
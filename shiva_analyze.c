@@ -1,91 +1,1172 @@
 /*
  * shiva_analyze.c - Functions for performing control flow analysis, and gathering other
  */
+#include <pthread.h>
+
 #include "shiva.h"
+#include "modules/include/shiva_module.h"
+#if __aarch64__
+#include <arm_neon.h>
+#include "shiva_aarch64.h"
+#endif
 
 #define BIT_MASK(n)	((1U << n) - 1)
 #ifdef __aarch64__
 #define ARM_INSN_LEN 4
 #endif
 
+#define SHIVA_ANALYZE_MAX_THREADS	64
+/*
+ * Don't bother spawning threads for a .text smaller than this
+ */
+#define SHIVA_ANALYZE_MIN_CHUNK		(PAGE_SIZE * 16)
+
+/*
+ * SHIVA_ANALYZE_ASYNC=1 runs the scan of .text on a thread of its own
+ * (See shiva_analyze_run), so that opening and sizing up the patch
+ * module overlaps with it. Everything that reads ctx->analysis is
+ * ordered after shiva_analyze_wait().
+ */
+
+/*
+ * SHIVA_ANALYZE_LAZY=1 restricts the analysis to the sites that the
+ * patch can actually relink. The filter holds the addresses (Within the
+ * target) of every global function and object that the patch overrides,
+ * and the address range of every function that the patch transforms.
+ * This mode is not suitable for modules that use the trace API to hook
+ * arbitrary callsites at runtime, so it is off by default.
+ */
+struct shiva_analyze_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+struct shiva_analyze_filter {
+	uint64_t *addrs; /* sorted */
+	size_t addr_count;
+	struct shiva_analyze_range *ranges;
+	size_t range_count;
+};
+
+/*
+ * Address index of the target that is built once before the scan, and
+ * shared read-only by every chunk. funcs holds the address range of
+ * each function, sorted by address, in place of elf_symbol_by_range()
+ * for the function that a site is in, and plts the PLT entries sorted
+ * by address, in place of walking the PLT for every call that has no
+ * symbol. plt_names holds the same entries sorted by name, for the
+ * imports that the patches override (See shiva_analyze_filter_add).
+ */
+struct shiva_analyze_func {
+	uint64_t start;
+	uint64_t end;
+	struct elf_symbol symbol;
+};
+
+struct shiva_analyze_plt {
+	uint64_t addr;
+	const char *symname;
+};
+
+struct shiva_analyze_symindex {
+	struct shiva_analyze_func *funcs;
+	size_t func_count;
+	struct shiva_analyze_plt *plts;
+	struct shiva_analyze_plt *plt_names;
+	size_t plt_count;
+};
+
+/*
+ * A chunk of .text that is scanned by a single thread. Each chunk has
+ * it's own site and symbol arrays which are merged into ctx->analysis,
+ * in address order, once all of the chunks have been scanned. Symbol
+ * indices within a chunk are local to that chunk until the merge.
+ */
+struct shiva_analyze_chunk {
+	struct shiva_ctx *ctx;
+	struct elf_section *text;
+	uint64_t start; /* offset into .text */
+	uint64_t end;
+	bool res;
+	pthread_t tid;
+	struct shiva_analyze_filter *filter; /* NULL if we want every site */
+	struct shiva_analyze_symindex *symindex; /* NULL if there is none */
+	size_t last_func; /* index into symindex->funcs of the last hit */
+	bool prefilter; /* see shiva_analyze_prefilter() */
+	struct shiva_branch_site *branches;
+	size_t branch_count;
+	size_t branch_max;
+	struct shiva_xref_site *xrefs;
+	size_t xref_count;
+	size_t xref_max;
+	struct elf_symbol *symbols; /* symbols[0] is SHIVA_SYMBOL_NONE */
+	size_t symbol_count;
+	size_t symbol_max;
+	struct hsearch_data symcache; /* symbol name -> index + 1 */
+	uint32_t last_function; /* Sites within a function are adjacent */
+	struct shiva_arena arena; /* adopted by ctx->arena.analysis */
+};
+
+#define SHIVA_ANALYZE_ARRAY_INIT	256
+
+static void
+shiva_analyze_chunk_init(struct shiva_analyze_chunk *chunk, struct shiva_ctx *ctx,
+    struct elf_section *text, uint64_t start, uint64_t end)
+{
+	memset(chunk, 0, sizeof(*chunk));
+	chunk->ctx = ctx;
+	chunk->text = text;
+	chunk->start = start;
+	chunk->end = end;
+	chunk->res = true;
+	shiva_arena_init(&chunk->arena, "analysis chunk");
+	chunk->symbol_max = SHIVA_ANALYZE_ARRAY_INIT;
+	chunk->symbols = shiva_malloc(chunk->symbol_max * sizeof(struct elf_symbol));
+	memset(&chunk->symbols[0], 0, sizeof(struct elf_symbol));
+	chunk->symbol_count = 1;
+	(void) hcreate_r((end - start) / 16 + SHIVA_ANALYZE_ARRAY_INIT, &chunk->symcache);
+	return;
+}
+
+/*
+ * Returns the chunk local index of symbol, adding it to the chunk's
+ * symbol array if it isn't already there. Names are only duplicated
+ * (strdup_name) when they are not owned by the ELF object.
+ */
+static uint32_t
+shiva_analyze_chunk_symbol(struct shiva_analyze_chunk *chunk, struct elf_symbol *symbol,
+    bool strdup_name)
+{
+	struct elf_symbol *last = &chunk->symbols[chunk->last_function];
+	ENTRY e, *ep;
+	uint32_t index;
+
+	if (symbol->name == NULL)
+		return SHIVA_SYMBOL_NONE;
+	if (chunk->last_function != SHIVA_SYMBOL_NONE &&
+	    last->value == symbol->value && strcmp(last->name, symbol->name) == 0)
+		return chunk->last_function;
+	e.key = (char *)symbol->name;
+	e.data = NULL;
+	if (hsearch_r(e, FIND, &ep, &chunk->symcache) != 0) {
+		index = (uint32_t)((uintptr_t)ep->data - 1);
+		if (chunk->symbols[index].value == symbol->value)
+			return index;
+	}
+	if (chunk->symbol_count == chunk->symbol_max) {
+		chunk->symbol_max <<= 1;
+		chunk->symbols = shiva_realloc(chunk->symbols,
+		    chunk->symbol_max * sizeof(struct elf_symbol));
+	}
+	index = chunk->symbol_count++;
+	memcpy(&chunk->symbols[index], symbol, sizeof(*symbol));
+	if (strdup_name == true)
+		chunk->symbols[index].name = shiva_arena_strdup(&chunk->arena, symbol->name);
+	/*
+	 * If an entry by this name exists already (i.e. two static functions
+	 * with the same name) the symbol is simply not cached.
+	 */
+	e.key = (char *)chunk->symbols[index].name;
+	e.data = (void *)((uintptr_t)index + 1);
+	(void) hsearch_r(e, ENTER, &ep, &chunk->symcache);
+	return index;
+}
+
+static inline uint32_t
+shiva_analyze_chunk_function(struct shiva_analyze_chunk *chunk, struct elf_symbol *symbol)
+{
+	chunk->last_function = shiva_analyze_chunk_symbol(chunk, symbol, false);
+	return chunk->last_function;
+}
+
+static struct shiva_branch_site *
+shiva_analyze_chunk_branch(struct shiva_analyze_chunk *chunk)
+{
+	struct shiva_branch_site *branch;
+
+	if (chunk->branch_count == chunk->branch_max) {
+		chunk->branch_max = chunk->branch_max == 0 ?
+		    SHIVA_ANALYZE_ARRAY_INIT : chunk->branch_max << 1;
+		chunk->branches = shiva_realloc(chunk->branches,
+		    chunk->branch_max * sizeof(struct shiva_branch_site));
+	}
+	branch = &chunk->branches[chunk->branch_count++];
+	memset(branch, 0, sizeof(*branch));
+	return branch;
+}
+
+static struct shiva_xref_site *
+shiva_analyze_chunk_xref(struct shiva_analyze_chunk *chunk)
+{
+	struct shiva_xref_site *xref;
+
+	if (chunk->xref_count == chunk->xref_max) {
+		chunk->xref_max = chunk->xref_max == 0 ?
+		    SHIVA_ANALYZE_ARRAY_INIT : chunk->xref_max << 1;
+		chunk->xrefs = shiva_realloc(chunk->xrefs,
+		    chunk->xref_max * sizeof(struct shiva_xref_site));
+	}
+	xref = &chunk->xrefs[chunk->xref_count++];
+	memset(xref, 0, sizeof(*xref));
+	return xref;
+}
+
+static inline uint32_t
+shiva_analyze_rebase_symbol(uint32_t index, size_t base)
+{
+	return index == SHIVA_SYMBOL_NONE ? SHIVA_SYMBOL_NONE :
+	    (uint32_t)(base + index - 1);
+}
+
+/*
+ * Merge the chunks (In ascending address order) into ctx->analysis.
+ * The chunk arrays are released, and the strings allocated by each
+ * chunk move to ctx->arena.analysis.
+ */
+static void
+shiva_analyze_merge_chunks(struct shiva_ctx *ctx, struct shiva_analyze_chunk *chunks,
+    int count)
+{
+	size_t branch_count = 0, xref_count = 0, symbol_count = 1, base, j;
+	size_t site_bytes = 0;
+	struct shiva_branch_site *branch;
+	struct shiva_xref_site *xref;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		branch_count += chunks[i].branch_count;
+		xref_count += chunks[i].xref_count;
+		symbol_count += chunks[i].symbol_count - 1;
+		site_bytes += chunks[i].branch_max * sizeof(*branch) +
+		    chunks[i].xref_max * sizeof(*xref);
+	}
+	/*
+	 * The arrays of the chunks are only freed once they are copied,
+	 * so this is when the site arrays are at their largest.
+	 */
+	site_bytes += (branch_count + 1) * sizeof(*branch) +
+	    (xref_count + 1) * sizeof(*xref);
+	if (site_bytes > ctx->analysis.site_bytes)
+		ctx->analysis.site_bytes = site_bytes;
+	ctx->analysis.branches = shiva_arena_alloc(&ctx->arena.analysis,
+	    (branch_count + 1) * sizeof(*branch));
+	ctx->analysis.xrefs = shiva_arena_alloc(&ctx->arena.analysis,
+	    (xref_count + 1) * sizeof(*xref));
+	ctx->analysis.symbols = shiva_arena_alloc(&ctx->arena.analysis,
+	    symbol_count * sizeof(struct elf_symbol));
+	ctx->analysis.branch_count = 0;
+	ctx->analysis.xref_count = 0;
+	ctx->analysis.symbol_count = 1;
+
+	for (i = 0; i < count; i++) {
+		base = ctx->analysis.symbol_count;
+		memcpy(&ctx->analysis.symbols[base], &chunks[i].symbols[1],
+		    (chunks[i].symbol_count - 1) * sizeof(struct elf_symbol));
+		ctx->analysis.symbol_count += chunks[i].symbol_count - 1;
+
+		for (j = 0; j < chunks[i].branch_count; j++) {
+			branch = &ctx->analysis.branches[ctx->analysis.branch_count++];
+			memcpy(branch, &chunks[i].branches[j], sizeof(*branch));
+			branch->symbol = shiva_analyze_rebase_symbol(branch->symbol, base);
+			branch->current_function =
+			    shiva_analyze_rebase_symbol(branch->current_function, base);
+		}
+		for (j = 0; j < chunks[i].xref_count; j++) {
+			xref = &ctx->analysis.xrefs[ctx->analysis.xref_count++];
+			memcpy(xref, &chunks[i].xrefs[j], sizeof(*xref));
+			xref->symbol = shiva_analyze_rebase_symbol(xref->symbol, base);
+			xref->deref_symbol = shiva_analyze_rebase_symbol(xref->deref_symbol, base);
+			xref->current_function =
+			    shiva_analyze_rebase_symbol(xref->current_function, base);
+		}
+		free(chunks[i].branches);
+		free(chunks[i].xrefs);
+		free(chunks[i].symbols);
+		hdestroy_r(&chunks[i].symcache);
+		shiva_arena_adopt(&ctx->arena.analysis, &chunks[i].arena);
+	}
+	shiva_debug("Analysis: %zu branches, %zu xrefs, %zu symbols\n",
+	    ctx->analysis.branch_count, ctx->analysis.xref_count,
+	    ctx->analysis.symbol_count);
+	return;
+}
+
+/*
+ * Returns the index of the first branch site at or above addr within
+ * ctx->analysis.branches, or branch_count if there is none.
+ */
+size_t
+shiva_analyze_branch_index(struct shiva_ctx *ctx, uint64_t addr)
+{
+	size_t lo = 0, hi = ctx->analysis.branch_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ctx->analysis.branches[mid].branch_site < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Same as shiva_analyze_branch_index() but for ctx->analysis.xrefs
+ */
+size_t
+shiva_analyze_xref_index(struct shiva_ctx *ctx, uint64_t addr)
+{
+	size_t lo = 0, hi = ctx->analysis.xref_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ctx->analysis.xrefs[mid].adrp_site < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Returns the symbol at index within ctx->analysis.symbols. An
+ * out of range index returns the empty symbol.
+ */
+struct elf_symbol *
+shiva_analyze_symbol(struct shiva_ctx *ctx, uint32_t index)
+{
+	static struct elf_symbol none;
+
+	if (ctx->analysis.symbols == NULL || index >= ctx->analysis.symbol_count)
+		return &none;
+	return &ctx->analysis.symbols[index];
+}
+
+/*
+ * The scan of .text, and everything that only it uses. The site table of
+ * shiva_analyze_load_prelinked() is all that shiva-rt has.
+ */
+
+#ifndef SHIVA_RT
+#ifdef __aarch64__
+static int
+shiva_analyze_addr_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static bool
+shiva_analyze_patch_symbol(struct elf_symbol *symbol)
+{
+	if (symbol->bind != STB_GLOBAL)
+		return false;
+	if (symbol->type != STT_FUNC && symbol->type != STT_OBJECT)
+		return false;
+	if (symbol->shndx == SHN_UNDEF)
+		return false;
+	return true;
+}
+
+static int
+shiva_analyze_plt_name_cmp(const void *a, const void *b)
+{
+	const struct shiva_analyze_plt *x = a, *y = b;
+
+	return strcmp(x->symname, y->symname);
+}
+
+/*
+ * The PLT entry of the import name, for a patch that overrides a shared
+ * library function that the target calls through its PLT.
+ */
+static bool
+shiva_analyze_plt_by_name(struct shiva_analyze_symindex *index, const char *name,
+    uint64_t *addr)
+{
+	struct shiva_analyze_plt key, *plt;
+
+	key.symname = name;
+	plt = bsearch(&key, index->plt_names, index->plt_count, sizeof(*index->plt_names),
+	    shiva_analyze_plt_name_cmp);
+	if (plt == NULL)
+		return false;
+	*addr = plt->addr;
+	return true;
+}
+
+/*
+ * Add the symbols that the patch at path overrides to the filter.
+ */
+static bool
+shiva_analyze_filter_add(struct shiva_ctx *ctx, struct shiva_analyze_filter *filter,
+    struct shiva_analyze_symindex *index, const char *path)
+{
+	elfobj_t patch;
+	elf_error_t error;
+	elf_symtab_iterator_t sym_iter;
+	struct elf_symbol symbol, target_sym;
+	size_t count = 0;
+	const char *name;
+	uint64_t plt_addr;
+
+	if (elf_open_object(path, &patch, ELF_LOAD_F_STRICT,
+	    &error) == false) {
+		fprintf(stderr, "Warning: cannot open '%s' for lazy analysis: %s\n",
+		    path, elf_error_msg(&error));
+		return false;
+	}
+	elf_symtab_iterator_init(&patch, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
+		if (shiva_analyze_patch_symbol(&symbol) == true)
+			count++;
+	}
+	filter->addrs = shiva_realloc(filter->addrs,
+	    (filter->addr_count + 2 * count + 1) * sizeof(uint64_t));
+	filter->ranges = shiva_realloc(filter->ranges,
+	    (filter->range_count + count + 1) * sizeof(struct shiva_analyze_range));
+
+	elf_symtab_iterator_init(&patch, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
+		if (shiva_analyze_patch_symbol(&symbol) == false)
+			continue;
+		/*
+		 * __shiva_splice_fn_name_foo replaces calls to foo, and
+		 * every site within foo is needed to build the transform,
+		 * as they are to check an emit into foo.
+		 */
+		name = shiva_tf_splice_target(symbol.name);
+		if (name == NULL)
+			name = shiva_tf_emit_target(symbol.name);
+		if (name == NULL)
+			name = symbol.name;
+		/*
+		 * Calls through the PLT are relinked as well (See
+		 * queue_external_patch_links).
+		 */
+		if (name == symbol.name && symbol.type == STT_FUNC &&
+		    shiva_analyze_plt_by_name(index, name, &plt_addr) == true) {
+			filter->addrs[filter->addr_count++] = plt_addr;
+			shiva_debug("Lazy analysis of calls to %s@plt(%#lx)\n", name, plt_addr);
+		}
+		if (elf_symbol_by_name(&ctx->elfobj, name, &target_sym) == false)
+			continue;
+		filter->addrs[filter->addr_count++] = target_sym.value;
+		if (name != symbol.name) {
+			filter->ranges[filter->range_count].start = target_sym.value;
+			filter->ranges[filter->range_count].end =
+			    target_sym.value + target_sym.size;
+			filter->range_count++;
+		}
+		shiva_debug("Lazy analysis of references to %s(%#lx)\n",
+		    name, target_sym.value);
+	}
+	elf_close_object(&patch);
+	return true;
+}
+
+/*
+ * Build the filter from the symbol tables of every patch module, so
+ * that a single analysis pass serves all of them. Returns false if a
+ * patch cannot be read, in which case every site is analyzed.
+ */
+static bool
+shiva_analyze_filter_build(struct shiva_ctx *ctx, struct shiva_analyze_filter *filter,
+    struct shiva_analyze_symindex *index)
+{
+	size_t i;
+
+	memset(filter, 0, sizeof(*filter));
+	if (ctx->module.count == 0)
+		return false;
+	for (i = 0; i < ctx->module.count; i++) {
+		if (shiva_analyze_filter_add(ctx, filter, index, ctx->module.paths[i]) == false) {
+			free(filter->addrs);
+			free(filter->ranges);
+			memset(filter, 0, sizeof(*filter));
+			return false;
+		}
+	}
+	qsort(filter->addrs, filter->addr_count, sizeof(uint64_t),
+	    shiva_analyze_addr_cmp);
+	return true;
+}
+
+static void
+shiva_analyze_filter_destroy(struct shiva_analyze_filter *filter)
+{
+	free(filter->addrs);
+	free(filter->ranges);
+	return;
+}
+
+static inline bool
+shiva_analyze_filter_has_addr(struct shiva_analyze_filter *filter, uint64_t addr)
+{
+	return bsearch(&addr, filter->addrs, filter->addr_count,
+	    sizeof(uint64_t), shiva_analyze_addr_cmp) != NULL;
+}
+
+/*
+ * Should a site at 'site' that references 'target' be recorded?
+ */
+static inline bool
+shiva_analyze_filter_keep(struct shiva_analyze_filter *filter, uint64_t site,
+    uint64_t target)
+{
+	size_t i;
+
+	if (filter == NULL)
+		return true;
+	if (shiva_analyze_filter_has_addr(filter, target) == true)
+		return true;
+	for (i = 0; i < filter->range_count; i++) {
+		if (site >= filter->ranges[i].start && site < filter->ranges[i].end)
+			return true;
+	}
+	return false;
+}
+
+static int
+shiva_analyze_func_cmp(const void *a, const void *b)
+{
+	const struct shiva_analyze_func *x = a, *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	/*
+	 * Of several symbols at one address the largest one wins
+	 */
+	return (x->end < y->end) - (x->end > y->end);
+}
+
+static int
+shiva_analyze_plt_cmp(const void *a, const void *b)
+{
+	const struct shiva_analyze_plt *x = a, *y = b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static size_t
+shiva_analyze_symindex_funcs(struct shiva_ctx *ctx, struct shiva_analyze_symindex *index,
+    bool dynsym)
+{
+	elf_symtab_iterator_t sym_iter;
+	elf_dynsym_iterator_t dsym_iter;
+	struct elf_symbol symbol;
+	size_t max = SHIVA_ANALYZE_ARRAY_INIT;
+
+	index->funcs = shiva_malloc(max * sizeof(*index->funcs));
+	index->func_count = 0;
+	if (dynsym == true)
+		elf_dynsym_iterator_init(&ctx->elfobj, &dsym_iter);
+	else
+		elf_symtab_iterator_init(&ctx->elfobj, &sym_iter);
+	while ((dynsym == true ? elf_dynsym_iterator_next(&dsym_iter, &symbol) :
+	    elf_symtab_iterator_next(&sym_iter, &symbol)) == ELF_ITER_OK) {
+		if (symbol.type != STT_FUNC || symbol.size == 0 || symbol.value == 0)
+			continue;
+		if (index->func_count == max) {
+			max <<= 1;
+			index->funcs = shiva_realloc(index->funcs, max * sizeof(*index->funcs));
+		}
+		index->funcs[index->func_count].start = symbol.value;
+		index->funcs[index->func_count].end = symbol.value + symbol.size;
+		index->funcs[index->func_count].symbol = symbol;
+		index->func_count++;
+	}
+	return index->func_count;
+}
+
+static void
+shiva_analyze_symindex_build(struct shiva_ctx *ctx, struct shiva_analyze_symindex *index)
+{
+	elf_plt_iterator_t plt_iter;
+	struct elf_plt plt_entry;
+	size_t i, n, max = SHIVA_ANALYZE_ARRAY_INIT;
+
+	memset(index, 0, sizeof(*index));
+	/*
+	 * The same symbols that elf_symbol_by_range() would find, .symtab
+	 * unless the target is stripped.
+	 */
+	if (shiva_analyze_symindex_funcs(ctx, index, false) == 0) {
+		free(index->funcs);
+		(void) shiva_analyze_symindex_funcs(ctx, index, true);
+	}
+	qsort(index->funcs, index->func_count, sizeof(*index->funcs),
+	    shiva_analyze_func_cmp);
+	for (i = n = 0; i < index->func_count; i++) {
+		if (n == 0 || index->funcs[i].start != index->funcs[n - 1].start)
+			index->funcs[n++] = index->funcs[i];
+	}
+	index->func_count = n;
+
+	index->plts = shiva_malloc(max * sizeof(*index->plts));
+	elf_plt_iterator_init(&ctx->elfobj, &plt_iter);
+	while (elf_plt_iterator_next(&plt_iter, &plt_entry) == ELF_ITER_OK) {
+		if (index->plt_count == max) {
+			max <<= 1;
+			index->plts = shiva_realloc(index->plts, max * sizeof(*index->plts));
+		}
+		index->plts[index->plt_count].addr = plt_entry.addr;
+		index->plts[index->plt_count].symname = shiva_arena_strdup(&ctx->arena.analysis,
+		    plt_entry.symname);
+		index->plt_count++;
+	}
+	qsort(index->plts, index->plt_count, sizeof(*index->plts), shiva_analyze_plt_cmp);
+	index->plt_names = shiva_malloc((index->plt_count + 1) * sizeof(*index->plt_names));
+	memcpy(index->plt_names, index->plts, index->plt_count * sizeof(*index->plts));
+	qsort(index->plt_names, index->plt_count, sizeof(*index->plt_names),
+	    shiva_analyze_plt_name_cmp);
+	shiva_debug("Symbol index: %zu functions, %zu PLT entries\n",
+	    index->func_count, index->plt_count);
+	return;
+}
+
+static void
+shiva_analyze_symindex_destroy(struct shiva_analyze_symindex *index)
+{
+	free(index->funcs);
+	free(index->plts);
+	free(index->plt_names);
+	return;
+}
+
+/*
+ * The function that addr is within. Sites are scanned in ascending
+ * order, so most of the time it is the same function as last time.
+ */
+static bool
+shiva_analyze_func_by_addr(struct shiva_analyze_chunk *chunk, uint64_t addr,
+    struct elf_symbol *out)
+{
+	struct shiva_analyze_symindex *index = chunk->symindex;
+	struct shiva_analyze_func *func;
+	size_t lo, hi, mid;
+
+	if (index == NULL)
+		return elf_symbol_by_range(&chunk->ctx->elfobj, addr, out);
+	if (index->func_count == 0)
+		return false;
+	func = &index->funcs[chunk->last_func];
+	if (addr < func->start || addr >= func->end) {
+		/*
+		 * The last function that starts at or below addr
+		 */
+		lo = 0;
+		hi = index->func_count;
+		while (lo < hi) {
+			mid = lo + ((hi - lo) >> 1);
+			if (index->funcs[mid].start <= addr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == 0)
+			return false;
+		func = &index->funcs[lo - 1];
+		if (addr >= func->end)
+			return false;
+		chunk->last_func = lo - 1;
+	}
+	memcpy(out, &func->symbol, sizeof(*out));
+	return true;
+}
+
+static const char *
+shiva_analyze_plt_by_addr(struct shiva_analyze_chunk *chunk, uint64_t addr)
+{
+	struct shiva_analyze_plt key, *plt;
+	elf_plt_iterator_t plt_iter;
+	struct elf_plt plt_entry;
+	const char *symname = NULL;
+
+	if (chunk->symindex == NULL) {
+		elf_plt_iterator_init(&chunk->ctx->elfobj, &plt_iter);
+		while (elf_plt_iterator_next(&plt_iter, &plt_entry) == ELF_ITER_OK) {
+			if (plt_entry.addr == addr)
+				symname = plt_entry.symname;
+		}
+		return symname;
+	}
+	key.addr = addr;
+	plt = bsearch(&key, chunk->symindex->plts, chunk->symindex->plt_count,
+	    sizeof(key), shiva_analyze_plt_cmp);
+	return plt == NULL ? NULL : plt->symname;
+}
+#endif
+
 /*
  * Way to many args, turn this into a macro.
  */
 static inline bool
-shiva_analyze_make_xref(struct shiva_ctx *ctx, struct elf_symbol *symbol, struct elf_symbol *deref_symbol,
+shiva_analyze_make_xref(struct shiva_analyze_chunk *chunk, struct elf_symbol *symbol, struct elf_symbol *deref_symbol,
     struct elf_symbol *src_func, int xref_type, uint64_t xref_flags, uint64_t adrp_site,
     uint64_t adrp_imm, uint64_t next_imm,
-    uint32_t adrp_o_bytes, uint32_t next_o_bytes)
+    uint32_t adrp_o_bytes, uint32_t next_o_bytes, bool strdup_name)
 {
 	struct shiva_xref_site *xref;
-	uint64_t gotaddr;
 
-	xref = calloc(1, sizeof(*xref));
-	if (xref == NULL) {
-		perror("calloc");
-		return false;
-	}
 	shiva_debug("XREF (Type: %d): site: %#lx target: %s(%#lx)\n",
 	    xref_type, adrp_site, symbol->name, symbol->value);
-	if (xref_flags & SHIVA_XREF_F_INDIRECT) {
-		memcpy(&xref->deref_symbol, deref_symbol, sizeof(struct elf_symbol));
-		gotaddr = (adrp_site & ~0xfff) + adrp_imm + next_imm;
-		xref->got = (uint64_t *)gotaddr;
-	}
+	xref = shiva_analyze_chunk_xref(chunk);
+	if (xref_flags & SHIVA_XREF_F_INDIRECT)
+		xref->deref_symbol = shiva_analyze_chunk_symbol(chunk, deref_symbol, false);
 	xref->type = xref_type;
 	xref->flags = xref_flags;
 	xref->adrp_imm = adrp_imm;
 	xref->adrp_site = adrp_site;
 	xref->next_imm = next_imm;
-	xref->next_site = adrp_site + ARM_INSN_LEN;
-	xref->adrp_o_insn = adrp_o_bytes; //*(uint32_t *)&tmp_ptr[c];
-	xref->next_o_insn = next_o_bytes; //*(uint32_t *)&tmp_ptr[c + ARM_INSN_LEN];
+	xref->adrp_o_insn = adrp_o_bytes;
+	xref->next_o_insn = next_o_bytes;
 	xref->target_vaddr = (adrp_site & ~0xfff) + adrp_imm + next_imm;
 	shiva_debug("ADRP(%#lx): %x\n", adrp_site, xref->adrp_o_insn);
-	shiva_debug("NEXT(%#lx): %x\n", xref->next_site, xref->next_o_insn);
-	memcpy(&xref->symbol, symbol, sizeof(*symbol));
+	shiva_debug("NEXT(%#lx): %x\n", adrp_site + 4, xref->next_o_insn);
+	xref->symbol = shiva_analyze_chunk_symbol(chunk, symbol, strdup_name);
 	if (src_func != NULL)
-		memcpy(&xref->current_function, src_func, sizeof(*src_func));
-	TAILQ_INSERT_TAIL(&ctx->tailq.xref_tqlist, xref, _linkage);
+		xref->current_function = shiva_analyze_chunk_function(chunk, src_func);
 	return true;
 }
 
+#ifdef __aarch64__
+/*
+ * Capstone is only used to print the instructions in debug builds,
+ * the analysis itself relies on shiva_aarch64_decode().
+ */
+static inline void
+shiva_analyze_debug_insn(struct shiva_ctx *ctx, uint32_t *code, uint64_t pc_vaddr)
+{
+#if defined DEBUG
+	const uint8_t *ptr = (const uint8_t *)code;
+	size_t len = ARM_INSN_LEN;
+	uint64_t addr = pc_vaddr;
+
+	if (ctx->disas.insn == NULL)
+		return;
+	if (cs_disasm_iter(ctx->disas.handle, &ptr, &len, &addr,
+	    ctx->disas.insn) == false)
+		return;
+	shiva_debug("0x%"PRIx64":\t%s\t\t%s\n", ctx->disas.insn->address,
+	    ctx->disas.insn->mnemonic, ctx->disas.insn->op_str);
+#endif
+	return;
+}
+
 static bool
-shiva_analyze_build_aarch64_jmp(struct shiva_ctx *ctx, uint64_t pc_vaddr)
+shiva_analyze_build_aarch64_jmp(struct shiva_analyze_chunk *chunk, uint64_t pc_vaddr,
+    struct shiva_aarch64_insn *insn)
 {
+	struct shiva_ctx *ctx = chunk->ctx;
 	struct shiva_branch_site *tmp;
 	struct elf_symbol tmp_sym;
-	char *p = strchr(ctx->disas.insn->op_str, '#');
+	char insn_string[128];
 
-	if (p == NULL) {
-		fprintf(stderr,
-		    "Unforseen parsing error in shiva_analyze_build_aarch64_jmp\n");
-		return false;
-	}
-	tmp = calloc(1, sizeof(*tmp));
-	if (tmp == NULL) {
-		perror("calloc");
-		return false;
-	}
-	tmp->target_vaddr = strtoul((p + 1), NULL, 16);
+	if (shiva_analyze_filter_keep(chunk->filter, pc_vaddr,
+	    pc_vaddr + insn->imm) == false)
+		return true;
+	tmp = shiva_analyze_chunk_branch(chunk);
+	shiva_aarch64_branch_string(insn, pc_vaddr, insn_string, sizeof(insn_string));
+	tmp->target_vaddr = pc_vaddr + insn->imm;
 	tmp->branch_site = pc_vaddr;
 	tmp->branch_type = SHIVA_BRANCH_JMP;
-	tmp->insn_string = shiva_xfmtstrdup("%s %s",
-	    ctx->disas.insn->mnemonic, ctx->disas.insn->op_str);
-	if (elf_symbol_by_range(&ctx->elfobj, pc_vaddr,
-	    &tmp_sym) == true) {
+	tmp->o_insn = insn->raw;
+	tmp->insn_string = shiva_arena_strdup(&chunk->arena, insn_string);
+	if (shiva_analyze_func_by_addr(chunk, pc_vaddr, &tmp_sym) == true) {
 		tmp->branch_flags |= SHIVA_BRANCH_F_SRC_SYMINFO;
-		memcpy(&tmp->current_function, &tmp_sym, sizeof(tmp_sym));
+		tmp->current_function = shiva_analyze_chunk_function(chunk, &tmp_sym);
 		shiva_debug("Source function found: %s\n", tmp_sym.name);
 	}
 	/*
 	 * Unconditional branch at a PC-relative offset
 	 */
 	shiva_debug("Found branch: %#lx:%s\n", pc_vaddr, tmp->insn_string);
-	TAILQ_INSERT_TAIL(&ctx->tailq.branch_tqlist, tmp, _linkage);
 	return true;
 }
 
+static bool
+shiva_analyze_build_aarch64_call(struct shiva_analyze_chunk *chunk, uint64_t pc_vaddr,
+    struct shiva_aarch64_insn *insn)
+{
+	struct shiva_ctx *ctx = chunk->ctx;
+	struct shiva_branch_site *tmp;
+	struct elf_symbol symbol, tmp_sym;
+	uint64_t call_addr = pc_vaddr + insn->imm;
+	char insn_string[128], symname[256];
+	bool strdup_name = false;
+
+	if (shiva_analyze_filter_keep(chunk->filter, pc_vaddr, call_addr) == false)
+		return true;
+	memset(&symbol, 0, sizeof(symbol));
+	tmp = shiva_analyze_chunk_branch(chunk);
+	if (elf_symbol_by_value_lookup(&ctx->elfobj, call_addr,
+	    &symbol) == false) {
+		const char *plt_symname;
+
+		symbol.name = NULL;
+
+		plt_symname = shiva_analyze_plt_by_addr(chunk, call_addr);
+		if (plt_symname != NULL) {
+			snprintf(symname, sizeof(symname), "%s@plt", plt_symname);
+			symbol.name = symname;
+			symbol.type = STT_FUNC;
+			symbol.bind = STB_GLOBAL;
+			symbol.size = 0;
+			tmp->branch_flags |= SHIVA_BRANCH_F_PLTCALL;
+		}
+		if (symbol.name == NULL) {
+			snprintf(symname, sizeof(symname), "fn_%#lx", call_addr);
+			symbol.name = symname;
+			symbol.value = call_addr;
+			symbol.type = STT_FUNC;
+			symbol.bind = STB_GLOBAL;
+		}
+		/*
+		 * Only copied if this is the first call to it within the chunk
+		 */
+		strdup_name = true;
+	}
+	shiva_aarch64_branch_string(insn, pc_vaddr, insn_string, sizeof(insn_string));
+	tmp->retaddr = pc_vaddr + ARM_INSN_LEN;
+	tmp->target_vaddr = call_addr;
+	tmp->o_insn = insn->raw;
+	tmp->symbol = shiva_analyze_chunk_symbol(chunk, &symbol, strdup_name);
+	tmp->branch_type = SHIVA_BRANCH_CALL;
+	tmp->branch_site = pc_vaddr;
+	tmp->branch_flags |= SHIVA_BRANCH_F_DST_SYMINFO;
+	tmp->insn_string = shiva_arena_strdup(&chunk->arena, insn_string);
+
+	if (shiva_analyze_func_by_addr(chunk, pc_vaddr, &tmp_sym) == true) {
+		tmp->branch_flags |= SHIVA_BRANCH_F_SRC_SYMINFO;
+		tmp->current_function = shiva_analyze_chunk_function(chunk, &tmp_sym);
+		shiva_debug("Source symbol included: %s\n", tmp_sym.name);
+	}
+	shiva_debug("Inserting branch for symbol %s callsite: %#lx\n", symbol.name, tmp->branch_site);
+	return true;
+}
+
+/*
+ * We're looking for several combinations that could be
+ * used to reference/access global data.
+ * scenario: 1
+ * adrp x0, #0x1000 (data segment)
+ * ldr x0, [x0, #0x16 (variable offset)]
+ *
+ * adrp x0, #0x1000
+ * add x0, x0, #0x16
+ */
+static bool
+shiva_analyze_build_aarch64_xref(struct shiva_analyze_chunk *chunk, uint64_t adrp_site,
+    struct shiva_aarch64_insn *adrp, struct shiva_aarch64_insn *next)
+{
+	struct shiva_ctx *ctx = chunk->ctx;
+	struct elf_symbol symbol, tmp_sym, deref_symbol;
+	struct elf_symbol *src_func = NULL;
+	uint64_t target_page, target, qword;
+	uint64_t xref_flags = 0;
+	int xref_type;
+	bool res, found_symbol = false;
+	char symname[256];
+
+	switch(next->type) {
+	case SHIVA_AARCH64_INSN_LDR_IMM:
+		xref_type = SHIVA_XREF_TYPE_ADRP_LDR;
+		break;
+	case SHIVA_AARCH64_INSN_STR_IMM:
+		xref_type = SHIVA_XREF_TYPE_ADRP_STR;
+		break;
+	case SHIVA_AARCH64_INSN_ADD_IMM:
+		xref_type = SHIVA_XREF_TYPE_ADRP_ADD;
+		break;
+	default:
+		/*
+		 * We don't know this combination of instructions for
+		 * forming an XREF.
+		 */
+		return true;
+	}
+	target_page = (adrp_site & ~0xfffUL) + adrp->imm;
+	target = target_page + next->imm;
+	if (chunk->filter != NULL) {
+		/*
+		 * The xref is kept if it leads to an overridden symbol
+		 * directly, or indirectly through a .got entry.
+		 */
+		if (elf_read_address(&ctx->elfobj, target, &qword, ELF_QWORD) == false)
+			return true;
+		if (shiva_analyze_filter_keep(chunk->filter, adrp_site, target) == false &&
+		    shiva_analyze_filter_has_addr(chunk->filter, qword) == false)
+			return true;
+	}
+	shiva_debug("Looking up symbol at address %#lx in"
+	    " the target executable\n", target);
+	/*
+	 * Look up the symbol that this xref points to.
+	 */
+	memset(&deref_symbol, 0, sizeof(deref_symbol));
+	if (elf_symbol_by_value_lookup(&ctx->elfobj, target, &symbol) == true) {
+		shiva_debug("Target xref symbol '%s'\n", symbol.name);
+		found_symbol = true;
+	}
+	/*
+	 * Does target_page + imm lead to storage of the address
+	 * we are looking for? Or does it calculate directly to the
+	 * address? First let's try to read 8 bytes from the address
+	 * and see if there's an indirect absolute value we are looking
+	 * for: (i.e. a .got[entry] pointing to a .bss variable.
+	 */
+	shiva_debug("Reading from address %#lx\n", target);
+	if (elf_read_address(&ctx->elfobj, target, &qword, ELF_QWORD) == false) {
+		shiva_debug("Failed to read address %#lx\n", target);
+		return true;
+	}
+	/*
+	 * Create a symbol to represent the location represented by adrp.
+	 * We have not found one, so we create one because it will be used
+	 * to install external re-linking patches for adrp sequences.
+	 */
+	if (found_symbol == false) {
+		struct elf_section shdr;
+
+		res = elf_section_by_address(&ctx->elfobj, target, &shdr);
+		if (res == false) {
+			fprintf(stderr, "Unable to find section associated with addr: %#lx\n",
+			    target);
+			return false;
+		}
+		shiva_debug("%#lx - section.address:%#lx = %#lx\n", target, shdr.address,
+		    target - shdr.address);
+		snprintf(symname, sizeof(symname), "%s+%lx", shdr.name,
+		    target - shdr.address);
+		symbol.name = symname;
+		symbol.value = target;
+		symbol.size = sizeof(uint64_t);
+		symbol.bind = STB_GLOBAL;
+		symbol.type = STT_OBJECT;
+		symbol.visibility = STV_PROTECTED;
+		if (elf_section_index_by_name(&ctx->elfobj, shdr.name, (uint64_t *)&symbol.shndx)
+		    == false) {
+			fprintf(stderr, "Failed to find section index for %s in %s\n",
+			    shdr.name, elf_pathname(&ctx->elfobj));
+			return true;
+		}
+	}
+	/*
+	 * We must get the name of the function that the
+	 * xref code is within. This is necessary later on
+	 * if transformations happen.
+	 */
+	if (shiva_analyze_func_by_addr(chunk, adrp_site + ARM_INSN_LEN, &tmp_sym) == true) {
+		xref_flags |= SHIVA_XREF_F_SRC_SYMINFO;
+		src_func = &tmp_sym;
+		shiva_debug("Source symbol included: %s\n", tmp_sym.name);
+	}
+	shiva_debug("Looking up value %#lx found at %#lx\n", qword, target);
+	res = elf_symbol_by_value_lookup(&ctx->elfobj,
+	    qword, &deref_symbol);
+	if (res == true) {
+		xref_flags |= SHIVA_XREF_F_INDIRECT;
+		shiva_debug("XREF (Indirect via GOT) (Type: %d): Site: %#lx target: %s (Deref)-> %s(%#lx)\n",
+		    xref_type, adrp_site, symbol.name ? symbol.name : "<unknown>",
+		    deref_symbol.name, deref_symbol.value);
+	}
+	res = shiva_analyze_make_xref(chunk, &symbol, &deref_symbol, src_func, xref_type,
+	    xref_flags, adrp_site, adrp->imm, next->imm, adrp->raw, next->raw,
+	    !found_symbol);
+	if (res == false) {
+		fprintf(stderr, "shiva_analyze_make_xref failed\n");
+		return false;
+	}
+	return true;
+}
+#endif
+
+#ifdef __aarch64__
+#ifndef HWCAP_ASIMD
+#define HWCAP_ASIMD	(1 << 1)
+#endif
+
+/*
+ * Only a small fraction of the instructions in .text are ones that the
+ * scan is after. shiva_analyze_prefilter() tests 16 instructions at a
+ * time against the encoding classes of b/bl/cb/tb, b.cond, and adrp,
+ * and returns a mask with a nibble per instruction that is set for the
+ * candidates, which are then decoded as usual. The classes are a
+ * superset of the opcode table in shiva_aarch64.h:
+ *
+ * b/bl, cbz/cbnz, tbz/tbnz	(insn & 0x5c000000) == 0x14000000
+ * b.cond			(insn & 0xff000010) == 0x54000000
+ * adrp				(insn & 0x9f000000) == 0x90000000
+ */
+#define SHIVA_ANALYZE_PREFILTER_INSNS	16
+
+static inline uint32x4_t
+shiva_analyze_prefilter4(uint32x4_t v)
+{
+	uint32x4_t m;
+
+	m = vceqq_u32(vandq_u32(v, vdupq_n_u32(0x5c000000)), vdupq_n_u32(0x14000000));
+	m = vorrq_u32(m, vceqq_u32(vandq_u32(v, vdupq_n_u32(0xff000010)),
+	    vdupq_n_u32(0x54000000)));
+	m = vorrq_u32(m, vceqq_u32(vandq_u32(v, vdupq_n_u32(0x9f000000)),
+	    vdupq_n_u32(0x90000000)));
+	return m;
+}
+
+static inline uint64_t
+shiva_analyze_prefilter(const uint32_t *code)
+{
+	uint16x8_t lo, hi;
+	uint8x16_t m;
+
+	lo = vcombine_u16(vmovn_u32(shiva_analyze_prefilter4(vld1q_u32(&code[0]))),
+	    vmovn_u32(shiva_analyze_prefilter4(vld1q_u32(&code[4]))));
+	hi = vcombine_u16(vmovn_u32(shiva_analyze_prefilter4(vld1q_u32(&code[8]))),
+	    vmovn_u32(shiva_analyze_prefilter4(vld1q_u32(&code[12]))));
+	m = vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+/*
+ * Decode and record the instruction at offset *c of .text. An adrp
+ * consumes the instruction after it, in which case *c is advanced past
+ * it.
+ */
+static bool
+shiva_analyze_scan_insn(struct shiva_analyze_chunk *chunk, uint32_t *code, size_t *c)
+{
+	struct shiva_aarch64_insn insn, next;
+	struct shiva_ctx *ctx = chunk->ctx;
+	struct elf_section *text = chunk->text;
+	uint64_t pc_vaddr = text->address + *c;
+
+	if (shiva_aarch64_decode(code[*c / ARM_INSN_LEN], &insn) == false)
+		return true;
+	shiva_analyze_debug_insn(ctx, &code[*c / ARM_INSN_LEN], pc_vaddr);
+	switch(insn.type) {
+	case SHIVA_AARCH64_INSN_B:
+	case SHIVA_AARCH64_INSN_BCOND:
+	case SHIVA_AARCH64_INSN_CB:
+	case SHIVA_AARCH64_INSN_TB:
+		/*
+		 * Branch instructions:
+		 * b, b.cond (b.eq, b.ne, ...), cbz, cbnz, tbz, tbnz
+		 */
+		if (shiva_analyze_build_aarch64_jmp(chunk, pc_vaddr, &insn) == false) {
+			fprintf(stderr, "shiva_analyze_build_aarch64_jmp(%p, %#lx) failed\n",
+			    ctx, pc_vaddr);
+			return false;
+		}
+		break;
+	case SHIVA_AARCH64_INSN_BL:
+		if (shiva_analyze_build_aarch64_call(chunk, pc_vaddr, &insn) == false) {
+			fprintf(stderr, "shiva_analyze_build_aarch64_call(%p, %#lx) failed\n",
+			    ctx, pc_vaddr);
+			return false;
+		}
+		break;
+	case SHIVA_AARCH64_INSN_ADRP:
+		/*
+		 * The instruction following the adrp is consumed
+		 * as apart of the xref.
+		 */
+		if (*c + (ARM_INSN_LEN * 2) > text->size)
+			break;
+		*c += ARM_INSN_LEN;
+		shiva_aarch64_decode(code[*c / ARM_INSN_LEN], &next);
+		shiva_analyze_debug_insn(ctx, &code[*c / ARM_INSN_LEN],
+		    text->address + *c);
+		if (shiva_analyze_build_aarch64_xref(chunk, pc_vaddr, &insn, &next) == false) {
+			fprintf(stderr, "shiva_analyze_build_aarch64_xref(%p, %#lx) failed\n",
+			    ctx, pc_vaddr);
+			return false;
+		}
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+
+/*
+ * Scan a single chunk of .text. Called directly for a serial scan
+ * or from shiva_analyze_worker() when SHIVA_ANALYZE_THREADS > 1
+ */
+static bool
+shiva_analyze_scan_chunk(struct shiva_analyze_chunk *chunk)
+{
+	struct shiva_ctx *ctx = chunk->ctx;
+	struct elf_section *text = chunk->text;
+	uint32_t *code = (uint32_t *)ctx->disas.textptr;
+	const size_t block = SHIVA_ANALYZE_PREFILTER_INSNS * ARM_INSN_LEN;
+	uint64_t mask;
+	size_t c = chunk->start, next = chunk->start, off, site;
+#if defined DEBUG
+	cs_insn *insnack;
+
+	if (cs_open(CS_ARCH_ARM64, CS_MODE_LITTLE_ENDIAN,
+	    &ctx->disas.handle) != CS_ERR_OK) {
+		fprintf(stderr, "cs_open failed\n");
+		chunk->res = false;
+		return false;
+	}
+	insnack = cs_malloc(ctx->disas.handle);
+	ctx->disas.insn = insnack;
+#endif
+
+	shiva_debug("disassembling text(%#lx), %#lx-%#lx\n", text->address,
+	    chunk->start, chunk->end);
+	/*
+	 * next is the first instruction that hasn't been looked at yet,
+	 * which is past the end of a block when an adrp at the end of it
+	 * consumed the first instruction of the next one.
+	 */
+	while (chunk->prefilter == true && c + block <= chunk->end) {
+		off = c;
+		mask = shiva_analyze_prefilter(&code[off / ARM_INSN_LEN]);
+		while (mask != 0) {
+			site = off + (__builtin_ctzll(mask) >> 2) * ARM_INSN_LEN;
+			mask &= ~(0xfULL << (__builtin_ctzll(mask) & ~3));
+			if (site < next)
+				continue;
+			if (shiva_analyze_scan_insn(chunk, code, &site) == false)
+				goto fail;
+			next = site + ARM_INSN_LEN;
+		}
+		c = next > off + block ? next : off + block;
+	}
+	for (; c + ARM_INSN_LEN <= chunk->end; c += ARM_INSN_LEN) {
+		if (shiva_analyze_scan_insn(chunk, code, &c) == false)
+			goto fail;
+	}
+#if defined DEBUG
+	cs_free(insnack, 1);
+	cs_close(&ctx->disas.handle);
+	ctx->disas.insn = NULL;
+#endif
+	return (chunk->res = true);
+fail:
+#if defined DEBUG
+	cs_free(insnack, 1);
+	cs_close(&ctx->disas.handle);
+	ctx->disas.insn = NULL;
+#endif
+	return (chunk->res = false);
+}
+
+static void *
+shiva_analyze_worker(void *arg)
+{
+	struct shiva_analyze_chunk *chunk = arg;
+
+	(void) shiva_analyze_scan_chunk(chunk);
+	return NULL;
+}
+#endif
+
 bool
 shiva_analyze_find_calls(struct shiva_ctx *ctx)
 {
@@ -103,6 +1184,9 @@ shiva_analyze_find_calls(struct shiva_ctx *ctx)
 	
 	}
 #ifdef __x86_64__
+	struct shiva_analyze_chunk chunk;
+
+	shiva_analyze_chunk_init(&chunk, ctx, &section, 0, section.size);
 	bits = elf_class(&ctx->elfobj) == elfclass64 ? 64 : 32;
 	ud_init(&ctx->disas.ud_obj);
 	ud_set_input_buffer(&ctx->disas.ud_obj, ctx->disas.textptr, section.size);
@@ -127,15 +1211,10 @@ shiva_analyze_find_calls(struct shiva_ctx *ctx)
 			current_address += insn_len;
 			continue;
 		}
-		tmp = calloc(1, sizeof(*tmp));
-		if (tmp == NULL) {
-			perror("calloc");
-			return false;
-		}
-		call_offset = *(uint32_t *)&ptr[1];
+		tmp = shiva_analyze_chunk_branch(&chunk);
+		call_offset = *(int32_t *)&ptr[1];
 		call_site = current_address;
 		call_addr = call_site + call_offset + 5;
-		call_addr &= 0xffffffff;
 		retaddr = call_site + insn_len;
 
 		if (elf_symbol_by_value_lookup(&ctx->elfobj, call_addr,
@@ -151,7 +1230,8 @@ shiva_analyze_find_calls(struct shiva_ctx *ctx)
 			elf_plt_iterator_init(&ctx->elfobj, &plt_iter);
 			while (elf_plt_iterator_next(&plt_iter, &plt_entry) == ELF_ITER_OK) {
 				if (plt_entry.addr == call_addr) {
-					symbol.name = shiva_xfmtstrdup("%s@plt", plt_entry.symname);
+					symbol.name = shiva_arena_xfmtstrdup(&chunk.arena,
+					    "%s@plt", plt_entry.symname);
 					symbol.type = STT_FUNC;
 					symbol.bind = STB_GLOBAL;
 					symbol.size = 0;
@@ -159,7 +1239,8 @@ shiva_analyze_find_calls(struct shiva_ctx *ctx)
 				}
 			}
 			if (symbol.name == NULL) {
-				symbol.name = shiva_xfmtstrdup("fn_%#lx", call_addr);
+				symbol.name = shiva_arena_xfmtstrdup(&chunk.arena,
+				    "fn_%#lx", call_addr);
 				if (symbol.name == NULL) {
 					perror("strdup");
 					return false;
@@ -172,341 +1253,442 @@ shiva_analyze_find_calls(struct shiva_ctx *ctx)
 		}
 		tmp->retaddr = retaddr;
 		tmp->target_vaddr = call_addr;
-		memcpy(&tmp->symbol, &symbol, sizeof(symbol));
+		tmp->symbol = shiva_analyze_chunk_symbol(&chunk, &symbol, false);
 		tmp->branch_type = SHIVA_BRANCH_CALL;
 		tmp->branch_site = call_site;
-		TAILQ_INSERT_TAIL(&ctx->tailq.branch_tqlist, tmp, _linkage);
 		current_address += insn_len;
 	}
+	shiva_analyze_merge_chunks(ctx, &chunk, 1);
 #elif __aarch64__
-	struct shiva_branch_site *tmp;
-	int xref_type;
-	size_t c, i, j;
-	size_t code_len = section.size - 1;
-	uint64_t code_vaddr = section.address; /* Points to .text */
-	uint8_t *code_ptr = ctx->disas.textptr;
-	uint8_t *tmp_ptr = code_ptr;
-	elf_symtab_iterator_t symtab_iter;
-	cs_detail insnack_detail = {{0}};
-	cs_insn insnack = {0};
-	ctx->disas.insn = &insnack;
-	if (cs_open(CS_ARCH_ARM64, CS_MODE_LITTLE_ENDIAN,
-	    &ctx->disas.handle) != CS_ERR_OK) {
-		fprintf(stderr, "cs_open failed\n");
+	struct shiva_analyze_chunk *chunks;
+	struct shiva_analyze_filter filter, *filterp = NULL;
+	struct shiva_analyze_symindex symindex;
+	struct elf_symbol warm_sym;
+	uint64_t start, end, chunk_size;
+	uint32_t *code = (uint32_t *)ctx->disas.textptr;
+	uint64_t hwcap;
+	char *env;
+	long nthreads = 1;
+	int i, n;
+	bool ret = true, prefilter;
+
+	env = getenv("SHIVA_ANALYZE_THREADS");
+	if (env != NULL) {
+		nthreads = strtol(env, NULL, 10);
+		if (nthreads < 1)
+			nthreads = 1;
+		if (nthreads > SHIVA_ANALYZE_MAX_THREADS)
+			nthreads = SHIVA_ANALYZE_MAX_THREADS;
+	}
+#if defined DEBUG
+	/*
+	 * The capstone handle used for debug output is not
+	 * shared between threads.
+	 */
+	nthreads = 1;
+#endif
+	while (nthreads > 1 && section.size / nthreads < SHIVA_ANALYZE_MIN_CHUNK)
+		nthreads--;
+	/*
+	 * From within a running target (See shiva_live.c) every site is
+	 * needed, and the scan stays on the calling thread.
+	 */
+	if (ctx->flags & SHIVA_OPTS_F_LIVE_ANALYSIS)
+		nthreads = 1;
+
+	shiva_analyze_symindex_build(ctx, &symindex);
+	env = getenv("SHIVA_ANALYZE_LAZY");
+	if (env != NULL && strcmp(env, "1") == 0 &&
+	    (ctx->flags & SHIVA_OPTS_F_LIVE_ANALYSIS) == 0) {
+		if (shiva_analyze_filter_build(ctx, &filter, &symindex) == true)
+			filterp = &filter;
+	}
+
+	/*
+	 * The NEON prefilter is used whenever the CPU has Advanced SIMD,
+	 * SHIVA_ANALYZE_PREFILTER=0 falls back to decoding every instruction.
+	 * Debug builds print every instruction, so they decode all of them.
+	 */
+	env = getenv("SHIVA_ANALYZE_PREFILTER");
+	prefilter = (env == NULL || strcmp(env, "0") != 0) &&
+	    shiva_auxv_hwcap(ctx, &hwcap, NULL) == true && (hwcap & HWCAP_ASIMD) != 0;
+#if defined DEBUG
+	prefilter = false;
+#endif
+	shiva_debug("NEON .text prefilter: %s\n", prefilter ? "on" : "off");
+
+	chunks = calloc(nthreads, sizeof(*chunks));
+	if (chunks == NULL) {
+		perror("calloc");
+		shiva_analyze_symindex_destroy(&symindex);
+		if (filterp != NULL)
+			shiva_analyze_filter_destroy(filterp);
 		return false;
 	}
+	/*
+	 * Split .text into nthreads chunks on 4 byte boundaries. An
+	 * adrp consumes the instruction after it, so a chunk may not
+	 * begin right after an adrp. Otherwise a chunk boundary is
+	 * transparent and the results are identical to a serial scan.
+	 */
+	chunk_size = (section.size / nthreads) & ~(uint64_t)(ARM_INSN_LEN - 1);
+	for (start = 0, n = 0; n < nthreads; n++, start = end) {
+		end = (n == nthreads - 1) ? section.size : start + chunk_size;
+		while (end < section.size) {
+			struct shiva_aarch64_insn insn;
 
-	shiva_debug("disassembling text(%#lx), %d bytes\n", section.address, section.size);
-	for (c = 0 ;; c += ARM_INSN_LEN) {
-		bool res;
+			if (shiva_aarch64_decode(code[end / ARM_INSN_LEN - 1], &insn) == false ||
+			    insn.type != SHIVA_AARCH64_INSN_ADRP)
+				break;
+			end += ARM_INSN_LEN;
+		}
+		if (end > section.size)
+			end = section.size;
+		shiva_analyze_chunk_init(&chunks[n], ctx, &section, start, end);
+		chunks[n].filter = filterp;
+		chunks[n].symindex = &symindex;
+		chunks[n].prefilter = prefilter;
+	}
 
-		shiva_debug("Address: %#lx\n", section.address + c);
-		shiva_debug("(uint32_t)textptr: %#x\n", *(uint32_t *)code_ptr);
-		if (c >= section.size)
-			break;
-		shiva_debug("code_ptr: %p\n", code_ptr);
-		res = cs_disasm_iter(ctx->disas.handle, (void *)&code_ptr, &code_len,
-		    &code_vaddr, ctx->disas.insn);
-		if (res == false) {
-			shiva_debug("code_ptr after fail: %p\n", code_ptr);
-			shiva_debug("code_vaddr after fail: %lx\n", code_vaddr);
-			code_vaddr += ARM_INSN_LEN;
-			code_ptr += ARM_INSN_LEN;
-			continue;
+	if (nthreads == 1) {
+		ret = shiva_analyze_scan_chunk(&chunks[0]);
+	} else {
+		shiva_debug("Analyzing .text with %ld threads\n", nthreads);
+		/*
+		 * The symbol lookups done by each thread are read-only,
+		 * but we perform one of each here first so that any lazily
+		 * built state in libelfmaster is created before the threads
+		 * start.
+		 */
+		(void) elf_symbol_by_range(&ctx->elfobj, section.address, &warm_sym);
+		(void) elf_symbol_by_value_lookup(&ctx->elfobj, section.address, &warm_sym);
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&chunks[i].tid, NULL,
+			    shiva_analyze_worker, &chunks[i]) != 0) {
+				/*
+				 * Fallback to scanning in this thread.
+				 */
+				chunks[i].tid = 0;
+				shiva_analyze_scan_chunk(&chunks[i]);
+			}
 		}
-#if 0
-		for (;;) {
-			if (*(uint32_t *)code_ptr[c + 4] != 0)
-				break;
-			code_vaddr += ARM_INSN_LEN;
-			c += ARM_INSN_LEN;
+		for (i = 0; i < nthreads; i++) {
+			if (chunks[i].tid != 0)
+				pthread_join(chunks[i].tid, NULL);
+			if (chunks[i].res == false)
+				ret = false;
 		}
+	}
+	/*
+	 * Chunks are in ascending address order, and each chunk
+	 * was scanned in ascending order.
+	 */
+	shiva_analyze_merge_chunks(ctx, chunks, nthreads);
+	ctx->analysis.lazy = filterp != NULL;
+	SHIVA_STATS_ADD(ctx, SHIVA_STATS_INSNS, section.size / ARM_INSN_LEN);
+	free(chunks);
+	shiva_analyze_symindex_destroy(&symindex);
+	if (filterp != NULL)
+		shiva_analyze_filter_destroy(filterp);
+	return ret;
 #endif
-		shiva_debug("0x%"PRIx64":\t%s\t\t%s\n", ctx->disas.insn->address,
-		    ctx->disas.insn->mnemonic, ctx->disas.insn->op_str);
-		if (strcmp(ctx->disas.insn->mnemonic, "b") == 0) {
-			if (shiva_analyze_build_aarch64_jmp(ctx, section.address + c)
-			    == false) {
-				fprintf(stderr, "shiva_analyze_build_aarch64_jmp(%p, %#lx) failed\n",
-				    ctx, section.address + c);
-				return false;
-			}
+	return true;
+}
+#endif /* SHIVA_RT */
+
+static inline void
+shiva_analyze_unpack_sym(struct elf_symbol *dst, struct shiva_prelink_sym *src,
+    const char *strtab)
+{
+	dst->name = src->name == 0 ? NULL : &strtab[src->name];
+	dst->value = src->value;
+	dst->size = src->size;
+	dst->shndx = src->shndx;
+	dst->bind = src->bind;
+	dst->type = src->type;
+	dst->visibility = src->visibility;
+	return;
+}
+
+static bool
+shiva_analyze_validate_sym(struct shiva_prelink_sym *sym, uint64_t strtab_size)
+{
+	return sym->name < strtab_size;
+}
+
+/*
+ * shiva-ld stores a prelinked table of every branch and xref site within
+ * the new PT_LOAD segment it creates (See shiva_prelink.h). If the table
+ * exists and was generated from this exact .text then we build
+ * ctx->analysis directly from it. The table is read in
+ * place from the mapping that libelfmaster already holds of the target,
+ * and symbol names point directly into its string table.
+ *
+ * Returns false if the table is missing or stale, in which case
+ * the caller falls back to live disassembly.
+ */
+static bool
+shiva_analyze_load_prelinked(struct shiva_ctx *ctx)
+{
+	struct shiva_prelink_table_hdr *hdr, key;
+	struct shiva_analyze_chunk chunk;
+	struct shiva_prelink_branch *pb;
+	struct shiva_prelink_xref *px;
+	elf_dynamic_iterator_t dyn_iter;
+	elf_dynamic_entry_t dyn_entry;
+	uint64_t table_vaddr = 0, i;
+	const char *strtab;
+	uint8_t *table;
+
+	if (shiva_target_has_prelinking(ctx) == false)
+		return false;
+
+	elf_dynamic_iterator_init(&ctx->elfobj, &dyn_iter);
+	while (elf_dynamic_iterator_next(&dyn_iter, &dyn_entry) == ELF_ITER_OK) {
+		if (dyn_entry.tag == SHIVA_DT_XREF_TABLE) {
+			table_vaddr = dyn_entry.value;
+			break;
 		}
-		if (strncmp(ctx->disas.insn->mnemonic, "b.", 2) == 0) {
-			/*
-			 * Branch instructions:
-			 * b.eq, b.ne, b.gt, b.ge, b.lt, b.le, b.ls, b.hi,
-			 * b.cc, b.cs, b.cond
-			 */
-			if (shiva_analyze_build_aarch64_jmp(ctx, section.address + c)
-			    == false) {
-				fprintf(stderr, "shiva_analyze_build_aarch64_jmp(%p, %#lx) failed\n",
-				    ctx, section.address + c);
-				return false;
-			}
-		} else if (strncmp(ctx->disas.insn->mnemonic, "cb", 2) == 0) {
-			/*
-			 * Compare and branch
-			 * cbnz, cbz
-			 */
-			if (shiva_analyze_build_aarch64_jmp(ctx, section.address + c)
-			    == false) {
-				fprintf(stderr, "shiva_analyze_build_aarch64_jmp(%p, %#lx) failed\n",
-				    ctx, section.address + c);
-				return false;
-			}
+	}
+	if (table_vaddr == 0) {
+		shiva_debug("No SHIVA_DT_XREF_TABLE found in %s\n",
+		    elf_pathname(&ctx->elfobj));
+		return false;
+	}
+	hdr = elf_address_pointer(&ctx->elfobj, table_vaddr);
+	if (hdr == NULL) {
+		shiva_debug("elf_address_pointer(%p, %#lx) failed\n",
+		    &ctx->elfobj, table_vaddr);
+		return false;
+	}
+	if (hdr->magic != SHIVA_PRELINK_TABLE_MAGIC ||
+	    hdr->version != SHIVA_PRELINK_TABLE_VERSION) {
+		fprintf(stderr, "Invalid prelinked xref table at %#lx\n", table_vaddr);
+		return false;
+	}
+	/*
+	 * Bounds check the entire table against the file mapping. The
+	 * header fields come from the file, so each check is written such
+	 * that it can't wrap around.
+	 */
+	if (hdr->table_size < sizeof(*hdr) ||
+	    hdr->table_size - 1 > UINT64_MAX - table_vaddr ||
+	    elf_address_pointer(&ctx->elfobj, table_vaddr + hdr->table_size - 1) == NULL ||
+	    hdr->branch_offset > hdr->table_size ||
+	    hdr->branch_count > (hdr->table_size - hdr->branch_offset) / sizeof(*pb) ||
+	    hdr->xref_offset > hdr->table_size ||
+	    hdr->xref_count > (hdr->table_size - hdr->xref_offset) / sizeof(*px) ||
+	    hdr->strtab_size == 0 ||
+	    hdr->strtab_offset > hdr->table_size ||
+	    hdr->strtab_size > hdr->table_size - hdr->strtab_offset) {
+		fprintf(stderr, "Prelinked xref table at %#lx is truncated\n", table_vaddr);
+		return false;
+	}
+	table = (uint8_t *)hdr;
+	strtab = (const char *)&table[hdr->strtab_offset];
+	if (strtab[hdr->strtab_size - 1] != '\0') {
+		fprintf(stderr, "Prelinked xref table has an unterminated strtab\n");
+		return false;
+	}
+	/*
+	 * Make sure that the table isn't stale, i.e. the executable was
+	 * modified after shiva-ld was run.
+	 */
+	memset(&key, 0, sizeof(key));
+	if (shiva_prelink_target_key(&ctx->elfobj, &key) == false) {
+		fprintf(stderr, "shiva_prelink_target_key() failed\n");
+		return false;
+	}
+	if (key.key_type != hdr->key_type || key.key_len != hdr->key_len ||
+	    key.text_vaddr != hdr->text_vaddr || key.text_size != hdr->text_size ||
+	    memcmp(key.key, hdr->key, key.key_len) != 0) {
+		fprintf(stderr, "Warning: prelinked xref table is stale, falling back"
+		    " to runtime analysis of '%s'\n", elf_pathname(&ctx->elfobj));
+		return false;
+	}
+	pb = (struct shiva_prelink_branch *)&table[hdr->branch_offset];
+	for (i = 0; i < hdr->branch_count; i++) {
+		if (pb[i].insn_string >= hdr->strtab_size ||
+		    shiva_analyze_validate_sym(&pb[i].symbol, hdr->strtab_size) == false ||
+		    shiva_analyze_validate_sym(&pb[i].current_function, hdr->strtab_size) == false) {
+			fprintf(stderr, "Invalid string offset in prelinked branch %lu\n", i);
+			return false;
+		}
+	}
+	px = (struct shiva_prelink_xref *)&table[hdr->xref_offset];
+	for (i = 0; i < hdr->xref_count; i++) {
+		if (shiva_analyze_validate_sym(&px[i].symbol, hdr->strtab_size) == false ||
+		    shiva_analyze_validate_sym(&px[i].deref_symbol, hdr->strtab_size) == false ||
+		    shiva_analyze_validate_sym(&px[i].current_function, hdr->strtab_size) == false) {
+			fprintf(stderr, "Invalid string offset in prelinked xref %lu\n", i);
+			return false;
+		}
+	}
 
-		} else if (strncmp(ctx->disas.insn->mnemonic, "tb", 2) == 0) {
-			/*
-			 * Test bit and branch
-			 * tbz, tbnz
-			 */
-			if (shiva_analyze_build_aarch64_jmp(ctx, section.address + c)
-			    == false) {
-				fprintf(stderr, "shiva_analyze_build_aarch64_jmp(%p, %#lx) failed\n",
-				    ctx, section.address + c);
-				return false;
-			}
+	shiva_debug("Loading %lu branches and %lu xrefs from prelinked table\n",
+	    hdr->branch_count, hdr->xref_count);
 
-		} else if (strcmp(ctx->disas.insn->mnemonic, "bl") == 0) {
-			struct shiva_branch_site *tmp;
-			uint64_t addr;
-			struct elf_symbol tmp_sym;
-			char *p = strchr(ctx->disas.insn->op_str, '#');
+	/*
+	 * Names point into the tables strtab, so identical symbols
+	 * share a name pointer and are stored once.
+	 */
+	shiva_analyze_chunk_init(&chunk, ctx, NULL, 0, hdr->text_size);
+	for (i = 0; i < hdr->branch_count; i++) {
+		struct shiva_branch_site *tmp;
+		struct elf_symbol sym;
 
-			if (p == NULL) {
-				continue;
-				fprintf(stderr, "unexpected error parsing: '%s %s'\n",
-				    ctx->disas.insn->mnemonic, ctx->disas.insn->op_str);
-				return false;
-			}
-			call_site = section.address + c;
-			call_addr = strtoul((p + 1), NULL, 16);
-			retaddr = call_site + ARM_INSN_LEN;
-			memset(&symbol, 0, sizeof(symbol));
-			tmp = calloc(1, sizeof(*tmp));
-			if (tmp == NULL) {
-				perror("calloc");
-				return false;
-			}
+		tmp = shiva_analyze_chunk_branch(&chunk);
+#ifdef __aarch64__
+		tmp->o_insn = pb[i].o_insn;
+#endif
+		tmp->branch_type = pb[i].branch_type;
+		tmp->branch_flags = pb[i].branch_flags;
+		tmp->branch_site = pb[i].branch_site;
+		tmp->target_vaddr = pb[i].target_vaddr;
+		tmp->retaddr = pb[i].retaddr;
+		tmp->insn_string = (char *)&strtab[pb[i].insn_string];
+		shiva_analyze_unpack_sym(&sym, &pb[i].symbol, strtab);
+		tmp->symbol = shiva_analyze_chunk_symbol(&chunk, &sym, false);
+		shiva_analyze_unpack_sym(&sym, &pb[i].current_function, strtab);
+		tmp->current_function = shiva_analyze_chunk_function(&chunk, &sym);
+	}
+	for (i = 0; i < hdr->xref_count; i++) {
+		struct shiva_xref_site *xref;
+		struct elf_symbol sym;
 
-			if (elf_symbol_by_value_lookup(&ctx->elfobj, call_addr,
-			    &symbol) == false) {
-				struct elf_plt plt_entry;
-				elf_plt_iterator_t plt_iter;
-
-				symbol.name = NULL;
-
-				elf_plt_iterator_init(&ctx->elfobj, &plt_iter);
-				while (elf_plt_iterator_next(&plt_iter, &plt_entry) == ELF_ITER_OK) {
-					if (plt_entry.addr == call_addr) {
-						symbol.name = shiva_xfmtstrdup("%s@plt", plt_entry.symname);
-						symbol.type = STT_FUNC;
-						symbol.bind = STB_GLOBAL;
-						symbol.size = 0;
-						tmp->branch_flags |= SHIVA_BRANCH_F_PLTCALL;
-					}
-				}
-				if (symbol.name == NULL) {
-					symbol.name = shiva_xfmtstrdup("fn_%#lx", call_addr);
-					if (symbol.name == NULL) {
-						perror("strdup");
-						return false;
-					}
-					symbol.value = call_addr;
-					symbol.type = STT_FUNC;
-					symbol.size = symbol.size;
-					symbol.bind = STB_GLOBAL;
-				}
-			}
-			tmp->retaddr = retaddr;
-			tmp->target_vaddr = call_addr;
-			memcpy(&tmp->o_insn, tmp_ptr + c, ARM_INSN_LEN);
-			memcpy(&tmp->symbol, &symbol, sizeof(symbol));
-			tmp->branch_type = SHIVA_BRANCH_CALL;
-			tmp->branch_site = call_site;
-			tmp->branch_flags |= SHIVA_BRANCH_F_DST_SYMINFO;
-			tmp->insn_string = shiva_xfmtstrdup("%s %s",
-			    ctx->disas.insn->mnemonic, ctx->disas.insn->op_str);
-
-			if (elf_symbol_by_range(&ctx->elfobj, code_vaddr - 4,
-			    &tmp_sym) == true) {
-				tmp->branch_flags |= SHIVA_BRANCH_F_SRC_SYMINFO;
-				memcpy(&tmp->current_function, &tmp_sym, sizeof(tmp_sym));
-				shiva_debug("Source symbol included: %s\n", tmp_sym.name);
-			}
-			shiva_debug("Inserting branch for symbol %s callsite: %#lx\n", tmp->symbol.name, tmp->branch_site);
-			TAILQ_INSERT_TAIL(&ctx->tailq.branch_tqlist, tmp, _linkage);
-			shiva_debug("Done inserting it\n");
-		} else if (strcmp(ctx->disas.insn->mnemonic, "adrp") == 0) {
-			uint64_t adrp_imm, adrp_site;
-			uint32_t adrp_o_bytes = *(uint32_t *)ctx->disas.insn->bytes;
-			uint32_t next_o_bytes;
+		xref = shiva_analyze_chunk_xref(&chunk);
+		xref->type = px[i].type;
+		xref->flags = px[i].flags;
+		xref->adrp_site = px[i].adrp_site;
+		xref->adrp_imm = px[i].adrp_imm;
+		xref->adrp_o_insn = px[i].adrp_o_insn;
+		xref->next_imm = px[i].next_imm;
+		xref->next_o_insn = px[i].next_o_insn;
+		xref->target_vaddr = px[i].target_vaddr;
+		shiva_analyze_unpack_sym(&sym, &px[i].symbol, strtab);
+		xref->symbol = shiva_analyze_chunk_symbol(&chunk, &sym, false);
+		shiva_analyze_unpack_sym(&sym, &px[i].deref_symbol, strtab);
+		xref->deref_symbol = shiva_analyze_chunk_symbol(&chunk, &sym, false);
+		shiva_analyze_unpack_sym(&sym, &px[i].current_function, strtab);
+		xref->current_function = shiva_analyze_chunk_function(&chunk, &sym);
+	}
+	shiva_analyze_merge_chunks(ctx, &chunk, 1);
+	return true;
+}
 
-			/*
-			 * We're looking for several combinations that could be
-			 * used to reference/access global data.
-			 * scenario: 1
-			 * adrp x0, #0x1000 (data segment)
-			 * ldr x0, [x0, #0x16 (variable offset)]
-			 * 
-			 * adrp x0, #0x1000
-			 * add x0, x0, #0x16
-			 */
-			struct shiva_xref_site *xref;
-			struct elf_symbol symbol;
-			uint64_t xref_site, xref_addr, target_page;
-			char *p = strchr(ctx->disas.insn->op_str, '#');
+/*
+ * Once the target is mapped (By the kernel in interp mode, or by
+ * shiva_ulexec.c), scan its .text where it is mapped rather than
+ * through the mapping of the file that libelfmaster holds. The target
+ * faults those pages in anyway, so the scan doesn't populate a second
+ * copy of the page tables for it. Text with relocations differs from
+ * the file, as does the text of a target that is already patched (See
+ * shiva_live.c), so both are scanned from the file.
+ */
+#ifndef SHIVA_RT
+static void
+shiva_analyze_text_source(struct shiva_ctx *ctx)
+{
+	struct elf_section section, rela;
+	uint8_t *textptr;
 
-			if (p == NULL) {
-				continue;
-				fprintf(stderr, "unexpected error parsing: '%s %s'\n",
-				    ctx->disas.insn->mnemonic, ctx->disas.insn->op_str);
-				return false;
-			}
-			adrp_site = section.address + c;
-			adrp_imm = strtoul((p + 1), NULL, 16);
-			target_page = (adrp_site & ~0xfff) + adrp_imm;
-			res = cs_disasm_iter(ctx->disas.handle, (void *)&code_ptr, &code_len,
-			    &code_vaddr, ctx->disas.insn);
-			if (res == false) {
-				fprintf(stderr, "cs_disasm_iter() failed\n");
-				return false;
-			}
-			next_o_bytes = *(uint32_t *)ctx->disas.insn->bytes;
-			c += ARM_INSN_LEN;
-			xref = calloc(1, sizeof(*xref));
-			if (xref == NULL) {
-				perror("calloc");
-				return false;
-			}
-			/*
-			 * Is the next instruction and ldr?
-			 */
-			if (strcmp(ctx->disas.insn->mnemonic, "ldr") == 0) {
-				xref_type = SHIVA_XREF_TYPE_ADRP_LDR;
-			} else if (strcmp(ctx->disas.insn->mnemonic, "str") == 0) {
-				xref_type = SHIVA_XREF_TYPE_ADRP_STR;
-			} else if (strcmp(ctx->disas.insn->mnemonic, "add") == 0) {
-				xref_type = SHIVA_XREF_TYPE_ADRP_ADD;
-			} else {
-				xref_type = SHIVA_XREF_TYPE_UNKNOWN;
-			}
+	if (elf_section_by_name(&ctx->elfobj, ".text", &section) == false)
+		return;
+	if (ctx->ulexec.base_vaddr == 0 ||
+	    (ctx->flags & SHIVA_OPTS_F_LIVE_ANALYSIS) ||
+	    elf_section_by_name(&ctx->elfobj, ".rela.text", &rela) == true) {
+		textptr = elf_address_pointer(&ctx->elfobj, section.address);
+		if (textptr != NULL)
+			ctx->disas.textptr = textptr;
+		return;
+	}
+	ctx->disas.textptr = (uint8_t *)(ctx->ulexec.base_vaddr + section.address);
+	shiva_debug("Analyzing .text of the target image at %p\n", ctx->disas.textptr);
+	return;
+}
+#endif
 
-			if (xref_type == SHIVA_XREF_TYPE_UNKNOWN) {
-				/*
-				 * We don't know this combination of instructions for
-				 * forming an XREF.
-				 */
-				continue;
-			}
-			uint32_t tmp_imm;
-			uint64_t qword;
-			uint64_t xref_flags = 0;
-			bool found_symbol = false;
+static void
+shiva_analyze_finish(struct shiva_ctx *ctx, shiva_stats_mark_t t0)
+{
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_ANALYZE, t0);
+	SHIVA_STATS_ADD(ctx, SHIVA_STATS_BRANCH_SITES, ctx->analysis.branch_count);
+	SHIVA_STATS_ADD(ctx, SHIVA_STATS_XREF_SITES, ctx->analysis.xref_count);
+	SHIVA_STATS_ADD(ctx, SHIVA_STATS_SITE_BYTES, ctx->analysis.site_bytes);
+	return;
+}
 
-			p = strchr(ctx->disas.insn->op_str, '#');
-			if (p == NULL) {
-				continue;
-				fprintf(stderr, "unexpected error parsing: '%s %s'\n",
-				    ctx->disas.insn->mnemonic, ctx->disas.insn->op_str);
-				return false;
-			}
-			tmp_imm = strtoul((p + 1), NULL, 16);
-			shiva_debug("Looking up symbol at address %#lx in"
-			    " the target executable\n", target_page + tmp_imm);
-			/*
-			 * Look up the symbol that this xref points to.
-			 */
-			if (elf_symbol_by_value_lookup(&ctx->elfobj, target_page + tmp_imm,
-			    &symbol) == true) {
-				shiva_debug("Target xref symbol '%s'\n", symbol.name);
-				found_symbol = true;
-			}
-			/*
-			 * Does target_page + tmp_imm lead to storage of the address
-			 * we are looking for? Or does it calculate directly to the
-			 * address? First let's try to read 8 bytes from the address
-			 * and see if there's an indirect absolute value we are looking
-			 * for: (i.e. a .got[entry] pointing to a .bss variable.
-			 */
-			shiva_debug("Reading from address %#lx\n", target_page + tmp_imm);
-			if (elf_read_address(&ctx->elfobj, target_page + tmp_imm,
-			    &qword, ELF_QWORD) == false) {
-				shiva_debug("Failed to read address %#lx\n", target_page + tmp_imm);
-				continue;
-			}
-			/*
-			 * Create a symbol to represent the location represented by adrp.
-			 * We have not found one, so we create one because it will be used
-			 * to install external re-linking patches for adrp sequences.
-			 */
-			if (found_symbol == false) {
-				struct elf_section shdr;
-
-				res = elf_section_by_address(&ctx->elfobj, target_page + tmp_imm,
-				    &shdr);
-				if (res == false) {
-					fprintf(stderr, "Unable to find section associated with addr: %#lx\n",
-					    target_page + tmp_imm);
-					return false;
-				}
-				shiva_debug("%#lx - section.address:%#lx = %#lx\n", target_page + tmp_imm, shdr.address,
-				    target_page + tmp_imm - shdr.address);
-				symbol.name = shiva_xfmtstrdup("%s+%lx", shdr.name,
-				    target_page + tmp_imm - shdr.address);
-				symbol.value = target_page + tmp_imm;
-				symbol.size = sizeof(uint64_t);
-				symbol.bind = STB_GLOBAL;
-				symbol.type = STT_OBJECT;
-				symbol.visibility = STV_PROTECTED;
-				if (elf_section_index_by_name(&ctx->elfobj, shdr.name, (uint64_t *)&symbol.shndx)
-				    == false) {
-					fprintf(stderr, "Failed to find section index for %s in %s\n",
-					    shdr.name, elf_pathname(&ctx->elfobj));
-					return true;
-				}
-			}
-			/*
-			 * We must get the name of the function that the
-			 * xref code is within. This is necessary later on
-			 * if transformations happen.
-			 */
-			struct elf_symbol tmp_sym, deref_symbol;
-			struct elf_symbol *src_func = NULL;
-
-			if (elf_symbol_by_range(&ctx->elfobj, code_vaddr - 4,
-			    &tmp_sym) == true) {
-				xref_flags |= SHIVA_XREF_F_SRC_SYMINFO;
-				src_func = shiva_malloc(sizeof(*src_func));
-				memcpy(src_func, &tmp_sym, sizeof(*src_func));
-				shiva_debug("Source symbol included: %s\n", tmp_sym.name);
-			}
-			shiva_debug("Looking up value %#lx found at %#lx\n", qword, target_page + tmp_imm);
-			res = elf_symbol_by_value_lookup(&ctx->elfobj,
-			    qword, &deref_symbol);
-			if (res == true) {
-				xref_flags |= SHIVA_XREF_F_INDIRECT;
-				shiva_debug("XREF (Indirect via GOT) (Type: %d): Site: %#lx target: %s (Deref)-> %s(%#lx)\n",
-				    xref_type, adrp_site, symbol.name ? symbol.name : "<unknown>",
-				    deref_symbol.name, deref_symbol.value);
-			}
-			res = shiva_analyze_make_xref(ctx, &symbol, &deref_symbol, src_func, xref_type, xref_flags, adrp_site,
-			    adrp_imm, tmp_imm, adrp_o_bytes, next_o_bytes);
-			if (res == false ) {
-				fprintf(stderr, "shiva_analyze_install_xref failed\n");
-				return false;
+#ifndef SHIVA_RT
+static void *
+shiva_analyze_async_worker(void *arg)
+{
+	struct shiva_ctx *ctx = arg;
+
+	ctx->analysis.res = shiva_analyze_find_calls(ctx);
+	shiva_analyze_finish(ctx, ctx->analysis.t0);
+	return NULL;
+}
+
+static bool
+shiva_analyze_async(struct shiva_ctx *ctx)
+{
+	char *env;
+
+	if (ctx->flags & SHIVA_OPTS_F_LIVE_ANALYSIS)
+		return false;
+	env = getenv("SHIVA_ANALYZE_ASYNC");
+	return env != NULL && strcmp(env, "1") == 0;
+}
+#endif
+
+/*
+ * With SHIVA_ANALYZE_ASYNC=1 this returns while .text is still being
+ * scanned, and the result is reported by shiva_analyze_wait().
+ */
+bool
+shiva_analyze_run(struct shiva_ctx *ctx)
+{
+	shiva_stats_mark_t t0 = SHIVA_STATS_START(ctx);
+	bool res = true;
+
+	if (shiva_analyze_load_prelinked(ctx) == true) {
+		shiva_debug("Using prelinked xref table\n");
+	} else {
+#ifdef SHIVA_RT
+		fprintf(stderr, "shiva-rt: '%s' has no usable prelinked xref table, prelink it"
+		    " with shiva-ld or run it with /lib/shiva\n", elf_pathname(&ctx->elfobj));
+		return false;
+#else
+		shiva_analyze_text_source(ctx);
+		if (shiva_analyze_async(ctx) == true) {
+			ctx->analysis.t0 = t0;
+			if (pthread_create(&ctx->analysis.thread, NULL,
+			    shiva_analyze_async_worker, ctx) == 0) {
+				shiva_debug("Running shiva_analyze_find_calls in the background\n");
+				ctx->analysis.pending = true;
+				return true;
 			}
-			continue;
 		}
-	}
+		shiva_debug("Running shiva_analyze_find_calls\n");
+		res = shiva_analyze_find_calls(ctx);
 #endif
-	return true;
+	}
+	shiva_analyze_finish(ctx, t0);
+	return res;
 }
 
+/*
+ * Wait for an analysis that shiva_analyze_run() left running. Returns
+ * false if it failed.
+ */
 bool
-shiva_analyze_run(struct shiva_ctx *ctx)
+shiva_analyze_wait(struct shiva_ctx *ctx)
 {
-	shiva_debug("Running shiva_analyze_find_calls\n");
-	return shiva_analyze_find_calls(ctx);
+	if (ctx->analysis.pending == false)
+		return true;
+	pthread_join(ctx->analysis.thread, NULL);
+	ctx->analysis.pending = false;
+	shiva_debug("Background analysis finished: %s\n",
+	    ctx->analysis.res == true ? "ok" : "failed");
+	return ctx->analysis.res;
 }
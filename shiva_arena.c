@@ -0,0 +1,174 @@
+/*
+ * shiva_arena.c - Bump allocator for objects that live as long as the
+ * interpreter does.
+ *
+ * Each arena is a list of anonymous mappings that are carved up in
+ * SHIVA_ARENA_ALIGN sized units. Nothing is ever freed individually,
+ * instead an entire arena is destroyed, or turned read-only once the
+ * phase of Shiva that owns it is complete. Since the blocks are mmap'd
+ * they never share pages with the musl heap, or with the heap of the
+ * target once it is running.
+ */
+#include "shiva.h"
+
+static inline void
+shiva_arena_lock(struct shiva_arena *arena)
+{
+	while (__atomic_test_and_set(&arena->lock, __ATOMIC_ACQUIRE))
+		;
+	return;
+}
+
+static inline void
+shiva_arena_unlock(struct shiva_arena *arena)
+{
+	__atomic_clear(&arena->lock, __ATOMIC_RELEASE);
+	return;
+}
+
+void
+shiva_arena_init(struct shiva_arena *arena, const char *name)
+{
+	memset(arena, 0, sizeof(*arena));
+	arena->name = name;
+	arena->prot = PROT_READ|PROT_WRITE;
+	return;
+}
+
+static struct shiva_arena_block *
+shiva_arena_new_block(struct shiva_arena *arena, size_t len)
+{
+	struct shiva_arena_block *block;
+	size_t size = sizeof(*block) + len;
+
+	size = size < SHIVA_ARENA_BLOCK_SIZE ? SHIVA_ARENA_BLOCK_SIZE :
+	    ELF_PAGEALIGN(size, PAGE_SIZE);
+	block = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+	    -1, 0);
+	if (block == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	block->size = size;
+	block->used = ELF_PAGEALIGN(sizeof(*block), SHIVA_ARENA_ALIGN);
+	block->next = arena->head;
+	arena->head = block;
+	arena->total += size;
+	return block;
+}
+
+/*
+ * Returns len bytes of zeroed memory from the arena. Like shiva_malloc()
+ * this never returns NULL.
+ */
+void *
+shiva_arena_alloc(struct shiva_arena *arena, size_t len)
+{
+	struct shiva_arena_block *block;
+	void *mem;
+
+	len = ELF_PAGEALIGN(len == 0 ? 1 : len, SHIVA_ARENA_ALIGN);
+	shiva_arena_lock(arena);
+	if (arena->prot != (PROT_READ|PROT_WRITE)) {
+		fprintf(stderr, "Allocation from read-only arena '%s'\n", arena->name);
+		exit(EXIT_FAILURE);
+	}
+	block = arena->head;
+	if (block == NULL || block->size - block->used < len)
+		block = shiva_arena_new_block(arena, len);
+	mem = (uint8_t *)block + block->used;
+	block->used += len;
+	shiva_arena_unlock(arena);
+	SHIVA_STATS_ALLOC(len);
+	return mem;
+}
+
+char *
+shiva_arena_strdup(struct shiva_arena *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p = shiva_arena_alloc(arena, len);
+
+	memcpy(p, s, len);
+	return p;
+}
+
+char *
+shiva_arena_xfmtstrdup(struct shiva_arena *arena, char *fmt, ...)
+{
+	char buf[512];
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+	return shiva_arena_strdup(arena, buf);
+}
+
+/*
+ * Move every block from src into dst. Used to collect the arenas of
+ * short lived workers (i.e. the analysis threads) into a phase arena.
+ */
+void
+shiva_arena_adopt(struct shiva_arena *dst, struct shiva_arena *src)
+{
+	struct shiva_arena_block *block, *next;
+
+	shiva_arena_lock(dst);
+	for (block = src->head; block != NULL; block = next) {
+		next = block->next;
+		block->next = dst->head;
+		dst->head = block;
+		dst->total += block->size;
+	}
+	shiva_arena_unlock(dst);
+	src->head = NULL;
+	src->total = 0;
+	return;
+}
+
+/*
+ * Change the protection of every block in the arena, i.e. PROT_READ
+ * once the analysis phase is complete so that the target cannot
+ * scribble over the data that Shiva relies on.
+ */
+bool
+shiva_arena_protect(struct shiva_arena *arena, int prot)
+{
+	struct shiva_arena_block *block, *next;
+
+	shiva_arena_lock(arena);
+	for (block = arena->head; block != NULL; block = next) {
+		/*
+		 * Read the next pointer before the block header
+		 * possibly becomes unreadable.
+		 */
+		next = block->next;
+		if (mprotect(block, block->size, prot) < 0) {
+			perror("mprotect");
+			shiva_arena_unlock(arena);
+			return false;
+		}
+	}
+	arena->prot = prot;
+	shiva_arena_unlock(arena);
+	shiva_debug("Arena '%s' (%zu bytes) set to prot %#x\n", arena->name,
+	    arena->total, prot);
+	return true;
+}
+
+void
+shiva_arena_destroy(struct shiva_arena *arena)
+{
+	struct shiva_arena_block *block, *next;
+
+	if (arena->prot != (PROT_READ|PROT_WRITE) && arena->prot != PROT_READ)
+		(void) shiva_arena_protect(arena, PROT_READ);
+	for (block = arena->head; block != NULL; block = next) {
+		next = block->next;
+		munmap(block, block->size);
+	}
+	arena->head = NULL;
+	arena->total = 0;
+	return;
+}
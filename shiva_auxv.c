@@ -68,3 +68,28 @@ shiva_auxv_set_value(struct shiva_auxv_iterator *iter, long value)
 	iter->auxv[iter->index - 1].a_un.a_val = (uint64_t)value;
 	return true;
 }
+
+/*
+ * Fetch AT_HWCAP and AT_HWCAP2, either of hwcap and hwcap2 may be NULL.
+ * A bit that the kernel doesn't report reads as 0.
+ */
+bool
+shiva_auxv_hwcap(struct shiva_ctx *ctx, uint64_t *hwcap, uint64_t *hwcap2)
+{
+	shiva_auxv_iterator_t a_iter;
+	struct shiva_auxv_entry a_entry;
+
+	if (hwcap != NULL)
+		*hwcap = 0;
+	if (hwcap2 != NULL)
+		*hwcap2 = 0;
+	if (shiva_auxv_iterator_init(ctx, &a_iter, NULL) == false)
+		return false;
+	while (shiva_auxv_iterator_next(&a_iter, &a_entry) == SHIVA_ITER_OK) {
+		if (a_entry.type == AT_HWCAP && hwcap != NULL)
+			*hwcap = a_entry.value;
+		else if (a_entry.type == AT_HWCAP2 && hwcap2 != NULL)
+			*hwcap2 = a_entry.value;
+	}
+	return true;
+}
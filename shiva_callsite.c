@@ -4,26 +4,27 @@ void
 shiva_callsite_iterator_init(struct shiva_ctx *ctx, struct shiva_callsite_iterator *iter)
 {
 
-	iter->current = TAILQ_FIRST(&ctx->tailq.branch_tqlist);
+	iter->index = 0;
 	iter->ctx = ctx;
 	return;
 }
 
+/*
+ * Sets *e to the next SHIVA_BRANCH_CALL site within ctx->analysis.branches.
+ * The site points directly into the array and must not be freed.
+ */
 shiva_iterator_res_t
-shiva_callsite_iterator_next(struct shiva_callsite_iterator *iter, struct shiva_branch_site *e)
+shiva_callsite_iterator_next(struct shiva_callsite_iterator *iter, struct shiva_branch_site **e)
 {
-	if (iter->current == NULL)
-		return SHIVA_ITER_DONE;
-check_branch:
-	if (iter->current->branch_type == SHIVA_BRANCH_CALL) {
-		memcpy(e, iter->current, sizeof(*e));
-		iter->current = TAILQ_NEXT(iter->current, _linkage);
-		return ELF_ITER_OK;
-	} else {
-		iter->current = TAILQ_NEXT(iter->current, _linkage);
-		if (iter->current == NULL)
-			return SHIVA_ITER_DONE;
-		goto check_branch;
+	struct shiva_ctx *ctx = iter->ctx;
+
+	while (iter->index < ctx->analysis.branch_count) {
+		struct shiva_branch_site *branch = &ctx->analysis.branches[iter->index++];
+
+		if (branch->branch_type == SHIVA_BRANCH_CALL) {
+			*e = branch;
+			return ELF_ITER_OK;
+		}
 	}
-	return ELF_ITER_DONE;
+	return SHIVA_ITER_DONE;
 }
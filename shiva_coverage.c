@@ -0,0 +1,329 @@
+/*
+ * shiva_coverage.c - Basic block coverage.
+ *
+ * SHIVA_COVERAGE=<path> records which basic blocks of the target .text
+ * execute. The block heads come from the branch sites of the analysis
+ * (ctx->analysis.branches): the target of every b, bl, b.cond, cbz and
+ * tbz, the fall through of the conditional ones, the return site of
+ * every call, and the function symbols of the target.
+ *
+ * Each head is overwritten with a brk right before control is passed to
+ * LDSO. The first time a block executes the SIGTRAP handler sets its bit
+ * in the bitmap and writes the original instruction back, after which
+ * the block runs at native speed: every block costs one trap, once.
+ * A stub per block would avoid the trap, but each head would then have
+ * to be displaced into a thunk, and heads are often exactly the short
+ * range instructions (b.cond, cbz, ldr literal) that cannot be.
+ *
+ * The bitmap lives in path, which is mapped shared, so it can be read
+ * at any time while the target runs:
+ *
+ * [shiva_coverage_hdr]
+ * [uint64_t block address (ELF vaddr), sorted] * block_count
+ * [uint8_t bitmap, block n is bit (n & 7) of byte (n >> 3)]
+ *
+ * The SIGTRAP handler runs with the thread pointer of the targets libc,
+ * so it only makes system calls directly. A SIGTRAP that isn't for one
+ * of our heads goes to the handler that was installed before ours.
+ */
+#include "shiva.h"
+#include "shiva_syscall.h"
+#include <sys/syscall.h>
+#include <ucontext.h>
+#if __aarch64__
+#include "shiva_aarch64.h"
+#endif
+
+#define SHIVA_COVERAGE_MAGIC	0x56434853 /* "SHCV" */
+#define SHIVA_COVERAGE_VERSION	1
+#define SHIVA_COVERAGE_BRK	0xd420b800 /* brk #0x5c0 */
+#define SHIVA_COVERAGE_INITIAL	4096
+
+#define A64_IS_BRK(insn)	(((insn) & 0xffe0001f) == 0xd4200000)
+
+struct shiva_coverage_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t base; /* load base of the target */
+	uint64_t block_count;
+	uint64_t block_offset; /* of the block addresses, from the start of the file */
+	uint64_t bitmap_offset;
+	uint64_t blocks_hit;
+};
+
+static struct {
+	struct shiva_coverage_hdr *hdr;
+	uint64_t *blocks;
+	uint8_t *bitmap;
+	uint32_t *o_insn;
+	size_t count;
+	size_t size;
+	uint64_t base;
+	int prot; /* of the target .text */
+	bool lock;
+	struct sigaction o_sa;
+} coverage;
+
+/*
+ * Kernel layout of struct sigaction, for rt_sigaction(2)
+ */
+struct shiva_coverage_ksigaction {
+	void *handler;
+	unsigned long flags;
+	void *restorer;
+	uint64_t mask;
+};
+
+#if __aarch64__
+static void
+shiva_coverage_add(uint64_t vaddr, uint64_t lo, uint64_t hi)
+{
+	if (vaddr < lo || vaddr >= hi || (vaddr & 0x3) != 0)
+		return;
+	if (coverage.count == coverage.size) {
+		coverage.size = coverage.size == 0 ? SHIVA_COVERAGE_INITIAL :
+		    coverage.size << 1;
+		coverage.blocks = shiva_realloc(coverage.blocks,
+		    coverage.size * sizeof(uint64_t));
+	}
+	coverage.blocks[coverage.count++] = vaddr;
+	return;
+}
+
+static int
+shiva_coverage_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Returns the index of the block at vaddr, or coverage.count.
+ */
+static size_t
+shiva_coverage_find(uint64_t vaddr)
+{
+	size_t lo = 0, hi = coverage.count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (coverage.blocks[mid] < vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < coverage.count && coverage.blocks[lo] == vaddr)
+		return lo;
+	return coverage.count;
+}
+
+static void
+shiva_coverage_fail(const char *msg)
+{
+	(void) shiva_syscall(SYS_write, STDERR_FILENO, (long)msg, strlen(msg), 0, 0, 0);
+	(void) shiva_syscall(SYS_exit_group, EXIT_FAILURE, 0, 0, 0, 0, 0);
+	return;
+}
+
+/*
+ * Write the original instruction back over the brk at pc. The lock keeps
+ * two threads from changing the protection of the same page at once.
+ */
+static void
+shiva_coverage_restore(uint64_t pc, size_t index)
+{
+	uint64_t page = ELF_PAGESTART(pc);
+
+	while (__atomic_test_and_set(&coverage.lock, __ATOMIC_ACQUIRE))
+		;
+	if (*(uint32_t *)pc == SHIVA_COVERAGE_BRK) {
+		if (shiva_syscall(SYS_mprotect, page, PAGE_SIZE,
+		    coverage.prot|PROT_WRITE, 0, 0, 0) < 0)
+			shiva_coverage_fail("SHIVA_COVERAGE: unable to make .text writable\n");
+		__atomic_store_n((uint32_t *)pc, coverage.o_insn[index], __ATOMIC_RELAXED);
+		(void) shiva_syscall(SYS_mprotect, page, PAGE_SIZE, coverage.prot, 0, 0, 0);
+		__builtin___clear_cache((char *)pc, (char *)pc + sizeof(uint32_t));
+	}
+	__atomic_clear(&coverage.lock, __ATOMIC_RELEASE);
+	return;
+}
+
+static void
+shiva_coverage_sigtrap(int sig, siginfo_t *si, void *uctx)
+{
+	ucontext_t *uc = uctx;
+	struct shiva_coverage_ksigaction ksa;
+	uint64_t pc = uc->uc_mcontext.pc;
+	size_t index;
+	uint8_t bit;
+
+	index = pc >= coverage.base ? shiva_coverage_find(pc - coverage.base) :
+	    coverage.count;
+	if (index == coverage.count) {
+		if (coverage.o_sa.sa_flags & SA_SIGINFO) {
+			coverage.o_sa.sa_sigaction(sig, si, uctx);
+			return;
+		}
+		if (coverage.o_sa.sa_handler != SIG_DFL &&
+		    coverage.o_sa.sa_handler != SIG_IGN) {
+			coverage.o_sa.sa_handler(sig);
+			return;
+		}
+		/*
+		 * Nobody else handles SIGTRAP, the brk traps again once we
+		 * return and takes the default action.
+		 */
+		memset(&ksa, 0, sizeof(ksa));
+		ksa.handler = SIG_DFL;
+		(void) shiva_syscall(SYS_rt_sigaction, SIGTRAP, (long)&ksa, 0,
+		    sizeof(ksa.mask), 0, 0);
+		return;
+	}
+	bit = 1 << (index & 7);
+	if ((__atomic_fetch_or(&coverage.bitmap[index >> 3], bit,
+	    __ATOMIC_RELAXED) & bit) == 0)
+		__atomic_fetch_add(&coverage.hdr->blocks_hit, 1, __ATOMIC_RELAXED);
+	shiva_coverage_restore(pc, index);
+	return;
+}
+#endif
+
+/*
+ * Called right before control is passed to LDSO, once every patch has
+ * been applied, so that the brk instructions displace the final code.
+ */
+bool
+shiva_coverage_start(struct shiva_ctx *ctx)
+{
+#if __aarch64__
+	struct shiva_aarch64_insn insn;
+	struct shiva_branch_site *branch;
+	struct shiva_mmap_entry map;
+	struct shiva_patch_txn txn;
+	struct elf_section text;
+	struct elf_symbol symbol;
+	elf_symtab_iterator_t sym_iter;
+	struct sigaction sa;
+	shiva_error_t error;
+	uint64_t lo, hi;
+	size_t i, n, len;
+	uint32_t word, brk = SHIVA_COVERAGE_BRK;
+	void *mem;
+	char *path;
+	int fd;
+
+	path = getenv("SHIVA_COVERAGE");
+	if (path == NULL || path[0] == '\0')
+		return true;
+	if (elf_section_by_name(&ctx->elfobj, ".text", &text) == false) {
+		fprintf(stderr, "SHIVA_COVERAGE: %s has no .text\n", ctx->path);
+		return false;
+	}
+	coverage.base = shiva_trace_base_addr(ctx);
+	lo = text.address;
+	hi = text.address + text.size;
+	if (shiva_maps_entry_by_addr(ctx, coverage.base + lo, &map) == false) {
+		fprintf(stderr, "SHIVA_COVERAGE: cannot find the mapping of .text\n");
+		return false;
+	}
+	coverage.prot = map.prot;
+
+	shiva_coverage_add(lo, lo, hi);
+	for (i = 0; i < ctx->analysis.branch_count; i++) {
+		branch = &ctx->analysis.branches[i];
+		if (branch->branch_type == SHIVA_BRANCH_CALL) {
+			shiva_coverage_add(branch->retaddr, lo, hi);
+		} else if (branch->branch_type == SHIVA_BRANCH_JMP) {
+			if (shiva_aarch64_decode(branch->o_insn, &insn) == true &&
+			    insn.type != SHIVA_AARCH64_INSN_B)
+				shiva_coverage_add(branch->branch_site + sizeof(uint32_t), lo, hi);
+		} else {
+			continue;
+		}
+		if ((branch->branch_flags & SHIVA_BRANCH_F_INDIRECT) == 0)
+			shiva_coverage_add(branch->target_vaddr, lo, hi);
+	}
+	elf_symtab_iterator_init(&ctx->elfobj, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
+		if (symbol.type == STT_FUNC)
+			shiva_coverage_add(symbol.value, lo, hi);
+	}
+	qsort(coverage.blocks, coverage.count, sizeof(uint64_t), shiva_coverage_cmp);
+
+	/*
+	 * Drop the duplicates, and heads that already hold a brk of the
+	 * trace API which would otherwise be lost.
+	 */
+	coverage.o_insn = shiva_malloc(coverage.count * sizeof(uint32_t) + 1);
+	for (i = 0, n = 0; i < coverage.count; i++) {
+		if (n > 0 && coverage.blocks[n - 1] == coverage.blocks[i])
+			continue;
+		memcpy(&word, (void *)(coverage.base + coverage.blocks[i]), sizeof(word));
+		if (A64_IS_BRK(word))
+			continue;
+		coverage.o_insn[n] = word;
+		coverage.blocks[n++] = coverage.blocks[i];
+	}
+	coverage.count = n;
+
+	len = sizeof(struct shiva_coverage_hdr) + n * sizeof(uint64_t) + (n + 7) / 8;
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("open");
+		return false;
+	}
+	if (ftruncate(fd, len) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return false;
+	}
+	mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	coverage.hdr = mem;
+	coverage.hdr->magic = SHIVA_COVERAGE_MAGIC;
+	coverage.hdr->version = SHIVA_COVERAGE_VERSION;
+	coverage.hdr->base = coverage.base;
+	coverage.hdr->block_count = n;
+	coverage.hdr->block_offset = sizeof(struct shiva_coverage_hdr);
+	coverage.hdr->bitmap_offset = coverage.hdr->block_offset + n * sizeof(uint64_t);
+	memcpy((uint8_t *)mem + coverage.hdr->block_offset, coverage.blocks,
+	    n * sizeof(uint64_t));
+	coverage.bitmap = (uint8_t *)mem + coverage.hdr->bitmap_offset;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = shiva_coverage_sigtrap;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	if (sigaction(SIGTRAP, &sa, &coverage.o_sa) < 0) {
+		perror("sigaction");
+		return false;
+	}
+
+	shiva_patch_txn_begin(ctx, &txn);
+	for (i = 0; i < n; i++) {
+		if (shiva_patch_txn_write(&txn, coverage.base + coverage.blocks[i],
+		    &brk, sizeof(brk), &error) == false) {
+			shiva_patch_txn_abort(&txn);
+			fprintf(stderr, "SHIVA_COVERAGE: %s\n", shiva_error_msg(&error));
+			return false;
+		}
+	}
+	if (shiva_patch_txn_commit(&txn, &error) == false) {
+		fprintf(stderr, "SHIVA_COVERAGE: %s\n", shiva_error_msg(&error));
+		return false;
+	}
+	shiva_debug("Coverage of %zu blocks into %s\n", n, path);
+	return true;
+#else
+	if (getenv("SHIVA_COVERAGE") != NULL) {
+		fprintf(stderr, "SHIVA_COVERAGE is only supported on aarch64\n");
+		return false;
+	}
+	return true;
+#endif
+}
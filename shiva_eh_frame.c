@@ -0,0 +1,317 @@
+/*
+ * shiva_eh_frame.c - Unwind info of patch modules.
+ *
+ * The .eh_frame of a module is mapped into its text image, right after
+ * the sections before it and followed by the zero length terminator
+ * that ld(1) would have added, and relocated along with the rest of the
+ * module (See shiva_module.c:apply_eh_frame_relocation). Once the
+ * shared objects of the target are loaded it is handed to the
+ * __register_frame() of the targets unwinder (libgcc_s, or libunwind),
+ * so that unwinding through patch code doesn't depend on frame pointers
+ * and C++ exceptions can cross it. The unwinder sorts the FDEs of a
+ * registered object into a search table on first use, lookups are a
+ * binary search from then on.
+ *
+ * SHIVA_MODULE_EH_FRAME=0 leaves .eh_frame out of the module, as it
+ * always used to be.
+ */
+#include "shiva.h"
+
+#define SHIVA_EH_FRAME_CIE_ID		0
+#define SHIVA_EH_FRAME_EXT_LEN	0xffffffff
+
+#define DW_EH_PE_absptr		0x00
+#define DW_EH_PE_omit		0xff
+
+bool
+shiva_eh_frame_enabled(struct shiva_module *linker)
+{
+	char *env = getenv("SHIVA_MODULE_EH_FRAME");
+
+	if (linker->mode != SHIVA_LINKING_MICROCODE_PATCH)
+		return false;
+	return env == NULL || strcmp(env, "0") != 0;
+}
+
+/*
+ * Drop the unwind info of a module that can't be trusted, unwinding
+ * through it is left to frame pointers.
+ */
+void
+shiva_eh_frame_drop(struct shiva_module *linker, const char *reason)
+{
+	if (linker->eh_frame.mem == NULL)
+		return;
+	shiva_debug("Not registering .eh_frame at %p: %s\n", linker->eh_frame.mem,
+	    reason);
+	linker->eh_frame.mem = NULL;
+	linker->eh_frame.size = 0;
+	return;
+}
+
+static uint64_t
+shiva_eh_frame_uleb128(uint8_t **p, uint8_t *end)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	while (*p < end) {
+		uint8_t b = *(*p)++;
+
+		if (shift < 64)
+			v |= (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+		if ((b & 0x80) == 0)
+			break;
+	}
+	return v;
+}
+
+/*
+ * Size of a pointer of encoding enc, 0 for those that aren't handled.
+ */
+static size_t
+shiva_eh_frame_ptr_size(uint8_t enc)
+{
+	if ((enc & 0x70) == 0x50) /* DW_EH_PE_aligned */
+		return 0;
+	switch (enc & 0x0f) {
+	case 0x00: /* DW_EH_PE_absptr */
+	case 0x04: /* DW_EH_PE_udata8 */
+	case 0x0c: /* DW_EH_PE_sdata8 */
+		return sizeof(uint64_t);
+	case 0x02: /* DW_EH_PE_udata2 */
+	case 0x0a: /* DW_EH_PE_sdata2 */
+		return sizeof(uint16_t);
+	case 0x03: /* DW_EH_PE_udata4 */
+	case 0x0b: /* DW_EH_PE_sdata4 */
+		return sizeof(uint32_t);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The pointer encoding of the FDEs of the CIE at cie, from the 'R' of
+ * its augmentation.
+ */
+static bool
+shiva_eh_frame_fde_encoding(uint8_t *cie, uint8_t *end, uint8_t *enc)
+{
+	uint8_t *p = cie + 2 * sizeof(uint32_t), version;
+	const char *aug;
+	size_t len;
+
+	*enc = DW_EH_PE_absptr;
+	if (p >= end)
+		return false;
+	version = *p++;
+	aug = (const char *)p;
+	len = strnlen(aug, end - p);
+	if (p + len >= end)
+		return false;
+	p += len + 1;
+	if (aug[0] != 'z')
+		return aug[0] == '\0';
+	(void) shiva_eh_frame_uleb128(&p, end); /* code alignment */
+	(void) shiva_eh_frame_uleb128(&p, end); /* data alignment, an sleb128 */
+	if (version == 1)
+		p++;
+	else
+		(void) shiva_eh_frame_uleb128(&p, end); /* return address register */
+	(void) shiva_eh_frame_uleb128(&p, end); /* augmentation length */
+	for (aug++; *aug != '\0' && p < end; aug++) {
+		switch (*aug) {
+		case 'R':
+			*enc = *p;
+			return true;
+		case 'P':
+			len = shiva_eh_frame_ptr_size(*p);
+			if (len == 0)
+				return false;
+			p += 1 + len;
+			break;
+		case 'L':
+			p++;
+			break;
+		case 'S':
+		case 'B':
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Called for a relocation at offset within .eh_frame that refers to a
+ * section which was left out of the module (See module_gc_sections),
+ * which must be the pc_begin of an FDE. The FDE is kept in place, with
+ * a pc_range of 0 which no PC falls into.
+ */
+void
+shiva_eh_frame_discard(struct shiva_module *linker, uint64_t offset)
+{
+	uint8_t *mem = linker->eh_frame.mem, *end, *range;
+	size_t off = 0, size;
+	uint32_t len, id;
+	uint8_t enc;
+
+	if (mem == NULL)
+		return;
+	end = mem + linker->eh_frame.size;
+	while (off + 2 * sizeof(uint32_t) <= linker->eh_frame.size) {
+		memcpy(&len, &mem[off], sizeof(len));
+		if (len == 0 || len == SHIVA_EH_FRAME_EXT_LEN ||
+		    len > linker->eh_frame.size - off - sizeof(uint32_t))
+			break;
+		if (offset > off && offset < off + sizeof(uint32_t) + len)
+			break;
+		off += sizeof(uint32_t) + len;
+	}
+	if (off + 2 * sizeof(uint32_t) <= linker->eh_frame.size)
+		memcpy(&id, &mem[off + sizeof(uint32_t)], sizeof(id));
+	if (off + 2 * sizeof(uint32_t) > linker->eh_frame.size ||
+	    offset != off + 2 * sizeof(uint32_t) || id == SHIVA_EH_FRAME_CIE_ID ||
+	    id > off + sizeof(uint32_t)) {
+		shiva_eh_frame_drop(linker, "relocation against a section that is left out");
+		return;
+	}
+	if (shiva_eh_frame_fde_encoding(&mem[off + sizeof(uint32_t) - id], end, &enc) == false ||
+	    enc == DW_EH_PE_omit || (size = shiva_eh_frame_ptr_size(enc)) == 0 ||
+	    offset + 2 * size > off + sizeof(uint32_t) + len) {
+		shiva_eh_frame_drop(linker, "FDE of a section that is left out has an"
+		    " unsupported encoding");
+		return;
+	}
+	range = &mem[offset + size];
+	memset(range, 0, size);
+	shiva_debug("Discarded the FDE at .eh_frame+%#lx\n", off);
+	return;
+}
+
+/*
+ * Walk the CIE and FDE records, every one of them must lie within the
+ * section and every FDE must point back to a CIE.
+ */
+static bool
+shiva_eh_frame_validate(uint8_t *mem, size_t size, size_t *fde_count)
+{
+	size_t off = 0;
+	uint32_t len, id;
+
+	*fde_count = 0;
+	while (off + sizeof(uint32_t) <= size) {
+		memcpy(&len, &mem[off], sizeof(len));
+		if (len == 0)
+			return true;
+		if (len == SHIVA_EH_FRAME_EXT_LEN || len < sizeof(uint32_t) ||
+		    len > size - off - sizeof(uint32_t))
+			return false;
+		memcpy(&id, &mem[off + sizeof(uint32_t)], sizeof(id));
+		if (id != SHIVA_EH_FRAME_CIE_ID) {
+			if (id > off + sizeof(uint32_t))
+				return false;
+			(*fde_count)++;
+		}
+		off += sizeof(uint32_t) + len;
+	}
+	return false;
+}
+
+/*
+ * Called once the module is linked (Or mapped from the patch cache).
+ * The unwind info of a live patch is registered right away, that of the
+ * others once LDSO has loaded the unwinder (See shiva_post_linker).
+ */
+bool
+shiva_eh_frame_seal(struct shiva_module *linker)
+{
+	size_t fde_count;
+
+	if (linker->eh_frame.mem == NULL)
+		return true;
+	if (shiva_eh_frame_enabled(linker) == false) {
+		shiva_eh_frame_drop(linker, "disabled");
+		return true;
+	}
+	/*
+	 * The terminator follows the section.
+	 */
+	if (shiva_eh_frame_validate(linker->eh_frame.mem,
+	    linker->eh_frame.size + sizeof(uint32_t), &fde_count) == false) {
+		shiva_eh_frame_drop(linker, "malformed CIE/FDE records");
+		return true;
+	}
+	if (fde_count == 0) {
+		shiva_eh_frame_drop(linker, "no FDEs");
+		return true;
+	}
+	shiva_debug("%zu FDEs in .eh_frame at %p\n", fde_count, linker->eh_frame.mem);
+	if (linker->flags & SHIVA_MODULE_F_LIVE)
+		return shiva_eh_frame_register(linker->ctx, linker);
+	return shiva_post_linker_enable(linker->ctx);
+}
+
+/*
+ * Runs after LDSO, with the thread pointer of the targets libc. A
+ * target without an unwinder of its own has nothing to register with.
+ */
+bool
+shiva_eh_frame_register(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	void (*register_frame)(void *);
+	struct elf_symbol symbol;
+	uint64_t base;
+	size_t i;
+
+	if (linker->eh_frame.mem == NULL || linker->eh_frame.registered == true)
+		return true;
+	if (shiva_link_map_resolve_symbol(ctx, "__register_frame", &symbol,
+	    &base) == false || symbol.type != STT_FUNC) {
+		shiva_debug("No __register_frame in the target, .eh_frame at %p is"
+		    " not registered\n", linker->eh_frame.mem);
+		return true;
+	}
+	register_frame = (void *)(base + symbol.value);
+	register_frame(linker->eh_frame.mem);
+	/*
+	 * Each text replica has a copy of .eh_frame that describes it.
+	 */
+	for (i = 0; i < linker->numa.count; i++)
+		register_frame(linker->numa.vec[i].mem +
+		    (linker->eh_frame.mem - linker->text_mem));
+	linker->eh_frame.registered = true;
+	shiva_debug("Registered .eh_frame at %p\n", linker->eh_frame.mem);
+	return true;
+}
+
+/*
+ * Undo shiva_eh_frame_register(), before the text of a live patch is
+ * unmapped.
+ */
+void
+shiva_eh_frame_deregister(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	void (*deregister_frame)(void *);
+	struct elf_symbol symbol;
+	uint64_t base;
+	size_t i;
+
+	if (linker->eh_frame.registered == false)
+		return;
+	if (shiva_link_map_resolve_symbol(ctx, "__deregister_frame", &symbol,
+	    &base) == false || symbol.type != STT_FUNC) {
+		shiva_debug("No __deregister_frame in the target\n");
+		return;
+	}
+	deregister_frame = (void *)(base + symbol.value);
+	deregister_frame(linker->eh_frame.mem);
+	for (i = 0; i < linker->numa.count; i++)
+		deregister_frame(linker->numa.vec[i].mem +
+		    (linker->eh_frame.mem - linker->text_mem));
+	linker->eh_frame.registered = false;
+	shiva_debug("Deregistered .eh_frame at %p\n", linker->eh_frame.mem);
+	return;
+}
@@ -0,0 +1,108 @@
+/*
+ * shiva_fork.c - Keeping the state of Shiva valid across fork(2).
+ *
+ * A pre-fork server forks its workers long after Shiva passed control
+ * to LDSO, through the fork() of the targets libc, so Shiva never gets
+ * to run a pthread_atfork() handler of its own. Instead a fork is
+ * noticed the first time a child enters Shiva: ctx->fork.gen lives on
+ * a page of its own that is mapped MADV_WIPEONFORK, so it reads as 0
+ * in a child and as SHIVA_FORK_GEN_PARENT everywhere else. The check is
+ * a single load, and the handlers that were registered with
+ * shiva_atfork() run once, in the first thread of the child that gets
+ * there.
+ *
+ * The child handlers only drop per-thread state, i.e. the thread list
+ * and the trace_tls slots of threads that don't exist in the child. The
+ * rest of Shiva, most of all the module images and the arenas, is never
+ * written after the target starts and stays shared with the parent.
+ *
+ * Handlers run with the thread pointer of the targets libc, so they
+ * must not call into libc functions that touch TLS.
+ */
+#include "shiva.h"
+
+#define SHIVA_FORK_GEN_CHILD	0 /* wiped by fork */
+#define SHIVA_FORK_GEN_PARENT	1
+#define SHIVA_FORK_GEN_BUSY	2 /* child handlers are running */
+
+#ifndef MADV_WIPEONFORK
+#define MADV_WIPEONFORK	18
+#endif
+
+/*
+ * Called before the target runs. Without MADV_WIPEONFORK (Linux < 4.14)
+ * forks go unnoticed, as they always used to.
+ */
+bool
+shiva_fork_init(struct shiva_ctx *ctx)
+{
+	void *mem;
+
+	mem = mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+	    -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	if (madvise(mem, PAGE_SIZE, MADV_WIPEONFORK) < 0) {
+		shiva_debug("madvise(MADV_WIPEONFORK) failed: %s\n", strerror(errno));
+		munmap(mem, PAGE_SIZE);
+		return true;
+	}
+	ctx->fork.gen = mem;
+	*ctx->fork.gen = SHIVA_FORK_GEN_PARENT;
+	return true;
+}
+
+/*
+ * Register handler to be called in every child that is forked from
+ * now on. Handlers run in the order they were registered.
+ */
+bool
+shiva_atfork(struct shiva_ctx *ctx, void (*handler)(struct shiva_ctx *))
+{
+	size_t i;
+
+	for (i = 0; i < ctx->fork.count; i++) {
+		if (ctx->fork.child[i] == handler)
+			return true;
+	}
+	if (ctx->fork.count == SHIVA_FORK_HANDLERS_MAX) {
+		fprintf(stderr, "shiva_atfork: too many handlers\n");
+		return false;
+	}
+	ctx->fork.child[ctx->fork.count++] = handler;
+	return true;
+}
+
+/*
+ * Called from every entry point into Shiva that touches per-thread
+ * state (See shiva_trace_tls_self).
+ */
+void
+shiva_fork_check(struct shiva_ctx *ctx)
+{
+	uint64_t gen;
+	size_t i;
+
+	if (ctx->fork.gen == NULL)
+		return;
+	gen = __atomic_load_n(ctx->fork.gen, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(gen == SHIVA_FORK_GEN_PARENT, 1))
+		return;
+	/*
+	 * The child may already have threads of its own by now, only one
+	 * of them runs the handlers and the rest wait for it.
+	 */
+	if (gen == SHIVA_FORK_GEN_CHILD &&
+	    __atomic_compare_exchange_n(ctx->fork.gen, &gen, SHIVA_FORK_GEN_BUSY,
+	    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == true) {
+		for (i = 0; i < ctx->fork.count; i++)
+			ctx->fork.child[i](ctx);
+		__atomic_store_n(ctx->fork.gen, SHIVA_FORK_GEN_PARENT, __ATOMIC_RELEASE);
+		return;
+	}
+	while (__atomic_load_n(ctx->fork.gen, __ATOMIC_ACQUIRE) != SHIVA_FORK_GEN_PARENT)
+		__asm__ __volatile__("" ::: "memory");
+	return;
+}
@@ -0,0 +1,158 @@
+/*
+ * shiva_gnu_hash.c - Exported symbol lookups through DT_GNU_HASH
+ *
+ * elf_symbol_by_name() is a generic lookup over the entire symbol
+ * table. An exported symbol can instead be found the way that LDSO
+ * finds it: the bloom filter rejects most misses with a single word
+ * test, and a hit costs one bucket and a short hash chain walk in
+ * .dynsym. Only names that aren't exported (local or static symbols,
+ * or undefined imports) fall back to elf_symbol_by_name().
+ */
+#include "shiva.h"
+
+/*
+ * Parse the DT_GNU_HASH header at hdr. Also used for the tables of the
+ * shared objects in the link_map of the RTLD (See shiva_link_map.c),
+ * which are already mapped.
+ */
+bool
+shiva_gnu_hash_setup(struct shiva_gnu_hash *gh, uint32_t *hdr, Elf64_Sym *dynsym,
+    char *dynstr)
+{
+	gh->state = SHIVA_GNU_HASH_ABSENT;
+	if (hdr == NULL || dynsym == NULL || dynstr == NULL)
+		return false;
+	gh->dynsym = dynsym;
+	gh->dynstr = dynstr;
+	gh->nbuckets = hdr[0];
+	gh->symoffset = hdr[1];
+	gh->bloom_size = hdr[2];
+	gh->bloom_shift = hdr[3];
+	if (gh->nbuckets == 0 || gh->bloom_size == 0 ||
+	    (gh->bloom_size & (gh->bloom_size - 1)) != 0)
+		return false;
+	gh->bloom = (uint64_t *)&hdr[4];
+	gh->buckets = (uint32_t *)&gh->bloom[gh->bloom_size];
+	gh->chain = &gh->buckets[gh->nbuckets];
+	gh->symcount = ~0U;
+	gh->state = SHIVA_GNU_HASH_READY;
+	return true;
+}
+
+static bool
+shiva_gnu_hash_init(elfobj_t *obj, struct shiva_gnu_hash *gh)
+{
+	elf_dynamic_iterator_t dyn_iter;
+	elf_dynamic_entry_t dyn_entry;
+	struct elf_section shdr;
+	uint64_t gnu_hash = 0, symtab = 0, strtab = 0;
+	uint32_t *hdr;
+
+	gh->state = SHIVA_GNU_HASH_ABSENT;
+	if (elf_class(obj) != elfclass64)
+		return false;
+	elf_dynamic_iterator_init(obj, &dyn_iter);
+	while (elf_dynamic_iterator_next(&dyn_iter, &dyn_entry) == ELF_ITER_OK) {
+		switch(dyn_entry.tag) {
+		case DT_GNU_HASH:
+			gnu_hash = dyn_entry.value;
+			break;
+		case DT_SYMTAB:
+			symtab = dyn_entry.value;
+			break;
+		case DT_STRTAB:
+			strtab = dyn_entry.value;
+			break;
+		default:
+			break;
+		}
+	}
+	if (gnu_hash == 0 || symtab == 0 || strtab == 0)
+		return false;
+	hdr = elf_address_pointer(obj, gnu_hash);
+	if (shiva_gnu_hash_setup(gh, hdr, elf_address_pointer(obj, symtab),
+	    elf_address_pointer(obj, strtab)) == false)
+		return false;
+	/*
+	 * Bound the chain walks with the size of .dynsym when we have it.
+	 */
+	if (elf_section_by_name(obj, ".dynsym", &shdr) == true && shdr.entsize != 0)
+		gh->symcount = shdr.size / shdr.entsize;
+	shiva_debug("DT_GNU_HASH for %s: %u buckets, symoffset %u\n",
+	    elf_pathname(obj), gh->nbuckets, gh->symoffset);
+	return true;
+}
+
+static inline uint32_t
+shiva_gnu_hash(const char *name)
+{
+	const uint8_t *s = (const uint8_t *)name;
+	uint32_t h = 5381;
+
+	for (; *s != '\0'; s++)
+		h = (h << 5) + h + *s;
+	return h;
+}
+
+bool
+shiva_gnu_hash_lookup(struct shiva_gnu_hash *gh, const char *name,
+    struct elf_symbol *out)
+{
+	uint32_t h = shiva_gnu_hash(name), h2, idx;
+	uint64_t word, mask;
+	Elf64_Sym *sym;
+
+	word = gh->bloom[(h / 64) & (gh->bloom_size - 1)];
+	mask = (1UL << (h % 64)) | (1UL << ((h >> gh->bloom_shift) % 64));
+	if ((word & mask) != mask)
+		return false;
+	idx = gh->buckets[h % gh->nbuckets];
+	if (idx < gh->symoffset)
+		return false;
+	for (; idx < gh->symcount; idx++) {
+		h2 = gh->chain[idx - gh->symoffset];
+		sym = &gh->dynsym[idx];
+		if ((h | 1) == (h2 | 1) && sym->st_shndx != SHN_UNDEF &&
+		    strcmp(name, gh->dynstr + sym->st_name) == 0) {
+			out->name = gh->dynstr + sym->st_name;
+			out->value = sym->st_value;
+			out->size = sym->st_size;
+			out->shndx = sym->st_shndx;
+			out->bind = ELF64_ST_BIND(sym->st_info);
+			out->type = ELF64_ST_TYPE(sym->st_info);
+			out->visibility = ELF64_ST_VISIBILITY(sym->st_other);
+			return true;
+		}
+		if (h2 & 1)
+			break;
+	}
+	return false;
+}
+
+/*
+ * Parse the DT_GNU_HASH of obj into gh on first use. Returns false if
+ * obj has none, shiva_gnu_hash_lookup() can't be used on gh then.
+ */
+bool
+shiva_gnu_hash_ready(struct shiva_gnu_hash *gh, elfobj_t *obj)
+{
+	if (gh->state == SHIVA_GNU_HASH_UNINIT)
+		(void) shiva_gnu_hash_init(obj, gh);
+	return gh->state == SHIVA_GNU_HASH_READY;
+}
+
+/*
+ * Drop in replacement for elf_symbol_by_name(). gh caches the parsed
+ * DT_GNU_HASH of obj and must be zeroed before its first use.
+ */
+bool
+shiva_symbol_by_name(struct shiva_gnu_hash *gh, elfobj_t *obj, const char *name,
+    struct elf_symbol *out)
+{
+	if (gh->state == SHIVA_GNU_HASH_UNINIT)
+		(void) shiva_gnu_hash_init(obj, gh);
+	if (gh->state == SHIVA_GNU_HASH_READY &&
+	    shiva_gnu_hash_lookup(gh, name, out) == true)
+		return true;
+	return elf_symbol_by_name(obj, name, out);
+}
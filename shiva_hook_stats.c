@@ -0,0 +1,229 @@
+/*
+ * shiva_hook_stats.c - Hit counters and latency histograms of hooks.
+ *
+ * SHIVA_HOOK_STATS=<path> maps <path> (preferably on a tmpfs such as
+ * /dev/shm) MAP_SHARED, laid out as described in shiva_hook_stats.h, and
+ * counts every call into a shiva_trace handler through a hook stub
+ * (CALL, JMP, TRAMPOLINE and PLTGOT breakpoints) and every call to a
+ * patch function that replaces a function of the target, while the
+ * target runs. tools/shiva-stats reads the counters from outside.
+ *
+ * Handler hits are counted by shiva_trace_frame_push(). With
+ * SHIVA_HOOK_STATS_LATENCY=1 the hook stubs also pop their frame through
+ * shiva_trace_frame_pop(), which adds the ticks of the virtual counter
+ * spent between the two (The handler and anything it calls, including
+ * the original function) to the stripe and to the log2 histogram of the
+ * entry.
+ *
+ * Patch functions are counted by a stub in the trace island (See
+ * shiva_trace_hit_stub()) that the callsites and the detour of the
+ * function are linked to instead, a single LSE stadd on the stripe of
+ * the calling thread before it branches to the patch. Without LSE
+ * atomics (HWCAP_ATOMICS) the patch functions are not counted, nor are
+ * they timed, since their return is never seen. Modules with counted
+ * patch entries aren't cached.
+ *
+ * SHIVA_HOOK_STATS_HOOKS overrides the number of entries.
+ */
+#include "shiva.h"
+
+#define SHIVA_HOOK_STATS_DEFAULT_HOOKS	256
+
+#ifndef HWCAP_ATOMICS
+#define HWCAP_ATOMICS	(1 << 8)
+#endif
+
+static uint64_t
+shiva_hook_stats_env(const char *name, uint64_t def)
+{
+	char *s = getenv(name), *end;
+	uint64_t v;
+
+	if (s == NULL || s[0] == '\0')
+		return def;
+	v = strtoul(s, &end, 0);
+	if (*end != '\0' || v == 0 || v > UINT32_MAX) {
+		fprintf(stderr, "%s: invalid value '%s', using %lu\n", name, s, def);
+		return def;
+	}
+	return v;
+}
+
+bool
+shiva_hook_stats_init(struct shiva_ctx *ctx)
+{
+	struct shiva_hook_stats_hdr *hdr;
+	uint64_t hooks, offset;
+	size_t len;
+	char *path, *env;
+	void *mem;
+	int fd;
+
+	path = getenv("SHIVA_HOOK_STATS");
+	if (path == NULL || path[0] == '\0')
+		return true;
+	hooks = shiva_hook_stats_env("SHIVA_HOOK_STATS_HOOKS",
+	    SHIVA_HOOK_STATS_DEFAULT_HOOKS);
+	offset = ELF_PAGEALIGN(sizeof(*hdr), SHIVA_HOOK_STATS_CACHELINE);
+	len = ELF_PAGEALIGN(offset + hooks * sizeof(struct shiva_hook_stats_entry),
+	    PAGE_SIZE);
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "SHIVA_HOOK_STATS: open(%s) failed: %s\n", path,
+		    strerror(errno));
+		return false;
+	}
+	if (ftruncate(fd, len) < 0) {
+		fprintf(stderr, "SHIVA_HOOK_STATS: ftruncate(%s, %zu) failed: %s\n",
+		    path, len, strerror(errno));
+		close(fd);
+		return false;
+	}
+	mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "SHIVA_HOOK_STATS: mmap(%s) failed: %s\n", path,
+		    strerror(errno));
+		return false;
+	}
+	hdr = mem;
+	hdr->version = SHIVA_HOOK_STATS_VERSION;
+	hdr->pid = getpid();
+	hdr->entry_size = sizeof(struct shiva_hook_stats_entry);
+	hdr->entry_count = hooks;
+	hdr->entry_used = 0;
+	hdr->stripes = SHIVA_HOOK_STATS_STRIPES;
+	env = getenv("SHIVA_HOOK_STATS_LATENCY");
+	hdr->flags = (env != NULL && strcmp(env, "1") == 0) ?
+	    SHIVA_HOOK_STATS_F_LATENCY : 0;
+	hdr->entry_offset = offset;
+	hdr->clock_freq = shiva_trace_ring_clock_freq();
+	/*
+	 * A reader must not trust the header until it sees the magic
+	 */
+	__atomic_store_n(&hdr->magic, SHIVA_HOOK_STATS_MAGIC, __ATOMIC_RELEASE);
+
+	ctx->hook_stats.hdr = hdr;
+	ctx->hook_stats.len = len;
+	shiva_debug("Hook stats %s: %lu hooks%s\n", path, hooks,
+	    (hdr->flags & SHIVA_HOOK_STATS_F_LATENCY) ? ", with latency" : "");
+	return true;
+}
+
+bool
+shiva_hook_stats_latency(struct shiva_ctx *ctx)
+{
+	return ctx->hook_stats.hdr != NULL &&
+	    (ctx->hook_stats.hdr->flags & SHIVA_HOOK_STATS_F_LATENCY) != 0;
+}
+
+/*
+ * Hand out the entry of a hook that is being installed. Returns NULL if
+ * stats are off, or if there is no entry left, in which case the hook
+ * is installed without one.
+ */
+struct shiva_hook_stats_entry *
+shiva_hook_stats_alloc(struct shiva_ctx *ctx, uint32_t type, uint32_t bp_type,
+    uint64_t addr, uint64_t fn, const char *name)
+{
+	struct shiva_hook_stats_hdr *hdr = ctx->hook_stats.hdr;
+	struct shiva_hook_stats_entry *entry;
+	uint32_t index;
+
+	if (hdr == NULL)
+		return NULL;
+	index = __atomic_fetch_add(&hdr->entry_used, 1, __ATOMIC_RELAXED);
+	if (index >= hdr->entry_count) {
+		__atomic_fetch_add(&hdr->dropped, 1, __ATOMIC_RELAXED);
+		shiva_debug("No hook stats entry left for %#lx\n", addr);
+		return NULL;
+	}
+	entry = shiva_hook_stats_entry_by_index(hdr, index);
+	entry->bp_type = bp_type;
+	entry->addr = addr;
+	entry->fn = fn;
+	if (name != NULL)
+		strncpy(entry->name, name, sizeof(entry->name) - 1);
+	__atomic_store_n(&entry->type, type, __ATOMIC_RELEASE);
+	return entry;
+}
+
+/*
+ * Called from shiva_trace_frame_push() on every handler hit, returns the
+ * time of the hit if latency is tracked. Like its caller it must not
+ * touch the SIMD registers.
+ */
+uint64_t __attribute__((target("general-regs-only")))
+shiva_hook_stats_enter(struct shiva_hook_stats_entry *entry, uint64_t tp)
+{
+	__atomic_fetch_add(&entry->stripes[shiva_hook_stats_stripe(tp)].hits, 1,
+	    __ATOMIC_RELAXED);
+	if ((ctx_global->hook_stats.hdr->flags & SHIVA_HOOK_STATS_F_LATENCY) == 0)
+		return 0;
+	return shiva_trace_ring_clock();
+}
+
+/*
+ * Called from shiva_trace_frame_pop() once the handler has returned,
+ * with the return value of the handler still to be handed back.
+ */
+void __attribute__((target("general-regs-only")))
+shiva_hook_stats_leave(struct shiva_hook_stats_entry *entry, uint64_t tp, uint64_t t0)
+{
+	uint64_t ticks = shiva_trace_ring_clock() - t0;
+	uint32_t bucket = ticks < 2 ? 0 : 63 - __builtin_clzl(ticks);
+
+	__atomic_fetch_add(&entry->stripes[shiva_hook_stats_stripe(tp)].time, ticks,
+	    __ATOMIC_RELAXED);
+	__atomic_fetch_add(&entry->latency[bucket], 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/*
+ * Called by patch_link_call_vaddr() with the address within the module
+ * that the calls and the detour of link go to, returns the address that
+ * they are linked to instead: the counting stub of the patch function,
+ * or target_vaddr itself if it isn't counted.
+ */
+uint64_t
+shiva_hook_stats_patch_link(struct shiva_module *linker, struct shiva_module_link *link,
+    uint64_t target_vaddr)
+{
+#if __aarch64__
+	struct shiva_ctx *ctx = linker->ctx;
+	struct shiva_hook_stats_entry *entry;
+	shiva_error_t error;
+	uint64_t hwcap;
+	uint8_t *stub;
+
+	if (ctx->hook_stats.hdr == NULL)
+		return target_vaddr;
+	if (link->stats_stub != 0)
+		return link->stats_stub;
+	if (shiva_auxv_hwcap(ctx, &hwcap, NULL) == false || (hwcap & HWCAP_ATOMICS) == 0) {
+		shiva_debug("No LSE atomics, not counting calls to %s\n", link->name);
+		return target_vaddr;
+	}
+	entry = shiva_hook_stats_alloc(ctx, SHIVA_HOOK_STATS_PATCH, 0,
+	    link->target_vaddr + ctx->ulexec.base_vaddr, target_vaddr, link->name);
+	if (entry == NULL)
+		return target_vaddr;
+	stub = shiva_trace_hit_stub(ctx, &entry->stripes[0].hits, target_vaddr, &error);
+	if (stub == NULL) {
+		fprintf(stderr, "Not counting calls to %s: %s\n", link->name,
+		    shiva_error_msg(&error));
+		return target_vaddr;
+	}
+	/*
+	 * The stub lives in the trace island, which the patch cache knows
+	 * nothing about.
+	 */
+	shiva_module_cache_invalidate(linker, "patch entries are counted");
+	link->stats_stub = (uint64_t)stub;
+	shiva_debug("Calls to %s are counted by %p\n", link->name, stub);
+	return link->stats_stub;
+#else
+	return target_vaddr;
+#endif
+}
@@ -0,0 +1,95 @@
+#ifndef _SHIVA_HOOK_STATS_H_
+#define _SHIVA_HOOK_STATS_H_
+
+/*
+ * Layout of the shared memory hook statistics (See shiva_hook_stats.c).
+ * This header is shared between the Shiva interpreter and
+ * tools/shiva-stats, so it must not depend on anything in shiva.h.
+ *
+ * File layout:
+ * [shiva_hook_stats_hdr]
+ * [shiva_hook_stats_entry] * entry_count
+ *
+ * Every shiva_trace hook stub and every patched function entry gets an
+ * entry of its own when it is installed. The counters of an entry are
+ * split into stripes, each in a cache line of its own, and a thread only
+ * ever adds to the stripe that its thread pointer hashes to (See
+ * shiva_hook_stats_stripe()), so threads that hit the same hook on
+ * different CPUs rarely share a line. All counters are updated with
+ * relaxed atomic adds, a reader sums the stripes. An entry is published
+ * by a store-release of its type, entries with a type of 0 are not in
+ * use yet.
+ */
+#include <stdint.h>
+
+#define SHIVA_HOOK_STATS_MAGIC		0x54534b48 /* "HKST" */
+#define SHIVA_HOOK_STATS_VERSION	1
+#define SHIVA_HOOK_STATS_CACHELINE	64
+#define SHIVA_HOOK_STATS_STRIPES	16
+#define SHIVA_HOOK_STATS_BUCKETS	64
+#define SHIVA_HOOK_STATS_NAME_LEN	40
+
+/*
+ * shiva_hook_stats_hdr.flags
+ */
+#define SHIVA_HOOK_STATS_F_LATENCY	(1U << 0) /* time and latency[] are kept */
+
+/*
+ * shiva_hook_stats_entry.type
+ */
+#define SHIVA_HOOK_STATS_HANDLER	1 /* a shiva_trace handler stub */
+#define SHIVA_HOOK_STATS_PATCH		2 /* the entry of a patch function */
+
+struct shiva_hook_stats_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	uint32_t entry_size;
+	uint32_t entry_count;
+	uint32_t entry_used; /* entries handed out so far */
+	uint32_t stripes;
+	uint32_t flags;
+	uint64_t entry_offset; /* of the first entry, from the start of the file */
+	uint64_t clock_freq; /* ticks per second of time and latency[], 0 if unknown */
+	uint64_t dropped; /* hooks that found no entry left */
+} __attribute__((aligned(SHIVA_HOOK_STATS_CACHELINE)));
+
+struct shiva_hook_stats_stripe {
+	uint64_t hits;
+	uint64_t time; /* ticks spent within the hook */
+} __attribute__((aligned(SHIVA_HOOK_STATS_CACHELINE)));
+
+struct shiva_hook_stats_entry {
+	uint32_t type;
+	uint32_t bp_type; /* shiva_trace_bp_type_t of a handler */
+	uint64_t addr; /* the hooked address */
+	uint64_t fn; /* the handler, or the patch function */
+	char name[SHIVA_HOOK_STATS_NAME_LEN];
+	struct shiva_hook_stats_stripe stripes[SHIVA_HOOK_STATS_STRIPES];
+	/*
+	 * latency[i] counts the calls that took [2^i, 2^(i+1)) ticks,
+	 * latency[0] those that took less than 2.
+	 */
+	uint64_t latency[SHIVA_HOOK_STATS_BUCKETS];
+} __attribute__((aligned(SHIVA_HOOK_STATS_CACHELINE)));
+
+static inline struct shiva_hook_stats_entry *
+shiva_hook_stats_entry_by_index(struct shiva_hook_stats_hdr *hdr, uint32_t index)
+{
+	return (struct shiva_hook_stats_entry *)((uint8_t *)hdr + hdr->entry_offset +
+	    (uint64_t)hdr->entry_size * index);
+}
+
+/*
+ * The stripe of the thread with the thread pointer tp. Thread pointers
+ * lie within the stacks or the static TLS blocks of their threads, which
+ * are at least a page apart. The patch entry stubs compute the same
+ * hash inline (See shiva_trace_hit_stub()).
+ */
+static inline uint32_t
+shiva_hook_stats_stripe(uint64_t tp)
+{
+	return ((tp ^ (tp >> 20)) >> 12) & (SHIVA_HOOK_STATS_STRIPES - 1);
+}
+
+#endif
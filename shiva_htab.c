@@ -0,0 +1,130 @@
+/*
+ * shiva_htab.c - String keyed hash table for the linker caches.
+ *
+ * Open addressing with linear probing over a power of 2 sized vector.
+ * The table never fills up, instead it doubles once it is 3/4 full, so
+ * there is no limit on the number of keys. Callers size the table up
+ * front from the number of keys they expect (Usually the symbol count of
+ * the module), which keeps the common path from ever rehashing.
+ *
+ * Keys are not copied, they must outlive the table. As with hsearch(3)
+ * the first entry of a key wins, and entries are never removed.
+ */
+#include "shiva.h"
+
+#define SHIVA_HTAB_MIN_SIZE	16
+
+static inline uint32_t
+shiva_htab_hash(const char *key)
+{
+	const uint8_t *s = (const uint8_t *)key;
+	uint32_t h = 2166136261U; /* FNV-1a */
+
+	for (; *s != '\0'; s++) {
+		h ^= *s;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void
+shiva_htab_alloc(struct shiva_htab *htab, size_t size)
+{
+	htab->vec = shiva_malloc(size * sizeof(*htab->vec));
+	memset(htab->vec, 0, size * sizeof(*htab->vec));
+	htab->size = size;
+	htab->count = 0;
+	return;
+}
+
+/*
+ * Size the table for count keys, at a load of at most 1/2.
+ */
+void
+shiva_htab_init(struct shiva_htab *htab, size_t count)
+{
+	size_t size = SHIVA_HTAB_MIN_SIZE;
+
+	while (size < count * 2)
+		size <<= 1;
+	free(htab->vec);
+	shiva_htab_alloc(htab, size);
+	return;
+}
+
+void
+shiva_htab_destroy(struct shiva_htab *htab)
+{
+	free(htab->vec);
+	memset(htab, 0, sizeof(*htab));
+	return;
+}
+
+static struct shiva_htab_entry *
+shiva_htab_slot(struct shiva_htab *htab, const char *key, uint32_t hash)
+{
+	struct shiva_htab_entry *entry;
+	size_t i, mask = htab->size - 1;
+
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		entry = &htab->vec[i];
+		if (entry->key == NULL)
+			return entry;
+		if (entry->hash == hash && strcmp(entry->key, key) == 0)
+			return entry;
+	}
+}
+
+static void
+shiva_htab_grow(struct shiva_htab *htab)
+{
+	struct shiva_htab_entry *old = htab->vec, *entry;
+	size_t i, old_size = htab->size;
+
+	shiva_debug("Growing hash table %p from %zu to %zu slots\n", htab,
+	    old_size, old_size << 1);
+	shiva_htab_alloc(htab, old_size << 1);
+	for (i = 0; i < old_size; i++) {
+		if (old[i].key == NULL)
+			continue;
+		entry = shiva_htab_slot(htab, old[i].key, old[i].hash);
+		*entry = old[i];
+		htab->count++;
+	}
+	free(old);
+	return;
+}
+
+void *
+shiva_htab_find(struct shiva_htab *htab, const char *key)
+{
+	struct shiva_htab_entry *entry;
+
+	if (htab->vec == NULL || key == NULL)
+		return NULL;
+	entry = shiva_htab_slot(htab, key, shiva_htab_hash(key));
+	return entry->key == NULL ? NULL : entry->data;
+}
+
+/*
+ * Returns false if key is already in the table, its data is left as is.
+ */
+bool
+shiva_htab_insert(struct shiva_htab *htab, const char *key, void *data)
+{
+	struct shiva_htab_entry *entry;
+	uint32_t hash = shiva_htab_hash(key);
+
+	if (htab->vec == NULL)
+		shiva_htab_alloc(htab, SHIVA_HTAB_MIN_SIZE);
+	else if ((htab->count + 1) * 4 > htab->size * 3)
+		shiva_htab_grow(htab);
+	entry = shiva_htab_slot(htab, key, hash);
+	if (entry->key != NULL)
+		return false;
+	entry->key = key;
+	entry->hash = hash;
+	entry->data = data;
+	htab->count++;
+	return true;
+}
@@ -0,0 +1,171 @@
+/*
+ * shiva_link_map.c - Shared objects of the target, as seen by the RTLD.
+ *
+ * Once LDSO has run, DT_DEBUG of the target points to its r_debug, and
+ * r_debug.r_map to the link_map list of every object it loaded, in
+ * symbol search order. Each link_map holds the load bias (l_addr) and
+ * the dynamic segment (l_ld) of its object, which is all that's needed
+ * to find a shared object or an exported symbol without going through
+ * /proc/self/maps or the files on disk. The symbols are looked up with
+ * the DT_GNU_HASH table of each object, which is already mapped.
+ *
+ * None of this is valid before shiva_post_linker() runs. Everything here
+ * may run with the thread pointer of the targets libc, so system calls
+ * are made directly (See shiva_syscall.h).
+ */
+#include "shiva.h"
+#include "shiva_syscall.h"
+#include <link.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+static struct link_map *
+shiva_link_map_head(struct shiva_ctx *ctx)
+{
+	struct r_debug *r_debug;
+	uint64_t dbg;
+
+	if (shiva_target_dynamic_get(ctx, DT_DEBUG, &dbg) == false || dbg == 0)
+		return NULL;
+	r_debug = (struct r_debug *)dbg;
+	return r_debug->r_map;
+}
+
+static bool
+shiva_link_map_same_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+
+	if (strcmp(a, b) == 0)
+		return true;
+	if (shiva_syscall(SYS_newfstatat, AT_FDCWD, (long)a, (long)&sa, 0, 0, 0) < 0 ||
+	    shiva_syscall(SYS_newfstatat, AT_FDCWD, (long)b, (long)&sb, 0, 0, 0) < 0)
+		return false;
+	return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/*
+ * Find the load bias of the shared object at so_path (A realpath, see
+ * shiva_so.c). The l_name of a link_map is the path LDSO opened, which
+ * may be a symlink to so_path, so the files are compared by inode.
+ */
+bool
+shiva_link_map_so_base(struct shiva_ctx *ctx, const char *so_path, uint64_t *base)
+{
+	struct link_map *lm;
+
+	for (lm = shiva_link_map_head(ctx); lm != NULL; lm = lm->l_next) {
+		if (lm->l_name == NULL || lm->l_name[0] == '\0')
+			continue;
+		if (shiva_link_map_same_file(lm->l_name, so_path) == false)
+			continue;
+		*base = lm->l_addr;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * glibc relocates the pointers in the dynamic segment of an object in
+ * place, musl leaves them as they are in the file.
+ */
+static inline void *
+shiva_link_map_ptr(struct link_map *lm, uint64_t value)
+{
+	return (void *)(value < lm->l_addr ? value + lm->l_addr : value);
+}
+
+static bool
+shiva_link_map_gnu_hash(struct link_map *lm, struct shiva_gnu_hash *gh)
+{
+	ElfW(Dyn) *dyn;
+	uint64_t gnu_hash = 0, symtab = 0, strtab = 0;
+
+	memset(gh, 0, sizeof(*gh));
+	if (lm->l_ld == NULL)
+		return false;
+	for (dyn = lm->l_ld; dyn->d_tag != DT_NULL; dyn++) {
+		switch(dyn->d_tag) {
+		case DT_GNU_HASH:
+			gnu_hash = dyn->d_un.d_ptr;
+			break;
+		case DT_SYMTAB:
+			symtab = dyn->d_un.d_ptr;
+			break;
+		case DT_STRTAB:
+			strtab = dyn->d_un.d_ptr;
+			break;
+		default:
+			break;
+		}
+	}
+	if (gnu_hash == 0 || symtab == 0 || strtab == 0)
+		return false;
+	return shiva_gnu_hash_setup(gh, shiva_link_map_ptr(lm, gnu_hash),
+	    shiva_link_map_ptr(lm, symtab), shiva_link_map_ptr(lm, strtab));
+}
+
+/*
+ * Look up the exported symbol symname in the shared objects of the
+ * target, in the order LDSO searches them, the first definition wins.
+ * out->value is relative to *base, the load bias of the object that
+ * defines it. The target itself is not searched, nor are objects
+ * without a DT_GNU_HASH.
+ */
+bool
+shiva_link_map_resolve_symbol(struct shiva_ctx *ctx, const char *symname,
+    struct elf_symbol *out, uint64_t *base)
+{
+	struct shiva_gnu_hash gh;
+	struct link_map *lm;
+
+	for (lm = shiva_link_map_head(ctx); lm != NULL; lm = lm->l_next) {
+		if (lm->l_name == NULL || lm->l_name[0] == '\0')
+			continue;
+		if (shiva_link_map_gnu_hash(lm, &gh) == false) {
+			shiva_debug("No DT_GNU_HASH in '%s'\n", lm->l_name);
+			continue;
+		}
+		if (shiva_gnu_hash_lookup(&gh, symname, out) == false)
+			continue;
+		if (out->bind != STB_GLOBAL && out->bind != STB_WEAK)
+			continue;
+		*base = lm->l_addr;
+		shiva_debug("Found symbol '%s' in '%s' (base %#lx)\n", symname,
+		    lm->l_name, lm->l_addr);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * The arguments that glibc passes to IFUNC resolvers on aarch64 (See
+ * <sys/ifunc.h>), other resolvers only look at the first one.
+ */
+struct shiva_ifunc_arg {
+	uint64_t size;
+	uint64_t hwcap;
+	uint64_t hwcap2;
+};
+
+#define SHIVA_IFUNC_ARG_HWCAP	(1ULL << 62)
+
+/*
+ * Run the STT_GNU_IFUNC resolver at the absolute address resolver, and
+ * return the implementation it selects, or 0. The object that defines
+ * it must have been relocated by LDSO.
+ */
+uint64_t
+shiva_link_map_ifunc_resolve(struct shiva_ctx *ctx, uint64_t resolver)
+{
+	uint64_t (*fn)(uint64_t, struct shiva_ifunc_arg *) = (void *)resolver;
+	struct shiva_ifunc_arg arg;
+	uint64_t addr;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.size = sizeof(arg);
+	(void) shiva_auxv_hwcap(ctx, &arg.hwcap, &arg.hwcap2);
+	addr = fn(arg.hwcap | SHIVA_IFUNC_ARG_HWCAP, &arg);
+	shiva_debug("IFUNC resolver %#lx selected %#lx\n", resolver, addr);
+	return addr;
+}
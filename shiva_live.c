@@ -0,0 +1,1316 @@
+/*
+ * shiva_live.c - Linking a patch into a target that is already running.
+ *
+ * Shiva lives within the address space of the target, so a live patch
+ * is linked from within the target itself: a process started with
+ * SHIVA_LIVE=1 catches SHIVA_LIVE_SIGNAL, which "shiva -l <pid> <patch>"
+ * sends after dropping the path of the patch into a request file. The
+ * handler only wakes the worker thread of Shiva, which links the patch
+ * into free address space within call26 range of the target .text, and
+ * queues every relinked instruction into a patch transaction.
+ *
+ * A transaction that only replaces instructions that the ARM ARM allows
+ * to be modified concurrently with their execution (b, bl, nop and a few
+ * others, see shiva_patch_txn_atomic_ok()), e.g. one that relinks call26
+ * sites alone, is committed while the target keeps running. Each write
+ * is a single 4 byte store, the commit invalidates the instruction cache
+ * to the point of unification for the inner shareable domain, and a
+ * SYNC_CORE membarrier then makes every core execute a context
+ * synchronizing event, which costs a round of IPIs rather than a pause
+ * of every thread.
+ *
+ * Any other transaction, e.g. one that replaces an adrp, is committed
+ * while every other thread is parked within the SHIVA_LIVE_STOP_SIGNAL
+ * handler, as is every transaction with SHIVA_LIVE_QUIESCE=1 or on a
+ * kernel without the membarrier. Where the membarrier is available,
+ * relinked adrp pairs are still routed through veneers so that only the
+ * adrp is replaced (See install_aarch64_xref_veneer()). Otherwise a
+ * thread that was stopped between an adrp and the instruction that
+ * consumes it would combine the old page with the new offset, so it is
+ * rewound to re-execute the new adrp, which has no side effects. The
+ * parked threads leave the handler through sigreturn, which is context
+ * synchronizing, so they can't run stale instructions either.
+ *
+ * The worker is created by shiva_live_init() before control is passed to
+ * LDSO, so it runs with the thread pointer of musl and never runs any
+ * code of the target, and every thread of the target keeps serving
+ * while a request is handled. Requests that arrive while a patch is
+ * already being linked (i.e. through shiva_live_patch()) are answered
+ * with "busy" and retried by shiva -l. A forked child has no worker,
+ * and ignores requests.
+ *
+ * "shiva -l <pid> -s <slot> <patch>" links patch as the next version of
+ * a named slot. The new version is linked alongside the one in the slot,
+ * and a single transaction both reverts every write of the old version
+ * (Its undo transaction, see shiva_patch_txn_undo()) and makes those of
+ * the new one, so each call site and GOT entry flips straight from the
+ * old patch to the new one. "shiva -l <pid> -r <slot>" rolls the slot
+ * back to the version before, or unlinks the patch if there is none. The
+ * state that a version keeps in its .data and .bss isn't carried over.
+ *
+ * The old version is retired rather than unmapped, since threads may
+ * still be running it or return into it. Its image is reclaimed once
+ * every thread of /proc/self/task has passed a quiescent point after
+ * the flip: SHIVA_LIVE_SCAN_SIGNAL has each thread look at its registers
+ * and its stack, and a thread with no word that points into a retired
+ * patch can never run it again, as nothing links to it anymore. Each
+ * thread notes the grace period that it passed in its trace_tls record
+ * (See shiva_trace_thread.c), a thread that has none (The table is
+ * full) holds up the reclaim. The
+ * check is conservative, a stray word only delays the reclaim. Nothing
+ * waits for the threads: shiva -l keeps asking the target to reclaim,
+ * and a version that is still in use is reclaimed on a later request.
+ * Function pointers to a retired version that the target keeps in its
+ * own data are not found, a patch that hands them out must not be
+ * swapped.
+ */
+#include "shiva.h"
+#include "shiva_syscall.h"
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <time.h>
+
+#define SHIVA_LIVE_SIGNAL	(SIGRTMAX - 1) /* a live patch request */
+#define SHIVA_LIVE_STOP_SIGNAL	SIGRTMAX /* parks a thread during the commit */
+#define SHIVA_LIVE_SCAN_SIGNAL	(SIGRTMAX - 2) /* looks for retired patches */
+#define SHIVA_LIVE_MAX_THREADS	256
+#define SHIVA_LIVE_QUIESCE_MS	500 /* how long a thread may take to park */
+#define SHIVA_LIVE_RETRIES	8
+#define SHIVA_LIVE_TIMEOUT	10 /* seconds that shiva -l waits for a reply */
+#define SHIVA_LIVE_BRANCH_RANGE	(128UL << 20) /* reach of a call26 */
+#define SHIVA_LIVE_MAX_SLOTS	32
+#define SHIVA_LIVE_MAX_VERSIONS	8 /* earlier versions a slot can roll back to */
+#define SHIVA_LIVE_SLOT_NAMELEN	64
+#define SHIVA_LIVE_MAX_RETIRED	32
+#define SHIVA_LIVE_MAX_RANGES	(SHIVA_NUMA_MAX_NODES + 2) /* of a patch */
+#define SHIVA_LIVE_STACK_SCAN	(8UL << 20) /* how much of a stack is looked at */
+#define SHIVA_LIVE_RECLAIM_MS	100 /* between the reclaim requests of shiva -l */
+#define SHIVA_LIVE_REQUEST_MAX	(PATH_MAX + SHIVA_LIVE_SLOT_NAMELEN + 16)
+#define SHIVA_LIVE_WORKER_STACK	(8UL << 20)
+
+struct shiva_live_thread {
+	pid_t tid;
+	uint64_t pc; /* where the thread was interrupted */
+	int parked;
+	int rewind; /* resume at the adrp before pc */
+};
+
+struct shiva_live_dirent {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * A named patch that can be swapped for another version of itself.
+ */
+struct shiva_live_slot {
+	char name[SHIVA_LIVE_SLOT_NAMELEN];
+	struct shiva_module *linker; /* the version that is linked in */
+	char *path;
+	char *history[SHIVA_LIVE_MAX_VERSIONS]; /* paths of the earlier versions */
+	size_t depth;
+	unsigned int version;
+	struct shiva_patch_txn undo; /* reverts the writes of linker */
+};
+
+struct shiva_live_retired {
+	struct shiva_module *linker;
+	uint64_t ranges[SHIVA_LIVE_MAX_RANGES][2];
+	size_t range_count;
+	uint64_t seq; /* the first grace period that looks for it */
+};
+
+static struct {
+	struct shiva_live_thread threads[SHIVA_LIVE_MAX_THREADS];
+	size_t count;
+	int stop;
+	bool busy;
+	char request_path[PATH_MAX];
+	struct shiva_live_slot slots[SHIVA_LIVE_MAX_SLOTS];
+	pthread_t worker;
+	pid_t worker_tid;
+	pid_t pid; /* of the process that has the worker */
+	int wake[2]; /* SHIVA_LIVE_SIGNAL wakes the worker through this pipe */
+} live;
+
+/*
+ * A thread has passed a quiescent point in grace period seq once it found
+ * no word pointing into the ranges of a retired patch.
+ */
+static struct {
+	/*
+	 * Odd while retired is being changed, which the scan handler
+	 * reads from.
+	 */
+	uint64_t seq;
+	struct shiva_live_retired retired[SHIVA_LIVE_MAX_RETIRED];
+	size_t retired_count;
+} grace;
+
+static void
+shiva_live_request_path(char *buf, size_t len, pid_t pid)
+{
+	char *dir = getenv("SHIVA_LIVE_DIR");
+
+	snprintf(buf, len, "%s/shiva-live.%d", dir != NULL ? dir : "/tmp", pid);
+	return;
+}
+
+static inline void
+shiva_live_sleep_ms(long ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+
+	nanosleep(&ts, NULL);
+	return;
+}
+
+static void
+shiva_live_stop_handler(int sig, siginfo_t *si, void *uc)
+{
+	ucontext_t *ucp = uc;
+	pid_t tid = syscall(SYS_gettid);
+	size_t i, count;
+
+	if (__atomic_load_n(&live.stop, __ATOMIC_ACQUIRE) == 0)
+		return;
+	count = __atomic_load_n(&live.count, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count; i++) {
+		if (live.threads[i].tid == tid)
+			break;
+	}
+	if (i == count)
+		return;
+#if __aarch64__
+	live.threads[i].pc = ucp->uc_mcontext.pc;
+#endif
+	__atomic_store_n(&live.threads[i].parked, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&live.stop, __ATOMIC_ACQUIRE) != 0)
+		sched_yield();
+#if __aarch64__
+	if (live.threads[i].rewind != 0)
+		ucp->uc_mcontext.pc -= 4;
+#endif
+	__atomic_store_n(&live.threads[i].parked, 0, __ATOMIC_RELEASE);
+	return;
+}
+
+/*
+ * Call fn for every thread of /proc/self/task but self and the worker,
+ * until it returns false. This runs while other threads are parked,
+ * possibly within the musl heap, so the directory is read with
+ * getdents64 instead of opendir().
+ */
+static bool
+shiva_live_each_thread(pid_t self, bool (*fn)(pid_t, void *, shiva_error_t *),
+    void *arg, shiva_error_t *error)
+{
+	struct shiva_live_dirent *de;
+	char buf[4096];
+	long n, off;
+	bool res = true;
+	pid_t tid;
+	int fd;
+
+	fd = open("/proc/self/task", O_RDONLY|O_DIRECTORY);
+	if (fd < 0) {
+		shiva_error_set(error, "open /proc/self/task failed: %s\n", strerror(errno));
+		return false;
+	}
+	while (res == true && (n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n && res == true; off += de->d_reclen) {
+			de = (struct shiva_live_dirent *)&buf[off];
+			if (de->d_name[0] == '.')
+				continue;
+			tid = strtol(de->d_name, NULL, 10);
+			if (tid != self && tid != live.worker_tid)
+				res = fn(tid, arg, error);
+		}
+	}
+	close(fd);
+	return res;
+}
+
+static bool
+shiva_live_stop_thread(pid_t tid, void *arg, shiva_error_t *error)
+{
+	struct shiva_live_thread *t;
+	bool *added = arg;
+	size_t i;
+
+	for (i = 0; i < live.count; i++) {
+		if (live.threads[i].tid == tid)
+			return true;
+	}
+	if (live.count == SHIVA_LIVE_MAX_THREADS) {
+		shiva_error_set(error, "more than %d threads\n", SHIVA_LIVE_MAX_THREADS);
+		return false;
+	}
+	t = &live.threads[live.count];
+	memset(t, 0, sizeof(*t));
+	t->tid = tid;
+	__atomic_store_n(&live.count, live.count + 1, __ATOMIC_RELEASE);
+	if (syscall(SYS_tgkill, getpid(), tid, SHIVA_LIVE_STOP_SIGNAL) < 0) {
+		/*
+		 * The thread exited in the meantime.
+		 */
+		if (errno == ESRCH) {
+			t->parked = 1;
+			return true;
+		}
+		shiva_error_set(error, "tgkill %d failed: %s\n", tid, strerror(errno));
+		return false;
+	}
+	*added = true;
+	return true;
+}
+
+/*
+ * Signal every thread that isn't parked yet.
+ */
+static bool
+shiva_live_signal_threads(pid_t self, bool *added, shiva_error_t *error)
+{
+	*added = false;
+	return shiva_live_each_thread(self, shiva_live_stop_thread, added, error);
+}
+
+static bool
+shiva_live_wait_parked(shiva_error_t *error)
+{
+	size_t i;
+	int ms;
+
+	for (ms = 0;; ms++) {
+		for (i = 0; i < live.count; i++) {
+			if (__atomic_load_n(&live.threads[i].parked, __ATOMIC_ACQUIRE) == 0)
+				break;
+		}
+		if (i == live.count)
+			return true;
+		if (ms == SHIVA_LIVE_QUIESCE_MS)
+			break;
+		shiva_live_sleep_ms(1);
+	}
+	shiva_error_set(error, "thread %d did not stop within %dms\n",
+	    live.threads[i].tid, SHIVA_LIVE_QUIESCE_MS);
+	return false;
+}
+
+/*
+ * Let the parked threads go, and wait for them to leave the handler so
+ * that live.threads can be reused.
+ */
+static void
+shiva_live_release(void)
+{
+	size_t i;
+
+	__atomic_store_n(&live.stop, 0, __ATOMIC_RELEASE);
+	for (i = 0; i < live.count; i++) {
+		while (__atomic_load_n(&live.threads[i].parked, __ATOMIC_ACQUIRE) != 0 &&
+		    syscall(SYS_tgkill, getpid(), live.threads[i].tid, 0) == 0)
+			sched_yield();
+	}
+	__atomic_store_n(&live.count, 0, __ATOMIC_RELEASE);
+	return;
+}
+
+/*
+ * Park every thread except the calling one. Threads that are created
+ * while we wait are picked up by scanning /proc/self/task again, once a
+ * scan finds nothing new every thread of the process is parked.
+ */
+static bool
+shiva_live_quiesce(pid_t self, shiva_error_t *error)
+{
+	bool added;
+
+	__atomic_store_n(&live.count, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&live.stop, 1, __ATOMIC_RELEASE);
+	do {
+		if (shiva_live_signal_threads(self, &added, error) == false)
+			return false;
+		if (shiva_live_wait_parked(error) == false)
+			return false;
+	} while (added == true);
+	return true;
+}
+
+/*
+ * A thread interrupted at pc executed whichever version of the
+ * instruction at pc - 4 was there at the time. If both pc - 4 and pc
+ * are rewritten, then it's in the middle of an adrp pair.
+ */
+static bool
+shiva_live_mid_pair(struct shiva_patch_txn *txn, uint64_t pc)
+{
+	bool prev = false, cur = false;
+	size_t i;
+
+	for (i = 0; i < txn->count; i++) {
+		if (txn->writes[i].addr == pc - 4)
+			prev = true;
+		else if (txn->writes[i].addr == pc)
+			cur = true;
+	}
+	return prev && cur;
+}
+
+static inline bool
+shiva_live_in_shiva(struct shiva_ctx *ctx, uint64_t pc)
+{
+	struct shiva_mmap_entry map;
+
+	return shiva_maps_entry_by_addr(ctx, pc, &map) == true &&
+	    map.debugger_mapping == true;
+}
+
+/*
+ * Shiva only ever analyzes the target once. If the analysis was skipped
+ * (A cached patch image) or limited to the first patch (SHIVA_ANALYZE_LAZY)
+ * then it's redone over the entire .text.
+ */
+static bool
+shiva_live_analysis(struct shiva_ctx *ctx)
+{
+	bool res;
+
+	if (ctx->analysis.branches != NULL && ctx->analysis.lazy == false)
+		return true;
+	shiva_debug("Analyzing the target for a live patch\n");
+	if (shiva_arena_protect(&ctx->arena.analysis, PROT_READ|PROT_WRITE) == false)
+		return false;
+	ctx->flags |= SHIVA_OPTS_F_LIVE_ANALYSIS;
+	res = shiva_analyze_run(ctx);
+	ctx->flags &= ~SHIVA_OPTS_F_LIVE_ANALYSIS;
+	if (shiva_arena_protect(&ctx->arena.analysis, PROT_READ) == false)
+		return false;
+	return res;
+}
+
+/*
+ * Commit txn while every other thread is parked, for kernels without the
+ * SYNC_CORE membarrier or SHIVA_LIVE_QUIESCE=1.
+ */
+static bool
+shiva_live_commit_quiesced(struct shiva_ctx *ctx, struct shiva_patch_txn *txn,
+    ucontext_t *self_uc, shiva_error_t *error)
+{
+	pid_t self = syscall(SYS_gettid);
+	size_t i;
+	int attempt;
+
+	/*
+	 * A thread parked within Shiva may hold the musl heap lock that
+	 * the commit needs, so let it run on for a moment and try again.
+	 */
+	for (attempt = 0;; attempt++) {
+		if (shiva_live_quiesce(self, error) == false) {
+			shiva_live_release();
+			shiva_patch_txn_abort(txn);
+			return false;
+		}
+		for (i = 0; i < live.count; i++) {
+			if (shiva_live_in_shiva(ctx, live.threads[i].pc) == true)
+				break;
+		}
+		if (i == live.count)
+			break;
+		shiva_live_release();
+		if (attempt == SHIVA_LIVE_RETRIES) {
+			shiva_patch_txn_abort(txn);
+			shiva_error_set(error, "thread %d stays within Shiva\n",
+			    live.threads[i].tid);
+			return false;
+		}
+		shiva_live_sleep_ms(1);
+	}
+	for (i = 0; i < live.count; i++)
+		live.threads[i].rewind = shiva_live_mid_pair(txn, live.threads[i].pc);
+#if __aarch64__
+	if (self_uc != NULL && shiva_live_mid_pair(txn, self_uc->uc_mcontext.pc) == true)
+		self_uc->uc_mcontext.pc -= 4;
+#endif
+	if (shiva_patch_txn_commit(txn, error) == false) {
+		/*
+		 * Part of the target may already be linked to the patch,
+		 * which can't be undone safely.
+		 */
+		fprintf(stderr, "Live patch failed: %s\n", shiva_error_msg(error));
+		exit(EXIT_FAILURE);
+	}
+	shiva_live_release();
+	return true;
+}
+
+static inline bool
+shiva_live_retired_addr(uint64_t addr)
+{
+	struct shiva_live_retired *r;
+	size_t i, j;
+
+	for (i = 0; i < grace.retired_count; i++) {
+		r = &grace.retired[i];
+		for (j = 0; j < r->range_count; j++) {
+			if (addr >= r->ranges[j][0] && addr < r->ranges[j][1])
+				return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Is the thread that was interrupted with ucp (Or that is running, if
+ * ucp is NULL) at a quiescent point? Its stack is read upwards from sp
+ * a page at a time with process_vm_readv(), which fails rather than
+ * faults at the end of the mapping.
+ */
+static bool
+shiva_live_thread_quiescent(ucontext_t *ucp)
+{
+	uint64_t buf[PAGE_SIZE / sizeof(uint64_t)];
+	struct iovec local, remote;
+	uint64_t sp, addr;
+	ssize_t n;
+	size_t i;
+
+	sp = (uint64_t)__builtin_frame_address(0);
+#if __aarch64__
+	if (ucp != NULL) {
+		if (shiva_live_retired_addr(ucp->uc_mcontext.pc) == true)
+			return false;
+		for (i = 0; i < 31; i++) {
+			if (shiva_live_retired_addr(ucp->uc_mcontext.regs[i]) == true)
+				return false;
+		}
+		sp = ucp->uc_mcontext.sp;
+	}
+#endif
+	for (addr = sp & ~7UL; addr < sp + SHIVA_LIVE_STACK_SCAN; addr += n) {
+		local.iov_base = buf;
+		local.iov_len = ELF_PAGESTART(addr) + PAGE_SIZE - addr;
+		remote.iov_base = (void *)addr;
+		remote.iov_len = local.iov_len;
+		n = process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+		if (n <= 0)
+			break;
+		for (i = 0; i < n / sizeof(uint64_t); i++) {
+			if (shiva_live_retired_addr(buf[i]) == true)
+				return false;
+		}
+	}
+	return true;
+}
+
+static void
+shiva_live_scan_handler(int sig, siginfo_t *si, void *uc)
+{
+	struct shiva_trace_thread *thread;
+	pid_t tid = syscall(SYS_gettid);
+	uint64_t seq = __atomic_load_n(&grace.seq, __ATOMIC_ACQUIRE);
+	int saved_errno = errno;
+
+	if (seq & 1)
+		goto done;
+	thread = shiva_trace_thread_self_tid(ctx_global, tid);
+	if (thread == NULL)
+		goto done;
+	/*
+	 * Retired patches may have been reclaimed, or added, meanwhile.
+	 */
+	if (shiva_live_thread_quiescent(uc) == true &&
+	    __atomic_load_n(&grace.seq, __ATOMIC_ACQUIRE) == seq)
+		__atomic_store_n(&thread->grace_seq, seq, __ATOMIC_RELEASE);
+done:
+	errno = saved_errno;
+	return;
+}
+
+struct shiva_live_grace_scan {
+	uint64_t min_seq; /* the oldest grace period that a thread passed */
+	bool signal;
+};
+
+/*
+ * Look up the grace period that tid passed last, or send it
+ * SHIVA_LIVE_SCAN_SIGNAL. A thread that exits in the meantime is of no
+ * concern either way.
+ */
+static bool
+shiva_live_grace_thread(pid_t tid, void *arg, shiva_error_t *error)
+{
+	struct shiva_live_grace_scan *scan = arg;
+	struct shiva_trace_thread *thread;
+	uint64_t seq = 0;
+
+	(void) error;
+	if (scan->signal == true) {
+		(void) syscall(SYS_tgkill, getpid(), tid, SHIVA_LIVE_SCAN_SIGNAL);
+		return true;
+	}
+	thread = shiva_trace_thread_by_tid(ctx_global, tid);
+	if (thread != NULL)
+		seq = __atomic_load_n(&thread->grace_seq, __ATOMIC_ACQUIRE);
+	if (seq < scan->min_seq)
+		scan->min_seq = seq;
+	return true;
+}
+
+/*
+ * Reclaim each retired patch that every thread has passed a quiescent
+ * point for, and start a grace period for those that are left. self_uc
+ * is the context of the calling thread, which is checked right away
+ * unless it's the worker, which never runs a patch. Returns the number
+ * of retired patches left in *pending.
+ */
+static bool
+shiva_live_reclaim(ucontext_t *self_uc, size_t *pending, shiva_error_t *error)
+{
+	struct shiva_live_grace_scan scan = { .min_seq = UINT64_MAX, .signal = false };
+	struct shiva_live_retired *r;
+	pid_t self = syscall(SYS_gettid);
+	bool self_quiescent;
+	size_t i;
+
+	*pending = 0;
+	if (grace.retired_count == 0)
+		return true;
+	if (shiva_live_each_thread(self, shiva_live_grace_thread, &scan, error) == false)
+		return false;
+	self_quiescent = self == live.worker_tid || shiva_live_thread_quiescent(self_uc);
+	__atomic_store_n(&grace.seq, grace.seq + 1, __ATOMIC_RELEASE);
+	for (i = 0; i < grace.retired_count;) {
+		r = &grace.retired[i];
+		if (self_quiescent == false || scan.min_seq < r->seq) {
+			i++;
+			continue;
+		}
+		shiva_debug("Reclaiming retired live patch '%s'\n",
+		    elf_pathname(&r->linker->elfobj));
+		shiva_module_live_unlink(r->linker);
+		memmove(r, r + 1, (grace.retired_count - i - 1) * sizeof(*r));
+		grace.retired_count--;
+	}
+	__atomic_store_n(&grace.seq, grace.seq + 1, __ATOMIC_RELEASE);
+	*pending = grace.retired_count;
+	if (grace.retired_count == 0)
+		return true;
+	scan.signal = true;
+	return shiva_live_each_thread(self, shiva_live_grace_thread, &scan, error);
+}
+
+/*
+ * Retire linker, which nothing links to anymore since the commit. The
+ * grace period that looks for it is started by shiva_live_reclaim().
+ */
+static bool
+shiva_live_retire(struct shiva_module *linker, shiva_error_t *error)
+{
+	struct shiva_live_retired *r;
+
+	if (grace.retired_count == SHIVA_LIVE_MAX_RETIRED) {
+		shiva_error_set(error, "more than %d retired patches are still in use\n",
+		    SHIVA_LIVE_MAX_RETIRED);
+		return false;
+	}
+	__atomic_store_n(&grace.seq, grace.seq + 1, __ATOMIC_RELEASE);
+	r = &grace.retired[grace.retired_count++];
+	r->linker = linker;
+	r->range_count = shiva_module_live_ranges(linker, r->ranges, SHIVA_LIVE_MAX_RANGES);
+	__atomic_store_n(&grace.seq, grace.seq + 1, __ATOMIC_RELEASE);
+	r->seq = grace.seq;
+	shiva_debug("Retired live patch '%s' in grace period %lu\n",
+	    elf_pathname(&linker->elfobj), r->seq);
+	return true;
+}
+
+static struct shiva_live_slot *
+shiva_live_slot(const char *name, bool create)
+{
+	struct shiva_live_slot *slot, *free_slot = NULL;
+	size_t i;
+
+	for (i = 0; i < SHIVA_LIVE_MAX_SLOTS; i++) {
+		slot = &live.slots[i];
+		if (slot->name[0] == '\0') {
+			if (free_slot == NULL)
+				free_slot = slot;
+			continue;
+		}
+		if (strcmp(slot->name, name) == 0)
+			return slot;
+	}
+	if (create == false || free_slot == NULL)
+		return NULL;
+	memset(free_slot, 0, sizeof(*free_slot));
+	snprintf(free_slot->name, sizeof(free_slot->name), "%s", name);
+	return free_slot;
+}
+
+/*
+ * Replace old, a path of ctx->module.paths, with new. A NULL old adds
+ * new, a NULL new removes old.
+ */
+static void
+shiva_live_set_path(struct shiva_ctx *ctx, char *old, char *new)
+{
+	size_t i;
+
+	for (i = 0; old != NULL && i < ctx->module.count; i++) {
+		if (ctx->module.paths[i] == old)
+			break;
+	}
+	if (old == NULL || i == ctx->module.count) {
+		if (new == NULL)
+			return;
+		ctx->module.paths = shiva_realloc(ctx->module.paths,
+		    (ctx->module.count + 1) * sizeof(char *));
+		ctx->module.paths[ctx->module.count++] = new;
+	} else if (new != NULL) {
+		ctx->module.paths[i] = new;
+	} else {
+		memmove(&ctx->module.paths[i], &ctx->module.paths[i + 1],
+		    (ctx->module.count - i - 1) * sizeof(char *));
+		ctx->module.count--;
+	}
+	return;
+}
+
+static bool
+shiva_live_install(struct shiva_ctx *ctx, const char *path, struct shiva_live_slot *slot,
+    ucontext_t *self_uc, shiva_error_t *error)
+{
+	struct shiva_module *linker = NULL, *old = NULL;
+	struct shiva_patch_txn txn, undo, swap;
+	struct elf_section section;
+	uint64_t text_lo, text_hi, lo, hi;
+	uint64_t flags = 0;
+	char *env, *new_path = NULL;
+	shiva_error_t atomic_error;
+	bool atomic;
+
+	/*
+	 * We are tracing ourself, which fails if an external tracer
+	 * or a coredump owns the process.
+	 */
+	if (shiva_trace(ctx, 0, SHIVA_TRACE_OP_ATTACH, NULL, NULL, 0, error) == false)
+		return false;
+	if (shiva_trace(ctx, 0, SHIVA_TRACE_OP_REFRESH_MAPS, NULL, NULL, 0, error) == false)
+		return false;
+	if (shiva_live_analysis(ctx) == false) {
+		shiva_error_set(error, "analysis of '%s' failed\n", elf_pathname(&ctx->elfobj));
+		return false;
+	}
+	if (elf_section_by_name(&ctx->elfobj, ".text", &section) == false) {
+		shiva_error_set(error, "elf_section_by_name failed to find \".text\"\n");
+		return false;
+	}
+	text_lo = ctx->ulexec.base_vaddr + section.address;
+	text_hi = text_lo + section.size;
+	if (section.size >= SHIVA_LIVE_BRANCH_RANGE) {
+		shiva_error_set(error, ".text of '%s' exceeds the range of a call26\n",
+		    elf_pathname(&ctx->elfobj));
+		return false;
+	}
+	lo = text_hi > SHIVA_LIVE_BRANCH_RANGE ? text_hi - SHIVA_LIVE_BRANCH_RANGE : 0;
+	hi = text_lo + SHIVA_LIVE_BRANCH_RANGE;
+
+	/*
+	 * Unless told otherwise the target keeps running while it's
+	 * relinked, if every write of the transaction allows it (See
+	 * below): call26 sites are rewritten with a single store, and adrp
+	 * pairs are rerouted through veneers so that only the adrp is.
+	 */
+	env = getenv("SHIVA_LIVE_QUIESCE");
+	atomic = (env == NULL || strcmp(env, "1") != 0) && shiva_patch_sync_cores() == true;
+	if (atomic == true)
+		flags |= SHIVA_MODULE_F_VENEERS;
+	shiva_debug("Live patch commit: %s\n", atomic ? "atomic" : "quiesced");
+
+	shiva_patch_txn_begin(ctx, &txn);
+	shiva_patch_txn_begin(ctx, &undo);
+	/*
+	 * A NULL path unlinks the patch in slot.
+	 */
+	if (path != NULL &&
+	    shiva_module_live_link(ctx, path, flags, lo, hi, &linker, &txn) == false) {
+		shiva_patch_txn_abort(&txn);
+		shiva_error_set(error, "failed to link '%s'\n", path);
+		return false;
+	}
+	/*
+	 * The writes of a slot are reverted by its undo transaction. The
+	 * writes of the new version are queued after it, so they win
+	 * where both versions relink the same site, and the undo of the
+	 * new version puts back what was there before either one.
+	 */
+	if (slot != NULL) {
+		old = slot->linker;
+		if (shiva_patch_txn_undo(&txn, old != NULL ? &slot->undo : NULL, &undo,
+		    error) == false) {
+			shiva_patch_txn_abort(&txn);
+			return false;
+		}
+		if (old != NULL) {
+			shiva_patch_txn_begin(ctx, &swap);
+			if (shiva_patch_txn_append(&swap, &slot->undo, error) == false ||
+			    shiva_patch_txn_append(&swap, &txn, error) == false) {
+				shiva_patch_txn_abort(&swap);
+				shiva_patch_txn_abort(&txn);
+				shiva_patch_txn_abort(&undo);
+				return false;
+			}
+			shiva_patch_txn_abort(&txn);
+			txn = swap;
+		}
+	}
+	/*
+	 * The commit looks up the protection of each page it writes.
+	 */
+	if (shiva_maps_refresh(ctx) == false) {
+		shiva_patch_txn_abort(&txn);
+		shiva_patch_txn_abort(&undo);
+		shiva_error_set(error, "refresh of /proc/self/maps failed\n");
+		return false;
+	}
+	/*
+	 * An instruction such as the adrp that a veneer replaces can't be
+	 * modified while another thread may execute it, such transactions
+	 * are committed with the threads parked.
+	 */
+	if (atomic == true && shiva_patch_txn_atomic_ok(&txn, &atomic_error) == false) {
+		shiva_debug("Live patch commit: quiesced, %s", shiva_error_msg(&atomic_error));
+		atomic = false;
+	}
+
+	if (atomic == true) {
+		/*
+		 * Every write is a single store that leaves the target
+		 * consistent, even if the commit fails part way through.
+		 */
+		if (shiva_patch_txn_commit_atomic(&txn, error) == false) {
+			shiva_patch_txn_abort(&undo);
+			return false;
+		}
+	} else if (shiva_live_commit_quiesced(ctx, &txn, self_uc, error) == false) {
+		shiva_patch_txn_abort(&undo);
+		return false;
+	}
+
+	if (linker != NULL) {
+		TAILQ_INSERT_TAIL(&ctx->module.list, linker, _linkage);
+		new_path = shiva_arena_strdup(&ctx->arena.module, path);
+	}
+	if (old != NULL)
+		TAILQ_REMOVE(&ctx->module.list, old, _linkage);
+	if (ctx->module.runtime == NULL || ctx->module.runtime == old)
+		ctx->module.runtime = TAILQ_FIRST(&ctx->module.list);
+	shiva_live_set_path(ctx, slot != NULL ? slot->path : NULL, new_path);
+	if (slot == NULL) {
+		shiva_debug("Live patched '%s' with '%s'\n", elf_pathname(&ctx->elfobj), path);
+		return true;
+	}
+	shiva_patch_txn_abort(&slot->undo);
+	slot->undo = undo;
+	slot->linker = linker;
+	slot->path = new_path;
+	slot->version++;
+	shiva_debug("Slot '%s' of '%s' is now at version %u: %s\n", slot->name,
+	    elf_pathname(&ctx->elfobj), slot->version, path != NULL ? path : "unlinked");
+	/*
+	 * The old version is already unlinked from the target, a failure
+	 * to retire it only leaks it.
+	 */
+	if (old != NULL && shiva_live_retire(old, error) == false)
+		fprintf(stderr, "Live patch '%s' is never reclaimed: %s",
+		    elf_pathname(&old->elfobj), shiva_error_msg(error));
+	return true;
+}
+
+/*
+ * Link path as the next version of the slot name, or roll the slot back
+ * if path is NULL.
+ */
+static bool
+shiva_live_swap_slot(struct shiva_ctx *ctx, const char *name, const char *path,
+    ucontext_t *self_uc, shiva_error_t *error)
+{
+	struct shiva_live_slot *slot;
+	char *prev = NULL;
+	size_t pending;
+
+	slot = shiva_live_slot(name, path != NULL);
+	if (slot == NULL && path == NULL) {
+		shiva_error_set(error, "there is no slot '%s'\n", name);
+		return false;
+	} else if (slot == NULL) {
+		shiva_error_set(error, "more than %d slots\n", SHIVA_LIVE_MAX_SLOTS);
+		return false;
+	}
+	if (path == NULL) {
+		if (slot->depth > 0)
+			prev = slot->history[slot->depth - 1];
+		if (shiva_live_install(ctx, prev, slot, self_uc, error) == false)
+			return false;
+		if (slot->depth > 0)
+			slot->depth--;
+	} else {
+		prev = slot->path;
+		if (shiva_live_install(ctx, path, slot, self_uc, error) == false) {
+			if (slot->linker == NULL)
+				memset(slot, 0, sizeof(*slot));
+			return false;
+		}
+		if (prev != NULL) {
+			if (slot->depth == SHIVA_LIVE_MAX_VERSIONS) {
+				memmove(&slot->history[0], &slot->history[1],
+				    (SHIVA_LIVE_MAX_VERSIONS - 1) * sizeof(char *));
+				slot->depth--;
+			}
+			slot->history[slot->depth++] = prev;
+		}
+	}
+	if (slot->linker == NULL) {
+		shiva_patch_txn_abort(&slot->undo);
+		memset(slot, 0, sizeof(*slot));
+	}
+	/*
+	 * Start looking for threads that are done with the old version.
+	 */
+	return shiva_live_reclaim(self_uc, &pending, error);
+}
+
+/*
+ * Link the microcode patch at path into the running target. Can be
+ * called from any thread of the target, i.e. from within a module.
+ */
+bool
+shiva_live_patch(struct shiva_ctx *ctx, const char *path, shiva_error_t *error)
+{
+	bool res;
+
+	if (__atomic_test_and_set(&live.busy, __ATOMIC_ACQUIRE)) {
+		shiva_error_set(error, "a live patch is already in progress\n");
+		return false;
+	}
+	res = shiva_live_install(ctx, path, NULL, NULL, error);
+	__atomic_clear(&live.busy, __ATOMIC_RELEASE);
+	return res;
+}
+
+/*
+ * Link the microcode patch at path as the next version of the slot
+ * name, or roll the slot back if path is NULL. Like shiva_live_patch(),
+ * but the version that is replaced is reclaimed once no thread runs it.
+ */
+bool
+shiva_live_swap(struct shiva_ctx *ctx, const char *name, const char *path,
+    shiva_error_t *error)
+{
+	bool res;
+
+	if (__atomic_test_and_set(&live.busy, __ATOMIC_ACQUIRE)) {
+		shiva_error_set(error, "a live patch is already in progress\n");
+		return false;
+	}
+	res = shiva_live_swap_slot(ctx, name, path, NULL, error);
+	__atomic_clear(&live.busy, __ATOMIC_RELEASE);
+	return res;
+}
+
+/*
+ * The request file must be a regular file that only its owner, who is
+ * also our owner, can write to. It contains the path of the patch, or
+ * one of "swap <slot> <path>", "rollback <slot>" and "reclaim".
+ */
+static bool
+shiva_live_read_request(char *path, size_t len)
+{
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	fd = open(live.request_path, O_RDONLY|O_NOFOLLOW);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || S_ISREG(st.st_mode) == 0 || st.st_uid != getuid() ||
+	    (st.st_mode & (S_IWGRP|S_IWOTH)) != 0) {
+		fprintf(stderr, "Ignoring untrusted live patch request '%s'\n",
+		    live.request_path);
+		close(fd);
+		return false;
+	}
+	n = read(fd, path, len - 1);
+	close(fd);
+	(void) unlink(live.request_path);
+	if (n <= 0)
+		return false;
+	path[n] = '\0';
+	path[strcspn(path, "\n")] = '\0';
+	return true;
+}
+
+static void
+shiva_live_reply(const char *status)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s.status", live.request_path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600);
+	if (fd < 0)
+		return;
+	if (write(fd, status, strlen(status)) < 0 || rename(tmp, path) < 0)
+		(void) unlink(tmp);
+	close(fd);
+	return;
+}
+
+static bool
+shiva_live_handle_request(struct shiva_ctx *ctx, char *request, char *status, size_t len,
+    shiva_error_t *error)
+{
+	char *name, *path;
+	size_t pending;
+
+	if (strcmp(request, "reclaim") == 0) {
+		if (shiva_live_reclaim(NULL, &pending, error) == false)
+			return false;
+		if (pending == 0)
+			snprintf(status, len, "ok\n");
+		else
+			snprintf(status, len, "pending %zu\n", pending);
+		return true;
+	}
+	snprintf(status, len, "ok\n");
+	if (strncmp(request, "rollback ", 9) == 0)
+		return shiva_live_swap_slot(ctx, request + 9, NULL, NULL, error);
+	if (strncmp(request, "swap ", 5) != 0)
+		return shiva_live_install(ctx, request, NULL, NULL, error);
+	name = request + 5;
+	path = strchr(name, ' ');
+	if (path == NULL || path == name || path - name >= SHIVA_LIVE_SLOT_NAMELEN) {
+		shiva_error_set(error, "malformed swap request\n");
+		return false;
+	}
+	*path++ = '\0';
+	return shiva_live_swap_slot(ctx, name, path, NULL, error);
+}
+
+static void
+shiva_live_serve(struct shiva_ctx *ctx)
+{
+	char request[SHIVA_LIVE_REQUEST_MAX], status[PATH_MAX + 64];
+	shiva_error_t error;
+
+	if (__atomic_test_and_set(&live.busy, __ATOMIC_ACQUIRE)) {
+		shiva_live_reply("busy\n");
+		return;
+	}
+	if (shiva_live_read_request(request, sizeof(request)) == false) {
+		shiva_live_reply("error: unable to read the request\n");
+	} else if (shiva_live_handle_request(ctx, request, status, sizeof(status),
+	    &error) == false) {
+		snprintf(status, sizeof(status), "error: %s", shiva_error_msg(&error));
+		shiva_live_reply(status);
+	} else {
+		shiva_live_reply(status);
+	}
+	__atomic_clear(&live.busy, __ATOMIC_RELEASE);
+	return;
+}
+
+/*
+ * Every signal is blocked in the worker, so it never parks, nor is it
+ * asked to scan its stack (See shiva_live_each_thread()).
+ */
+static void *
+shiva_live_worker(void *arg)
+{
+	struct shiva_ctx *ctx = arg;
+	ssize_t n;
+	char c;
+
+	live.worker_tid = syscall(SYS_gettid);
+	for (;;) {
+		n = read(live.wake[0], &c, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		shiva_live_serve(ctx);
+	}
+	fprintf(stderr, "Live patch worker exited: %s\n", n < 0 ? strerror(errno) : "EOF");
+	return NULL;
+}
+
+/*
+ * Runs on whichever thread of the target the signal was delivered to,
+ * with the thread pointer of its libc, so the worker is woken with a
+ * raw system call (See shiva_syscall.h). The write end of the pipe is
+ * non-blocking, a full pipe already has a wakeup pending.
+ */
+static void
+shiva_live_request_handler(int sig, siginfo_t *si, void *uc)
+{
+	char c = 0;
+
+	if (shiva_syscall(SYS_getpid, 0, 0, 0, 0, 0, 0) != live.pid)
+		return;
+	(void) shiva_syscall(SYS_write, live.wake[1], (long)&c, 1, 0, 0, 0);
+	return;
+}
+
+/*
+ * Start the worker with every signal blocked, and with a stack as large
+ * as that of a thread of the target, which the handler used to run on.
+ */
+static bool
+shiva_live_start_worker(struct shiva_ctx *ctx)
+{
+	pthread_attr_t attr;
+	sigset_t set, oset;
+	int res;
+
+	if (pipe(live.wake) < 0 ||
+	    fcntl(live.wake[0], F_SETFD, FD_CLOEXEC) < 0 ||
+	    fcntl(live.wake[1], F_SETFD, FD_CLOEXEC) < 0 ||
+	    fcntl(live.wake[1], F_SETFL, O_NONBLOCK) < 0) {
+		perror("pipe");
+		return false;
+	}
+	live.pid = getpid();
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, SHIVA_LIVE_WORKER_STACK);
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	res = pthread_create(&live.worker, &attr, shiva_live_worker, ctx);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	pthread_attr_destroy(&attr);
+	if (res != 0) {
+		fprintf(stderr, "pthread_create failed: %s\n", strerror(res));
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Called right before control is passed to LDSO. Live patching is
+ * opt-in since the default action of SHIVA_LIVE_SIGNAL is to terminate,
+ * and the target must leave all three signals alone.
+ */
+bool
+shiva_live_init(struct shiva_ctx *ctx)
+{
+	struct sigaction act;
+	char *env = getenv("SHIVA_LIVE");
+
+	if (env == NULL || strcmp(env, "1") != 0)
+		return true;
+	shiva_live_request_path(live.request_path, sizeof(live.request_path), getpid());
+	/*
+	 * The scan handler keeps its grace period in the trace_tls record
+	 * of its thread.
+	 */
+	shiva_trace_tls_init(ctx);
+	if (shiva_live_start_worker(ctx) == false)
+		return false;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_sigaction = shiva_live_stop_handler;
+	act.sa_flags = SA_SIGINFO|SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	if (sigaction(SHIVA_LIVE_STOP_SIGNAL, &act, NULL) < 0) {
+		perror("sigaction");
+		return false;
+	}
+	act.sa_sigaction = shiva_live_scan_handler;
+	if (sigaction(SHIVA_LIVE_SCAN_SIGNAL, &act, NULL) < 0) {
+		perror("sigaction");
+		return false;
+	}
+	act.sa_sigaction = shiva_live_request_handler;
+	sigaddset(&act.sa_mask, SHIVA_LIVE_STOP_SIGNAL);
+	if (sigaction(SHIVA_LIVE_SIGNAL, &act, NULL) < 0) {
+		perror("sigaction");
+		return false;
+	}
+	shiva_debug("Live patch requests are read from %s\n", live.request_path);
+	return true;
+}
+
+/*
+ * Check /proc/<pid>/status to make sure that pid catches sig, otherwise
+ * sending it would kill the process.
+ */
+static bool
+shiva_live_catches(pid_t pid, int sig)
+{
+	char path[PATH_MAX], buf[256];
+	uint64_t mask = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return false;
+	}
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (strncmp(buf, "SigCgt:", 7) == 0) {
+			mask = strtoul(buf + 7, NULL, 16);
+			break;
+		}
+	}
+	fclose(fp);
+	return (mask & (1UL << (sig - 1))) != 0;
+}
+
+/*
+ * Send request to the Shiva instance within pid, and wait for its reply
+ * in status. Requests that find it busy are sent again.
+ */
+static int
+shiva_live_send(pid_t pid, const char *request, char *status, size_t len)
+{
+	char request_path[PATH_MAX], status_path[PATH_MAX], tmp[PATH_MAX];
+	ssize_t n;
+	int fd, ms, attempt;
+
+	if (shiva_live_catches(pid, SHIVA_LIVE_SIGNAL) == false) {
+		fprintf(stderr, "pid %d isn't running under Shiva with SHIVA_LIVE=1\n", pid);
+		return -1;
+	}
+	shiva_live_request_path(request_path, sizeof(request_path), pid);
+	snprintf(status_path, sizeof(status_path), "%s.status", request_path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", request_path);
+
+	for (attempt = 0; attempt < SHIVA_LIVE_RETRIES; attempt++) {
+		(void) unlink(status_path);
+		fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600);
+		if (fd < 0) {
+			perror("open");
+			return -1;
+		}
+		if (write(fd, request, strlen(request)) < 0 || rename(tmp, request_path) < 0) {
+			perror("write");
+			close(fd);
+			(void) unlink(tmp);
+			return -1;
+		}
+		close(fd);
+		if (kill(pid, SHIVA_LIVE_SIGNAL) < 0) {
+			perror("kill");
+			(void) unlink(request_path);
+			return -1;
+		}
+		for (ms = 0; ms < SHIVA_LIVE_TIMEOUT * 1000; ms += 10) {
+			fd = open(status_path, O_RDONLY|O_NOFOLLOW);
+			if (fd >= 0)
+				break;
+			shiva_live_sleep_ms(10);
+		}
+		if (fd < 0) {
+			fprintf(stderr, "pid %d did not reply within %d seconds\n", pid,
+			    SHIVA_LIVE_TIMEOUT);
+			(void) unlink(request_path);
+			return -1;
+		}
+		n = read(fd, status, len - 1);
+		close(fd);
+		(void) unlink(status_path);
+		status[n < 0 ? 0 : n] = '\0';
+		if (strcmp(status, "busy\n") != 0)
+			break;
+		shiva_debug("pid %d is busy, retrying\n", pid);
+		shiva_live_sleep_ms(100);
+	}
+	return 0;
+}
+
+/*
+ * shiva -l <pid> <patch>
+ * Ask the Shiva instance within pid to link patch, and wait for
+ * its reply.
+ */
+int
+shiva_live_request(pid_t pid, const char *patch)
+{
+	char path[PATH_MAX], status[PATH_MAX + 64];
+
+	if (realpath(patch, path) == NULL) {
+		fprintf(stderr, "realpath(%s) failed: %s\n", patch, strerror(errno));
+		return -1;
+	}
+	if (shiva_live_send(pid, path, status, sizeof(status)) < 0)
+		return -1;
+	if (strcmp(status, "ok\n") != 0) {
+		fprintf(stderr, "Live patch of pid %d with '%s' failed: %s", pid, path, status);
+		return -1;
+	}
+	printf("Live patched pid %d with '%s'\n", pid, path);
+	return 0;
+}
+
+/*
+ * shiva -l <pid> -s <slot> <patch>
+ * shiva -l <pid> -r <slot>
+ * Ask the Shiva instance within pid to swap patch into slot, or to roll
+ * slot back if patch is NULL. Then keep asking it to reclaim the version
+ * that was replaced for as long as it's still in use, up to
+ * SHIVA_LIVE_TIMEOUT seconds.
+ */
+int
+shiva_live_swap_request(pid_t pid, const char *slot, const char *patch)
+{
+	char request[SHIVA_LIVE_REQUEST_MAX], path[PATH_MAX], status[PATH_MAX + 64];
+	int ms;
+
+	if (strlen(slot) == 0 || strlen(slot) >= SHIVA_LIVE_SLOT_NAMELEN ||
+	    strpbrk(slot, " \n") != NULL) {
+		fprintf(stderr, "Invalid slot name '%s'\n", slot);
+		return -1;
+	}
+	if (patch != NULL && realpath(patch, path) == NULL) {
+		fprintf(stderr, "realpath(%s) failed: %s\n", patch, strerror(errno));
+		return -1;
+	}
+	if (patch != NULL)
+		snprintf(request, sizeof(request), "swap %s %s", slot, path);
+	else
+		snprintf(request, sizeof(request), "rollback %s", slot);
+	if (shiva_live_send(pid, request, status, sizeof(status)) < 0)
+		return -1;
+	if (strcmp(status, "ok\n") != 0) {
+		fprintf(stderr, "Live %s of slot '%s' in pid %d failed: %s",
+		    patch != NULL ? "swap" : "rollback", slot, pid, status);
+		return -1;
+	}
+	if (patch != NULL)
+		printf("Swapped slot '%s' of pid %d to '%s'\n", slot, pid, path);
+	else
+		printf("Rolled back slot '%s' of pid %d\n", slot, pid);
+	for (ms = 0; ms < SHIVA_LIVE_TIMEOUT * 1000; ms += SHIVA_LIVE_RECLAIM_MS) {
+		shiva_live_sleep_ms(SHIVA_LIVE_RECLAIM_MS);
+		if (shiva_live_send(pid, "reclaim", status, sizeof(status)) < 0)
+			return -1;
+		if (strcmp(status, "ok\n") == 0) {
+			printf("Replaced versions of pid %d are reclaimed\n", pid);
+			return 0;
+		}
+		if (strncmp(status, "pending ", 8) != 0) {
+			fprintf(stderr, "Reclaim in pid %d failed: %s", pid, status);
+			return -1;
+		}
+	}
+	printf("Replaced versions of pid %d are still in use (%s), they are reclaimed "
+	    "on a later request\n", pid, strtok(status, "\n"));
+	return 0;
+}
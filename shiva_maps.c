@@ -27,32 +27,54 @@ shiva_maps_get_base(struct shiva_ctx *ctx, uint64_t *out)
 	return false;
 }
 
+/*
+ * so_path is the realpath of a shared object. The shared objects are
+ * mapped by LDSO long after shiva_maps_build_list() ran, so if so_path
+ * isn't cached yet we refresh the maps and try again.
+ */
 bool
 shiva_maps_get_so_base(struct shiva_ctx *ctx, char *so_path,
     uint64_t *out)
 {
-	FILE *fp;
-	char buf[PATH_MAX];
-	char *p;
+	ENTRY e, *ep = NULL;
 
-	fp = fopen("/proc/self/maps", "r");
-	if (fp == NULL) {
-		perror("fopen");
-		return false;
-	}
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		if (strstr(buf, so_path) == NULL)
-			continue;
-		if (strstr(buf, "r-xp") == NULL)
-			continue;
-		p = strchr(buf, '-');
-		*p = '\0';
-		*out = strtoul(buf, NULL, 16);
-		fclose(fp);
+	e.key = so_path;
+	e.data = NULL;
+	if (ctx->maps.so_bases_init == true &&
+	    hsearch_r(e, FIND, &ep, &ctx->maps.so_bases) != 0) {
+		*out = (uint64_t)ep->data;
 		return true;
 	}
-	fclose(fp);
-	return false;
+	if (shiva_maps_refresh(ctx) == false)
+		return false;
+	if (hsearch_r(e, FIND, &ep, &ctx->maps.so_bases) == 0)
+		return false;
+	*out = (uint64_t)ep->data;
+	return true;
+}
+
+/*
+ * Binary search ctx->maps.vec for the mapping that contains addr.
+ */
+static struct shiva_mmap_entry *
+shiva_maps_lookup(struct shiva_ctx *ctx, uint64_t addr)
+{
+	struct shiva_mmap_entry *entry;
+	size_t lo = 0, hi = ctx->maps.count, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (ctx->maps.vec[mid]->base <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	entry = ctx->maps.vec[lo - 1];
+	if (addr >= entry->base + entry->len)
+		return NULL;
+	return entry;
 }
 /*
  * Checking if 'addr' is a valid address mapping.
@@ -65,126 +87,314 @@ shiva_maps_get_so_base(struct shiva_ctx *ctx, char *so_path,
 bool
 shiva_maps_validate_addr(struct shiva_ctx *ctx, uint64_t addr)
 {
-	struct shiva_mmap_entry *current;
+	struct shiva_mmap_entry *current = shiva_maps_lookup(ctx, addr);
 
-	TAILQ_FOREACH(current, &ctx->tailq.mmap_tqlist, _linkage) {
-		if (current->debugger_mapping == true)
-			continue;
-		if (addr >= current->base && addr < current->base + current->len)
-			return true;
+	if (current == NULL || current->debugger_mapping == true)
+		return false;
+	return true;
+}
+
+/*
+ * A single parsed line of /proc/self/maps. path points into
+ * ctx->maps.buf and is only valid until the next refresh.
+ */
+struct shiva_maps_record {
+	uint64_t base;
+	size_t len;
+	uint32_t prot;
+	uint32_t mapping;
+	shiva_mmap_type_t mmap_type;
+	bool debugger_mapping;
+	char *path;
+};
+
+static inline uint64_t
+shiva_maps_parse_hex(char **pp, char *end)
+{
+	uint64_t v = 0;
+	char *p = *pp;
+
+	for (; p < end; p++) {
+		if (*p >= '0' && *p <= '9')
+			v = (v << 4) | (*p - '0');
+		else if (*p >= 'a' && *p <= 'f')
+			v = (v << 4) | (*p - 'a' + 10);
+		else
+			break;
 	}
-	return false;
+	*pp = p;
+	return v;
+}
+
+static inline char *
+shiva_maps_skip_field(char *p, char *end)
+{
+	while (p < end && *p != ' ')
+		p++;
+	while (p < end && *p == ' ')
+		p++;
+	return p;
 }
 
 /*
- * Load /proc/pid/maps into the ctx->tailq.mmap_tqlist
- * XXX: Update this function to deal with Shiva when
- * it's in interpreter mode... the address space layout
- * is different than it would be in standalone mode. 
+ * Parse the line starting at p, which has been NUL terminated at end.
+ * i.e. "aaaab2c1d000-aaaab2c1e000 r-xp 00000000 fd:00 1234  /bin/ls"
  */
-bool
-shiva_maps_build_list(struct shiva_ctx *ctx)
+static bool
+shiva_maps_parse_line(char *p, char *end, struct shiva_maps_record *rec)
 {
-	FILE *fp;
-	char buf[PATH_MAX];
-	int i;
+	char *basename;
+	uint64_t end_addr;
 
-	if (!TAILQ_EMPTY(&ctx->tailq.mmap_tqlist)) {
-		fprintf(stderr, "mmap_tqlist is already initialized\n");
+	memset(rec, 0, sizeof(*rec));
+	rec->base = shiva_maps_parse_hex(&p, end);
+	if (p >= end || *p != '-')
 		return false;
+	p++;
+	end_addr = shiva_maps_parse_hex(&p, end);
+	if (end_addr <= rec->base || end - p < 6)
+		return false;
+	rec->len = end_addr - rec->base;
+	p++;
+	if (p[0] == 'r')
+		rec->prot |= PROT_READ;
+	if (p[1] == 'w')
+		rec->prot |= PROT_WRITE;
+	if (p[2] == 'x')
+		rec->prot |= PROT_EXEC;
+	rec->mapping = p[3] == 's' ? MAP_SHARED : MAP_PRIVATE;
+	/*
+	 * Skip perms, offset, dev and inode to get to the path
+	 */
+	p = shiva_maps_skip_field(p, end);
+	p = shiva_maps_skip_field(p, end);
+	p = shiva_maps_skip_field(p, end);
+	p = shiva_maps_skip_field(p, end);
+	rec->path = p;
+	if (*p == '/') {
+		for (basename = p; p < end; p++) {
+			if (*p == '/')
+				basename = p + 1;
+		}
+		if (strncmp(basename, "shiva", 5) == 0) {
+			rec->mmap_type = SHIVA_MMAP_TYPE_SHIVA;
+			rec->debugger_mapping = true;
+		} else {
+			/*
+			 * XXX: Other file mappings have always been left as
+			 * zero (SHIVA_MMAP_TYPE_HEAP). The module text segment
+			 * placement in shiva_module.c relies on the first such
+			 * entry, which is the target executable.
+			 */
+			rec->mmap_type = SHIVA_MMAP_TYPE_HEAP;
+		}
+	} else if (strcmp(p, "[heap]") == 0) {
+		rec->mmap_type = SHIVA_MMAP_TYPE_HEAP;
+	} else if (strcmp(p, "[stack]") == 0) {
+		rec->mmap_type = SHIVA_MMAP_TYPE_STACK;
+	} else if (strcmp(p, "[vdso]") == 0) {
+		rec->mmap_type = SHIVA_MMAP_TYPE_VDSO;
+	} else {
+		rec->mmap_type = SHIVA_MMAP_TYPE_MISC;
 	}
+	return true;
+}
 
-	TAILQ_INIT(&ctx->tailq.mmap_tqlist);
+/*
+ * Read all of /proc/self/maps into ctx->maps.buf. procfs hands the
+ * file out a page or so at a time, so we read until EOF.
+ */
+static ssize_t
+shiva_maps_read(struct shiva_ctx *ctx)
+{
+	ssize_t n, len = 0;
+	int fd;
 
-	fp = fopen("/proc/self/maps", "r");
-	if (fp == NULL) {
-		perror("fopen");
-		return false;
+	fd = open("/proc/self/maps", O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return -1;
 	}
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		struct shiva_mmap_entry *entry;
-		unsigned long end;
-		char *appname = NULL;
-		char *p, *q;
-		char tmp[PATH_MAX];
-
-		strcpy(tmp, buf);
-
-		p = strrchr(buf, '/');
-		if (p != NULL)
-			appname = &p[1];
-		entry = shiva_malloc(sizeof(*entry));
-		memset(entry, 0, sizeof(*entry));
-
-		p = strrchr(buf, '/');
-		if (p != NULL) {
-			if (strncmp(&p[1], "shiva", 5) == 0) {
-				if (strstr(buf, "r----") != NULL) {
-					if (ctx->shiva_path == NULL) {
-						p = strchr(tmp, '/');
-						ctx->shiva_path = shiva_malloc(PATH_MAX + 1);
-						for (i = 0; *p != '\n' && *p != '\0'; p++, i++)
-							ctx->shiva_path[i] = *p;
-						ctx->shiva_path[i] = '\0';
-					}
-				}
-				entry->mmap_type = SHIVA_MMAP_TYPE_SHIVA;
-			}
-		} else if (strstr(buf, "[heap]") != NULL) {
-			entry->mmap_type = SHIVA_MMAP_TYPE_HEAP;
-		} else if (strstr(buf, "[stack]") != NULL) {
-			entry->mmap_type = SHIVA_MMAP_TYPE_STACK;
-		} else if (strstr(buf, "[vdso]") != NULL) {
-			entry->mmap_type = SHIVA_MMAP_TYPE_VDSO;
-		} else {
-			entry->mmap_type = SHIVA_MMAP_TYPE_MISC;
+	for (;;) {
+		if (ctx->maps.buf_size - len < PAGE_SIZE) {
+			ctx->maps.buf_size = ctx->maps.buf_size == 0 ? PAGE_SIZE * 4 :
+			    ctx->maps.buf_size << 1;
+			ctx->maps.buf = shiva_realloc(ctx->maps.buf, ctx->maps.buf_size);
+		}
+		n = read(fd, ctx->maps.buf + len, ctx->maps.buf_size - len - 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			close(fd);
+			return -1;
 		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	ctx->maps.buf[len] = '\0';
+	return len;
+}
 
-		p = strchr(buf, '-');
-		assert(p != NULL);
-		*p = '\0';
-		entry->base = strtoul(buf, NULL, 16);
-		end = strtoul(p + 1, NULL, 16);
-		assert(end > entry->base);
-		entry->len = end - entry->base;
-		shiva_debug("base: %#lx\n", entry->base);
-		if (appname != NULL) {
-			if (!strncmp(appname, "shiva", 5)) {
-				shiva_debug("Debug mapping found: %#lx\n", entry->base);
-				entry->debugger_mapping = true;
-			}
+static struct shiva_mmap_entry *
+shiva_maps_new_entry(struct shiva_ctx *ctx)
+{
+	struct shiva_mmap_entry *entry;
+
+	entry = TAILQ_FIRST(&ctx->maps.freelist);
+	if (entry == NULL)
+		return shiva_arena_alloc(&ctx->arena.module, sizeof(*entry));
+	TAILQ_REMOVE(&ctx->maps.freelist, entry, _linkage);
+	memset(entry, 0, sizeof(*entry));
+	return entry;
+}
+
+static void
+shiva_maps_set_entry(struct shiva_mmap_entry *entry, struct shiva_maps_record *rec)
+{
+	entry->base = rec->base;
+	entry->len = rec->len;
+	entry->prot = rec->prot;
+	entry->mapping = rec->mapping;
+	entry->mmap_type = rec->mmap_type;
+	entry->debugger_mapping = rec->debugger_mapping;
+	return;
+}
+
+static void
+shiva_maps_record_so_base(struct shiva_ctx *ctx, struct shiva_maps_record *rec)
+{
+	ENTRY e, *ep = NULL;
+
+	if (rec->path[0] != '/' || rec->prot != (PROT_READ|PROT_EXEC) ||
+	    rec->mapping != MAP_PRIVATE)
+		return;
+	e.key = rec->path;
+	e.data = NULL;
+	if (hsearch_r(e, FIND, &ep, &ctx->maps.so_bases) != 0)
+		return;
+	e.key = shiva_arena_strdup(&ctx->arena.module, rec->path);
+	e.data = (void *)rec->base;
+	if (hsearch_r(e, ENTER, &ep, &ctx->maps.so_bases) == 0)
+		shiva_debug("so_bases cache is full, ignoring %s\n", rec->path);
+	return;
+}
+
+/*
+ * Re-read /proc/self/maps and bring ctx->tailq.mmap_tqlist and the
+ * ctx->maps.vec index up to date with it. Both are kept in ascending
+ * order, so this is a single merge pass over the old index and the
+ * new maps: entries that still exist are updated in place, new ones
+ * are inserted, and entries that are gone are moved to a freelist.
+ * Called explicitly once LDSO has mapped the shared objects (See
+ * shiva_post_linker.c), or via SHIVA_TRACE_OP_REFRESH_MAPS.
+ */
+bool
+shiva_maps_refresh(struct shiva_ctx *ctx)
+{
+	struct shiva_mmap_entry **old_vec = ctx->maps.vec, **vec;
+	struct shiva_mmap_entry *entry;
+	struct shiva_maps_record rec;
+	size_t old_count = ctx->maps.count, i = 0, count = 0, vec_size;
+	size_t added = 0, removed = 0, updated = 0;
+	char *p, *end, *buf_end;
+	ssize_t len;
+	bool have_rec;
+	shiva_stats_mark_t t0 = SHIVA_STATS_START(ctx);
+
+	if (ctx->maps.so_bases_init == false) {
+		if (hcreate_r(SHIVA_MAPS_SO_BASES_MAX, &ctx->maps.so_bases) == 0) {
+			perror("hcreate_r");
+			return false;
+		}
+		ctx->maps.so_bases_init = true;
+	}
+	len = shiva_maps_read(ctx);
+	if (len < 0)
+		return false;
+	buf_end = ctx->maps.buf + len;
+	vec_size = old_count + 64;
+	vec = shiva_malloc(vec_size * sizeof(*vec));
+
+	for (p = ctx->maps.buf; p < buf_end || i < old_count; p = end + 1) {
+		have_rec = false;
+		end = p;
+		if (p < buf_end) {
+			end = memchr(p, '\n', buf_end - p);
+			if (end == NULL)
+				end = buf_end;
+			*end = '\0';
+			if (shiva_maps_parse_line(p, end, &rec) == false)
+				continue;
+			have_rec = true;
+			shiva_maps_record_so_base(ctx, &rec);
+		}
+		/*
+		 * Drop every old entry that sits below the current line,
+		 * or all that remain once we're out of lines.
+		 */
+		while (i < old_count && (have_rec == false || old_vec[i]->base < rec.base)) {
+			TAILQ_REMOVE(&ctx->tailq.mmap_tqlist, old_vec[i], _linkage);
+			TAILQ_INSERT_TAIL(&ctx->maps.freelist, old_vec[i], _linkage);
+			removed++;
+			i++;
 		}
-		q = strchr(p + 1, ' ');
-		assert(q != NULL);
-		p = q + 1;
-		while (*p != ' ') {
-			switch(*p) {
-			case 'r':
-				entry->prot |= PROT_READ;
-				break;
-			case 'w':
-				entry->prot |= PROT_WRITE;
-				break;
-			case 'x':
-				entry->prot |= PROT_EXEC;
-			case 'p':
-				entry->mapping = MAP_PRIVATE;
-				break;
-			case 's':
-				entry->mapping = MAP_SHARED;
-			case '-':
-			default:
-				break;
-			}
-			p++;
+		if (have_rec == false)
+			continue;
+		if (count == vec_size) {
+			vec_size <<= 1;
+			vec = shiva_realloc(vec, vec_size * sizeof(*vec));
+		}
+		if (i < old_count && old_vec[i]->base == rec.base) {
+			entry = old_vec[i++];
+			if (entry->len != rec.len || entry->prot != rec.prot ||
+			    entry->mmap_type != rec.mmap_type)
+				updated++;
+		} else {
+			entry = shiva_maps_new_entry(ctx);
+			if (i < old_count)
+				TAILQ_INSERT_BEFORE(old_vec[i], entry, _linkage);
+			else
+				TAILQ_INSERT_TAIL(&ctx->tailq.mmap_tqlist, entry, _linkage);
+			shiva_debug("Inserted mapping for %#lx - %#lx\n", rec.base,
+			    rec.base + rec.len);
+			added++;
 		}
-		shiva_debug("Inserted mapping for %#lx - %#lx\n", entry->base,
-		    entry->base + entry->len);
-		TAILQ_INSERT_TAIL(&ctx->tailq.mmap_tqlist, entry, _linkage);
+		shiva_maps_set_entry(entry, &rec);
+		if (ctx->shiva_path == NULL && rec.mmap_type == SHIVA_MMAP_TYPE_SHIVA &&
+		    rec.prot == PROT_READ)
+			ctx->shiva_path = shiva_arena_strdup(&ctx->arena.module, rec.path);
+		vec[count++] = entry;
 	}
+	free(old_vec);
+	ctx->maps.vec = vec;
+	ctx->maps.count = count;
+	shiva_debug("maps refresh: %zu mappings, %zu added %zu removed %zu updated\n",
+	    count, added, removed, updated);
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_MAPS, t0);
 	return true;
 }
 
+/*
+ * Load /proc/pid/maps into the ctx->tailq.mmap_tqlist, and build
+ * the ctx->maps.vec address index over it.
+ * XXX: Update this function to deal with Shiva when
+ * it's in interpreter mode... the address space layout
+ * is different than it would be in standalone mode.
+ */
+bool
+shiva_maps_build_list(struct shiva_ctx *ctx)
+{
+
+	if (!TAILQ_EMPTY(&ctx->tailq.mmap_tqlist)) {
+		fprintf(stderr, "mmap_tqlist is already initialized\n");
+		return false;
+	}
+	return shiva_maps_refresh(ctx);
+}
+
 void
 shiva_maps_iterator_init(struct shiva_ctx *ctx, struct shiva_maps_iterator *iter)
 {
@@ -204,19 +414,79 @@ shiva_maps_iterator_next(struct shiva_maps_iterator *iter, struct shiva_mmap_ent
 	return ELF_ITER_OK;
 }
 
+/*
+ * Like shiva_maps_prot_by_addr() but returns the whole mapping, so
+ * that the caller can test further addresses against it without
+ * walking the list again.
+ */
 bool
-shiva_maps_prot_by_addr(struct shiva_ctx *ctx, uint64_t addr, int *prot)
+shiva_maps_entry_by_addr(struct shiva_ctx *ctx, uint64_t addr, struct shiva_mmap_entry *out)
 {
-	shiva_maps_iterator_t mmap_iter;
-	struct shiva_mmap_entry mmap_entry;
+	struct shiva_mmap_entry *entry = shiva_maps_lookup(ctx, addr);
+
+	if (entry == NULL)
+		return false;
+	memcpy(out, entry, sizeof(*out));
+	return true;
+}
 
-	shiva_maps_iterator_init(ctx, &mmap_iter);
-	while (shiva_maps_iterator_next(&mmap_iter, &mmap_entry) == SHIVA_ITER_OK) {
-		shiva_debug("mmap_entry.base: %#lx mmap_entry.len: %lx\n", mmap_entry.base, mmap_entry.len);
-		if (addr >= mmap_entry.base && addr < mmap_entry.base + mmap_entry.len) {
-			*prot = mmap_entry.prot;
-			return true;
+/*
+ * Find len bytes of unmapped address space that lie entirely within
+ * [lo, hi), as close to the middle of the window as possible. Used to
+ * place a live patch within branch range of the target, so the maps
+ * should have been refreshed first.
+ */
+bool
+shiva_maps_find_gap(struct shiva_ctx *ctx, uint64_t lo, uint64_t hi, size_t len,
+    uint64_t *out)
+{
+	uint64_t gap_start, gap_end, addr, mid, dist, best_dist = ~0UL;
+	size_t i;
+	bool found = false;
+
+	lo = ELF_PAGEALIGN(lo, PAGE_SIZE);
+	hi = ELF_PAGESTART(hi);
+	len = ELF_PAGEALIGN(len, PAGE_SIZE);
+	mid = lo + ((hi - lo) >> 1);
+	if (hi <= lo || hi - lo < len)
+		return false;
+	for (i = 0; i <= ctx->maps.count; i++) {
+		gap_start = i == 0 ? PAGE_SIZE : ctx->maps.vec[i - 1]->base +
+		    ctx->maps.vec[i - 1]->len;
+		gap_end = i == ctx->maps.count ? ~0UL : ctx->maps.vec[i]->base;
+		if (gap_start < lo)
+			gap_start = lo;
+		if (gap_end > hi)
+			gap_end = hi;
+		if (gap_end <= gap_start || gap_end - gap_start < len)
+			continue;
+		/*
+		 * Take the end of the gap that is closest to mid.
+		 */
+		if (gap_start >= mid)
+			addr = gap_start;
+		else if (gap_end <= mid)
+			addr = gap_end - len;
+		else
+			addr = mid + len <= gap_end ? ELF_PAGESTART(mid) : gap_end - len;
+		dist = addr > mid ? addr - mid : mid - addr;
+		if (dist < best_dist) {
+			best_dist = dist;
+			*out = addr;
+			found = true;
 		}
 	}
-	return false;
+	return found;
+}
+
+bool
+shiva_maps_prot_by_addr(struct shiva_ctx *ctx, uint64_t addr, int *prot)
+{
+	struct shiva_mmap_entry *entry = shiva_maps_lookup(ctx, addr);
+
+	if (entry == NULL)
+		return false;
+	shiva_debug("mmap_entry.base: %#lx mmap_entry.len: %lx\n", entry->base, entry->len);
+	*prot = entry->prot;
+	return true;
 }
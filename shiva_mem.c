@@ -0,0 +1,225 @@
+/*
+ * shiva_mem.c - Memory footprint of the interpreter.
+ *
+ * Accounts for the memory that Shiva adds to the process of the target,
+ * by subsystem (See shiva_mem_subsys_t): the bytes that each one has
+ * mapped or allocated, and how many pages of them are resident according
+ * to mincore(2). For the ELF objects, which are private file mappings,
+ * that is their residency in the page cache, i.e. the most they can add
+ * to the RSS. The footprint is reported with SHIVA_STATS (See
+ * shiva_stats.c), and patches may take it at any time with
+ * shiva_trace_footprint().
+ *
+ * Before control is passed to LDSO, shiva_mem_release() frees what was
+ * only needed to analyze the target and link the patches: the symbol
+ * caches of each module, the ELF object of Shiva itself, and the cached
+ * shared objects unless SHIVA_LIVE=1 may still link against them. The
+ * ELF object of Shiva and the shared objects are opened again should a
+ * later lookup need them (i.e. a GOT hook of the trace API). The module
+ * caches are not rebuilt, see shiva_module_release_caches() for why
+ * nothing looks them up anymore. SHIVA_MEM_RELEASE=0 keeps them all.
+ */
+#include "shiva.h"
+
+static const char *shiva_mem_subsys_names[SHIVA_MEM_SUBSYS_COUNT] = {
+	[SHIVA_MEM_ANALYSIS] = "analysis",
+	[SHIVA_MEM_MODULE_ARENA] = "module_arena",
+	[SHIVA_MEM_MODULE_IMAGE] = "module_image",
+	[SHIVA_MEM_MODULE_ELF] = "module_elf",
+	[SHIVA_MEM_TARGET_ELF] = "target_elf",
+	[SHIVA_MEM_SO_ELF] = "so_elf",
+	[SHIVA_MEM_SHIVA_ELF] = "shiva_elf",
+	[SHIVA_MEM_TRACE] = "trace",
+	[SHIVA_MEM_STACK] = "stack",
+	[SHIVA_MEM_HTAB] = "htab",
+	[SHIVA_MEM_MAPS] = "maps"
+};
+
+#define SHIVA_MEM_MINCORE_VEC	256
+
+const char *
+shiva_mem_subsys_name(shiva_mem_subsys_t subsys)
+{
+	if (subsys >= SHIVA_MEM_SUBSYS_COUNT)
+		return "unknown";
+	return shiva_mem_subsys_names[subsys];
+}
+
+/*
+ * Account len bytes at addr, and each resident page that they touch. A
+ * range that isn't mapped (anymore) stops the page count short, mincore
+ * fails with ENOMEM.
+ */
+static void
+shiva_mem_account(struct shiva_mem_usage *usage, const void *addr, size_t len)
+{
+	unsigned char vec[SHIVA_MEM_MINCORE_VEC];
+	uint64_t start, end;
+	size_t i, n;
+
+	if (addr == NULL || len == 0)
+		return;
+	usage->bytes += len;
+	start = (uint64_t)addr & ~((uint64_t)PAGE_SIZE - 1);
+	end = ELF_PAGEALIGN((uint64_t)addr + len, PAGE_SIZE);
+	while (start < end) {
+		n = (end - start) / PAGE_SIZE;
+		if (n > SHIVA_MEM_MINCORE_VEC)
+			n = SHIVA_MEM_MINCORE_VEC;
+		if (mincore((void *)start, n * PAGE_SIZE, vec) < 0)
+			return;
+		for (i = 0; i < n; i++)
+			usage->pages += vec[i] & 1;
+		start += n * PAGE_SIZE;
+	}
+	return;
+}
+
+static void
+shiva_mem_account_arena(struct shiva_mem_usage *usage, struct shiva_arena *arena)
+{
+	struct shiva_arena_block *block;
+
+	for (block = arena->head; block != NULL; block = block->next)
+		shiva_mem_account(usage, block, block->size);
+	return;
+}
+
+static void
+shiva_mem_account_htab(struct shiva_mem_usage *usage, struct shiva_htab *htab)
+{
+	shiva_mem_account(usage, htab->vec, htab->size * sizeof(struct shiva_htab_entry));
+	return;
+}
+
+static void
+shiva_mem_account_module(struct shiva_mem_footprint *fp, struct shiva_module *linker)
+{
+	struct shiva_mem_usage *image = &fp->subsys[SHIVA_MEM_MODULE_IMAGE];
+	struct shiva_mem_usage *htab = &fp->subsys[SHIVA_MEM_HTAB];
+	uint64_t ranges[SHIVA_NUMA_MAX_NODES + 2][2];
+	size_t i, count;
+
+	/*
+	 * Unlinked by shiva_live.c, along with its ELF object.
+	 */
+	if (linker->text_mem == NULL)
+		return;
+	count = shiva_module_live_ranges(linker, ranges, SHIVA_NUMA_MAX_NODES + 2);
+	for (i = 0; i < count; i++)
+		shiva_mem_account(image, (void *)ranges[i][0], ranges[i][1] - ranges[i][0]);
+	shiva_mem_account(image, linker->lazy.mem, linker->lazy.size);
+	shiva_mem_account(&fp->subsys[SHIVA_MEM_MODULE_ELF], linker->elfobj.mem,
+	    linker->elfobj.size);
+	shiva_mem_account_htab(htab, &linker->cache.bss);
+	shiva_mem_account_htab(htab, &linker->cache.got);
+	shiva_mem_account_htab(htab, &linker->cache.helpers);
+	shiva_mem_account_htab(htab, &linker->cache.variants);
+	shiva_mem_account_htab(htab, &linker->cache.links);
+	shiva_mem_account_htab(htab, &linker->cache.sections);
+	shiva_mem_account_htab(htab, &linker->cache.symres);
+	shiva_mem_account_htab(htab, &linker->cache.gc);
+	return;
+}
+
+void
+shiva_mem_footprint(struct shiva_ctx *ctx, struct shiva_mem_footprint *fp)
+{
+	struct shiva_module *linker;
+	size_t i;
+
+	memset(fp, 0, sizeof(*fp));
+	shiva_mem_account_arena(&fp->subsys[SHIVA_MEM_ANALYSIS], &ctx->arena.analysis);
+	shiva_mem_account_arena(&fp->subsys[SHIVA_MEM_MODULE_ARENA], &ctx->arena.module);
+	TAILQ_FOREACH(linker, &ctx->module.list, _linkage)
+		shiva_mem_account_module(fp, linker);
+	shiva_mem_account(&fp->subsys[SHIVA_MEM_MODULE_ELF], ctx->module.index.mem,
+	    ctx->module.index.size);
+	shiva_mem_account(&fp->subsys[SHIVA_MEM_TARGET_ELF], ctx->elfobj.mem,
+	    ctx->elfobj.size);
+	/*
+	 * Objects that the prefetch thread is still opening are left out.
+	 */
+	if (ctx->prefetch.pending == false) {
+		for (i = 0; i < ctx->so.count; i++)
+			shiva_mem_account(&fp->subsys[SHIVA_MEM_SO_ELF],
+			    ctx->so.objects[i]->elfobj.mem, ctx->so.objects[i]->elfobj.size);
+		shiva_mem_account_htab(&fp->subsys[SHIVA_MEM_HTAB], &ctx->so.symbols);
+	}
+	if (ctx->shiva_elfobj_loaded == true)
+		shiva_mem_account(&fp->subsys[SHIVA_MEM_SHIVA_ELF], ctx->shiva_elfobj.mem,
+		    ctx->shiva_elfobj.size);
+	shiva_mem_account_arena(&fp->subsys[SHIVA_MEM_TRACE], &ctx->arena.trace);
+	shiva_mem_account(&fp->subsys[SHIVA_MEM_TRACE], ctx->trace_island.mem,
+	    ctx->trace_island.size);
+	shiva_mem_account(&fp->subsys[SHIVA_MEM_TRACE], ctx->trace_ring.hdr,
+	    ctx->trace_ring.len);
+	shiva_mem_account(&fp->subsys[SHIVA_MEM_TRACE], ctx->hook_stats.hdr,
+	    ctx->hook_stats.len);
+	if (ctx->ulexec.stack != NULL)
+		shiva_mem_account(&fp->subsys[SHIVA_MEM_STACK], ctx->ulexec.stack - PAGE_SIZE,
+		    ctx->ulexec.stack_size + PAGE_SIZE);
+	/*
+	 * The hsearch(3) table is opaque, it's sized from its entry count.
+	 */
+	if (ctx->maps.so_bases_init == true)
+		fp->subsys[SHIVA_MEM_HTAB].bytes += SHIVA_MAPS_SO_BASES_MAX * sizeof(ENTRY);
+	shiva_mem_account(&fp->subsys[SHIVA_MEM_MAPS], ctx->maps.buf, ctx->maps.buf_size);
+	shiva_mem_account(&fp->subsys[SHIVA_MEM_MAPS], ctx->maps.vec,
+	    ctx->maps.count * sizeof(struct shiva_mmap_entry *));
+
+	for (i = 0; i < SHIVA_MEM_SUBSYS_COUNT; i++) {
+		fp->bytes += fp->subsys[i].bytes;
+		fp->pages += fp->subsys[i].pages;
+	}
+	fp->released = ctx->mem.released;
+	return;
+}
+
+/*
+ * Called once the patches are linked, right before control is passed to
+ * LDSO (Or to a zygote, which hands the smaller image to its children).
+ */
+void
+shiva_mem_release(struct shiva_ctx *ctx)
+{
+	struct shiva_module *linker;
+	char *env = getenv("SHIVA_MEM_RELEASE");
+	char *live = getenv("SHIVA_LIVE");
+	uint64_t bytes = 0;
+
+	if (env != NULL && strcmp(env, "0") == 0)
+		return;
+	TAILQ_FOREACH(linker, &ctx->module.list, _linkage)
+		bytes += shiva_module_release_caches(linker);
+	if (ctx->shiva_elfobj_loaded == true) {
+		bytes += ctx->shiva_elfobj.size;
+		elf_close_object(&ctx->shiva_elfobj);
+		ctx->shiva_elfobj_loaded = false;
+	}
+	/*
+	 * Keep the shared objects for live patches, which would otherwise
+	 * have to open all of them again within the request handler.
+	 */
+	if (live == NULL || strcmp(live, "1") != 0)
+		bytes += shiva_so_cache_release(ctx);
+	ctx->mem.released += bytes;
+	shiva_debug("Released %lu bytes of analysis and linking state\n", bytes);
+	return;
+}
+
+/*
+ * shiva_trace API: the current footprint of Shiva within the process,
+ * see shiva_mem_subsys_t for what each entry covers.
+ */
+bool
+shiva_trace_footprint(struct shiva_ctx *ctx, struct shiva_mem_footprint *fp,
+    shiva_error_t *error)
+{
+	if (ctx == NULL || fp == NULL) {
+		shiva_error_set(error, "shiva_trace_footprint: invalid argument\n");
+		return false;
+	}
+	shiva_mem_footprint(ctx, fp);
+	return true;
+}
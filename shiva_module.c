@@ -2,6 +2,9 @@
 #include "shiva_debug.h"
 #include "modules/include/shiva_module.h"
 #include <sys/mman.h>
+#if __aarch64__
+#include "shiva_aarch64.h"
+#endif
 
 #define RELOC_MASK(n)	((1U << n) - 1)
 
@@ -36,7 +39,9 @@ uint8_t plt_stub[8] = "\x11\x00\x00\x58"  /* ldr	x17, got_entry_mem */
 
 static bool module_has_transforms(struct shiva_module *);
 static bool get_section_mapping(struct shiva_module *, char *, struct shiva_module_section_mapping *);
-static bool enable_post_linker(struct shiva_module *);
+static inline bool patch_variant_symbol(struct shiva_module *, const char *,
+    struct elf_symbol *);
+static bool delay_target_ifunc(struct shiva_module *, uint8_t *, uint64_t, struct elf_symbol *);
 /*
  * Returns the name of the ELF section that the symbol lives in, within the
  * loaded ET_REL module.
@@ -44,7 +49,7 @@ static bool enable_post_linker(struct shiva_module *);
 static char *
 module_symbol_shndx_str(struct shiva_module *linker, struct elf_symbol *symbol)
 {
-	struct elf_section *section = shiva_malloc(sizeof(*section));
+	struct elf_section section;
 	uint16_t shndx = symbol->shndx;
 
 	shiva_debug("SHNDX: %d\n", shndx);
@@ -55,10 +60,23 @@ module_symbol_shndx_str(struct shiva_module *linker, struct elf_symbol *symbol)
 	/*
 	 * What section does our symbol live in?
 	 */
-	if (elf_section_by_index(&linker->elfobj, shndx, section)
+	if (elf_section_by_index(&linker->elfobj, shndx, &section)
 	    == false)
 		return NULL;
-	return section->name;
+	return section.name;
+}
+
+/*
+ * Number of symbols in the modules symtab, used to size the caches.
+ */
+static size_t
+module_symbol_count(struct shiva_module *linker)
+{
+	uint64_t count;
+
+	if (elf_symtab_count(&linker->elfobj, &count) == false)
+		return 0;
+	return count;
 }
 
 static void
@@ -69,21 +87,127 @@ transfer_to_module(struct shiva_ctx *ctx, uint64_t entry)
 	return fn(ctx);
 }
 
+#define SHIVA_VENEER_SIZE	(3 * sizeof(uint32_t))
+#define SHIVA_CALL26_RANGE	(1L << 27) /* +/- 128MB */
+
+static inline bool
+call26_in_range(uint64_t from, uint64_t to)
+{
+	int64_t off = (int64_t)(to - from);
+
+	return off >= -SHIVA_CALL26_RANGE && off < SHIVA_CALL26_RANGE;
+}
+
+/*
+ * Map a branch island for the module within call26 range of the .text
+ * of the target, with room for a veneer to each function of the patch
+ * and the out of line code of its emits (See shiva_tf_island_size).
+ * Only live patches have their island carved out of the module image,
+ * since only they are placed within range to begin with.
+ */
 static bool
-install_aarch64_call26_patch(struct shiva_ctx *ctx, struct shiva_module *linker,
-    struct shiva_branch_site *e, struct elf_symbol *patch_symbol,
-    struct shiva_transform *transform)
+module_island_map(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	struct elf_section section;
+	uint64_t text_lo, text_hi, lo, hi, base;
+	size_t size;
+	void *mem;
+
+	if (elf_section_by_name(linker->target_elfobj, ".text", &section) == false) {
+		fprintf(stderr, "elf_section_by_name failed to find \".text\"\n");
+		return false;
+	}
+	text_lo = ctx->ulexec.base_vaddr + section.address;
+	text_hi = text_lo + section.size;
+	lo = text_hi > SHIVA_CALL26_RANGE ? text_hi - SHIVA_CALL26_RANGE : 0;
+	hi = text_lo + SHIVA_CALL26_RANGE;
+	size = ELF_PAGEALIGN((linker->links.count + 1) * SHIVA_VENEER_SIZE +
+	    shiva_tf_island_size(linker), PAGE_SIZE);
+	/*
+	 * The maps were last read before any module was mapped.
+	 */
+	if (shiva_maps_refresh(ctx) == false) {
+		fprintf(stderr, "shiva_maps_refresh() failed\n");
+		return false;
+	}
+	if (shiva_maps_find_gap(ctx, lo, hi, size, &base) == false) {
+		fprintf(stderr, "No room for a branch island within range of %#lx - %#lx\n",
+		    text_lo, text_hi);
+		return false;
+	}
+	mem = mmap((void *)base, size, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+	if (mem == MAP_FAILED) {
+		shiva_debug("mmap failed: %s\n", strerror(errno));
+		return false;
+	}
+	if ((uint64_t)mem != base) {
+		munmap(mem, size);
+		fprintf(stderr, "Unable to map a branch island at %#lx\n", base);
+		return false;
+	}
+	linker->island.mem = mem;
+	linker->island.size = size;
+	linker->island.used = 0;
+	shiva_debug("Branch island for '%s' at %p (%zu bytes)\n",
+	    elf_pathname(&linker->elfobj), mem, size);
+	/*
+	 * The patch cache only knows about the text and data images.
+	 */
+	shiva_module_cache_invalidate(linker, "module uses a branch island");
+	return true;
+}
+
+/*
+ * Carve len bytes out of the branch island of the module, mapping the
+ * island first if need be. Returns NULL once the island is full.
+ */
+uint8_t *
+shiva_module_island_alloc(struct shiva_module *linker, size_t len)
+{
+	uint8_t *p;
+
+	if (linker->island.mem == NULL && module_island_map(linker->ctx, linker) == false)
+		return NULL;
+	if (linker->island.size - linker->island.used < len)
+		return NULL;
+	p = linker->island.mem + linker->island.used;
+	linker->island.used += len;
+	return p;
+}
+
+/*
+ * Make the veneers executable before anything is relinked to them.
+ */
+static bool
+module_island_seal(struct shiva_module *linker)
+{
+	if (linker->island.mem == NULL || linker->island.used == 0)
+		return true;
+	__builtin___clear_cache((char *)linker->island.mem,
+	    (char *)linker->island.mem + linker->island.used);
+	if (mprotect(linker->island.mem, linker->island.size, PROT_READ|PROT_EXEC) < 0) {
+		perror("mprotect");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * The address within the module image that calls to link are relinked
+ * to.
+ */
+static uint64_t
+patch_link_call_vaddr(struct shiva_module *linker, struct shiva_module_link *link)
 {
+	struct elf_symbol *patch_symbol = &link->call_symbol;
+	struct shiva_transform *transform = link->transform;
 	/*
 	 * The patch_symbol->value will be a symbol value found within the patch
 	 * module, containing an offset into the text section which is the first
 	 * section within a Shiva modules text segment.
 	 */
-	uint64_t target_vaddr = patch_symbol->value + linker->text_vaddr;
-	uint32_t insn_bytes = e->o_insn;
-	uint32_t call_offset;
-	shiva_error_t error;
-	bool res;
+	uint64_t target_vaddr;
 
 	shiva_debug("patch_symbol->value: %#lx\n", patch_symbol->value);
 	shiva_debug("transform: %p\n", transform);
@@ -105,8 +229,90 @@ install_aarch64_call26_patch(struct shiva_ctx *ctx, struct shiva_module *linker,
 			shiva_debug("Module has no transforms\n");
 		}
 	}
+	return shiva_hook_stats_patch_link(linker, link,
+	    shiva_module_numa_link(linker, link, target_vaddr));
+}
+
+#if __aarch64__
+/*
+ * A call26 site that can't reach the patch function at target_vaddr
+ * is relinked to a veneer in the island instead:
+ *
+ * veneer:	adrp	x16, target_vaddr
+ *		add	x16, x16, #:lo12:target_vaddr
+ *		br	x16
+ *
+ * x16 (IP0) may be clobbered by any veneer that a static linker places
+ * between caller and callee, so this is transparent to the target. Every
+ * site that calls the same patch function shares the veneer.
+ */
+static uint64_t
+install_aarch64_call26_veneer(struct shiva_module *linker, struct shiva_module_link *link,
+    uint64_t target_vaddr)
+{
+	uint8_t *veneer;
+	int32_t rel_val;
+	int64_t pages;
+
+	if (link->veneer != 0)
+		return link->veneer;
+	veneer = shiva_module_island_alloc(linker, SHIVA_VENEER_SIZE);
+	if (veneer == NULL) {
+		fprintf(stderr, "No branch island slot for a veneer to '%s'\n", link->name);
+		return 0;
+	}
+	/*
+	 * The adrp of the veneer reaches +/-4GB of the island.
+	 */
+	pages = (int64_t)(ELF_PAGESTART(target_vaddr) - ELF_PAGESTART((uint64_t)veneer)) >> 12;
+	if (pages < -(1L << 20) || pages >= (1L << 20)) {
+		fprintf(stderr, "%s(%#lx) is out of adrp range of the veneer at %p\n",
+		    link->name, target_vaddr, veneer);
+		return 0;
+	}
+	rel_val = (int32_t)pages;
+	shiva_aarch64_emit_insn(veneer, 0x90000010 |
+	    ((rel_val & RELOC_MASK(2)) << 29) | ((rel_val & (RELOC_MASK(19) << 2)) << 3));
+	shiva_aarch64_emit_insn(veneer + 4, 0x91000210 |
+	    ((target_vaddr & RELOC_MASK(12)) << 10));
+	shiva_aarch64_emit_insn(veneer + 8, 0xd61f0200);
+	link->veneer = (uint64_t)veneer;
+	shiva_debug("Call veneer for %s(%#lx) at %p\n", link->name, target_vaddr, veneer);
+	return link->veneer;
+}
+#endif
+
+static bool
+install_aarch64_call26_patch(struct shiva_ctx *ctx, struct shiva_module *linker,
+    struct shiva_branch_site *e, struct shiva_module_link *link,
+    struct shiva_patch_txn *txn)
+{
+	uint64_t target_vaddr = patch_link_call_vaddr(linker, link);
+	uint32_t insn_bytes = e->o_insn;
+	uint32_t call_offset;
+	shiva_error_t error;
+	bool res;
 
 	shiva_debug("PATCHING BRANCH SITE: %#lx\n", e->branch_site);
+	/*
+	 * Nothing guarantees that the module was mapped within range, i.e.
+	 * in interpreter mode it's placed after the heap.
+	 */
+	if (call26_in_range(e->branch_site + ctx->ulexec.base_vaddr, target_vaddr) == false) {
+#if __aarch64__
+		shiva_debug("%#lx is out of call26 range of %#lx\n", target_vaddr,
+		    e->branch_site + ctx->ulexec.base_vaddr);
+		target_vaddr = install_aarch64_call26_veneer(linker, link, target_vaddr);
+		if (target_vaddr == 0)
+			return false;
+#endif
+		if (call26_in_range(e->branch_site + ctx->ulexec.base_vaddr,
+		    target_vaddr) == false) {
+			fprintf(stderr, "Branch site %#lx cannot reach %#lx\n",
+			    e->branch_site + ctx->ulexec.base_vaddr, target_vaddr);
+			return false;
+		}
+	}
 	call_offset = (target_vaddr - ((e->branch_site + ctx->ulexec.base_vaddr))) >> 2;
 
 	shiva_debug("target_vaddr: %#lx branch_site: %#lx\n",
@@ -116,23 +322,138 @@ install_aarch64_call26_patch(struct shiva_ctx *ctx, struct shiva_module *linker,
 
 	insn_bytes = (insn_bytes & ~RELOC_MASK(26)) | (call_offset & RELOC_MASK(26));
 	/*
-	 * XXX
-	 * Technically the shiva_trace API shouldn't be used from within Shiva.
-	 * It's Akin to the Kernel invoking syscalls. Although atleast we aren't
-	 * calling shiva_trace(), but rather one of it's utility functions for
-	 * writing to memory. This won't cause any harm, but it's not congruent
-	 * with the modeled use cases of Shiva trace API which is meant to be invoked
-	 * by modules.
+	 * The write is queued, and applied along with every other relinked
+	 * instruction when apply_external_patch_links() commits the txn.
 	 */
-	res = shiva_trace_write(ctx, 0, (void *)e->branch_site + ctx->ulexec.base_vaddr,
-	    (void *)&insn_bytes, 4, &error);
+	res = shiva_patch_txn_write(txn, e->branch_site + ctx->ulexec.base_vaddr,
+	    &insn_bytes, 4, &error);
 	if (res == false) {
-		fprintf(stderr, "sihva_trace_write failed: %s\n", shiva_error_msg(&error));
+		fprintf(stderr, "shiva_patch_txn_write failed: %s\n", shiva_error_msg(&error));
+		return false;
+	}
+	return true;
+}
+
+#if __aarch64__
+/*
+ * Relink the adrp pair at site to var_addr without touching more than
+ * a single instruction of the target. The adrp becomes a b to a veneer
+ * in the island:
+ *
+ * veneer:	adrp	xN, var_addr	; relinked to the page of var_addr
+ *		add	xM, xN, #lo12	; relinked second instruction
+ *		b	site + 8
+ *
+ * The second instruction of the original pair is left alone, so a
+ * thread that already executed the original adrp finishes the original
+ * pair, and the b/adrp swap is a single 4 byte store. An adrp isn't one
+ * of the instructions that may be modified while another thread runs
+ * it, so shiva_live.c still commits the swap with the threads parked.
+ */
+static bool
+install_aarch64_xref_veneer(struct shiva_module *linker, uint64_t site, uint64_t var_addr,
+    uint32_t adrp_insn, uint32_t next_insn, struct shiva_patch_txn *txn)
+{
+	shiva_error_t error;
+	uint8_t *veneer;
+	uint64_t vaddr;
+	uint32_t b_insn;
+	int64_t off;
+	int32_t rel_val;
+
+	veneer = shiva_module_island_alloc(linker, SHIVA_VENEER_SIZE);
+	if (veneer == NULL) {
+		fprintf(stderr, "Branch island of '%s' is full\n", elf_pathname(&linker->elfobj));
+		return false;
+	}
+	vaddr = (uint64_t)veneer;
+	off = (int64_t)(vaddr - site);
+	if (call26_in_range(site, vaddr) == false) {
+		fprintf(stderr, "Veneer at %#lx is out of range of the xref at %#lx\n",
+		    vaddr, site);
+		return false;
+	}
+	rel_val = (int32_t)((int64_t)(ELF_PAGESTART(var_addr) - ELF_PAGESTART(vaddr)) >> 12);
+	adrp_insn = (adrp_insn & ~((RELOC_MASK(2) << 29) | (RELOC_MASK(19) << 5)))
+	    | ((rel_val & RELOC_MASK(2)) << 29) | ((rel_val & (RELOC_MASK(19) << 2)) << 3);
+	shiva_aarch64_emit_insn(veneer, adrp_insn);
+	shiva_aarch64_emit_insn(veneer + 4, next_insn);
+	shiva_aarch64_emit_b(veneer + 8, false, (int64_t)(site + 8 - (vaddr + 8)));
+	shiva_debug("Veneer for xref at %#lx: %#lx\n", site, vaddr);
+
+	b_insn = B | shiva_aarch64_encode(off >> 2, 26, 0);
+	if (shiva_patch_txn_write(txn, site, &b_insn, 4, &error) == false) {
+		fprintf(stderr, "shiva_patch_txn_write failed: %s\n", shiva_error_msg(&error));
+		return false;
+	}
+	return true;
+}
+#endif
+
+static int
+rela_addend_cmp(const void *a, const void *b)
+{
+	const Elf64_Rela *x = *(Elf64_Rela * const *)a, *y = *(Elf64_Rela * const *)b;
+
+	if (x->r_addend != y->r_addend)
+		return (x->r_addend > y->r_addend) - (x->r_addend < y->r_addend);
+	return (x > y) - (x < y);
+}
+
+/*
+ * Build ctx->rela_index over the DT_RELA table of the target, once.
+ */
+static bool
+target_rela_index(struct shiva_ctx *ctx)
+{
+	Elf64_Rela *rela;
+	uint64_t rela_ptr, relasz;
+	size_t i;
+
+	if (ctx->rela_index.init == true)
+		return true;
+	if (shiva_target_dynamic_get(ctx, DT_RELASZ, &relasz) == false) {
+		fprintf(stderr, "shiva_target_dynamic_get(%p, DT_RELASZ, ...) failed\n",
+		    ctx);
 		return false;
 	}
+	if (shiva_target_dynamic_get(ctx, DT_RELA, &rela_ptr) == false) {
+		fprintf(stderr, "shiva_target_dynamic_get(%p, DT_RELA, ...) failed\n",
+		    ctx);
+		return false;
+	}
+	rela = (void *)(rela_ptr + ctx->ulexec.base_vaddr);
+	ctx->rela_index.count = relasz / sizeof(Elf64_Rela);
+	ctx->rela_index.vec = shiva_arena_alloc(&ctx->arena.module,
+	    (ctx->rela_index.count + 1) * sizeof(Elf64_Rela *));
+	for (i = 0; i < ctx->rela_index.count; i++)
+		ctx->rela_index.vec[i] = &rela[i];
+	qsort(ctx->rela_index.vec, ctx->rela_index.count, sizeof(Elf64_Rela *),
+	    rela_addend_cmp);
+	ctx->rela_index.init = true;
+	shiva_debug("Indexed %zu DT_RELA entries by r_addend\n", ctx->rela_index.count);
 	return true;
 }
 
+/*
+ * Index of the first entry of ctx->rela_index whose r_addend is addend.
+ * The entries with the same r_addend follow it.
+ */
+static size_t
+target_rela_lower_bound(struct shiva_ctx *ctx, int64_t addend)
+{
+	size_t lo = 0, hi = ctx->rela_index.count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ctx->rela_index.vec[mid]->r_addend < addend)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 /*
  * XXX does not properly handle xrefs from target executable
  * to fully transformed function.
@@ -140,16 +461,18 @@ install_aarch64_call26_patch(struct shiva_ctx *ctx, struct shiva_module *linker,
  */
 static bool
 install_aarch64_xref_patch(struct shiva_ctx *ctx, struct shiva_module *linker,
-    struct shiva_xref_site *e, struct elf_symbol *patch_symbol)
+    struct shiva_xref_site *e, struct elf_symbol *patch_symbol,
+    struct shiva_patch_txn *txn)
 {
 
 	uint32_t n_adrp_insn;
 	uint32_t n_add_insn;
-	uint32_t n_ldr_insn;
-	uint32_t n_str_insn;
+	uint32_t n_ldst_insn;
 	int32_t rel_val, xoffset;
+	int64_t pages;
 	uint64_t rel_addr = e->adrp_site + ctx->ulexec.base_vaddr;
-	uint64_t var_segment;
+	uint64_t var_segment, var_addr, access;
+	struct elf_symbol *orig_symbol;
 	uint8_t *rel_unit;
 	struct elf_section shdr;
 	struct shiva_module_section_mapping smap;
@@ -219,57 +542,67 @@ install_aarch64_xref_patch(struct shiva_ctx *ctx, struct shiva_module *linker,
 	 * of the .bss variable.
 	 */
 	if (e->flags & SHIVA_XREF_F_INDIRECT) {
-		int i;
+		size_t i;
 		Elf64_Rela *rela;
-		size_t relasz;
-		uint64_t rela_ptr;
-		uint64_t var_addr = patch_symbol->value + var_segment;
+		int64_t addend;
+		uint64_t relval;
+		bool found = false;
+		uint64_t *got = (uint64_t *)(e->target_vaddr + ctx->ulexec.base_vaddr);
 
-		e->got = (uint64_t *)((uint64_t)e->got + ctx->ulexec.base_vaddr);
-
-		if (shiva_target_dynamic_get(ctx, DT_RELASZ, &relasz) == false) {
-			fprintf(stderr, "shiva_target_dynamic_get(%p, DT_RELASZ, ...) failed\n",
-			    ctx);
-			return false;
+		var_addr = patch_symbol->value + var_segment;
+		/*
+		 * LDSO consumed the R_AARCH64_RELATIVE relocations long before
+		 * a live patch is linked, so point the GOT entry itself at the
+		 * new variable instead. It's written along with the code.
+		 */
+		if (linker->flags & SHIVA_MODULE_F_LIVE) {
+			res = shiva_patch_txn_write(txn, (uint64_t)got, &var_addr, 8, &error);
+			if (res == false) {
+				fprintf(stderr, "shiva_patch_txn_write failed: %s\n",
+				    shiva_error_msg(&error));
+				return false;
+			}
+			return true;
 		}
 
-		if (shiva_target_dynamic_get(ctx, DT_RELA, &rela_ptr) == false) {
-			fprintf(stderr, "shiva_target_dynamic_set(%p, DT_RELA, ...) failed\n",
-			    ctx);
+		if (target_rela_index(ctx) == false)
 			return false;
-		}
-		rela_ptr += ctx->ulexec.base_vaddr;
-		rela = (void *)rela_ptr;
-		for (i = 0; i < relasz / sizeof(Elf64_Rela); i++) {
-			if (rela[i].r_addend == *(e->got)) {
-				uint64_t relval = var_addr - ctx->ulexec.base_vaddr - 4;
-
-				shiva_debug("Found RELATIVE rela.dyn relocation entry for %s\n",
-				    patch_symbol->name);
-				shiva_debug("Patching rela[%d].r_addend with %#lx\n", i, relval);
-				res = shiva_trace_write(ctx, 0, (void *)&rela[i].r_addend, (void *)&relval,
-				    8, &error);
-				if (res == false) {
-					fprintf(stderr, "shiva_trace_write failed: %s\n",
-					    shiva_error_msg(&error));
-					return false;
-				}
-				/*
-				 * XXX - We do not support ELF32 at the moment, but if we did
-				 * the Elf32_Rel doesn't contain an r_addend field. The rtld
-				 * retrieves it from the relocation unit. We overwrite the
-				 * addend (Pointed to by e->got) with the correct offset to
-				 * the global object (the symbol), i.e. a variable in the .bss.
-				 * This call to shiva_trace_write() isn't necessary on 64bit.
-				 */
-				res = shiva_trace_write(ctx, 0, (void *)e->got, (void *)&relval,
-				    8, &error);
-				if (res == false) {
-					fprintf(stderr, "shiva_trace_write failed: %s\n",
-					    shiva_error_msg(&error));
-					return false;
-				}
+		/*
+		 * Every indirect xref to the variable shares the GOT entry, the
+		 * writes of the second and later ones just repeat the first.
+		 */
+		addend = *got;
+		relval = var_addr - ctx->ulexec.base_vaddr - 4;
+		for (i = target_rela_lower_bound(ctx, addend); i < ctx->rela_index.count &&
+		    ctx->rela_index.vec[i]->r_addend == addend; i++) {
+			rela = ctx->rela_index.vec[i];
+			shiva_debug("Found RELATIVE rela.dyn relocation entry for %s\n",
+			    patch_symbol->name);
+			shiva_debug("Patching r_addend at %p with %#lx\n", &rela->r_addend, relval);
+			res = shiva_patch_txn_write(txn, (uint64_t)&rela->r_addend, &relval,
+			    8, &error);
+			if (res == false) {
+				fprintf(stderr, "shiva_patch_txn_write failed: %s\n",
+				    shiva_error_msg(&error));
+				return false;
 			}
+			found = true;
+		}
+		if (found == false)
+			return true;
+		/*
+		 * XXX - We do not support ELF32 at the moment, but if we did
+		 * the Elf32_Rel doesn't contain an r_addend field. The rtld
+		 * retrieves it from the relocation unit. We overwrite the
+		 * addend (Pointed to by got) with the correct offset to
+		 * the global object (the symbol), i.e. a variable in the .bss.
+		 * This write isn't necessary on 64bit.
+		 */
+		res = shiva_patch_txn_write(txn, (uint64_t)got, &relval, 8, &error);
+		if (res == false) {
+			fprintf(stderr, "shiva_patch_txn_write failed: %s\n",
+			    shiva_error_msg(&error));
+			return false;
 		}
 		return true;
 	}
@@ -288,158 +621,667 @@ install_aarch64_xref_patch(struct shiva_ctx *ctx, struct shiva_module *linker,
 	case SHIVA_XREF_TYPE_ADRP_ADD:
 		rel_unit = (uint8_t *)e->adrp_site + ctx->ulexec.base_vaddr; // address of unit we are patching in target ELF executable
 		shiva_debug("Installing SHIVA_XREF_TYPE_ADRP_ADD patch at %#lx\n", e->adrp_site + ctx->ulexec.base_vaddr);
-		res = shiva_trace_write(ctx, 0, (void *)rel_unit,
-		    (void *)&n_adrp_insn, 4, &error);
-		if (res == false) {
-			fprintf(stderr, "shiva_trace_write failed: %s\n", shiva_error_msg(&error));
-			return false;
-		}
 		rel_val = patch_symbol->value;
 		shiva_debug("Add offset: %#lx\n", rel_val);
 		n_add_insn = e->next_o_insn;
 		n_add_insn = (n_add_insn & ~(RELOC_MASK(12) << 10)) | ((rel_val & RELOC_MASK(12)) << 10);
+#if __aarch64__
+		if (linker->flags & SHIVA_MODULE_F_VENEERS)
+			return install_aarch64_xref_veneer(linker, (uint64_t)rel_unit,
+			    patch_symbol->value + var_segment, e->adrp_o_insn & 0xffffffff,
+			    n_add_insn, txn);
+#endif
+		res = shiva_patch_txn_write(txn, (uint64_t)rel_unit,
+		    &n_adrp_insn, 4, &error);
+		if (res == false) {
+			fprintf(stderr, "shiva_patch_txn_write failed: %s\n", shiva_error_msg(&error));
+			return false;
+		}
 
 		rel_unit += sizeof(uint32_t);
-		res = shiva_trace_write(ctx, 0, (void *)rel_unit,
-		    (void *)&n_add_insn, 4, &error);
+		res = shiva_patch_txn_write(txn, (uint64_t)rel_unit,
+		    &n_add_insn, 4, &error);
 		if (res == false) {
-			fprintf(stderr, "shiva_trace_write failed: %s\n", shiva_error_msg(&error));
+			fprintf(stderr, "shiva_patch_txn_write failed: %s\n", shiva_error_msg(&error));
 			return false;
 		}
 		break;
 	case SHIVA_XREF_TYPE_ADRP_LDR:
+	case SHIVA_XREF_TYPE_ADRP_STR:
+		/*
+		 * adrp	x0, var
+		 * ldr	w1, [x0, #:lo12:var] (or str)
+		 *
+		 * The access may be to a member of var rather than to its
+		 * start, which is kept as the same offset into the patched
+		 * var. The imm12 is scaled by the size of the access, so the
+		 * new address must be aligned to it as the old one was.
+		 */
 		rel_unit = (uint8_t *)e->adrp_site + ctx->ulexec.base_vaddr;
-		rel_val = patch_symbol->value;
-		shiva_debug("Installing SHIVA_XREF_TYPE_ADRP_LDR patch at %#lx\n",
-		    e->adrp_site + ctx->ulexec.base_vaddr);
-		shiva_debug("SHIVA_XREF_TYPE_ADRP_LDR not yet supported\n");
-		assert(true);
+		orig_symbol = shiva_analyze_symbol(ctx, e->symbol);
+		access = e->target_vaddr - orig_symbol->value;
+		if (e->target_vaddr < orig_symbol->value ||
+		    (access > 0 && access >= patch_symbol->size)) {
+			fprintf(stderr, "xref at %#lx accesses %s+%#lx, which is outside "
+			    "of the patched %s\n", e->adrp_site, orig_symbol->name, access,
+			    patch_symbol->name);
+			return false;
+		}
+		var_addr = patch_symbol->value + var_segment + access;
+		shiva_debug("Installing %s patch at %#lx for %s+%#lx\n",
+		    e->type == SHIVA_XREF_TYPE_ADRP_LDR ? "SHIVA_XREF_TYPE_ADRP_LDR" :
+		    "SHIVA_XREF_TYPE_ADRP_STR", (uint64_t)rel_unit, patch_symbol->name, access);
+#if __aarch64__
+		if (shiva_aarch64_ldst_set_imm(e->next_o_insn, var_addr & 0xfff,
+		    &n_ldst_insn) == false) {
+			fprintf(stderr, "%s+%#lx at %#lx is not aligned to the size of the "
+			    "access at %#lx\n", patch_symbol->name, access, var_addr, e->adrp_site);
+			return false;
+		}
+		if (linker->flags & SHIVA_MODULE_F_VENEERS)
+			return install_aarch64_xref_veneer(linker, (uint64_t)rel_unit,
+			    var_addr, e->adrp_o_insn & 0xffffffff, n_ldst_insn, txn);
+#else
+		fprintf(stderr, "Cannot relink the ldr/str xref at %#lx on x86_64. Unsupported\n",
+		    e->adrp_site);
+		return false;
+#endif
+		pages = (int64_t)(ELF_PAGESTART(var_addr) - ELF_PAGESTART((uint64_t)rel_unit)) >> 12;
+		if (pages < -(1L << 20) || pages >= (1L << 20)) {
+			fprintf(stderr, "%s at %#lx is out of adrp range of the xref at %#lx\n",
+			    patch_symbol->name, var_addr, e->adrp_site);
+			return false;
+		}
+		n_adrp_insn = (e->adrp_o_insn & ~((RELOC_MASK(2) << 29) | (RELOC_MASK(19) << 5)))
+		    | ((pages & RELOC_MASK(2)) << 29) | ((pages & (RELOC_MASK(19) << 2)) << 3);
+		res = shiva_patch_txn_write(txn, (uint64_t)rel_unit,
+		    &n_adrp_insn, 4, &error);
+		if (res == false) {
+			fprintf(stderr, "shiva_patch_txn_write failed: %s\n", shiva_error_msg(&error));
+			return false;
+		}
+		rel_unit += sizeof(uint32_t);
+		res = shiva_patch_txn_write(txn, (uint64_t)rel_unit,
+		    &n_ldst_insn, 4, &error);
+		if (res == false) {
+			fprintf(stderr, "shiva_patch_txn_write failed: %s\n", shiva_error_msg(&error));
+			return false;
+		}
 		break;
 	}
 	return true;
 
 }
+static int
+link_addr_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static struct shiva_module_link *
+lookup_patch_link(struct shiva_module *linker, const char *name)
+{
+	return shiva_htab_find(&linker->cache.links, name);
+}
+
+/*
+ * Build an index of every global function and object within the patch
+ * that can replace a symbol of the same name within the target. Splice
+ * transforms are indexed by the name of the function they transform,
+ * i.e. __shiva_splice_fn_name_foo is stored under 'foo'. The sorted
+ * target addresses of each entry let us discard the callsites and xrefs
+ * that don't reference a patched symbol with a single bsearch.
+ */
 static bool
-apply_external_patch_links(struct shiva_ctx *ctx, struct shiva_module *linker)
+build_patch_link_index(struct shiva_ctx *ctx, struct shiva_module *linker)
 {
-	struct shiva_transform *transform = NULL;
-	struct shiva_transform *tfptr = NULL;
-	shiva_callsite_iterator_t callsites;
-	struct shiva_branch_site be, *branch;
-	shiva_xref_iterator_t xrefs;
-	struct shiva_xref_site xe;
-	shiva_iterator_res_t ires;
-	struct elf_symbol symbol;
-	bool res;
-	const char *symname = NULL;
+	struct shiva_transform *transform;
+	struct shiva_module_link *link;
+	elf_symtab_iterator_t sym_iter;
+	struct elf_symbol symbol, target_sym;
+	size_t count = 0, i;
+	char *name;
 
-#if __x86_64__
-	fprintf(stderr, "Cannot apply external patch links on x86_64. Unsupported\n");
-	return false;
-#endif
+	if (linker->links.vec != NULL)
+		return true;
+	elf_symtab_iterator_init(&linker->elfobj, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
+		if (symbol.bind == STB_GLOBAL &&
+		    (symbol.type == STT_FUNC || symbol.type == STT_OBJECT))
+			count++;
+	}
+	linker->links.vec = shiva_arena_alloc(&ctx->arena.module,
+	    (count + 1) * sizeof(struct shiva_module_link));
+	linker->links.addrs = shiva_arena_alloc(&ctx->arena.module,
+	    (count + 1) * sizeof(uint64_t));
+	linker->links.count = 0;
+	linker->links.addr_count = 0;
+	shiva_htab_init(&linker->cache.links, count);
 
-	shiva_callsite_iterator_init(ctx, &callsites);
-	while (shiva_callsite_iterator_next(&callsites, &be) == SHIVA_ITER_OK) {
-		if (be.branch_flags & SHIVA_BRANCH_F_PLTCALL) // TODO handle this scenario instead which
+	elf_symtab_iterator_init(&linker->elfobj, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
+		if (symbol.bind != STB_GLOBAL)
+			continue;
+		if (symbol.type != STT_FUNC && symbol.type != STT_OBJECT)
 			continue;
 		/*
-		 * The callsites were found early on in shiva_analyze.c and
-		 * contain every branch instruction within the target ELF.
-		 */
-
-		/*
-		 * Check the patch object file (Represented by &linker->elfobj) to see
-		 * if it contains the same function name within it as the one originally
-		 * being called. If so then we relink this call instruction to point to
-		 * our new relocated function.
-		 *
-		 * If transformations are involved, then any calls from say main() to
-		 * foo(), are relinked to a newly created version of foo with spliced in
-		 * patch code. This source transform function will be called:
-		 * __shiva_splice_fn_name_foo() in the patch object. So we must search
-		 * for it by the correct name.
+		 * Variants are linked in through the function they stand in for.
 		 */
-		shiva_debug("tfptr: %p\n", tfptr);
-		shiva_debug("Callsite %#lx branches to %#lx\n", be.branch_site, be.target_vaddr);
-		symname = be.symbol.name;
-		if (module_has_transforms(linker) == true) {
+		if (strncmp(symbol.name, SHIVA_VARIANT_ID, strlen(SHIVA_VARIANT_ID)) == 0)
+			continue;
+		name = (char *)symbol.name;
+		transform = NULL;
+		if (symbol.type == STT_FUNC && module_has_transforms(linker) == true &&
+		    shiva_tf_splice_target(name) != NULL) {
 			TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
-				switch(transform->type) {
-				case SHIVA_TRANSFORM_SPLICE_FUNCTION:
-					shiva_debug("Comparing %s and %s\n",
-					    transform->source_symbol.name +
-					    strlen(SHIVA_T_SPLICE_FUNC_ID), be.symbol.name);
-					if (strcmp(transform->source_symbol.name +
-					    strlen(SHIVA_T_SPLICE_FUNC_ID), be.symbol.name) == 0) {
-						symname = transform->source_symbol.name;
-						shiva_debug("Transform source found: %s\n", symname);
-						tfptr = transform;
-					}
-					break;
-				default:
+				if (transform->type == SHIVA_TRANSFORM_SPLICE_FUNCTION &&
+				    strcmp(transform->source_symbol.name, symbol.name) == 0)
 					break;
-				}
 			}
-		}
-		if (elf_symbol_by_name(&linker->elfobj, symname,
-		    &symbol) == true) {
-			if (symbol.type != STT_FUNC ||
-			    symbol.bind != STB_GLOBAL)
+			/*
+			 * A function spliced in place is still called where it
+			 * always was.
+			 */
+			if (transform == NULL || (transform->flags & SHIVA_TRANSFORM_F_INPLACE))
 				continue;
-#if __aarch64__
-			shiva_debug("Installing patch offset on target at %#lx for %s. Transform: %p\n",
-			    be.branch_site, symbol.name, tfptr);
-			res = install_aarch64_call26_patch(ctx, linker, &be, &symbol, tfptr);
-			if (res == false) {
-				fprintf(stderr, "external linkage failure: "
-				    "install_aarch64_call26_patch() failed\n");
+			transform = transform->splice.primary;
+			name = (char *)shiva_tf_splice_target(name);
+		}
+		link = lookup_patch_link(linker, name);
+		if (link == NULL) {
+			link = &linker->links.vec[linker->links.count++];
+			link->name = name;
+			if (shiva_htab_insert(&linker->cache.links, name, link) == false) {
+				fprintf(stderr, "Failed to index patch symbol: %s\n", name);
 				return false;
 			}
-#endif
+			if (shiva_symbol_by_name(&linker->ctx->gnu_hash, linker->target_elfobj, name,
+			    &target_sym) == true) {
+				link->target_vaddr = target_sym.value;
+				link->target_size = target_sym.size;
+				linker->links.addrs[linker->links.addr_count++] = target_sym.value;
+			}
 		}
-		tfptr = NULL;
+		if (transform != NULL) {
+			/*
+			 * A splice transform always takes precedence over a
+			 * function of the same name.
+			 */
+			memcpy(&link->call_symbol, &symbol, sizeof(symbol));
+			link->transform = transform;
+			link->flags |= SHIVA_MODULE_LINK_F_CALL;
+		} else if (symbol.type == STT_FUNC) {
+			if (link->transform != NULL)
+				continue;
+			memcpy(&link->call_symbol, &symbol, sizeof(symbol));
+			(void) patch_variant_symbol(linker, symbol.name, &link->call_symbol);
+			link->flags |= SHIVA_MODULE_LINK_F_CALL;
+		} else {
+			memcpy(&link->xref_symbol, &symbol, sizeof(symbol));
+			link->flags |= SHIVA_MODULE_LINK_F_XREF;
+		}
+		shiva_debug("Indexed patch link %s(%#lx) transform: %p\n",
+		    name, link->target_vaddr, link->transform);
 	}
-
-	shiva_debug("Calling shiva_xref_iterator_init\n");
+	qsort(linker->links.addrs, linker->links.addr_count, sizeof(uint64_t),
+	    link_addr_cmp);
+	/*
+	 * Remove duplicate addresses (Aliases within the target).
+	 */
+	for (count = 0, i = 0; i < linker->links.addr_count; i++) {
+		if (count == 0 || linker->links.addrs[count - 1] != linker->links.addrs[i])
+			linker->links.addrs[count++] = linker->links.addrs[i];
+	}
+	linker->links.addr_count = count;
+	return true;
+}
+
+static inline bool
+patch_link_address(struct shiva_module *linker, uint64_t addr)
+{
+	return bsearch(&addr, linker->links.addrs, linker->links.addr_count,
+	    sizeof(uint64_t), link_addr_cmp) != NULL;
+}
+
+/*
+ * Calls to an overridden function are relinked one callsite at a time,
+ * which costs nothing at runtime, but turns every text page holding one
+ * of them into a private copy. A function that is called from all over
+ * the target (i.e. a logging helper) is detoured instead: a single b to
+ * the patch is written at the entry of the original function, which
+ * costs one branch per call and dirties a single page.
+ *
+ * SHIVA_PATCH_REDIRECT=callsite never detours, and =detour detours every
+ * function that can be. By default a function is detoured once its
+ * callsites span more than SHIVA_DETOUR_MIN_PAGES pages (Besides the
+ * page of its entry).
+ */
+#define SHIVA_DETOUR_MIN_PAGES	4
+
+int
+shiva_module_redirect_mode(void)
+{
+	char *env = getenv("SHIVA_PATCH_REDIRECT");
+
+	if (env == NULL)
+		return SHIVA_REDIRECT_AUTO;
+	if (strcmp(env, "callsite") == 0)
+		return SHIVA_REDIRECT_CALLSITE;
+	if (strcmp(env, "detour") == 0)
+		return SHIVA_REDIRECT_DETOUR;
+	return SHIVA_REDIRECT_AUTO;
+}
+
+#if __aarch64__
+#define AARCH64_BTI_MASK	0xffffff3f
+#define AARCH64_BTI		0xd503241f /* bti {c,j,jc} */
+#define AARCH64_PACIASP		0xd503233f
+#define AARCH64_PACIBSP		0xd503237f
+
+/*
+ * Does the patch call the original function of link, through a
+ * __shiva_helper_orig_func_<name> helper (See validate_helpers())?
+ */
+static bool
+patch_link_orig_helper(struct shiva_module *linker, struct shiva_module_link *link)
+{
+	struct shiva_helper *helper;
+
+	TAILQ_FOREACH(helper, &linker->tailq.helper_list, _linkage) {
+		if (helper->type == SHIVA_HELPER_CALL_EXTERNAL &&
+		    strcmp(helper->symbol.name, link->name) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Find the instruction of the target function of link that the detour
+ * replaces. The original function is never resumed, so the displaced
+ * instruction needn't be relocated anywhere, but not every function can
+ * be detoured:
+ *
+ * A bti landing pad at the entry stays where it is, since indirect calls
+ * would fault on a b, and the detour goes right after it. paciasp and
+ * pacibsp double as landing pads, and there is nothing to put after
+ * them that wouldn't return to the caller with a signed LR.
+ *
+ * A branch within the target to the detour site, i.e. a loop that
+ * begins at the entry of a leaf function, would end up in the patch.
+ *
+ * A patch that still calls the original function through
+ * SHIVA_HELPER_CALL_EXTERNAL() would call right back into itself.
+ */
+static bool
+patch_link_detour_site(struct shiva_ctx *ctx, struct shiva_module *linker,
+    struct shiva_module_link *link, uint64_t *site)
+{
+	struct shiva_branch_site *branch;
+	uint32_t insn;
+	size_t i;
+
+	if (link->transform != NULL || link->target_vaddr == 0 ||
+	    link->target_size < sizeof(uint32_t))
+		return false;
+	if (patch_link_orig_helper(linker, link) == true)
+		return false;
+	*site = link->target_vaddr;
+	insn = *(uint32_t *)(ctx->ulexec.base_vaddr + link->target_vaddr);
+	if ((insn & AARCH64_BTI_MASK) == AARCH64_BTI) {
+		/*
+		 * SHIVA_ANALYZE_LAZY only keeps the branches to the entry.
+		 */
+		if (link->target_size < 2 * sizeof(uint32_t) || ctx->analysis.lazy == true)
+			return false;
+		*site += sizeof(uint32_t);
+	} else if (insn == AARCH64_PACIASP || insn == AARCH64_PACIBSP) {
+		return false;
+	}
+	for (i = shiva_analyze_branch_index(ctx, link->target_vaddr);
+	    i < ctx->analysis.branch_count; i++) {
+		branch = &ctx->analysis.branches[i];
+		if (branch->branch_site >= link->target_vaddr + link->target_size)
+			break;
+		if (branch->branch_type != SHIVA_BRANCH_CALL && branch->target_vaddr == *site)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Decide which of the functions that the patch overrides are detoured,
+ * from the callsites that relinking them would rewrite.
+ */
+static void
+choose_patch_redirects(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	struct shiva_module_link *link;
+	shiva_callsite_iterator_t callsites;
+	struct shiva_branch_site *be;
+	uint64_t page, site;
+	int mode = shiva_module_redirect_mode();
+	size_t i;
+
+	if (mode == SHIVA_REDIRECT_CALLSITE)
+		return;
+	for (i = 0; i < linker->links.count; i++) {
+		link = &linker->links.vec[i];
+		link->callsites = link->callsite_pages = 0;
+		link->last_page = ELF_PAGESTART(link->target_vaddr);
+	}
+	/*
+	 * The callsites are in ascending address order.
+	 */
+	shiva_callsite_iterator_init(ctx, &callsites);
+	while (shiva_callsite_iterator_next(&callsites, &be) == SHIVA_ITER_OK) {
+		if (patch_link_address(linker, be->target_vaddr) == false)
+			continue;
+		link = lookup_patch_link(linker, shiva_analyze_symbol(ctx, be->symbol)->name);
+		if (link == NULL || (link->flags & SHIVA_MODULE_LINK_F_CALL) == 0)
+			continue;
+		link->callsites++;
+		page = ELF_PAGESTART(be->branch_site);
+		if (page != link->last_page && page != ELF_PAGESTART(link->target_vaddr))
+			link->callsite_pages++;
+		link->last_page = page;
+	}
+	for (i = 0; i < linker->links.count; i++) {
+		link = &linker->links.vec[i];
+		if ((link->flags & SHIVA_MODULE_LINK_F_CALL) == 0)
+			continue;
+		if (mode == SHIVA_REDIRECT_AUTO && link->callsite_pages <= SHIVA_DETOUR_MIN_PAGES)
+			continue;
+		if (patch_link_detour_site(ctx, linker, link, &site) == false)
+			continue;
+		link->flags |= SHIVA_MODULE_LINK_F_DETOUR;
+		shiva_debug("Detouring %s at %#lx: %zu callsites over %zu pages\n",
+		    link->name, site, link->callsites, link->callsite_pages);
+	}
+	return;
+}
+
+/*
+ * Write the b from the original function of link to the patch.
+ */
+static bool
+install_aarch64_detour(struct shiva_ctx *ctx, struct shiva_module *linker,
+    struct shiva_module_link *link, struct shiva_patch_txn *txn)
+{
+	uint64_t site, target_vaddr;
+	uint32_t insn_bytes;
+	shiva_error_t error;
+
+	if (patch_link_detour_site(ctx, linker, link, &site) == false)
+		return false;
+	site += ctx->ulexec.base_vaddr;
+	target_vaddr = patch_link_call_vaddr(linker, link);
+	if (call26_in_range(site, target_vaddr) == false) {
+		target_vaddr = install_aarch64_call26_veneer(linker, link, target_vaddr);
+		if (target_vaddr == 0)
+			return false;
+		if (call26_in_range(site, target_vaddr) == false) {
+			fprintf(stderr, "Detour at %#lx cannot reach %#lx\n", site, target_vaddr);
+			return false;
+		}
+	}
+	insn_bytes = 0x14000000 | (((target_vaddr - site) >> 2) & RELOC_MASK(26));
+	shiva_debug("Installing detour at %#lx for %s -> %#lx\n", site, link->name,
+	    target_vaddr);
+	if (shiva_patch_txn_write(txn, site, &insn_bytes, 4, &error) == false) {
+		fprintf(stderr, "shiva_patch_txn_write failed: %s\n", shiva_error_msg(&error));
+		return false;
+	}
+	return true;
+}
+#endif
+
+/*
+ * The link of a bl foo@plt within the target, if the patch defines foo.
+ * This is how a patch overrides a shared library function (i.e. one of
+ * libc) that the target calls, with a direct branch rather than a hook
+ * of its GOT slot.
+ */
+static struct shiva_module_link *
+lookup_patch_plt_link(struct shiva_ctx *ctx, struct shiva_module *linker,
+    struct shiva_branch_site *be)
+{
+	struct shiva_module_link *link;
+	const char *name, *suffix;
+	char tmp[256];
+
+	name = shiva_analyze_symbol(ctx, be->symbol)->name;
+	if (name == NULL)
+		return NULL;
+	suffix = strrchr(name, '@');
+	if (suffix == NULL || strcmp(suffix, "@plt") != 0)
+		return NULL;
+	if (snprintf(tmp, sizeof(tmp), "%.*s", (int)(suffix - name), name) >= (int)sizeof(tmp))
+		return NULL;
+	link = lookup_patch_link(linker, tmp);
+	if (link == NULL || (link->flags & SHIVA_MODULE_LINK_F_CALL) == 0 ||
+	    link->transform != NULL)
+		return NULL;
+	return link;
+}
+
+/*
+ * Queue every rewrite of the target that links it to the patch into txn.
+ */
+static bool
+queue_external_patch_links(struct shiva_ctx *ctx, struct shiva_module *linker,
+    struct shiva_patch_txn *txn)
+{
+	struct shiva_module_link *link;
+	shiva_callsite_iterator_t callsites;
+	struct shiva_branch_site *be;
+	shiva_xref_iterator_t xrefs;
+	struct shiva_xref_site *xe;
+	struct elf_symbol *symbol;
+	size_t i;
+	bool res;
+
+#if __x86_64__
+	fprintf(stderr, "Cannot apply external patch links on x86_64. Unsupported\n");
+	return false;
+#endif
+
+	if (linker->links.vec == NULL && build_patch_link_index(ctx, linker) == false) {
+		fprintf(stderr, "build_patch_link_index() failed\n");
+		return false;
+	}
+	if (linker->links.count == 0) {
+		shiva_debug("Patch overrides no symbols within the target\n");
+		goto splice;
+	}
+#if __aarch64__
+	choose_patch_redirects(ctx, linker);
+#endif
+
+	shiva_callsite_iterator_init(ctx, &callsites);
+	while (shiva_callsite_iterator_next(&callsites, &be) == SHIVA_ITER_OK) {
+		/*
+		 * The callsites were found early on in shiva_analyze.c and
+		 * contain every branch instruction within the target ELF.
+		 */
+
+		/*
+		 * Check the patch object file (Represented by &linker->elfobj) to see
+		 * if it contains the same function name within it as the one originally
+		 * being called. If so then we relink this call instruction to point to
+		 * our new relocated function.
+		 *
+		 * If transformations are involved, then any calls from say main() to
+		 * foo(), are relinked to a newly created version of foo with spliced in
+		 * patch code. This source transform function will be called:
+		 * __shiva_splice_fn_name_foo() in the patch object. The link index
+		 * stores it under 'foo'.
+		 *
+		 * A call through the PLT (bl foo@plt) is relinked straight to
+		 * the patch as well.
+		 */
+		if (be->branch_flags & SHIVA_BRANCH_F_PLTCALL) {
+			link = lookup_patch_plt_link(ctx, linker, be);
+		} else {
+			if (patch_link_address(linker, be->target_vaddr) == false)
+				continue;
+			shiva_debug("Callsite %#lx branches to %#lx\n", be->branch_site,
+			    be->target_vaddr);
+			link = lookup_patch_link(linker, shiva_analyze_symbol(ctx, be->symbol)->name);
+		}
+		if (link == NULL || (link->flags & SHIVA_MODULE_LINK_F_CALL) == 0 ||
+		    (link->flags & SHIVA_MODULE_LINK_F_DETOUR))
+			continue;
+#if __aarch64__
+		shiva_debug("Installing patch offset on target at %#lx for %s. Transform: %p\n",
+		    be->branch_site, link->call_symbol.name, link->transform);
+		res = install_aarch64_call26_patch(ctx, linker, be, link, txn);
+		if (res == false) {
+			fprintf(stderr, "external linkage failure: "
+			    "install_aarch64_call26_patch() failed\n");
+			return false;
+		}
+#endif
+	}
+#if __aarch64__
+	for (i = 0; i < linker->links.count; i++) {
+		link = &linker->links.vec[i];
+		if ((link->flags & SHIVA_MODULE_LINK_F_DETOUR) == 0)
+			continue;
+		if (install_aarch64_detour(ctx, linker, link, txn) == false) {
+			fprintf(stderr, "external linkage failure: "
+			    "install_aarch64_detour() failed for %s\n", link->name);
+			return false;
+		}
+	}
+#endif
+
+	shiva_debug("Calling shiva_xref_iterator_init\n");
 	shiva_xref_iterator_init(ctx, &xrefs);
 
 	shiva_debug("iterating over xrefs\n");
 	while (shiva_xref_iterator_next(&xrefs, &xe) == SHIVA_ITER_OK) {
-		switch(xe.type) {
+		switch(xe->type) {
 		case SHIVA_XREF_TYPE_UNKNOWN:
 			fprintf(stderr, "External linkage failure: "
 			    "Discovered unknown XREF insn-sequence at %#lx\n",
-			    xe.adrp_site);
+			    xe->adrp_site);
 			return false;
 		case SHIVA_XREF_TYPE_ADRP_LDR:
 		case SHIVA_XREF_TYPE_ADRP_STR:
 		case SHIVA_XREF_TYPE_ADRP_ADD:
+			symbol = shiva_analyze_symbol(ctx, (xe->flags & SHIVA_XREF_F_INDIRECT) ?
+			    xe->deref_symbol : xe->symbol);
+			if (patch_link_address(linker, symbol->value) == false)
+				continue;
 			shiva_debug("Found %s XREF at %#lx for %s\n",
-			   (xe.flags & SHIVA_XREF_F_INDIRECT) ? "indirect" : "", xe.adrp_site, xe.symbol.name);
-			if (elf_symbol_by_name(&linker->elfobj,
-			    (xe.flags & SHIVA_XREF_F_INDIRECT) ? xe.deref_symbol.name : xe.symbol.name,
-			    &symbol) == true) {
-				shiva_debug("Found symbol for %s\n", xe.symbol.name);
-				if (symbol.type != STT_OBJECT ||
-				    symbol.bind != STB_GLOBAL)
-					continue;
-				shiva_debug("Installing xref patch at %#lx for symbol %s\n",
-				    xe.adrp_site, xe.symbol.name);
-				res = install_aarch64_xref_patch(ctx, linker, &xe, &symbol);
-				if (res == false) {
-					fprintf(stderr, "install_aarch64_xref_patch() for '%s' failed\n",
-					    symbol.name);
+			   (xe->flags & SHIVA_XREF_F_INDIRECT) ? "indirect" : "", xe->adrp_site, symbol->name);
+			link = lookup_patch_link(linker, symbol->name);
+			if (link == NULL || (link->flags & SHIVA_MODULE_LINK_F_XREF) == 0)
+				continue;
+			shiva_debug("Installing xref patch at %#lx for symbol %s\n",
+			    xe->adrp_site, symbol->name);
+			res = install_aarch64_xref_patch(ctx, linker, xe, &link->xref_symbol,
+			    txn);
+			if (res == false) {
+				fprintf(stderr, "install_aarch64_xref_patch() for '%s' failed\n",
+				    link->xref_symbol.name);
 					return false;
-				}
 			}
 			break;
 		default:
 			break;
 		}
 	}
-
+splice:
+	/*
+	 * In place splices are queued last, so that they overwrite any
+	 * call or xref that was relinked within the code they replace.
+	 */
+	if (module_has_transforms(linker) == true &&
+	    shiva_tf_queue_inplace(linker, txn) == false) {
+		fprintf(stderr, "shiva_tf_queue_inplace() failed\n");
+		return false;
+	}
+	return true;
+}
+/*
+ * Link the target to each of the count patches in linkers. Every relinked
+ * instruction is queued in a single txn and written out at the end, see
+ * shiva_patch.c. The writes of a later patch are queued after those of
+ * an earlier one, so when two patches override the same symbol the
+ * later patch in the list wins.
+ */
+static bool
+apply_external_patch_links(struct shiva_ctx *ctx, struct shiva_module **linkers,
+    size_t count)
+{
+	struct shiva_patch_txn txn;
+	shiva_error_t error;
+	size_t i;
+	shiva_stats_mark_t t0 = SHIVA_STATS_START(ctx);
+
+	shiva_patch_txn_begin(ctx, &txn);
+	for (i = 0; i < count; i++) {
+		if (queue_external_patch_links(ctx, linkers[i], &txn) == false ||
+		    module_island_seal(linkers[i]) == false ||
+		    shiva_module_numa_seal(linkers[i]) == false) {
+			shiva_patch_txn_abort(&txn);
+			return false;
+		}
+	}
+	if (count == 1)
+		shiva_module_cache_note_txn(linkers[0], &txn);
+	if (shiva_patch_txn_commit(&txn, &error) == false) {
+		fprintf(stderr, "shiva_patch_txn_commit failed: %s\n", shiva_error_msg(&error));
+		return false;
+	}
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_RELINK, t0);
 	return true;
 }
+/*
+ * The ELF object of Shiva itself. It is only needed to resolve symbols
+ * that a module links against the Shiva API, which most microcode
+ * patches never do, so it is opened on first use, once for every
+ * module. Returns NULL if it can't be opened.
+ */
+static elfobj_t *
+module_self(struct shiva_module *linker)
+{
+	struct shiva_ctx *ctx = linker->ctx;
+	const char *shiva_path;
+	elf_error_t error;
+	shiva_stats_mark_t t0;
+
+	if (ctx->shiva_elfobj_loaded == true)
+		return &ctx->shiva_elfobj;
+	shiva_path = (ctx->flags & SHIVA_OPTS_F_INTERP_MODE) ?
+	    elf_interpreter_path(&ctx->elfobj) : "/proc/self/exe";
+	t0 = SHIVA_STATS_START(ctx);
+	if (elf_open_object(shiva_path, &ctx->shiva_elfobj, ELF_LOAD_F_STRICT,
+	    &error) == false) {
+		fprintf(stderr, "elf_open_object(%s, ...) failed: %s\n",
+		    shiva_path, elf_error_msg(&error));
+		return NULL;
+	}
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_ELF_OPEN, t0);
+	ctx->shiva_elfobj_loaded = true;
+	shiva_debug("Opened %s for Shiva API symbols\n", shiva_path);
+	return &ctx->shiva_elfobj;
+}
+
+static bool
+module_self_symbol(struct shiva_module *linker, const char *name, struct elf_symbol *out)
+{
+	elfobj_t *self = module_self(linker);
+
+	if (self == NULL)
+		return false;
+	return shiva_symbol_by_name(&linker->self_gnu_hash, self, name, out);
+}
+
 /*
  * Module entry point. Lookup symbol "shakti_main"
  */
@@ -491,7 +1333,7 @@ resolve_pltgot_entries(struct shiva_module *linker)
 	uint64_t *GOT;
 	struct shiva_module_got_entry *current;
 	char *so_path;
-	bool res;
+	bool res, lazy = shiva_module_lazy_enabled(linker);
 
 	/*
 	 * Order of symbol resolution:
@@ -517,6 +1359,8 @@ resolve_pltgot_entries(struct shiva_module *linker)
 			 * PLT/GOT for the Shiva module. Should only be function calls in this
 			 * part of the GOT, I think... Could cause a bug.
 			 */
+			if (symbol.type == STT_FUNC)
+				(void) patch_variant_symbol(linker, current->symname, &symbol);
 			if (symbol.type == STT_FUNC || symbol.type == STT_OBJECT) {
 				shiva_debug("Setting [%#lx] GOT entry '%s' to %#lx\n",
 				    linker->data_vaddr + linker->pltgot_off +
@@ -524,6 +1368,8 @@ resolve_pltgot_entries(struct shiva_module *linker)
 				    (module_has_transforms(linker) == true ? linker->tf_text_offset : 0));
 				*GOT = symbol.value + linker->text_vaddr +
 				    (module_has_transforms(linker) == true ? linker->tf_text_offset : 0);
+				shiva_module_cache_note_abs(linker, GOT);
+				SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_MODULE, 1);
 				shiva_debug("*GOT = %#lx (Address within Shiva module)\n", *GOT);
 				continue;
 			}
@@ -537,11 +1383,6 @@ resolve_pltgot_entries(struct shiva_module *linker)
 			bool in_target = false;
 			struct elf_plt plt_entry;
 			struct shiva_module_delayed_reloc *delay_rel;
-			ENTRY e, *ep;
-
-			e.key = current->symname;
-			e.data = NULL;
-
 			/*
 			 * Handle the special case of SHIVA_HELPER_CALL_EXTERNAL()
 			 * macro. Symbols are in the patch object, but give Shiva
@@ -549,7 +1390,7 @@ resolve_pltgot_entries(struct shiva_module *linker)
 			 * within the target. See SHIVA HELPER macros in documentation.
 			 */
 			shiva_debug("Searching cache for %s\n", current->symname);
-			if (hsearch_r(e, FIND, &ep, &linker->cache.helpers) != 0) {
+			if (shiva_htab_find(&linker->cache.helpers, current->symname) != NULL) {
 				char *real_symname;
 				/*
 				 * We are dealing with a helper symbol that denotes that
@@ -561,7 +1402,7 @@ resolve_pltgot_entries(struct shiva_module *linker)
 				real_symname += strlen("_orig_func_");
 
 				shiva_debug("Looking up symbol: '%s' in target\n", real_symname);
-				if (elf_symbol_by_name(linker->target_elfobj, real_symname,
+				if (shiva_symbol_by_name(&linker->ctx->gnu_hash, linker->target_elfobj, real_symname,
 				    &symbol) == true) {
 					if (symbol.value == 0 || symbol.type != STT_FUNC) {
 						fprintf(stderr, "external symbol is invalid: %s\n",
@@ -572,6 +1413,8 @@ resolve_pltgot_entries(struct shiva_module *linker)
 					    " = %#lx\n", symbol.name, real_symname,
 					    symbol.value + linker->target_base);
 					*(uint64_t *)GOT = symbol.value + linker->target_base;
+					shiva_module_cache_note_abs(linker, GOT);
+					SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_TARGET, 1);
 					continue;
 				}
 			}
@@ -580,7 +1423,7 @@ resolve_pltgot_entries(struct shiva_module *linker)
 			 */
 			shiva_debug("Looking up symbol '%s' in target %s\n", current->symname,
 			    elf_pathname(linker->target_elfobj));
-			if (elf_symbol_by_name(linker->target_elfobj, current->symname,
+			if (shiva_symbol_by_name(&linker->ctx->gnu_hash, linker->target_elfobj, current->symname,
 			    &symbol) == true) {
 				if (symbol.value == 0 && symbol.type == STT_FUNC) {
 					if (elf_plt_by_name(linker->target_elfobj,
@@ -590,6 +1433,11 @@ resolve_pltgot_entries(struct shiva_module *linker)
 
 						shiva_debug("Symbol '%s' is a PLT entry, let's look it up in the shared libraries\n",
 						    symbol.name);
+						if (lazy == true) {
+							if (shiva_module_lazy_add(linker, current, GOT) == false)
+								return false;
+							continue;
+						}
 						res = shiva_so_resolve_symbol(linker, (char *)symbol.name, &tmp, &so_path);
 						if (res == false) {
 							fprintf(stderr, "Failed to resolve symbol '%s' in shared libs\n",
@@ -600,11 +1448,14 @@ resolve_pltgot_entries(struct shiva_module *linker)
 							perror("realpath");
 							return false;
 						}
-						delay_rel = shiva_malloc(sizeof(*delay_rel));
+						SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_SO, 1);
+						delay_rel = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*delay_rel));
 						delay_rel->rel_unit = (uint8_t *)GOT;
 						delay_rel->rel_addr = (uint64_t)GOT;
 						delay_rel->symval = tmp.value;
-						delay_rel->symname = shiva_strdup(symbol.name);
+						delay_rel->symname = shiva_arena_strdup(&linker->ctx->arena.module, symbol.name);
+						if (tmp.type == STT_GNU_IFUNC)
+							delay_rel->flags |= SHIVA_DELAYED_RELOC_F_IFUNC;
 						strncpy(delay_rel->so_path, path_out, PATH_MAX);
 						delay_rel->so_path[PATH_MAX - 1] = '\0';
 						shiva_debug("Delayed relocation for GOT[%s] -> lookup %s\n",
@@ -617,7 +1468,7 @@ resolve_pltgot_entries(struct shiva_module *linker)
 						 * can be known of the library. We must insert a delayed relocation
 						 * entry.
 						 */
-						if (enable_post_linker(linker) == false) {
+						if (shiva_module_enable_post_linker(linker) == false) {
 							fprintf(stderr, "failed to enable delayed relocs\n");
 							return false;
 						}
@@ -627,9 +1478,16 @@ resolve_pltgot_entries(struct shiva_module *linker)
 						    symbol.name);
 						return false;
 					}
+				} else if (symbol.value > 0 && symbol.type == STT_GNU_IFUNC) {
+					if (delay_target_ifunc(linker, (uint8_t *)GOT, (uint64_t)GOT,
+					    &symbol) == false)
+						return false;
+					SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_TARGET, 1);
 				} else if (symbol.value > 0 && symbol.type == STT_FUNC) {
 					shiva_debug("resolved symbol in target: %s\n", elf_pathname(linker->target_elfobj));
 					*(uint64_t *)GOT = symbol.value + linker->target_base;
+					shiva_module_cache_note_abs(linker, GOT);
+					SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_TARGET, 1);
 				}
 			} else {
 				/*
@@ -640,6 +1498,11 @@ resolve_pltgot_entries(struct shiva_module *linker)
 				struct elf_symbol tmp;
 				char path_out[PATH_MAX];
 
+				if (lazy == true) {
+					if (shiva_module_lazy_add(linker, current, GOT) == false)
+						return false;
+					continue;
+				}
 				res = shiva_so_resolve_symbol(linker, (char *)symbol.name, &tmp, &so_path);
 				if (res == false) {
 					fprintf(stderr, "Failed to resolve symbol '%s' in shared libs\n",
@@ -650,11 +1513,14 @@ resolve_pltgot_entries(struct shiva_module *linker)
 					perror("realpath");
 					return false;
 				}
-				delay_rel = shiva_malloc(sizeof(*delay_rel));
+				SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_SO, 1);
+				delay_rel = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*delay_rel));
 				delay_rel->rel_unit = (uint8_t *)GOT;
 				delay_rel->rel_addr = (uint64_t)GOT;
 				delay_rel->symval = tmp.value;
-				delay_rel->symname = shiva_strdup(symbol.name);
+				delay_rel->symname = shiva_arena_strdup(&linker->ctx->arena.module, symbol.name);
+				if (tmp.type == STT_GNU_IFUNC)
+					delay_rel->flags |= SHIVA_DELAYED_RELOC_F_IFUNC;
 				strncpy(delay_rel->so_path, path_out, PATH_MAX);
 				delay_rel->so_path[PATH_MAX - 1] = '\0';
 				shiva_debug("Delayed relocation for GOT[%s] -> lookup %s\n",
@@ -667,7 +1533,7 @@ resolve_pltgot_entries(struct shiva_module *linker)
 				 * can be known of the library. We must insert a delayed relocation
 				 * entry.
 				 */
-				 if (enable_post_linker(linker) == false) {
+				 if (shiva_module_enable_post_linker(linker) == false) {
 					fprintf(stderr, "failed to enable delayed relocs\n");
 					return false;
 				}
@@ -682,12 +1548,13 @@ resolve_pltgot_entries(struct shiva_module *linker)
 			 * be?
 			 */
 		} else if (linker->mode == SHIVA_LINKING_MODULE) {
-			if (elf_symbol_by_name(&linker->self, current->symname, &symbol) == false) {
+			if (module_self_symbol(linker, current->symname, &symbol) == false) {
 				fprintf(stderr, "Could not resolve symbol '%s'. Linkage failure!\n",
 				    current->symname);
 				return false;
 			}
 			*(uint64_t *)GOT = symbol.value;
+			SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_SHIVA, 1);
 			shiva_debug("Found symbol '%s':%#lx within the Shiva API\n", current->symname,
 			    symbol.value);
 		} else {
@@ -699,6 +1566,57 @@ resolve_pltgot_entries(struct shiva_module *linker)
 	return true;
 }
 
+#if __aarch64__
+/*
+ * Every bl of the module is linked to a PLT stub, which loads the
+ * destination from the GOT of the module and branches to it. Once the
+ * GOT is resolved, a call whose destination is within call26 range of
+ * the bl (The module itself, and the target when the module is placed
+ * next to it, see module_image_base()) is relinked to branch there
+ * directly, which saves the GOT load and the indirect branch. Calls into
+ * shared objects are resolved after LDSO runs (See shiva_post_linker.c)
+ * and keep going through their stub, as do calls that are out of range.
+ *
+ * The stubs are laid out by calculate_text_size() before the module is
+ * placed, so their room is reserved either way.
+ */
+static void
+relax_module_calls(struct shiva_module *linker)
+{
+	struct shiva_module_got_entry *got_entry;
+	struct shiva_module_call26 *call;
+	uint64_t dest;
+	uint32_t insn_bytes;
+	size_t i, relaxed = 0;
+
+	for (i = 0; i < linker->calls.count; i++) {
+		call = &linker->calls.vec[i];
+		got_entry = shiva_htab_find(&linker->cache.got, call->symname);
+		if (got_entry == NULL || got_entry->lazy == true)
+			continue;
+		dest = *(uint64_t *)(linker->data_vaddr + linker->pltgot_off + got_entry->gotoff);
+		/*
+		 * A delayed relocation, the GOT entry isn't filled in yet.
+		 */
+		if (dest == 0)
+			continue;
+		dest += call->addend;
+		if (call26_in_range(call->rel_addr, dest) == false)
+			continue;
+		memcpy(&insn_bytes, call->rel_unit, sizeof(uint32_t));
+		insn_bytes = (insn_bytes & ~RELOC_MASK(26)) |
+		    (((dest - call->rel_addr) >> 2) & RELOC_MASK(26));
+		memcpy(call->rel_unit, &insn_bytes, sizeof(uint32_t));
+		shiva_debug("Relaxed call to %s at %#lx -> %#lx\n", call->symname,
+		    call->rel_addr, dest);
+		relaxed++;
+	}
+	SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_RELAXED_CALLS, relaxed);
+	shiva_debug("Relaxed %zu of %zu calls\n", relaxed, linker->calls.count);
+	return;
+}
+#endif
+
 static bool
 patch_plt_stubs(struct shiva_module *linker)
 {
@@ -746,42 +1664,97 @@ patch_plt_stubs(struct shiva_module *linker)
 	return true;
 }
 
-static bool
-get_section_mapping(struct shiva_module *linker, char *shdrname, struct shiva_module_section_mapping *smap)
+/*
+ * Section mappings are indexed by name in linker->cache.sections, the
+ * relocations of an ET_REL module refer to a section by the name of its
+ * STT_SECTION symbol. The first mapping of a name wins, just as it did
+ * when section_maplist was searched from the head.
+ */
+static void
+section_mapping_insert(struct shiva_module *linker, struct shiva_module_section_mapping *n)
 {
-	struct shiva_module_section_mapping *current;
+	TAILQ_INSERT_TAIL(&linker->tailq.section_maplist, n, _linkage);
+	(void) shiva_htab_insert(&linker->cache.sections, n->name, n);
+	return;
+}
 
-	TAILQ_FOREACH(current, &linker->tailq.section_maplist, _linkage) {
-		if (strcmp(shdrname, current->name) != 0)
-			continue;
-		memcpy(smap, current, sizeof(*smap));
-		return true;
-	}
-	return false;
+static struct shiva_module_section_mapping *
+section_mapping_lookup(struct shiva_module *linker, const char *name)
+{
+	return shiva_htab_find(&linker->cache.sections, name);
 }
 
 /*
- * An STT_NOTYPE symbol was found within the Shiva module;
- * This must be an external reference to a symbol. Search order:
- * 1. Check target executable for symbol.
- * 2. Check target executable's dependencies (DT_NEEDED) for symbol.
+ * Has the section been left out of the module by module_gc_sections()?
  */
-#define RESOLVER_TARGET_SHIVA_SELF 0
-#define RESOLVER_TARGET_EXECUTABLE 1
-#define RESOLVER_TARGET_SO_RESOLVE 2
-static bool
-internal_symresolve(struct shiva_module *linker, char *symname,
-    struct elf_symbol *symbol, uint64_t *e_type, uint64_t *type, char *path_out)
+static inline bool
+module_section_dead(struct shiva_module *linker, const char *name)
 {
-	struct elf_symbol tmp;
-	struct elfobj *elfobj = linker->mode == SHIVA_LINKING_MODULE ?
-	    &linker->self : linker->target_elfobj;
-	bool res;
+	uint8_t *live;
 
-	shiva_debug("Looking up symbol %s in %s\n", symname, linker->mode ==
-	    SHIVA_LINKING_MODULE ? "the Shiva Interpreter" : "target ELF executable");
+	if (linker->gc.dead == 0 || name == NULL)
+		return false;
+	live = shiva_htab_find(&linker->cache.gc, name);
+	return live != NULL && *live == 0;
+}
 
-	res = elf_symbol_by_name(elfobj, symname, &tmp);
+/*
+ * The section that rel applies to, i.e. ".text" for ".rela.text"
+ */
+static inline const char *
+module_rel_section(struct elf_relocation *rel)
+{
+	if (strncmp(rel->shdrname, ".rela.", 6) == 0)
+		return rel->shdrname + 5;
+	if (strncmp(rel->shdrname, ".rel.", 5) == 0)
+		return rel->shdrname + 4;
+	return rel->shdrname;
+}
+
+static inline bool
+module_rel_dead(struct shiva_module *linker, struct elf_relocation *rel)
+{
+	return module_section_dead(linker, module_rel_section(rel));
+}
+
+static bool
+get_section_mapping(struct shiva_module *linker, char *shdrname, struct shiva_module_section_mapping *smap)
+{
+	struct shiva_module_section_mapping *current;
+
+	current = section_mapping_lookup(linker, shdrname);
+	if (current == NULL)
+		return false;
+	memcpy(smap, current, sizeof(*smap));
+	return true;
+}
+
+/*
+ * An STT_NOTYPE symbol was found within the Shiva module;
+ * This must be an external reference to a symbol. Search order:
+ * 1. Check target executable for symbol.
+ * 2. Check target executable's dependencies (DT_NEEDED) for symbol.
+ */
+#define RESOLVER_TARGET_SHIVA_SELF 0
+#define RESOLVER_TARGET_EXECUTABLE 1
+#define RESOLVER_TARGET_SO_RESOLVE 2
+static bool
+internal_symresolve(struct shiva_module *linker, char *symname,
+    struct elf_symbol *symbol, uint64_t *e_type, uint64_t *type, char *path_out)
+{
+	struct elf_symbol tmp;
+	struct elfobj *elfobj = linker->mode == SHIVA_LINKING_MODULE ?
+	    module_self(linker) : linker->target_elfobj;
+	struct shiva_gnu_hash *gnu_hash = linker->mode == SHIVA_LINKING_MODULE ?
+	    &linker->self_gnu_hash : &linker->ctx->gnu_hash;
+	bool res;
+
+	if (elfobj == NULL)
+		return false;
+	shiva_debug("Looking up symbol %s in %s\n", symname, linker->mode ==
+	    SHIVA_LINKING_MODULE ? "the Shiva Interpreter" : "target ELF executable");
+
+	res = shiva_symbol_by_name(gnu_hash, elfobj, symname, &tmp);
 	*e_type = elf_type(elfobj);
 	if (res == true) {
 		switch(tmp.type) {
@@ -799,9 +1772,9 @@ internal_symresolve(struct shiva_module *linker, char *symname,
 #if 0
 			switch (linker->mode) {
 			case SHIVA_LINKING_MICROCODE_PATCH:
-				*e_type = elf_type(&linker->self);
+				*e_type = elf_type(module_self(linker));
 				*type = RESOLVER_TARGET_SHIVA_SELF;
-				res = elf_symbol_by_name(&linker->self, symname, &tmp);
+				res = module_self_symbol(linker, symname, &tmp);
 				if (res == true) {
 					memcpy(symbol, &tmp, sizeof(*symbol));
 					return true;
@@ -815,12 +1788,15 @@ internal_symresolve(struct shiva_module *linker, char *symname,
 #endif
 		case STT_FUNC:
 		case STT_OBJECT:
+		case STT_GNU_IFUNC:
 			shiva_debug("Found symbol '%s' in %s\n", symname, linker->mode == SHIVA_LINKING_MODULE ?
 			    "shiva binary" : "target binary");
 			if (linker->mode == SHIVA_LINKING_MODULE) {
 				*type = RESOLVER_TARGET_SHIVA_SELF;
+				SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_SHIVA, 1);
 			} else {
 				*type = RESOLVER_TARGET_EXECUTABLE;
+				SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_TARGET, 1);
 			}
 			memcpy(symbol, &tmp, sizeof(*symbol));
 			return true;
@@ -834,6 +1810,7 @@ internal_symresolve(struct shiva_module *linker, char *symname,
 		if (res == true) {
 			*type = RESOLVER_TARGET_SO_RESOLVE;
 			*e_type = ET_DYN;
+			SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_SO, 1);
 			if (realpath(so_path, path_out) == NULL) {
 				perror("realpath");
 				return false;
@@ -843,10 +1820,16 @@ internal_symresolve(struct shiva_module *linker, char *symname,
 			memcpy(symbol, &tmp, sizeof(*symbol));
 			return true;
 		}
-		res = elf_symbol_by_name(&linker->self, symname, &tmp);
+		res = module_self_symbol(linker, symname, &tmp);
 		if (res == true) {
 			*type = RESOLVER_TARGET_SHIVA_SELF;
-			*e_type = elf_type(&linker->self);
+			SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_SYM_SHIVA, 1);
+			/*
+			 * The patch calls into the Shiva API, which may rely on
+			 * the analyzers having run.
+			 */
+			shiva_module_cache_invalidate(linker, "patch links against Shiva");
+			*e_type = elf_type(&linker->ctx->shiva_elfobj);
 			shiva_debug("Found symbol '%s' within the Shiva binary: %#lx\n", symname, tmp.value);
 			memcpy(symbol, &tmp, sizeof(*symbol));
 			return true;
@@ -858,47 +1841,133 @@ internal_symresolve(struct shiva_module *linker, char *symname,
 	return false;
 }
 
+/*
+ * Look up, and on the first call resolve, the relocation symbol symname.
+ * relocate_module() resolves the symbol of every relocation up front,
+ * so that apply_relocation() never searches for the same symbol twice.
+ */
+static struct shiva_module_symres *
+module_symres(struct shiva_module *linker, const char *symname)
+{
+	struct shiva_module_symres *sr;
+	char so_path[PATH_MAX];
+
+	sr = shiva_htab_find(&linker->cache.symres, symname);
+	if (sr != NULL)
+		return sr;
+	sr = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*sr));
+	sr->defined = elf_symbol_by_name(&linker->elfobj, symname, &sr->symbol);
+	if (sr->defined == true && sr->symbol.type == STT_NOTYPE) {
+		so_path[0] = '\0';
+		sr->resolved = internal_symresolve(linker, (char *)symname, &sr->target,
+		    &sr->e_type, &sr->type, so_path);
+		if (sr->resolved == true && sr->type == RESOLVER_TARGET_SO_RESOLVE)
+			sr->so_path = shiva_arena_strdup(&linker->ctx->arena.module, so_path);
+	}
+	(void) shiva_htab_insert(&linker->cache.symres,
+	    shiva_arena_strdup(&linker->ctx->arena.module, symname), sr);
+	return sr;
+}
+
+/*
+ * Drop-in replacements for elf_symbol_by_name(&linker->elfobj, ...) and
+ * internal_symresolve() that go through the resolution table.
+ */
+static bool
+module_symbol_by_name(struct shiva_module *linker, const char *symname,
+    struct elf_symbol *symbol)
+{
+	struct shiva_module_symres *sr = module_symres(linker, symname);
+
+	if (sr->defined == false)
+		return false;
+	memcpy(symbol, &sr->symbol, sizeof(*symbol));
+	return true;
+}
+
+/*
+ * Is symname, a section or a symbol defined within the module, in a
+ * section that module_gc_sections() left out?
+ */
+static bool
+module_symbol_dead(struct shiva_module *linker, const char *symname)
+{
+	struct elf_symbol symbol;
+
+	if (linker->gc.dead == 0)
+		return false;
+	if (shiva_htab_find(&linker->cache.gc, symname) != NULL)
+		return module_section_dead(linker, symname);
+	if (module_symbol_by_name(linker, symname, &symbol) == false ||
+	    symbol.shndx == SHN_UNDEF || symbol.shndx >= SHN_LORESERVE ||
+	    symbol.shndx >= elf_section_count(&linker->elfobj))
+		return false;
+	return linker->gc.live[symbol.shndx] == 0;
+}
+
 static bool
-enable_post_linker(struct shiva_module *linker)
+module_symresolve(struct shiva_module *linker, const char *symname,
+    struct elf_symbol *symbol, uint64_t *e_type, uint64_t *type, char *path_out)
 {
+	struct shiva_module_symres *sr = module_symres(linker, symname);
+
+	if (sr->resolved == false)
+		return false;
+	memcpy(symbol, &sr->target, sizeof(*symbol));
+	*e_type = sr->e_type;
+	*type = sr->type;
+	if (sr->so_path != NULL) {
+		strncpy(path_out, sr->so_path, PATH_MAX);
+		path_out[PATH_MAX - 1] = '\0';
+	}
+	return true;
+}
 
-	shiva_ctx_t *ctx = linker->ctx;
-	shiva_auxv_iterator_t a_iter;
-	struct shiva_auxv_entry a_entry;
+bool
+shiva_module_enable_post_linker(struct shiva_module *linker)
+{
 
 	if (linker->flags & SHIVA_MODULE_F_DELAYED_RELOCS)
 		return true;
 
 	shiva_debug("Enabling post linker for delayed relocations\n");
 	linker->flags |= SHIVA_MODULE_F_DELAYED_RELOCS;
-	if (shiva_auxv_iterator_init(ctx, &a_iter,
-	    ctx->ulexec.auxv.vector) == false) {
-		fprintf(stderr, "shiva_auxv_iterator_init failed\n");
+	/*
+	 * A live patch is linked long after LDSO ran, module_link()
+	 * resolves its delayed relocations right away.
+	 */
+	if (linker->flags & SHIVA_MODULE_F_LIVE)
+		return true;
+	return shiva_post_linker_enable(linker->ctx);
+}
+
+/*
+ * An STT_GNU_IFUNC of the target can't be resolved before LDSO has
+ * relocated the target, the value at rel_unit is left for
+ * shiva_post_linker_resolve() to fill in with what its resolver returns.
+ */
+static bool
+delay_target_ifunc(struct shiva_module *linker, uint8_t *rel_unit, uint64_t rel_addr,
+    struct elf_symbol *symbol)
+{
+	struct shiva_module_delayed_reloc *delay_rel;
+
+	delay_rel = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*delay_rel));
+	delay_rel->rel_unit = rel_unit;
+	delay_rel->rel_addr = rel_addr;
+	delay_rel->symval = symbol->value;
+	delay_rel->symname = shiva_arena_strdup(&linker->ctx->arena.module, symbol->name);
+	delay_rel->flags = SHIVA_DELAYED_RELOC_F_TARGET | SHIVA_DELAYED_RELOC_F_IFUNC;
+	if (realpath(elf_pathname(linker->target_elfobj), delay_rel->so_path) == NULL) {
+		perror("realpath");
 		return false;
 	}
-	while (shiva_auxv_iterator_next(&a_iter, &a_entry) == SHIVA_ITER_OK) {
-		if (a_entry.type == AT_ENTRY) {
-			uint64_t entry;
-
-			/*
-			 * IMPORTANT NOTE:
-			 * In our aarch64 implementation, shiva is an ET_EXEC
-			 * so we can pass a function address as absolute. In
-			 * other implementations we would have to create a macro
-			 * to entry = GET_RIP() - &shiva_post_linker
-			 * -- In aarch64 Shiva we can just pass &shiva_post_linker address
-			 *  directly.
-			 */
-			shiva_debug("Enabling post linker, setting AT_ENTRY to %#lx\n",
-			    &shiva_post_linker);
-			entry = (uint64_t)&shiva_post_linker;
-			if (shiva_auxv_set_value(&a_iter, entry) == false) {
-				fprintf(stderr, "shiva_auxv_set_value failed (Setting %#lx)\n", entry);
-				return false;
-			}
-			break;
-		}
+	if (shiva_module_enable_post_linker(linker) == false) {
+		fprintf(stderr, "Failed to enable delayed relocs\n");
+		return false;
 	}
+	shiva_debug("Delayed relocation for IFUNC '%s' of the target\n", symbol->name);
+	TAILQ_INSERT_TAIL(&linker->tailq.delayed_reloc_list, delay_rel, _linkage);
 	return true;
 }
 
@@ -939,8 +2008,7 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 	uint64_t rel_val;
 	uint32_t insn_bytes;
 	struct elf_symbol symbol;
-	ENTRY e, *ep;
-	struct shiva_module_got_entry got_entry;
+	struct shiva_module_got_entry got_entry, *got_ptr;
 	bool res;
 	char *symbol_section;
 	struct elf_section tmp_shdr;
@@ -979,12 +2047,16 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 				shiva_debug("Testing rel.symname: %s with .text\n",
 				    rel.symname);
 				if (strcmp(rel.symname, ".text") == 0) {
+					/*
+					 * The addend points into the .text encoded data
+					 * after the transform source, which was moved to
+					 * splice.ext_offset within the new function.
+					 */
 					shiva_debug("Found text on text relocation\n");
-					shiva_debug("Increasing r_addend by %zu bytes\n",
-					    transform->splice.copy_len3 +
-					    transform->segment_offset + transform->offset);
-					rel.addend += transform->segment_offset + transform->offset;
-					rel.addend += transform->splice.copy_len3;
+					rel.addend += transform->segment_offset + transform->splice.ext_offset;
+					rel.addend -= transform->source_symbol.value +
+					    transform->source_symbol.size;
+					shiva_debug("r_addend is now %#lx\n", rel.addend);
 				}
 			}
 			/*
@@ -992,22 +2064,25 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 			 * an R_AARCH64_ABS64 relocation.
 			 */
 			if (is_text_encoding_reloc(linker, rel.offset) == true) {
-				shiva_debug("Text encoding is true! Increasing r_offset by %zu\n",
-				    transform->splice.copy_len3);
 				/*
 				 * See transformation specification on handling
 				 * relocations that apply to .text encoded data.
 				 */
-				shiva_debug("Increasing r_offset(%#lx) to %#lx\n", rel.offset,
-				    rel.offset + transform->splice.copy_len3);
-				rel.offset += transform->splice.copy_len3;
+				shiva_debug("Text encoding is true! Moving r_offset(%#lx)"
+				    " to the extended area at %#lx\n", rel.offset,
+				    transform->segment_offset + transform->splice.ext_offset);
+				rel.offset = transform->segment_offset + transform->splice.ext_offset +
+				    rel.offset - (transform->source_symbol.value +
+				    transform->source_symbol.size);
 				text_encoding = true;
+			} else {
+				/*
+				 * In the event of relocating a spliced function we must always
+				 * move the rel.offset to match the new location.
+				 */
+				rel.offset = transform->segment_offset + transform->splice.new_offset +
+				    rel.offset - transform->source_symbol.value;
 			}
-			/*
-			 * In the event of relocating a spliced function we must always increase
-			 * the rel.offset to match the new location.
-			 */
-			rel.offset = transform->segment_offset + transform->offset + rel.offset;
 		} else {
 			shiva_debug("Transforms exist. rel_offset = rel.offset(%#lx)"
 			    " + linker->tf_text_offset(%#lx) = %#lx\n", rel.offset,
@@ -1036,9 +2111,8 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 		 * that lives within the Shiva-module itself?
 		 */
 		shiva_debug("Applying R_AARCH64_ABS64 relocation for symbol %s\n", rel.symname);
-		TAILQ_FOREACH(smap_current, &linker->tailq.section_maplist, _linkage) {
-			if (strcmp(smap_current->name, rel.symname) != 0)
-				continue;
+		smap_current = section_mapping_lookup(linker, rel.symname);
+		if (smap_current != NULL) {
 			symval = smap_current->vaddr;
 			rel_unit = &linker->text_mem[smap.offset + rel.offset];
 			shiva_debug("symval: %#lx symval, rel_addr: %#lx addend: %#lx\n", symval,
@@ -1047,12 +2121,13 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 			rel_addr = linker->text_vaddr + smap.offset + rel.offset;
 			rel_val = symval + rel.addend;
 			*(uint64_t *)&rel_unit[0] = rel_val;
+			shiva_module_cache_note_abs(linker, rel_unit);
 			return true;
 		}
 		/*
 		 * Is the symbol found in the ET_REL Shiva module?
 		 */
-		if (elf_symbol_by_name(&linker->elfobj, rel.symname,
+		if (module_symbol_by_name(linker, rel.symname,
 		    &symbol) == true) {
 			if (symbol.type == STT_NOTYPE) {
 				uint64_t e_type, target_type;
@@ -1064,14 +2139,10 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 				 * 3. Search the target executables shared library dependencies
 				 */
 				shiva_debug("Internal symresolve on %s\n", rel.symname);
-				res = internal_symresolve(linker, rel.symname,
+				res = module_symresolve(linker, rel.symname,
 				    &symbol, &e_type, &target_type, so_path);
 				if (res == true) {
-					uint64_t so_base;
 					struct shiva_module_delayed_reloc *delay_rel;
-					char path_out[PATH_MAX];
-					char *so_path;
-					struct elf_symbol tmp;
 #ifdef __x86_64__
 #ifdef SHIVA_STANDALONE
 					symval = symbol.value;
@@ -1085,6 +2156,11 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 						    symbol.value + linker->shiva_base;
 						break;
 					case RESOLVER_TARGET_EXECUTABLE:
+						if (symbol.type == STT_GNU_IFUNC)
+							return delay_target_ifunc(linker,
+							    &linker->text_mem[smap.offset + rel.offset],
+							    linker->text_vaddr + smap.offset + rel.offset,
+							    &symbol);
 						symval = e_type == ET_EXEC ? symbol.value :
 						    symbol.value + linker->target_base;
 						break;
@@ -1098,26 +2174,17 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 						 * Insert this as a delayed relocation so that the
 						 * shiva_post_linker code can handle it later.
 						 */
-						res = shiva_so_resolve_symbol(linker, (char *)symbol.name, &tmp, &so_path);
-						if (res == false) {
-							fprintf(stderr, "Failed to resolve symbol '%s' in shared libs\n",
-							    symbol.name);
-							return false;
-						}
-						if (realpath(so_path, path_out) == NULL) {
-							perror("realpath");
-							return false;
-						}
-
-						delay_rel = shiva_malloc(sizeof(*delay_rel));
+						delay_rel = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*delay_rel));
 						delay_rel->rel_unit = &linker->text_mem[smap.offset + rel.offset];
 						delay_rel->rel_addr = linker->text_vaddr + smap.offset + rel.offset;
-						delay_rel->symval = tmp.value;
-						delay_rel->symname = shiva_strdup(symbol.name);
-						strncpy(delay_rel->so_path, path_out, PATH_MAX);
+						delay_rel->symval = symbol.value;
+						delay_rel->symname = shiva_arena_strdup(&linker->ctx->arena.module, symbol.name);
+						if (symbol.type == STT_GNU_IFUNC)
+							delay_rel->flags |= SHIVA_DELAYED_RELOC_F_IFUNC;
+						strncpy(delay_rel->so_path, so_path, PATH_MAX);
 						delay_rel->so_path[PATH_MAX - 1] = '\0';
 
-						if (enable_post_linker(linker) == false) {
+						if (shiva_module_enable_post_linker(linker) == false) {
 							fprintf(stderr, "Failed to enable delayed relocs\n");
 							return false;
 						}
@@ -1135,6 +2202,10 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 					shiva_debug("rel_val = %#lx + %#lx\n", symval, rel.addend);
 					shiva_debug("rel_addr: %#lx rel_val: %#x\n", rel_addr, rel_val);
 					*(uint64_t *)&rel_unit[0] = rel_val;
+#ifdef __aarch64__
+					if (target_type == RESOLVER_TARGET_EXECUTABLE && e_type != ET_EXEC)
+						shiva_module_cache_note_abs(linker, rel_unit);
+#endif
 					return true;
 				} else {
 					fprintf(stderr, "Failed to find relocation "
@@ -1162,22 +2233,20 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 				 */
 				if (tmp_shdr.type == SHT_NOBITS && symbol.shndx == SHN_COMMON) {
 					if ((tmp_shdr.flags & SHF_ALLOC|SHF_WRITE) == SHF_ALLOC|SHF_WRITE) {
-						ENTRY e, *ep;
-
-						e.key = (char *)symbol.name;
-						e.data = NULL;
+						struct shiva_module_bss_entry *bss_entry;
 
 						shiva_debug(".bss variable being allocated\n");
 
-						if (hsearch_r(e, FIND, &ep, &linker->cache.bss) == 0) {
+						bss_entry = shiva_htab_find(&linker->cache.bss, symbol.name);
+						if (bss_entry == NULL) {
 							fprintf(stderr, "Unable to find symbol '%s' in"
 							    " the the bss cache\n", symbol.name);
 							return false;
 						}
 						shiva_debug("[!] BSS scenario. symval = %#lx + %#lx\n",
-						    linker->bss_vaddr, ((struct shiva_module_bss_entry *)(ep->data))->offset);
+						    linker->bss_vaddr, bss_entry->offset);
 						symval = linker->bss_vaddr;
-						symval += ((struct shiva_module_bss_entry *)(ep->data))->offset;
+						symval += bss_entry->offset;
 						rel_unit = &linker->text_mem[smap.offset + rel.offset];
 						rel_addr = linker->text_vaddr + smap.offset + rel.offset;
 					}
@@ -1203,6 +2272,7 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 				shiva_debug("rel_val = %#lx + %#lx\n", symval, rel.addend);
 				shiva_debug("rel_addr: %#lx rel_val: %#x\n", rel_addr, rel_val);
 				*(uint64_t *)&rel_unit[0] = rel_val;
+				shiva_module_cache_note_abs(linker, rel_unit);
 				return true;
 			}
 		}
@@ -1228,6 +2298,20 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 			memcpy(&insn_bytes, &rel_unit[0], sizeof(uint32_t));
 			insn_bytes = (insn_bytes & ~RELOC_MASK(26) | rel_val & RELOC_MASK(26));
 			*(uint32_t *)&rel_unit[0] = insn_bytes;
+			/*
+			 * Remember the call, relax_module_calls() may link it
+			 * straight to the function once the GOT is resolved.
+			 */
+			if (linker->calls.vec == NULL)
+				linker->calls.vec = shiva_arena_alloc(&linker->ctx->arena.module,
+				    linker->plt_count * sizeof(*linker->calls.vec));
+			if (linker->calls.count < linker->plt_count) {
+				linker->calls.vec[linker->calls.count].rel_unit = rel_unit;
+				linker->calls.vec[linker->calls.count].rel_addr = rel_addr;
+				linker->calls.vec[linker->calls.count].addend = rel.addend;
+				linker->calls.vec[linker->calls.count].symname = current->symname;
+				linker->calls.count++;
+			}
 			return true;
 		}
 		break;
@@ -1236,9 +2320,8 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 		 * Does the relocation symbol reference a section header name?
 		 * i.e. '.text'.
 		 */
-		TAILQ_FOREACH(smap_current, &linker->tailq.section_maplist, _linkage) {
-			if (strcmp(smap_current->name, rel.symname) != 0)
-				continue;
+		smap_current = section_mapping_lookup(linker, rel.symname);
+		if (smap_current != NULL) {
 			shiva_debug("Applying R_AARCH64_ADD_ABS_LO12_NC relocation for %s\n",
 			    rel.symname);
 			symval = smap_current->vaddr;
@@ -1262,9 +2345,8 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 		 * It usually references `.text` as it's symbol.
 		 */
 
-		TAILQ_FOREACH(smap_current, &linker->tailq.section_maplist, _linkage) {
-			if (strcmp(smap_current->name, rel.symname) != 0)
-				continue;
+		smap_current = section_mapping_lookup(linker, rel.symname);
+		if (smap_current != NULL) {
 			shiva_debug("Applying R_AARCH64_ADR_PREL_PG_HI21 relocation for %s\n",
 			    rel.symname);
 			symval = smap_current->vaddr;
@@ -1321,15 +2403,13 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 		break;
 	case R_X86_64_GOT64:
 		shiva_debug("Applying GOT64 relocation for %s\n", rel.symname);
-		e.key = rel.symname;
-		e.data = NULL;
-
-		if (hsearch_r(e, FIND, &ep, &linker->cache.got) == 0) {
+		got_ptr = shiva_htab_find(&linker->cache.got, rel.symname);
+		if (got_ptr == NULL) {
 			fprintf(stderr, "Unable to find symbol '%s' in GOT cache, cannot resolve GOT64 relocation\n",
 			    rel.symname);
 			return false;
 		}
-		memcpy(&got_entry, ep->data, sizeof(got_entry));
+		memcpy(&got_entry, got_ptr, sizeof(got_entry));
 		rel_unit = &linker->text_mem[smap.offset + rel.offset];
 		rel_addr = linker->text_vaddr + smap.offset + rel.offset;
 		rel_val = got_entry.gotoff;
@@ -1346,7 +2426,7 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 		 * from the GOT to resolve the symbol address. The symbol is then
 		 * invoked indirectly via call *reg
 		 */
-		if (elf_symbol_by_name(&linker->elfobj, rel.symname, &symbol) == true) {
+		if (module_symbol_by_name(linker, rel.symname, &symbol) == true) {
 			rel_unit = &linker->text_mem[smap.offset + rel.offset];
 			rel_addr = linker->text_vaddr + smap.offset + rel.offset;
 			if (strncmp(rel.symname, ".LC", 3) == 0) {
@@ -1394,9 +2474,8 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 			 * mapping to get it's address, as our symbol value. therefore S =
 			 * address of ".eh_frame" mapping.
 			 */
-			TAILQ_FOREACH(smap_current, &linker->tailq.section_maplist, _linkage) {
-				if (strcmp(smap_current->name, rel.symname) != 0)
-					continue;
+			smap_current = section_mapping_lookup(linker, rel.symname);
+			if (smap_current != NULL) {
 				symval = smap_current->vaddr;
 				rel_unit = &linker->text_mem[smap.offset + rel.offset];
 				rel_addr = linker->text_vaddr + smap.offset + rel.offset;
@@ -1414,7 +2493,7 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 			 */
 			/* 1. Check module for symbol */
 			shiva_debug("Checking module for symbol\n");
-			if (elf_symbol_by_name(&linker->elfobj, rel.symname,
+			if (module_symbol_by_name(linker, rel.symname,
 			    &symbol) == true) {
 				/*
 				 * If the symbol is a NOTYPE then it is an external reference
@@ -1439,8 +2518,7 @@ apply_relocation(struct shiva_module *linker, struct elf_relocation rel,
 			 */
 internal_lookup:
 			shiva_debug("Looking up symbol %s inside of Shiva\n");
-			if (elf_symbol_by_name(&linker->self, rel.symname,
-			    &symbol) == true) {
+			if (module_self_symbol(linker, rel.symname, &symbol) == true) {
 				shiva_debug("Internal symbol lookup\n");
 				shiva_debug("Symbol value for %s: %#lx\n", rel.symname, symbol.value);
 				/*
@@ -1480,68 +2558,265 @@ internal_lookup:
 #endif
 	return false;
 }
+/*
+ * The range of transform source code that a .text relocation may fall
+ * within, the source function plus the padding that follows it.
+ */
+struct module_tf_range {
+	uint64_t lo;
+	uint64_t hi;
+	struct shiva_transform *transform;
+};
+
+static int
+module_tf_range_cmp(const void *a, const void *b)
+{
+	const struct module_tf_range *x = a, *y = b;
+
+	return (x->lo > y->lo) - (x->lo < y->lo);
+}
+
+/*
+ * Binary search for the transform whose source code contains offset.
+ */
+static struct shiva_transform *
+module_tf_range_find(struct module_tf_range *ranges, size_t count, uint64_t offset)
+{
+	size_t lo = 0, hi = count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ranges[mid].lo <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || offset >= ranges[lo - 1].hi)
+		return NULL;
+	return ranges[lo - 1].transform;
+}
+
+/*
+ * Resolve every symbol that the patch imports against the shared objects
+ * of the target in one batch, before the relocations and the GOT look
+ * them up one at a time. The names that turn out to be defined by the
+ * target itself cost nothing more than a failed probe. Returns false if
+ * the shared objects of the target can't be opened.
+ */
+static bool
+batch_so_imports(struct shiva_module *linker)
+{
+	elf_symtab_iterator_t sym_iter;
+	struct elf_symbol symbol;
+	const char **names;
+	size_t count = 0;
+	bool res;
+
+	if (linker->mode != SHIVA_LINKING_MICROCODE_PATCH)
+		return true;
+	elf_symtab_iterator_init(&linker->elfobj, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK)
+		count++;
+	if (count == 0)
+		return true;
+	names = shiva_malloc(count * sizeof(*names));
+	count = 0;
+	elf_symtab_iterator_init(&linker->elfobj, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
+		if (symbol.shndx != SHN_UNDEF || symbol.name == NULL ||
+		    symbol.name[0] == '\0')
+			continue;
+		names[count++] = symbol.name;
+	}
+	res = count == 0 ? true : shiva_so_resolve_batch(linker, names, count);
+	free(names);
+	return res;
+}
+
+/*
+ * The relocations of .eh_frame only refer to the module itself, i.e.
+ * the pc_begin of each FDE to the section its function lives in, and
+ * its LSDA to .gcc_except_table.
+ */
+static bool
+eh_frame_symval(struct shiva_module *linker, const char *symname, uint64_t *symval)
+{
+	struct shiva_module_section_mapping *smap;
+	struct elf_symbol symbol;
+	const char *section = symname;
+
+	*symval = 0;
+	if (section_mapping_lookup(linker, symname) == NULL) {
+		if (module_symbol_by_name(linker, symname, &symbol) == false ||
+		    symbol.shndx == SHN_UNDEF || symbol.shndx >= SHN_LORESERVE)
+			return false;
+		section = module_symbol_shndx_str(linker, &symbol);
+		if (section == NULL)
+			return false;
+		*symval = symbol.value;
+	}
+	smap = section_mapping_lookup(linker, section);
+	if (smap == NULL)
+		return false;
+	*symval += smap->vaddr;
+	if (strcmp(section, ".text") == 0 && module_has_transforms(linker) == true)
+		*symval += linker->tf_text_offset;
+	return true;
+}
+
+/*
+ * A relocation that can't be applied costs the module its unwind info,
+ * not its link.
+ */
+static void
+apply_eh_frame_relocation(struct shiva_module *linker, struct elf_relocation rel)
+{
+	uint8_t *rel_unit;
+	uint64_t symval, rel_addr, rel_val;
+	int64_t disp;
+
+	if (linker->eh_frame.mem == NULL)
+		return;
+	if (rel.offset > linker->eh_frame.size ||
+	    linker->eh_frame.size - rel.offset < sizeof(uint32_t)) {
+		shiva_eh_frame_drop(linker, "relocation out of bounds");
+		return;
+	}
+	if (rel.symname != NULL && module_symbol_dead(linker, rel.symname) == true) {
+		shiva_eh_frame_discard(linker, rel.offset);
+		return;
+	}
+	if (rel.symname == NULL || eh_frame_symval(linker, rel.symname, &symval) == false) {
+		shiva_eh_frame_drop(linker, "relocation against a symbol outside of the module");
+		return;
+	}
+	rel_unit = &linker->eh_frame.mem[rel.offset];
+	rel_addr = (uint64_t)rel_unit;
+	rel_val = symval + rel.addend;
+	switch(rel.type) {
+#ifdef __x86_64__
+	case R_X86_64_PC32:
+#elif __aarch64__
+	case R_AARCH64_PREL32:
+#endif
+		disp = (int64_t)(rel_val - rel_addr);
+		if (disp != (int32_t)disp) {
+			shiva_eh_frame_drop(linker, "PC relative relocation out of range");
+			return;
+		}
+		*(int32_t *)&rel_unit[0] = (int32_t)disp;
+		break;
+#ifdef __x86_64__
+	case R_X86_64_64:
+#elif __aarch64__
+	case R_AARCH64_ABS64:
+#endif
+		if (linker->eh_frame.size - rel.offset < sizeof(uint64_t)) {
+			shiva_eh_frame_drop(linker, "relocation out of bounds");
+			return;
+		}
+		memcpy(rel_unit, &rel_val, sizeof(rel_val));
+		shiva_module_cache_note_abs(linker, rel_unit);
+		break;
+	default:
+		shiva_eh_frame_drop(linker, "unsupported relocation type");
+		return;
+	}
+	shiva_debug(".eh_frame+%#lx (%s) = %#lx\n", rel.offset, rel.symname, rel_val);
+	return;
+}
+
+/*
+ * Relocations are applied in two stages. The first resolves the symbol
+ * of every relocation once into linker->cache.symres, and sorts the
+ * ranges of the transform source functions. The second applies each
+ * relocation, dispatched on its type by apply_relocation(), with the
+ * symbol values from the first stage.
+ */
 bool
 relocate_module(struct shiva_module *linker)
 {
 	struct elf_relocation_iterator rel_iter;
 	struct elf_relocation rel;
-	bool res;
+	bool res = false;
 	char *shdrname;
 	struct shiva_transform *transform;
 	struct shiva_transform *tf_ptr = NULL;
+	struct module_tf_range *ranges = NULL;
+	size_t range_count = 0, rel_count = 0;
+
+	elf_relocation_iterator_init(&linker->elfobj, &rel_iter);
+	while (elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK)
+		rel_count++;
+	shiva_htab_init(&linker->cache.symres, rel_count);
+	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage)
+		range_count++;
+	if (range_count > 0) {
+		ranges = shiva_malloc(range_count * sizeof(*ranges));
+		range_count = 0;
+		TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
+			ranges[range_count].lo = transform->source_symbol.value;
+			ranges[range_count].hi = transform->source_symbol.value +
+			    transform->source_symbol.size + transform->ext_len;
+			ranges[range_count].transform = transform;
+			range_count++;
+		}
+		qsort(ranges, range_count, sizeof(*ranges), module_tf_range_cmp);
+	}
+	/*
+	 * Not fatal, a static target has no shared objects to import from.
+	 */
+	if (batch_so_imports(linker) == false)
+		shiva_debug("Unable to batch the imports of %s\n", elf_pathname(&linker->elfobj));
+	elf_relocation_iterator_init(&linker->elfobj, &rel_iter);
+	while (elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK) {
+		shdrname = strrchr(rel.shdrname, '.');
+		if (shdrname == NULL || strcmp(shdrname, ".eh_frame") == 0 ||
+		    module_rel_dead(linker, &rel) == true)
+			continue;
+		if (rel.symname == NULL || rel.symname[0] == '\0' ||
+		    section_mapping_lookup(linker, rel.symname) != NULL)
+			continue;
+		(void) module_symres(linker, rel.symname);
+	}
 
 	elf_relocation_iterator_init(&linker->elfobj, &rel_iter);
 	while (elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK) {
-		tf_ptr = NULL;
 		shdrname = strrchr(rel.shdrname, '.');
 		if (shdrname == NULL) {
 			shiva_debug("strrchr parse error");
-			return false;
+			goto done;
 		}
 		if (strcmp(shdrname, ".eh_frame") == 0) {
-			/*
-			 * We don't need to process relocations for .eh_frame. Maybe
-			 * in the future for module debugging purposes.
-			 */
+			apply_eh_frame_relocation(linker, rel);
 			continue;
 		}
+		if (module_rel_dead(linker, &rel) == true)
+			continue;
 		shiva_debug("Relocation in %s (offset: %#lx) for symbol %s\n", shdrname,
 		    rel.offset, rel.symname);
 		/*
-		 * Check transformation records and see if the current relocation
-		 * record is fixing up code within one of our transform source
-		 * functions.
+		 * Does rel.offset fit within the range of a function that is to be spliced?
+		 * We actually check to see if it fits within the range of the transformed
+		 * function + the padding between it and the next function. This padding is
+		 * used in ELF .text relocations in AARCH64
 		 */
-		TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
-			shiva_debug("Is rel.offset(%#lx) within the range of %#lx-%#lx\n", rel.offset,		
-			    transform->source_symbol.value,
-			    transform->source_symbol.value + transform->source_symbol.size +
-			    transform->ext_len);
-
-			/*
-			 * Does rel.offset fit within the range of a function that is to be spliced?
-			 * We actually check to see if it fits within the range of the transformed
-			 * function + the padding between it and the next function. This padding is
-			 * used in ELF .text relocations in AARCH64
-			 */
-			if (rel.offset >= transform->source_symbol.value &&
-			    rel.offset < transform->source_symbol.value +
-			    transform->source_symbol.size + transform->ext_len) {
-				shiva_debug("This .text relocation applies to transform code in: %s\n",
-				    transform->source_symbol.name);
-				tf_ptr = transform;
-				break;
-			}
-		}
+		tf_ptr = module_tf_range_find(ranges, range_count, rel.offset);
+		if (tf_ptr != NULL)
+			shiva_debug("This .text relocation applies to transform code in: %s\n",
+			    tf_ptr->source_symbol.name);
 		shiva_debug("Relocation symbol name: %s\n", rel.symname);
-		res = apply_relocation(linker, rel, tf_ptr);
-		if (res == false) {
+		if (apply_relocation(linker, rel, tf_ptr) == false) {
 			shiva_debug("Failed to apply %s relocation at offset %#lx\n",
 			    rel.shdrname, rel.offset);
-			return false;
+			goto done;
 		}
+		SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_RELOCS, 1);
 	}
-	return true;
+	res = true;
+done:
+	free(ranges);
+	return res;
 }
 
 static bool
@@ -1569,10 +2844,8 @@ bool
 elf_section_map(struct shiva_module *linker, elfobj_t *elfobj, uint8_t *dst, 
     struct elf_section section, uint64_t *segment_offset)
 {
-	size_t rem = section.size % sizeof(uint64_t);
-	uint64_t qword;
+	uint8_t *src;
 	bool res;
-	size_t i = 0;
 
 	if (strcmp(section.name, ".text") == 0 &&
 	    module_has_transforms(linker)  == true) {
@@ -1588,39 +2861,18 @@ elf_section_map(struct shiva_module *linker, elfobj_t *elfobj, uint8_t *dst,
 	}
 	shiva_debug("Reading from offset %#lx - %#lx\n", section.offset,
 	    section.offset + section.size);
-	for (i = 0; i < section.size; i += sizeof(uint64_t)) {
-		if (i + sizeof(uint64_t) > section.size) {
-			size_t j;
-			  shiva_debug("%d + sizeof(uint64_t) >= %d\n", i, section.size);
-
-			/*
-			 * If there are 7 or less remaining bytes we cannot read
-			 * by QWORD and will read the remainder byte by byte
-			 */
-			shiva_debug("writing out remainder: %d bytes\n", rem);
-			for (j = 0; j < rem; j++) {
-				shiva_debug("Reading remaining byte from offset: %zu\n",
-				    section.offset + i + j);
-				res = elf_read_offset(elfobj, section.offset + i + j,
-				    &qword, ELF_BYTE);
-				if (res == false) {
-					shiva_debug("elf_read_offset failed at %#lx\n",
-					    section.offset + i + j);
-					return false;
-				}
-				dst[*segment_offset + i + j] = (uint8_t)qword;
-			}
-			break;
-		}
-		shiva_debug("Reading qword from offset: %zu\n", section.offset + i);
-		res = elf_read_offset(elfobj, section.offset + i, &qword, ELF_QWORD);
-		if (res == false) {
-			shiva_debug("elf_read_offset failed at %#lx\n", section.offset + i);
-			return false;
-		}
-		shiva_debug("qword: %#lx\n", qword);
-		*(uint64_t *)&dst[*segment_offset + i] = qword;
+	/*
+	 * Copy the whole section straight out of the objects file mapping,
+	 * rather than a qword at a time through elf_read_offset().
+	 */
+	src = elf_offset_pointer(elfobj, section.offset);
+	if (src == NULL || section.offset + section.size < section.offset ||
+	    section.offset + section.size > elf_size(elfobj)) {
+		shiva_debug("section %s at offset %#lx - %#lx is out of bounds\n",
+		    section.name, section.offset, section.offset + section.size);
+		return false;
 	}
+	memcpy(&dst[*segment_offset], src, section.size);
 	*segment_offset += section.size;
 	return true;
 }
@@ -1640,8 +2892,6 @@ elf_section_map(struct shiva_module *linker, elfobj_t *elfobj, uint8_t *dst,
  * can check the cache, which already contains the underlying linking data
  * that is required my Shiva.
  */
-#define MAX_BSS_COUNT 512 /* XXX This should be configurable/tunable */
-
 bool
 calculate_bss_size(struct shiva_module *linker, size_t *out)
 {
@@ -1649,35 +2899,28 @@ calculate_bss_size(struct shiva_module *linker, size_t *out)
 	struct elf_symbol symbol;
 	elf_symtab_iterator_t symtab_iter;
 	struct shiva_module_bss_entry *bss_entry;
-	ENTRY e, *ep;
 	uint64_t var_offset = 0;
 	size_t bss_size = 0;
 
 	TAILQ_INIT(&linker->tailq.bss_list);
-	(void) hcreate_r(MAX_BSS_COUNT, &linker->cache.bss);
+	shiva_htab_init(&linker->cache.bss, module_symbol_count(linker));
 
 	elf_symtab_iterator_init(elfobj, &symtab_iter);
 	while (elf_symtab_iterator_next(&symtab_iter, &symbol) == ELF_ITER_OK) {
 		if (symbol.shndx == SHN_COMMON) {
-			e.key = (char *)symbol.name;
-			e.data = NULL;
-
 			/*
 			 * If the symbol already exists, then move on.
 			 */
-			if (hsearch_r(e, FIND, &ep, &linker->cache.bss) != 0)
+			if (shiva_htab_find(&linker->cache.bss, symbol.name) != NULL)
 				continue;
-			bss_entry = shiva_malloc(sizeof(*bss_entry));
+			bss_entry = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*bss_entry));
 			bss_entry->symname = (char *)symbol.name;
 			bss_entry->addr = linker->bss_vaddr + var_offset;
 			bss_entry->offset = var_offset;
 			var_offset += symbol.size;
 
-			e.key = (char *)bss_entry->symname;
-			e.data = bss_entry;
-
-			if (hsearch_r(e, ENTER, &ep, &linker->cache.bss) == 0) {
-				free(bss_entry);
+			if (shiva_htab_insert(&linker->cache.bss, bss_entry->symname,
+			    bss_entry) == false) {
 				fprintf(stderr, "Failed to add .bss entry into cache: '%s'\n",
 				    symbol.name);
 				return false;
@@ -1693,8 +2936,6 @@ calculate_bss_size(struct shiva_module *linker, size_t *out)
 	return true;
 }
 
-#define MAX_GOT_COUNT 4096 * 10
-
 /*
  * Generally our modules data segment looks like this:
  * 0x6000000				
@@ -1710,7 +2951,6 @@ calculate_data_size(struct shiva_module *linker)
 	struct elf_relocation rel;
 	elf_relocation_iterator_t rel_iter;
 	struct shiva_module_got_entry *got_entry;
-	ENTRY e, *ep;
 	uint64_t offset;
 	size_t bss_len = 0;
 
@@ -1723,6 +2963,8 @@ calculate_data_size(struct shiva_module *linker)
 			 */
 			if (strcmp(section.name, ".bss") == 0)
 				continue;
+			if (module_section_dead(linker, section.name) == true)
+				continue;
 			shiva_debug("Increasing data segment len for section: %s len: %d\n",
 			    section.name, section.size);
 			linker->data_size += section.size;
@@ -1756,7 +2998,7 @@ calculate_data_size(struct shiva_module *linker)
 	/*
 	 * Create cache for GOT entries.
 	 */
-	(void) hcreate_r(MAX_GOT_COUNT, &linker->cache.got);
+	shiva_htab_init(&linker->cache.got, module_symbol_count(linker));
 
 	TAILQ_INIT(&linker->tailq.got_list);
 
@@ -1764,6 +3006,8 @@ calculate_data_size(struct shiva_module *linker)
 
 	elf_relocation_iterator_init(&linker->elfobj, &rel_iter);
 	while (elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK) {
+		if (module_rel_dead(linker, &rel) == true)
+			continue;
 		switch(rel.type) {
 #ifdef __x86_64__
 		case R_X86_64_PLT32:
@@ -1778,25 +3022,19 @@ calculate_data_size(struct shiva_module *linker)
 			/*
 			 * Cache symbol so we don't create duplicate GOT entries
 			*/
-			e.key = (char *)rel.symname;
-			e.data = (char *)rel.symname;
-
 			/*
 			 * If we already have this symbol then move on.
 			 */
-			if (hsearch_r(e, FIND, &ep, &linker->cache.got) != 0)
+			if (shiva_htab_find(&linker->cache.got, rel.symname) != NULL)
 				continue;
 
-			got_entry = shiva_malloc(sizeof(*got_entry));
+			got_entry = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*got_entry));
 			got_entry->symname = rel.symname; /* rel.symname will be valid until elf is unloaded */
 			got_entry->gotaddr = linker->data_vaddr + linker->pltgot_off + offset;
 			got_entry->gotoff = offset;
 
-			e.key = (char *)got_entry->symname;
-			e.data = got_entry;
-
-			if (hsearch_r(e, ENTER, &ep, &linker->cache.got) == 0) {
-				free(got_entry);
+			if (shiva_htab_insert(&linker->cache.got, got_entry->symname,
+			    got_entry) == false) {
 				fprintf(stderr, "Failed to add symbol: '%s'\n",
 				    rel.symname);
 				return false;
@@ -1818,6 +3056,8 @@ calculate_data_size(struct shiva_module *linker)
 	 * Offset from beginning of data segment.
 	 * The .bss lives right after our modules .got section in memory.
 	 */
+	SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_GOT_ENTRIES,
+	    linker->pltgot_size / sizeof(uint64_t));
 	linker->bss_off = linker->data_size;
 	shiva_debug("Shiva module data segment size: %zu\n", linker->data_size);
 	return true;
@@ -1839,11 +3079,20 @@ calculate_text_size(struct shiva_module *linker)
 	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
 		switch(transform->type) {
 		case SHIVA_TRANSFORM_SPLICE_FUNCTION:
+			/*
+			 * In place splices need no room at all. A function
+			 * with several splices is copied once, by its primary
+			 * splice, and is aligned to 4 bytes.
+			 */
+			if (transform->flags & SHIVA_TRANSFORM_F_INPLACE)
+				break;
 			shiva_debug("Calculate room for function splicing on %s\n",
 			    transform->target_symbol.name);
-			total_tf_len += transform->target_symbol.size;
+			if (transform->splice.primary == transform)
+				total_tf_len += transform->target_symbol.size + 3;
 			total_tf_len += (transform->new_len > transform->old_len) ?
 			    transform->new_len - transform->old_len : 0;
+			total_tf_len += transform->ext_len;
 			break;
 		default:
 			break;
@@ -1863,15 +3112,24 @@ calculate_text_size(struct shiva_module *linker)
 		if (section.flags & SHF_ALLOC) {
 			if (section.flags & SHF_WRITE)
 				continue;
+			if (module_section_dead(linker, section.name) == true)
+				continue;
 			/*
 			 * Looking only for section types of AX, and A
 			 */
 			linker->text_size += section.size;
+			/*
+			 * Room to align .eh_frame, and for its terminator.
+			 */
+			if (strcmp(section.name, ".eh_frame") == 0)
+				linker->text_size += sizeof(uint64_t) + sizeof(uint32_t);
 		}
 	}
 	linker->plt_off = linker->text_size;
 	elf_relocation_iterator_init(&linker->elfobj, &rel_iter);
 	while (elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK) {
+		if (module_rel_dead(linker, &rel) == true)
+			continue;
 #ifdef __x86_64__
 		if (rel.type == R_X86_64_PLT32 || rel.type == R_X86_64_PLTOFF64) {
 #elif __aarch64__
@@ -1894,8 +3152,92 @@ calculate_text_size(struct shiva_module *linker)
 	return true;
 }
 
-bool
-create_data_image(struct shiva_ctx *ctx, struct shiva_module *linker)
+/*
+ * TODO In the event that there is no data segment (i.e. data_size == 0)
+ * then we still allocate PAGE_SIZE bytes for any .bss data.
+ * In the future we need to assume that the .bss could be larger
+ * than PAGE_SIZE and fix this.
+ */
+static inline size_t
+module_data_size_aligned(struct shiva_module *linker)
+{
+	return linker->data_size == 0 ? PAGE_SIZE :
+	    ELF_PAGEALIGN(linker->data_size, PAGE_SIZE);
+}
+
+/*
+ * SHIVA_MODULE_HUGEPAGES=1 backs the text of each patch module with
+ * 2MB aligned, MADV_HUGEPAGE memory that is faulted in up front, so that
+ * the hot paths of a large patch take as few iTLB misses and page faults
+ * as the target does. The text is rounded up to a whole number of huge
+ * pages, since mprotect() on part of one would split it. The images
+ * are still placed by module_image_base(), so they share the
+ * neighbourhood of the target text.
+ */
+#define SHIVA_HUGEPAGE_SIZE	(2UL << 20)
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+static bool
+module_hugepages(void)
+{
+	char *env = getenv("SHIVA_MODULE_HUGEPAGES");
+
+	return env != NULL && strcmp(env, "1") == 0;
+}
+
+/*
+ * Length of the mapping at linker->text_mem
+ */
+static inline size_t
+module_text_map_size(struct shiva_module *linker)
+{
+	return linker->text_map_size != 0 ? linker->text_map_size :
+	    ELF_PAGEALIGN(linker->text_size, PAGE_SIZE);
+}
+
+static void
+module_prefault_text(uint8_t *mem, size_t len)
+{
+	volatile uint8_t *p;
+
+	if (madvise(mem, len, MADV_HUGEPAGE) < 0)
+		shiva_debug("madvise(MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+	if (madvise(mem, len, MADV_POPULATE_WRITE) == 0)
+		return;
+	/*
+	 * Kernels older than 5.14
+	 */
+	for (p = mem; p < mem + len; p += PAGE_SIZE)
+		*p = 0;
+	return;
+}
+
+/*
+ * Map len bytes at a SHIVA_HUGEPAGE_SIZE aligned address near base.
+ */
+static uint8_t *
+module_map_huge(uint64_t base, size_t len, int prot, uint64_t flags)
+{
+	uint8_t *mem, *aligned;
+	size_t span = len + SHIVA_HUGEPAGE_SIZE;
+
+	mem = mmap(base == 0 ? NULL : (void *)ELF_PAGEALIGN(base, SHIVA_HUGEPAGE_SIZE),
+	    span, prot, flags, -1, 0);
+	if (mem == MAP_FAILED)
+		return MAP_FAILED;
+	aligned = (uint8_t *)ELF_PAGEALIGN((uint64_t)mem, SHIVA_HUGEPAGE_SIZE);
+	if (aligned > mem)
+		(void) munmap(mem, aligned - mem);
+	if (mem + span > aligned + len)
+		(void) munmap(aligned + len, (mem + span) - (aligned + len));
+	return aligned;
+}
+
+bool
+create_data_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 {
 	elf_section_iterator_t shdr_iter;
 	struct elf_section section;
@@ -1914,31 +3256,8 @@ create_data_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 		return true; // we need no data segment
 	}
 #endif
-	uint64_t mmap_flags = (ctx->flags & SHIVA_OPTS_F_INTERP_MODE) ? MAP_PRIVATE|MAP_ANONYMOUS :
-	    MAP_PRIVATE|MAP_ANONYMOUS;
-	uint64_t mmap_base = 0;
-
-	if (ctx->flags & SHIVA_OPTS_F_INTERP_MODE) {
-		mmap_base = ELF_PAGEALIGN(linker->text_vaddr + linker->text_size, PAGE_SIZE);
-	} else {
-		mmap_base = ELF_PAGEALIGN(linker->text_vaddr + linker->text_size, PAGE_SIZE);
-		mmap_flags |= MAP_32BIT;
-	}
-	/*
-	 * TODO In the event that there is no data segment (i.e. data_size == 0)
-	 * then we still allocate PAGE_SIZE bytes for any .bss data.
-	 * In the future we need to assume that the .bss could be larger
-	 * than PAGE_SIZE and fix this.
-	 */
-	data_size_aligned = linker->data_size == 0 ? PAGE_SIZE :
-	    ELF_PAGEALIGN(linker->data_size, PAGE_SIZE);
+	data_size_aligned = module_data_size_aligned(linker);
 	shiva_debug("ELF data segment len: %zu\n", data_size_aligned);
-	linker->data_mem = mmap((void *)mmap_base, data_size_aligned, PROT_READ|PROT_WRITE,
-	    mmap_flags, -1, 0);
-	if (linker->data_mem == MAP_FAILED) {
-		shiva_debug("mmap failed: %s\n", strerror(errno));
-		return false;
-	}
 	linker->data_vaddr = (uint64_t)linker->data_mem;
 	elf_section_iterator_init(&linker->elfobj, &shdr_iter);
 	while (elf_section_iterator_next(&shdr_iter, &section) == ELF_ITER_OK) {
@@ -1955,6 +3274,8 @@ create_data_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 			 */
 			if (strcmp(section.name, ".bss") != 0 && section.size == 0)
 				continue;
+			if (module_section_dead(linker, section.name) == true)
+				continue;
 			shiva_debug("Attempting to map section %s(offset: %zu) into data segment"
 			    " at address %p\n", section.name, off, linker->data_mem + off);
 			/*
@@ -1969,11 +3290,7 @@ create_data_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 					return false;
 				}
 			}
-			n = malloc(sizeof(*n));
-			if (n == NULL) {
-				shiva_debug("malloc failed\n");
-				return false;
-			}
+			n = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*n));
 			n->map_attribute = (section.type == SHT_NOBITS) ? LP_SECTION_BSS_SEGMENT :
 			    LP_SECTION_DATASEGMENT;
 			n->vaddr = (section.type == SHT_NOBITS) ? linker->data_vaddr + linker->bss_off 
@@ -1985,7 +3302,7 @@ create_data_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 			shiva_debug("Address: %#lx\n", n->vaddr);
 			shiva_debug("Offset: %#lx\n", n->offset);
 			shiva_debug("Size: %#lx\n", n->size);
-			TAILQ_INSERT_TAIL(&linker->tailq.section_maplist, n, _linkage);
+			section_mapping_insert(linker, n);
 			count += section.size;
 			shiva_debug("COUNT: %zu\n", count);
 		}
@@ -1994,21 +3311,52 @@ create_data_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 	return true;
 }
 
-bool
-create_text_image(struct shiva_ctx *ctx, struct shiva_module *linker)
+/*
+ * In interpreter mode the module images are placed into a window of
+ * SHIVA_MODULE_WINDOW_SIZE bytes right below the target, allocated from
+ * its bottom up. The window is at the same offset from the target base
+ * on every run, so an image that was relocated once (See
+ * shiva_module_cache.c) applies to any later run with a single base
+ * delta, and the kernel ASLR of the target moves the window along with
+ * it. Every image in the window is within call26 range of the first
+ * 64MB of the target text. SHIVA_MODULE_PLACEMENT=heap places the
+ * images after the heap instead, as Shiva always used to.
+ */
+#define SHIVA_MODULE_WINDOW_SIZE	(64UL << 20)
+
+static bool
+module_window_base(struct shiva_ctx *ctx, size_t len, uint64_t *base)
 {
-	elf_section_iterator_t shdr_iter;
-	struct elf_section section;
-	elf_relocation_iterator_t rel_iter;
-	struct elf_relocation rel;
-	bool res;
-	size_t text_size_aligned;
-	size_t off = 0;
-	size_t count = 0;
-	int i;
-	struct shiva_transform *transform;
-	size_t total_transforms_len = 0;
+	char *env = getenv("SHIVA_MODULE_PLACEMENT");
+	uint64_t window = ctx->ulexec.base_vaddr - SHIVA_MODULE_WINDOW_SIZE;
 
+	if (env != NULL && strcmp(env, "heap") == 0)
+		return false;
+	if (ctx->ulexec.base_vaddr < SHIVA_MODULE_WINDOW_SIZE)
+		return false;
+	/*
+	 * module_map_huge() aligns the image up to the next huge page
+	 */
+	len = ELF_PAGEALIGN(len, PAGE_SIZE);
+	if (module_hugepages() == true)
+		len += SHIVA_HUGEPAGE_SIZE;
+	if (ctx->module.window_off + len > SHIVA_MODULE_WINDOW_SIZE) {
+		shiva_debug("No room left in the module window for %zu bytes\n", len);
+		return false;
+	}
+	*base = window + ctx->module.window_off;
+	ctx->module.window_off += len;
+	return true;
+}
+
+/*
+ * Find the address and mmap flags that the segments of a module are
+ * mapped with, len is the size of the image.
+ */
+static void
+module_image_base(struct shiva_ctx *ctx, struct shiva_module *linker, size_t len,
+    uint64_t *base_out, uint64_t *flags_out)
+{
 	/*
 	 * NOTE: We map the module to segments within a 32bit address range.
 	 * This avoids the problem of call offsets larger than 32bits. The
@@ -2020,9 +3368,9 @@ create_text_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 	 * to load the target executable to a much higher address space.
 	 * In this case we won't use the MAP_32BIT.
 	 */
-	uint64_t mmap_flags = (ctx->flags & SHIVA_OPTS_F_INTERP_MODE) ? MAP_PRIVATE|MAP_ANONYMOUS :
+	uint64_t flags = (ctx->flags & SHIVA_OPTS_F_INTERP_MODE) ? MAP_PRIVATE|MAP_ANONYMOUS :
 	    MAP_PRIVATE|MAP_ANONYMOUS;
-	uint64_t mmap_base = 0;
+	uint64_t base = 0;
 
 	/*
 	 * If we are in interpreter mode, then we were not responsible for
@@ -2032,37 +3380,59 @@ create_text_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 	 * module and the target executable. To correct this we make sure that the
 	 * module is mapped to an address space right after the heap, to ensure
 	 * that the module is within a 4GB range of the target executable.
+	 * Unless there is room for it in the window below the target (See
+	 * module_window_base).
 	 */
 	if (ctx->flags & SHIVA_OPTS_F_INTERP_MODE) {
 
 		shiva_maps_iterator_t maps_iter;
 		struct shiva_mmap_entry mmap_entry;
 
+		if (module_window_base(ctx, len, &base) == true) {
+			shiva_debug("Module '%s' placed at target base - %#lx\n",
+			    elf_pathname(&linker->elfobj), ctx->ulexec.base_vaddr - base);
+			*base_out = base;
+			*flags_out = flags;
+			return;
+		}
 		shiva_maps_iterator_init(ctx, &maps_iter);
 		while (shiva_maps_iterator_next(&maps_iter, &mmap_entry) == SHIVA_ITER_OK) {
 			if (mmap_entry.mmap_type == SHIVA_MMAP_TYPE_HEAP) {
-				mmap_base = ELF_PAGEALIGN(mmap_entry.base + mmap_entry.len, PAGE_SIZE);
-				mmap_base += 4096 * 8;
+				base = ELF_PAGEALIGN(mmap_entry.base + mmap_entry.len, PAGE_SIZE);
+				base += 4096 * 8;
 				break;
 			}
 		}
-		if (mmap_base == 0) {
+		if (base == 0) {
 			fprintf(stderr, "Warning, couldn't find heap location which we use to "
 			    "indicate the load bias for the module '%s' text segment\n",
 			    elf_pathname(&linker->elfobj));
 		}
 	} else {
-		mmap_base = 0x6000000;
-		mmap_flags |= MAP_32BIT;
-		mmap_flags |= MAP_FIXED;
-	}
-	text_size_aligned = ELF_PAGEALIGN(linker->text_size, PAGE_SIZE);
-	linker->text_mem = mmap((void *)mmap_base, text_size_aligned, PROT_READ|PROT_WRITE|PROT_EXEC,
-	    mmap_flags, -1, 0);
-	if (linker->text_mem == MAP_FAILED) {
-		shiva_debug("mmap failed: %s\n", strerror(errno));
-		return false;
+		base = 0x6000000;
+		flags |= MAP_32BIT;
+		flags |= MAP_FIXED;
 	}
+	*base_out = base;
+	*flags_out = flags;
+	return;
+}
+
+bool
+create_text_image(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	elf_section_iterator_t shdr_iter;
+	struct elf_section section;
+	elf_relocation_iterator_t rel_iter;
+	struct elf_relocation rel;
+	bool res, eh_frame;
+	size_t off = 0;
+	size_t count = 0;
+	size_t pad;
+	int i;
+	struct shiva_transform *transform;
+	size_t total_transforms_len = 0;
+
 	shiva_debug("Module text segment: %p\n", linker->text_mem);
 	linker->text_vaddr = (uint64_t)linker->text_mem;
 
@@ -2077,11 +3447,17 @@ create_text_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 			 * If we made it here then the section should be
 			 * placed into the text segment :)
 			 */
-			if (section.size == 0)
-				continue;
-			if (strcmp(section.name, ".eh_frame") == 0) {
-				shiva_debug("Skipping section .eh_frame (Unused)\n");
+			if (section.size == 0 || module_section_dead(linker, section.name) == true)
 				continue;
+			eh_frame = strcmp(section.name, ".eh_frame") == 0;
+			if (eh_frame == true) {
+				if (shiva_eh_frame_enabled(linker) == false) {
+					shiva_debug("Skipping section .eh_frame\n");
+					continue;
+				}
+				pad = ELF_PAGEALIGN(off, sizeof(uint64_t)) - off;
+				off += pad;
+				count += pad;
 			}
 			if (strstr(section.name, ".note") != NULL) {
 				shiva_debug("Skipping note sections\n");
@@ -2095,26 +3471,28 @@ create_text_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 				shiva_debug("elf_section_map failed\n");
 				return false;
 			}
-			n = malloc(sizeof(*n));
-			if (n == NULL) {
-				shiva_debug("malloc failed\n");
-				return false;
-			}
+			n = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*n));
 			n->map_attribute = LP_SECTION_TEXTSEGMENT;
 			n->vaddr = (unsigned long)linker->text_mem + count;
 			n->offset = count; // offset within text segment that section lives at
 			n->size = section.size;
-			n->name = strdup(section.name);
-			if (n->name == NULL) {
-				shiva_debug("strdup: %s\n", strerror(errno));
-				return false;
-			}
+			n->name = shiva_arena_strdup(&linker->ctx->arena.module, section.name);
 			shiva_debug("Inserting section to segment mapping\n");
 			shiva_debug("Address: %#lx\n", n->vaddr);
 			shiva_debug("Offset: %#lx\n", n->offset);
 			shiva_debug("Size: %#lx\n", n->size);
-			TAILQ_INSERT_TAIL(&linker->tailq.section_maplist, n, _linkage);
+			section_mapping_insert(linker, n);
 			count = (module_has_transforms(linker) == true) ? off :  count + section.size;
+			if (eh_frame == true) {
+				/*
+				 * Followed by a zero length terminator, the text
+				 * image is zero filled.
+				 */
+				linker->eh_frame.mem = linker->text_mem + off - section.size;
+				linker->eh_frame.size = section.size;
+				off += sizeof(uint32_t);
+				count += sizeof(uint32_t);
+			}
 		}
 	}
 	shiva_debug("count: %zu off: %zu\n", count, off);
@@ -2124,20 +3502,12 @@ create_text_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 		if (i == 0) {
 			struct shiva_module_section_mapping *n;
 
-			n = malloc(sizeof(*n));
-			if (n == NULL) {
-				shiva_debug("malloc: %s\n", strerror(errno));
-				return false;
-			}
+			n = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*n));
 			n->map_attribute = LP_SECTION_TEXTSEGMENT;
 			n->vaddr = linker->text_vaddr + linker->plt_off;
 			n->size = section.size;
-			n->name = strdup(".plt");
-			if (n->name == NULL) {
-				shiva_debug("strdup: %s\n", strerror(errno));
-				return false;
-			}
-			TAILQ_INSERT_TAIL(&linker->tailq.section_maplist, n, _linkage);
+			n->name = ".plt";
+			section_mapping_insert(linker, n);
 		}
 		/*
 		 * ELF Relocs for creating internal PLT linkage to external (And local) calls.
@@ -2158,6 +3528,8 @@ create_text_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 		if (rel.type != R_AARCH64_CALL26)
 			continue;
 #endif
+		if (module_rel_dead(linker, &rel) == true)
+			continue;
 
 		/*
 		 * We have a tailq list for the address/offset of each PLT entry
@@ -2165,16 +3537,8 @@ create_text_image(struct shiva_ctx *ctx, struct shiva_module *linker)
 		 */
 		struct shiva_module_plt_entry *plt;
 
-		plt = calloc(1, sizeof(*plt));
-		if (plt == NULL) {
-			shiva_debug("malloc: %s\n", strerror(errno));
-			return false;
-		}
-		plt->symname = strdup(rel.symname);
-		if (plt->symname == NULL) {
-			shiva_debug("strdup: %s\n", strerror(errno));
-			return false;
-		}
+		plt = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*plt));
+		plt->symname = shiva_arena_strdup(&linker->ctx->arena.module, rel.symname);
 		plt->offset = linker->plt_off + i * sizeof(plt_stub);
 		plt->vaddr = linker->text_vaddr + linker->plt_off + i * sizeof(plt_stub);
 		plt->plt_count++;
@@ -2195,41 +3559,34 @@ static bool
 get_tf_function_refs(struct shiva_ctx *ctx, struct shiva_module *linker,
     struct shiva_transform *transform)
 {
-	struct shiva_xref_site xref;
-	struct shiva_branch_site *branch;
-	shiva_xref_iterator_t xrefs;
-
-	TAILQ_INIT(&transform->xref_list);
-	TAILQ_INIT(&transform->branch_list);
+	uint64_t start = transform->target_symbol.value;
+	uint64_t end = start + transform->target_symbol.size;
+	size_t first, i;
 
 	shiva_debug("get_tf_function_refs:\n");
 
-	shiva_xref_iterator_init(ctx, &xrefs);
-	while (shiva_xref_iterator_next(&xrefs, &xref) == SHIVA_ITER_OK) {
-		if ((xref.flags & SHIVA_XREF_F_SRC_SYMINFO) == 0)
-			continue;
-		shiva_debug("Comparing %s and %s\n", xref.current_function.name, transform->target_symbol.name);
-		if (strcmp(xref.current_function.name, transform->target_symbol.name) == 0) {
-			shiva_debug("XREF site in transform target '%s'\n",
-			    transform->target_symbol.name);
-			struct shiva_xref_site *xp = shiva_malloc(sizeof(*xp));
-
-			memcpy(xp, &xref, sizeof(*xp));
-			TAILQ_INSERT_TAIL(&transform->xref_list, xp, _linkage);
-		}
+	/*
+	 * The analysis arrays are sorted by site address, so the sites
+	 * within the transform target are contiguous, and the transform
+	 * borrows that range of each array.
+	 */
+	first = shiva_analyze_xref_index(ctx, start);
+	for (i = first; i < ctx->analysis.xref_count; i++) {
+		if (ctx->analysis.xrefs[i].adrp_site >= end)
+			break;
 	}
-	TAILQ_FOREACH(branch, &ctx->tailq.branch_tqlist, _linkage) {
-		if ((branch->branch_flags & SHIVA_BRANCH_F_SRC_SYMINFO) == 0)
-			continue;
-		if (strcmp(branch->current_function.name, transform->target_symbol.name) == 0) {
-			struct shiva_branch_site *tmp = shiva_malloc(sizeof(struct shiva_branch_site));
+	transform->xrefs = &ctx->analysis.xrefs[first];
+	transform->xref_count = i - first;
 
-			memcpy(tmp, branch, sizeof(*branch));
-			shiva_debug("BRANCH site in transform target '%s': %s\n",
-			    transform->target_symbol.name, branch->insn_string);
-			TAILQ_INSERT_TAIL(&transform->branch_list, tmp, _linkage);
-		}
+	first = shiva_analyze_branch_index(ctx, start);
+	for (i = first; i < ctx->analysis.branch_count; i++) {
+		if (ctx->analysis.branches[i].branch_site >= end)
+			break;
 	}
+	transform->branches = &ctx->analysis.branches[first];
+	transform->branch_count = i - first;
+	shiva_debug("%zu branch and %zu xref sites in transform target '%s'\n",
+	    transform->branch_count, transform->xref_count, transform->target_symbol.name);
 	return true;
 }
 
@@ -2284,8 +3641,6 @@ next_function_by_address(elfobj_t *elfobj, uint64_t current_func, struct elf_sym
 	return true;
 }
 
-#define SHIVA_HELPERS_MAX 4096
-
 static bool
 validate_helpers(struct shiva_ctx *ctx, struct shiva_module *linker)
 {
@@ -2295,9 +3650,8 @@ validate_helpers(struct shiva_ctx *ctx, struct shiva_module *linker)
 	elf_symtab_iterator_t sym_iter;
 	char *dst_symname;
 	struct shiva_helper *helper;
-	ENTRY e, *ep;
 
-	(void) hcreate_r(SHIVA_HELPERS_MAX, &linker->cache.helpers);
+	shiva_htab_init(&linker->cache.helpers, module_symbol_count(linker));
 
 	elf_symtab_iterator_init(&linker->elfobj, &sym_iter);
 	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
@@ -2313,28 +3667,26 @@ validate_helpers(struct shiva_ctx *ctx, struct shiva_module *linker)
 			}
 			dst_symname += strlen("_orig_func_");
 			shiva_debug("Function %s\n", dst_symname);
-			if (elf_symbol_by_name(linker->target_elfobj,
+			if (shiva_symbol_by_name(&linker->ctx->gnu_hash, linker->target_elfobj,
 				dst_symname, &target_sym) == false) {
 				fprintf(stderr, "The symbol doesn't exist: %s not found in %s\n",
 				    dst_symname, elf_pathname(linker->target_elfobj));
 				return false;
 			}
 
-			e.key = (char *)symbol.name; /* i.e. __shiva_helper_orig_func */
-			e.data = NULL;
-
-                        if (hsearch_r(e, FIND, &ep, &linker->cache.helpers) != 0)
+			/* i.e. __shiva_helper_orig_func */
+			if (shiva_htab_find(&linker->cache.helpers, symbol.name) != NULL)
 				continue;
 
-			helper = shiva_malloc(sizeof(*helper));
+			helper = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*helper));
 			helper->type = SHIVA_HELPER_CALL_EXTERNAL;
 			memcpy(&helper->symbol, &target_sym, sizeof(struct elf_symbol));
 
- 			if (hsearch_r(e, ENTER, &ep, &linker->cache.helpers) == 0) {
-                                free(helper);
-                                fprintf(stderr, "Failed to add helper: %s\n", symbol.name);
-                                return false;
-                        }
+			if (shiva_htab_insert(&linker->cache.helpers, symbol.name,
+			    helper) == false) {
+				fprintf(stderr, "Failed to add helper: %s\n", symbol.name);
+				return false;
+			}
 			shiva_debug("Inserting helper record\n"
 					"Helper type: SHIVA_HEPLER_CALL_EXTERNAL\n"
 					"External symbol value: %#lx\n", target_sym.value);
@@ -2345,6 +3697,162 @@ validate_helpers(struct shiva_ctx *ctx, struct shiva_module *linker)
 	return true;
 }
 
+/*
+ * Read the HWCAP bits that the variant n of fn_name needs from its
+ * __shiva_variant_hwcap_n<N>_<fn_name> record in .shiva.variant.
+ */
+static bool
+read_variant_hwcap(struct shiva_module *linker, unsigned long n, const char *fn_name,
+    uint64_t *hwcap, uint64_t *hwcap2)
+{
+	struct elf_symbol symbol;
+	struct elf_section shdr;
+	char name[PATH_MAX];
+
+	snprintf(name, sizeof(name), "%s%lu_%s", SHIVA_VARIANT_HWCAP_ID, n, fn_name);
+	if (elf_symbol_by_name(&linker->elfobj, name, &symbol) == false) {
+		fprintf(stderr, "Failed to find variant input '%s'\n", name);
+		return false;
+	}
+	if (elf_section_by_index(&linker->elfobj, symbol.shndx, &shdr) == false ||
+	    strcmp(shdr.name, ".shiva.variant") != 0 ||
+	    symbol.size != sizeof(uint64_t) * 2) {
+		fprintf(stderr, "Symbol '%s' is not a '.shiva.variant' record\n", name);
+		return false;
+	}
+	if (elf_read_offset(&linker->elfobj, shdr.offset + symbol.value, hwcap,
+	    ELF_QWORD) == false ||
+	    elf_read_offset(&linker->elfobj, shdr.offset + symbol.value + sizeof(uint64_t),
+	    hwcap2, ELF_QWORD) == false) {
+		fprintf(stderr, "Failed to read variant input '%s' in %s\n", name,
+		    elf_pathname(&linker->elfobj));
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Pick the variant of each patch function that is linked in on this CPU
+ * (See SHIVA_VARIANT). A variant __shiva_variant_n<N>_<fn_name> is
+ * eligible when AT_HWCAP and AT_HWCAP2 have every bit that it needs, and
+ * the eligible one with the lowest N wins. Functions without an eligible
+ * variant keep their plain definition.
+ */
+static bool
+validate_variants(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	struct shiva_module_variant *variant;
+	elf_symtab_iterator_t sym_iter;
+	struct elf_symbol symbol, plain;
+	uint64_t hwcap, hwcap2, need, need2;
+	const size_t prefix_len = strlen(SHIVA_VARIANT_ID);
+	unsigned long n;
+	const char *fn_name;
+	char *end;
+	bool have_hwcap = false;
+
+	elf_symtab_iterator_init(&linker->elfobj, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
+		if (symbol.type != STT_FUNC || symbol.bind != STB_GLOBAL ||
+		    strncmp(symbol.name, SHIVA_VARIANT_ID, prefix_len) != 0)
+			continue;
+		n = strtoul(symbol.name + prefix_len, &end, 10);
+		if (end == symbol.name + prefix_len || *end != '_' || end[1] == '\0') {
+			fprintf(stderr, "Invalid format to SHIVA_VARIANT: %s\n", symbol.name);
+			return false;
+		}
+		fn_name = end + 1;
+		if (elf_symbol_by_name(&linker->elfobj, fn_name, &plain) == false ||
+		    plain.type != STT_FUNC || plain.shndx == SHN_UNDEF) {
+			fprintf(stderr, "SHIVA_VARIANT %s has no plain definition of %s\n",
+			    symbol.name, fn_name);
+			return false;
+		}
+		if (read_variant_hwcap(linker, n, fn_name, &need, &need2) == false)
+			return false;
+		/*
+		 * The choice depends on the CPU, not just on the target.
+		 */
+		shiva_module_cache_invalidate(linker, "module has HWCAP variants");
+		if (have_hwcap == false) {
+			if (shiva_auxv_hwcap(ctx, &hwcap, &hwcap2) == false) {
+				fprintf(stderr, "Unable to read AT_HWCAP\n");
+				return false;
+			}
+			have_hwcap = true;
+		}
+		if ((hwcap & need) != need || (hwcap2 & need2) != need2) {
+			shiva_debug("Variant %s needs HWCAP %#lx:%#lx, skipping it\n",
+			    symbol.name, need, need2);
+			continue;
+		}
+		variant = shiva_htab_find(&linker->cache.variants, fn_name);
+		if (variant != NULL) {
+			if (variant->n < n)
+				continue;
+		} else {
+			variant = shiva_arena_alloc(&ctx->arena.module, sizeof(*variant));
+			(void) shiva_htab_insert(&linker->cache.variants, fn_name, variant);
+		}
+		memcpy(&variant->symbol, &symbol, sizeof(symbol));
+		variant->n = n;
+		variant->hwcap = need;
+		variant->hwcap2 = need2;
+		shiva_debug("Variant %s is eligible for %s\n", symbol.name, fn_name);
+	}
+	return true;
+}
+
+/*
+ * If fn_name within the patch has a variant for this CPU, replace
+ * *symbol with it.
+ */
+static inline bool
+patch_variant_symbol(struct shiva_module *linker, const char *fn_name,
+    struct elf_symbol *symbol)
+{
+	struct shiva_module_variant *variant;
+
+	variant = shiva_htab_find(&linker->cache.variants, fn_name);
+	if (variant == NULL)
+		return false;
+	memcpy(symbol, &variant->symbol, sizeof(*symbol));
+	return true;
+}
+
+/*
+ * Read the value of name, a transform input, from the .shiva.transform
+ * section of the module.
+ */
+static bool
+read_transform_input(struct shiva_module *linker, const char *name, uint64_t *val)
+{
+	struct elf_symbol symbol;
+	struct elf_section shdr;
+
+	if (elf_symbol_by_name(&linker->elfobj, name, &symbol) == false) {
+		fprintf(stderr, "Failed to find transform input '%s'\n", name);
+		return false;
+	}
+	if (elf_section_by_index(&linker->elfobj, symbol.shndx, &shdr) == false) {
+		fprintf(stderr, "Failed to find section index %d\n", symbol.shndx);
+		return false;
+	}
+	if (strcmp(shdr.name, ".shiva.transform") != 0) {
+		fprintf(stderr, "Symbol '%s' corresponds to wrong section: '%s'"
+		    " and not '.shiva.transform'\n", symbol.name, shdr.name);
+		return false;
+	}
+	if (elf_read_offset(&linker->elfobj, shdr.offset + symbol.value, val,
+	    symbol.size == 8 ? ELF_QWORD : ELF_DWORD) == false) {
+		fprintf(stderr, "Failed to read transform input '%s' value"
+		    " at %#lx in %s\n", symbol.name, shdr.offset + symbol.value,
+		    elf_pathname(&linker->elfobj));
+		return false;
+	}
+	return true;
+}
+
 /*
  * Transformations (formerly known as PTD)
  * If there are any transformations, make internal transformation
@@ -2366,6 +3874,7 @@ validate_transformations(struct shiva_ctx *ctx, struct shiva_module *linker)
 	elf_symtab_iterator_t sym_iter;
 	struct shiva_transform *transform, *next_tf;
 	uint64_t insert_vaddr, extend_vaddr, tf_val;
+	size_t prefix_len;
 	char *dst_symname;
 	char tmp[PATH_MAX];
 
@@ -2383,40 +3892,41 @@ validate_transformations(struct shiva_ctx *ctx, struct shiva_module *linker)
 	elf_symtab_iterator_init(&linker->elfobj, &sym_iter);
 	while (elf_symtab_iterator_next(&sym_iter, &tf_sym) == ELF_ITER_OK) {
 		shiva_debug("transform symbol '%s'\n", tf_sym.name);
-		if (tf_sym.type == STT_FUNC) {
-			if (strncmp(tf_sym.name, SHIVA_T_SPLICE_FUNC_ID,
-			    strlen(SHIVA_T_SPLICE_FUNC_ID)) == 0) {
-				shiva_debug("transform op: %s\n", SHIVA_T_SPLICE_FUNC_ID);
-				dst_symname = strstr(tf_sym.name, "_fn_name_");
-				if (dst_symname == NULL) {
-					fprintf(stderr, "Invalid format to SHIVA_T_SPLICE_FUNCTION: %s\n",
-					    tf_sym.name);
-					return false;
-				}
-				dst_symname += strlen("_fn_name_");
-				shiva_debug("Function %s\n", dst_symname);
-				if (elf_symbol_by_name(linker->target_elfobj,
-				    dst_symname, &target_sym) == false) {
-					fprintf(stderr, "Transform target symbol doesn't exist: %s not found\n",
-					    dst_symname);
-					return false;
-				}
-				shiva_debug("Found symbol information in target executable, for %s\n",
+		/*
+		 * __shiva_emit_n<N>_code_<function_name> is the bytecode
+		 * of an emit into <function_name>, see SHIVA_T_EMIT_BYTECODE.
+		 */
+		dst_symname = NULL;
+		if (tf_sym.type == STT_FUNC)
+			dst_symname = (char *)shiva_tf_splice_target(tf_sym.name);
+		else if (tf_sym.type == STT_OBJECT)
+			dst_symname = (char *)shiva_tf_emit_target(tf_sym.name);
+		if (dst_symname != NULL) {
+			shiva_debug("transform op: %s\n", tf_sym.type == STT_FUNC ?
+			    SHIVA_T_SPLICE_FUNC_ID : SHIVA_T_EMIT_ID);
+			shiva_debug("Function %s\n", dst_symname);
+			if (shiva_symbol_by_name(&linker->ctx->gnu_hash, linker->target_elfobj,
+			    dst_symname, &target_sym) == false) {
+				fprintf(stderr, "Transform target symbol doesn't exist: %s not found\n",
 				    dst_symname);
-				transform = shiva_malloc(sizeof(*transform));
-				transform->type = SHIVA_TRANSFORM_SPLICE_FUNCTION;
-				memcpy(&transform->target_symbol, &target_sym,
-				    sizeof(struct elf_symbol));
-				memcpy(&transform->source_symbol, &tf_sym,
-				    sizeof(struct elf_symbol));
-				transform->name = (char *)target_sym.name;
-				transform->ptr = NULL;
-				shiva_debug("Source symbol '%s' value: %zu size: %zu\n",
-				    transform->source_symbol.name, transform->source_symbol.value, transform->source_symbol.size);
-
-				shiva_debug("Inserting transform entry: %s\n", transform->name);
-				TAILQ_INSERT_TAIL(&linker->tailq.transform_list, transform, _linkage);
+				return false;
 			}
+			shiva_debug("Found symbol information in target executable, for %s\n",
+			    dst_symname);
+			transform = shiva_arena_alloc(&linker->ctx->arena.module, sizeof(*transform));
+			transform->type = tf_sym.type == STT_FUNC ?
+			    SHIVA_TRANSFORM_SPLICE_FUNCTION : SHIVA_TRANSFORM_EMIT_BYTECODE;
+			memcpy(&transform->target_symbol, &target_sym,
+			    sizeof(struct elf_symbol));
+			memcpy(&transform->source_symbol, &tf_sym,
+			    sizeof(struct elf_symbol));
+			transform->name = (char *)target_sym.name;
+			transform->ptr = NULL;
+			shiva_debug("Source symbol '%s' value: %zu size: %zu\n",
+			    transform->source_symbol.name, transform->source_symbol.value, transform->source_symbol.size);
+
+			shiva_debug("Inserting transform entry: %s\n", transform->name);
+			TAILQ_INSERT_TAIL(&linker->tailq.transform_list, transform, _linkage);
 		}
 	}
 
@@ -2429,6 +3939,7 @@ validate_transformations(struct shiva_ctx *ctx, struct shiva_module *linker)
 	 * must locate the corresponding transform inputs, which are two symbols:
 	 * 1. __shiva_splice_insert_<func_name>
 	 * 2. __shiva_splice_extend_<func_name>
+	 * (__shiva_splice_n<N>_insert_<func_name> etc. for SHIVA_T_SPLICE_FUNCTION_AT)
 	 * And read their stored values, from within the .shiva.transform section
 	 * of the module. The values are stored as: transform->insert_vaddr, and
 	 * transform->extend_vaddr respectively.
@@ -2450,10 +3961,14 @@ validate_transformations(struct shiva_ctx *ctx, struct shiva_module *linker)
 				    transform->name);
 				return false;
 			}
-			strcpy(tmp, SHIVA_T_SPLICE_INSERT_ID);
-			strncat(tmp, transform->name,
-			    PATH_MAX - strlen(SHIVA_T_SPLICE_INSERT_ID));
-			tmp[sizeof(tmp) - 1] = '\0';
+			/*
+			 * The inputs share the prefix of the source function,
+			 * i.e. "__shiva_splice" or "__shiva_splice_n<N>".
+			 */
+			prefix_len = strstr(transform->source_symbol.name, "_fn_name_") -
+			    transform->source_symbol.name;
+			snprintf(tmp, sizeof(tmp), "%.*s_insert_%s", (int)prefix_len,
+			    transform->source_symbol.name, transform->name);
 			shiva_debug("Checking '%s' symbol cache for %s\n",
 			    elf_pathname(&linker->elfobj), tmp);
 			if (elf_symbol_by_name(&linker->elfobj,
@@ -2493,11 +4008,8 @@ validate_transformations(struct shiva_ctx *ctx, struct shiva_module *linker)
 			shiva_debug("%s: (deferenced at offset %#lx): %#lx\n", tf_sym.name,
 			    shdr.offset + tf_sym.value, tf_val);
 
-			memset(tmp, 0, sizeof(tmp));
-			strcpy(tmp, SHIVA_T_SPLICE_EXTEND_ID);
-			strncat(tmp, transform->name,
-			    PATH_MAX - strlen(SHIVA_T_SPLICE_EXTEND_ID));
-			tmp[sizeof(tmp) - 1] = '\0';
+			snprintf(tmp, sizeof(tmp), "%.*s_extend_%s", (int)prefix_len,
+			    transform->source_symbol.name, transform->name);
 			shiva_debug("Checking symbol cache for %s\n", tmp);
 			if (elf_symbol_by_name(&linker->elfobj,
 			    tmp, &tf_sym) == false) {
@@ -2544,8 +4056,8 @@ validate_transformations(struct shiva_ctx *ctx, struct shiva_module *linker)
 			 * TODO: Sanity checks on insert_vaddr, extend_vaddr
 			 */
 			shiva_debug("transform->offset = %#lx - %#lx\n", insert_vaddr,
-			    target_sym.value);
-			transform->offset = insert_vaddr - target_sym.value;
+			    transform->target_symbol.value);
+			transform->offset = insert_vaddr - transform->target_symbol.value;
 			transform->old_len = extend_vaddr - insert_vaddr;
 			transform->new_len = transform->source_symbol.size;
 			shiva_debug("transform->new_len: %#lx\n", transform->new_len);
@@ -2640,17 +4152,7 @@ validate_transformations(struct shiva_ctx *ctx, struct shiva_module *linker)
 				transform->flags |=
 				    (SHIVA_TRANSFORM_F_EXTEND|SHIVA_TRANSFORM_F_INJECT);
 			}
-			memset(tmp, 0, sizeof(tmp));
-			strcpy(tmp, SHIVA_T_SPLICE_FUNC_ID);
-			strncat(tmp, transform->name,
-			    PATH_MAX - strlen(SHIVA_T_SPLICE_EXTEND_ID));
-			tmp[sizeof(tmp) - 1] = '\0';
-
-			if (elf_symbol_by_name(&linker->elfobj, tmp,
-			    &tf_sym) == false) {
-				fprintf(stderr, "elf_symbol_by_name failed '%s'\n", tmp);
-				goto fail;
-			}
+			memcpy(&tf_sym, &transform->source_symbol, sizeof(tf_sym));
 			if (elf_section_by_index(&linker->elfobj, tf_sym.shndx,
 			    &shdr) == false) {
 				fprintf(stderr, "elf_section_by_index failed, invalid index %d\n",
@@ -2673,9 +4175,59 @@ validate_transformations(struct shiva_ctx *ctx, struct shiva_module *linker)
 			shiva_debug("flags:\t%#lx\n", transform->flags);
 			shiva_debug("transform symbol: %s\n", transform->source_symbol.name);
 			shiva_debug("target symbol: %s\n", transform->target_symbol.name);
+			break;
+		case SHIVA_TRANSFORM_EMIT_BYTECODE:
+			/*
+			 * The inputs of __shiva_emit_n<N>_code_<func_name> are
+			 * __shiva_emit_n<N>_offset_<func_name> and
+			 * __shiva_emit_n<N>_len_<func_name>. The branch sites
+			 * are only needed to check that nothing branches into
+			 * the code that is replaced.
+			 */
+			if (get_tf_function_refs(ctx, linker, transform) == false) {
+				fprintf(stderr, "Failed to gather xref and branch data from %s\n",
+				    transform->name);
+				return false;
+			}
+			prefix_len = strstr(transform->source_symbol.name, "_code_") -
+			    transform->source_symbol.name;
+			snprintf(tmp, sizeof(tmp), "%.*s_offset_%s", (int)prefix_len,
+			    transform->source_symbol.name, transform->name);
+			if (read_transform_input(linker, tmp, &transform->offset) == false)
+				goto fail;
+			snprintf(tmp, sizeof(tmp), "%.*s_len_%s", (int)prefix_len,
+			    transform->source_symbol.name, transform->name);
+			if (read_transform_input(linker, tmp, &transform->old_len) == false)
+				goto fail;
+			transform->new_len = transform->source_symbol.size;
+			if (transform->new_len == transform->old_len) {
+				transform->flags |= SHIVA_TRANSFORM_F_REPLACE;
+			} else if (transform->new_len < transform->old_len) {
+				transform->flags |= SHIVA_TRANSFORM_F_NOP_PAD;
+			} else {
+				transform->flags |= SHIVA_TRANSFORM_F_EXTEND;
+			}
+			if (elf_section_by_index(&linker->elfobj, transform->source_symbol.shndx,
+			    &shdr) == false) {
+				fprintf(stderr, "elf_section_by_index failed, invalid index %d\n",
+				    transform->source_symbol.shndx);
+				goto fail;
+			}
+			assert((transform->ptr = elf_offset_pointer(&linker->elfobj,
+			    shdr.offset + transform->source_symbol.value)) != NULL);
+			shiva_debug("Emit %s into %s: offset %#lx old_len %#lx new_len %#lx\n",
+			    transform->source_symbol.name, transform->name, transform->offset,
+			    transform->old_len, transform->new_len);
+			break;
+		default:
+			break;
 		}
 	}
 	if (TAILQ_EMPTY(&linker->tailq.transform_list) == 0) {
+		if (shiva_tf_plan_splices(linker) == false) {
+			fprintf(stderr, "shiva_tf_plan_splices() failed\n");
+			return false;
+		}
 		/*
 		 * We have a transform entry in the list, so
 		 * set the appropriate module/linker flag.
@@ -2687,7 +4239,6 @@ validate_transformations(struct shiva_ctx *ctx, struct shiva_module *linker)
 	return true;
 
 fail:
-	free(transform);
 	return false;
 }
 /*
@@ -2711,29 +4262,204 @@ set_linker_mode(struct shiva_module *linker)
 	}
 	return;
 }
+
+/*
+ * SHIVA_MODULE_GC=0 maps every SHF_ALLOC section of a module, as Shiva
+ * always used to.
+ */
+static bool
+module_gc_enabled(void)
+{
+	char *env = getenv("SHIVA_MODULE_GC");
+
+	return env == NULL || strcmp(env, "0") != 0;
+}
+
+struct module_gc_edge {
+	uint32_t from;
+	uint32_t to;
+};
+
+static int
+module_gc_edge_cmp(const void *a, const void *b)
+{
+	const struct module_gc_edge *x = a, *y = b;
+
+	return (x->from > y->from) - (x->from < y->from);
+}
+
+/*
+ * The section index of symname, a section or a symbol defined within
+ * the module, or 0.
+ */
+static uint32_t
+module_gc_section_of(struct shiva_module *linker, const char *symname)
+{
+	struct elf_symbol symbol;
+	uint8_t *live;
+
+	if (symname == NULL || symname[0] == '\0')
+		return 0;
+	live = shiva_htab_find(&linker->cache.gc, symname);
+	if (live != NULL)
+		return live - linker->gc.live;
+	if (elf_symbol_by_name(&linker->elfobj, symname, &symbol) == false ||
+	    symbol.shndx == SHN_UNDEF || symbol.shndx >= SHN_LORESERVE ||
+	    symbol.shndx >= elf_section_count(&linker->elfobj))
+		return 0;
+	return symbol.shndx;
+}
+
+static inline void
+module_gc_mark(struct shiva_module *linker, uint32_t shndx, uint32_t *stack, size_t *depth)
+{
+	if (shndx == 0 || linker->gc.live[shndx] != 0)
+		return;
+	linker->gc.live[shndx] = 1;
+	stack[(*depth)++] = shndx;
+	return;
+}
+
+/*
+ * Leave out the SHF_ALLOC sections of the module that nothing which
+ * runs can reach, as ld --gc-sections would. The graph is that of the
+ * relocations between sections, and its roots are the sections of the
+ * patch functions and objects that replace a symbol of the target (Or
+ * the variant of one that was picked), the transforms, shakti_main,
+ * .text (Patch functions are addressed from the start of the text
+ * image, see patch_link_call_vaddr), the .shiva.* records, the .bss
+ * and .gcc_except_table. .eh_frame is kept, but holds no section, the
+ * FDEs of the sections that are left out are discarded as it is
+ * relocated (See shiva_eh_frame_discard). Runs before the segments are
+ * sized, every pass that follows skips the sections and relocations
+ * that module_section_dead() reports.
+ */
+static bool
+module_gc_sections(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	struct elf_relocation_iterator rel_iter;
+	struct elf_relocation rel;
+	struct elf_section section;
+	struct shiva_transform *transform;
+	struct shiva_module_link *link;
+	struct module_gc_edge *edges;
+	struct elf_symbol symbol;
+	size_t count, rel_count = 0, edge_count = 0, depth = 0, i, lo, hi, dead_size = 0;
+	uint32_t *stack, *first, shndx;
+
+	if (module_gc_enabled() == false)
+		return true;
+	count = elf_section_count(&linker->elfobj);
+	linker->gc.live = shiva_arena_alloc(&ctx->arena.module, count);
+	memset(linker->gc.live, 0, count);
+	shiva_htab_init(&linker->cache.gc, count);
+	for (i = 1; i < count; i++) {
+		if (elf_section_by_index(&linker->elfobj, i, &section) == false)
+			continue;
+		(void) shiva_htab_insert(&linker->cache.gc, section.name, &linker->gc.live[i]);
+		/*
+		 * Sections that aren't mapped, and .eh_frame, never hold
+		 * another section.
+		 */
+		if ((section.flags & SHF_ALLOC) == 0 || strcmp(section.name, ".eh_frame") == 0)
+			linker->gc.live[i] = 2;
+	}
+	elf_relocation_iterator_init(&linker->elfobj, &rel_iter);
+	while (elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK)
+		rel_count++;
+	edges = shiva_malloc((rel_count + 1) * sizeof(*edges));
+	elf_relocation_iterator_init(&linker->elfobj, &rel_iter);
+	while (elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK) {
+		edges[edge_count].from = module_gc_section_of(linker, module_rel_section(&rel));
+		edges[edge_count].to = module_gc_section_of(linker, rel.symname);
+		if (edges[edge_count].from != 0 && edges[edge_count].to != 0 &&
+		    edges[edge_count].from != edges[edge_count].to)
+			edge_count++;
+	}
+	qsort(edges, edge_count, sizeof(*edges), module_gc_edge_cmp);
+	first = shiva_malloc((count + 1) * sizeof(*first));
+	for (i = 0, shndx = 0; shndx <= count; shndx++) {
+		while (i < edge_count && edges[i].from < shndx)
+			i++;
+		first[shndx] = i;
+	}
+	stack = shiva_malloc(count * sizeof(*stack));
+
+	for (i = 1; i < count; i++) {
+		if (elf_section_by_index(&linker->elfobj, i, &section) == false)
+			continue;
+		if (strcmp(section.name, ".text") == 0 || strcmp(section.name, ".bss") == 0 ||
+		    strncmp(section.name, ".shiva", 6) == 0 ||
+		    strncmp(section.name, ".gcc_except_table", 17) == 0)
+			module_gc_mark(linker, i, stack, &depth);
+	}
+	module_gc_mark(linker, module_gc_section_of(linker, "shakti_main"), stack, &depth);
+	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage)
+		module_gc_mark(linker, module_gc_section_of(linker,
+		    transform->source_symbol.name), stack, &depth);
+	for (i = 0; i < linker->links.count; i++) {
+		link = &linker->links.vec[i];
+		if (link->target_vaddr == 0 && link->transform == NULL)
+			continue;
+		if (link->flags & SHIVA_MODULE_LINK_F_CALL)
+			module_gc_mark(linker, module_gc_section_of(linker,
+			    link->call_symbol.name), stack, &depth);
+		if (link->flags & SHIVA_MODULE_LINK_F_XREF)
+			module_gc_mark(linker, module_gc_section_of(linker,
+			    link->xref_symbol.name), stack, &depth);
+		if (patch_variant_symbol(linker, link->name, &symbol) == true)
+			module_gc_mark(linker, module_gc_section_of(linker, symbol.name),
+			    stack, &depth);
+	}
+	while (depth > 0) {
+		shndx = stack[--depth];
+		for (lo = first[shndx], hi = first[shndx + 1]; lo < hi; lo++)
+			module_gc_mark(linker, edges[lo].to, stack, &depth);
+	}
+
+	for (i = 1; i < count; i++) {
+		if (linker->gc.live[i] != 0 ||
+		    elf_section_by_index(&linker->elfobj, i, &section) == false ||
+		    section.size == 0)
+			continue;
+		shiva_debug("Section %s (%zu bytes) is unreachable, not mapping it\n",
+		    section.name, section.size);
+		linker->gc.dead++;
+		dead_size += section.size;
+	}
+	if (linker->gc.dead > 0)
+		shiva_debug("%zu sections (%zu bytes) of '%s' are left out\n",
+		    linker->gc.dead, dead_size, elf_pathname(&linker->elfobj));
+	free(stack);
+	free(first);
+	free(edges);
+	return true;
+}
 static bool
 apply_memory_protection(struct shiva_module *linker)
 {
-	if (mprotect(linker->text_mem,
-	    ELF_PAGEALIGN(linker->text_size, PAGE_SIZE),
+	if (mprotect(linker->text_mem, module_text_map_size(linker),
 	    PROT_READ|PROT_EXEC) < 0) {
 		perror("mprotect");
 		return false;
 	}
+	SHIVA_STATS_ADD(linker->ctx, SHIVA_STATS_MPROTECT_PAGES,
+	    module_text_map_size(linker) / PAGE_SIZE);
 	return true;
 }
 
 /*
- * NOTE: const char *path: path to the ELF module
+ * Open the module at path and size up its segments. path is the ELF
+ * module (I.E. modules/shakti_runtime.o)
  */
-bool
-shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module **linkerptr, uint64_t flags)
+static bool
+module_prepare(struct shiva_ctx *ctx, const char *path, struct shiva_module **linkerptr,
+    uint64_t flags)
 {
 	struct shiva_module *linker;
 	elf_error_t error;
 	bool res;
-	uint64_t entry;
-	char *shiva_path;
+	shiva_stats_mark_t t0;
 
 	linker = malloc(sizeof(struct shiva_module));
 	if (linker == NULL) {
@@ -2741,6 +4467,7 @@ shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module
 		return false;
 	}
 	memset(linker, 0, sizeof(*linker));
+	shiva_module_cache_init(linker);
 	linker->target_elfobj = &ctx->elfobj;
 	linker->flags = flags;
 	linker->shiva_base = ctx->shiva.base;
@@ -2761,25 +4488,21 @@ shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module
 	/*
 	 * Open the module ELF object (I.E. modules/shakti_runtime.o)
 	 */
+	t0 = SHIVA_STATS_START(ctx);
 	res = elf_open_object(path, &linker->elfobj,
 	    ELF_LOAD_F_STRICT, &error);
 	if (res == false) {
 		shiva_debug("elf_open_object(%s, ...) failed\n", path);
 		return false;
 	}
+	if (shiva_module_index_verify(ctx, path, &linker->elfobj) == false)
+		return false;
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_ELF_OPEN, t0);
+	shiva_htab_init(&linker->cache.sections, elf_section_count(&linker->elfobj) + 1);
 	/*
-	 * Open our self (The debugger/interpreter) ELF object.
+	 * Our self (The debugger/interpreter) ELF object is opened by
+	 * module_self() if a symbol of the Shiva API is needed.
 	 */
-	shiva_path = (ctx->flags & SHIVA_OPTS_F_INTERP_MODE) ?
-	    elf_interpreter_path(&ctx->elfobj) : "/proc/self/exe";
-
-	if (elf_open_object(shiva_path, &linker->self, ELF_LOAD_F_STRICT,
-	    &error) == false) {
-		shiva_debug("elf_open_object(%s, ...) failed: %s\n",
-		    "/proc/self/exe", elf_error_msg(&error));
-		return false;
-	}
-	memcpy(&ctx->shiva_elfobj, &linker->self, sizeof(elfobj_t));
 
 	set_linker_mode(linker);
 	switch(linker->mode) {
@@ -2793,6 +4516,14 @@ shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module
 		shiva_debug("Unknown linking mode, quitting\n");
 		return false;
 	}
+	/*
+	 * Everything up to here may overlap with SHIVA_ANALYZE_ASYNC,
+	 * the transforms need the sites of the functions they splice.
+	 */
+	if (shiva_analyze_wait(ctx) == false) {
+		fprintf(stderr, "Failed to run the analyzers\n");
+		return false;
+	}
 	if (validate_transformations(ctx, linker) == false) {
 		fprintf(stderr, "Failed to validate transformations\n");
 		return false;
@@ -2801,6 +4532,24 @@ shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module
 		fprintf(stderr, "Failed to validate helpers\n");
 		return false;
 	}
+	if (validate_variants(ctx, linker) == false) {
+		fprintf(stderr, "Failed to validate variants\n");
+		return false;
+	}
+	/*
+	 * The patch links are the roots of module_gc_sections(), and tell
+	 * shiva_module_numa_replicate() how many veneers to make.
+	 */
+	t0 = SHIVA_STATS_START(ctx);
+	if (linker->mode == SHIVA_LINKING_MICROCODE_PATCH &&
+	    build_patch_link_index(ctx, linker) == false) {
+		fprintf(stderr, "build_patch_link_index() failed\n");
+		return false;
+	}
+	if (module_gc_sections(ctx, linker) == false) {
+		fprintf(stderr, "Failed to find the unreachable sections of '%s'\n", path);
+		return false;
+	}
 	if (calculate_text_size(linker) == false) {
 		shiva_debug("Failed to calculate .text size for parasite module\n");
 		return false;
@@ -2809,6 +4558,67 @@ shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module
 		shiva_debug("Failed to calculate .data size for parasite module\n");
 		return false;
 	}
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_LAYOUT, t0);
+	return true;
+}
+
+/*
+ * Map the text and data segments of a module that isn't already packed
+ * into an image (See shiva_module_load_list) with a single mmap. The
+ * text is followed directly by the data, so the whole module spans one
+ * VMA until apply_memory_protection() splits it in two.
+ */
+static bool
+module_map_image(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	uint64_t mmap_base, mmap_flags;
+	size_t total;
+	uint8_t *image;
+
+	if (module_hugepages() == true)
+		linker->text_map_size = ELF_PAGEALIGN(linker->text_size, SHIVA_HUGEPAGE_SIZE);
+	total = module_text_map_size(linker) + module_data_size_aligned(linker);
+	module_image_base(ctx, linker, total, &mmap_base, &mmap_flags);
+	if (module_hugepages() == true)
+		image = module_map_huge(mmap_base, total, PROT_READ|PROT_WRITE|PROT_EXEC,
+		    mmap_flags);
+	else
+		image = mmap((void *)mmap_base, total, PROT_READ|PROT_WRITE|PROT_EXEC,
+		    mmap_flags, -1, 0);
+	if (image == MAP_FAILED) {
+		shiva_debug("mmap failed: %s\n", strerror(errno));
+		linker->text_map_size = 0;
+		return false;
+	}
+	if (module_hugepages() == true)
+		module_prefault_text(image, module_text_map_size(linker));
+	linker->flags |= SHIVA_MODULE_F_PACKED;
+	linker->text_mem = image;
+	linker->data_mem = image + module_text_map_size(linker);
+	if (mprotect(linker->data_mem, module_data_size_aligned(linker),
+	    PROT_READ|PROT_WRITE) < 0) {
+		perror("mprotect");
+		return false;
+	}
+	shiva_debug("Module image for '%s' at %p (%zu bytes)\n",
+	    elf_pathname(&linker->elfobj), image, total);
+	return true;
+}
+
+/*
+ * Build the segments of a prepared module and relocate them.
+ */
+static bool
+module_link(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	shiva_stats_mark_t t0;
+
+	t0 = SHIVA_STATS_START(ctx);
+	if ((linker->flags & SHIVA_MODULE_F_PACKED) == 0 &&
+	    module_map_image(ctx, linker) == false) {
+		shiva_debug("Failed to map module image\n");
+		return false;
+	}
 	if (create_text_image(ctx, linker) == false) {
 		shiva_debug("Failed to create text segment\n");
 		return false;
@@ -2817,10 +4627,14 @@ shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module
 		shiva_debug("Failed to create data segment\n");
 		return false;
 	}
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_IMAGE, t0);
+	t0 = SHIVA_STATS_START(ctx);
 	if (relocate_module(linker) == false) {
 		shiva_debug("Failed to relocate module\n");
 		return false;
 	}
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_RELOCATE, t0);
+	t0 = SHIVA_STATS_START(ctx);
 	if (patch_plt_stubs(linker) == false) {
 		shiva_debug("Failed to patch PLT stubs\n");
 		return false;
@@ -2829,12 +4643,56 @@ shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module
 		shiva_debug("Failed to resolve PLTGOT entries\n");
 		return false;
 	}
-	if ((linker->flags & SHIVA_MODULE_F_DELAYED_RELOCS) == 0) {
-		if (apply_memory_protection(linker) == false) {
-			shiva_debug("Failed to apply module segment memory protection\n");
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_PLTGOT, t0);
+	if (shiva_module_lazy_seal(linker) == false) {
+		shiva_debug("Failed to seal lazy binding stubs\n");
+		return false;
+	}
+#if __aarch64__
+	relax_module_calls(linker);
+#endif
+	if (linker->flags & SHIVA_MODULE_F_LIVE) {
+		if (shiva_post_linker_resolve(ctx, linker) == false) {
+			shiva_debug("Failed to resolve delayed relocations\n");
 			return false;
 		}
+		__builtin___clear_cache((char *)linker->text_mem,
+		    (char *)linker->text_mem + linker->text_size);
+	}
+	if (shiva_module_numa_replicate(linker, module_text_map_size(linker)) == false) {
+		shiva_debug("Failed to replicate module text\n");
+		return false;
+	}
+	if ((linker->flags & SHIVA_MODULE_F_LIVE) &&
+	    shiva_module_numa_sync(ctx, linker) == false) {
+		shiva_debug("Failed to steer calls to the module text replicas\n");
+		return false;
 	}
+	if (apply_memory_protection(linker) == false) {
+		shiva_debug("Failed to apply module segment memory protection\n");
+		return false;
+	}
+	if (shiva_eh_frame_seal(linker) == false) {
+		shiva_debug("Failed to register module unwind info\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * NOTE: const char *path: path to the ELF module
+ */
+bool
+shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module **linkerptr, uint64_t flags)
+{
+	struct shiva_module *linker;
+	uint64_t entry;
+
+	if (module_prepare(ctx, path, linkerptr, flags) == false)
+		return false;
+	linker = *linkerptr;
+	if (module_link(ctx, linker) == false)
+		return false;
 
 	/*
 	 * If we are linking a Shiva module, then we pass control to the
@@ -2845,11 +4703,13 @@ shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module
 	 */
 	if (linker->mode == SHIVA_LINKING_MICROCODE_PATCH) {
 		shiva_debug("Finished relocating patch\n");
-		if (apply_external_patch_links(ctx, linker) == false) {
+		if (apply_external_patch_links(ctx, &linker, 1) == false) {
 			shiva_debug("Failed to apply patches to target executable: %s\n",
 			    elf_pathname(linker->target_elfobj));
 			return false;
 		}
+		(void) shiva_module_cache_store(ctx, linker, path);
+		(void) shiva_perf_map_write(linker, path);
 		return true;
 	}
 
@@ -2863,4 +4723,376 @@ shiva_module_loader(struct shiva_ctx *ctx, const char *path, struct shiva_module
 	return true;
 }
 
+/*
+ * Set ctx->module.paths from a ':' separated list of patch modules.
+ * Relative paths are taken to be relative to dir, if dir isn't NULL.
+ */
+bool
+shiva_module_set_paths(struct shiva_ctx *ctx, const char *dir, const char *list)
+{
+	char path[PATH_MAX], idir[PATH_MAX], *name;
+	const char *p, *end;
+	uint64_t hash;
+	size_t len;
+	int n;
+
+	for (p = list; *p != '\0'; p = *end == ':' ? end + 1 : end) {
+		end = strchr(p, ':');
+		if (end == NULL)
+			end = p + strlen(p);
+		len = end - p;
+		if (len == 0)
+			continue;
+		if (dir != NULL && p[0] != '/')
+			n = snprintf(path, sizeof(path), "%s/%.*s", dir, (int)len, p);
+		else
+			n = snprintf(path, sizeof(path), "%.*s", (int)len, p);
+		if (n < 0 || (size_t)n >= sizeof(path)) {
+			fprintf(stderr, "module path len exceeds PATH_MAX - 1\n");
+			return false;
+		}
+		/*
+		 * If the directory of the module has an index, then it
+		 * decides where the module is, or that it is missing.
+		 */
+		hash = 0;
+		name = strrchr(path, '/');
+		if (name != NULL && name != path) {
+			snprintf(idir, sizeof(idir), "%.*s", (int)(name - path), path);
+			switch (shiva_module_index_lookup(ctx, idir, name + 1, path, &hash)) {
+			case SHIVA_MODULE_INDEX_MISS:
+				fprintf(stderr, "Patch module '%s' is not in the module index of %s\n",
+				    name + 1, idir);
+				return false;
+			case SHIVA_MODULE_INDEX_HIT:
+			case SHIVA_MODULE_INDEX_NONE:
+			default:
+				break;
+			}
+		}
+		ctx->module.paths = shiva_realloc(ctx->module.paths,
+		    (ctx->module.count + 1) * sizeof(char *));
+		ctx->module.hashes = shiva_realloc(ctx->module.hashes,
+		    (ctx->module.count + 1) * sizeof(uint64_t));
+		ctx->module.hashes[ctx->module.count] = hash;
+		ctx->module.paths[ctx->module.count++] =
+		    shiva_arena_strdup(&ctx->arena.module, path);
+		shiva_debug("Patch module %zu: %s\n", ctx->module.count - 1, path);
+	}
+	if (ctx->module.count == 0) {
+		fprintf(stderr, "No patch modules in '%s'\n", list);
+		return false;
+	}
+	strcpy(ctx->module_path, ctx->module.paths[0]);
+	return true;
+}
+
+/*
+ * Load every module in ctx->module.paths. A single module goes through
+ * shiva_module_loader() as always. A list of microcode patches is
+ * linked in one pass: every patch is sized up first, then the text and
+ * data segments of all of them are carved out of one contiguous mapping,
+ * and finally the target is linked to all of the patches within a single
+ * patch transaction. The patches share the analysis of the target.
+ */
+bool
+shiva_module_load_list(struct shiva_ctx *ctx, uint64_t flags)
+{
+	struct shiva_module **linkers;
+	struct shiva_module *linker;
+	uint64_t mmap_base, mmap_flags;
+	size_t i, total = 0, off = 0;
+	bool huge = module_hugepages();
+	uint8_t *image;
+
+	if (ctx->module.count == 1) {
+		if (shiva_module_loader(ctx, ctx->module.paths[0], &ctx->module.runtime,
+		    flags) == false)
+			return false;
+		TAILQ_INSERT_TAIL(&ctx->module.list, ctx->module.runtime, _linkage);
+		return true;
+	}
+
+	linkers = shiva_malloc(ctx->module.count * sizeof(*linkers));
+	for (i = 0; i < ctx->module.count; i++) {
+		if (module_prepare(ctx, ctx->module.paths[i], &linkers[i], flags) == false) {
+			fprintf(stderr, "Failed to load patch module '%s'\n",
+			    ctx->module.paths[i]);
+			goto fail;
+		}
+		if (linkers[i]->mode != SHIVA_LINKING_MICROCODE_PATCH) {
+			fprintf(stderr, "'%s' is a Shiva module and cannot be linked "
+			    "alongside other patches\n", ctx->module.paths[i]);
+			goto fail;
+		}
+		/*
+		 * Only a single patch is stored in the patch cache.
+		 */
+		linkers[i]->mcache.enabled = false;
+		/*
+		 * With huge pages each text starts on a huge page of its
+		 * own. The gaps are never touched.
+		 */
+		if (huge == true) {
+			total = ELF_PAGEALIGN(total, SHIVA_HUGEPAGE_SIZE);
+			linkers[i]->text_map_size =
+			    ELF_PAGEALIGN(linkers[i]->text_size, SHIVA_HUGEPAGE_SIZE);
+		}
+		total += module_text_map_size(linkers[i]) +
+		    module_data_size_aligned(linkers[i]);
+	}
+
+	module_image_base(ctx, linkers[0], total, &mmap_base, &mmap_flags);
+	if (huge == true)
+		image = module_map_huge(mmap_base, total, PROT_READ|PROT_WRITE|PROT_EXEC,
+		    mmap_flags);
+	else
+		image = mmap((void *)mmap_base, total, PROT_READ|PROT_WRITE|PROT_EXEC,
+		    mmap_flags, -1, 0);
+	if (image == MAP_FAILED) {
+		shiva_debug("mmap failed: %s\n", strerror(errno));
+		goto fail;
+	}
+	shiva_debug("Packed %zu patch modules into %p (%zu bytes)\n",
+	    ctx->module.count, image, total);
+	for (i = 0; i < ctx->module.count; i++) {
+		linker = linkers[i];
+		linker->flags |= SHIVA_MODULE_F_PACKED;
+		if (huge == true) {
+			off = ELF_PAGEALIGN(off, SHIVA_HUGEPAGE_SIZE);
+			module_prefault_text(&image[off], module_text_map_size(linker));
+		}
+		linker->text_mem = &image[off];
+		off += module_text_map_size(linker);
+		linker->data_mem = &image[off];
+		off += module_data_size_aligned(linker);
+		if (mprotect(linker->data_mem, module_data_size_aligned(linker),
+		    PROT_READ|PROT_WRITE) < 0) {
+			perror("mprotect");
+			goto fail;
+		}
+		if (module_link(ctx, linker) == false) {
+			fprintf(stderr, "Failed to link patch module '%s'\n",
+			    ctx->module.paths[i]);
+			goto fail;
+		}
+	}
+	if (apply_external_patch_links(ctx, linkers, ctx->module.count) == false) {
+		shiva_debug("Failed to apply patches to target executable: %s\n",
+		    elf_pathname(&ctx->elfobj));
+		goto fail;
+	}
+	for (i = 0; i < ctx->module.count; i++) {
+		(void) shiva_perf_map_write(linkers[i], ctx->module.paths[i]);
+		TAILQ_INSERT_TAIL(&ctx->module.list, linkers[i], _linkage);
+	}
+	ctx->module.runtime = linkers[0];
+	free(linkers);
+	return true;
+fail:
+	free(linkers);
+	return false;
+}
+
+/*
+ * Size up the branch island of a module, with one veneer for each adrp
+ * pair that install_aarch64_xref_patch() will relink, and room for the
+ * emits that don't fit in place.
+ */
+static bool
+module_island_size(struct shiva_ctx *ctx, struct shiva_module *linker, size_t *out)
+{
+	struct shiva_module_link *link;
+	shiva_xref_iterator_t xrefs;
+	struct shiva_xref_site *xe;
+	struct elf_symbol *symbol;
+	size_t count = 0;
 
+	*out = ELF_PAGEALIGN(shiva_tf_island_size(linker), PAGE_SIZE);
+	if ((linker->flags & SHIVA_MODULE_F_VENEERS) == 0)
+		return true;
+	if (build_patch_link_index(ctx, linker) == false) {
+		fprintf(stderr, "build_patch_link_index() failed\n");
+		return false;
+	}
+	shiva_xref_iterator_init(ctx, &xrefs);
+	while (shiva_xref_iterator_next(&xrefs, &xe) == SHIVA_ITER_OK) {
+		if (xe->type == SHIVA_XREF_TYPE_UNKNOWN || (xe->flags & SHIVA_XREF_F_INDIRECT))
+			continue;
+		symbol = shiva_analyze_symbol(ctx, xe->symbol);
+		if (patch_link_address(linker, symbol->value) == false)
+			continue;
+		link = lookup_patch_link(linker, symbol->name);
+		if (link != NULL && (link->flags & SHIVA_MODULE_LINK_F_XREF))
+			count++;
+	}
+	*out = ELF_PAGEALIGN(count * SHIVA_VENEER_SIZE + shiva_tf_island_size(linker),
+	    PAGE_SIZE);
+	shiva_debug("Branch island for %zu veneers: %zu bytes\n", count, *out);
+	return true;
+}
+
+/*
+ * Link the microcode patch at path into a target that is already
+ * running, see shiva_live.c. The segments, and the branch island when
+ * flags has SHIVA_MODULE_F_VENEERS, are carved out of a single mapping
+ * placed within [lo, hi) so that every call26 site of the target can
+ * reach the patch. The relinked instructions of the target are only
+ * queued into txn for the caller to commit.
+ */
+bool
+shiva_module_live_link(struct shiva_ctx *ctx, const char *path, uint64_t flags,
+    uint64_t lo, uint64_t hi, struct shiva_module **linkerptr, struct shiva_patch_txn *txn)
+{
+	struct shiva_module *linker;
+	uint64_t base;
+	size_t total, island_size;
+	uint8_t *image;
+
+	flags |= SHIVA_MODULE_F_RUNTIME|SHIVA_MODULE_F_LIVE;
+	if (module_prepare(ctx, path, linkerptr, flags) == false) {
+		fprintf(stderr, "Failed to load patch module '%s'\n", path);
+		return false;
+	}
+	linker = *linkerptr;
+	if (linker->mode != SHIVA_LINKING_MICROCODE_PATCH) {
+		fprintf(stderr, "'%s' is a Shiva module and cannot be linked into a "
+		    "running target\n", path);
+		return false;
+	}
+	linker->mcache.enabled = false;
+	if (module_island_size(ctx, linker, &island_size) == false)
+		return false;
+	total = ELF_PAGEALIGN(linker->text_size, PAGE_SIZE) + island_size +
+	    module_data_size_aligned(linker);
+	if (shiva_maps_find_gap(ctx, lo, hi, total, &base) == false) {
+		fprintf(stderr, "No room for '%s' (%zu bytes) within branch range of the "
+		    "target\n", path, total);
+		return false;
+	}
+	/*
+	 * MAP_FIXED_NOREPLACE since another thread of the target may have
+	 * mapped something into the gap after the maps were read. Older
+	 * kernels treat it as a hint, so the result is checked either way.
+	 */
+	image = mmap((void *)base, total, PROT_READ|PROT_WRITE|PROT_EXEC,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+	if (image == MAP_FAILED) {
+		shiva_debug("mmap failed: %s\n", strerror(errno));
+		return false;
+	}
+	if ((uint64_t)image != base) {
+		fprintf(stderr, "Unable to map '%s' at %#lx\n", path, base);
+		munmap(image, total);
+		return false;
+	}
+	shiva_debug("Live patch image for '%s' at %p (%zu bytes)\n", path, image, total);
+	linker->flags |= SHIVA_MODULE_F_PACKED;
+	linker->text_mem = image;
+	linker->island.mem = image + ELF_PAGEALIGN(linker->text_size, PAGE_SIZE);
+	linker->island.size = island_size;
+	linker->data_mem = linker->island.mem + island_size;
+	if (mprotect(linker->data_mem, module_data_size_aligned(linker),
+	    PROT_READ|PROT_WRITE) < 0) {
+		perror("mprotect");
+		goto fail;
+	}
+	if (module_link(ctx, linker) == false) {
+		fprintf(stderr, "Failed to link patch module '%s'\n", path);
+		goto fail;
+	}
+	if (queue_external_patch_links(ctx, linker, txn) == false) {
+		shiva_debug("Failed to link the target to '%s'\n", path);
+		goto fail;
+	}
+	/*
+	 * Nothing branches to the veneers until txn is committed.
+	 */
+	if (module_island_seal(linker) == false ||
+	    shiva_module_numa_seal(linker) == false)
+		goto fail;
+	(void) shiva_perf_map_write(linker, path);
+	return true;
+fail:
+	munmap(image, total);
+	return false;
+}
+
+/*
+ * The address ranges of a patch linked by shiva_module_live_link(),
+ * as up to max [lo, hi) pairs: its image, and the NUMA veneers and
+ * replicas of its text. Returns the number of pairs.
+ */
+size_t
+shiva_module_live_ranges(struct shiva_module *linker, uint64_t (*ranges)[2], size_t max)
+{
+	size_t i, count = 0;
+
+	if (count < max) {
+		ranges[count][0] = (uint64_t)linker->text_mem;
+		ranges[count++][1] = (uint64_t)linker->text_mem +
+		    ELF_PAGEALIGN(linker->text_size, PAGE_SIZE) + linker->island.size +
+		    module_data_size_aligned(linker);
+	}
+	if (linker->numa.veneers != NULL && count < max) {
+		ranges[count][0] = (uint64_t)linker->numa.veneers;
+		ranges[count++][1] = (uint64_t)linker->numa.veneers + linker->numa.veneers_size;
+	}
+	for (i = 0; i < linker->numa.count && count < max; i++) {
+		ranges[count][0] = (uint64_t)linker->numa.vec[i].mem;
+		ranges[count++][1] = (uint64_t)linker->numa.vec[i].mem +
+		    module_text_map_size(linker);
+	}
+	return count;
+}
+
+/*
+ * Free the hash tables that are only looked up while the module is
+ * linked, once control is about to be passed to LDSO (See
+ * shiva_mem_release). They are not rebuilt: a live patch is linked with
+ * a linker of its own (See shiva_module_live_link), and lazy binding
+ * looks functions up in the link_map of the target (See
+ * shiva_module_lazy.c), so neither finds anything in them. The section
+ * and link tables are kept since the post linker and the trace API
+ * still use them. Returns the bytes freed.
+ */
+size_t
+shiva_module_release_caches(struct shiva_module *linker)
+{
+	struct shiva_htab *caches[] = {
+		&linker->cache.bss, &linker->cache.got, &linker->cache.helpers,
+		&linker->cache.variants, &linker->cache.symres, &linker->cache.gc
+	};
+	size_t i, bytes = 0;
+
+	for (i = 0; i < sizeof(caches) / sizeof(caches[0]); i++) {
+		bytes += caches[i]->size * sizeof(struct shiva_htab_entry);
+		shiva_htab_destroy(caches[i]);
+	}
+	return bytes;
+}
+
+/*
+ * Reclaim a patch linked by shiva_module_live_link() that nothing can
+ * run anymore, see shiva_live.c. The linker itself lives on in the
+ * module arena.
+ */
+void
+shiva_module_live_unlink(struct shiva_module *linker)
+{
+	uint64_t ranges[SHIVA_NUMA_MAX_NODES + 2][2];
+	size_t i, count;
+
+	shiva_eh_frame_deregister(linker->ctx, linker);
+	count = shiva_module_live_ranges(linker, ranges, SHIVA_NUMA_MAX_NODES + 2);
+	for (i = 0; i < count; i++) {
+		shiva_debug("Unmapping %#lx - %#lx of live patch '%s'\n", ranges[i][0],
+		    ranges[i][1], elf_pathname(&linker->elfobj));
+		munmap((void *)ranges[i][0], ranges[i][1] - ranges[i][0]);
+	}
+	linker->text_mem = linker->data_mem = linker->island.mem = NULL;
+	linker->numa.veneers = NULL;
+	linker->numa.count = 0;
+	elf_close_object(&linker->elfobj);
+	return;
+}
@@ -0,0 +1,1030 @@
+/*
+ * shiva_module_cache.c - On-disk cache of relocated patch images.
+ *
+ * Loading a microcode patch means analyzing the target, relocating the
+ * patch object, resolving its PLT/GOT and rewriting the target. For a
+ * given (target, patch, Shiva) triple the result is always the same,
+ * except for the base address that the kernel picked for the target.
+ * When SHIVA_MODULE_CACHE is set to a directory, the final text and
+ * data images of the patch, and every write that was made into the
+ * target, are stored there after a successful link. On the next launch
+ * the images are mapped straight from the cache file at the same offset
+ * from the new target base. Only absolute 64bit values that depend on
+ * the base need to be adjusted; everything else in the images, and all
+ * of the target writes, are PC-relative and therefore position
+ * independent.
+ *
+ * shiva-ld --static_link can also embed an image into the executable
+ * itself (SHIVA_MODULE_IMAGE names the file to store it in), so that a
+ * patch which is fixed at deploy time is never linked at runtime. The
+ * shared library symbols of an embedded image are resolved by name
+ * once LDSO is done, since the libraries of the machine it runs on
+ * need not be the ones it was linked against.
+ *
+ * The text of an image is mapped read-only straight from the file
+ * whenever none of its fixups need to change, so every process that
+ * runs the patched target shares the same page cache pages for it. With
+ * SHIVA_MODULE_CACHE_SHARED=1 a text image that must be rebased is
+ * written once per target base into the cache directory (See
+ * mcache_text_variant()), and shared in the same way by every process
+ * that later loads the target at that base.
+ *
+ * The image layout is described in shiva_prelink.h
+ */
+#include "shiva.h"
+
+static const char *
+shiva_module_cache_dir(void)
+{
+	char *dir = getenv("SHIVA_MODULE_CACHE");
+
+	return (dir == NULL || dir[0] == '\0') ? NULL : dir;
+}
+
+static const char *
+shiva_module_image_path(void)
+{
+	char *path = getenv("SHIVA_MODULE_IMAGE");
+
+	return (path == NULL || path[0] == '\0') ? NULL : path;
+}
+
+/*
+ * Rebased text variants are only useful where the target base repeats,
+ * i.e. ET_EXEC targets, ulexec mode or hosts without ASLR, otherwise
+ * every run would leave one behind.
+ */
+static bool
+shiva_module_cache_shared(void)
+{
+	char *s = getenv("SHIVA_MODULE_CACHE_SHARED");
+
+	return s != NULL && atoi(s) != 0 && shiva_module_cache_dir() != NULL;
+}
+
+static inline uint64_t
+mcache_hash(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= SHIVA_PRELINK_FNV_PRIME;
+	}
+	return hash;
+}
+
+/*
+ * The key covers everything that the relocated images and the target
+ * writes are derived from: the target (By the same key that the prelink
+ * tables use), the contents of the patch object, the Shiva binary that
+ * is linking it, the mode that Shiva is running in and how calls are
+ * redirected to the patch (SHIVA_PATCH_REDIRECT).
+ */
+static bool
+shiva_module_cache_key(struct shiva_ctx *ctx, const char *path, uint64_t *key)
+{
+	struct shiva_prelink_table_hdr thdr;
+	struct stat st;
+	uint64_t hash = SHIVA_PRELINK_FNV_OFFSET;
+	uint64_t interp, module_hash;
+	void *mem;
+	int fd, redirect;
+
+	hash = mcache_hash(hash, "shiva-mcache", sizeof("shiva-mcache"));
+	memset(&thdr, 0, sizeof(thdr));
+	if (shiva_prelink_target_key(&ctx->elfobj, &thdr) == false)
+		return false;
+	hash = mcache_hash(hash, &thdr.key_type, sizeof(thdr.key_type));
+	hash = mcache_hash(hash, thdr.key, thdr.key_len);
+	hash = mcache_hash(hash, &thdr.text_vaddr, sizeof(thdr.text_vaddr));
+	hash = mcache_hash(hash, &thdr.text_size, sizeof(thdr.text_size));
+
+	/*
+	 * The module index already knows the hash of the contents of the
+	 * patch, shiva_module_index_verify() checks it when it is linked.
+	 */
+	if (shiva_module_index_get_hash(ctx, path, &module_hash) == true) {
+		hash = mcache_hash(hash, &module_hash, sizeof(module_hash));
+	} else {
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		if (fstat(fd, &st) < 0 || st.st_size == 0) {
+			close(fd);
+			return false;
+		}
+		mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED)
+			return false;
+		hash = mcache_hash(hash, mem, st.st_size);
+		munmap(mem, st.st_size);
+	}
+
+	if (stat("/proc/self/exe", &st) < 0)
+		return false;
+	hash = mcache_hash(hash, &st.st_dev, sizeof(st.st_dev));
+	hash = mcache_hash(hash, &st.st_ino, sizeof(st.st_ino));
+	hash = mcache_hash(hash, &st.st_size, sizeof(st.st_size));
+	hash = mcache_hash(hash, &st.st_mtime, sizeof(st.st_mtime));
+
+	interp = ctx->flags & SHIVA_OPTS_F_INTERP_MODE;
+	hash = mcache_hash(hash, &interp, sizeof(interp));
+	redirect = shiva_module_redirect_mode();
+	hash = mcache_hash(hash, &redirect, sizeof(redirect));
+	*key = hash;
+	return true;
+}
+
+/*
+ * The key of an embedded image. The patch object is not part of it, it
+ * may not even be installed, and neither is the Shiva binary on disk
+ * since a fleet has it under a different inode on every machine. The
+ * image can only be trusted by the Shiva build that produced it though,
+ * which the build time and the address of this function stand in for
+ * (Shiva is an ET_EXEC).
+ */
+static bool
+shiva_module_image_key(struct shiva_ctx *ctx, uint64_t *key)
+{
+	struct shiva_prelink_table_hdr thdr;
+	static const char build[] = __DATE__ " " __TIME__;
+	uint64_t hash = SHIVA_PRELINK_FNV_OFFSET;
+	uint64_t interp, self = (uint64_t)&shiva_module_image_key;
+	int redirect;
+
+	hash = mcache_hash(hash, "shiva-mimage", sizeof("shiva-mimage"));
+	memset(&thdr, 0, sizeof(thdr));
+	if (shiva_prelink_target_key(&ctx->elfobj, &thdr) == false)
+		return false;
+	hash = mcache_hash(hash, &thdr.key_type, sizeof(thdr.key_type));
+	hash = mcache_hash(hash, thdr.key, thdr.key_len);
+	hash = mcache_hash(hash, &thdr.text_vaddr, sizeof(thdr.text_vaddr));
+	hash = mcache_hash(hash, &thdr.text_size, sizeof(thdr.text_size));
+	hash = mcache_hash(hash, build, sizeof(build));
+	hash = mcache_hash(hash, &self, sizeof(self));
+	interp = ctx->flags & SHIVA_OPTS_F_INTERP_MODE;
+	hash = mcache_hash(hash, &interp, sizeof(interp));
+	redirect = shiva_module_redirect_mode();
+	hash = mcache_hash(hash, &redirect, sizeof(redirect));
+	*key = hash;
+	return true;
+}
+
+static void
+shiva_module_cache_path(const char *dir, uint64_t key, char *out)
+{
+	snprintf(out, PATH_MAX, "%s/%016lx.shc", dir, key);
+	return;
+}
+
+/*
+ * Called by shiva_module_loader() before the patch is linked. Recording
+ * is only enabled when there is a cache directory to store into.
+ */
+void
+shiva_module_cache_init(struct shiva_module *linker)
+{
+	memset(&linker->mcache, 0, sizeof(linker->mcache));
+	linker->mcache.enabled = shiva_module_cache_dir() != NULL ||
+	    shiva_module_image_path() != NULL;
+	return;
+}
+
+/*
+ * Mark the link as uncacheable, i.e. it resolved a value that can't be
+ * recomputed by a relocation against the target base.
+ */
+void
+shiva_module_cache_invalidate(struct shiva_module *linker, const char *reason)
+{
+	if (linker->mcache.enabled == false || linker->mcache.uncacheable == true)
+		return;
+	shiva_debug("Patch is not cacheable: %s\n", reason);
+	linker->mcache.uncacheable = true;
+	return;
+}
+
+/*
+ * Record an absolute 64bit value within the text or data image of the
+ * patch that depends on the base address of the target, or on the
+ * address of the images themselves.
+ */
+void
+shiva_module_cache_note_abs(struct shiva_module *linker, void *slot)
+{
+	if (linker->mcache.enabled == false || linker->mcache.uncacheable == true)
+		return;
+	if (linker->mcache.fixup_count == linker->mcache.fixup_size) {
+		linker->mcache.fixup_size = linker->mcache.fixup_size == 0 ? 64 :
+		    linker->mcache.fixup_size << 1;
+		linker->mcache.fixups = shiva_realloc(linker->mcache.fixups,
+		    linker->mcache.fixup_size * sizeof(uint64_t));
+	}
+	linker->mcache.fixups[linker->mcache.fixup_count++] = (uint64_t)slot;
+	return;
+}
+
+/*
+ * Record a write into the target so that it can be replayed.
+ */
+void
+shiva_module_cache_note_write(struct shiva_module *linker, uint64_t addr,
+    const void *src, size_t len)
+{
+	struct shiva_patch_write *w;
+
+	if (linker->mcache.enabled == false || linker->mcache.uncacheable == true)
+		return;
+	if (len == 0 || len > SHIVA_PATCH_WRITE_MAX) {
+		shiva_module_cache_invalidate(linker, "unsupported target write size");
+		return;
+	}
+	if (linker->mcache.write_count == linker->mcache.write_size) {
+		linker->mcache.write_size = linker->mcache.write_size == 0 ? 256 :
+		    linker->mcache.write_size << 1;
+		linker->mcache.writes = shiva_realloc(linker->mcache.writes,
+		    linker->mcache.write_size * sizeof(*w));
+	}
+	w = &linker->mcache.writes[linker->mcache.write_count];
+	memset(w, 0, sizeof(*w));
+	w->addr = addr - linker->target_base;
+	w->len = len;
+	w->seq = linker->mcache.write_count++;
+	memcpy(w->data, src, len);
+	return;
+}
+
+/*
+ * Record every write queued in txn. Must be called before the txn is
+ * committed, since the commit releases the queue.
+ */
+void
+shiva_module_cache_note_txn(struct shiva_module *linker, struct shiva_patch_txn *txn)
+{
+	size_t i;
+
+	for (i = 0; i < txn->count; i++) {
+		shiva_module_cache_note_write(linker, txn->writes[i].addr,
+		    txn->writes[i].data, txn->writes[i].len);
+	}
+	return;
+}
+
+static void
+shiva_module_cache_release(struct shiva_module *linker)
+{
+	free(linker->mcache.fixups);
+	free(linker->mcache.writes);
+	memset(&linker->mcache, 0, sizeof(linker->mcache));
+	return;
+}
+
+/*
+ * Walks the RELR encoded fixups of an image (See shiva_prelink.h).
+ */
+struct mcache_relr_iterator {
+	const uint64_t *relr;
+	size_t count;
+	size_t index;
+	uint64_t where; /* the word after the last fixup or bitmap */
+	uint64_t bitmap;
+	uint64_t bitmap_where;
+	unsigned int bit;
+};
+
+static void
+mcache_relr_iterator_init(struct mcache_relr_iterator *iter, const uint64_t *relr,
+    size_t count)
+{
+	memset(iter, 0, sizeof(*iter));
+	iter->relr = relr;
+	iter->count = count;
+	return;
+}
+
+static bool
+mcache_relr_iterator_next(struct mcache_relr_iterator *iter, uint64_t *offset)
+{
+	uint64_t word;
+	unsigned int bit;
+
+	for (;;) {
+		while (iter->bitmap != 0) {
+			word = iter->bitmap;
+			bit = iter->bit++;
+			iter->bitmap >>= 1;
+			if (word & 1) {
+				*offset = iter->bitmap_where + bit * sizeof(uint64_t);
+				return true;
+			}
+		}
+		if (iter->index >= iter->count)
+			return false;
+		word = iter->relr[iter->index++];
+		if ((word & 1) == 0) {
+			*offset = word;
+			iter->where = word + sizeof(uint64_t);
+			return true;
+		}
+		iter->bitmap = word >> 1;
+		iter->bitmap_where = iter->where;
+		iter->bit = 0;
+		iter->where += 63 * sizeof(uint64_t);
+	}
+}
+
+static int
+mcache_offset_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Encode the n fixup offsets at sites, which are sorted, unique and 8
+ * byte aligned. *relr has room for at least n words, since every word
+ * covers at least one fixup.
+ */
+static size_t
+mcache_relr_encode(const uint64_t *sites, size_t n, uint64_t *relr)
+{
+	size_t i = 0, count = 0;
+	uint64_t where, bitmap;
+
+	while (i < n) {
+		relr[count++] = sites[i];
+		where = sites[i++] + sizeof(uint64_t);
+		for (;;) {
+			bitmap = 0;
+			while (i < n && sites[i] - where < 63 * sizeof(uint64_t)) {
+				bitmap |= 1UL << ((sites[i] - where) / sizeof(uint64_t));
+				i++;
+			}
+			if (bitmap == 0)
+				break;
+			relr[count++] = (bitmap << 1) | 1;
+			where += 63 * sizeof(uint64_t);
+		}
+	}
+	return count;
+}
+
+static bool
+mcache_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t b;
+
+	while (len > 0) {
+		b = write(fd, p, len);
+		if (b < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += b;
+		len -= b;
+	}
+	return true;
+}
+
+static uint32_t
+mcache_strtab_add(char **strtab, size_t *size, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	uint32_t off = *size;
+
+	*strtab = shiva_realloc(*strtab, *size + len);
+	memcpy(*strtab + *size, s, len);
+	*size += len;
+	return off;
+}
+
+static inline size_t
+mcache_data_map_size(struct shiva_module *linker)
+{
+	/*
+	 * Must match create_data_image()
+	 */
+	return linker->data_size == 0 ? PAGE_SIZE :
+	    ELF_PAGEALIGN(linker->data_size, PAGE_SIZE);
+}
+
+/*
+ * Write the image to path. It's written to a temporary file first and
+ * renamed into place, so that a concurrent load never sees a partial
+ * image.
+ */
+static bool
+mcache_write_file(struct shiva_module *linker, const char *path,
+    struct shiva_mcache_hdr *hdr, uint64_t *relr,
+    struct shiva_mcache_delayed *delayed, const char *strtab)
+{
+	char tmp_path[PATH_MAX + 32];
+	int fd;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid());
+	fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		shiva_debug("open(%s) failed: %s\n", tmp_path, strerror(errno));
+		return false;
+	}
+	if (mcache_write_all(fd, hdr, sizeof(*hdr)) == false ||
+	    mcache_write_all(fd, relr, hdr->relr_count * sizeof(*relr)) == false ||
+	    mcache_write_all(fd, linker->mcache.writes,
+	    hdr->write_count * sizeof(struct shiva_patch_write)) == false ||
+	    mcache_write_all(fd, delayed, hdr->delayed_count * sizeof(*delayed)) == false ||
+	    mcache_write_all(fd, strtab, hdr->strtab_size) == false)
+		goto fail;
+	if (lseek(fd, hdr->text_offset, SEEK_SET) < 0 ||
+	    mcache_write_all(fd, linker->text_mem, hdr->text_map_size) == false ||
+	    mcache_write_all(fd, (void *)linker->data_vaddr, hdr->data_map_size) == false)
+		goto fail;
+	close(fd);
+	fd = -1;
+	if (rename(tmp_path, path) < 0)
+		goto fail;
+	shiva_debug("Stored patch image in %s: %zu fixup words, %zu target writes,"
+	    " %zu delayed relocs\n", path, hdr->relr_count, hdr->write_count,
+	    hdr->delayed_count);
+	return true;
+fail:
+	shiva_debug("Failed to write %s: %s\n", tmp_path, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	(void) unlink(tmp_path);
+	return false;
+}
+
+/*
+ * Store the fully linked microcode patch, into the SHIVA_MODULE_CACHE
+ * directory and/or the SHIVA_MODULE_IMAGE file. Called after the target
+ * has been rewritten, but before any delayed relocations are applied by
+ * shiva_post_linker(). Failure is not fatal, the patch simply isn't
+ * cached.
+ */
+bool
+shiva_module_cache_store(struct shiva_ctx *ctx, struct shiva_module *linker,
+    const char *path)
+{
+	struct shiva_mcache_hdr hdr;
+	struct shiva_prelink_table_hdr thdr;
+	uint64_t *sites = NULL, *relr = NULL;
+	struct shiva_mcache_delayed *delayed = NULL;
+	struct shiva_module_delayed_reloc *delay_rel;
+	struct stat st;
+	char cache_path[PATH_MAX];
+	char *strtab = NULL;
+	size_t strtab_size = 1, i, n;
+	uint64_t addr, text_start, data_start;
+	const char *dir, *image_path;
+	bool res = false;
+
+#ifdef __x86_64__
+	shiva_module_cache_release(linker);
+	return false;
+#endif
+	dir = shiva_module_cache_dir();
+	image_path = shiva_module_image_path();
+	if ((dir == NULL && image_path == NULL) || linker->mcache.enabled == false ||
+	    linker->mcache.uncacheable == true ||
+	    linker->mode != SHIVA_LINKING_MICROCODE_PATCH)
+		goto done;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (shiva_module_cache_key(ctx, path, &hdr.key) == false ||
+	    shiva_module_image_key(ctx, &hdr.image_key) == false)
+		goto done;
+	memset(&thdr, 0, sizeof(thdr));
+	if (shiva_prelink_target_key(&ctx->elfobj, &thdr) == false)
+		goto done;
+	hdr.target_key_type = thdr.key_type;
+	hdr.target_key_len = thdr.key_len;
+	memcpy(hdr.target_key, thdr.key, sizeof(hdr.target_key));
+	hdr.magic = SHIVA_MCACHE_MAGIC;
+	hdr.version = SHIVA_MCACHE_VERSION;
+	hdr.target_base = linker->target_base;
+	hdr.text_off = (int64_t)(linker->text_vaddr - linker->target_base);
+	hdr.data_off = (int64_t)(linker->data_vaddr - linker->target_base);
+	hdr.text_size = linker->text_size;
+	hdr.text_map_size = ELF_PAGEALIGN(linker->text_size, PAGE_SIZE);
+	hdr.data_size = linker->data_size;
+	hdr.data_map_size = mcache_data_map_size(linker);
+	hdr.bss_off = linker->bss_off;
+	hdr.flags = linker->flags & SHIVA_MODULE_F_DELAYED_RELOCS;
+	if (linker->eh_frame.mem != NULL) {
+		hdr.eh_frame_off = linker->eh_frame.mem - linker->text_mem;
+		hdr.eh_frame_size = linker->eh_frame.size;
+	}
+
+	text_start = (uint64_t)linker->text_mem;
+	data_start = linker->data_vaddr;
+	sites = shiva_malloc(sizeof(*sites) * (linker->mcache.fixup_count + 1));
+	for (i = 0; i < linker->mcache.fixup_count; i++) {
+		addr = linker->mcache.fixups[i];
+		if (addr >= text_start && addr + 8 <= text_start + hdr.text_map_size) {
+			sites[i] = addr - text_start;
+		} else if (addr >= data_start && addr + 8 <= data_start + hdr.data_map_size) {
+			sites[i] = hdr.text_map_size + addr - data_start;
+		} else {
+			shiva_debug("Fixup %#lx is outside of the patch images\n", addr);
+			goto done;
+		}
+		if ((sites[i] & (sizeof(uint64_t) - 1)) != 0) {
+			shiva_debug("Fixup %#lx is not 8 byte aligned\n", addr);
+			goto done;
+		}
+	}
+	/*
+	 * A slot can be noted more than once, i.e. a GOT entry that is
+	 * shared by several relocations.
+	 */
+	qsort(sites, linker->mcache.fixup_count, sizeof(*sites), mcache_offset_cmp);
+	for (i = n = 0; i < linker->mcache.fixup_count; i++) {
+		if (n == 0 || sites[i] != sites[n - 1])
+			sites[n++] = sites[i];
+	}
+	relr = shiva_malloc(sizeof(*relr) * (n + 1));
+	hdr.relr_count = mcache_relr_encode(sites, n, relr);
+	hdr.write_count = linker->mcache.write_count;
+
+	strtab = shiva_malloc(1);
+	strtab[0] = '\0';
+	TAILQ_FOREACH(delay_rel, &linker->tailq.delayed_reloc_list, _linkage)
+		hdr.delayed_count++;
+	delayed = shiva_malloc(sizeof(*delayed) * (hdr.delayed_count + 1));
+	i = 0;
+	TAILQ_FOREACH(delay_rel, &linker->tailq.delayed_reloc_list, _linkage) {
+		if (stat(delay_rel->so_path, &st) < 0)
+			goto done;
+		memset(&delayed[i], 0, sizeof(delayed[i]));
+		delayed[i].rel_off = (int64_t)(delay_rel->rel_addr - linker->target_base);
+		delayed[i].symval = delay_rel->symval;
+		delayed[i].symname = mcache_strtab_add(&strtab, &strtab_size, delay_rel->symname);
+		delayed[i].so_path = mcache_strtab_add(&strtab, &strtab_size, delay_rel->so_path);
+		delayed[i].so_ino = st.st_ino;
+		delayed[i].so_size = st.st_size;
+		delayed[i].so_mtime = st.st_mtime;
+		delayed[i].flags = delay_rel->flags &
+		    (SHIVA_DELAYED_RELOC_F_IFUNC | SHIVA_DELAYED_RELOC_F_TARGET);
+		i++;
+	}
+
+	hdr.relr_offset = sizeof(hdr);
+	hdr.write_offset = hdr.relr_offset + hdr.relr_count * sizeof(*relr);
+	hdr.delayed_offset = hdr.write_offset +
+	    hdr.write_count * sizeof(struct shiva_patch_write);
+	hdr.strtab_offset = hdr.delayed_offset + hdr.delayed_count * sizeof(*delayed);
+	hdr.strtab_size = strtab_size;
+	hdr.text_offset = ELF_PAGEALIGN(hdr.strtab_offset + hdr.strtab_size, PAGE_SIZE);
+	hdr.data_offset = hdr.text_offset + hdr.text_map_size;
+	hdr.file_size = hdr.data_offset + hdr.data_map_size;
+
+	if (dir != NULL) {
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+			shiva_debug("mkdir(%s) failed: %s\n", dir, strerror(errno));
+		} else {
+			shiva_module_cache_path(dir, hdr.key, cache_path);
+			res = mcache_write_file(linker, cache_path, &hdr, relr,
+			    delayed, strtab);
+		}
+	}
+	if (image_path != NULL &&
+	    mcache_write_file(linker, image_path, &hdr, relr, delayed, strtab) == true)
+		res = true;
+done:
+	free(sites);
+	free(relr);
+	free(delayed);
+	free(strtab);
+	shiva_module_cache_release(linker);
+	return res;
+}
+
+static bool
+mcache_range_ok(struct shiva_mcache_hdr *hdr, uint64_t offset, uint64_t count,
+    size_t entsize)
+{
+	if (count > hdr->file_size / (entsize ? entsize : 1))
+		return false;
+	return offset <= hdr->file_size && count * entsize <= hdr->file_size - offset;
+}
+
+static bool
+mcache_validate(struct shiva_mcache_hdr *hdr, uint64_t key, bool embedded,
+    size_t file_size)
+{
+	if (hdr->magic != SHIVA_MCACHE_MAGIC || hdr->version != SHIVA_MCACHE_VERSION ||
+	    (embedded == true ? hdr->image_key : hdr->key) != key ||
+	    hdr->file_size != file_size)
+		return false;
+	if (hdr->text_map_size == 0 || hdr->data_map_size == 0 ||
+	    (hdr->text_offset & (PAGE_SIZE - 1)) != 0 ||
+	    (hdr->data_offset & (PAGE_SIZE - 1)) != 0 ||
+	    (hdr->text_map_size & (PAGE_SIZE - 1)) != 0 ||
+	    (hdr->data_map_size & (PAGE_SIZE - 1)) != 0 ||
+	    hdr->text_size > hdr->text_map_size ||
+	    hdr->data_size > hdr->data_map_size)
+		return false;
+	if (mcache_range_ok(hdr, hdr->relr_offset, hdr->relr_count,
+	    sizeof(uint64_t)) == false ||
+	    mcache_range_ok(hdr, hdr->write_offset, hdr->write_count,
+	    sizeof(struct shiva_patch_write)) == false ||
+	    mcache_range_ok(hdr, hdr->delayed_offset, hdr->delayed_count,
+	    sizeof(struct shiva_mcache_delayed)) == false ||
+	    mcache_range_ok(hdr, hdr->strtab_offset, hdr->strtab_size, 1) == false ||
+	    mcache_range_ok(hdr, hdr->text_offset, hdr->text_map_size, 1) == false ||
+	    mcache_range_ok(hdr, hdr->data_offset, hdr->data_map_size, 1) == false)
+		return false;
+	if (hdr->strtab_size == 0)
+		return false;
+	return true;
+}
+
+static void *
+mcache_map_image(int fd, uint64_t addr, size_t len, off_t offset, int prot)
+{
+	void *mem;
+
+	/*
+	 * Reserve the range without clobbering anything that already
+	 * lives there. Kernels that predate MAP_FIXED_NOREPLACE treat
+	 * the address as a hint, so the result is checked either way.
+	 */
+	mem = mmap((void *)addr, len, PROT_NONE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	if ((uint64_t)mem != addr) {
+		munmap(mem, len);
+		return NULL;
+	}
+	mem = mmap((void *)addr, len, prot, MAP_PRIVATE|MAP_FIXED, fd, offset);
+	if (mem == MAP_FAILED) {
+		munmap((void *)addr, len);
+		return NULL;
+	}
+	return mem;
+}
+
+/*
+ * Open the text of the image at offset within fd, as rebased for the
+ * target base, from the cache directory. It is created on the first
+ * load at that base. Returns -1 if there is no usable variant.
+ */
+static int
+mcache_text_variant(int fd, off_t offset, struct shiva_mcache_hdr *hdr,
+    const uint64_t *relr, uint64_t key, uint64_t base)
+{
+	struct mcache_relr_iterator relr_iter;
+	char path[PATH_MAX], tmp[PATH_MAX + 32];
+	struct stat st;
+	uint8_t *text;
+	uint64_t delta = base - hdr->target_base, off;
+	int vfd;
+
+	snprintf(path, sizeof(path), "%s/%016lx-%016lx.text", shiva_module_cache_dir(),
+	    key, base);
+	vfd = open(path, O_RDONLY|O_CLOEXEC);
+	if (vfd >= 0) {
+		if (fstat(vfd, &st) == 0 && (uint64_t)st.st_size == hdr->text_map_size)
+			return vfd;
+		close(vfd);
+	}
+	text = shiva_malloc(hdr->text_map_size);
+	if (pread(fd, text, hdr->text_map_size, offset + hdr->text_offset) !=
+	    (ssize_t)hdr->text_map_size) {
+		free(text);
+		return -1;
+	}
+	mcache_relr_iterator_init(&relr_iter, relr, hdr->relr_count);
+	while (mcache_relr_iterator_next(&relr_iter, &off) == true) {
+		if (off < hdr->text_map_size)
+			*(uint64_t *)&text[off] += delta;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+	vfd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (vfd < 0) {
+		free(text);
+		return -1;
+	}
+	if (mcache_write_all(vfd, text, hdr->text_map_size) == false ||
+	    rename(tmp, path) < 0) {
+		unlink(tmp);
+		close(vfd);
+		free(text);
+		return -1;
+	}
+	free(text);
+	shiva_debug("Stored text rebased to %#lx in %s\n", base, path);
+	return vfd;
+}
+
+/*
+ * Map the image at offset within fd (Either a cache file, or the target
+ * executable for an embedded image). On success the target has been
+ * rewritten and *linkerptr describes the mapped patch. On failure
+ * nothing has been changed.
+ */
+static bool
+mcache_load_image(struct shiva_ctx *ctx, int fd, off_t offset, size_t size,
+    uint64_t key, bool embedded, const char *name, struct shiva_module **linkerptr)
+{
+	struct shiva_mcache_hdr hdr;
+	struct mcache_relr_iterator relr_iter;
+	const uint64_t *relr;
+	struct shiva_mcache_delayed *delayed;
+	struct shiva_patch_write *writes;
+	struct shiva_module_delayed_reloc *delay_rel;
+	struct shiva_module *linker = NULL;
+	struct shiva_patch_txn txn;
+	shiva_error_t error;
+	struct stat st;
+	uint8_t *meta = MAP_FAILED, *text = NULL, *data = NULL;
+	const char *strtab;
+	uint64_t base, delta, off, text_fixups = 0;
+	size_t i;
+	int text_fd = -1;
+	off_t text_offset;
+	bool shared = false;
+
+	if (size < sizeof(hdr))
+		return false;
+	meta = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, offset);
+	if (meta == MAP_FAILED)
+		goto miss;
+	memcpy(&hdr, meta, sizeof(hdr));
+	if (mcache_validate(&hdr, key, embedded, size) == false) {
+		shiva_debug("Patch image %s is invalid\n", name);
+		goto miss;
+	}
+	relr = (const uint64_t *)&meta[hdr.relr_offset];
+	writes = (struct shiva_patch_write *)&meta[hdr.write_offset];
+	delayed = (struct shiva_mcache_delayed *)&meta[hdr.delayed_offset];
+	strtab = (const char *)&meta[hdr.strtab_offset];
+	if (strtab[hdr.strtab_size - 1] != '\0')
+		goto miss;
+	for (i = 0; i < hdr.delayed_count; i++) {
+		if (delayed[i].symname >= hdr.strtab_size ||
+		    delayed[i].so_path >= hdr.strtab_size)
+			goto miss;
+		if (embedded == true)
+			continue;
+		if (stat(&strtab[delayed[i].so_path], &st) < 0 ||
+		    (uint64_t)st.st_ino != delayed[i].so_ino ||
+		    (uint64_t)st.st_size != delayed[i].so_size ||
+		    (int64_t)st.st_mtime != delayed[i].so_mtime) {
+			shiva_debug("Patch cache entry is stale: %s changed\n",
+			    &strtab[delayed[i].so_path]);
+			goto miss;
+		}
+	}
+	mcache_relr_iterator_init(&relr_iter, relr, hdr.relr_count);
+	while (mcache_relr_iterator_next(&relr_iter, &off) == true) {
+		if (off < hdr.text_map_size) {
+			if (off + 8 > hdr.text_map_size)
+				goto miss;
+			text_fixups++;
+		} else if (off - hdr.text_map_size + 8 > hdr.data_map_size) {
+			goto miss;
+		}
+	}
+	if (hdr.eh_frame_size > 0 && (hdr.eh_frame_off > hdr.text_map_size ||
+	    hdr.text_map_size - hdr.eh_frame_off < hdr.eh_frame_size + sizeof(uint32_t)))
+		goto miss;
+
+	base = ctx->ulexec.base_vaddr;
+	delta = base - hdr.target_base;
+	/*
+	 * Text that is mapped read-only is never copied on write, and is
+	 * shared with every other process that maps the same file.
+	 */
+	text_offset = offset + hdr.text_offset;
+	if (delta == 0 || text_fixups == 0) {
+		shared = true;
+	} else if (shiva_module_cache_shared() == true &&
+	    (text_fd = mcache_text_variant(fd, offset, &hdr, relr, key, base)) >= 0) {
+		text_offset = 0;
+		shared = true;
+	}
+	text = mcache_map_image(text_fd >= 0 ? text_fd : fd, base + hdr.text_off,
+	    hdr.text_map_size, text_offset,
+	    shared == true ? PROT_READ|PROT_EXEC : PROT_READ|PROT_WRITE);
+	if (text_fd >= 0)
+		close(text_fd);
+	if (text == NULL) {
+		shiva_debug("Patch image text address %#lx is unavailable\n",
+		    base + hdr.text_off);
+		goto miss;
+	}
+	data = mcache_map_image(fd, base + hdr.data_off, hdr.data_map_size,
+	    offset + hdr.data_offset, PROT_READ|PROT_WRITE);
+	if (data == NULL) {
+		shiva_debug("Patch image data address %#lx is unavailable\n",
+		    base + hdr.data_off);
+		goto miss;
+	}
+	/*
+	 * A single pass that adds the delta to every absolute value, all
+	 * else within the images is relative to the images or the target,
+	 * which moved along with them.
+	 */
+	mcache_relr_iterator_init(&relr_iter, relr, hdr.relr_count);
+	while (delta != 0 && mcache_relr_iterator_next(&relr_iter, &off) == true) {
+		if (off < hdr.text_map_size) {
+			if (shared == false)
+				*(uint64_t *)&text[off] += delta;
+			continue;
+		}
+		*(uint64_t *)&data[off - hdr.text_map_size] += delta;
+	}
+
+	linker = shiva_malloc(sizeof(*linker));
+	memset(linker, 0, sizeof(*linker));
+	linker->fd = -1;
+	linker->ctx = ctx;
+	linker->mode = SHIVA_LINKING_MICROCODE_PATCH;
+	linker->flags = SHIVA_MODULE_F_RUNTIME;
+	linker->target_elfobj = &ctx->elfobj;
+	linker->shiva_base = ctx->shiva.base;
+	linker->target_base = base;
+	linker->text_mem = text;
+	linker->text_vaddr = (uint64_t)text;
+	linker->text_size = hdr.text_size;
+	linker->data_mem = data;
+	linker->data_vaddr = (uint64_t)data;
+	linker->data_size = hdr.data_size;
+	linker->bss_off = hdr.bss_off;
+	linker->bss_vaddr = linker->data_vaddr + hdr.bss_off;
+	if (hdr.eh_frame_size > 0) {
+		linker->eh_frame.mem = text + hdr.eh_frame_off;
+		linker->eh_frame.size = hdr.eh_frame_size;
+	}
+	TAILQ_INIT(&linker->tailq.transform_list);
+	TAILQ_INIT(&linker->tailq.helper_list);
+	TAILQ_INIT(&linker->tailq.section_maplist);
+	TAILQ_INIT(&linker->tailq.plt_list);
+	TAILQ_INIT(&linker->tailq.delayed_reloc_list);
+
+	for (i = 0; i < hdr.delayed_count; i++) {
+		delay_rel = shiva_arena_alloc(&ctx->arena.module, sizeof(*delay_rel));
+		delay_rel->rel_addr = base + delayed[i].rel_off;
+		delay_rel->rel_unit = (uint8_t *)delay_rel->rel_addr;
+		delay_rel->symval = delayed[i].symval;
+		delay_rel->symname = shiva_arena_strdup(&ctx->arena.module,
+		    &strtab[delayed[i].symname]);
+		delay_rel->flags = delayed[i].flags &
+		    (SHIVA_DELAYED_RELOC_F_IFUNC | SHIVA_DELAYED_RELOC_F_TARGET);
+		/*
+		 * The target is part of the key of an embedded image, its
+		 * own IFUNCs stay where they are.
+		 */
+		if (embedded == true && (delay_rel->flags & SHIVA_DELAYED_RELOC_F_TARGET) == 0)
+			delay_rel->flags = SHIVA_DELAYED_RELOC_F_BY_NAME;
+		strncpy(delay_rel->so_path, &strtab[delayed[i].so_path], PATH_MAX);
+		delay_rel->so_path[PATH_MAX - 1] = '\0';
+		TAILQ_INSERT_TAIL(&linker->tailq.delayed_reloc_list, delay_rel, _linkage);
+	}
+	/*
+	 * Nothing in the target has been touched up until this point, any
+	 * failure beyond here leaves it half patched.
+	 */
+	shiva_patch_txn_begin(ctx, &txn);
+	for (i = 0; i < hdr.write_count; i++) {
+		if (shiva_patch_txn_write(&txn, base + writes[i].addr, writes[i].data,
+		    writes[i].len, &error) == false) {
+			shiva_patch_txn_abort(&txn);
+			goto miss;
+		}
+	}
+	if (shiva_patch_txn_commit(&txn, &error) == false) {
+		fprintf(stderr, "shiva_patch_txn_commit failed: %s\n", shiva_error_msg(&error));
+		exit(EXIT_FAILURE);
+	}
+	if (hdr.delayed_count > 0 &&
+	    shiva_module_enable_post_linker(linker) == false) {
+		fprintf(stderr, "Failed to enable delayed relocs\n");
+		exit(EXIT_FAILURE);
+	}
+	if (shared == false &&
+	    mprotect(text, hdr.text_map_size, PROT_READ|PROT_EXEC) < 0) {
+		perror("mprotect");
+		exit(EXIT_FAILURE);
+	}
+	__builtin___clear_cache((char *)text, (char *)text + hdr.text_map_size);
+	if (shiva_eh_frame_seal(linker) == false) {
+		fprintf(stderr, "Failed to register patch unwind info\n");
+		exit(EXIT_FAILURE);
+	}
+	munmap(meta, size);
+	shiva_debug("Patch image hit: %s mapped at %p (delta %#lx, %s text)\n", name,
+	    text, delta, shared == true ? "shared" : "private");
+	(void) shiva_perf_map_write(linker, name);
+	*linkerptr = linker;
+	TAILQ_INSERT_TAIL(&ctx->module.list, linker, _linkage);
+	return true;
+miss:
+	free(linker);
+	if (data != NULL)
+		munmap(data, hdr.data_map_size);
+	if (text != NULL)
+		munmap(text, hdr.text_map_size);
+	if (meta != MAP_FAILED)
+		munmap(meta, size);
+	return false;
+}
+
+/*
+ * Look for an image that shiva-ld --static_link embedded in the target.
+ */
+static bool
+mcache_embedded_image(struct shiva_ctx *ctx, uint64_t *offset, uint64_t *size)
+{
+	elf_dynamic_iterator_t dyn_iter;
+	elf_dynamic_entry_t dyn_entry;
+
+	*offset = *size = 0;
+	if (shiva_target_has_prelinking(ctx) == false)
+		return false;
+	elf_dynamic_iterator_init(&ctx->elfobj, &dyn_iter);
+	while (elf_dynamic_iterator_next(&dyn_iter, &dyn_entry) == ELF_ITER_OK) {
+		if (dyn_entry.tag == SHIVA_DT_PATCH_IMAGE)
+			*offset = dyn_entry.value;
+		else if (dyn_entry.tag == SHIVA_DT_PATCH_IMAGESZ)
+			*size = dyn_entry.value;
+	}
+	if (*offset == 0 || *size == 0 || (*offset & (PAGE_SIZE - 1)) != 0 ||
+	    *offset > ctx->elfobj.size || *size > ctx->elfobj.size - *offset)
+		return false;
+	return true;
+}
+
+/*
+ * Try to load the patch at path from the image embedded in the target,
+ * or else from the cache. On a hit the target has been rewritten and
+ * *linkerptr describes the mapped patch, just as if shiva_module_loader()
+ * had linked it. On a miss nothing has been changed and false is
+ * returned.
+ */
+bool
+shiva_module_cache_load(struct shiva_ctx *ctx, const char *path,
+    struct shiva_module **linkerptr)
+{
+	struct stat st;
+	char cache_path[PATH_MAX];
+	const char *dir;
+	uint64_t key, offset, size;
+	bool res;
+	int fd;
+
+#ifdef __x86_64__
+	return false;
+#endif
+	/*
+	 * Only a single patch is cached, a list of patches is packed
+	 * and linked together by shiva_module_load_list().
+	 */
+	if (ctx->module.count != 1)
+		return false;
+	/*
+	 * A cached patch calls its functions directly, without the
+	 * counting stubs of shiva_hook_stats.c
+	 */
+	if (ctx->hook_stats.hdr != NULL)
+		return false;
+	/*
+	 * Nor are the text replicas of shiva_module_numa.c
+	 */
+	if (shiva_module_numa_enabled() == true)
+		return false;
+	if (mcache_embedded_image(ctx, &offset, &size) == true) {
+		if (shiva_module_image_key(ctx, &key) == true &&
+		    (fd = open(elf_pathname(&ctx->elfobj), O_RDONLY)) >= 0) {
+			res = mcache_load_image(ctx, fd, offset, size, key, true,
+			    elf_pathname(&ctx->elfobj), linkerptr);
+			close(fd);
+			if (res == true)
+				return true;
+		}
+		shiva_debug("The embedded patch image is unusable, linking %s\n", path);
+	}
+	dir = shiva_module_cache_dir();
+	if (dir == NULL)
+		return false;
+	if (shiva_module_cache_key(ctx, path, &key) == false)
+		return false;
+	shiva_module_cache_path(dir, key, cache_path);
+	fd = open(cache_path, O_RDONLY);
+	if (fd < 0) {
+		shiva_debug("Patch cache miss: %s\n", cache_path);
+		return false;
+	}
+	res = fstat(fd, &st) == 0 &&
+	    mcache_load_image(ctx, fd, 0, st.st_size, key, false, cache_path, linkerptr);
+	close(fd);
+	return res;
+}
@@ -0,0 +1,207 @@
+/*
+ * shiva_module_index.c - Module registry lookups.
+ *
+ * A module directory (i.e. /opt/shiva/modules) that was indexed with
+ * shiva-ld --index holds a modules.idx file (See shiva_prelink.h) that
+ * maps each module name to a content addressed copy of the module and
+ * the hash of its contents. The index of a directory is mapped once and
+ * binary searched, so locating a module costs no directory probing, and
+ * a name that isn't in the index is known to be missing without going
+ * to the filesystem at all. The hash doubles as the identity of the
+ * module for the patch cache, and is checked against the contents once
+ * the module is opened for linking.
+ *
+ * A directory without an index, or with a stale one, is searched the
+ * way it always was.
+ */
+#include "shiva.h"
+
+static void
+shiva_module_index_close(struct shiva_ctx *ctx)
+{
+	if (ctx->module.index.mem != NULL)
+		munmap(ctx->module.index.mem, ctx->module.index.size);
+	ctx->module.index.mem = NULL;
+	ctx->module.index.size = 0;
+	return;
+}
+
+static bool
+shiva_module_index_validate(struct shiva_module_index_hdr *hdr, size_t size)
+{
+	struct shiva_module_index_entry *entries;
+	const char *strtab;
+	uint64_t i;
+
+	if (size < sizeof(*hdr) || hdr->magic != SHIVA_MODULE_INDEX_MAGIC ||
+	    hdr->version != SHIVA_MODULE_INDEX_VERSION || hdr->file_size != size)
+		return false;
+	if (hdr->count > size / sizeof(*entries) ||
+	    hdr->entry_offset > size ||
+	    hdr->count * sizeof(*entries) > size - hdr->entry_offset ||
+	    hdr->strtab_size == 0 || hdr->strtab_offset > size ||
+	    hdr->strtab_size > size - hdr->strtab_offset)
+		return false;
+	entries = (struct shiva_module_index_entry *)((uint8_t *)hdr + hdr->entry_offset);
+	strtab = (const char *)hdr + hdr->strtab_offset;
+	if (strtab[hdr->strtab_size - 1] != '\0')
+		return false;
+	for (i = 0; i < hdr->count; i++) {
+		if (entries[i].name >= hdr->strtab_size || entries[i].path >= hdr->strtab_size)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Map the index of dir, unless it is the one that is mapped already.
+ * Returns false if dir has no index that can be trusted.
+ */
+static bool
+shiva_module_index_open(struct shiva_ctx *ctx, const char *dir)
+{
+	char path[PATH_MAX];
+	struct stat dst, ist;
+	void *mem;
+	int fd;
+
+	if (ctx->module.index.init == true &&
+	    strcmp(ctx->module.index.dir, dir) == 0)
+		return ctx->module.index.mem != NULL;
+	shiva_module_index_close(ctx);
+	ctx->module.index.init = true;
+	snprintf(ctx->module.index.dir, sizeof(ctx->module.index.dir), "%s", dir);
+	if (snprintf(path, sizeof(path), "%s/%s", dir, SHIVA_MODULE_INDEX_NAME) >=
+	    (int)sizeof(path))
+		return false;
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &ist) < 0 || stat(dir, &dst) < 0) {
+		close(fd);
+		return false;
+	}
+	/*
+	 * Something was added to, or removed from the directory since it
+	 * was indexed.
+	 */
+	if (dst.st_mtim.tv_sec > ist.st_mtim.tv_sec ||
+	    (dst.st_mtim.tv_sec == ist.st_mtim.tv_sec &&
+	    dst.st_mtim.tv_nsec > ist.st_mtim.tv_nsec)) {
+		shiva_debug("Module index %s is stale, ignoring it\n", path);
+		close(fd);
+		return false;
+	}
+	mem = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return false;
+	if (shiva_module_index_validate(mem, ist.st_size) == false) {
+		fprintf(stderr, "Invalid module index %s, ignoring it\n", path);
+		munmap(mem, ist.st_size);
+		return false;
+	}
+	ctx->module.index.mem = mem;
+	ctx->module.index.size = ist.st_size;
+	shiva_debug("Mapped module index %s: %lu modules\n", path,
+	    ((struct shiva_module_index_hdr *)mem)->count);
+	return true;
+}
+
+static struct shiva_module_index_entry *
+shiva_module_index_find(struct shiva_ctx *ctx, const char *name)
+{
+	struct shiva_module_index_hdr *hdr = (void *)ctx->module.index.mem;
+	struct shiva_module_index_entry *entries;
+	const char *strtab;
+	size_t lo = 0, hi = hdr->count, mid;
+	int cmp;
+
+	entries = (struct shiva_module_index_entry *)(ctx->module.index.mem +
+	    hdr->entry_offset);
+	strtab = (const char *)ctx->module.index.mem + hdr->strtab_offset;
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		cmp = strcmp(name, &strtab[entries[mid].name]);
+		if (cmp == 0)
+			return &entries[mid];
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+/*
+ * Look up the module name within dir. On SHIVA_MODULE_INDEX_HIT path
+ * is set to the module that the index points to, and *hash to the hash
+ * of its contents. SHIVA_MODULE_INDEX_MISS means that the module is not
+ * in dir, and SHIVA_MODULE_INDEX_NONE that dir has no usable index.
+ */
+shiva_module_index_res_t
+shiva_module_index_lookup(struct shiva_ctx *ctx, const char *dir, const char *name,
+    char *path, uint64_t *hash)
+{
+	struct shiva_module_index_entry *entry;
+	const char *strtab;
+	int n;
+
+	if (shiva_module_index_open(ctx, dir) == false)
+		return SHIVA_MODULE_INDEX_NONE;
+	entry = shiva_module_index_find(ctx, name);
+	if (entry == NULL) {
+		shiva_debug("Module %s is not in the index of %s\n", name, dir);
+		return SHIVA_MODULE_INDEX_MISS;
+	}
+	strtab = (const char *)ctx->module.index.mem +
+	    ((struct shiva_module_index_hdr *)ctx->module.index.mem)->strtab_offset;
+	shiva_debug("Module index: %s -> %s/%s (%#lx)\n", name, dir,
+	    &strtab[entry->path], entry->hash);
+	/*
+	 * name may point into path
+	 */
+	n = snprintf(path, PATH_MAX, "%s/%s", dir, &strtab[entry->path]);
+	if (n < 0 || n >= PATH_MAX)
+		return SHIVA_MODULE_INDEX_NONE;
+	*hash = entry->hash;
+	return SHIVA_MODULE_INDEX_HIT;
+}
+
+/*
+ * The content hash of the module at path, if it was found through an
+ * index.
+ */
+bool
+shiva_module_index_get_hash(struct shiva_ctx *ctx, const char *path, uint64_t *hash)
+{
+	size_t i;
+
+	if (ctx->module.hashes == NULL)
+		return false;
+	for (i = 0; i < ctx->module.count; i++) {
+		if (ctx->module.hashes[i] != 0 && strcmp(ctx->module.paths[i], path) == 0) {
+			*hash = ctx->module.hashes[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Make sure that the module at path, now mapped as obj, is the one that
+ * the index vouched for.
+ */
+bool
+shiva_module_index_verify(struct shiva_ctx *ctx, const char *path, elfobj_t *obj)
+{
+	uint64_t hash;
+
+	if (shiva_module_index_get_hash(ctx, path, &hash) == false)
+		return true;
+	if (shiva_module_index_hash(obj->mem, obj->size) != hash) {
+		fprintf(stderr, "Module %s does not match its index entry\n", path);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,207 @@
+/*
+ * shiva_module_lazy.c - Lazy binding of patch module calls into shared
+ * objects.
+ *
+ * By default resolve_pltgot_entries() looks up every function that a
+ * patch imports from the shared objects of the target up front, and
+ * fills in their GOT entries once LDSO has mapped them (See
+ * shiva_post_linker.c). Most of those are error paths that never run.
+ * With SHIVA_MODULE_LAZY=1 the GOT entry of each such function points
+ * to a stub of its own instead:
+ *
+ * stub:	adr	x16, stub + 16
+ *		ldr	x17, [x16]	; shiva_module_lazy_trampoline
+ *		br	x17
+ *		brk	#0
+ *		.quad	shiva_module_lazy_trampoline
+ *		.quad	got		; the GOT entry to bind
+ *		.quad	symname
+ *
+ * The first call through the stub saves the argument registers, looks
+ * the function up in the link_map of the target (The same search order
+ * that LDSO uses, see shiva_link_map.c), stores it in the GOT entry and
+ * tail calls it. Later calls go straight to the function. Two threads
+ * may bind the same entry at once, they store the same value.
+ *
+ * Binding runs with the thread pointer of the targets libc, so system
+ * calls are made directly, and a failure to bind is fatal just as it
+ * would have been at load time.
+ */
+#include "shiva.h"
+#include "shiva_syscall.h"
+#include <sys/syscall.h>
+
+struct shiva_module_lazy_stub {
+	uint32_t code[4];
+	uint64_t trampoline;
+	uint64_t *got;
+	const char *symname;
+};
+
+#if __aarch64__
+#define SHIVA_LAZY_ADR_X16	0x10000090 /* adr x16, #16 */
+#define SHIVA_LAZY_LDR_X17	0xf9400211 /* ldr x17, [x16] */
+#define SHIVA_LAZY_BR_X17	0xd61f0220 /* br x17 */
+#define SHIVA_LAZY_BRK		0xd4200000 /* brk #0 */
+
+static void
+shiva_module_lazy_fail(const char *symname)
+{
+	static const char prefix[] = "shiva: unable to bind patch call to '";
+	static const char suffix[] = "'\n";
+
+	(void) shiva_syscall(SYS_write, STDERR_FILENO, (long)prefix, sizeof(prefix) - 1,
+	    0, 0, 0);
+	(void) shiva_syscall(SYS_write, STDERR_FILENO, (long)symname, strlen(symname),
+	    0, 0, 0);
+	(void) shiva_syscall(SYS_write, STDERR_FILENO, (long)suffix, sizeof(suffix) - 1,
+	    0, 0, 0);
+	(void) shiva_syscall(SYS_exit_group, EXIT_FAILURE, 0, 0, 0, 0, 0);
+	return;
+}
+
+/*
+ * Called by shiva_module_lazy_trampoline() with the stub of the call,
+ * returns the function to continue to.
+ */
+static uint64_t __attribute__((used))
+shiva_module_lazy_bind(struct shiva_module_lazy_stub *stub)
+{
+	struct elf_symbol symbol;
+	uint64_t base, addr;
+
+	if (shiva_link_map_resolve_symbol(ctx_global, stub->symname, &symbol,
+	    &base) == false)
+		shiva_module_lazy_fail(stub->symname);
+	addr = base + symbol.value;
+	if (symbol.type == STT_GNU_IFUNC)
+		addr = shiva_link_map_ifunc_resolve(ctx_global, addr);
+	else if (symbol.type != STT_FUNC)
+		addr = 0;
+	if (addr == 0)
+		shiva_module_lazy_fail(stub->symname);
+	__atomic_store_n(stub->got, addr, __ATOMIC_RELEASE);
+	return addr;
+}
+
+/*
+ * x16 points to the trampoline field of the stub. Everything that may
+ * carry an argument (x0-x8, q0-q7) is preserved across the bind.
+ */
+static void __attribute__((naked))
+shiva_module_lazy_trampoline(void)
+{
+	__asm__ __volatile__(
+		"stp x29, x30, [sp, #-224]!\n\t"
+		"mov x29, sp\n\t"
+		"stp x0, x1, [sp, #16]\n\t"
+		"stp x2, x3, [sp, #32]\n\t"
+		"stp x4, x5, [sp, #48]\n\t"
+		"stp x6, x7, [sp, #64]\n\t"
+		"str x8, [sp, #80]\n\t"
+		"stp q0, q1, [sp, #96]\n\t"
+		"stp q2, q3, [sp, #128]\n\t"
+		"stp q4, q5, [sp, #160]\n\t"
+		"stp q6, q7, [sp, #192]\n\t"
+		"sub x0, x16, #16\n\t"
+		"bl shiva_module_lazy_bind\n\t"
+		"mov x17, x0\n\t"
+		"ldp q6, q7, [sp, #192]\n\t"
+		"ldp q4, q5, [sp, #160]\n\t"
+		"ldp q2, q3, [sp, #128]\n\t"
+		"ldp q0, q1, [sp, #96]\n\t"
+		"ldr x8, [sp, #80]\n\t"
+		"ldp x6, x7, [sp, #64]\n\t"
+		"ldp x4, x5, [sp, #48]\n\t"
+		"ldp x2, x3, [sp, #32]\n\t"
+		"ldp x0, x1, [sp, #16]\n\t"
+		"ldp x29, x30, [sp], #224\n\t"
+		"br x17\n\t"
+		);
+}
+#endif
+
+bool
+shiva_module_lazy_enabled(struct shiva_module *linker)
+{
+#if __aarch64__
+	char *env = getenv("SHIVA_MODULE_LAZY");
+
+	if (linker->mode != SHIVA_LINKING_MICROCODE_PATCH)
+		return false;
+	return env != NULL && strcmp(env, "1") == 0;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Point the GOT entry got_entry of the module at a stub that binds it to
+ * the shared object function symname on first call.
+ */
+bool
+shiva_module_lazy_add(struct shiva_module *linker, struct shiva_module_got_entry *got_entry,
+    uint64_t *got)
+{
+#if __aarch64__
+	struct shiva_module_got_entry *current;
+	struct shiva_module_lazy_stub *stub;
+	size_t count = 0;
+	void *mem;
+
+	if (linker->lazy.mem == NULL) {
+		TAILQ_FOREACH(current, &linker->tailq.got_list, _linkage)
+			count++;
+		linker->lazy.size = ELF_PAGEALIGN(count * sizeof(*stub), PAGE_SIZE);
+		mem = mmap(NULL, linker->lazy.size, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			perror("mmap");
+			return false;
+		}
+		linker->lazy.mem = mem;
+		linker->lazy.count = 0;
+		/*
+		 * The patch cache has no notion of the stubs.
+		 */
+		shiva_module_cache_invalidate(linker, "module uses lazy binding");
+	}
+	if ((linker->lazy.count + 1) * sizeof(*stub) > linker->lazy.size) {
+		fprintf(stderr, "No lazy binding stub left for '%s'\n", got_entry->symname);
+		return false;
+	}
+	stub = (struct shiva_module_lazy_stub *)linker->lazy.mem + linker->lazy.count++;
+	stub->code[0] = SHIVA_LAZY_ADR_X16;
+	stub->code[1] = SHIVA_LAZY_LDR_X17;
+	stub->code[2] = SHIVA_LAZY_BR_X17;
+	stub->code[3] = SHIVA_LAZY_BRK;
+	stub->trampoline = (uint64_t)shiva_module_lazy_trampoline;
+	stub->got = got;
+	stub->symname = shiva_arena_strdup(&linker->ctx->arena.module, got_entry->symname);
+	*got = (uint64_t)stub;
+	got_entry->lazy = true;
+	shiva_debug("GOT[%s] is bound lazily through %p\n", got_entry->symname, stub);
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Make the stubs executable, before anything can call through them.
+ */
+bool
+shiva_module_lazy_seal(struct shiva_module *linker)
+{
+	if (linker->lazy.mem == NULL)
+		return true;
+	__builtin___clear_cache((char *)linker->lazy.mem,
+	    (char *)linker->lazy.mem + linker->lazy.size);
+	if (mprotect(linker->lazy.mem, linker->lazy.size, PROT_READ|PROT_EXEC) < 0) {
+		perror("mprotect");
+		return false;
+	}
+	shiva_debug("%zu GOT entries of '%s' are bound lazily\n", linker->lazy.count,
+	    elf_pathname(&linker->elfobj));
+	return true;
+}
@@ -0,0 +1,577 @@
+/*
+ * shiva_module_numa.c - Per NUMA node copies of the text of patch modules.
+ *
+ * SHIVA_MODULE_NUMA=1 gives the text image of each patch module a
+ * replica on every other online node of a multi node machine, bound to
+ * that node with mbind(MPOL_BIND) before it is first touched. A replica
+ * is a copy of the relocated image at a page aligned delta from it,
+ * within branch range: references within the image are position
+ * independent and left alone, while every PC relative instruction
+ * (b, bl, b.cond, cbz, tbz, ldr literal, adr and adrp) that reaches out
+ * of the image, i.e. to the data of the module or to the target, is
+ * re-encoded for its new address. The PLT stubs of a replica branch to
+ * those of the image, since their GOT literals are out of ldr range.
+ * Modules with text transforms, or with literal data within their code
+ * ($d mapping symbols), are not replicated.
+ *
+ * The target is relinked to a steering veneer for each patch function
+ * instead of to the function itself (See shiva_module_numa_link()):
+ *
+ * veneer:	mrs	x16, tpidr_el0
+ *		adr	x17, node_off
+ *		ldr	x17, [x17]
+ *		ldr	w16, [x16, x17]		// rseq->node_id
+ *		cmp	w16, #SHIVA_NUMA_MAX_NODES
+ *		mov	w17, #SHIVA_NUMA_MAX_NODES
+ *		csel	w16, w17, w16, hs
+ *		adr	x17, delta
+ *		ldr	x17, [x17, w16, uxtw #3]
+ *		ldr	x16, target
+ *		add	x16, x16, x17
+ *		br	x16
+ * target:	.quad	<patch function within the image>
+ *
+ * The node comes from the rseq area that glibc registers for every
+ * thread at __rseq_offset from the thread pointer, which the kernel
+ * keeps up to date (node_id needs Linux 6.3, AT_RSEQ_FEATURE_SIZE). A
+ * thread that is migrated keeps running in the replica it entered, calls
+ * within a replica stay within it. Until the rseq offset is known, once
+ * LDSO has run (See shiva_module_numa_sync()), or if it never is, the
+ * veneers branch straight to the image.
+ */
+#include "shiva.h"
+#include <stddef.h>
+#include <sys/syscall.h>
+
+#define SHIVA_NUMA_VENEER_SIZE		64
+#define SHIVA_NUMA_VENEER_TARGET_OFF	48
+#define SHIVA_NUMA_RANGE		(64UL << 20) /* replicas are placed within +/- 64MB */
+#define SHIVA_NUMA_RSEQ_NODE_ID_OFF	20 /* offsetof(struct rseq, node_id) */
+#define SHIVA_NUMA_PLT_STUB_SIZE	8 /* ldr x17, got_entry; br x17 */
+
+#define RELOC_MASK(n)	((1U << n) - 1)
+
+#ifndef AT_RSEQ_FEATURE_SIZE
+#define AT_RSEQ_FEATURE_SIZE	27
+#endif
+
+#ifndef MPOL_BIND
+#define MPOL_BIND	2
+#endif
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE	(1 << 0)
+#define MPOL_F_ADDR	(1 << 1)
+#endif
+
+/*
+ * Head of the veneer mapping, the veneers follow it.
+ */
+struct shiva_numa_table {
+	int64_t node_off; /* of rseq->node_id from the thread pointer */
+	int64_t delta[SHIVA_NUMA_MAX_NODES + 1]; /* replica - text_mem, 0 for the image */
+};
+
+#define SHIVA_NUMA_VENEERS_OFF	ELF_PAGEALIGN(sizeof(struct shiva_numa_table), \
+				    SHIVA_NUMA_VENEER_SIZE)
+
+bool
+shiva_module_numa_enabled(void)
+{
+	char *env = getenv("SHIVA_MODULE_NUMA");
+
+	return env != NULL && strcmp(env, "1") == 0;
+}
+
+/*
+ * Parse a sysfs node list such as "0-1,4" into a mask.
+ */
+static uint64_t
+numa_online_nodes(void)
+{
+	char buf[256], *p, *end;
+	unsigned long lo, hi;
+	uint64_t mask = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open("/sys/devices/system/node/online", O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 1;
+	buf[n] = '\0';
+	for (p = buf; *p >= '0' && *p <= '9'; p = end + 1) {
+		lo = hi = strtoul(p, &end, 10);
+		if (*end == '-')
+			hi = strtoul(end + 1, &end, 10);
+		for (; lo <= hi && lo < SHIVA_NUMA_MAX_NODES; lo++)
+			mask |= 1UL << lo;
+		if (*end != ',')
+			break;
+	}
+	return mask;
+}
+
+static inline int64_t
+numa_sext(uint64_t v, int bits)
+{
+	return (int64_t)(v << (64 - bits)) >> (64 - bits);
+}
+
+static inline bool
+numa_fits(int64_t v, int bits)
+{
+	return v >= -(1L << (bits - 1)) && v < (1L << (bits - 1));
+}
+
+/*
+ * Re-encode the instruction at off within the replica copy of the
+ * image at text, if it reaches out of [text, text + len).
+ */
+static bool
+numa_fixup_insn(uint8_t *text, size_t len, uint8_t *copy, size_t off)
+{
+	uint64_t pc = (uint64_t)text + off, npc = (uint64_t)copy + off;
+	uint64_t lo = (uint64_t)text, hi = lo + len, target;
+	int64_t imm;
+	uint32_t insn;
+
+	memcpy(&insn, copy + off, sizeof(insn));
+	if ((insn & 0x7c000000) == 0x14000000) { /* b, bl */
+		target = pc + (numa_sext(insn & RELOC_MASK(26), 26) << 2);
+		if (target >= lo && target < hi)
+			return true;
+		imm = (int64_t)(target - npc) >> 2;
+		if (numa_fits(imm, 26) == false)
+			return false;
+		insn = (insn & ~RELOC_MASK(26)) | (imm & RELOC_MASK(26));
+	} else if ((insn & 0xff000010) == 0x54000000 || /* b.cond */
+	    (insn & 0x7e000000) == 0x34000000 || /* cbz, cbnz */
+	    (insn & 0x3b000000) == 0x18000000) { /* ldr (literal) */
+		target = pc + (numa_sext((insn >> 5) & RELOC_MASK(19), 19) << 2);
+		if (target >= lo && target < hi)
+			return true;
+		imm = (int64_t)(target - npc) >> 2;
+		if (numa_fits(imm, 19) == false)
+			return false;
+		insn = (insn & ~(RELOC_MASK(19) << 5)) | ((imm & RELOC_MASK(19)) << 5);
+	} else if ((insn & 0x7e000000) == 0x36000000) { /* tbz, tbnz */
+		target = pc + (numa_sext((insn >> 5) & RELOC_MASK(14), 14) << 2);
+		if (target >= lo && target < hi)
+			return true;
+		imm = (int64_t)(target - npc) >> 2;
+		if (numa_fits(imm, 14) == false)
+			return false;
+		insn = (insn & ~(RELOC_MASK(14) << 5)) | ((imm & RELOC_MASK(14)) << 5);
+	} else if ((insn & 0x1f000000) == 0x10000000) { /* adr, adrp */
+		imm = numa_sext((((insn >> 5) & RELOC_MASK(19)) << 2) | ((insn >> 29) & 3), 21);
+		if (insn & 0x80000000) {
+			target = ELF_PAGESTART(pc) + (imm << 12);
+			if (target >= lo && target < hi)
+				return true;
+			imm = (int64_t)(target - ELF_PAGESTART(npc)) >> 12;
+		} else {
+			target = pc + imm;
+			if (target >= lo && target < hi)
+				return true;
+			imm = (int64_t)(target - npc);
+		}
+		if (numa_fits(imm, 21) == false)
+			return false;
+		insn = (insn & ~((RELOC_MASK(19) << 5) | (3U << 29))) |
+		    ((imm & 3) << 29) | (((imm >> 2) & RELOC_MASK(19)) << 5);
+	} else {
+		return true;
+	}
+	memcpy(copy + off, &insn, sizeof(insn));
+	return true;
+}
+
+/*
+ * The code of the module can only be told from data within its text
+ * image by its sections, unless the assembler marked literal data
+ * within a code section with a $d mapping symbol.
+ */
+static bool
+numa_code_is_pure(struct shiva_module *linker)
+{
+	elf_symtab_iterator_t sym_iter;
+	struct elf_symbol symbol;
+	struct elf_section section;
+
+	elf_symtab_iterator_init(&linker->elfobj, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
+		if (symbol.name == NULL || strncmp(symbol.name, "$d", 2) != 0)
+			continue;
+		if (elf_section_by_index(&linker->elfobj, symbol.shndx, &section) == true &&
+		    (section.flags & SHF_EXECINSTR))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * An .eh_frame copy describes the code of its replica, since its FDEs
+ * are PC relative, but the personality and LSDA pointers of a CIE point
+ * out of the copy.
+ */
+static bool
+numa_eh_frame_is_portable(struct shiva_module *linker)
+{
+	uint8_t *mem = linker->eh_frame.mem;
+	size_t off = 0;
+	uint32_t len, id;
+	char *aug;
+
+	while (mem != NULL && off + 2 * sizeof(uint32_t) <= linker->eh_frame.size) {
+		memcpy(&len, mem + off, sizeof(len));
+		if (len == 0)
+			break;
+		memcpy(&id, mem + off + sizeof(len), sizeof(id));
+		if (id == 0) {
+			aug = (char *)mem + off + 2 * sizeof(uint32_t) + 1;
+			if (strchr(aug, 'P') != NULL || strchr(aug, 'L') != NULL)
+				return false;
+		}
+		off += sizeof(len) + len;
+	}
+	return true;
+}
+
+static bool
+numa_fixup_replica(struct shiva_module *linker, size_t map_size, uint8_t *copy)
+{
+	struct shiva_module_section_mapping *smap;
+	struct elf_section section;
+	uint32_t insn;
+	uint64_t off;
+	int64_t delta;
+	size_t i;
+
+	TAILQ_FOREACH(smap, &linker->tailq.section_maplist, _linkage) {
+		if (smap->map_attribute != LP_SECTION_TEXTSEGMENT ||
+		    strcmp(smap->name, ".plt") == 0)
+			continue;
+		if (elf_section_by_name(&linker->elfobj, smap->name, &section) == false ||
+		    (section.flags & SHF_EXECINSTR) == 0)
+			continue;
+		for (off = smap->offset; off + sizeof(uint32_t) <= smap->offset + smap->size;
+		    off += sizeof(uint32_t)) {
+			if (numa_fixup_insn(linker->text_mem, map_size, copy, off) == false) {
+				shiva_debug("%s+%#lx can't reach out of the replica at %p\n",
+				    smap->name, off - smap->offset, copy);
+				return false;
+			}
+		}
+	}
+	/*
+	 * ldr x17, got_entry; br x17 -> b <the stub within the image>; nop
+	 */
+	delta = ((int64_t)linker->text_mem - (int64_t)copy) >> 2;
+	for (i = 0; i < linker->plt_count; i++) {
+		off = linker->plt_off + i * SHIVA_NUMA_PLT_STUB_SIZE;
+		if (numa_fits(delta, 26) == false)
+			return false;
+		insn = 0x14000000 | (delta & RELOC_MASK(26));
+		memcpy(copy + off, &insn, sizeof(insn));
+		insn = 0xd503201f;
+		memcpy(copy + off + sizeof(insn), &insn, sizeof(insn));
+	}
+	return true;
+}
+
+static uint8_t *
+numa_map_near(struct shiva_ctx *ctx, uint8_t *near, size_t len)
+{
+	uint64_t lo, hi, base;
+	void *mem;
+
+	lo = (uint64_t)near > SHIVA_NUMA_RANGE ? (uint64_t)near - SHIVA_NUMA_RANGE : 0;
+	hi = (uint64_t)near + SHIVA_NUMA_RANGE;
+	if (shiva_maps_refresh(ctx) == false ||
+	    shiva_maps_find_gap(ctx, lo, hi, len, &base) == false)
+		return NULL;
+	mem = mmap((void *)base, len, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	if ((uint64_t)mem != base) {
+		munmap(mem, len);
+		return NULL;
+	}
+	return mem;
+}
+
+/*
+ * Called by module_link() once the text image of linker is complete,
+ * before it is made executable. map_size is the length of the mapping
+ * at linker->text_mem. A module that can't be replicated keeps running
+ * from its image alone.
+ */
+bool
+shiva_module_numa_replicate(struct shiva_module *linker, size_t map_size)
+{
+	struct shiva_ctx *ctx = linker->ctx;
+	struct shiva_numa_table *table;
+	shiva_auxv_iterator_t a_iter;
+	struct shiva_auxv_entry a_entry;
+	uint64_t nodes, nodemask, rseq_size = 0;
+	uint8_t *mem;
+	size_t size;
+	int node, home = -1;
+
+	if (shiva_module_numa_enabled() == false ||
+	    linker->mode != SHIVA_LINKING_MICROCODE_PATCH || linker->links.count == 0)
+		return true;
+	nodes = numa_online_nodes();
+	if ((nodes & (nodes - 1)) == 0) {
+		shiva_debug("Single NUMA node, not replicating '%s'\n",
+		    elf_pathname(&linker->elfobj));
+		return true;
+	}
+	shiva_auxv_iterator_init(ctx, &a_iter, NULL);
+	while (shiva_auxv_iterator_next(&a_iter, &a_entry) == SHIVA_ITER_OK) {
+		if (a_entry.type == AT_RSEQ_FEATURE_SIZE)
+			rseq_size = a_entry.value;
+	}
+	if (rseq_size < SHIVA_NUMA_RSEQ_NODE_ID_OFF + sizeof(uint32_t)) {
+		fprintf(stderr, "SHIVA_MODULE_NUMA: the kernel has no rseq node_id,"
+		    " not replicating '%s'\n", elf_pathname(&linker->elfobj));
+		return true;
+	}
+	if (TAILQ_EMPTY(&linker->tailq.transform_list) == false ||
+	    numa_code_is_pure(linker) == false ||
+	    numa_eh_frame_is_portable(linker) == false) {
+		fprintf(stderr, "SHIVA_MODULE_NUMA: '%s' can't be relocated as a copy,"
+		    " not replicating it\n", elf_pathname(&linker->elfobj));
+		return true;
+	}
+	if (syscall(SYS_get_mempolicy, &home, NULL, 0, linker->text_mem,
+	    MPOL_F_NODE|MPOL_F_ADDR) < 0)
+		home = -1;
+
+	size = ELF_PAGEALIGN(SHIVA_NUMA_VENEERS_OFF +
+	    linker->links.count * SHIVA_NUMA_VENEER_SIZE, PAGE_SIZE);
+	linker->numa.veneers = numa_map_near(ctx, linker->text_mem, size);
+	if (linker->numa.veneers == NULL) {
+		fprintf(stderr, "SHIVA_MODULE_NUMA: no room for the veneers of '%s'\n",
+		    elf_pathname(&linker->elfobj));
+		return true;
+	}
+	linker->numa.veneers_size = size;
+	linker->numa.veneers_used = SHIVA_NUMA_VENEERS_OFF;
+	table = (struct shiva_numa_table *)linker->numa.veneers;
+	linker->numa.vec = shiva_malloc(SHIVA_NUMA_MAX_NODES * sizeof(*linker->numa.vec));
+
+	for (node = 0; node < SHIVA_NUMA_MAX_NODES; node++) {
+		if ((nodes & (1UL << node)) == 0 || node == home)
+			continue;
+		mem = numa_map_near(ctx, linker->text_mem, map_size);
+		if (mem == NULL) {
+			fprintf(stderr, "SHIVA_MODULE_NUMA: no room for the node %d replica"
+			    " of '%s'\n", node, elf_pathname(&linker->elfobj));
+			continue;
+		}
+		nodemask = 1UL << node;
+		if (syscall(SYS_mbind, mem, map_size, MPOL_BIND, &nodemask,
+		    sizeof(nodemask) * 8 + 1, 0) < 0) {
+			shiva_debug("mbind(%p, node %d) failed: %s\n", mem, node,
+			    strerror(errno));
+			munmap(mem, map_size);
+			continue;
+		}
+		/*
+		 * The copy faults the pages in on node.
+		 */
+		memcpy(mem, linker->text_mem, linker->text_size);
+		if (numa_fixup_replica(linker, map_size, mem) == false) {
+			fprintf(stderr, "SHIVA_MODULE_NUMA: the node %d replica of '%s'"
+			    " is out of range\n", node, elf_pathname(&linker->elfobj));
+			munmap(mem, map_size);
+			continue;
+		}
+		__builtin___clear_cache((char *)mem, (char *)mem + linker->text_size);
+		if (mprotect(mem, map_size, PROT_READ|PROT_EXEC) < 0) {
+			perror("mprotect");
+			return false;
+		}
+		table->delta[node] = (int64_t)mem - (int64_t)linker->text_mem;
+		linker->numa.vec[linker->numa.count].mem = mem;
+		linker->numa.vec[linker->numa.count].node = node;
+		linker->numa.count++;
+		shiva_debug("Node %d replica of '%s' at %p\n", node,
+		    elf_pathname(&linker->elfobj), mem);
+	}
+	if (linker->numa.count == 0) {
+		munmap(linker->numa.veneers, linker->numa.veneers_size);
+		linker->numa.veneers = NULL;
+		return true;
+	}
+	/*
+	 * The patch cache only knows about the text and data images.
+	 */
+	shiva_module_cache_invalidate(linker, "text is replicated per NUMA node");
+	if ((linker->flags & SHIVA_MODULE_F_LIVE) == 0)
+		return shiva_post_linker_enable(ctx);
+	return true;
+}
+
+static void
+numa_write_veneer(struct shiva_module *linker, uint8_t *veneer)
+{
+	uint8_t *table = linker->numa.veneers;
+	uint32_t code[SHIVA_NUMA_VENEER_TARGET_OFF / sizeof(uint32_t)];
+	int64_t off;
+	size_t i;
+
+	memset(code, 0, sizeof(code));
+	if (linker->numa.ready == false) {
+		code[0] = 0x58000000 | ((SHIVA_NUMA_VENEER_TARGET_OFF >> 2) << 5) | 16;
+		code[1] = 0xd61f0200; /* br x16 */
+		memcpy(veneer, code, 2 * sizeof(uint32_t));
+		return;
+	}
+	code[0] = 0xd53bd050; /* mrs x16, tpidr_el0 */
+	off = table + offsetof(struct shiva_numa_table, node_off) - (veneer + 4);
+	code[1] = 0x10000011 | ((off & 3) << 29) | (((off >> 2) & RELOC_MASK(19)) << 5);
+	code[2] = 0xf9400231; /* ldr x17, [x17] */
+	code[3] = 0xb8716a10; /* ldr w16, [x16, x17] */
+	code[4] = 0x7100001f | (SHIVA_NUMA_MAX_NODES << 10) | (16 << 5); /* cmp w16, #N */
+	code[5] = 0x52800011 | (SHIVA_NUMA_MAX_NODES << 5); /* mov w17, #N */
+	code[6] = 0x1a902230; /* csel w16, w17, w16, hs */
+	off = table + offsetof(struct shiva_numa_table, delta) - (veneer + 28);
+	code[7] = 0x10000011 | ((off & 3) << 29) | (((off >> 2) & RELOC_MASK(19)) << 5);
+	code[8] = 0xf8705a31; /* ldr x17, [x17, w16, uxtw #3] */
+	i = (SHIVA_NUMA_VENEER_TARGET_OFF - 36) >> 2;
+	code[9] = 0x58000000 | (i << 5) | 16; /* ldr x16, target */
+	code[10] = 0x8b110210; /* add x16, x16, x17 */
+	code[11] = 0xd61f0200; /* br x16 */
+	memcpy(veneer, code, sizeof(code));
+	return;
+}
+
+/*
+ * Called by patch_link_call_vaddr() with the address within the image
+ * that the calls and the detour of link go to, returns the address of
+ * the steering veneer of link, or target_vaddr if the module has no
+ * replicas.
+ */
+uint64_t
+shiva_module_numa_link(struct shiva_module *linker, struct shiva_module_link *link,
+    uint64_t target_vaddr)
+{
+	uint8_t *veneer;
+
+	if (linker->numa.veneers == NULL)
+		return target_vaddr;
+	if (link->numa_veneer != 0)
+		return link->numa_veneer;
+	if (linker->numa.veneers_used + SHIVA_NUMA_VENEER_SIZE > linker->numa.veneers_size)
+		return target_vaddr;
+	veneer = linker->numa.veneers + linker->numa.veneers_used;
+	linker->numa.veneers_used += SHIVA_NUMA_VENEER_SIZE;
+	memcpy(veneer + SHIVA_NUMA_VENEER_TARGET_OFF, &target_vaddr, sizeof(uint64_t));
+	numa_write_veneer(linker, veneer);
+	link->numa_veneer = (uint64_t)veneer;
+	shiva_debug("Calls to %s are steered by %p\n", link->name, veneer);
+	return link->numa_veneer;
+}
+
+/*
+ * Make the veneers executable before anything is relinked to them.
+ */
+bool
+shiva_module_numa_seal(struct shiva_module *linker)
+{
+	if (linker->numa.veneers == NULL)
+		return true;
+	__builtin___clear_cache((char *)linker->numa.veneers,
+	    (char *)linker->numa.veneers + linker->numa.veneers_used);
+	if (mprotect(linker->numa.veneers, linker->numa.veneers_size,
+	    PROT_READ|PROT_EXEC) < 0) {
+		perror("mprotect");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Runs once LDSO has loaded the shared objects: copy the delayed
+ * relocations that shiva_post_linker_resolve() wrote into the image
+ * into each replica, and have the veneers steer once the rseq area of
+ * glibc is found.
+ */
+bool
+shiva_module_numa_sync(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	struct shiva_module_delayed_reloc *delay_rel;
+	struct shiva_numa_table *table;
+	struct elf_symbol symbol;
+	uint64_t text = (uint64_t)linker->text_mem, base;
+	size_t i, len = ELF_PAGEALIGN(linker->text_size, PAGE_SIZE);
+	int64_t rseq_off;
+	uint32_t rseq_size;
+	uint8_t *veneer;
+
+	if (linker->numa.veneers == NULL)
+		return true;
+	for (i = 0; i < linker->numa.count && (linker->flags & SHIVA_MODULE_F_LIVE) == 0; i++) {
+		if (mprotect(linker->numa.vec[i].mem, len, PROT_READ|PROT_WRITE) < 0) {
+			perror("mprotect");
+			return false;
+		}
+		TAILQ_FOREACH(delay_rel, &linker->tailq.delayed_reloc_list, _linkage) {
+			if (delay_rel->rel_addr < text || delay_rel->rel_addr >= text + linker->text_size)
+				continue;
+			memcpy(linker->numa.vec[i].mem + (delay_rel->rel_addr - text),
+			    &delay_rel->symval_final, sizeof(uint64_t));
+		}
+		__builtin___clear_cache((char *)linker->numa.vec[i].mem,
+		    (char *)linker->numa.vec[i].mem + linker->text_size);
+		if (mprotect(linker->numa.vec[i].mem, len, PROT_READ|PROT_EXEC) < 0) {
+			perror("mprotect");
+			return false;
+		}
+	}
+	if (linker->numa.ready == true)
+		return true;
+	if (shiva_link_map_resolve_symbol(ctx, "__rseq_offset", &symbol, &base) == false) {
+		shiva_debug("No __rseq_offset in the target, calls aren't steered\n");
+		return true;
+	}
+	memcpy(&rseq_off, (void *)(base + symbol.value), sizeof(rseq_off));
+	if (shiva_link_map_resolve_symbol(ctx, "__rseq_size", &symbol, &base) == false)
+		return true;
+	memcpy(&rseq_size, (void *)(base + symbol.value), sizeof(rseq_size));
+	/*
+	 * glibc registers no rseq area with glibc.pthread.rseq=0, and the
+	 * node_id of an area that it registered isn't updated
+	 */
+	if (rseq_size < SHIVA_NUMA_RSEQ_NODE_ID_OFF + sizeof(uint32_t)) {
+		shiva_debug("rseq area of %u bytes has no node_id\n", rseq_size);
+		return true;
+	}
+	if (mprotect(linker->numa.veneers, linker->numa.veneers_size,
+	    PROT_READ|PROT_WRITE) < 0) {
+		perror("mprotect");
+		return false;
+	}
+	table = (struct shiva_numa_table *)linker->numa.veneers;
+	table->node_off = rseq_off + SHIVA_NUMA_RSEQ_NODE_ID_OFF;
+	linker->numa.ready = true;
+	for (veneer = linker->numa.veneers + SHIVA_NUMA_VENEERS_OFF;
+	    veneer < linker->numa.veneers + linker->numa.veneers_used;
+	    veneer += SHIVA_NUMA_VENEER_SIZE)
+		numa_write_veneer(linker, veneer);
+	shiva_debug("Calls into '%s' are steered to %zu replicas, rseq at tp%+ld\n",
+	    elf_pathname(&linker->elfobj), linker->numa.count, rseq_off);
+	/*
+	 * The veneers of a live patch are yet to be allocated, and are
+	 * sealed along with the island.
+	 */
+	if (linker->flags & SHIVA_MODULE_F_LIVE)
+		return true;
+	return shiva_module_numa_seal(linker);
+}
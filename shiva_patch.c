@@ -0,0 +1,366 @@
+/*
+ * shiva_patch.c - Patch transactions.
+ *
+ * Relinking the target executable rewrites thousands of individual
+ * instructions. Rather than calling shiva_trace_write() for each one,
+ * which walks the maps list and issues an mprotect pair per write, the
+ * writes are queued up and applied at once: the queue is sorted by
+ * address, writes that land on the same (or adjacent) pages of a mapping
+ * are grouped into a single run, each run is made writable once, and
+ * the instruction-cache is flushed once over the entire touched range.
+ *
+ * shiva_patch_txn_commit_atomic() is for targets whose threads are
+ * already running. Each write must then be a single naturally aligned
+ * store, and both the instruction that it replaces and the one that it
+ * writes must be among those that the ARM ARM allows to be modified
+ * concurrently with their execution (b, bl, nop, isb, brk, svc, hvc and
+ * smc), so that a thread fetching it sees either the old or the new
+ * instruction. shiva_patch_txn_atomic_ok() tells whether a transaction
+ * can be committed that way.
+ */
+#include "shiva.h"
+#include <sys/syscall.h>
+
+#define SHIVA_PATCH_TXN_INITIAL	256
+
+#ifndef MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE		(1 << 5)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE	(1 << 6)
+#endif
+
+void
+shiva_patch_txn_begin(struct shiva_ctx *ctx, struct shiva_patch_txn *txn)
+{
+	memset(txn, 0, sizeof(*txn));
+	txn->ctx = ctx;
+	return;
+}
+
+/*
+ * Queue len bytes from src to be written at addr. The data is copied,
+ * so src may be a stack variable.
+ */
+bool
+shiva_patch_txn_write(struct shiva_patch_txn *txn, uint64_t addr, const void *src,
+    size_t len, shiva_error_t *error)
+{
+	struct shiva_patch_write *w;
+
+	if (len == 0 || len > SHIVA_PATCH_WRITE_MAX) {
+		shiva_error_set(error, "patch write at %#lx of %zu bytes is not supported\n",
+		    addr, len);
+		return false;
+	}
+	if (txn->count == txn->size) {
+		txn->size = txn->size == 0 ? SHIVA_PATCH_TXN_INITIAL : txn->size << 1;
+		txn->writes = shiva_realloc(txn->writes, txn->size * sizeof(*txn->writes));
+	}
+	w = &txn->writes[txn->count];
+	w->addr = addr;
+	w->len = len;
+	w->seq = txn->count++;
+	memcpy(w->data, src, len);
+	return true;
+}
+
+/*
+ * Queue into undo the writes that revert txn, which must not have been
+ * committed yet: for each write of txn the bytes that are there now. If
+ * base is not NULL it's the undo transaction of a patch that txn will
+ * replace, so its bytes stand in for the ones that patch wrote.
+ */
+bool
+shiva_patch_txn_undo(struct shiva_patch_txn *txn, struct shiva_patch_txn *base,
+    struct shiva_patch_txn *undo, shiva_error_t *error)
+{
+	struct shiva_patch_write *w, *b;
+	uint8_t data[SHIVA_PATCH_WRITE_MAX];
+	uint64_t lo, hi;
+	size_t i, j;
+
+	shiva_patch_txn_begin(txn->ctx, undo);
+	for (i = 0; i < txn->count; i++) {
+		w = &txn->writes[i];
+		memcpy(data, (void *)w->addr, w->len);
+		for (j = 0; base != NULL && j < base->count; j++) {
+			b = &base->writes[j];
+			lo = b->addr > w->addr ? b->addr : w->addr;
+			hi = b->addr + b->len < w->addr + w->len ? b->addr + b->len :
+			    w->addr + w->len;
+			if (lo < hi)
+				memcpy(&data[lo - w->addr], &b->data[lo - b->addr], hi - lo);
+		}
+		if (shiva_patch_txn_write(undo, w->addr, data, w->len, error) == false) {
+			shiva_patch_txn_abort(undo);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Queue every write of src into dst, after those already in dst. src is
+ * left as it is.
+ */
+bool
+shiva_patch_txn_append(struct shiva_patch_txn *dst, struct shiva_patch_txn *src,
+    shiva_error_t *error)
+{
+	struct shiva_patch_write *w;
+	size_t i;
+
+	for (i = 0; i < src->count; i++) {
+		w = &src->writes[i];
+		if (shiva_patch_txn_write(dst, w->addr, w->data, w->len, error) == false)
+			return false;
+	}
+	return true;
+}
+
+void
+shiva_patch_txn_abort(struct shiva_patch_txn *txn)
+{
+	free(txn->writes);
+	txn->writes = NULL;
+	txn->count = txn->size = 0;
+	return;
+}
+
+static int
+patch_write_cmp(const void *a, const void *b)
+{
+	const struct shiva_patch_write *x = a;
+	const struct shiva_patch_write *y = b;
+
+	if (x->addr != y->addr)
+		return (x->addr > y->addr) - (x->addr < y->addr);
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static inline void
+patch_write_apply(struct shiva_patch_write *w, bool atomic)
+{
+	uint32_t v32;
+	uint64_t v64;
+
+	if (atomic == false) {
+		memcpy((void *)w->addr, w->data, w->len);
+	} else if (w->len == sizeof(v32)) {
+		memcpy(&v32, w->data, sizeof(v32));
+		__atomic_store_n((uint32_t *)w->addr, v32, __ATOMIC_RELAXED);
+	} else {
+		memcpy(&v64, w->data, sizeof(v64));
+		__atomic_store_n((uint64_t *)w->addr, v64, __ATOMIC_RELAXED);
+	}
+	return;
+}
+
+static bool
+patch_txn_apply(struct shiva_patch_txn *txn, bool atomic, shiva_error_t *error)
+{
+	struct shiva_mmap_entry map;
+	struct shiva_patch_write *w;
+	uint64_t run_start, run_end, end;
+	uint64_t lo = ~0UL, hi = 0;
+	size_t i, j, k, runs = 0;
+	bool res = true;
+
+	if (txn->count == 0)
+		goto done;
+
+	qsort(txn->writes, txn->count, sizeof(*txn->writes), patch_write_cmp);
+	for (i = 0; i < txn->count; i = j) {
+		w = &txn->writes[i];
+		if (shiva_maps_entry_by_addr(txn->ctx, w->addr, &map) == false) {
+			shiva_error_set(error, "patch write at %#lx failed: "
+			    "cannot find memory protection\n", w->addr);
+			res = false;
+			goto done;
+		}
+		run_start = ELF_PAGESTART(w->addr);
+		run_end = ELF_PAGEALIGN(w->addr + w->len, PAGE_SIZE);
+		/*
+		 * Extend the run over each following write that lands within
+		 * the run, or on the page right after it, so long as it's in
+		 * the same mapping and therefore has the same protection.
+		 */
+		for (j = i + 1; j < txn->count; j++) {
+			w = &txn->writes[j];
+			if (ELF_PAGESTART(w->addr) > run_end)
+				break;
+			if (w->addr >= map.base + map.len)
+				break;
+			end = ELF_PAGEALIGN(w->addr + w->len, PAGE_SIZE);
+			if (end > run_end)
+				run_end = end;
+		}
+		if (mprotect((void *)run_start, run_end - run_start, map.prot|PROT_WRITE) < 0) {
+			shiva_error_set(error, "patch write at %#lx failed: "
+			    "mprotect failure: %s\n", run_start, strerror(errno));
+			res = false;
+			goto done;
+		}
+		for (k = i; k < j; k++)
+			patch_write_apply(&txn->writes[k], atomic);
+		if (mprotect((void *)run_start, run_end - run_start, map.prot) < 0) {
+			shiva_error_set(error, "patch write at %#lx failed: "
+			    "mprotect failure: %s\n", run_start, strerror(errno));
+			res = false;
+			goto done;
+		}
+		SHIVA_STATS_ADD(txn->ctx, SHIVA_STATS_MPROTECT_PAGES,
+		    ((run_end - run_start) / PAGE_SIZE) * 2);
+		if (txn->writes[i].addr < lo)
+			lo = txn->writes[i].addr;
+		for (k = i; k < j; k++) {
+			if (txn->writes[k].addr + txn->writes[k].len > hi)
+				hi = txn->writes[k].addr + txn->writes[k].len;
+		}
+		runs++;
+	}
+	shiva_debug("Applied %zu patch writes in %zu runs: %#lx - %#lx\n",
+	    txn->count, runs, lo, hi);
+	SHIVA_STATS_ADD(txn->ctx, SHIVA_STATS_PATCH_WRITES, txn->count);
+done:
+	if (hi > lo)
+		__builtin___clear_cache((char *)lo, (char *)hi);
+	shiva_patch_txn_abort(txn);
+	return res;
+}
+
+/*
+ * Apply every queued write and release the transaction. On failure some
+ * runs may already have been applied, just as a failed sequence of
+ * shiva_trace_write() calls would leave the earlier writes in place.
+ */
+bool
+shiva_patch_txn_commit(struct shiva_patch_txn *txn, shiva_error_t *error)
+{
+	return patch_txn_apply(txn, false, error);
+}
+
+/*
+ * Make every thread of the process execute a context synchronizing
+ * event, so that none of them can still be running instructions that
+ * were fetched before the instruction cache was invalidated. Returns
+ * false if the kernel doesn't support the SYNC_CORE membarrier (Linux
+ * 4.16 and newer).
+ */
+bool
+shiva_patch_sync_cores(void)
+{
+	static int registered;
+
+	if (registered == 0) {
+		registered = syscall(SYS_membarrier,
+		    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0 ? 1 : -1;
+		shiva_debug("SYNC_CORE membarrier %s\n", registered > 0 ?
+		    "registered" : "is not supported");
+	}
+	if (registered < 0)
+		return false;
+	return syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0;
+}
+
+#if __aarch64__
+/*
+ * Is insn one of the instructions that may be modified while another
+ * thread executes it? See B2.2.5 "Concurrent modification and execution
+ * of instructions" of the ARM ARM.
+ */
+static bool
+patch_insn_concurrent_ok(uint32_t insn)
+{
+	if ((insn & 0x7c000000) == 0x14000000)	/* b, bl */
+		return true;
+	if (insn == 0xd503201f)			/* nop */
+		return true;
+	if ((insn & 0xfffff0ff) == 0xd50330df)	/* isb */
+		return true;
+	if ((insn & 0xffe0001f) == 0xd4200000)	/* brk */
+		return true;
+	if ((insn & 0xffe0001c) == 0xd4000000 && (insn & 0x3) != 0) /* svc, hvc, smc */
+		return true;
+	return false;
+}
+#endif
+
+/*
+ * Can every write of txn be applied while other threads execute the code
+ * being written? The old instruction is read from the target, a write
+ * that follows another one to the same address replaces the instruction
+ * of that write, which is checked as well.
+ */
+bool
+shiva_patch_txn_atomic_ok(struct shiva_patch_txn *txn, shiva_error_t *error)
+{
+	struct shiva_mmap_entry map;
+	struct shiva_patch_write *w;
+#if __aarch64__
+	uint32_t old, new;
+#endif
+	size_t i;
+
+	for (i = 0; i < txn->count; i++) {
+		w = &txn->writes[i];
+		if (w->len != sizeof(uint32_t) && w->len != sizeof(uint64_t))
+			goto unsupported;
+		if ((w->addr & (w->len - 1)) != 0)
+			goto unsupported;
+		if (shiva_maps_entry_by_addr(txn->ctx, w->addr, &map) == false) {
+			shiva_error_set(error, "patch write at %#lx failed: "
+			    "cannot find memory protection\n", w->addr);
+			return false;
+		}
+		if ((map.prot & PROT_EXEC) == 0)
+			continue;
+#if __aarch64__
+		if (w->len != sizeof(new))
+			goto unsupported;
+		memcpy(&old, (void *)w->addr, sizeof(old));
+		memcpy(&new, w->data, sizeof(new));
+		if (patch_insn_concurrent_ok(old) == false ||
+		    patch_insn_concurrent_ok(new) == false) {
+			shiva_error_set(error, "patch write at %#lx replaces %#x with %#x, "
+			    "which cannot be done atomically\n", w->addr, old, new);
+			return false;
+		}
+#endif
+	}
+	return true;
+unsupported:
+	shiva_error_set(error, "patch write at %#lx of %u bytes cannot be applied "
+	    "atomically\n", w->addr, w->len);
+	return false;
+}
+
+/*
+ * Like shiva_patch_txn_commit(), but safe while other threads execute
+ * the code being written: each write is a single atomic store, the
+ * instruction cache is invalidated across the inner shareable domain
+ * by __builtin___clear_cache(), and finally every core is synchronized
+ * with a membarrier. Nothing is written if a queued write fails
+ * shiva_patch_txn_atomic_ok(), or the membarrier isn't available.
+ */
+bool
+shiva_patch_txn_commit_atomic(struct shiva_patch_txn *txn, shiva_error_t *error)
+{
+	if (shiva_patch_txn_atomic_ok(txn, error) == false)
+		goto fail;
+	if (shiva_patch_sync_cores() == false) {
+		shiva_error_set(error, "membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE) "
+		    "failed: %s\n", strerror(errno));
+		goto fail;
+	}
+	if (patch_txn_apply(txn, true, error) == false)
+		return false;
+	if (shiva_patch_sync_cores() == false) {
+		shiva_error_set(error, "membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE) "
+		    "failed: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+fail:
+	shiva_patch_txn_abort(txn);
+	return false;
+}
@@ -0,0 +1,141 @@
+/*
+ * shiva_perf_map.c - Symbolizing patch code for perf(1).
+ *
+ * The text of each patch module, the splice copies of target functions
+ * and the stubs that they call through all live in anonymous mappings,
+ * so perf has nothing to attribute samples within them to. With
+ * SHIVA_PERF_MAP=1 every one of them is written to /tmp/perf-<pid>.map
+ * once it is at its final address, one "START SIZE name" line each, in
+ * hex, which is the format that perf reads for JIT'd code.
+ *
+ * The same file is appended to by each module that is loaded, including
+ * those that are linked into a running target.
+ */
+#include "shiva.h"
+
+static bool
+shiva_perf_map_enabled(void)
+{
+	char *env = getenv("SHIVA_PERF_MAP");
+
+	return env != NULL && strcmp(env, "1") == 0;
+}
+
+static void
+perf_map_entry(FILE *fp, uint64_t addr, uint64_t size, const char *name,
+    const char *suffix)
+{
+	if (size == 0)
+		return;
+	fprintf(fp, "%lx %lx %s%s\n", addr, size, name, suffix);
+	return;
+}
+
+/*
+ * A function with several splices is copied once by its primary splice,
+ * and the copies are laid out back to back in front of the module .text
+ * (See shiva_tf_process_transforms), so each one ends where the next
+ * one begins.
+ */
+static void
+perf_map_splices(FILE *fp, struct shiva_module *linker)
+{
+	struct shiva_transform *transform, *next;
+	uint64_t end;
+
+	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
+		if (transform->type != SHIVA_TRANSFORM_SPLICE_FUNCTION ||
+		    transform->splice.primary != transform ||
+		    (transform->flags & SHIVA_TRANSFORM_F_INPLACE))
+			continue;
+		end = linker->tf_text_offset;
+		for (next = TAILQ_NEXT(transform, _linkage); next != NULL;
+		    next = TAILQ_NEXT(next, _linkage)) {
+			if (next->type == SHIVA_TRANSFORM_SPLICE_FUNCTION &&
+			    next->splice.primary == next &&
+			    (next->flags & SHIVA_TRANSFORM_F_INPLACE) == 0) {
+				end = next->segment_offset;
+				break;
+			}
+		}
+		if (end < transform->segment_offset)
+			continue;
+		perf_map_entry(fp, linker->text_vaddr + transform->segment_offset,
+		    end - transform->segment_offset, transform->source_symbol.name, "");
+	}
+	return;
+}
+
+static void
+perf_map_symbols(FILE *fp, struct shiva_module *linker)
+{
+	elf_symtab_iterator_t sym_iter;
+	struct elf_symbol symbol;
+	uint64_t addr;
+
+	elf_symtab_iterator_init(&linker->elfobj, &sym_iter);
+	while (elf_symtab_iterator_next(&sym_iter, &symbol) == ELF_ITER_OK) {
+		if (symbol.type != STT_FUNC || symbol.shndx == SHN_UNDEF ||
+		    symbol.name == NULL || symbol.name[0] == '\0')
+			continue;
+		/*
+		 * Only the splice copy of these ever runs.
+		 */
+		if (shiva_tf_splice_target(symbol.name) != NULL)
+			continue;
+		addr = linker->text_vaddr + symbol.value;
+		if (linker->flags & SHIVA_MODULE_F_TRANSFORM)
+			addr += linker->tf_text_offset;
+		perf_map_entry(fp, addr, symbol.size, symbol.name, "");
+	}
+	return;
+}
+
+/*
+ * Write the perf map entries of a linked module. A module that was
+ * loaded from the patch cache has no symbol table at hand, its text is
+ * written as a single entry.
+ */
+bool
+shiva_perf_map_write(struct shiva_module *linker, const char *path)
+{
+	struct shiva_module_plt_entry *plt;
+	char map_path[PATH_MAX];
+	const char *name;
+	FILE *fp;
+
+	if (shiva_perf_map_enabled() == false)
+		return true;
+	snprintf(map_path, sizeof(map_path), "/tmp/perf-%d.map", getpid());
+	fp = fopen(map_path, "a");
+	if (fp == NULL) {
+		perror("fopen");
+		return false;
+	}
+	name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+	if (linker->elfobj.mem == NULL) {
+		perf_map_entry(fp, linker->text_vaddr, linker->text_size, name, " [cached]");
+		goto done;
+	}
+	perf_map_symbols(fp, linker);
+	perf_map_splices(fp, linker);
+	TAILQ_FOREACH(plt, &linker->tailq.plt_list, _linkage) {
+		if (linker->plt_count == 0)
+			break;
+		perf_map_entry(fp, plt->vaddr, linker->plt_size / linker->plt_count,
+		    plt->symname, "@plt");
+	}
+	if (linker->island.mem != NULL)
+		perf_map_entry(fp, (uint64_t)linker->island.mem, linker->island.used,
+		    name, " [veneers]");
+	if (linker->lazy.mem != NULL)
+		perf_map_entry(fp, (uint64_t)linker->lazy.mem, linker->lazy.size,
+		    name, " [lazy stubs]");
+done:
+	if (fclose(fp) != 0) {
+		perror("fclose");
+		return false;
+	}
+	shiva_debug("Wrote the perf map entries of %s to %s\n", path, map_path);
+	return true;
+}
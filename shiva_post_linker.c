@@ -1,5 +1,182 @@
 #include "shiva.h"
 
+#define SHIVA_POST_LINKER_LIBS	32
+
+struct shiva_post_linker_lib {
+	const char *so_path;
+	uint64_t base;
+};
+
+static bool
+post_linker_so_base(struct shiva_ctx *ctx, struct shiva_post_linker_lib *libs,
+    size_t *lib_count, const char *so_path, uint64_t *base)
+{
+	size_t i;
+
+	for (i = 0; i < *lib_count; i++) {
+		if (strcmp(libs[i].so_path, so_path) == 0) {
+			*base = libs[i].base;
+			return true;
+		}
+	}
+	if (shiva_link_map_so_base(ctx, so_path, base) == false) {
+		shiva_debug("'%s' not found in the link_map, searching the maps\n", so_path);
+		if (shiva_maps_refresh(ctx) == false ||
+		    shiva_maps_get_so_base(ctx, (char *)so_path, base) == false)
+			return false;
+	}
+	shiva_debug("Base of '%s': %#lx\n", so_path, *base);
+	if (*lib_count < SHIVA_POST_LINKER_LIBS) {
+		libs[*lib_count].so_path = so_path;
+		libs[*lib_count].base = *base;
+		(*lib_count)++;
+	}
+	return true;
+}
+
+/*
+ * Apply the delayed relocations of a single module against the shared
+ * objects that LDSO has mapped. Also used by shiva_live.c, where LDSO
+ * finished long before the patch was linked.
+ *
+ * The base of each shared object is looked up once. The relocations
+ * that land in the module text are applied together, the text being
+ * writable only for the pages they span and only while they are being
+ * written. The module text stays read-only while LDSO runs.
+ *
+ * Relocations against an STT_GNU_IFUNC get the implementation that its
+ * resolver selects, which can only be run now that its object has been
+ * relocated.
+ */
+bool
+shiva_post_linker_resolve(struct shiva_ctx *ctx, struct shiva_module *linker)
+{
+	struct shiva_module_delayed_reloc *delay_rel;
+	struct shiva_post_linker_lib libs[SHIVA_POST_LINKER_LIBS];
+	struct elf_symbol symbol;
+	size_t lib_count = 0;
+	uint64_t base, text = (uint64_t)linker->text_mem;
+	uint64_t text_end = text + linker->text_size, lo = ~0UL, hi = 0;
+
+	if (TAILQ_EMPTY(&linker->tailq.delayed_reloc_list))
+		return true;
+	/*
+	 * Resolve each so_path first, so that the text is opened up only
+	 * once every value is known.
+	 */
+	TAILQ_FOREACH(delay_rel, &linker->tailq.delayed_reloc_list, _linkage) {
+		if (delay_rel->flags & SHIVA_DELAYED_RELOC_F_BY_NAME) {
+			if (shiva_link_map_resolve_symbol(ctx, delay_rel->symname,
+			    &symbol, &base) == false) {
+				fprintf(stderr, "Failed to resolve '%s' in the loaded shared objects\n",
+				    delay_rel->symname);
+				return false;
+			}
+			delay_rel->symval_final = symbol.value + base;
+			if (symbol.type == STT_GNU_IFUNC)
+				delay_rel->flags |= SHIVA_DELAYED_RELOC_F_IFUNC;
+		} else if (delay_rel->flags & SHIVA_DELAYED_RELOC_F_TARGET) {
+			delay_rel->symval_final = delay_rel->symval +
+			    (elf_type(linker->target_elfobj) == ET_EXEC ? 0 : linker->target_base);
+		} else if (post_linker_so_base(ctx, libs, &lib_count, delay_rel->so_path,
+		    &base) == true) {
+			delay_rel->symval_final = delay_rel->symval + base;
+		} else {
+			fprintf(stderr, "Failed to locate base address of loaded module '%s'\n",
+			    delay_rel->so_path);
+			return false;
+		}
+		if (delay_rel->flags & SHIVA_DELAYED_RELOC_F_IFUNC) {
+			delay_rel->symval_final = shiva_link_map_ifunc_resolve(ctx,
+			    delay_rel->symval_final);
+			if (delay_rel->symval_final == 0) {
+				fprintf(stderr, "IFUNC resolver of '%s' failed\n", delay_rel->symname);
+				return false;
+			}
+		}
+		if (delay_rel->rel_addr >= text && delay_rel->rel_addr < text_end) {
+			if (delay_rel->rel_addr < lo)
+				lo = delay_rel->rel_addr;
+			if (delay_rel->rel_addr + sizeof(uint64_t) > hi)
+				hi = delay_rel->rel_addr + sizeof(uint64_t);
+		}
+	}
+	if (hi > lo) {
+		lo = ELF_PAGESTART(lo);
+		hi = ELF_PAGEALIGN(hi, PAGE_SIZE);
+		if (mprotect((void *)lo, hi - lo, PROT_READ|PROT_WRITE) < 0) {
+			perror("mprotect");
+			return false;
+		}
+	}
+	TAILQ_FOREACH(delay_rel, &linker->tailq.delayed_reloc_list, _linkage) {
+		/*
+		 * Apply the final relocation value on our delayed
+		 * relocation entry.
+		 */
+		*(uint64_t *)delay_rel->rel_unit = delay_rel->symval_final;
+		shiva_debug("%#lx:rel_unit(%s) = %#lx\n", delay_rel->rel_addr,
+		    delay_rel->symname, delay_rel->symval_final);
+	}
+	if (hi > lo) {
+		if (mprotect((void *)lo, hi - lo, PROT_READ|PROT_EXEC) < 0) {
+			fprintf(stderr, "shiva_post_linker() Unable to mark text as read-only\n");
+			perror("mprotect");
+			return false;
+		}
+		__builtin___clear_cache((char *)lo, (char *)hi);
+	}
+	return true;
+}
+
+/*
+ * Have LDSO transfer control to shiva_post_linker(), rather than to the
+ * entry point of the target, once it has loaded and relocated the target
+ * and its shared libraries. Used for the delayed relocations of modules,
+ * and for the PLTGOT hooks of shiva_trace, which both need the final
+ * state that LDSO leaves behind.
+ */
+bool
+shiva_post_linker_enable(struct shiva_ctx *ctx)
+{
+	shiva_auxv_iterator_t a_iter;
+	struct shiva_auxv_entry a_entry;
+
+	if (shiva_auxv_iterator_init(ctx, &a_iter,
+	    ctx->ulexec.auxv.vector) == false) {
+		fprintf(stderr, "shiva_auxv_iterator_init failed\n");
+		return false;
+	}
+	while (shiva_auxv_iterator_next(&a_iter, &a_entry) == SHIVA_ITER_OK) {
+		if (a_entry.type == AT_ENTRY) {
+			uint64_t entry;
+
+			if (a_entry.value == (uint64_t)&shiva_post_linker)
+				break;
+
+			/*
+			 * IMPORTANT NOTE:
+			 * In our aarch64 implementation, shiva is an ET_EXEC
+			 * so we can pass a function address as absolute. In
+			 * other implementations we would have to create a macro
+			 * to entry = GET_RIP() - &shiva_post_linker
+			 * -- In aarch64 Shiva we can just pass &shiva_post_linker address
+			 *  directly.
+			 */
+			shiva_debug("Enabling post linker, setting AT_ENTRY to %#lx\n",
+			    &shiva_post_linker);
+			entry = (uint64_t)&shiva_post_linker;
+			if (shiva_auxv_set_value(&a_iter, entry) == false) {
+				fprintf(stderr, "shiva_auxv_set_value failed (Setting %#lx)\n", entry);
+				return false;
+			}
+			break;
+		}
+	}
+	return true;
+}
+
+
 /*
  * The aarch64 post linker in Shiva works by hooking AT_ENTRY early on (In
  * shiva_module.c:apply_relocation), so that it is set to &shiva_post_linker()
@@ -14,8 +191,8 @@
  * 0x100124c:	br	x21  ; jump to _start() has been hooked to jump to &shiva_post_linker
  *
  * Control is transferred to our function below, which runs after ld-linux.so has loaded
- * and linked it's libaries, therefore we use shiva_maps_get_so_base() to acquire the
- * base address of the library for the symbol we are resolving. We resolve the symbol
+ * and linked it's libaries, therefore we take the base address of the library for the
+ * symbol we are resolving from the link_map of the RTLD. We resolve the symbol
  * value by applying the delayed relocation value to the rel_unit.
  *
  * Once we are done, we reset $x21 directly with the value of the real &_start.
@@ -29,43 +206,38 @@
 void
 shiva_post_linker(void)
 {
-	static struct shiva_module_delayed_reloc *delay_rel;
-	static uint64_t base;
-
-	TAILQ_FOREACH(delay_rel, &ctx_global->module.runtime->tailq.delayed_reloc_list, _linkage) {
+	static struct shiva_module *linker;
+	shiva_error_t error;
 
-		if (shiva_maps_get_so_base(ctx_global, delay_rel->so_path, &base) == false) {
-			fprintf(stderr, "Failed to locate base address of loaded module '%s'\n",
-			    delay_rel->so_path);
+	/*
+	 * LDSO has mapped and relocated the shared objects by now, their
+	 * bases are taken from its link_map.
+	 */
+	TAILQ_FOREACH(linker, &ctx_global->module.list, _linkage) {
+		if (shiva_post_linker_resolve(ctx_global, linker) == false)
+			exit(EXIT_FAILURE);
+		if (shiva_module_numa_sync(ctx_global, linker) == false)
+			exit(EXIT_FAILURE);
+		if (shiva_eh_frame_register(ctx_global, linker) == false)
 			exit(EXIT_FAILURE);
-		}
-		shiva_debug("Post linking '%s'\n", delay_rel->symname);
-		/*
-		 * Apply the final relocation value on our delayed
-		 * relocation entry.
-		 */
-		*(uint64_t *)delay_rel->rel_unit = delay_rel->symval + base;
-
-		shiva_debug("%#lx:rel_unit = %#lx + %#lx (%#lx)\n", delay_rel->rel_addr,
-		    delay_rel->symval, base, delay_rel->symval + base);
 	}
-
-	shiva_debug("Transfering control to %#lx\n", ctx_global->ulexec.entry_point);
-	test_mark();
-
 	/*
-	 * Mark the text segment as read-only now that there won't
-	 * be any final fixups in the modules .text.
+	 * LDSO has applied the JUMP_SLOT relocations (And RELRO) by now,
+	 * so the GOT hooks of shiva_trace can no longer be overwritten.
 	 */
-	if (mprotect(ctx_global->module.runtime->text_mem,
-	    ELF_PAGEALIGN(ctx_global->module.runtime->text_size,
-	    PAGE_SIZE),
-	    PROT_READ|PROT_EXEC) < 0) {
-		fprintf(stderr, "shiva_post_linker() Unable to mark text as read-only\n");
-		perror("mprotect");
+	if (ctx_global->trace_pltgot_pending > 0 && shiva_maps_refresh(ctx_global) == false) {
+		fprintf(stderr, "shiva_maps_refresh() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (shiva_trace_pltgot_commit(ctx_global, &error) == false) {
+		fprintf(stderr, "shiva_trace_pltgot_commit() failed: %s\n",
+		    shiva_error_msg(&error));
 		exit(EXIT_FAILURE);
 	}
 
+	shiva_debug("Transfering control to %#lx\n", ctx_global->ulexec.entry_point);
+	test_mark();
+
 	__asm__ __volatile__ ("mov x21, %0" :: "r"(ctx_global->ulexec.entry_point));
 	return;
 }
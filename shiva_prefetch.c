@@ -0,0 +1,92 @@
+/*
+ * shiva_prefetch.c - Overlapping the I/O of startup with the analysis.
+ *
+ * Without it every file that Shiva needs is read in turn as it gets to
+ * it: the target, then the patch modules, LDSO, and then every shared
+ * object of the target once the first symbol of a patch is resolved
+ * against them (See shiva_so.c). On a cold page cache each of them
+ * blocks. As soon as the module paths are known, shiva_prefetch_start()
+ * asks the kernel to read ahead the patch modules and LDSO, which
+ * doesn't block, and builds the shared object cache on a helper thread,
+ * so that the DT_NEEDED graph is resolved and opened while .text is
+ * analyzed. The shared objects are read ahead as they are opened.
+ *
+ * The cache is only ever used once shiva_prefetch_wait() has joined the
+ * thread. If the thread failed, the cache is built again in the
+ * foreground, which reports the error. SHIVA_PREFETCH=0 turns this off.
+ */
+#include "shiva.h"
+
+static bool
+shiva_prefetch_enabled(void)
+{
+	char *s = getenv("SHIVA_PREFETCH");
+
+	return s == NULL || strcmp(s, "0") != 0;
+}
+
+/*
+ * Start reading path into the page cache. Nothing waits for it, so
+ * errors are of no consequence.
+ */
+void
+shiva_prefetch_file(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		shiva_debug("prefetch: open(%s) failed: %s\n", path, strerror(errno));
+		return;
+	}
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+	shiva_debug("prefetch: %s\n", path);
+	return;
+}
+
+static void *
+shiva_prefetch_worker(void *arg)
+{
+	struct shiva_ctx *ctx = arg;
+
+	ctx->prefetch.res = shiva_so_cache_build(ctx, true);
+	return NULL;
+}
+
+bool
+shiva_prefetch_start(struct shiva_ctx *ctx)
+{
+	size_t i;
+
+	if (shiva_prefetch_enabled() == false)
+		return true;
+	for (i = 0; i < ctx->module.count; i++)
+		shiva_prefetch_file(ctx->module.paths[i]);
+	shiva_prefetch_file(SHIVA_LDSO_PATH);
+	if (ctx->so.init == true)
+		return true;
+	if (pthread_create(&ctx->prefetch.thread, NULL, shiva_prefetch_worker,
+	    ctx) != 0) {
+		shiva_debug("pthread_create failed, shared objects are opened on demand\n");
+		return true;
+	}
+	ctx->prefetch.pending = true;
+	return true;
+}
+
+/*
+ * Join the helper thread. Must be called before ctx->so is read, and
+ * before control is passed to LDSO.
+ */
+void
+shiva_prefetch_wait(struct shiva_ctx *ctx)
+{
+	if (ctx->prefetch.pending == false)
+		return;
+	pthread_join(ctx->prefetch.thread, NULL);
+	ctx->prefetch.pending = false;
+	shiva_debug("prefetch: %zu shared objects opened in the background (%s)\n",
+	    ctx->so.count, ctx->prefetch.res == true ? "ok" : "failed");
+	return;
+}
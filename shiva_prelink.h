@@ -0,0 +1,278 @@
+#ifndef _SHIVA_PRELINK_H_
+#define _SHIVA_PRELINK_H_
+
+/*
+ * On-disk layout of the prelinked branch/xref table. The table is
+ * generated by shiva-ld and stored within the new PT_LOAD segment
+ * that houses the Shiva PT_DYNAMIC. The SHIVA_DT_XREF_TABLE tag holds
+ * the address of the table header. This header is shared between
+ * the Shiva interpreter and tools/shiva-ld, so it must not depend
+ * on anything in shiva.h.
+ *
+ * Table layout:
+ * [shiva_prelink_table_hdr]
+ * [shiva_prelink_branch * branch_count]
+ * [shiva_prelink_xref * xref_count]
+ * [string table, strtab[0] is always '\0']
+ *
+ * All offsets within the header are relative to the start of the table.
+ * The type and flag values stored in each record are identical to the
+ * SHIVA_BRANCH_* and SHIVA_XREF_* values found in shiva.h.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <elf.h>
+#include <link.h>
+
+#define SHIVA_DT_XREF_TABLE (DT_LOOS + 13)
+#define SHIVA_DT_PATCH_IMAGE (DT_LOOS + 14) /* file offset of an embedded patch image */
+#define SHIVA_DT_PATCH_IMAGESZ (DT_LOOS + 15)
+
+#define SHIVA_PRELINK_TABLE_MAGIC	0x58564853 /* "SHVX" */
+#define SHIVA_PRELINK_TABLE_VERSION	1
+
+/*
+ * The table is keyed by the NT_GNU_BUILD_ID of the target. If the
+ * target has no build-id we fallback to a 64bit FNV-1a hash of .text
+ */
+#define SHIVA_PRELINK_KEY_BUILD_ID	0
+#define SHIVA_PRELINK_KEY_TEXT_HASH	1
+
+#define SHIVA_PRELINK_KEY_MAX		32
+
+#define SHIVA_PRELINK_FNV_OFFSET	0xcbf29ce484222325ULL
+#define SHIVA_PRELINK_FNV_PRIME		0x100000001b3ULL
+
+struct shiva_prelink_table_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t key_type;
+	uint32_t key_len;
+	uint8_t key[SHIVA_PRELINK_KEY_MAX];
+	uint64_t text_vaddr; /* address of .text at prelink time */
+	uint64_t text_size; /* size of .text at prelink time */
+	uint64_t branch_count;
+	uint64_t branch_offset;
+	uint64_t xref_count;
+	uint64_t xref_offset;
+	uint64_t strtab_offset;
+	uint64_t strtab_size;
+	uint64_t table_size; /* total size of table including the header */
+};
+
+/*
+ * Compact version of struct elf_symbol. The name is an offset
+ * into the tables string table.
+ */
+struct shiva_prelink_sym {
+	uint32_t name;
+	uint16_t shndx;
+	uint8_t bind;
+	uint8_t type;
+	uint8_t visibility;
+	uint8_t pad[7];
+	uint64_t value;
+	uint64_t size;
+};
+
+struct shiva_prelink_branch {
+	uint64_t branch_site;
+	uint64_t target_vaddr;
+	uint64_t retaddr;
+	uint64_t branch_flags;
+	uint32_t branch_type;
+	uint32_t o_insn;
+	uint32_t insn_string; /* strtab offset */
+	uint32_t pad;
+	struct shiva_prelink_sym symbol;
+	struct shiva_prelink_sym current_function;
+};
+
+struct shiva_prelink_xref {
+	uint32_t type;
+	uint32_t pad;
+	uint64_t flags;
+	uint64_t adrp_site;
+	uint64_t adrp_imm;
+	uint64_t adrp_o_insn;
+	uint64_t next_imm;
+	uint64_t next_o_insn;
+	uint64_t target_vaddr;
+	struct shiva_prelink_sym symbol;
+	struct shiva_prelink_sym deref_symbol;
+	struct shiva_prelink_sym current_function;
+};
+
+/*
+ * On-disk layout of a relocated patch image (See shiva_module_cache.c).
+ * The image is either a file in the SHIVA_MODULE_CACHE directory, or
+ * it is embedded into the executable by shiva-ld --static_link, in
+ * which case SHIVA_DT_PATCH_IMAGE holds its page aligned file offset.
+ *
+ * Image layout:
+ * [shiva_mcache_hdr]
+ * [uint64_t * relr_count] (RELR encoded fixups, see below)
+ * [shiva_patch_write * write_count] (addr is an offset from the base)
+ * [shiva_mcache_delayed * delayed_count]
+ * [string table]
+ * [text image] (page aligned)
+ * [data image] (page aligned)
+ *
+ * All offsets within the header are relative to the start of the image.
+ *
+ * The fixups are the 8 byte aligned absolute values within the text and
+ * data images that the target base is added to when the image is loaded
+ * at another base. They are offsets into the text and data images taken
+ * as one (A data offset is text_map_size + its offset into the data),
+ * encoded the way DT_RELR encodes relative relocations: an even word is
+ * the offset of a fixup, and an odd word is a bitmap of which of the 63
+ * words that follow the last fixup (or bitmap) are fixups as well.
+ */
+#define SHIVA_MCACHE_MAGIC	0x43484853 /* "SHHC" */
+#define SHIVA_MCACHE_VERSION	5
+
+struct shiva_mcache_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key; /* of a SHIVA_MODULE_CACHE entry */
+	uint64_t image_key; /* of an embedded image */
+	uint32_t target_key_type; /* shiva_prelink_target_key() of the target */
+	uint32_t target_key_len;
+	uint8_t target_key[SHIVA_PRELINK_KEY_MAX];
+	uint64_t target_base; /* base of the target when the images were linked */
+	int64_t text_off; /* text_vaddr - target_base */
+	int64_t data_off; /* data_vaddr - target_base */
+	uint64_t text_size;
+	uint64_t text_map_size;
+	uint64_t data_size;
+	uint64_t data_map_size;
+	uint64_t bss_off;
+	uint64_t flags;
+	uint64_t relr_count;
+	uint64_t relr_offset;
+	uint64_t write_count;
+	uint64_t write_offset;
+	uint64_t delayed_count;
+	uint64_t delayed_offset;
+	uint64_t strtab_offset;
+	uint64_t strtab_size;
+	uint64_t text_offset;
+	uint64_t data_offset;
+	uint64_t eh_frame_off; /* within the text image, see shiva_eh_frame.c */
+	uint64_t eh_frame_size;
+	uint64_t file_size;
+};
+
+struct shiva_mcache_delayed {
+	int64_t rel_off; /* rel_addr - target_base */
+	uint64_t symval;
+	uint32_t symname; /* strtab offset */
+	uint32_t so_path; /* strtab offset */
+	/*
+	 * The symbol value is an offset into the shared object, so the
+	 * entry is only valid for the exact same file. An embedded image
+	 * resolves symname by name instead.
+	 */
+	uint64_t so_ino;
+	uint64_t so_size;
+	int64_t so_mtime;
+	uint64_t flags; /* SHIVA_DELAYED_RELOC_F_IFUNC, SHIVA_DELAYED_RELOC_F_TARGET */
+};
+
+/*
+ * On-disk layout of a module registry index (See shiva_module_index.c),
+ * written by shiva-ld --index into the module directory. It maps each
+ * module name to a content addressed copy of the module within the
+ * directory, i.e. "patch.o" -> "objects/<hash>.o", along with the hash
+ * of its contents. A name that isn't in the index isn't in the directory,
+ * so Shiva never probes the filesystem for it.
+ *
+ * Index layout:
+ * [shiva_module_index_hdr]
+ * [shiva_module_index_entry * count] (sorted by name)
+ * [string table]
+ *
+ * The index is only trusted while the mtime of the directory is no newer
+ * than that of the index, shiva-ld sets the one to the other.
+ */
+#define SHIVA_MODULE_INDEX_NAME		"modules.idx"
+#define SHIVA_MODULE_INDEX_OBJECTS	"objects"
+#define SHIVA_MODULE_INDEX_MAGIC	0x58444953 /* "SIDX" */
+#define SHIVA_MODULE_INDEX_VERSION	1
+
+struct shiva_module_index_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count;
+	uint64_t entry_offset;
+	uint64_t strtab_offset;
+	uint64_t strtab_size;
+	uint64_t file_size;
+};
+
+struct shiva_module_index_entry {
+	uint32_t name; /* strtab offset */
+	uint32_t path; /* strtab offset, relative to the directory */
+	uint64_t hash; /* shiva_module_index_hash() of the contents */
+	uint64_t size;
+};
+
+static inline uint64_t
+shiva_module_index_hash(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t hash = SHIVA_PRELINK_FNV_OFFSET;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= SHIVA_PRELINK_FNV_PRIME;
+	}
+	return hash;
+}
+
+/*
+ * Compute the key that a prelinked table is stored under. Both shiva-ld
+ * and the Shiva interpreter use this so that a table is only trusted when
+ * it was generated from the exact same .text.
+ */
+static inline bool
+shiva_prelink_target_key(elfobj_t *obj, struct shiva_prelink_table_hdr *hdr)
+{
+	struct elf_section shdr;
+	uint8_t *ptr;
+	uint64_t hash = SHIVA_PRELINK_FNV_OFFSET;
+	size_t i;
+
+	if (elf_section_by_name(obj, ".text", &shdr) == false)
+		return false;
+	hdr->text_vaddr = shdr.address;
+	hdr->text_size = shdr.size;
+
+	if (elf_section_by_name(obj, ".note.gnu.build-id", &shdr) == true) {
+		ElfW(Nhdr) *note = elf_offset_pointer(obj, shdr.offset);
+
+		if (note != NULL && note->n_type == NT_GNU_BUILD_ID &&
+		    sizeof(*note) + ELFNOTE_NAMESZ(note) + note->n_descsz <= shdr.size) {
+			hdr->key_type = SHIVA_PRELINK_KEY_BUILD_ID;
+			hdr->key_len = note->n_descsz > SHIVA_PRELINK_KEY_MAX ?
+			    SHIVA_PRELINK_KEY_MAX : note->n_descsz;
+			memcpy(hdr->key, ELFNOTE_DESC(note), hdr->key_len);
+			return true;
+		}
+	}
+	ptr = elf_address_pointer(obj, hdr->text_vaddr);
+	if (ptr == NULL)
+		return false;
+	for (i = 0; i < hdr->text_size; i++) {
+		hash ^= ptr[i];
+		hash *= SHIVA_PRELINK_FNV_PRIME;
+	}
+	hdr->key_type = SHIVA_PRELINK_KEY_TEXT_HASH;
+	hdr->key_len = sizeof(hash);
+	memcpy(hdr->key, &hash, sizeof(hash));
+	return true;
+}
+
+#endif
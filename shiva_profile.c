@@ -0,0 +1,321 @@
+/*
+ * shiva_profile.c - Sampling profiler.
+ *
+ * SHIVA_PROFILE=<path> samples the target SHIVA_PROFILE_HZ (default 997)
+ * times per second of CPU time with ITIMER_PROF. The SIGPROF handler
+ * records the interrupted pc and walks the frame pointer chain, and when
+ * the target exits the samples are symbolized against ctx->elfobj and the
+ * symbol tables of the patch modules, and written to path as folded
+ * stacks, one "frame;frame;...;frame count" line per distinct stack,
+ * which is what flamegraph.pl and friends take as input. Frames within
+ * a patch module are suffixed with "_[patch]", and frames that are in
+ * neither the target nor a module (i.e. shared libraries) are written
+ * as an address.
+ *
+ * Everything here runs after control was passed to LDSO, with the thread
+ * pointer of the targets libc, so no libc function that touches TLS (and
+ * errno is one) is used. System calls are made directly.
+ *
+ * The samples are written from DT_FINI of the target, which LDSO calls
+ * from _dl_fini() as the target exits; the original DT_FINI is called
+ * afterwards. A target without DT_FINI cannot be profiled.
+ */
+#include "shiva.h"
+#include "shiva_syscall.h"
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+
+#define SHIVA_PROFILE_DEFAULT_HZ	997
+#define SHIVA_PROFILE_DEFAULT_SAMPLES	(1 << 16)
+#define SHIVA_PROFILE_DEPTH		62
+#define SHIVA_PROFILE_OUTBUF		8192
+
+struct shiva_profile_sample {
+	uint32_t depth;
+	uint32_t pad;
+	uint64_t pc[SHIVA_PROFILE_DEPTH + 1]; /* leaf first */
+};
+
+static struct {
+	struct shiva_ctx *ctx;
+	struct shiva_profile_sample *samples;
+	size_t max;
+	uint64_t count; /* may exceed max, the rest are dropped */
+	uint64_t o_fini; /* original DT_FINI, relative to the base */
+	const char *path;
+	char buf[SHIVA_PROFILE_OUTBUF];
+	size_t buf_len;
+	int fd;
+} profile;
+
+/*
+ * Read a frame record {next frame pointer, return address} without
+ * faulting on a bogus frame pointer.
+ */
+static bool
+shiva_profile_read_frame(uint64_t fp, uint64_t frame[2])
+{
+	struct iovec local, remote;
+	static pid_t pid;
+
+	if (pid == 0)
+		pid = shiva_syscall(SYS_getpid, 0, 0, 0, 0, 0, 0);
+	local.iov_base = frame;
+	local.iov_len = sizeof(uint64_t) * 2;
+	remote.iov_base = (void *)fp;
+	remote.iov_len = sizeof(uint64_t) * 2;
+	return shiva_syscall(SYS_process_vm_readv, pid, (long)&local, 1,
+	    (long)&remote, 1, 0) == (long)local.iov_len;
+}
+
+static void
+shiva_profile_sigprof(int sig, siginfo_t *si, void *uctx)
+{
+	ucontext_t *uc = uctx;
+	struct shiva_profile_sample *s;
+	uint64_t index, pc, lr, fp, sp, frame[2];
+	uint32_t depth = 0;
+
+	(void)sig;
+	(void)si;
+	index = __atomic_fetch_add(&profile.count, 1, __ATOMIC_RELAXED);
+	if (index >= profile.max)
+		return;
+	s = &profile.samples[index];
+#if __aarch64__
+	pc = uc->uc_mcontext.pc;
+	sp = uc->uc_mcontext.sp;
+	fp = uc->uc_mcontext.regs[29];
+	lr = uc->uc_mcontext.regs[30];
+#else
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+	sp = uc->uc_mcontext.gregs[REG_RSP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+	lr = 0;
+#endif
+	s->pc[depth++] = pc;
+	while (depth < SHIVA_PROFILE_DEPTH && fp >= sp && (fp & 0x7) == 0) {
+		if (shiva_profile_read_frame(fp, frame) == false || frame[1] == 0)
+			break;
+		/*
+		 * A leaf function that didn't push a frame record of its own
+		 * still has its return address in lr.
+		 */
+		if (depth == 1 && lr != 0 && frame[1] != lr)
+			s->pc[depth++] = lr;
+		s->pc[depth++] = frame[1];
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+	if (depth == 1 && lr != 0)
+		s->pc[depth++] = lr;
+	s->depth = depth;
+	return;
+}
+
+static void
+shiva_profile_flush(void)
+{
+	if (profile.buf_len > 0)
+		(void) shiva_syscall(SYS_write, profile.fd, (long)profile.buf,
+		    profile.buf_len, 0, 0, 0);
+	profile.buf_len = 0;
+	return;
+}
+
+static void
+shiva_profile_puts(const char *s)
+{
+	size_t len = strlen(s);
+
+	if (profile.buf_len + len > sizeof(profile.buf))
+		shiva_profile_flush();
+	if (len > sizeof(profile.buf))
+		len = sizeof(profile.buf);
+	memcpy(&profile.buf[profile.buf_len], s, len);
+	profile.buf_len += len;
+	return;
+}
+
+static void
+shiva_profile_putnum(uint64_t v, int base)
+{
+	char tmp[24], *p = &tmp[sizeof(tmp) - 1];
+
+	*p = '\0';
+	do {
+		*--p = "0123456789abcdef"[v % base];
+		v /= base;
+	} while (v != 0);
+	if (base == 16) {
+		*--p = 'x';
+		*--p = '0';
+	}
+	shiva_profile_puts(p);
+	return;
+}
+
+/*
+ * Write the name of the function that pc is in.
+ */
+static void
+shiva_profile_put_frame(struct shiva_ctx *ctx, uint64_t pc)
+{
+	struct shiva_module_section_mapping *smap;
+	struct shiva_module *linker;
+	struct elf_symbol symbol;
+	uint64_t base = shiva_trace_base_addr(ctx);
+
+	if (pc >= base && elf_symbol_by_range(&ctx->elfobj, pc - base, &symbol) == true &&
+	    symbol.type == STT_FUNC) {
+		shiva_profile_puts(symbol.name);
+		return;
+	}
+	TAILQ_FOREACH(linker, &ctx->module.list, _linkage) {
+		if (pc < linker->text_vaddr || pc >= linker->text_vaddr + linker->text_size)
+			continue;
+		TAILQ_FOREACH(smap, &linker->tailq.section_maplist, _linkage) {
+			if (smap->map_attribute != LP_SECTION_TEXTSEGMENT)
+				continue;
+			if (pc < smap->vaddr || pc >= smap->vaddr + smap->size)
+				continue;
+			if (elf_symbol_by_range(&linker->elfobj, pc - smap->vaddr,
+			    &symbol) == true) {
+				shiva_profile_puts(symbol.name);
+				shiva_profile_puts("_[patch]");
+				return;
+			}
+		}
+		shiva_profile_puts("[patch]");
+		return;
+	}
+	shiva_profile_putnum(pc, 16);
+	return;
+}
+
+static int
+shiva_profile_sample_cmp(const void *a, const void *b)
+{
+	const struct shiva_profile_sample *x = a, *y = b;
+
+	if (x->depth != y->depth)
+		return (x->depth > y->depth) - (x->depth < y->depth);
+	return memcmp(x->pc, y->pc, x->depth * sizeof(x->pc[0]));
+}
+
+/*
+ * Installed as DT_FINI of the target.
+ */
+static void
+shiva_profile_fini(void)
+{
+	struct shiva_ctx *ctx = profile.ctx;
+	struct itimerval it;
+	size_t i, j, n;
+	int k;
+	void (*o_fini)(void);
+
+	memset(&it, 0, sizeof(it));
+	(void) shiva_syscall(SYS_setitimer, ITIMER_PROF, (long)&it, 0, 0, 0, 0);
+	n = profile.count < profile.max ? profile.count : profile.max;
+	profile.fd = shiva_syscall(SYS_openat, AT_FDCWD, (long)profile.path,
+	    O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644, 0, 0);
+	if (profile.fd < 0)
+		goto done;
+	/*
+	 * A sample that was claimed but never written has a depth of 0
+	 */
+	qsort(profile.samples, n, sizeof(*profile.samples), shiva_profile_sample_cmp);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n; j++) {
+			if (shiva_profile_sample_cmp(&profile.samples[i],
+			    &profile.samples[j]) != 0)
+				break;
+		}
+		if (profile.samples[i].depth == 0)
+			continue;
+		for (k = profile.samples[i].depth - 1; k >= 0; k--) {
+			shiva_profile_put_frame(ctx, profile.samples[i].pc[k]);
+			shiva_profile_puts(k == 0 ? " " : ";");
+		}
+		shiva_profile_putnum(j - i, 10);
+		shiva_profile_puts("\n");
+	}
+	if (profile.count > profile.max) {
+		shiva_profile_puts("[dropped] ");
+		shiva_profile_putnum(profile.count - profile.max, 10);
+		shiva_profile_puts("\n");
+	}
+	shiva_profile_flush();
+	(void) shiva_syscall(SYS_close, profile.fd, 0, 0, 0, 0, 0);
+done:
+	if (profile.o_fini != 0) {
+		o_fini = (void *)(shiva_trace_base_addr(ctx) + profile.o_fini);
+		o_fini();
+	}
+	return;
+}
+
+/*
+ * Called right before control is passed to LDSO.
+ */
+bool
+shiva_profile_start(struct shiva_ctx *ctx)
+{
+	struct sigaction sa;
+	struct itimerval it;
+	char *s;
+	long hz = SHIVA_PROFILE_DEFAULT_HZ;
+	size_t max = SHIVA_PROFILE_DEFAULT_SAMPLES;
+	void *mem;
+
+	profile.path = getenv("SHIVA_PROFILE");
+	if (profile.path == NULL || profile.path[0] == '\0')
+		return true;
+	if ((s = getenv("SHIVA_PROFILE_HZ")) != NULL && atol(s) > 0)
+		hz = atol(s);
+	if ((s = getenv("SHIVA_PROFILE_SAMPLES")) != NULL && atol(s) > 0)
+		max = atol(s);
+	if (shiva_target_dynamic_get(ctx, DT_FINI, &profile.o_fini) == false) {
+		fprintf(stderr, "SHIVA_PROFILE: %s has no DT_FINI\n", ctx->path);
+		return false;
+	}
+	mem = mmap(NULL, max * sizeof(*profile.samples), PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	profile.ctx = ctx;
+	profile.samples = mem;
+	profile.max = max;
+	/*
+	 * LDSO adds the load base to DT_FINI
+	 */
+	if (shiva_target_dynamic_set(ctx, DT_FINI,
+	    (uint64_t)shiva_profile_fini - shiva_trace_base_addr(ctx)) == false) {
+		fprintf(stderr, "SHIVA_PROFILE: unable to set DT_FINI\n");
+		return false;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = shiva_profile_sigprof;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	if (sigaction(SIGPROF, &sa, NULL) < 0) {
+		perror("sigaction");
+		return false;
+	}
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL) < 0) {
+		perror("setitimer");
+		return false;
+	}
+	shiva_debug("Profiling at %ld Hz into %s\n", hz, profile.path);
+	return true;
+}
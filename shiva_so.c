@@ -1,21 +1,41 @@
 #include "shiva.h"
 
+static void
+shiva_so_cache_destroy(struct shiva_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->so.count; i++)
+		elf_close_object(&ctx->so.objects[i]->elfobj);
+	free(ctx->so.objects);
+	ctx->so.objects = NULL;
+	ctx->so.count = 0;
+	shiva_htab_destroy(&ctx->so.symbols);
+	return;
+}
+
+/*
+ * Resolve the DT_NEEDED graph of the target once, and open each shared
+ * object once. The objects are kept open until shiva_so_cache_release()
+ * since the symbols in ctx->so.symbols point into them. In the
+ * background (See shiva_prefetch.c) each object is read ahead before
+ * it is opened, and the errors are left to the foreground to report.
+ */
 bool
-shiva_so_resolve_symbol(struct shiva_module *linker, char *symname, struct elf_symbol *out,
-    char **so_path)
+shiva_so_cache_build(struct shiva_ctx *ctx, bool background)
 {
 	elf_shared_object_iterator_t so_iter;
 	struct elf_shared_object so;
+	struct shiva_so_object *current;
 	elf_iterator_res_t res;
 	elf_error_t error;
-	elfobj_t so_obj;
+	char path[PATH_MAX];
 
-	*so_path = NULL;
-
-	if (elf_shared_object_iterator_init(linker->target_elfobj, &so_iter,
+	if (elf_shared_object_iterator_init(&ctx->elfobj, &so_iter,
 	    NULL, ELF_SO_RESOLVE_ALL_F| /*ELF_SO_LDSO_FAST_F|*/ELF_SO_IGNORE_VDSO_F, &error) == false) {
-		fprintf(stderr, "elf_shared_object_iterator_init failed: %s\n",
-		    elf_error_msg(&error));
+		if (background == false)
+			fprintf(stderr, "elf_shared_object_iterator_init failed: %s\n",
+			    elf_error_msg(&error));
 		return false;
 	}
 	for (;;) {
@@ -23,37 +43,186 @@ shiva_so_resolve_symbol(struct shiva_module *linker, char *symname, struct elf_s
 		if (res == ELF_ITER_DONE)
 			break;
 		if (res == ELF_ITER_ERROR) {
-			fprintf(stderr, "elf_shared_object_iterator_next failed: %s\n",
-			    elf_error_msg(&error));
-			return false;
+			if (background == false)
+				fprintf(stderr, "elf_shared_object_iterator_next failed: %s\n",
+				    elf_error_msg(&error));
+			goto fail;
 		}
 		shiva_debug("[+] Processing: %s\n", so.path);
-		if (elf_open_object(so.path, &so_obj, ELF_LOAD_F_STRICT, &error) == false) {
-			fprintf(stderr, "elf_open_object failed: %s\n", elf_error_msg(&error));
-			return false;
+		if (background == true)
+			shiva_prefetch_file(so.path);
+		current = shiva_arena_alloc(&ctx->arena.module, sizeof(*current));
+		if (elf_open_object(so.path, &current->elfobj, ELF_LOAD_F_STRICT, &error) == false) {
+			if (background == false)
+				fprintf(stderr, "elf_open_object failed: %s\n", elf_error_msg(&error));
+			goto fail;
 		}
-		shiva_debug("[+] Searching for symbol '%s' in shared object '%s'\n",
-		    symname, so.basename);
+		current->path = shiva_arena_strdup(&ctx->arena.module,
+		    realpath(so.path, path) != NULL ? path : so.path);
+		ctx->so.objects = shiva_realloc(ctx->so.objects,
+		    (ctx->so.count + 1) * sizeof(struct shiva_so_object *));
+		ctx->so.objects[ctx->so.count++] = current;
+	}
+	shiva_debug("Cached %zu shared objects\n", ctx->so.count);
+	ctx->so.init = true;
+	return true;
+fail:
+	shiva_so_cache_destroy(ctx);
+	return false;
+}
+
+/*
+ * Close the shared objects once nothing is left to link against them,
+ * see shiva_mem_release(). The resolved symbols point into them, so they
+ * go as well, and both are built again on the next lookup. Returns the
+ * bytes freed.
+ */
+size_t
+shiva_so_cache_release(struct shiva_ctx *ctx)
+{
+	size_t i, bytes;
 
-		if (elf_symbol_by_name(&so_obj, symname, out) == false)
+	shiva_prefetch_wait(ctx);
+	if (ctx->so.init == false)
+		return 0;
+	bytes = ctx->so.symbols.size * sizeof(struct shiva_htab_entry);
+	for (i = 0; i < ctx->so.count; i++)
+		bytes += ctx->so.objects[i]->elfobj.size;
+	shiva_debug("Closing %zu cached shared objects\n", ctx->so.count);
+	shiva_so_cache_destroy(ctx);
+	ctx->so.init = false;
+	return bytes;
+}
+
+static inline bool
+shiva_so_symbol_exported(struct elf_symbol *symbol)
+{
+	if (symbol->shndx == SHN_UNDEF || symbol->name == NULL || symbol->name[0] == '\0')
+		return false;
+	return symbol->bind == STB_GLOBAL || symbol->bind == STB_WEAK;
+}
+
+/*
+ * Resolve every name in names that hasn't been looked up yet with a
+ * single pass over the shared objects, instead of searching all of them
+ * for each name in turn. Objects with a DT_GNU_HASH are probed for each
+ * outstanding name, its bloom filter rejects most of them with a single
+ * word test. Objects without one have their .dynsym streamed once and
+ * matched against the outstanding names. The pass stops as soon as
+ * every name has a definition.
+ *
+ * Precedence follows the LDSO search order: the first shared object
+ * that defines a symbol wins, even if its definition is STB_WEAK and
+ * a later one is STB_GLOBAL. Within a single object a STB_GLOBAL
+ * definition takes precedence over a STB_WEAK one. Names that no
+ * object defines are remembered as missing.
+ */
+bool
+shiva_so_resolve_batch(struct shiva_module *linker, const char **names, size_t count)
+{
+	struct shiva_ctx *ctx = linker->ctx;
+	elf_dynsym_iterator_t dynsym_iter;
+	struct shiva_so_object *current;
+	struct shiva_so_symbol *entry, **pending;
+	struct elf_symbol symbol;
+	size_t i, j, npending = 0, remaining, weak;
+	shiva_stats_mark_t t0;
+
+	shiva_prefetch_wait(ctx);
+	if (ctx->so.init == false && shiva_so_cache_build(ctx, false) == false)
+		return false;
+	t0 = SHIVA_STATS_START(ctx);
+	pending = shiva_malloc((count > 0 ? count : 1) * sizeof(*pending));
+	for (i = 0; i < count; i++) {
+		if (names[i] == NULL || names[i][0] == '\0' ||
+		    shiva_htab_find(&ctx->so.symbols, names[i]) != NULL)
 			continue;
-		if (out->bind != STB_GLOBAL && out->bind != STB_WEAK)
+		entry = shiva_arena_alloc(&ctx->arena.module, sizeof(*entry));
+		entry->symbol.name = shiva_arena_strdup(&ctx->arena.module, names[i]);
+		(void) shiva_htab_insert(&ctx->so.symbols, entry->symbol.name, entry);
+		pending[npending++] = entry;
+	}
+	remaining = npending;
+	for (i = 0; i < ctx->so.count && remaining > 0; i++) {
+		current = ctx->so.objects[i];
+		if (shiva_gnu_hash_ready(&current->gnu_hash, &current->elfobj) == true) {
+			for (j = 0; j < npending; j++) {
+				entry = pending[j];
+				if (entry->so != NULL)
+					continue;
+				if (shiva_gnu_hash_lookup(&current->gnu_hash, entry->symbol.name,
+				    &symbol) == false || shiva_so_symbol_exported(&symbol) == false)
+					continue;
+				memcpy(&entry->symbol, &symbol, sizeof(symbol));
+				entry->so = current;
+				remaining--;
+			}
 			continue;
-		/*
-		 * Fill in the pathname to the shared object that this symbol
-		 * lives within.
-		 */
-		*so_path = strdup(so.path);
-		if (*so_path == NULL) {
-			perror("strdup");
-			exit(EXIT_FAILURE);
 		}
-		shiva_debug("Found symbol '%s' in shared object '%s'\n",
-		    symname, so.basename);
-		return true;
+		shiva_debug("Streaming .dynsym of %s for %zu symbols\n", current->path,
+		    remaining);
+		weak = 0;
+		elf_dynsym_iterator_init(&current->elfobj, &dynsym_iter);
+		while (elf_dynsym_iterator_next(&dynsym_iter, &symbol) == ELF_ITER_OK) {
+			if (shiva_so_symbol_exported(&symbol) == false)
+				continue;
+			entry = shiva_htab_find(&ctx->so.symbols, symbol.name);
+			if (entry == NULL || entry->missing == true)
+				continue;
+			if (entry->so == NULL) {
+				memcpy(&entry->symbol, &symbol, sizeof(symbol));
+				entry->so = current;
+				remaining--;
+				if (symbol.bind == STB_WEAK)
+					weak++;
+			} else if (entry->so == current && entry->symbol.bind == STB_WEAK &&
+			    symbol.bind == STB_GLOBAL) {
+				memcpy(&entry->symbol, &symbol, sizeof(symbol));
+				weak--;
+			}
+			if (remaining == 0 && weak == 0)
+				break;
+		}
 	}
-	if (*so_path == NULL)
-		return false;
+	for (i = 0; i < npending; i++) {
+		if (pending[i]->so == NULL)
+			pending[i]->missing = true;
+	}
+	shiva_debug("Resolved %zu of %zu symbols against %zu shared objects\n",
+	    npending - remaining, npending, ctx->so.count);
+	free(pending);
+	SHIVA_STATS_STOP(ctx, SHIVA_STATS_SO_RESOLVE, t0);
+	return true;
+}
 
+/*
+ * Look up symname within the shared objects of the target. On success
+ * *so_path is set to the realpath of the shared object that the symbol
+ * lives in. It belongs to the cache and must not be freed. Names that
+ * weren't part of a batch (See shiva_so_resolve_batch) are resolved
+ * on their own.
+ */
+bool
+shiva_so_resolve_symbol(struct shiva_module *linker, char *symname, struct elf_symbol *out,
+    char **so_path)
+{
+	struct shiva_ctx *ctx = linker->ctx;
+	struct shiva_so_symbol *entry;
+	const char *name = symname;
+
+	*so_path = NULL;
+
+	entry = shiva_htab_find(&ctx->so.symbols, symname);
+	if (entry == NULL) {
+		if (shiva_so_resolve_batch(linker, &name, 1) == false)
+			return false;
+		entry = shiva_htab_find(&ctx->so.symbols, symname);
+	}
+	if (entry == NULL || entry->so == NULL)
+		return false;
+	memcpy(out, &entry->symbol, sizeof(*out));
+	*so_path = entry->so->path;
+	shiva_debug("Found symbol '%s' in shared object '%s'\n",
+	    symname, entry->so->path);
 	return true;
 }
@@ -0,0 +1,153 @@
+/*
+ * shiva_stats.c - Load-time metrics.
+ *
+ * SHIVA_STATS=<path> turns on a timer for each phase of loading the
+ * target (See shiva_stats_phase_t), and a handful of counters. Once
+ * control is about to be passed to LDSO a single line of key=value
+ * pairs is appended to path, or written to stderr if path is "-".
+ * Times are in microseconds, and each <phase>_us is followed by the
+ * bytes allocated during the phase, <phase>_alloc. The counters are
+ * followed by the memory footprint of each subsystem (See shiva_mem.c),
+ * mem_<subsys>_kb and its resident part mem_<subsys>_rss_kb. When
+ * SHIVA_STATS is unset the clock is never read, see SHIVA_STATS_START()
+ * in shiva.h
+ */
+#include "shiva.h"
+#include <time.h>
+
+static const char *shiva_stats_phase_names[SHIVA_STATS_PHASE_COUNT] = {
+	[SHIVA_STATS_ELF_OPEN] = "elf_open_us",
+	[SHIVA_STATS_MAPS] = "maps_us",
+	[SHIVA_STATS_ANALYZE] = "analyze_us",
+	[SHIVA_STATS_MODULE_CACHE] = "module_cache_us",
+	[SHIVA_STATS_MODULE_LOAD] = "module_load_us",
+	[SHIVA_STATS_RELOCATE] = "relocate_us",
+	[SHIVA_STATS_SO_RESOLVE] = "so_resolve_us",
+	[SHIVA_STATS_RELINK] = "relink_us",
+	[SHIVA_STATS_LAYOUT] = "layout_us",
+	[SHIVA_STATS_IMAGE] = "image_us",
+	[SHIVA_STATS_PLTGOT] = "pltgot_us"
+};
+
+static const char *shiva_stats_counter_names[SHIVA_STATS_COUNTER_COUNT] = {
+	[SHIVA_STATS_INSNS] = "insns",
+	[SHIVA_STATS_BRANCH_SITES] = "branch_sites",
+	[SHIVA_STATS_XREF_SITES] = "xref_sites",
+	[SHIVA_STATS_SITE_BYTES] = "site_bytes",
+	[SHIVA_STATS_RELOCS] = "relocs",
+	[SHIVA_STATS_SYM_MODULE] = "sym_module",
+	[SHIVA_STATS_SYM_TARGET] = "sym_target",
+	[SHIVA_STATS_SYM_SO] = "sym_so",
+	[SHIVA_STATS_SYM_SHIVA] = "sym_shiva",
+	[SHIVA_STATS_PATCH_WRITES] = "patch_writes",
+	[SHIVA_STATS_MPROTECT_PAGES] = "mprotect_pages",
+	[SHIVA_STATS_RELAXED_CALLS] = "relaxed_calls",
+	[SHIVA_STATS_GOT_ENTRIES] = "got_entries"
+};
+
+uint64_t
+shiva_stats_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+shiva_stats_mark_t
+shiva_stats_mark(struct shiva_ctx *ctx)
+{
+	shiva_stats_mark_t mark;
+
+	mark.ns = shiva_stats_now();
+	mark.alloc = __atomic_load_n(&ctx->stats.alloc, __ATOMIC_RELAXED);
+	return mark;
+}
+
+void
+shiva_stats_init(struct shiva_ctx *ctx)
+{
+	char *path = getenv("SHIVA_STATS");
+
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	if (path == NULL || path[0] == '\0')
+		return;
+	ctx->stats.path = path;
+	ctx->stats.enabled = true;
+	ctx->stats.start = shiva_stats_now();
+	return;
+}
+
+/*
+ * The line is written with a single write(2) to an O_APPEND descriptor
+ * so that several processes can share one stats file.
+ */
+void
+shiva_stats_report(struct shiva_ctx *ctx)
+{
+	struct shiva_mem_footprint fp;
+	char line[4096];
+	size_t len, i;
+	int n, fd;
+
+	if (ctx->stats.enabled == false)
+		return;
+	n = snprintf(line, sizeof(line), "shiva-stats pid=%d target=%s total_us=%lu",
+	    getpid(), ctx->path, (shiva_stats_now() - ctx->stats.start) / 1000);
+	if (n < 0 || (size_t)n >= sizeof(line))
+		return;
+	len = n;
+	for (i = 0; i < SHIVA_STATS_PHASE_COUNT && len < sizeof(line); i++) {
+		n = snprintf(&line[len], sizeof(line) - len, " %s=%lu %.*s_alloc=%lu",
+		    shiva_stats_phase_names[i], ctx->stats.phase_ns[i] / 1000,
+		    (int)strlen(shiva_stats_phase_names[i]) - 3, shiva_stats_phase_names[i],
+		    ctx->stats.phase_alloc[i]);
+		if (n < 0)
+			return;
+		len += n;
+	}
+	for (i = 0; i < SHIVA_STATS_COUNTER_COUNT && len < sizeof(line); i++) {
+		n = snprintf(&line[len], sizeof(line) - len, " %s=%lu",
+		    shiva_stats_counter_names[i], ctx->stats.counters[i]);
+		if (n < 0)
+			return;
+		len += n;
+	}
+	shiva_mem_footprint(ctx, &fp);
+	for (i = 0; i < SHIVA_MEM_SUBSYS_COUNT && len < sizeof(line); i++) {
+		n = snprintf(&line[len], sizeof(line) - len, " mem_%s_kb=%lu mem_%s_rss_kb=%lu",
+		    shiva_mem_subsys_name(i), fp.subsys[i].bytes / 1024,
+		    shiva_mem_subsys_name(i), fp.subsys[i].pages * PAGE_SIZE / 1024);
+		if (n < 0)
+			return;
+		len += n;
+	}
+	if (len < sizeof(line)) {
+		n = snprintf(&line[len], sizeof(line) - len,
+		    " mem_total_kb=%lu mem_rss_kb=%lu mem_released_kb=%lu", fp.bytes / 1024,
+		    fp.pages * PAGE_SIZE / 1024, fp.released / 1024);
+		if (n < 0)
+			return;
+		len += n;
+	}
+	if (len >= sizeof(line) - 1)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	if (strcmp(ctx->stats.path, "-") == 0) {
+		(void) write(STDERR_FILENO, line, len);
+		return;
+	}
+	fd = open(ctx->stats.path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "SHIVA_STATS: open(%s) failed: %s\n", ctx->stats.path,
+		    strerror(errno));
+		return;
+	}
+	if (write(fd, line, len) != (ssize_t)len)
+		fprintf(stderr, "SHIVA_STATS: write(%s) failed: %s\n", ctx->stats.path,
+		    strerror(errno));
+	close(fd);
+	return;
+}
@@ -0,0 +1,37 @@
+#ifndef _SHIVA_SYSCALL_H_
+#define _SHIVA_SYSCALL_H_
+
+/*
+ * Raw system calls, for code that runs after control was passed to LDSO
+ * (Signal handlers, DT_FINI hooks). It runs with the thread pointer of
+ * the targets libc, so the musl wrappers, which set errno through it,
+ * must not be used. Returns -errno on failure.
+ */
+static inline long
+shiva_syscall(long nr, long a0, long a1, long a2, long a3, long a4, long a5)
+{
+#if __aarch64__
+	register long x8 __asm__("x8") = nr;
+	register long x0 __asm__("x0") = a0;
+	register long x1 __asm__("x1") = a1;
+	register long x2 __asm__("x2") = a2;
+	register long x3 __asm__("x3") = a3;
+	register long x4 __asm__("x4") = a4;
+	register long x5 __asm__("x5") = a5;
+
+	__asm__ __volatile__("svc #0" : "+r"(x0) : "r"(x8), "r"(x1), "r"(x2),
+	    "r"(x3), "r"(x4), "r"(x5) : "memory");
+	return x0;
+#else
+	register long r10 __asm__("r10") = a3;
+	register long r8 __asm__("r8") = a4;
+	register long r9 __asm__("r9") = a5;
+	long ret;
+
+	__asm__ __volatile__("syscall" : "=a"(ret) : "a"(nr), "D"(a0), "S"(a1),
+	    "d"(a2), "r"(r10), "r"(r8), "r"(r9) : "rcx", "r11", "memory");
+	return ret;
+#endif
+}
+
+#endif
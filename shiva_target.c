@@ -44,14 +44,15 @@ shiva_target_copy_string(struct shiva_ctx *ctx, char *dst, const char *src, size
 }
 
 /*
- * Copies no more than PATH_MAX bytes into buf.
+ * SHIVA_DT_NEEDED holds a ':' separated list of patch basenames, each of
+ * which lives within the SHIVA_DT_SEARCH directory. See shiva-ld.
  */
 bool
-shiva_target_get_module_path(struct shiva_ctx *ctx, char *buf)
+shiva_target_get_module_paths(struct shiva_ctx *ctx)
 {
 	uint64_t search_addr, basename_addr;
-	char tmp[PATH_MAX];
-	size_t len, o_len;
+	char search[PATH_MAX], needed[PATH_MAX];
+	size_t len;
 	bool res;
 
 	if (shiva_target_dynamic_get(ctx, SHIVA_DT_SEARCH, &search_addr) == false) {
@@ -64,27 +65,18 @@ shiva_target_get_module_path(struct shiva_ctx *ctx, char *buf)
                     ctx);
                 return false;
         }
-	res = shiva_target_copy_string(ctx, tmp, (const char *)search_addr, &len);
+	res = shiva_target_copy_string(ctx, search, (const char *)search_addr, &len);
         if (res == false) {
                 fprintf(stderr, "shiva_target_copy_string() failed at %#lx\n", (uint64_t)search_addr);
                 return false;
         }
-	o_len = len;
-	if (tmp[len] != '/' && len < 4095) {
-		tmp[len + 1] = '/';
-		len += 1;
-	}
-        res = shiva_target_copy_string(ctx, &tmp[len + 1], (const char *)basename_addr, &len);
+        res = shiva_target_copy_string(ctx, needed, (const char *)basename_addr, &len);
         if (res == false) {
                 fprintf(stderr, "shiva_target_copy_string() failed at %#lx\n", (uint64_t)basename_addr);
                 return false;
         }
-	if (len + o_len >= PATH_MAX - 1) {
-		fprintf(stderr, "path len (%zu) exceeds PATH_MAX - 1\n", len + o_len);
-		return false;
-	}
-	strcpy(buf, tmp);
-	return true;
+	search[PATH_MAX - 1] = needed[PATH_MAX - 1] = '\0';
+	return shiva_module_set_paths(ctx, search, needed);
 }
 
 /*
@@ -1,4 +1,14 @@
 #include "shiva.h"
+#include <stddef.h>
+#if __aarch64__
+#include "shiva_aarch64.h"
+#endif
+
+#if __aarch64__
+#define SHIVA_TRACE_JUMP_SLOT	R_AARCH64_JUMP_SLOT
+#else
+#define SHIVA_TRACE_JUMP_SLOT	R_X86_64_JUMP_SLOT
+#endif
 
 static bool shiva_trace_op_peek(struct shiva_ctx *, pid_t,
     void *, void *, size_t, shiva_error_t *);
@@ -104,7 +114,13 @@ shiva_trace_write(struct shiva_ctx *ctx, pid_t pid, void *dst,
 	uint64_t addr = (uint64_t)dst;
 	int ret, o_prot;
 
-	if (shiva_maps_prot_by_addr(ctx, (uint64_t)addr, &o_prot) == false) {
+	/*
+	 * The address may belong to a mapping that didn't exist when
+	 * the maps were last read, i.e. a shared object. Refresh once.
+	 */
+	if (shiva_maps_prot_by_addr(ctx, (uint64_t)addr, &o_prot) == false &&
+	    (shiva_maps_refresh(ctx) == false ||
+	    shiva_maps_prot_by_addr(ctx, (uint64_t)addr, &o_prot) == false)) {
 	    shiva_error_set(error, "shiva_trace_write pid(%d) at %#lx failed: "
 	    "cannot find memory protection\n", pid, (uint64_t)addr);
 		return false;
@@ -140,20 +156,972 @@ shiva_trace_write(struct shiva_ctx *ctx, pid_t pid, void *dst,
 	return true;
 }
 
+/*
+ * Every breakpoint is indexed by the return address its handler will
+ * see, so that SHIVA_TRACE_BP_STRUCT() finds it in constant time: the
+ * call site return address of CALL hooks, the return address within
+ * the stub of hooks that go through one (aarch64), and each known
+ * return address of the function for PLTGOT and TRAMPOLINE hooks.
+ * WATCH breakpoints are indexed by the watched address instead (See
+ * shiva_trace_watch_bp()).
+ *
+ * The index is read without a lock while it is written to (See
+ * shiva_trace_rcu.c). A slot is filled in place, its bp before its
+ * retaddr, and a slot that is in use is never emptied, so a reader
+ * sees either a free slot or a complete one. An index that would be
+ * more than half full is replaced by a copy twice its size.
+ */
+#define SHIVA_TRACE_BP_INDEX_INITIAL	64
+
+static inline size_t
+shiva_trace_bp_hash(uint64_t retaddr)
+{
+	return (size_t)((retaddr >> 2) * 0x9e3779b97f4a7c15UL >> 32);
+}
+
+static void
+shiva_trace_bp_index_set(struct shiva_trace_bp_index *index, uint64_t retaddr,
+    struct shiva_trace_bp *bp)
+{
+	struct shiva_trace_bp_slot *slots = index->slots;
+	size_t i, mask = index->size - 1;
+
+	for (i = shiva_trace_bp_hash(retaddr) & mask;; i = (i + 1) & mask) {
+		if (slots[i].retaddr == retaddr) {
+			__atomic_store_n(&slots[i].bp, bp, __ATOMIC_RELEASE);
+			return;
+		}
+		if (slots[i].retaddr == 0) {
+			__atomic_store_n(&slots[i].bp, bp, __ATOMIC_RELAXED);
+			__atomic_store_n(&slots[i].retaddr, retaddr, __ATOMIC_RELEASE);
+			index->count++;
+			return;
+		}
+	}
+}
+
+/*
+ * Make room in the index of handler for n more return addresses.
+ */
+static void
+shiva_trace_bp_index_reserve(struct shiva_ctx *ctx, struct shiva_trace_handler *handler,
+    size_t n)
+{
+	struct shiva_trace_bp_index *index = handler->bp_index, *grown;
+	size_t size, count, i;
+
+	count = index == NULL ? 0 : index->count;
+	if (index != NULL && (count + n) * 2 <= index->size)
+		return;
+	size = index == NULL ? SHIVA_TRACE_BP_INDEX_INITIAL : index->size << 1;
+	while ((count + n) * 2 > size)
+		size <<= 1;
+	grown = shiva_malloc(sizeof(*grown) + size * sizeof(grown->slots[0]));
+	memset(grown, 0, sizeof(*grown) + size * sizeof(grown->slots[0]));
+	grown->size = size;
+	if (index != NULL) {
+		grown->fallback = index->fallback;
+		for (i = 0; i < index->size; i++) {
+			if (index->slots[i].retaddr == 0)
+				continue;
+			shiva_trace_bp_index_set(grown, index->slots[i].retaddr,
+			    index->slots[i].bp);
+		}
+	}
+	shiva_trace_rcu_publish(ctx, (void **)&handler->bp_index, grown);
+	return;
+}
+
+static void
+shiva_trace_bp_index_add(struct shiva_trace_handler *handler, uint64_t retaddr,
+    struct shiva_trace_bp *bp)
+{
+	if (retaddr == 0)
+		return;
+	shiva_trace_bp_index_set(handler->bp_index, retaddr, bp);
+	return;
+}
+
+/*
+ * Add bp to the breakpoint list of handler, and to its index. Must be
+ * called with the trace_rcu lock held, the list is only walked by
+ * writers.
+ */
+void
+shiva_trace_bp_insert(struct shiva_ctx *ctx, struct shiva_trace_handler *handler,
+    struct shiva_trace_bp *bp)
+{
+	struct shiva_addr_struct *addr;
+	size_t n = 3;
+
+	TAILQ_INSERT_TAIL(&handler->bp_tqlist, bp, _linkage);
+	TAILQ_FOREACH(addr, &bp->retaddr_list, _linkage)
+		n++;
+	shiva_trace_bp_index_reserve(ctx, handler, n);
+	shiva_trace_bp_index_add(handler, bp->callsite_retaddr, bp);
+	shiva_trace_bp_index_add(handler, bp->stub_retaddr, bp);
+	if (bp->bp_type == SHIVA_TRACE_BP_WATCH)
+		shiva_trace_bp_index_add(handler, bp->bp_addr, bp);
+	if (bp->bp_type == SHIVA_TRACE_BP_PLTGOT ||
+	    bp->bp_type == SHIVA_TRACE_BP_TRAMPOLINE) {
+		TAILQ_FOREACH(addr, &bp->retaddr_list, _linkage)
+			shiva_trace_bp_index_add(handler, addr->addr, bp);
+	}
+	if (bp->bp_type == SHIVA_TRACE_BP_TRAMPOLINE && handler->bp_index->fallback == NULL)
+		__atomic_store_n(&handler->bp_index->fallback, bp, __ATOMIC_RELEASE);
+	return;
+}
+
+/*
+ * Find the breakpoint of handler that a handler invocation returning
+ * to retaddr came from. A TRAMPOLINE hook may also be reached through
+ * a call that shiva_analyze.c didn't see (i.e. through a function
+ * pointer), in which case the first TRAMPOLINE breakpoint of the
+ * handler is returned, as SHIVA_TRACE_BP_STRUCT() always has.
+ */
+struct shiva_trace_bp *
+shiva_trace_bp_lookup(struct shiva_trace_handler *handler, uint64_t retaddr)
+{
+	struct shiva_trace_bp_index *index;
+	struct shiva_trace_bp_slot *slot;
+	struct shiva_trace_bp *bp = NULL;
+	uint64_t key;
+	size_t i, mask;
+
+	shiva_trace_rcu_enter(ctx_global);
+	index = __atomic_load_n(&handler->bp_index, __ATOMIC_ACQUIRE);
+	if (index == NULL)
+		goto done;
+	bp = __atomic_load_n(&index->fallback, __ATOMIC_ACQUIRE);
+	if (retaddr == 0)
+		goto done;
+	mask = index->size - 1;
+	for (i = shiva_trace_bp_hash(retaddr) & mask;; i = (i + 1) & mask) {
+		slot = &index->slots[i];
+		key = __atomic_load_n(&slot->retaddr, __ATOMIC_ACQUIRE);
+		if (key == retaddr) {
+			bp = __atomic_load_n(&slot->bp, __ATOMIC_ACQUIRE);
+			break;
+		}
+		if (key == 0)
+			break;
+	}
+done:
+	shiva_trace_rcu_exit(ctx_global);
+	return bp;
+}
+
+static inline size_t
+shiva_trace_tls_hash(uint64_t tp)
+{
+	return (size_t)((tp >> 4) * 0x9e3779b97f4a7c15UL >> 32);
+}
+
+/*
+ * Find the slot of the thread whose thread pointer is tp, claiming a
+ * free one if insert is true. Slots are only ever claimed, with a
+ * single compare and swap, so lookups need no lock. A thread that
+ * exits leaves its slot behind, which is reused by the next thread
+ * that gets the same thread pointer.
+ */
+static struct shiva_trace_tls *
+shiva_trace_tls_slot(struct shiva_ctx *ctx, uint64_t tp, bool insert)
+{
+	struct shiva_trace_tls *slot;
+	size_t i, n, mask = SHIVA_TRACE_TLS_SLOTS - 1;
+	uint64_t key;
+
+	if (ctx->trace_tls == NULL)
+		return NULL;
+	for (i = shiva_trace_tls_hash(tp) & mask, n = 0; n < SHIVA_TRACE_TLS_SLOTS;
+	    i = (i + 1) & mask, n++) {
+		slot = &ctx->trace_tls[i];
+		key = __atomic_load_n(&slot->tp, __ATOMIC_ACQUIRE);
+		if (key == tp)
+			return slot;
+		if (key != 0)
+			continue;
+		if (insert == false)
+			return NULL;
+		if (__atomic_compare_exchange_n(&slot->tp, &key, tp, false,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == true || key == tp)
+			return slot;
+	}
+	return NULL;
+}
+
+static inline uint64_t
+shiva_trace_tp(void)
+{
+	uint64_t tp = (uint64_t)__builtin_thread_pointer();
+
+	return tp == 0 ? 1 : tp;
+}
+
+/*
+ * The slot of the calling thread, claimed if insert is true. When the
+ * table is full the extra slot at the end of ctx->trace_tls, shared by
+ * every thread that didn't fit, is returned instead.
+ */
+struct shiva_trace_tls *
+shiva_trace_tls_self(struct shiva_ctx *ctx, bool insert)
+{
+	struct shiva_trace_tls *tls;
+
+	if (ctx->trace_tls == NULL)
+		return NULL;
+	shiva_fork_check(ctx);
+	tls = shiva_trace_tls_slot(ctx, shiva_trace_tp(), insert);
+	if (tls == NULL && insert == true)
+		tls = &ctx->trace_tls[SHIVA_TRACE_TLS_SLOTS];
+	return tls;
+}
+
+/*
+ * In a forked child only the thread that called fork() survives. It is
+ * most likely the one that gets here first, so its slot is kept, along
+ * with any hook frames it is in. Every other slot belongs to a thread
+ * of the parent, and so is its thread record. No slot keeps its trace
+ * ring, which is shared with the parent and may only have a single
+ * producer.
+ */
+static void
+shiva_trace_tls_atfork(struct shiva_ctx *ctx)
+{
+	uint64_t tp = shiva_trace_tp();
+	size_t i;
+
+	for (i = 0; i < SHIVA_TRACE_TLS_SLOTS + 1; i++) {
+		if (i == SHIVA_TRACE_TLS_SLOTS || ctx->trace_tls[i].tp != tp) {
+			ctx->trace_tls[i].frame = NULL;
+			memset(&ctx->trace_tls[i].thread, 0, sizeof(ctx->trace_tls[i].thread));
+			ctx->trace_tls[i].rcu_epoch = 0;
+			ctx->trace_tls[i].rcu_nest = 0;
+			__atomic_store_n(&ctx->trace_tls[i].tp, 0, __ATOMIC_RELEASE);
+		} else {
+			shiva_trace_thread_forked(&ctx->trace_tls[i]);
+		}
+		ctx->trace_tls[i].ring = NULL;
+	}
+	/*
+	 * Readers and writers of the trace_rcu tables that were left in
+	 * the threads that didn't survive the fork.
+	 */
+	ctx->trace_rcu.overflow = 0;
+	ctx->trace_rcu.lock = 0;
+	return;
+}
+
+/*
+ * Must be called before any thread can reach shiva_trace_tls_self().
+ * The slots are written on every hook, so they get pages of their own
+ * rather than dirtying the heap pages that a forked child would share
+ * with its parent.
+ */
+void
+shiva_trace_tls_init(struct shiva_ctx *ctx)
+{
+	void *mem;
+
+	if (ctx->trace_tls != NULL)
+		return;
+	mem = mmap(NULL, ELF_PAGEALIGN((SHIVA_TRACE_TLS_SLOTS + 1) *
+	    sizeof(*ctx->trace_tls), PAGE_SIZE), PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	ctx->trace_tls = mem;
+	(void) shiva_atfork(ctx, shiva_trace_tls_atfork);
+	return;
+}
+
+#if __aarch64__
+/*
+ * AArch64 hooks.
+ *
+ * CALL and JMP breakpoints rewrite the bl or b at bp_addr, and
+ * TRAMPOLINE breakpoints patch the first instruction of the function at
+ * bp_addr with a b. Either way the branch goes to a stub in
+ * ctx->trace_island, which saves x0-x9, x29, x30 and sp in a struct
+ * shiva_trace_frame on the stack, pushes it onto the frame list of the
+ * calling thread and calls the handler with the original arguments.
+ * Once the handler returns the frame is popped and the stub returns to
+ * the caller of the hooked function with the handlers return value.
+ * No signal is involved, and no state is shared between threads.
+ * With hook stats (See shiva_hook_stats.c) the stub passes the entry of
+ * the hook to shiva_trace_frame_push() in x1, and with latency enabled
+ * it pops the frame through shiva_trace_frame_pop(), preserving x0 and
+ * x1 across it, rather than inline.
+ *
+ * stub:	sub	sp, sp, #FRAME
+ *		stp	x0, x1, [sp] ... stp x8, x9, [sp, #64]
+ *		stp	x29, x30, [sp, #232]
+ *		add	x9, sp, #FRAME
+ *		str	x9, [sp, #248]
+ *		mov	x0, sp
+ *		ldr	x16, .Lpush
+ *		blr	x16			// shiva_trace_frame_push()
+ *		ldp	x0, x1, [sp] ... ldp x8, x9, [sp, #64]
+ *		ldr	x16, .Lhandler
+ *		blr	x16
+ *		ldr	x16, [sp, #264]		// frame->tls->frame = frame->prev
+ *		ldr	x17, [sp, #256]
+ *		str	x17, [x16, #8]
+ *		ldp	x29, x30, [sp, #232]
+ *		add	sp, sp, #FRAME
+ *		ret
+ *
+ * For TRAMPOLINE breakpoints the stub is followed by a thunk that runs
+ * the displaced instruction and branches back to bp_addr + 4, which is
+ * what SHIVA_TRACE_CALL_ORIGINAL() calls. The island is mapped within
+ * b/bl range of the target .text so that all of these branches are
+ * direct; an indirect branch back into the target could fault on a BTI
+ * guarded page.
+ */
+#define SHIVA_TRACE_ISLAND_SIZE		(PAGE_SIZE * 4)
+#define SHIVA_TRACE_STUB_SIZE		160
+#define SHIVA_TRACE_THUNK_SIZE		32
+#define SHIVA_TRACE_B_RANGE		(1L << 27)
+
+#define A64_NOP			0xd503201f
+#define A64_RET			0xd65f03c0
+#define A64_BLR_X16		0xd63f0200
+#define A64_MOV_X0_SP		0x910003e0
+#define A64_SUB_SP(imm)		(0xd10003ff | ((imm) << 10))
+#define A64_ADD_SP(imm)		(0x910003ff | ((imm) << 10))
+#define A64_ADD_X9_SP(imm)	(0x910003e9 | ((imm) << 10))
+#define A64_LDR_LIT(rt, off)	(0x58000000 | ((((off) >> 2) & 0x7ffff) << 5) | (rt))
+#define A64_STP(rt, rt2, rn, off) \
+	(0xa9000000 | ((((off) >> 3) & 0x7f) << 15) | ((rt2) << 10) | ((rn) << 5) | (rt))
+#define A64_LDP(rt, rt2, rn, off) (A64_STP(rt, rt2, rn, off) | (1 << 22))
+#define A64_STR(rt, rn, off)	(0xf9000000 | (((off) >> 3) << 10) | ((rn) << 5) | (rt))
+#define A64_LDR(rt, rn, off)	(A64_STR(rt, rn, off) | (1 << 22))
+
+static inline bool
+shiva_trace_b_in_range(uint64_t from, uint64_t to)
+{
+	int64_t off = (int64_t)(to - from);
+
+	return off >= -SHIVA_TRACE_B_RANGE && off < SHIVA_TRACE_B_RANGE;
+}
+
+static inline uint32_t
+shiva_trace_a64_b(bool is_bl, uint64_t from, uint64_t to)
+{
+	uint8_t buf[4];
+	uint32_t insn;
+
+	shiva_aarch64_emit_b(buf, is_bl, (int64_t)(to - from));
+	memcpy(&insn, buf, sizeof(insn));
+	return insn;
+}
+
+/*
+ * Carve len bytes out of the trace island, mapping a new one within
+ * range of the target .text when there is no room left.
+ */
+static uint8_t *
+shiva_trace_island_alloc(struct shiva_ctx *ctx, size_t len, shiva_error_t *error)
+{
+	struct elf_section section;
+	uint64_t text_lo, text_hi, lo, hi, base;
+	uint8_t *p;
+	void *mem;
+
+	if (ctx->trace_island.mem != NULL &&
+	    ctx->trace_island.size - ctx->trace_island.used >= len)
+		goto done;
+	if (elf_section_by_name(&ctx->elfobj, ".text", &section) == false) {
+		shiva_error_set(error, "elf_section_by_name failed to find \".text\"\n");
+		return NULL;
+	}
+	text_lo = shiva_trace_base_addr(ctx) + section.address;
+	text_hi = text_lo + section.size;
+	lo = text_hi > SHIVA_TRACE_B_RANGE ? text_hi - SHIVA_TRACE_B_RANGE : 0;
+	hi = text_lo + SHIVA_TRACE_B_RANGE;
+	if (shiva_maps_refresh(ctx) == false ||
+	    shiva_maps_find_gap(ctx, lo, hi, SHIVA_TRACE_ISLAND_SIZE, &base) == false) {
+		shiva_error_set(error, "no room for a trace island within range of "
+		    "%#lx - %#lx\n", text_lo, text_hi);
+		return NULL;
+	}
+	mem = mmap((void *)base, SHIVA_TRACE_ISLAND_SIZE, PROT_READ|PROT_EXEC,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+	if (mem == MAP_FAILED || (uint64_t)mem != base) {
+		if (mem != MAP_FAILED)
+			munmap(mem, SHIVA_TRACE_ISLAND_SIZE);
+		shiva_error_set(error, "unable to map a trace island at %#lx\n", base);
+		return NULL;
+	}
+	if (shiva_maps_refresh(ctx) == false) {
+		shiva_error_set(error, "refresh of /proc/self/maps failed\n");
+		return NULL;
+	}
+	ctx->trace_island.mem = mem;
+	ctx->trace_island.size = SHIVA_TRACE_ISLAND_SIZE;
+	ctx->trace_island.used = 0;
+	shiva_debug("Trace island at %p\n", mem);
+done:
+	p = ctx->trace_island.mem + ctx->trace_island.used;
+	ctx->trace_island.used += len;
+	return p;
+}
+
+/*
+ * shiva_trace_write() followed by an instruction cache flush.
+ */
+static bool
+shiva_trace_write_code(struct shiva_ctx *ctx, void *dst, const void *src, size_t len,
+    shiva_error_t *error)
+{
+	if (shiva_trace_write(ctx, 0, dst, src, len, error) == false)
+		return false;
+	__builtin___clear_cache((char *)dst, (char *)dst + len);
+	return true;
+}
+
+/*
+ * Called by the hook stubs before entering the handler. It must not
+ * touch the SIMD registers, which may still hold arguments of the
+ * hooked function.
+ */
+static void __attribute__((target("general-regs-only"), used))
+shiva_trace_frame_push(struct shiva_trace_frame *frame, struct shiva_hook_stats_entry *stats)
+{
+	struct shiva_trace_tls *tls = shiva_trace_tls_self(ctx_global, true);
+
+	frame->tls = tls;
+	frame->prev = tls->frame;
+	frame->stats = stats;
+	if (stats != NULL)
+		frame->t0 = shiva_hook_stats_enter(stats, shiva_trace_tp());
+	tls->frame = frame;
+	return;
+}
+
+/*
+ * Called by the hook stubs of hooks with latency stats once the handler
+ * has returned.
+ */
+static void __attribute__((target("general-regs-only"), used))
+shiva_trace_frame_pop(struct shiva_trace_frame *frame)
+{
+	if (frame->stats != NULL)
+		shiva_hook_stats_leave(frame->stats, shiva_trace_tp(), frame->t0);
+	frame->tls->frame = frame->prev;
+	return;
+}
+
+/*
+ * The registers saved by the innermost hook stub that the calling
+ * thread is in, or NULL.
+ */
+struct shiva_trace_regset_aarch64 *
+shiva_trace_regs_current(void)
+{
+	struct shiva_trace_tls *tls = shiva_trace_tls_self(ctx_global, false);
+
+	if (tls == NULL || tls->frame == NULL)
+		return NULL;
+	return &tls->frame->regs;
+}
+
+/*
+ * Write the hook stub for handler_fn at stub, and set *retaddr to the
+ * address that the handler returns to. stats is the hook stats entry of
+ * the hook, or NULL.
+ */
+static bool
+shiva_trace_aarch64_stub(struct shiva_ctx *ctx, uint8_t *stub, void *handler_fn,
+    struct shiva_hook_stats_entry *stats, uint64_t *retaddr, shiva_error_t *error)
+{
+	uint32_t code[SHIVA_TRACE_STUB_SIZE / sizeof(uint32_t)];
+	size_t frame = sizeof(struct shiva_trace_frame);
+	uint64_t literal[4];
+	int i, n = 0, nlit = 0, push_lit, fn_lit, stats_lit = -1, pop_lit = -1;
+	bool latency = stats != NULL && shiva_hook_stats_latency(ctx);
+
+	shiva_trace_tls_init(ctx);
+	code[n++] = A64_SUB_SP(frame);
+	for (i = 0; i < 10; i += 2)
+		code[n++] = A64_STP(i, i + 1, 31, SHIVA_TRACE_AARCH64_X_OFF(i));
+	code[n++] = A64_STP(29, 30, 31, SHIVA_TRACE_AARCH64_X_OFF(29));
+	code[n++] = A64_ADD_X9_SP(frame);
+	code[n++] = A64_STR(9, 31, SHIVA_TRACE_AARCH64_SP_OFF);
+	code[n++] = A64_MOV_X0_SP;
+	if (stats != NULL)
+		stats_lit = n++;
+	push_lit = n++;
+	code[n++] = A64_BLR_X16;
+	for (i = 0; i < 10; i += 2)
+		code[n++] = A64_LDP(i, i + 1, 31, SHIVA_TRACE_AARCH64_X_OFF(i));
+	fn_lit = n++;
+	code[n++] = A64_BLR_X16;
+	*retaddr = (uint64_t)stub + n * sizeof(uint32_t);
+	if (latency == true) {
+		code[n++] = A64_STP(0, 1, 31, SHIVA_TRACE_AARCH64_X_OFF(0));
+		code[n++] = A64_MOV_X0_SP;
+		pop_lit = n++;
+		code[n++] = A64_BLR_X16;
+		code[n++] = A64_LDP(0, 1, 31, SHIVA_TRACE_AARCH64_X_OFF(0));
+	} else {
+		code[n++] = A64_LDR(16, 31, offsetof(struct shiva_trace_frame, tls));
+		code[n++] = A64_LDR(17, 31, offsetof(struct shiva_trace_frame, prev));
+		code[n++] = A64_STR(17, 16, offsetof(struct shiva_trace_tls, frame));
+	}
+	code[n++] = A64_LDP(29, 30, 31, SHIVA_TRACE_AARCH64_X_OFF(29));
+	code[n++] = A64_ADD_SP(frame);
+	code[n++] = A64_RET;
+	literal[nlit++] = (uint64_t)shiva_trace_frame_push;
+	literal[nlit++] = (uint64_t)handler_fn;
+	if (stats != NULL)
+		literal[nlit++] = (uint64_t)stats;
+	if (latency == true)
+		literal[nlit++] = (uint64_t)shiva_trace_frame_pop;
+	while (n < (int)((SHIVA_TRACE_STUB_SIZE - nlit * sizeof(uint64_t)) /
+	    sizeof(uint32_t)))
+		code[n++] = A64_NOP;
+	code[push_lit] = A64_LDR_LIT(16, (n - push_lit) * 4);
+	code[fn_lit] = A64_LDR_LIT(16, (n + 2 - fn_lit) * 4);
+	if (stats != NULL)
+		code[stats_lit] = A64_LDR_LIT(1, (n + 4 - stats_lit) * 4);
+	if (latency == true)
+		code[pop_lit] = A64_LDR_LIT(16, (n + 6 - pop_lit) * 4);
+	memcpy(&code[n], literal, nlit * sizeof(uint64_t));
+	return shiva_trace_write_code(ctx, stub, code, sizeof(code), error);
+}
+
+/*
+ * The counting stub of a patch function (See shiva_hook_stats.c), hits
+ * is the counter of the first stripe of its entry:
+ *
+ * stub:	mrs	x17, tpidr_el0
+ *		eor	x17, x17, x17, lsr #20
+ *		ubfx	x17, x17, #12, #4	// shiva_hook_stats_stripe()
+ *		ldr	x16, .Lhits
+ *		add	x16, x16, x17, lsl #6
+ *		mov	x17, #1
+ *		stadd	x17, [x16]
+ *		ldr	x16, .Ltarget
+ *		br	x16
+ *
+ * It only clobbers x16 and x17, which any veneer may, and lives in the
+ * trace island so that every callsite of the target can reach it.
+ */
+#define A64_MRS_X17_TPIDR	0xd53bd051
+#define A64_EOR_X17_LSR20	0xca515231
+#define A64_UBFX_X17_12_4	0xd34c3e31
+#define A64_ADD_X16_X17_LSL6	0x8b111a10
+#define A64_MOV_X17_1		0xd2800031
+#define A64_STADD_X17_X16	0xf831021f
+#define A64_BR_X16		0xd61f0200
+#define SHIVA_TRACE_HIT_STUB_SIZE	56
+
+uint8_t *
+shiva_trace_hit_stub(struct shiva_ctx *ctx, uint64_t *hits, uint64_t target,
+    shiva_error_t *error)
+{
+	uint32_t code[SHIVA_TRACE_HIT_STUB_SIZE / sizeof(uint32_t)];
+	uint64_t literal[2];
+	uint8_t *stub;
+	int n = 0;
+
+	stub = shiva_trace_island_alloc(ctx, SHIVA_TRACE_HIT_STUB_SIZE, error);
+	if (stub == NULL)
+		return NULL;
+	code[n++] = A64_MRS_X17_TPIDR;
+	code[n++] = A64_EOR_X17_LSR20;
+	code[n++] = A64_UBFX_X17_12_4;
+	code[n] = A64_LDR_LIT(16, (10 - n) * 4);
+	n++;
+	code[n++] = A64_ADD_X16_X17_LSL6;
+	code[n++] = A64_MOV_X17_1;
+	code[n++] = A64_STADD_X17_X16;
+	code[n] = A64_LDR_LIT(16, (12 - n) * 4);
+	n++;
+	code[n++] = A64_BR_X16;
+	code[n++] = A64_NOP;
+	literal[0] = (uint64_t)hits;
+	literal[1] = target;
+	memcpy(&code[n], literal, sizeof(literal));
+	if (shiva_trace_write_code(ctx, stub, code, sizeof(code), error) == false)
+		return NULL;
+	return stub;
+}
+
+/*
+ * Build the thunk that executes the instruction displaced from
+ * bp_addr and continues at bp_addr + 4. PC relative instructions
+ * are relocated to the thunk, except for those with a short range
+ * (b.cond, cbz, tbz, ldr literal) which cannot be displaced.
+ */
+static bool
+shiva_trace_aarch64_thunk(struct shiva_ctx *ctx, uint8_t *thunk, uint64_t bp_addr,
+    uint32_t o_insn, shiva_error_t *error)
+{
+	uint32_t code[SHIVA_TRACE_THUNK_SIZE / sizeof(uint32_t)];
+	uint64_t pc = (uint64_t)thunk, value;
+	struct shiva_aarch64_insn insn;
+	int i;
+
+	for (i = 0; i < SHIVA_TRACE_THUNK_SIZE / (int)sizeof(uint32_t); i++)
+		code[i] = A64_NOP;
+	if ((o_insn & 0x9f000000) == 0x10000000) {
+		/*
+		 * adr xd, label
+		 */
+		value = bp_addr + shiva_aarch64_sext(((o_insn >> 29) & 0x3) |
+		    (((o_insn >> 5) & 0x7ffff) << 2), 21);
+		goto materialize;
+	}
+	if ((o_insn & 0x3b000000) == 0x18000000)
+		goto unsupported;
+	if (shiva_aarch64_decode(o_insn, &insn) == false) {
+		code[0] = o_insn;
+		code[1] = shiva_trace_a64_b(false, pc + 4, bp_addr + 4);
+		goto write;
+	}
+	switch(insn.type) {
+	case SHIVA_AARCH64_INSN_B:
+	case SHIVA_AARCH64_INSN_BL:
+		if (shiva_trace_b_in_range(pc, bp_addr + insn.imm) == false)
+			goto unsupported;
+		code[0] = shiva_trace_a64_b(insn.type == SHIVA_AARCH64_INSN_BL, pc,
+		    bp_addr + insn.imm);
+		code[1] = shiva_trace_a64_b(false, pc + 4, bp_addr + 4);
+		goto write;
+	case SHIVA_AARCH64_INSN_ADRP:
+		value = (bp_addr & ~0xfffUL) + insn.imm;
+		goto materialize;
+	case SHIVA_AARCH64_INSN_BCOND:
+	case SHIVA_AARCH64_INSN_CB:
+	case SHIVA_AARCH64_INSN_TB:
+		goto unsupported;
+	default:
+		code[0] = o_insn;
+		code[1] = shiva_trace_a64_b(false, pc + 4, bp_addr + 4);
+		goto write;
+	}
+materialize:
+	/*
+	 * ldr xd, .Lvalue; b bp_addr + 4; ... .Lvalue: .quad value
+	 */
+	code[0] = A64_LDR_LIT(o_insn & 0x1f, 16);
+	code[1] = shiva_trace_a64_b(false, pc + 4, bp_addr + 4);
+	memcpy(&code[4], &value, sizeof(value));
+write:
+	return shiva_trace_write_code(ctx, thunk, code, sizeof(code), error);
+unsupported:
+	shiva_error_set(error, "cannot displace the instruction %#x at %#lx\n",
+	    o_insn, bp_addr);
+	return false;
+}
+
+/*
+ * SHIVA_TRACE_BP_CALL and SHIVA_TRACE_BP_JMP: relink the bl or b at
+ * bp_addr to a stub for handler_fn.
+ */
+static bool
+shiva_trace_aarch64_branch_hook(struct shiva_ctx *ctx, struct shiva_trace_handler *handler,
+    uint64_t bp_addr, shiva_error_t *error)
+{
+	struct shiva_hook_stats_entry *stats;
+	struct shiva_aarch64_insn insn;
+	struct shiva_trace_bp *bp;
+	struct elf_symbol symbol;
+	uint64_t stub_retaddr;
+	uint8_t *stub;
+	uint32_t o_insn, n_insn;
+	bool is_bl = handler->type == SHIVA_TRACE_BP_CALL;
+
+	memcpy(&o_insn, (void *)bp_addr, sizeof(o_insn));
+	if (shiva_aarch64_decode(o_insn, &insn) == false ||
+	    insn.type != (is_bl ? SHIVA_AARCH64_INSN_BL : SHIVA_AARCH64_INSN_B)) {
+		shiva_error_set(error, "instruction at %#lx is not a %s\n", bp_addr,
+		    is_bl ? "bl" : "b");
+		return false;
+	}
+	stub = shiva_trace_island_alloc(ctx, SHIVA_TRACE_STUB_SIZE, error);
+	if (stub == NULL)
+		return false;
+	if (shiva_trace_b_in_range(bp_addr, (uint64_t)stub) == false) {
+		shiva_error_set(error, "trace stub %p is out of range of %#lx\n",
+		    stub, bp_addr);
+		return false;
+	}
+
+	bp = shiva_arena_alloc(&ctx->arena.trace, sizeof(*bp));
+	memcpy(&bp->insn.o_insn[0], &o_insn, sizeof(o_insn));
+	bp->insn.o_insn_len = sizeof(o_insn);
+	bp->o_call_offset = insn.imm;
+	bp->o_target = bp_addr + insn.imm;
+	bp->bp_type = handler->type;
+	bp->bp_addr = bp_addr;
+	bp->bp_len = sizeof(o_insn);
+	bp->callsite_retaddr = bp_addr + bp->bp_len;
+	TAILQ_INIT(&bp->retaddr_list);
+	if (elf_symbol_by_value_lookup(&ctx->elfobj,
+	    bp->o_target - shiva_trace_base_addr(ctx), &symbol) == true) {
+		bp->symbol_location = true;
+		memcpy(&bp->symbol, &symbol, sizeof(symbol));
+		bp->call_target_symname = (char *)symbol.name;
+	} else {
+		bp->call_target_symname = shiva_arena_xfmtstrdup(&ctx->arena.trace,
+		    "fn_%#lx", bp->o_target);
+	}
+	stats = shiva_hook_stats_alloc(ctx, SHIVA_HOOK_STATS_HANDLER, handler->type,
+	    bp_addr, (uint64_t)handler->handler_fn, bp->call_target_symname);
+	if (shiva_trace_aarch64_stub(ctx, stub, handler->handler_fn, stats,
+	    &stub_retaddr, error) == false)
+		return false;
+	bp->stub_retaddr = stub_retaddr;
+	n_insn = shiva_trace_a64_b(is_bl, bp_addr, (uint64_t)stub);
+	memcpy(&bp->insn.n_insn[0], &n_insn, sizeof(n_insn));
+	bp->insn.n_insn_len = sizeof(n_insn);
+	if (shiva_trace_write_code(ctx, (void *)bp_addr, &n_insn, sizeof(n_insn),
+	    error) == false)
+		return false;
+	shiva_debug("Inserted %s breakpoint: %#lx -> %p -> %p\n", is_bl ? "call" : "jmp",
+	    bp_addr, stub, handler->handler_fn);
+	shiva_trace_bp_insert(ctx, handler, bp);
+	return true;
+}
+
+/*
+ * SHIVA_TRACE_BP_TRAMPOLINE: branch from the first instruction of the
+ * function at bp_addr to a stub for handler_fn.
+ */
+static bool
+shiva_trace_aarch64_trampoline(struct shiva_ctx *ctx, struct shiva_trace_handler *handler,
+    uint64_t bp_addr, shiva_error_t *error)
+{
+	struct shiva_hook_stats_entry *stats;
+	struct shiva_branch_site *branch_site;
+	struct shiva_trace_bp *bp;
+	struct elf_symbol symbol;
+	uint64_t stub_retaddr;
+	uint8_t *stub;
+	uint32_t o_insn, n_insn;
+	size_t i;
+
+	memcpy(&o_insn, (void *)bp_addr, sizeof(o_insn));
+	stub = shiva_trace_island_alloc(ctx, SHIVA_TRACE_STUB_SIZE +
+	    SHIVA_TRACE_THUNK_SIZE, error);
+	if (stub == NULL)
+		return false;
+	if (shiva_trace_b_in_range(bp_addr, (uint64_t)stub) == false) {
+		shiva_error_set(error, "trace stub %p is out of range of %#lx\n",
+		    stub, bp_addr);
+		return false;
+	}
+	if (shiva_trace_aarch64_thunk(ctx, stub + SHIVA_TRACE_STUB_SIZE, bp_addr,
+	    o_insn, error) == false)
+		return false;
+
+	bp = shiva_arena_alloc(&ctx->arena.trace, sizeof(*bp));
+	if (elf_symbol_by_value_lookup(&ctx->elfobj,
+	    bp_addr - shiva_trace_base_addr(ctx), &symbol) == true) {
+		bp->symbol_location = true;
+		memcpy(&bp->symbol, &symbol, sizeof(symbol));
+		bp->call_target_symname = (char *)symbol.name;
+	}
+	stats = shiva_hook_stats_alloc(ctx, SHIVA_HOOK_STATS_HANDLER, handler->type,
+	    bp_addr, (uint64_t)handler->handler_fn, bp->call_target_symname);
+	if (shiva_trace_aarch64_stub(ctx, stub, handler->handler_fn, stats,
+	    &stub_retaddr, error) == false)
+		return false;
+	memcpy(&bp->insn.o_insn[0], &o_insn, sizeof(o_insn));
+	bp->insn.o_insn_len = sizeof(o_insn);
+	bp->o_target = (uint64_t)stub + SHIVA_TRACE_STUB_SIZE;
+	bp->bp_type = handler->type;
+	bp->bp_addr = bp_addr;
+	bp->bp_len = sizeof(o_insn);
+	bp->stub_retaddr = stub_retaddr;
+	/*
+	 * Valid return addresses for the function we are hooking, from
+	 * the control flow information of shiva_analyze.c
+	 */
+	TAILQ_INIT(&bp->retaddr_list);
+	for (i = 0; i < ctx->analysis.branch_count; i++) {
+		branch_site = &ctx->analysis.branches[i];
+		if (branch_site->branch_type != SHIVA_BRANCH_CALL)
+			continue;
+		if (branch_site->target_vaddr + shiva_trace_base_addr(ctx) == bp_addr) {
+			struct shiva_addr_struct *addr =
+			    shiva_arena_alloc(&ctx->arena.trace, sizeof(*addr));
+
+			addr->addr = branch_site->retaddr + shiva_trace_base_addr(ctx);
+			TAILQ_INSERT_TAIL(&bp->retaddr_list, addr, _linkage);
+		}
+	}
+	n_insn = shiva_trace_a64_b(false, bp_addr, (uint64_t)stub);
+	memcpy(&bp->insn.n_insn[0], &n_insn, sizeof(n_insn));
+	bp->insn.n_insn_len = sizeof(n_insn);
+	if (shiva_trace_write_code(ctx, (void *)bp_addr, &n_insn, sizeof(n_insn),
+	    error) == false)
+		return false;
+	shiva_debug("Inserted trampoline breakpoint: %#lx -> %p, original at %#lx\n",
+	    bp_addr, stub, bp->o_target);
+	shiva_trace_bp_insert(ctx, handler, bp);
+	return true;
+}
+/*
+ * SHIVA_TRACE_BP_FAST: the instruction at bp_addr is replaced with a b
+ * to a stub that saves the full register state on the stack, calls
+ * handler_fn(struct shiva_trace_fast_regs *) and then restores the
+ * registers, runs the displaced instruction and branches back to
+ * bp_addr + 4. No signal is delivered, and since the register state
+ * lives on the stack of the thread that hit the breakpoint the handler
+ * may be reached by several threads at once. Changes that the handler
+ * makes to x0-x30 and nzcv take effect when it returns.
+ */
+#define SHIVA_TRACE_FAST_FRAME		(272 + 32 * 16)
+#define SHIVA_TRACE_FAST_CODE_MAX	96
+
+#define A64_MRS_X9_NZCV		0xd53b4209
+#define A64_MSR_NZCV_X9		0xd51b4209
+#define A64_STP_Q(rt, rt2, rn, off) \
+	(0xad000000 | ((((off) >> 4) & 0x7f) << 15) | ((rt2) << 10) | ((rn) << 5) | (rt))
+#define A64_LDP_Q(rt, rt2, rn, off) (A64_STP_Q(rt, rt2, rn, off) | (1 << 22))
+
+static bool
+shiva_trace_aarch64_fast(struct shiva_ctx *ctx, struct shiva_trace_handler *handler,
+    uint64_t bp_addr, shiva_error_t *error)
+{
+	uint32_t code[SHIVA_TRACE_FAST_CODE_MAX];
+	uint32_t o_insn, n_insn;
+	struct shiva_trace_bp *bp;
+	struct elf_symbol symbol;
+	uint64_t literal[2];
+	size_t code_len, len;
+	uint8_t *stub;
+	int i, n = 0, pc_lit, fn_lit;
+
+	memcpy(&o_insn, (void *)bp_addr, sizeof(o_insn));
+	/*
+	 * stub:	sub	sp, sp, #FRAME
+	 *		stp	x0, x1, [sp] ... str x30, [sp, #240]
+	 *		(sp, nzcv, pc and q0-q31)
+	 *		mov	x0, sp
+	 *		ldr	x16, .Lhandler
+	 *		blr	x16
+	 *		(restore q0-q31, nzcv, x0-x30)
+	 *		add	sp, sp, #FRAME
+	 * thunk:	<displaced instruction>
+	 *		b	bp_addr + 4
+	 * .Lhandler:	.quad handler_fn
+	 * .Lpc:	.quad bp_addr
+	 */
+	code[n++] = A64_SUB_SP(SHIVA_TRACE_FAST_FRAME);
+	for (i = 0; i < 30; i += 2)
+		code[n++] = A64_STP(i, i + 1, 31, SHIVA_TRACE_AARCH64_X_OFF(i));
+	code[n++] = A64_STR(30, 31, SHIVA_TRACE_AARCH64_X_OFF(30));
+	code[n++] = A64_ADD_X9_SP(SHIVA_TRACE_FAST_FRAME);
+	code[n++] = A64_STR(9, 31, SHIVA_TRACE_AARCH64_SP_OFF);
+	code[n++] = A64_MRS_X9_NZCV;
+	code[n++] = A64_STR(9, 31, SHIVA_TRACE_FAST_NZCV_OFF);
+	/*
+	 * ldr x9, .Lpc and ldr x16, .Lhandler are filled in below, once the
+	 * offset of the literals is known
+	 */
+	pc_lit = n;
+	code[n++] = 0;
+	code[n++] = A64_STR(9, 31, SHIVA_TRACE_FAST_PC_OFF);
+	for (i = 0; i < 32; i += 2)
+		code[n++] = A64_STP_Q(i, i + 1, 31, SHIVA_TRACE_FAST_Q_OFF(i));
+	code[n++] = A64_MOV_X0_SP;
+	fn_lit = n;
+	code[n++] = 0;
+	code[n++] = A64_BLR_X16;
+	for (i = 0; i < 32; i += 2)
+		code[n++] = A64_LDP_Q(i, i + 1, 31, SHIVA_TRACE_FAST_Q_OFF(i));
+	code[n++] = A64_LDR(9, 31, SHIVA_TRACE_FAST_NZCV_OFF);
+	code[n++] = A64_MSR_NZCV_X9;
+	for (i = 0; i < 30; i += 2)
+		code[n++] = A64_LDP(i, i + 1, 31, SHIVA_TRACE_AARCH64_X_OFF(i));
+	code[n++] = A64_LDR(30, 31, SHIVA_TRACE_AARCH64_X_OFF(30));
+	code[n++] = A64_ADD_SP(SHIVA_TRACE_FAST_FRAME);
+	if (n & 1)
+		code[n++] = A64_NOP;
+	code_len = n * sizeof(uint32_t);
+	assert(code_len + SHIVA_TRACE_THUNK_SIZE <= sizeof(code));
+	code[pc_lit] = A64_LDR_LIT(9, (int)(code_len + SHIVA_TRACE_THUNK_SIZE + 8 -
+	    pc_lit * 4));
+	code[fn_lit] = A64_LDR_LIT(16, (int)(code_len + SHIVA_TRACE_THUNK_SIZE -
+	    fn_lit * 4));
+	literal[0] = (uint64_t)handler->handler_fn;
+	literal[1] = bp_addr;
+	len = code_len + SHIVA_TRACE_THUNK_SIZE + sizeof(literal);
+
+	stub = shiva_trace_island_alloc(ctx, len, error);
+	if (stub == NULL)
+		return false;
+	if (shiva_trace_b_in_range(bp_addr, (uint64_t)stub) == false) {
+		shiva_error_set(error, "trace stub %p is out of range of %#lx\n",
+		    stub, bp_addr);
+		return false;
+	}
+	if (shiva_trace_aarch64_thunk(ctx, stub + code_len, bp_addr, o_insn,
+	    error) == false)
+		return false;
+	if (shiva_trace_write_code(ctx, stub + code_len + SHIVA_TRACE_THUNK_SIZE,
+	    literal, sizeof(literal), error) == false)
+		return false;
+	if (shiva_trace_write_code(ctx, stub, code, code_len, error) == false)
+		return false;
+
+	bp = shiva_arena_alloc(&ctx->arena.trace, sizeof(*bp));
+	if (elf_symbol_by_value_lookup(&ctx->elfobj,
+	    bp_addr - shiva_trace_base_addr(ctx), &symbol) == true) {
+		bp->symbol_location = true;
+		memcpy(&bp->symbol, &symbol, sizeof(symbol));
+	}
+	memcpy(&bp->insn.o_insn[0], &o_insn, sizeof(o_insn));
+	bp->insn.o_insn_len = sizeof(o_insn);
+	bp->o_target = (uint64_t)stub + code_len;
+	bp->bp_type = handler->type;
+	bp->bp_addr = bp_addr;
+	bp->bp_len = sizeof(o_insn);
+	/*
+	 * The handler returns to the instruction after the blr
+	 */
+	bp->stub_retaddr = (uint64_t)stub + (fn_lit + 2) * sizeof(uint32_t);
+	TAILQ_INIT(&bp->retaddr_list);
+	n_insn = shiva_trace_a64_b(false, bp_addr, (uint64_t)stub);
+	memcpy(&bp->insn.n_insn[0], &n_insn, sizeof(n_insn));
+	bp->insn.n_insn_len = sizeof(n_insn);
+	if (shiva_trace_write_code(ctx, (void *)bp_addr, &n_insn, sizeof(n_insn),
+	    error) == false)
+		return false;
+	shiva_debug("Inserted fast breakpoint: %#lx -> %p -> %p\n", bp_addr, stub,
+	    handler->handler_fn);
+	shiva_trace_bp_insert(ctx, handler, bp);
+	return true;
+}
+#endif
+
 struct shiva_trace_handler *
 shiva_trace_find_handler(struct shiva_ctx *ctx, void *handler)
 {
+	struct shiva_trace_handler_table *table;
 	struct shiva_trace_handler *current = NULL;
+	size_t i;
 
-	shiva_debug("ctx: %p, handler: %p handler_tqlist: %p\n", ctx, handler,
-	    &ctx->tailq.trace_handlers_tqlist);
-	TAILQ_FOREACH(current, &ctx->tailq.trace_handlers_tqlist, _linkage) {
-		shiva_debug("Testing current: %p handler_fn %p handler %p\n", current, current->handler_fn,
-		    handler);
-		if (current->handler_fn == handler)
-			return current;
+	shiva_trace_rcu_enter(ctx);
+	table = __atomic_load_n(&ctx->trace_rcu.handlers, __ATOMIC_ACQUIRE);
+	shiva_debug("ctx: %p, handler: %p handler table: %p\n", ctx, handler, table);
+	for (i = 0; table != NULL && i < table->count; i++) {
+		shiva_debug("Testing current: %p handler_fn %p handler %p\n", table->handlers[i],
+		    table->handlers[i]->handler_fn, handler);
+		if (table->handlers[i]->handler_fn == handler) {
+			current = table->handlers[i];
+			break;
+		}
 	}
-	return NULL;
+	shiva_trace_rcu_exit(ctx);
+	return current;
 }
 
 bool
@@ -161,7 +1129,9 @@ shiva_trace_register_handler(struct shiva_ctx *ctx, void * (*handler_fn)(void *)
     shiva_trace_bp_type_t bp_type, shiva_error_t *error)
 {
 
+	struct shiva_trace_handler_table *table, *old;
 	struct shiva_trace_handler *handler_struct;
+	size_t count;
 	/*
 	 * Let's confirm that the specified handler doesn't exist in the debugger
 	 * memory.
@@ -173,26 +1143,33 @@ shiva_trace_register_handler(struct shiva_ctx *ctx, void * (*handler_fn)(void *)
 		return false;
 	}
 #endif
-	handler_struct = calloc(1, sizeof(*handler_struct));
-	if (handler_struct == NULL) {
-		shiva_error_set(error, "memory allocation failed: %s\n", strerror(errno));
-		return false;
-	}
+	handler_struct = shiva_arena_alloc(&ctx->arena.trace, sizeof(*handler_struct));
 	handler_struct->handler_fn = handler_fn;
 	handler_struct->type = bp_type;
 	TAILQ_INIT(&handler_struct->bp_tqlist);
+	handler_struct->bp_index = NULL;
 
 	shiva_debug("Registering handler %p\n", handler_struct->handler_fn);
-	TAILQ_INSERT_TAIL(&ctx->tailq.trace_handlers_tqlist, handler_struct, _linkage);
+	shiva_trace_rcu_lock(ctx);
+	old = ctx->trace_rcu.handlers;
+	count = old == NULL ? 0 : old->count;
+	table = shiva_malloc(sizeof(*table) + (count + 1) * sizeof(table->handlers[0]));
+	if (count > 0)
+		memcpy(table->handlers, old->handlers, count * sizeof(table->handlers[0]));
+	table->handlers[count] = handler_struct;
+	table->count = count + 1;
+	shiva_trace_rcu_publish(ctx, (void **)&ctx->trace_rcu.handlers, table);
+	shiva_trace_rcu_unlock(ctx);
 	return true;
 }
 
 #define MAX_PLT_RETADDR_COUNT 4096
 
-bool
-shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
+static bool
+shiva_trace_set_breakpoint_locked(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
     uint64_t bp_addr, void *option, shiva_error_t *error)
 {
+	struct shiva_trace_handler_table *table = ctx->trace_rcu.handlers;
 	struct shiva_trace_handler *current;
 	struct shiva_trace_bp *bp;
 	uint8_t *inst_ptr = (uint8_t *)bp_addr;
@@ -206,21 +1183,25 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 	bool found_handler = false;
 	struct elf_plt plt_entry;
 	elf_plt_iterator_t plt_iter;
-	elf_pltgot_iterator_t pltgot_iter;
-	struct elf_pltgot_entry pltgot_entry;
 	char *symname;
 	int i, signum, bits;
 	elf_relocation_iterator_t rel_iter;
 	struct elf_relocation rel;
-	size_t jmprel_count = 0;
 	struct shiva_branch_site *branch_site;
+	size_t n;
 
-	TAILQ_FOREACH(current, &ctx->tailq.trace_handlers_tqlist, _linkage) {
+	for (n = 0; table != NULL && n < table->count; n++) {
+		current = table->handlers[n];
 		if (current->handler_fn == handler_fn) {
 			found_handler = true;
 			shiva_debug("found handler: %p\n", handler_fn);
 			switch(current->type) {
 			case SHIVA_TRACE_BP_JMP:
+#if __aarch64__
+				if (shiva_trace_aarch64_branch_hook(ctx, current, bp_addr,
+				    error) == false)
+					return false;
+#endif
 				break;
 			case SHIVA_TRACE_BP_SEGV:
 				/*
@@ -257,24 +1238,28 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 					    "shiva_trace_op_peek() failed to read %#lx\n", bp_addr);
 					return false;
 				}
+#if __aarch64__
+				trap = (qword & ~0xffffffffUL); /* udf #0 */
+#else
 				trap = 0x0b0f;
+#endif
 				if (shiva_trace_write(ctx, 0,
 				    (void *)bp_addr, &trap, 4, error) == false) {
 					shiva_error_set(error,
 					    "shiva_trace_write() failed to write to %#lx\n", bp_addr);
 					return false;
 				}
-				bp = calloc(1, sizeof(*bp));
-				if (bp == NULL) {
-					shiva_error_set(error, "memory allocation failed: %s\n",
-					    strerror(errno));
-					return false;
-				}
+				bp = shiva_arena_alloc(&ctx->arena.trace, sizeof(*bp));
 				bp->bp_addr = bp_addr;
+#if __aarch64__
+				bp->bp_len = 4;
+				__builtin___clear_cache((char *)bp_addr, (char *)bp_addr + 4);
+#else
 				bp->bp_len = 2;
+#endif
 				bp->bp_type = current->type;
 				shiva_debug("Inserted SIGILL breakpoint: %#lx\n", bp->bp_addr);
-				TAILQ_INSERT_TAIL(&current->bp_tqlist, bp, _linkage);
+				shiva_trace_bp_insert(ctx, current, bp);
 				break;
 			case SHIVA_TRACE_BP_INT3:
 				/*
@@ -300,7 +1285,11 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 					shiva_error_set(error, "shiva_trace_op_peek() failed to read %#lx\n", bp_addr);
 					return false;
 				}
+#if __aarch64__
+				trap = (qword & ~0xffffffffUL) | 0xd4200000; /* brk #0 */
+#else
 				trap = (qword & ~0xff) | 0xcc;
+#endif
 				//*(uint64_t *)&bp->insn.o_insn[0] = qword;
 				//*(uint64_t *)&bp->insn.n_insn[0] = trap;
 
@@ -308,17 +1297,17 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 					shiva_error_set(error, "shiva_trace_write() failed to write to %#lx\n", bp_addr);
 					return false;
 				}
-				bp = calloc(1, sizeof(*bp));
-				if (bp == NULL) {
-					shiva_error_set(error, "memory allocation failed: %s\n",
-					    strerror(errno));
-					return false;
-				}
+				bp = shiva_arena_alloc(&ctx->arena.trace, sizeof(*bp));
 				bp->bp_addr = bp_addr;
+#if __aarch64__
+				bp->bp_len = 4;
+				__builtin___clear_cache((char *)bp_addr, (char *)bp_addr + 4);
+#else
 				bp->bp_len = 1;
+#endif
 				bp->bp_type = current->type;
 				shiva_debug("Inserted int3 breakpoint: %#lx\n", bp->bp_addr);
-				TAILQ_INSERT_TAIL(&current->bp_tqlist, bp, _linkage);
+				shiva_trace_bp_insert(ctx, current, bp);
 				break;
 			case SHIVA_TRACE_BP_PLTGOT:
 				if (elf_plt_by_name(&ctx->elfobj, (char *)option, &plt_entry) == false) {
@@ -326,209 +1315,153 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 					    &ctx->elfobj, (char *)option);
 					return false;
 				}
-				elf_pltgot_iterator_init(&ctx->elfobj, &pltgot_iter);
-				while (elf_pltgot_iterator_next(&pltgot_iter, &pltgot_entry) == ELF_ITER_OK) {
-					if (pltgot_entry.flags & ELF_PLTGOT_PLT_STUB_F) {
-						/*
-						 * XXX IMPORTANT XXX
-						 * If the target binary has a .plt with bound instructions
-						 * then the + 6 calculation will not work. Currently our
-						 * 'test' target binary is built with -fcf-protection=none
-						 * We must add code for compatibility, and libelfmaster's plt
-						 * API needs to be updated to handle as well.
-						 */
-						if (pltgot_entry.value != (plt_entry.addr + 6))
-							continue;
-						shiva_debug("Patching GOT entry %#lx\n",
-						    pltgot_entry.offset + ctx->ulexec.base_vaddr);
-						shiva_debug("plt_entry.addr: %#lx\n", plt_entry.addr);
-						bp = calloc(1, sizeof(*bp));
-						if (bp == NULL) {
-							shiva_error_set(error, "memory allocation failed: %s\n",
-							    strerror(errno));
-							return false;
-						}
-						/*
-						 * This is a PLTGOT hook. So we are actually modifying an fptr (The GOT)
-						 * in the data segment. bp_addr is assigned the address of the GOT entry
-						 * that we are patching (Instead of a code location like usual).
-						 * We may change this convention in the future...
-						 */
-						shiva_debug("pltgot.offset: %#lx base_vaddr: %#lx\n",
-						    pltgot_entry.offset, ctx->ulexec.base_vaddr);
-						elf_relocation_iterator_init(&ctx->elfobj, &rel_iter);
-						for (i = 0; elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK;) {
-							if (rel.type != R_X86_64_JUMP_SLOT)
-								continue;
-							if (rel.offset != pltgot_entry.offset)
-								continue;
-							symname = rel.symname;
-							break;
-						}
-						if (symname == NULL) {
-							shiva_error_set(error, "failed to find symbol for got offset: %#lx\n",
-							    pltgot_entry.offset);
-							return false;
-						}
-						bp->bp_type = SHIVA_TRACE_BP_PLTGOT;
-						bp->bp_addr = pltgot_entry.offset + ctx->ulexec.base_vaddr;
-						uint64_t *gotptr = (uint64_t *)bp->bp_addr;
-						memcpy(&bp->o_target, gotptr, sizeof(uint64_t));
-						/*
-						 * This gotptr value will be an offset, and we must add the base
-						 * address to it, atleast with PIE binaries.
-						 */
-						if (elf_type(&ctx->elfobj) == ET_DYN) {
-							bp->o_target += ctx->ulexec.base_vaddr;
-						}
-						shiva_debug("*gotptr old value: %#lx\n", *gotptr);
-						shiva_debug("Setting gotptr(%p) to %p\n", gotptr, handler_fn);
-						/*
-						 * Currently we only handle PIE target binaries (We must fix this).
-						 * Anyway, PIE binaries have GOT values that are computed with the
-						 * baes address at runtime. We must patch the GOT with an offset from
-						 * the base, and not an absolute address.
-						 *
-						 * XXX:
-						 * Actually scratch this last note out somewhat... yes we normally would
-						 * put an offset from the base so that the RTLD could then patch it with
-						 * the base offset at runtime, but we are going to instruct RTLD to not
-						 * touch this got entry ever again by removing the JUMP_SLOT relocation
-						 * record for it.
-						 */
-						*(uint64_t *)&gotptr[0] = (uint64_t)handler_fn;
-						/*
-						 * STRICT LINKING (flags: PIE NOW) can be a problem for us since it
-						 * will overwrite any PLT hooks that are set.
-						 *
-						 * Our solution is to create an alternate .rela.plt that excludes the
-						 * JUMP_SLOT relocation entry for the symbol we are hooking.
-						 *
-						 * Update DT_JMPREL to point to our new symbol table.
-						 *
-						 * Update DT_PLTRELASZ with the updated size of .rela.plt
-						 */
-
-						struct elf_section rela_plt;
-						Elf64_Rela *rela_plt_ptr;
-						struct elf_symbol symbol;
+				symname = NULL;
+				elf_relocation_iterator_init(&ctx->elfobj, &rel_iter);
+				while (elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK) {
+					if (rel.type != SHIVA_TRACE_JUMP_SLOT)
+						continue;
+					if (rel.symname == NULL || strcmp(rel.symname, (char *)option) != 0)
+						continue;
+					symname = rel.symname;
+					break;
+				}
+				if (symname == NULL) {
+					shiva_error_set(error, "failed to find the JUMP_SLOT relocation of '%s'\n",
+					    (char *)option);
+					return false;
+				}
+				bp = shiva_arena_alloc(&ctx->arena.trace, sizeof(*bp));
+				/*
+				 * This is a PLTGOT hook. So we are actually modifying an fptr (The GOT)
+				 * in the data segment. bp_addr is assigned the address of the GOT entry
+				 * that we are patching (Instead of a code location like usual).
+				 *
+				 * The GOT entry is not written yet: RTLD still has to process the
+				 * JUMP_SLOT relocation for it, and with BIND_NOW it would simply
+				 * overwrite our handler. Instead shiva_post_linker() runs after RTLD
+				 * has relocated the target, and calls shiva_trace_pltgot_commit()
+				 * which saves the resolved GOT value in bp->o_target and writes
+				 * every hooked GOT entry at once, in a single mprotect window over
+				 * the RELRO pages. This way .rela.plt is left intact.
+				 */
+				bp->bp_type = SHIVA_TRACE_BP_PLTGOT;
+				bp->bp_addr = rel.offset + shiva_trace_base_addr(ctx);
+				bp->bp_len = sizeof(uint64_t);
+				bp->plt_addr = plt_entry.addr + shiva_trace_base_addr(ctx);
+				bp->o_target = 0;
+				bp->call_target_symname = symname;
+				if (elf_symbol_by_name(&ctx->elfobj, symname, &symbol) == true) {
+					memcpy(&bp->symbol, &symbol, sizeof(symbol));
+					bp->symbol_location = true;
+				}
+#if __aarch64__
+				/*
+				 * Point the GOT entry at a hook stub rather than at the handler
+				 * itself, so that the handler gets a trace frame, and can use
+				 * SHIVA_TRACE_CALL_ORIGINAL() and SHIVA_TRACE_BP_STRUCT().
+				 */
+				{
+					struct shiva_hook_stats_entry *stats;
+					uint8_t *stub;
 
-						if (elf_section_by_name(&ctx->elfobj, ".rela.plt", &rela_plt) == false) {
-							shiva_error_set(error, "unable to find .rela.plt section\n");
-							return false;
-						}
+					stub = shiva_trace_island_alloc(ctx, SHIVA_TRACE_STUB_SIZE, error);
+					if (stub == NULL)
+						return false;
+					stats = shiva_hook_stats_alloc(ctx, SHIVA_HOOK_STATS_HANDLER,
+					    SHIVA_TRACE_BP_PLTGOT, bp->bp_addr, (uint64_t)handler_fn,
+					    symname);
+					if (shiva_trace_aarch64_stub(ctx, stub, handler_fn, stats,
+					    &bp->stub_retaddr, error) == false)
+						return false;
+					qword = (uint64_t)stub;
+				}
+#else
+				qword = (uint64_t)handler_fn;
+#endif
+				memcpy(&bp->insn.n_insn[0], &qword, sizeof(qword));
+				bp->insn.n_insn_len = sizeof(qword);
+				if (shiva_post_linker_enable(ctx) == false) {
+					shiva_error_set(error, "unable to install the post linker for "
+					    "the GOT hook of '%s'\n", symname);
+					return false;
+				}
+				ctx->trace_pltgot_pending++;
+				shiva_debug("Deferred .got.plt hook breakpoint: %#lx -> %#lx\n",
+				    bp->bp_addr, qword);
+				/*
+				 * We must also set all possible return addresses
+				 * for this call <symname>@plt -- keeping track of
+				 * this in the 'struct shiva_trace_bp->plt_retaddrs
+				 * -- This is important information, because when we
+				 *  are within a PLTGOT breakpoint handler we can find
+				 *  the associated shiva_trace_bp struct by seeing if
+				 *  the current return address (At the top of the stack)
+				 *  matches one of the valid retaddrs for the plt call
+				 *  associated with the PLT/GOT breakpoint. If the
+				 *  retaddr at the top of the stack matches one of
+				 *  the addresses in the handlers current_bp->retaddrs_tqlist
+				 *  then the handlers current bp struct is the correct
+				 *  one and correlates to PLT symbol bp->symbol.name.
+				 */
+				TAILQ_INIT(&bp->retaddr_list);
+				(void) hcreate_r(MAX_PLT_RETADDR_COUNT, &bp->valid_plt_retaddrs);
+				for (i = 0; i < ctx->analysis.branch_count; i++) {
+					const char *name;
+					char *p;
+					size_t copy_len;
 
+					branch_site = &ctx->analysis.branches[i];
+					if (branch_site->branch_type != SHIVA_BRANCH_CALL)
+						continue;
+					name = shiva_analyze_symbol(ctx, branch_site->symbol)->name;
+					if (name == NULL || strstr(name, "@plt") == NULL)
+						continue;
+					p = strchr(name, '@');
+					copy_len = p - name;
+					if (strncmp((char *)option, name,
+					    copy_len) == 0) {
+						struct shiva_addr_struct *addr =
+						    shiva_arena_alloc(&ctx->arena.trace, sizeof(*addr));
 						/*
-						 * Find the relocation record that we want to modify. It is the JUMP_SLOT
-						 * relocation for the symbol related to the .got.plt entry that we are hijacking.
-						 */
-						memset(&symbol, 0, sizeof(symbol));
-						rela_plt_ptr = (Elf64_Rela *)((char *)ctx->ulexec.base_vaddr + rela_plt.offset);
-						shiva_debug("rela_plt_ptr: %p\n", rela_plt_ptr);
-						if (ctx->altrelocs.jmprel == NULL)
-							ctx->altrelocs.jmprel = shiva_malloc(rela_plt.size);
-						for (i = 0, jmprel_count = 0; i < rela_plt.size / rela_plt.entsize; i++) {
-							if (ELF64_R_TYPE(rela_plt_ptr[i].r_info) != R_X86_64_JUMP_SLOT)
-								continue;
-							if (elf_symbol_by_index(&ctx->elfobj,
-							    ELF64_R_SYM(rela_plt_ptr[i].r_info),
-							    &symbol,
-							    SHT_DYNSYM) == true) {
-								if (strcmp(symbol.name, (char *)option) == 0) {
-									memcpy(&bp->symbol, &symbol, sizeof(symbol));
-									bp->symbol_location = true;
-									continue;
-								} else {
-									memcpy(ctx->altrelocs.jmprel + jmprel_count,
-									    &rela_plt_ptr[i], sizeof(Elf64_Rela));
-									jmprel_count++;
-								}
-							} else {
-								shiva_error_set(error, "unable to find dynamic symbol index: %d\n",
-								    ELF64_R_SYM(rela_plt_ptr[i].r_info));
-								return false;
-							}
-						}
-						if (jmprel_count >= rela_plt.size / rela_plt.entsize) {
-							shiva_error_set(error, "unable to properly de-activate relocation record"
-							    " '%s'\n", (char *)option);
-							return false;
-						}
-						shiva_debug("Setting DT_JMPREL to %#lx - %#lx = %#lx\n",
-						    (uint64_t) ctx->altrelocs.jmprel, ctx->ulexec.base_vaddr,
-						   (uint64_t) ctx->altrelocs.jmprel - ctx->ulexec.base_vaddr);
-
-						(void) shiva_target_dynamic_set(ctx, DT_JMPREL,
-						    (uint64_t)ctx->altrelocs.jmprel - ctx->ulexec.base_vaddr);
-						(void) shiva_target_dynamic_set(ctx, DT_PLTRELSZ,
-						    jmprel_count * sizeof(Elf64_Rela));
-						shiva_debug("Inserted .got.plt hook breakpoint: %#lx\n", bp->bp_addr);
-						/*
-						 * We must also set all possible return addresses
-						 * for this call <symname>@plt -- keeping track of
-						 * this in the 'struct shiva_trace_bp->plt_retaddrs
-						 * -- This is important information, because when we
-						 *  are within a PLTGOT breakpoint handler we can find
-						 *  the associated shiva_trace_bp struct by seeing if
-						 *  the current return address (At the top of the stack)
-						 *  matches one of the valid retaddrs for the plt call
-						 *  associated with the PLT/GOT breakpoint. If the
-						 *  retaddr at the top of the stack matches one of
-						 *  the addresses in the handlers current_bp->retaddrs_tqlist
-						 *  then the handlers current bp struct is the correct
-						 *  one and correlates to PLT symbol bp->symbol.name.
+						 * We found a branch site (A call) that calls
+						 * the PLT symbol that we are hooking via
+						 * PLTGOT. Add the retaddr to the the current
+						 * breakpoints 'valid_plt_retaddrs' cache.
 						 */
-						TAILQ_INIT(&bp->retaddr_list);
-						(void) hcreate_r(MAX_PLT_RETADDR_COUNT, &bp->valid_plt_retaddrs);
-						TAILQ_FOREACH(branch_site, &ctx->tailq.branch_tqlist, _linkage) {
-							char *p;
-							size_t copy_len;
-
-							if (strstr(branch_site->symbol.name, "@plt") == NULL)
-								continue;
-							if (branch_site->branch_type != SHIVA_BRANCH_CALL)
-								continue;
-							p = strchr(branch_site->symbol.name, '@');
-							copy_len = p - branch_site->symbol.name;
-							if (strncmp((char *)option, branch_site->symbol.name,
-							    copy_len) == 0) {
-								struct shiva_addr_struct *addr = shiva_malloc(sizeof(*addr));
-								/*
-								 * We found a branch site (A call) that calls
-								 * the PLT symbol that we are hooking via
-								 * PLTGOT. Add the retaddr to the the current
-								 * breakpoints 'valid_plt_retaddrs' cache.
-								 */
-								addr->addr = branch_site->retaddr + shiva_trace_base_addr(ctx);
-								TAILQ_INSERT_TAIL(&bp->retaddr_list, addr, _linkage);
-								/*
-								 * Set the PLT address that corresponds to our PLTGOT hook
-								 */
-								bp->plt_addr = branch_site->target_vaddr;
-								
-								/*
-								 * We cannot use an hcreate cache because there's
-								 * some incompatibility when using it cross module
-								 * execution.
-								 */
-							}
-						}
-						TAILQ_INSERT_TAIL(&current->bp_tqlist, bp, _linkage);
-						return true;
+						addr->addr = branch_site->retaddr + shiva_trace_base_addr(ctx);
+						TAILQ_INSERT_TAIL(&bp->retaddr_list, addr, _linkage);
 					}
 				}
+				shiva_trace_bp_insert(ctx, current, bp);
+				return true;
+			case SHIVA_TRACE_BP_FAST:
+#if __aarch64__
+				if (shiva_trace_aarch64_fast(ctx, current, bp_addr,
+				    error) == false)
+					return false;
+#else
+				shiva_error_set(error, "SHIVA_TRACE_BP_FAST is only "
+				    "supported on aarch64\n");
+				return false;
+#endif
+				break;
+			case SHIVA_TRACE_BP_WATCH:
+				if (shiva_trace_watch_set(ctx, current, bp_addr, option,
+				    error) == false)
+					return false;
 				break;
 			case SHIVA_TRACE_BP_TRAMPOLINE:
+#if __aarch64__
+				if (shiva_trace_aarch64_trampoline(ctx, current, bp_addr,
+				    error) == false)
+					return false;
+				break;
+#endif
 				//ud_set_input_buffer(&ctx->disas.ud_obj, inst_ptr, SHIVA_MAX_INST_LEN);
 				bits = elf_class(&ctx->elfobj) == elfclass64 ? 64 : 32;
 				insn_len = sizeof(tramp_inst); //ud_insn_len(&ctx->disas.ud_obj);
 				assert(insn_len <= 15);
-				bp = calloc(1, sizeof(*bp));
-				if (bp == NULL) {
-					shiva_error_set(error, "memory allocation failed: %s\n",
-					    strerror(errno));
-					return false;
-				}
+				bp = shiva_arena_alloc(&ctx->arena.trace, sizeof(*bp));
 				if (elf_symbol_by_value_lookup(&ctx->elfobj,
 				    bp_addr - shiva_trace_base_addr(ctx), &symbol) == true) {
 					bp->symbol_location = true;
@@ -544,7 +1477,6 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 				res = shiva_trace_write(ctx, 0, (void *)bp_addr, tramp_inst, bp->bp_len,
 				    error);
 				if (res == false) {
-					free(bp);
 					return false;
 				}
 				/*
@@ -553,12 +1485,14 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 				 * created by shiva_analyze.c:shiva_analyze_find_calls()
 				 */
 				TAILQ_INIT(&bp->retaddr_list);
-				TAILQ_FOREACH(branch_site, &ctx->tailq.branch_tqlist, _linkage) {
+				for (i = 0; i < ctx->analysis.branch_count; i++) {
+					branch_site = &ctx->analysis.branches[i];
 					if (branch_site->branch_type != SHIVA_BRANCH_CALL)
 						continue;
 					if ((branch_site->target_vaddr + shiva_trace_base_addr(ctx)) ==
 					    (uint64_t)bp_addr) {
-						struct shiva_addr_struct *addr = shiva_malloc(sizeof(*addr));
+						struct shiva_addr_struct *addr =
+							    shiva_arena_alloc(&ctx->arena.trace, sizeof(*addr));
 
 						addr->addr = branch_site->retaddr + shiva_trace_base_addr(ctx);
 						shiva_debug(
@@ -569,9 +1503,15 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 					}
 				}
 				shiva_debug("Inserted breakpoint: %#lx\n", bp->bp_addr);
-				TAILQ_INSERT_TAIL(&current->bp_tqlist, bp, _linkage);
+				shiva_trace_bp_insert(ctx, current, bp);
 				break;
 			case SHIVA_TRACE_BP_CALL: /* This hooks imm32 calls, and only works in mcmodel=small scenarios */
+#if __aarch64__
+				if (shiva_trace_aarch64_branch_hook(ctx, current, bp_addr,
+				    error) == false)
+					return false;
+				break;
+#endif
 #ifndef SHIVA_STANDALONE
 				shiva_error_set(error, "SHIVA_TRACE_BP_CALL incompatible with Shiva-LDSO. Please use"
 				    " Shiva in standalone mode.");
@@ -584,12 +1524,7 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 				bits = elf_class(&ctx->elfobj) == elfclass64 ? 64 : 32;
 				insn_len = 5; //ud_insn_len(&ctx->disas.ud_obj);
 				assert(insn_len <= 15);
-				bp = calloc(1, sizeof(*bp));
-				if (bp == NULL) {
-					shiva_error_set(error, "memory allocation failed: %s\n",
-					    strerror(errno));
-					return false;
-				}
+				bp = shiva_arena_alloc(&ctx->arena.trace, sizeof(*bp));
 				/*
 				 * backup the original instruction.
 				 */
@@ -620,11 +1555,12 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 					elf_plt_iterator_init(&ctx->elfobj, &plt_iter);
 					while (elf_plt_iterator_next(&plt_iter, &plt_entry) == ELF_ITER_OK) {
 						if ((bp->o_target - shiva_trace_base_addr(ctx)) == plt_entry.addr) {
-							bp->call_target_symname = shiva_xfmtstrdup("%s@plt", plt_entry.symname);
+							bp->call_target_symname = shiva_arena_xfmtstrdup(&ctx->arena.trace,
+							    "%s@plt", plt_entry.symname);
 						}
 					}
 					if (bp->call_target_symname == NULL) {
-						bp->call_target_symname = shiva_xfmtstrdup("fn_%#lx",
+						bp->call_target_symname = shiva_arena_xfmtstrdup(&ctx->arena.trace, "fn_%#lx",
 						    bp->o_target);
 					}
 				}
@@ -637,11 +1573,10 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 				res = shiva_trace_write(ctx, 0, (void *)bp_addr, call_inst, bp->bp_len,
 				    error);
 				if (res == false) {
-					free(bp);
 					return false;
 				}
 				shiva_debug("Inserted breakpoint: %#lx\n", bp->bp_addr);
-				TAILQ_INSERT_TAIL(&current->bp_tqlist, bp, _linkage);
+				shiva_trace_bp_insert(ctx, current, bp);
 				break;
 			}
 		}
@@ -653,6 +1588,122 @@ shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
 	return true;
 }
 
+/*
+ * Breakpoints are set with the trace_rcu lock held, so that handlers
+ * and breakpoints are added by one thread at a time while hook stubs
+ * look them up.
+ */
+bool
+shiva_trace_set_breakpoint(struct shiva_ctx *ctx, void * (*handler_fn)(void *),
+    uint64_t bp_addr, void *option, shiva_error_t *error)
+{
+	bool res;
+
+	shiva_trace_rcu_lock(ctx);
+	res = shiva_trace_set_breakpoint_locked(ctx, handler_fn, bp_addr, option, error);
+	shiva_trace_rcu_unlock(ctx);
+	return res;
+}
+
+/*
+ * The value that LDSO left in the GOT entry of a PLTGOT hook, i.e. the
+ * function that the hook replaces. Without BIND_NOW the entry still
+ * points back into .plt (The lazy binding path), in which case the
+ * symbol is resolved against the shared libraries now (Through the
+ * link_map of LDSO, or the files on disk as a fallback), so that
+ * SHIVA_TRACE_CALL_ORIGINAL() doesn't have to go through the resolver.
+ */
+static bool
+shiva_trace_pltgot_target(struct shiva_ctx *ctx, struct shiva_trace_bp *bp,
+    uint64_t *target, shiva_error_t *error)
+{
+	struct elf_section plt;
+	struct elf_symbol symbol;
+	uint64_t value, plt_lo, base;
+	char *so_path;
+
+	memcpy(&value, (void *)bp->bp_addr, sizeof(value));
+	if (elf_section_by_name(&ctx->elfobj, ".plt", &plt) == true) {
+		plt_lo = plt.address + shiva_trace_base_addr(ctx);
+		if (value != 0 && (value < plt_lo || value >= plt_lo + plt.size)) {
+			*target = value;
+			return true;
+		}
+	}
+	if (shiva_link_map_resolve_symbol(ctx, bp->call_target_symname, &symbol,
+	    &base) == true) {
+		*target = symbol.value + base;
+		return true;
+	}
+	if (ctx->module.runtime == NULL ||
+	    shiva_so_resolve_symbol(ctx->module.runtime, bp->call_target_symname,
+	    &symbol, &so_path) == false) {
+		shiva_error_set(error, "unable to resolve '%s' for its GOT hook\n",
+		    bp->call_target_symname);
+		return false;
+	}
+	if (shiva_maps_get_so_base(ctx, so_path, &base) == false) {
+		shiva_error_set(error, "unable to find the base address of '%s'\n", so_path);
+		return false;
+	}
+	*target = symbol.value + base;
+	return true;
+}
+
+/*
+ * Install the PLTGOT hooks that shiva_trace_set_breakpoint() deferred.
+ * Called by shiva_post_linker() once LDSO has relocated the target, so
+ * BIND_NOW can no longer overwrite the hooks, and .rela.plt is used as
+ * is. The GOT entries are written in one patch transaction: they share
+ * the RELRO (Or .got.plt) pages, so that's a single mprotect window,
+ * and their original protection is restored afterwards.
+ */
+bool
+shiva_trace_pltgot_commit(struct shiva_ctx *ctx, shiva_error_t *error)
+{
+	struct shiva_trace_handler *handler;
+	struct shiva_trace_bp *bp;
+	struct shiva_trace_handler_table *table;
+	struct shiva_patch_txn txn;
+	size_t count = 0, i;
+
+	if (ctx->trace_pltgot_pending == 0)
+		return true;
+	shiva_patch_txn_begin(ctx, &txn);
+	shiva_trace_rcu_lock(ctx);
+	table = ctx->trace_rcu.handlers;
+	for (i = 0; table != NULL && i < table->count; i++) {
+		handler = table->handlers[i];
+		if (handler->type != SHIVA_TRACE_BP_PLTGOT)
+			continue;
+		TAILQ_FOREACH(bp, &handler->bp_tqlist, _linkage) {
+			if (bp->o_target != 0)
+				continue;
+			if (shiva_trace_pltgot_target(ctx, bp, &bp->o_target, error) == false)
+				goto fail;
+			memcpy(&bp->insn.o_insn[0], &bp->o_target, sizeof(uint64_t));
+			bp->insn.o_insn_len = sizeof(uint64_t);
+			shiva_debug("GOT entry %#lx (%s): %#lx -> %#lx\n", bp->bp_addr,
+			    bp->call_target_symname, bp->o_target,
+			    *(uint64_t *)&bp->insn.n_insn[0]);
+			if (shiva_patch_txn_write(&txn, bp->bp_addr, &bp->insn.n_insn[0],
+			    bp->insn.n_insn_len, error) == false)
+				goto fail;
+			count++;
+		}
+	}
+	shiva_trace_rcu_unlock(ctx);
+	if (shiva_patch_txn_commit(&txn, error) == false)
+		return false;
+	shiva_debug("Installed %zu GOT hooks\n", count);
+	ctx->trace_pltgot_pending = 0;
+	return true;
+fail:
+	shiva_trace_rcu_unlock(ctx);
+	shiva_patch_txn_abort(&txn);
+	return false;
+}
+
 bool
 shiva_trace_op_attach(struct shiva_ctx *ctx, pid_t pid,
     void *addr, void *data, size_t len, shiva_error_t *error)
@@ -676,6 +1727,8 @@ shiva_trace_op_attach(struct shiva_ctx *ctx, pid_t pid,
 				return false;
 			}
 		}
+		if (shiva_trace_thread_hook(ctx, error) == false)
+			return false;
 
 	} else {
 		/*
@@ -726,6 +1779,7 @@ shiva_trace_op_peek(struct shiva_ctx *ctx, pid_t pid,
  * SHIVA_TRACE_OP_SETFPREGS
  * SHIVA_TRACE_OP_GETSIGINFO
  * SHIVA_TRACE_OP_SETSIGINFO
+ * SHIVA_TRACE_OP_REFRESH_MAPS
  */
 
 bool
@@ -747,6 +1801,11 @@ shiva_trace(struct shiva_ctx *ctx, pid_t pid, shiva_trace_op_t op,
 	case SHIVA_TRACE_OP_PEEK:
 		res = shiva_trace_op_peek(ctx, pid, addr, data, len, error);
 		break;
+	case SHIVA_TRACE_OP_REFRESH_MAPS:
+		res = shiva_maps_refresh(ctx);
+		if (res == false)
+			shiva_error_set(error, "refresh of /proc/self/maps failed\n");
+		break;
 #if 0
 	case SHIVA_TRACE_OP_GETREGS:
 		res = shiva_trace_op_getregs(ctx, pid, op, addr, data);
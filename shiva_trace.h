@@ -105,6 +105,10 @@ bool shiva_trace_register_handler(shiva_ctx_t *, void * (*)(shiva_ctx_t *), shiv
     shiva_error_t *);
 bool shiva_trace_set_breakpoint(shiva_ctx_t *, void * (*)(shiva_ctx_t *), uint64_t, shiva_error_t *);
 bool shiva_trace_write(struct shiva_ctx *, pid_t, void *, const void *, size_t, shiva_error_t *);
+/*
+ * shiva_mem.c
+ */
+bool shiva_trace_footprint(shiva_ctx_t *, struct shiva_mem_footprint *, shiva_error_t *);
 /*
  * shiva_trace_thread.c
  */
@@ -0,0 +1,162 @@
+/*
+ * shiva_trace_rcu.c - Epoch based reclamation for the shiva_trace tables.
+ *
+ * The handler table (ctx->trace_rcu.handlers) and the breakpoint index
+ * of each handler are looked up by hook handlers while the target runs,
+ * possibly by many threads at once and from within signal handlers, and
+ * may be updated at the same time by shiva_trace_register_handler() and
+ * shiva_trace_set_breakpoint(). Readers never block: they only announce
+ * the epoch they are reading in, in their ctx->trace_tls slot, for the
+ * duration of the lookup (shiva_trace_rcu_enter() and _exit()). Writers
+ * are serialized by a spinlock, never modify what a reader may be
+ * looking at, and publish a new copy of a table with a single
+ * store-release instead (shiva_trace_rcu_publish()). The copy it
+ * replaces is retired in the current epoch, and a new epoch begins. It
+ * is freed once no reader is left in that epoch or an earlier one,
+ * which every writer checks on its way out, so there is no grace period
+ * to wait for.
+ *
+ * Threads that found no trace_tls slot of their own share the extra
+ * slot, their readers are counted in ctx->trace_rcu.overflow instead,
+ * and nothing is freed while any of them read.
+ */
+#include "shiva.h"
+
+struct shiva_trace_rcu_retired {
+	void *ptr;
+	uint64_t epoch;
+	TAILQ_ENTRY(shiva_trace_rcu_retired) _linkage;
+};
+
+static inline bool
+shiva_trace_rcu_overflow(struct shiva_ctx *ctx, struct shiva_trace_tls *tls)
+{
+	return tls == NULL || tls == &ctx->trace_tls[SHIVA_TRACE_TLS_SLOTS];
+}
+
+/*
+ * Begin a lookup. Lookups nest, i.e. a signal handler that interrupts
+ * one may do one of its own.
+ */
+void
+shiva_trace_rcu_enter(struct shiva_ctx *ctx)
+{
+	struct shiva_trace_tls *tls = shiva_trace_tls_self(ctx, true);
+
+	if (shiva_trace_rcu_overflow(ctx, tls) == true) {
+		__atomic_fetch_add(&ctx->trace_rcu.overflow, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+	if (tls->rcu_nest++ == 0) {
+		__atomic_store_n(&tls->rcu_epoch,
+		    __atomic_load_n(&ctx->trace_rcu.epoch, __ATOMIC_RELAXED),
+		    __ATOMIC_RELAXED);
+		/*
+		 * The epoch must be visible to writers before any table
+		 * pointer is loaded.
+		 */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return;
+}
+
+void
+shiva_trace_rcu_exit(struct shiva_ctx *ctx)
+{
+	struct shiva_trace_tls *tls = shiva_trace_tls_self(ctx, false);
+
+	if (shiva_trace_rcu_overflow(ctx, tls) == true) {
+		__atomic_fetch_sub(&ctx->trace_rcu.overflow, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	if (--tls->rcu_nest == 0)
+		__atomic_store_n(&tls->rcu_epoch, 0, __ATOMIC_RELEASE);
+	return;
+}
+
+void
+shiva_trace_rcu_lock(struct shiva_ctx *ctx)
+{
+	while (__atomic_exchange_n(&ctx->trace_rcu.lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(&ctx->trace_rcu.lock, __ATOMIC_RELAXED) != 0)
+			__asm__ __volatile__("" ::: "memory");
+	}
+	return;
+}
+
+/*
+ * The oldest epoch that a reader may still be in, UINT64_MAX if there
+ * is none.
+ */
+static uint64_t
+shiva_trace_rcu_oldest(struct shiva_ctx *ctx)
+{
+	uint64_t epoch, oldest = UINT64_MAX;
+	size_t i;
+
+	if (__atomic_load_n(&ctx->trace_rcu.overflow, __ATOMIC_ACQUIRE) != 0)
+		return 0;
+	for (i = 0; ctx->trace_tls != NULL && i < SHIVA_TRACE_TLS_SLOTS; i++) {
+		epoch = __atomic_load_n(&ctx->trace_tls[i].rcu_epoch, __ATOMIC_ACQUIRE);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+	return oldest;
+}
+
+static void
+shiva_trace_rcu_reclaim(struct shiva_ctx *ctx)
+{
+	struct shiva_trace_rcu_retired *current, *next;
+	uint64_t oldest;
+
+	if (TAILQ_EMPTY(&ctx->trace_rcu.retired))
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	oldest = shiva_trace_rcu_oldest(ctx);
+	for (current = TAILQ_FIRST(&ctx->trace_rcu.retired); current != NULL;
+	    current = next) {
+		next = TAILQ_NEXT(current, _linkage);
+		if (current->epoch >= oldest)
+			continue;
+		shiva_debug("Reclaiming %p, retired in epoch %lu\n", current->ptr,
+		    current->epoch);
+		TAILQ_REMOVE(&ctx->trace_rcu.retired, current, _linkage);
+		free(current->ptr);
+		free(current);
+	}
+	return;
+}
+
+void
+shiva_trace_rcu_unlock(struct shiva_ctx *ctx)
+{
+	shiva_trace_rcu_reclaim(ctx);
+	__atomic_store_n(&ctx->trace_rcu.lock, 0, __ATOMIC_RELEASE);
+	return;
+}
+
+/*
+ * Replace the table at *slot with ptr, which must be complete, and
+ * retire the one it replaces. Must be called with the lock held.
+ */
+void
+shiva_trace_rcu_publish(struct shiva_ctx *ctx, void **slot, void *ptr)
+{
+	struct shiva_trace_rcu_retired *retired;
+	void *old = *slot;
+
+	__atomic_store_n(slot, ptr, __ATOMIC_RELEASE);
+	if (old == NULL)
+		return;
+	retired = shiva_malloc(sizeof(*retired));
+	retired->ptr = old;
+	/*
+	 * Readers that can still see old entered in this epoch or an
+	 * earlier one, those that enter from now on see ptr.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	retired->epoch = __atomic_fetch_add(&ctx->trace_rcu.epoch, 1, __ATOMIC_SEQ_CST);
+	TAILQ_INSERT_TAIL(&ctx->trace_rcu.retired, retired, _linkage);
+	return;
+}
@@ -0,0 +1,182 @@
+/*
+ * shiva_trace_ring.c - Shared memory trace buffer for shiva_trace handlers.
+ *
+ * SHIVA_TRACE_RING=<path> maps <path> (preferably on a tmpfs such as
+ * /dev/shm) MAP_SHARED, laid out as described in shiva_trace_ring.h, so
+ * that a handler can record function entries and exits with
+ * shiva_trace_ring_write() and an external reader (tools/shiva-trace)
+ * can drain them while the target runs. The hot path makes no system
+ * calls and takes no locks: the calling thread finds its ring through
+ * its ctx->trace_tls slot, and the timestamp is read from the virtual
+ * counter (cntvct_el0) on aarch64 and the TSC on x86_64.
+ *
+ * SHIVA_TRACE_RING_RECORDS and SHIVA_TRACE_RING_THREADS override the
+ * number of records per ring and the number of rings.
+ */
+#include "shiva.h"
+
+#define SHIVA_TRACE_RING_DEFAULT_RECORDS	16384
+#define SHIVA_TRACE_RING_DEFAULT_THREADS	64
+
+/*
+ * Stored in shiva_trace_tls.ring of threads that found no ring left
+ */
+#define SHIVA_TRACE_RING_NONE	((struct shiva_trace_ring *)~0UL)
+
+static uint64_t
+shiva_trace_ring_env(const char *name, uint64_t def)
+{
+	char *s = getenv(name), *end;
+	uint64_t v;
+
+	if (s == NULL || s[0] == '\0')
+		return def;
+	v = strtoul(s, &end, 0);
+	if (*end != '\0' || v == 0) {
+		fprintf(stderr, "%s: invalid value '%s', using %lu\n", name, s, def);
+		return def;
+	}
+	return v;
+}
+
+bool
+shiva_trace_ring_init(struct shiva_ctx *ctx)
+{
+	struct shiva_trace_ring_hdr *hdr;
+	uint64_t records, threads, stride, offset;
+	size_t len;
+	char *path;
+	void *mem;
+	int fd;
+
+	path = getenv("SHIVA_TRACE_RING");
+	if (path == NULL || path[0] == '\0')
+		return true;
+	records = shiva_trace_ring_env("SHIVA_TRACE_RING_RECORDS",
+	    SHIVA_TRACE_RING_DEFAULT_RECORDS);
+	threads = shiva_trace_ring_env("SHIVA_TRACE_RING_THREADS",
+	    SHIVA_TRACE_RING_DEFAULT_THREADS);
+	/*
+	 * The producer indexes records with head & (records - 1)
+	 */
+	while ((records & (records - 1)) != 0)
+		records &= records - 1;
+	offset = ELF_PAGEALIGN(sizeof(*hdr), SHIVA_TRACE_RING_CACHELINE);
+	stride = ELF_PAGEALIGN(sizeof(struct shiva_trace_ring) +
+	    records * sizeof(struct shiva_trace_record), PAGE_SIZE);
+	len = ELF_PAGEALIGN(offset + stride * threads, PAGE_SIZE);
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "SHIVA_TRACE_RING: open(%s) failed: %s\n", path,
+		    strerror(errno));
+		return false;
+	}
+	if (ftruncate(fd, len) < 0) {
+		fprintf(stderr, "SHIVA_TRACE_RING: ftruncate(%s, %zu) failed: %s\n",
+		    path, len, strerror(errno));
+		close(fd);
+		return false;
+	}
+	mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "SHIVA_TRACE_RING: mmap(%s) failed: %s\n", path,
+		    strerror(errno));
+		return false;
+	}
+	hdr = mem;
+	hdr->version = SHIVA_TRACE_RING_VERSION;
+	hdr->pid = getpid();
+	hdr->record_size = sizeof(struct shiva_trace_record);
+	hdr->ring_count = threads;
+	hdr->ring_used = 0;
+	hdr->ring_records = records;
+	hdr->ring_offset = offset;
+	hdr->ring_stride = stride;
+	hdr->clock_freq = shiva_trace_ring_clock_freq();
+	/*
+	 * A reader must not trust the header until it sees the magic
+	 */
+	__atomic_store_n(&hdr->magic, SHIVA_TRACE_RING_MAGIC, __ATOMIC_RELEASE);
+
+	shiva_trace_tls_init(ctx);
+	ctx->trace_ring.hdr = hdr;
+	ctx->trace_ring.len = len;
+	shiva_debug("Trace ring %s: %lu rings of %lu records\n", path, threads, records);
+	return true;
+}
+
+/*
+ * Hand the calling thread a ring of its own. Only the first record a
+ * thread writes gets here.
+ */
+static struct shiva_trace_ring *
+shiva_trace_ring_claim(struct shiva_trace_ring_hdr *hdr, struct shiva_trace_tls *tls)
+{
+	struct shiva_trace_ring *ring;
+	uint32_t index;
+
+	index = __atomic_fetch_add(&hdr->ring_used, 1, __ATOMIC_RELAXED);
+	if (index >= hdr->ring_count) {
+		tls->ring = SHIVA_TRACE_RING_NONE;
+		return NULL;
+	}
+	ring = shiva_trace_ring_by_index(hdr, index);
+	__atomic_store_n(&ring->owner, tls->tp, __ATOMIC_RELAXED);
+	tls->ring = ring;
+	return ring;
+}
+
+/*
+ * Append a record to the ring of the calling thread. Returns false if
+ * the record was dropped, because tracing is off, the ring is full or
+ * there was no ring left for the thread.
+ */
+bool
+shiva_trace_ring_write(uint32_t type, uint64_t fn, uint64_t a0, uint64_t a1,
+    uint64_t a2, uint64_t a3)
+{
+	struct shiva_trace_ring_hdr *hdr = ctx_global->trace_ring.hdr;
+	struct shiva_trace_record *rec;
+	struct shiva_trace_ring *ring;
+	struct shiva_trace_tls *tls;
+	uint64_t head, tail;
+
+	if (hdr == NULL)
+		return false;
+	tls = shiva_trace_tls_self(ctx_global, true);
+	/*
+	 * The extra slot shared by threads that didn't fit in trace_tls
+	 * has no single producer, so it never gets a ring.
+	 */
+	if (tls == &ctx_global->trace_tls[SHIVA_TRACE_TLS_SLOTS])
+		goto noring;
+	ring = tls->ring;
+	if (ring == SHIVA_TRACE_RING_NONE)
+		goto noring;
+	if (ring == NULL && (ring = shiva_trace_ring_claim(hdr, tls)) == NULL)
+		goto noring;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= hdr->ring_records) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	rec = &ring->records[head & (hdr->ring_records - 1)];
+	rec->time = shiva_trace_ring_clock();
+	rec->thread = tls->tp;
+	rec->fn = fn;
+	rec->type = type;
+	rec->flags = 0;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	rec->args[3] = a3;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+noring:
+	__atomic_fetch_add(&hdr->dropped_noring, 1, __ATOMIC_RELAXED);
+	return false;
+}
@@ -0,0 +1,103 @@
+#ifndef _SHIVA_TRACE_RING_H_
+#define _SHIVA_TRACE_RING_H_
+
+/*
+ * Layout of the shared memory trace buffer (See shiva_trace_ring.c).
+ * This header is shared between the Shiva interpreter, patch modules
+ * (through modules/include/shiva_module.h) and tools/shiva-trace, so it
+ * must not depend on anything in shiva.h.
+ *
+ * File layout:
+ * [shiva_trace_ring_hdr]
+ * [shiva_trace_ring + shiva_trace_record * records] * ring_count
+ *
+ * Each thread that writes a record is given a ring of its own the first
+ * time it does so. A ring has exactly one producer, the thread, and one
+ * consumer, the reader, so neither side takes a lock: the producer owns
+ * head and the consumer owns tail. A record is written before head is
+ * advanced past it (store-release), and is only overwritten once the
+ * consumer has advanced tail past it. When a ring is full the record is
+ * dropped and counted instead.
+ */
+#include <stdint.h>
+
+#define SHIVA_TRACE_RING_MAGIC		0x474e5253 /* "SRNG" */
+#define SHIVA_TRACE_RING_VERSION	1
+#define SHIVA_TRACE_RING_CACHELINE	64
+
+/*
+ * shiva_trace_record.type
+ */
+#define SHIVA_TRACE_REC_ENTRY	1 /* args[] holds the first 4 arguments */
+#define SHIVA_TRACE_REC_EXIT	2 /* args[0] holds the return value */
+#define SHIVA_TRACE_REC_USER	3 /* anything the handler likes */
+
+struct shiva_trace_ring_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	uint32_t record_size;
+	uint32_t ring_count;
+	uint32_t ring_used; /* rings handed out to threads so far */
+	uint64_t ring_records; /* records per ring, a power of 2 */
+	uint64_t ring_offset; /* of the first ring, from the start of the file */
+	uint64_t ring_stride; /* distance between two rings */
+	uint64_t clock_freq; /* ticks per second of shiva_trace_record.time, 0 if unknown */
+	uint64_t dropped_noring; /* records of threads that found no ring left */
+} __attribute__((aligned(SHIVA_TRACE_RING_CACHELINE)));
+
+struct shiva_trace_record {
+	uint64_t time;
+	uint64_t thread; /* thread pointer of the writer */
+	uint64_t fn;
+	uint32_t type;
+	uint32_t flags;
+	uint64_t args[4];
+};
+
+struct shiva_trace_ring {
+	uint64_t head __attribute__((aligned(SHIVA_TRACE_RING_CACHELINE)));
+	uint64_t tail __attribute__((aligned(SHIVA_TRACE_RING_CACHELINE)));
+	uint64_t owner __attribute__((aligned(SHIVA_TRACE_RING_CACHELINE)));
+	uint64_t dropped;
+	struct shiva_trace_record records[] __attribute__((aligned(SHIVA_TRACE_RING_CACHELINE)));
+};
+
+/*
+ * The time base of shiva_trace_record.time, which the hook statistics
+ * of shiva_hook_stats.h use as well.
+ */
+static inline uint64_t
+shiva_trace_ring_clock(void)
+{
+#if __aarch64__
+	uint64_t cnt;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(cnt));
+	return cnt;
+#else
+	return __builtin_ia32_rdtsc();
+#endif
+}
+
+static inline uint64_t
+shiva_trace_ring_clock_freq(void)
+{
+#if __aarch64__
+	uint64_t freq;
+
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+	return freq;
+#else
+	return 0;
+#endif
+}
+
+static inline struct shiva_trace_ring *
+shiva_trace_ring_by_index(struct shiva_trace_ring_hdr *hdr, uint32_t index)
+{
+	return (struct shiva_trace_ring *)((uint8_t *)hdr + hdr->ring_offset +
+	    hdr->ring_stride * index);
+}
+
+#endif
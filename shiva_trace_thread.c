@@ -1,115 +1,348 @@
+/*
+ * shiva_trace_thread.c - Threads of the target.
+ *
+ * The record of each thread (struct shiva_trace_thread) lives in its
+ * ctx->trace_tls slot, which is found through the thread pointer in the
+ * same lock-free table that the hook stubs use, so looking up the
+ * calling thread costs no system call and no list walk. A thread is
+ * registered with its tid the first time it looks itself up, or as it
+ * starts when it was created through the pthread_create() PLT entry of
+ * the target, which shiva_trace_thread_hook() wraps so that the record
+ * of the new thread is reset (A slot is reused by the next thread that
+ * gets the same thread pointer) and knows the thread that created it.
+ *
+ * The fields that only /proc has (Name, Uid, Gid, PPid, TracerPid and
+ * CoreDumping) are read from /proc/self/task/<tid>/status the first time
+ * they are asked for, with shiva_trace_thread_status().
+ *
+ * All of this may run with the thread pointer of the targets libc, so
+ * system calls are made directly (See shiva_syscall.h).
+ */
 #include "shiva.h"
+#include "shiva_syscall.h"
+#include <sys/syscall.h>
 
-static bool
-shiva_trace_thread_status(struct shiva_ctx *ctx, pid_t pid,
-    struct shiva_trace_thread *thread)
+#define SHIVA_TRACE_THREAD_SPAWN_MAX	64
+
+/*
+ * Handed from the pthread_create() hook to the thread it creates, a
+ * spawn is busy from the call until the new thread has taken it.
+ */
+struct shiva_trace_thread_spawn {
+	void *(*start)(void *);
+	void *arg;
+	pid_t ptid;
+	uint32_t busy;
+};
+
+static void
+shiva_trace_thread_reset(struct shiva_trace_tls *tls, pid_t ptid)
 {
-	struct shiva_trace_thread *current;
-	char filepath[64], buf[PATH_MAX];
-	FILE *fp;
-
-	TAILQ_FOREACH(current, &ctx->tailq.thread_tqlist, _linkage) {
-		if (current->pid == pid) {
-			memcpy(thread, current, sizeof(*thread));
-			return true;
-		}
-	}
-	if (pid == 0) {
-		snprintf(filepath, 64, "/proc/self/status");
-	} else {
-		snprintf(filepath, 64, "/proc/%d/status", pid);
+	struct shiva_trace_thread *thread = &tls->thread;
+
+	memset(thread, 0, sizeof(*thread));
+	thread->tp = tls->tp;
+	thread->pid = shiva_syscall(SYS_gettid, 0, 0, 0, 0, 0, 0);
+	thread->ptid = ptid;
+	thread->flags = SHIVA_TRACE_THREAD_F_NEW;
+	return;
+}
+
+/*
+ * The record of the calling thread, registered on first use. Threads
+ * that found no trace_tls slot of their own have no record.
+ */
+struct shiva_trace_thread *
+shiva_trace_thread_self(struct shiva_ctx *ctx)
+{
+	struct shiva_trace_tls *tls;
+
+	shiva_trace_tls_init(ctx);
+	tls = shiva_trace_tls_self(ctx, true);
+	if (tls == &ctx->trace_tls[SHIVA_TRACE_TLS_SLOTS])
+		return NULL;
+	/*
+	 * A slot that was dropped in a forked child may have been claimed
+	 * by a thread with another thread pointer since.
+	 */
+	if (tls->thread.tp != tls->tp)
+		shiva_trace_thread_reset(tls, 0);
+	return &tls->thread;
+}
+
+/*
+ * Like shiva_trace_thread_self(), for a caller that knows its tid, i.e.
+ * a signal handler. A record that an exited thread with the same thread
+ * pointer left behind is reset, which shiva_trace_thread_self() can't
+ * tell without a system call.
+ */
+struct shiva_trace_thread *
+shiva_trace_thread_self_tid(struct shiva_ctx *ctx, pid_t tid)
+{
+	struct shiva_trace_thread *thread;
+	struct shiva_trace_tls *tls;
+
+	thread = shiva_trace_thread_self(ctx);
+	if (thread == NULL || thread->pid == tid)
+		return thread;
+	tls = shiva_trace_tls_self(ctx, false);
+	shiva_trace_thread_reset(tls, 0);
+	return &tls->thread;
+}
+
+/*
+ * The record of the thread tid, which must have registered itself. The
+ * only way to find a thread other than the caller is to look at every
+ * slot.
+ */
+struct shiva_trace_thread *
+shiva_trace_thread_by_tid(struct shiva_ctx *ctx, pid_t tid)
+{
+	struct shiva_trace_tls *tls;
+	size_t i;
+
+	if (ctx->trace_tls == NULL)
+		return NULL;
+	for (i = 0; i < SHIVA_TRACE_TLS_SLOTS; i++) {
+		tls = &ctx->trace_tls[i];
+		if (__atomic_load_n(&tls->tp, __ATOMIC_ACQUIRE) != 0 &&
+		    tls->thread.tp == tls->tp && tls->thread.pid == tid)
+			return &tls->thread;
 	}
-	shiva_debug("Opening: %s\n", filepath);
-	fp = fopen(filepath, "r");
-	if (fp == NULL) {
-		perror("fopen");
+	return NULL;
+}
+
+static long
+shiva_trace_thread_num(const char *p)
+{
+	long v = 0;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	while (*p >= '0' && *p <= '9')
+		v = v * 10 + (*p++ - '0');
+	return v;
+}
+
+/*
+ * Fill in the fields of thread that only /proc/self/task/<tid>/status
+ * knows, once.
+ */
+bool
+shiva_trace_thread_status(struct shiva_ctx *ctx, struct shiva_trace_thread *thread)
+{
+	char path[64] = "/proc/self/task/", digits[16], buf[4096], *p, *eol;
+	size_t len = strlen(path), n = 0;
+	long fd, ret;
+	pid_t tid;
+
+	(void) ctx;
+	if (thread->flags & SHIVA_TRACE_THREAD_F_STATUS)
+		return true;
+	for (tid = thread->pid; tid != 0 || n == 0; tid /= 10)
+		digits[n++] = '0' + tid % 10;
+	while (n > 0)
+		path[len++] = digits[--n];
+	memcpy(&path[len], "/status", sizeof("/status"));
+	shiva_debug("Opening: %s\n", path);
+	fd = shiva_syscall(SYS_openat, AT_FDCWD, (long)path, O_RDONLY|O_CLOEXEC, 0, 0, 0);
+	if (fd < 0) {
+		fprintf(stderr, "open(%s) failed: %s\n", path, strerror(-fd));
 		return false;
 	}
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		char *p;
-
-		p = strchr(buf, ':') + 1;
-		while (*p == ' ')
-			p++;
-		if (strncmp(buf, "Name:", 5) == 0) {
-			shiva_debug("Thread name: %s\n", p);
-			thread->name = shiva_strdup(p);
-			if (thread->name == NULL) {
-				perror("strdup");
-				return false;
-			}
-		} else if (strncmp(buf, "Gid", 3) == 0) {
-			thread->gid = strtoul(p, NULL, 10);
+	len = 0;
+	while (len < sizeof(buf) - 1 && (ret = shiva_syscall(SYS_read, fd,
+	    (long)&buf[len], sizeof(buf) - 1 - len, 0, 0, 0)) > 0)
+		len += ret;
+	(void) shiva_syscall(SYS_close, fd, 0, 0, 0, 0, 0);
+	buf[len] = '\0';
+	for (p = buf; *p != '\0'; p = eol + 1) {
+		char *val;
+
+		eol = strchr(p, '\n');
+		if (eol == NULL)
+			break;
+		*eol = '\0';
+		val = strchr(p, ':');
+		if (val == NULL)
+			continue;
+		val++;
+		while (*val == ' ' || *val == '\t')
+			val++;
+		if (strncmp(p, "Name:", 5) == 0) {
+			strncpy(thread->name, val, sizeof(thread->name) - 1);
+			shiva_debug("Thread name: %s\n", thread->name);
+		} else if (strncmp(p, "Gid:", 4) == 0) {
+			thread->gid = shiva_trace_thread_num(val);
 			shiva_debug("Thread gid: %d\n", thread->gid);
-		} else if (strncmp(buf, "TracerPid", 9) == 0) {
-			thread->external_tracer_pid = strtoul(p, NULL, 10);
+		} else if (strncmp(p, "TracerPid:", 10) == 0) {
+			thread->external_tracer_pid = shiva_trace_thread_num(val);
 			shiva_debug("Thread tracer pid: %d\n", thread->external_tracer_pid);
 			if (thread->external_tracer_pid != 0) {
 				thread->flags |= SHIVA_TRACE_THREAD_F_EXTERN_TRACER;
 			} else {
 				thread->flags |= SHIVA_TRACE_THREAD_F_TRACED;
 			}
-		} else if (strncmp(buf, "Uid", 3) == 0) {
-			thread->uid = strtoul(p, NULL, 10);
+		} else if (strncmp(p, "Uid:", 4) == 0) {
+			thread->uid = shiva_trace_thread_num(val);
 			shiva_debug("Thread uid: %d\n", thread->uid);
-		} else if (strncmp(buf, "PPid", 4) == 0) {
-			thread->ppid = strtoul(p, NULL, 10);
+		} else if (strncmp(p, "PPid:", 5) == 0) {
+			thread->ppid = shiva_trace_thread_num(val);
 			shiva_debug("Thread ppid: %d\n", thread->ppid);
-		} else if (strncmp(buf, "CoreDumping", 11) == 0) {
-			thread->flags |= SHIVA_TRACE_THREAD_F_COREDUMPING;
+		} else if (strncmp(p, "CoreDumping:", 12) == 0) {
+			if (shiva_trace_thread_num(val) != 0)
+				thread->flags |= SHIVA_TRACE_THREAD_F_COREDUMPING;
 		}
 	}
-	thread->flags |= SHIVA_TRACE_THREAD_F_NEW;
-	shiva_debug("Returning true\n");
+	thread->flags |= SHIVA_TRACE_THREAD_F_STATUS;
 	return true;
 }
-				
+
+/*
+ * Called by shiva_trace_tls_atfork() for the slot of the thread that
+ * survives in a forked child, which has a tid of its own now. The
+ * thread that forked is taken as its creator.
+ */
+void
+shiva_trace_thread_forked(struct shiva_trace_tls *tls)
+{
+	if (tls->thread.tp != tls->tp)
+		return;
+	shiva_trace_thread_reset(tls, tls->thread.pid);
+	return;
+}
+
 bool
 shiva_trace_thread_insert(struct shiva_ctx *ctx, pid_t pid, uint64_t *out)
 {
 	struct shiva_trace_thread *thread;
 
-	thread = calloc(1, sizeof(*thread));
+	/*
+	 * Only the calling thread (pid 0) can be inserted, any other
+	 * thread would require ptrace.
+	 */
+	if (pid != 0)
+		return false;
+	thread = shiva_trace_thread_self(ctx);
 	if (thread == NULL) {
-		perror("calloc");
+		fprintf(stderr, "No trace_tls slot left for the calling thread\n");
 		return false;
 	}
-	if (shiva_trace_thread_status(ctx, pid, thread) == false) {
-		fprintf(stderr, "shiva_pthread_thread_status() failed on pid: %d\n", pid);
-		free(thread);
+	if (shiva_trace_thread_status(ctx, thread) == false) {
+		fprintf(stderr, "shiva_trace_thread_status() failed on tid: %d\n",
+		    thread->pid);
 		return false;
 	}
 	/*
-	 * If the pid is coredumping or is already being traced by sys_ptrace
-	 * then we cannot insert it into the threadlist (Unless it is pid 0).
-	 * Any threads other than pid 0 require ptrace. In single threaded
-	 * processes we only use in-process tracing (No sys_ptrace) which
-	 * means that we can shiva_trace() the main debuggee process even
-	 * if it is being ptrace'd.
+	 * In single threaded processes we only use in-process tracing (No
+	 * sys_ptrace) which means that we can shiva_trace() the main
+	 * debuggee process even if it is being ptrace'd or is coredumping.
 	 */
-	*out = 0;
-	if (pid != 0) {
-		if (thread->flags & SHIVA_TRACE_THREAD_F_EXTERN_TRACER) {
-			if (out != NULL) {
-				*out |= SHIVA_TRACE_THREAD_F_EXTERN_TRACER;
-				free(thread);
-				shiva_debug("has external tracer, ret false\n");
-				return false;
-			}
-		} else if (thread->flags & SHIVA_TRACE_THREAD_F_COREDUMPING) {
-			if (out != NULL) {
-				*out |= SHIVA_TRACE_THREAD_F_COREDUMPING;
-				free(thread);
-				shiva_debug("coredumping, ret false\n");
-				return false;
-			}
-		}
-	}
+	*out = thread->flags & (SHIVA_TRACE_THREAD_F_EXTERN_TRACER |
+	    SHIVA_TRACE_THREAD_F_COREDUMPING);
 	if (thread->flags & SHIVA_TRACE_THREAD_F_NEW) {
-		shiva_debug("Inserting new thread\n");
-		TAILQ_INSERT_TAIL(&ctx->tailq.thread_tqlist, thread, _linkage);
+		shiva_debug("Inserting new thread %d\n", thread->pid);
 		thread->flags &= ~SHIVA_TRACE_THREAD_F_NEW;
 	}
 	shiva_debug("Returning true\n");
 	return true;
 }
+
+/*
+ * The start routine of the threads that the target creates through its
+ * pthread_create() PLT entry.
+ */
+static void *
+shiva_trace_thread_start(void *arg)
+{
+	struct shiva_trace_thread_spawn *spawn = arg;
+	void *(*start)(void *) = spawn->start;
+	void *start_arg = spawn->arg;
+	struct shiva_trace_tls *tls;
+
+	tls = shiva_trace_tls_self(ctx_global, true);
+	if (tls != &ctx_global->trace_tls[SHIVA_TRACE_TLS_SLOTS]) {
+		shiva_trace_thread_reset(tls, spawn->ptid);
+		tls->thread.flags |= SHIVA_TRACE_THREAD_F_CREATED;
+		shiva_debug("Thread %d created by %d\n", tls->thread.pid, spawn->ptid);
+	}
+	__atomic_store_n(&spawn->busy, 0, __ATOMIC_RELEASE);
+	return start(start_arg);
+}
+
+/*
+ * The GOT hook of pthread_create(), which hands the new thread the
+ * start routine of the target through a spawn. Without a spawn left
+ * the thread is registered once it looks itself up, like any other.
+ */
+static void *
+shiva_trace_thread_create(void *tid, void *attr, void *(*start)(void *), void *arg)
+{
+	int (*o_create)(void *, void *, void *(*)(void *), void *);
+	struct shiva_trace_thread_spawn *spawn = NULL;
+	struct shiva_trace_thread *self;
+	uint32_t busy;
+	size_t i;
+	int ret;
+
+	o_create = (void *)ctx_global->trace_thread.create_bp->o_target;
+	self = shiva_trace_thread_self(ctx_global);
+	for (i = 0; i < SHIVA_TRACE_THREAD_SPAWN_MAX; i++) {
+		busy = 0;
+		if (__atomic_compare_exchange_n(&ctx_global->trace_thread.spawn[i].busy,
+		    &busy, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) == true) {
+			spawn = &ctx_global->trace_thread.spawn[i];
+			break;
+		}
+	}
+	if (spawn == NULL)
+		return (void *)(long)o_create(tid, attr, start, arg);
+	spawn->start = start;
+	spawn->arg = arg;
+	spawn->ptid = self != NULL ? self->pid : 0;
+	ret = o_create(tid, attr, shiva_trace_thread_start, spawn);
+	if (ret != 0)
+		__atomic_store_n(&spawn->busy, 0, __ATOMIC_RELEASE);
+	return (void *)(long)ret;
+}
+
+/*
+ * Hook the pthread_create() PLT entry of the target, if it has one. The
+ * GOT hook is written by shiva_post_linker(), so this is a no-op once
+ * LDSO has run (A live patch), and threads created by shared objects
+ * aren't seen either, both are registered lazily.
+ */
+bool
+shiva_trace_thread_hook(struct shiva_ctx *ctx, shiva_error_t *error)
+{
+	struct shiva_trace_handler *handler;
+	struct elf_plt plt_entry;
+	uint64_t dbg;
+	void *mem;
+
+	if (ctx->trace_thread.create_bp != NULL)
+		return true;
+	if (elf_plt_by_name(&ctx->elfobj, "pthread_create", &plt_entry) == false)
+		return true;
+	if (shiva_target_dynamic_get(ctx, DT_DEBUG, &dbg) == true && dbg != 0)
+		return true;
+	shiva_trace_tls_init(ctx);
+	mem = mmap(NULL, ELF_PAGEALIGN(SHIVA_TRACE_THREAD_SPAWN_MAX *
+	    sizeof(struct shiva_trace_thread_spawn), PAGE_SIZE), PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		shiva_error_set(error, "mmap failed: %s\n", strerror(errno));
+		return false;
+	}
+	ctx->trace_thread.spawn = mem;
+	if (shiva_trace_register_handler(ctx, (void *)shiva_trace_thread_create,
+	    SHIVA_TRACE_BP_PLTGOT, error) == false)
+		return false;
+	if (shiva_trace_set_breakpoint(ctx, (void *)shiva_trace_thread_create, 0,
+	    "pthread_create", error) == false)
+		return false;
+	handler = shiva_trace_find_handler(ctx, (void *)shiva_trace_thread_create);
+	ctx->trace_thread.create_bp = TAILQ_FIRST(&handler->bp_tqlist);
+	shiva_debug("Threads created through pthread_create@plt are registered\n");
+	return true;
+}
@@ -0,0 +1,110 @@
+/*
+ * shiva_trace_watch.c - SHIVA_TRACE_BP_WATCH, hardware watchpoints.
+ *
+ * A watchpoint is a PERF_TYPE_BREAKPOINT perf event on the calling
+ * thread, which the kernel arms in the debug registers (DBGWVR/DBGWCR
+ * on aarch64) whenever the thread runs. Nothing within the target is
+ * rewritten, and the accesses that don't hit the watched bytes cost
+ * nothing at all. Each hit delivers a synchronous SIGTRAP (sigtrap=1,
+ * Linux 5.13 and later) to the thread that made the access, after the
+ * access, with si_code TRAP_PERF and si_perf_data set to the watched
+ * address. The handler of the breakpoint is installed as the SIGTRAP
+ * handler (Which SHIVA_TRACE_BP_INT3 uses as well), and finds its
+ * breakpoint with shiva_trace_watch_bp() rather than
+ * SHIVA_TRACE_BP_STRUCT().
+ *
+ * The events are inherited by threads that are created from now on, so
+ * watchpoints set before the target runs cover all of its threads. The
+ * number of watchpoints is bounded by the hardware (Often 4), the one
+ * past the limit fails with ENOSPC.
+ */
+#include "shiva.h"
+#include <linux/perf_event.h>
+#include <linux/hw_breakpoint.h>
+#include <sys/syscall.h>
+
+bool
+shiva_trace_watch_set(struct shiva_ctx *ctx, struct shiva_trace_handler *handler,
+    uint64_t addr, struct shiva_trace_watch *watch, shiva_error_t *error)
+{
+#ifdef PERF_ATTR_SIZE_VER7
+	struct perf_event_attr attr;
+	struct shiva_trace_bp *bp;
+	size_t len = watch != NULL ? watch->len : sizeof(uint64_t);
+	uint32_t access = watch != NULL ? watch->access : SHIVA_TRACE_WATCH_W;
+	int fd;
+
+	if ((len != 1 && len != 2 && len != 4 && len != 8) ||
+	    (addr & ~7UL) != ((addr + len - 1) & ~7UL)) {
+		shiva_error_set(error, "cannot watch %zu bytes at %#lx, the bytes must"
+		    " lie within an aligned 8 bytes\n", len, addr);
+		return false;
+	}
+	if ((access & (SHIVA_TRACE_WATCH_R|SHIVA_TRACE_WATCH_W)) == 0) {
+		shiva_error_set(error, "no access to watch at %#lx\n", addr);
+		return false;
+	}
+	if (TAILQ_EMPTY(&handler->bp_tqlist)) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = (void *)handler->handler_fn;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART | SA_SIGINFO;
+		if (sigaction(SIGTRAP, &sa, NULL) < 0) {
+			shiva_error_set(error, "sigaction failed: %s\n", strerror(errno));
+			return false;
+		}
+		memcpy(&handler->sa, &sa, sizeof(sa));
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_BREAKPOINT;
+	attr.size = sizeof(attr);
+	attr.bp_type = ((access & SHIVA_TRACE_WATCH_R) ? HW_BREAKPOINT_R : 0) |
+	    ((access & SHIVA_TRACE_WATCH_W) ? HW_BREAKPOINT_W : 0);
+	attr.bp_addr = addr;
+	attr.bp_len = len;
+	attr.sample_period = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = 1;
+	attr.remove_on_exec = 1;
+	attr.sigtrap = 1;
+	attr.sig_data = addr;
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0) {
+		shiva_error_set(error, "perf_event_open(PERF_TYPE_BREAKPOINT, %#lx) failed: %s\n",
+		    addr, errno == ENOSPC ? "no hardware watchpoint left" : strerror(errno));
+		return false;
+	}
+	bp = shiva_arena_alloc(&ctx->arena.trace, sizeof(*bp));
+	bp->bp_type = SHIVA_TRACE_BP_WATCH;
+	bp->bp_addr = addr;
+	bp->bp_len = len;
+	bp->watch_fd = fd;
+	shiva_debug("Armed %s watchpoint on %zu bytes at %#lx (fd %d)\n",
+	    access == SHIVA_TRACE_WATCH_W ? "write" : "access", len, addr, fd);
+	shiva_trace_bp_insert(ctx, handler, bp);
+	return true;
+#else
+	shiva_error_set(error, "hardware watchpoints need perf_event_attr.sigtrap"
+	    " (Linux 5.13)\n");
+	return false;
+#endif
+}
+
+/*
+ * The breakpoint of a watchpoint hit, from within its SIGTRAP handler.
+ */
+struct shiva_trace_bp *
+shiva_trace_watch_bp(struct shiva_ctx *ctx, void *handler_fn, uint64_t addr)
+{
+	struct shiva_trace_handler *handler;
+	struct shiva_trace_bp *bp;
+
+	handler = shiva_trace_find_handler(ctx, handler_fn);
+	if (handler == NULL || handler->type != SHIVA_TRACE_BP_WATCH)
+		return NULL;
+	bp = shiva_trace_bp_lookup(handler, addr);
+	return bp != NULL && bp->bp_addr == addr ? bp : NULL;
+}
@@ -1,4 +1,5 @@
 #include "shiva.h"
+#include "modules/include/shiva_module.h"
 #if __aarch64__
 #include "shiva_aarch64.h"
 #endif
@@ -26,85 +27,179 @@
  * [spliced code ] <- shiva_module.c:apply_relocation()
  * [original code] <- shiva_transform.c:shiva_tf_relink_new_func()
  * }
+ *
+ * A function may have several splices (SHIVA_T_SPLICE_FUNCTION_AT), it's
+ * still copied only once, with every splice in place. The splices of a
+ * function form a group, and the one with the lowest offset (The primary)
+ * owns the copy.
+ *
+ * When the patch code of every splice in a group fits within the code it
+ * replaces (REPLACE/NOP_PAD) and doesn't need to be relocated, the function
+ * isn't copied at all: the splices are written straight into the target
+ * by shiva_tf_queue_inplace(), and the callers of the function are left
+ * alone.
+ *
+ * An emit (SHIVA_T_EMIT_BYTECODE) never copies the function. Its bytecode
+ * overwrites the old_len bytes at offset, padded with nops, when it fits.
+ * Otherwise the first instruction there becomes a b to the bytecode in
+ * the branch island of the module (See shiva_module_island_alloc), which
+ * ends with a b back to offset + old_len:
+ *
+ * foo + offset:	b	island		island:	[bytecode]
+ *			nop				b	foo + offset + old_len
+ *
+ * Either way only the page(s) of the replaced code are written to.
+ */
+
+static int
+shiva_tf_offset_cmp(const void *a, const void *b)
+{
+	const struct shiva_transform *x = *(struct shiva_transform * const *)a;
+	const struct shiva_transform *y = *(struct shiva_transform * const *)b;
+
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+ * Every splice of the function that primary splices, sorted by offset.
+ * The array must be free'd by the caller.
+ */
+static struct shiva_transform **
+shiva_tf_splice_group(struct shiva_module *linker, struct shiva_transform *primary,
+    size_t *count)
+{
+	struct shiva_transform *transform, **group = NULL;
+	size_t n = 0;
+
+	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
+		if (transform->type != SHIVA_TRANSFORM_SPLICE_FUNCTION ||
+		    transform->splice.primary != primary)
+			continue;
+		group = shiva_realloc(group, (n + 1) * sizeof(*group));
+		group[n++] = transform;
+	}
+	qsort(group, n, sizeof(*group), shiva_tf_offset_cmp);
+	*count = n;
+	return group;
+}
+
+/*
+ * Translate off, an offset within the original function, to its offset
+ * within the copy of the function.
+ */
+static uint64_t
+shiva_tf_new_offset(struct shiva_transform **group, size_t count, uint64_t off)
+{
+	int64_t shift = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (off < group[i]->offset)
+			break;
+		if (off < group[i]->offset + group[i]->old_len)
+			return group[i]->splice.new_offset + (off - group[i]->offset);
+		shift += (int64_t)group[i]->new_len - (int64_t)group[i]->old_len;
+	}
+	return off + shift;
+}
+
+/*
+ * Translates the offsets of the sites within a function, visited in
+ * ascending order, to their offsets within the copy. The shift is carried
+ * from one site to the next rather than recomputed for each.
+ */
+struct shiva_tf_cursor {
+	struct shiva_transform **group;
+	size_t count;
+	size_t index; /* first splice that doesn't end before the offset */
+	int64_t shift;
+};
+
+/*
+ * Returns false if off lies within code that one of the splices replaces.
  */
+static bool
+shiva_tf_cursor_next(struct shiva_tf_cursor *cursor, uint64_t off, uint64_t *new_off)
+{
+	struct shiva_transform *transform;
+
+	while (cursor->index < cursor->count) {
+		transform = cursor->group[cursor->index];
+		if (off < transform->offset + transform->old_len)
+			break;
+		cursor->shift += (int64_t)transform->new_len - (int64_t)transform->old_len;
+		cursor->index++;
+	}
+	if (cursor->index < cursor->count &&
+	    off >= cursor->group[cursor->index]->offset)
+		return false;
+	*new_off = off + cursor->shift;
+	return true;
+}
+
 /*
- * shiva_tf_splice_function_extend
+ * shiva_tf_splice_function
  * Copy the function that is being transformed into a new location
- * while splicing the transform source (The patch) into place.
- * If the original byte-code is smaller than the patch, then we overwrite
+ * while splicing the transform sources (The patches) into place.
+ * If the original byte-code is smaller than a patch, then we overwrite
  * the original code and then extend from that offset to make room for the
  * rest of the patch.
  *
  * The patch code is relocatable, and will be properly relocated by apply_relocation().
- * The code before and after the patch insertion may also need to be relinked due to
+ * The code before and after the patch insertions may also need to be relinked due to
  * offsets changing.
+ *
+ * Returns the length of the copy.
  */
-static bool
-shiva_tf_splice_function_extend(struct shiva_module *linker, struct shiva_transform *transform,
-    uint8_t *dst)
+static size_t
+shiva_tf_splice_function(struct shiva_module *linker, struct shiva_transform **group,
+    size_t count, uint8_t *dest)
 {
-	/*
-	 * Destination function
-	 */
-	uint8_t *dest = dst;
+	struct shiva_transform *transform;
 	/*
 	 * Source function
 	 */
-	uint8_t *source = (uint8_t *)transform->target_symbol.value + linker->target_base;
-	size_t copy_len;
-
-	/*
-	 * Step 1 Inject first half
-	 * Copy first half of function into module image.
-	 */
-	copy_len = transform->offset;
-	shiva_debug("COPY_FIRST_HALF: dest:%p, source:%p, len:%zu\n",
-	    dest, source, copy_len);
-	memcpy(dest, source, copy_len);
-	transform->splice.copy_len1 = copy_len;
-
-	test_mark();
-	/* Step 2. Inject patch code. If the patch code is larger
-	 * than the original code, then extend.
-	 * Copy the patch code (Transform source) into the correct
-	 * offset (transform->offset to be exact) of the new function.
-	 */
-	copy_len = transform->new_len;
-	source = transform->ptr;
-	shiva_debug("note: transform_offset: %#zu\n", transform->offset);
-	shiva_debug("COPY_TF_SOURCE: dest:%#lx, source:%#lx, len:%zu\n",
-	    dest + transform->offset, source, copy_len);
-	/*
-	 * attribute((naked)) does not work with gcc aarch64.
-	 * Our patch functions are compiled with a 4 byte prologue
-	 * that we must NOP out. As well as an 8 byte epilogue.
-	 */
-#ifdef __aarch64__
-	*(uint32_t *)&transform->ptr[0] = AARCH64_NOP;
-	*(uint32_t *)&transform->ptr[transform->new_len - 4] = AARCH64_NOP;
-	*(uint32_t *)&transform->ptr[transform->new_len - 8] = AARCH64_NOP;
-#endif
-	memcpy(dest + transform->offset, transform->ptr, copy_len);
-	transform->splice.copy_len2 = copy_len;
+	uint8_t *source = (uint8_t *)group[0]->target_symbol.value + linker->target_base;
+	uint64_t src_off = 0, dst_off = 0;
+	size_t copy_len, i;
 
-	test_mark();
+	for (i = 0; i < count; i++) {
+		transform = group[i];
+		/*
+		 * Step 1. Copy the original code up to the splice
+		 */
+		copy_len = transform->offset - src_off;
+		shiva_debug("COPY_ORIGINAL: dest:%p, source:%p, len:%zu\n",
+		    dest + dst_off, source + src_off, copy_len);
+		memcpy(dest + dst_off, source + src_off, copy_len);
+		dst_off += copy_len;
 
+		/* Step 2. Inject patch code. If the patch code is larger
+		 * than the original code, then extend.
+		 * Copy the patch code (Transform source) into the new
+		 * function. The prologue and epilogue were already
+		 * replaced with nops by shiva_tf_plan_splices().
+		 */
+		shiva_debug("note: transform_offset: %#zu\n", transform->offset);
+		shiva_debug("COPY_TF_SOURCE: dest:%p, source:%p, len:%zu\n",
+		    dest + dst_off, transform->ptr, transform->new_len);
+		memcpy(dest + dst_off, transform->ptr, transform->new_len);
+		transform->splice.new_offset = dst_off;
+		dst_off += transform->new_len;
+		src_off = transform->offset + transform->old_len;
+		test_mark();
+	}
 	/*
-	 * Step 3. Inject last half of function
-	 * Copy the second half of the original function
-	 * into place after the patch code.
+	 * Step 3. Inject last part of function
+	 * Copy the rest of the original function into place
+	 * after the last patch code.
 	 */
-	source = (uint8_t *)transform->target_symbol.value + linker->target_base;
-	copy_len = transform->target_symbol.value + transform->target_symbol.size;
-	copy_len = copy_len - (transform->target_symbol.value + transform->offset + transform->old_len);
-	shiva_debug("COPY_SECOND_HALF: dest:%#lx, source:%#lx, len:%zu\n",
-	    dest + transform->offset + transform->new_len,
-	    source + transform->offset + transform->old_len, copy_len);
-	memcpy(dest + transform->offset + transform->new_len,
-	    source + transform->offset + transform->old_len, copy_len);
-	transform->splice.copy_len3 = copy_len;
+	copy_len = group[0]->target_symbol.size - src_off;
+	shiva_debug("COPY_SECOND_HALF: dest:%p, source:%p, len:%zu\n",
+	    dest + dst_off, source + src_off, copy_len);
+	memcpy(dest + dst_off, source + src_off, copy_len);
+	dst_off += copy_len;
 
-	test_mark();
 	/*
 	 * Step 4. Create an extended area at the end of the function
 	 * containing .text read-only data. The data stored here
@@ -123,24 +218,27 @@ shiva_tf_splice_function_extend(struct shiva_module *linker, struct shiva_transf
 	 * adrp, and add. When we splice the source function (The patch) in with
 	 * the target function, we will have to move this read-only .text
 	 * to the end of the final spliced function. The relocations
-	 * r_addend fields will have to be increased by:
-	 * transform->splice.copy_len3 bytes
+	 * r_offset and r_addend fields are moved to splice.ext_offset
+	 * by apply_relocation(). Each splice has an area of its own.
 	 *
 	 * foo() function layout after step 4
-	 * 1. [first_half ]
+	 * 1. [original   ]
 	 * 2. [patch_code ]
-	 * 3. [second_half]
-	 * 4. [.text encoded values]
+	 * 3. [original   ] (1. and 2. repeat for each splice)
+	 * 4. [.text encoded values] (one for each splice)
 	 */
-	shiva_debug("COPY_IN_TEXT_ENCDODINGS: dest:%#lx, source: %#lx, len: %zu\n",
-	    dest + transform->offset + transform->new_len + transform->splice.copy_len3,
-	    &transform->ptr[transform->source_symbol.size],
-	    transform->ext_len);
-	memcpy(dest + transform->offset + transform->new_len + transform->splice.copy_len3,
-	    &transform->ptr[transform->source_symbol.size],
-	    transform->ext_len);
+	for (i = 0; i < count; i++) {
+		transform = group[i];
+		shiva_debug("COPY_IN_TEXT_ENCDODINGS: dest:%p, source: %p, len: %zu\n",
+		    dest + dst_off, &transform->ptr[transform->source_symbol.size],
+		    transform->ext_len);
+		memcpy(dest + dst_off, &transform->ptr[transform->source_symbol.size],
+		    transform->ext_len);
+		transform->splice.ext_offset = dst_off;
+		dst_off += transform->ext_len;
+	}
 	test_mark();
-	return true;
+	return dst_off;
 }
 
 /*
@@ -149,8 +247,8 @@ shiva_tf_splice_function_extend(struct shiva_module *linker, struct shiva_transf
  * Their code helped to shed some light on re-encoding the branches.
  */
 #define BRANCH_IS_LOCAL(addr) \
-	(addr >= branch->current_function.value && \
-	 addr < branch->current_function.value + branch->current_function.size)
+	(addr >= src_func->value && \
+	 addr < src_func->value + src_func->size)
 
 #define BRANCH_LINK (1UL << 0)
 #define RELOC_MASK(n)	((1U << n) - 1)
@@ -177,7 +275,7 @@ shiva_tf_splice_function_extend(struct shiva_module *linker, struct shiva_transf
  */
 static bool
 shiva_tf_relink_xref(struct shiva_module *linker, struct shiva_transform *transform,
-    struct shiva_xref_site *xref)
+    struct shiva_xref_site *xref, uint64_t adrp_off)
 {
 	bool res;
 	shiva_error_t error;
@@ -186,8 +284,9 @@ shiva_tf_relink_xref(struct shiva_module *linker, struct shiva_transform *transf
 	uint32_t n_ldr_insn;
 	uint32_t n_str_insn;
 	int32_t rel_val, xoffset;
-	uint64_t rel_addr, adrp_off;
+	uint64_t rel_addr;
 	uint8_t *rel_unit;
+	struct elf_symbol *symbol = shiva_analyze_symbol(linker->ctx, xref->symbol);
 
 	shiva_debug("ctx_global: %p\n", ctx_global);
 
@@ -195,22 +294,20 @@ shiva_tf_relink_xref(struct shiva_module *linker, struct shiva_transform *transf
 	    xref->adrp_site < transform->target_symbol.value + transform->target_symbol.size);
 
 	/*
-	 * we get the offset of an adrp instruction from beginning of the
-	 * transformed function. This offset can change if the transform
-	 * new_len is > than old_len.
+	 * adrp_off is the offset of the adrp instruction from the beginning
+	 * of the transformed function. It differs from its offset within the
+	 * original function when a splice before it changed the length.
 	 */
-	adrp_off = xref->adrp_site - transform->target_symbol.value;
 	shiva_debug("Adrp offset: %#lx\n", adrp_off);
-	if (adrp_off > transform->offset + transform->old_len)
-		adrp_off += transform->new_len - transform->old_len;
 	rel_addr = linker->text_vaddr + transform->segment_offset + adrp_off;
 
-	shiva_debug("Symbol name: %s\n", xref->symbol.name);
-	shiva_debug("Source sym: %s\n", xref->current_function.name);
-	shiva_debug("Target symbol addr: %#lx\n", linker->target_base + xref->symbol.value);
+	shiva_debug("Symbol name: %s\n", symbol->name);
+	shiva_debug("Source sym: %s\n",
+	    shiva_analyze_symbol(linker->ctx, xref->current_function)->name);
+	shiva_debug("Target symbol addr: %#lx\n", linker->target_base + symbol->value);
 	xoffset = rel_val = (int32_t)
-	    (ELF_PAGESTART(linker->target_base + xref->symbol.value) - ELF_PAGESTART(rel_addr));
-	shiva_debug("rel_val = %#lx - %#lx = %#lx\n", ELF_PAGESTART(linker->target_base + xref->symbol.value),
+	    (ELF_PAGESTART(linker->target_base + symbol->value) - ELF_PAGESTART(rel_addr));
+	shiva_debug("rel_val = %#lx - %#lx = %#lx\n", ELF_PAGESTART(linker->target_base + symbol->value),
 	    ELF_PAGESTART(rel_addr), rel_val);
 	rel_val >>= 12;
 
@@ -241,7 +338,7 @@ shiva_tf_relink_xref(struct shiva_module *linker, struct shiva_transform *transf
 	case SHIVA_XREF_TYPE_ADRP_ADD:
 		rel_unit = (uint8_t *)rel_addr;
 		shiva_debug("Installing SHIVA_XREF_TYPE_ADRP_ADD patch at %#lx to link symbol %s\n",
-		    rel_addr, xref->symbol.name);
+		    rel_addr, symbol->name);
 		memcpy(rel_unit, &n_adrp_insn, 4);
 #if 0
 		shiva_trace_write() cannot work here because it relies on shiva_maps_prot_by_addr()
@@ -256,7 +353,7 @@ shiva_tf_relink_xref(struct shiva_module *linker, struct shiva_transform *transf
 			return false;
 		}
 #endif
-		rel_val = xref->symbol.value;
+		rel_val = symbol->value;
 		shiva_debug("Add offset: %#lx\n", rel_val);
 		n_add_insn = xref->next_o_insn;
 		n_add_insn = (n_add_insn & ~(RELOC_MASK(12) << 10)) | ((rel_val & RELOC_MASK(12)) << 10);
@@ -294,20 +391,17 @@ XXX TODO
 
 static bool
 shiva_tf_relink_global_branch(struct shiva_module *linker, struct shiva_transform *transform,
-    struct shiva_branch_site *branch)
+    struct shiva_branch_site *branch, size_t br_off)
 {
 	/*
-	 * Offset to branch instruction (Within our new transformed version of the function)
+	 * br_off is the offset to the branch instruction (Within our new
+	 * transformed version of the function)
 	 */
-	size_t br_off = branch->branch_site - transform->target_symbol.value;
-	shiva_debug("br_off = %lx - %lx = %#lx\n", branch->branch_site, transform->target_symbol.value,
-	    br_off);
+	shiva_debug("br_off: %#lx\n", br_off);
 	/*
 	 * mem points to the branch instruction within the new location of the
 	 * spliced/transformed function.
 	 */
-	if (br_off > transform->offset + transform->old_len)
-		br_off += transform->new_len - transform->old_len;
 	uint8_t *mem = &linker->text_mem[transform->segment_offset + br_off];
 
 	/*
@@ -324,9 +418,9 @@ shiva_tf_relink_global_branch(struct shiva_module *linker, struct shiva_transfor
 	if (strncmp(branch->insn_string, "bl ", 3) == 0) {
 
 		if (branch->branch_flags & SHIVA_BRANCH_F_PLTCALL) {
-			shiva_debug("plt call to %s\n", branch->symbol.name);
+			shiva_debug("plt call to %s\n", shiva_analyze_symbol(linker->ctx, branch->symbol)->name);
 		} else {
-			shiva_debug("local call to %s\n", branch->symbol.name);
+			shiva_debug("local call to %s\n", shiva_analyze_symbol(linker->ctx, branch->symbol)->name);
 		}
 		decoded_offset = sbits(raw_insn, 0, 25) << 2;
 		target_vaddr = linker->target_base + branch->branch_site + decoded_offset;
@@ -345,20 +439,13 @@ shiva_tf_relink_global_branch(struct shiva_module *linker, struct shiva_transfor
 
 static bool
 shiva_tf_relink_local_branch(struct shiva_module *linker, struct shiva_transform *transform,
-    struct shiva_branch_site *branch, ssize_t delta)
+    struct shiva_branch_site *branch, size_t br_off, ssize_t delta)
 {
 	/*
-	 * Offset to branch instruction
-	 */
-	size_t br_off = branch->branch_site - transform->target_symbol.value;
-	shiva_debug("br_off = %lx - %lx = %#lx\n", branch->branch_site, transform->target_symbol.value,
-	    br_off);
-	/*
-	 * mem points to the branch instruction within the new location of the
-	 * spliced/transformed function.
+	 * br_off is the offset to the branch instruction within the
+	 * new location of the spliced/transformed function.
 	 */
-	if (br_off > transform->offset + transform->old_len)
-		br_off += transform->new_len - transform->old_len;
+	shiva_debug("br_off: %#lx\n", br_off);
 	uint8_t *mem = &linker->text_mem[transform->segment_offset + br_off];
 
 	/*
@@ -465,63 +552,63 @@ shiva_tf_relink_local_branch(struct shiva_module *linker, struct shiva_transform
 
 static bool
 shiva_tf_relink_new_func(struct shiva_module *linker,
-    struct shiva_transform *transform)
+    struct shiva_transform **group, size_t count)
 {
-	uint8_t *code_ptr;
+	struct shiva_transform *transform = group[0];
 	struct shiva_branch_site *branch;
 	struct shiva_xref_site *xref;
+	struct elf_symbol *src_func = &transform->target_symbol;
+	struct shiva_tf_cursor cursor;
+	uint64_t func = transform->target_symbol.value;
+	uint64_t site_off, target_off, new_off;
 	ssize_t delta;
+	size_t i;
 	bool res;
 
 	/*
 	 * Local branches (i.e. jmp's) and global branches (i.e. calls)
-	 * must be re-linked.
+	 * must be re-linked. Every splice in the group shares the same
+	 * target function, and therefore the same branches and xrefs,
+	 * which are address sorted slices of ctx->analysis. Those within
+	 * code that was spliced out no longer exist in the new function.
 	 */
-	TAILQ_FOREACH(branch, &transform->branch_list, _linkage) {
-		if ((transform->flags & SHIVA_TRANSFORM_F_EXTEND) == 0)
+	memset(&cursor, 0, sizeof(cursor));
+	cursor.group = group;
+	cursor.count = count;
+	for (i = 0; i < transform->branch_count; i++) {
+		branch = &transform->branches[i];
+		if ((branch->branch_flags & SHIVA_BRANCH_F_SRC_SYMINFO) == 0)
+			continue;
+		site_off = branch->branch_site - func;
+		if (shiva_tf_cursor_next(&cursor, site_off, &new_off) == false)
 			continue;
-		/*
-		 * Relink positive offsets that link to code
-		 * after the splice insertion, from code before
-		 * the splice insertion.
-		 */
 		shiva_debug("Processing transform branch: %#lx:%s\n", branch->branch_site,
 		    branch->insn_string);
 
 		if (BRANCH_IS_LOCAL(branch->target_vaddr)) {
-			shiva_debug("Processing local branch: %#lx:%s\n", branch->branch_site,
-			    branch->insn_string);
-			shiva_debug("Is branch_site %#lx < %#lx\n", branch->branch_site, transform->target_symbol.value +
-			    transform->offset);
-			 if ((branch->branch_site < transform->target_symbol.value + transform->offset) &&
-			    branch->target_vaddr > transform->target_symbol.value + transform->offset) {
-				delta = transform->new_len - transform->old_len;
-				shiva_debug("Calling shiva_tf_relink_local_branch with delta %zd\n", delta);
-				res = shiva_tf_relink_local_branch(linker,
-				    transform, branch, delta);
-				if (res == false) {
-					fprintf(stderr,
-					    "shiva_tf_relink_local_branch() failed\n");
-					return false;
-				}
-			} else if ((branch->branch_site > transform->target_symbol.value +
-				transform->offset + transform->old_len) &&
-				branch->target_vaddr < transform->target_symbol.value + transform->offset) {
-				delta = transform->new_len - transform->old_len;
-				shiva_debug("Calling shiva_tf_relink_local_branch (Backwards) with delta: %d\n", -delta);
-				res = shiva_tf_relink_local_branch(linker,
-				    transform, branch, -delta);
-				if (res == false) {
-					fprintf(stderr,
-					    "shiva_tf_relink_local_branch() failed\n");
-					return false;
-				}
+			/*
+			 * Relink any local branch whose distance to its
+			 * target changed, i.e. one that crosses a splice
+			 * that changed the length of the code, in either
+			 * direction.
+			 */
+			target_off = branch->target_vaddr - func;
+			delta = (ssize_t)(shiva_tf_new_offset(group, count, target_off) - new_off) -
+			    (ssize_t)(target_off - site_off);
+			if (delta == 0)
+				continue;
+			shiva_debug("Calling shiva_tf_relink_local_branch with delta %zd\n", delta);
+			res = shiva_tf_relink_local_branch(linker, transform, branch,
+			    new_off, delta);
+			if (res == false) {
+				fprintf(stderr,
+				    "shiva_tf_relink_local_branch() failed\n");
+				return false;
 			}
-		} else if ((branch->branch_site < transform->target_symbol.value + transform->offset) ||
-			    (branch->branch_site > transform->target_symbol.value  + transform->offset + transform->old_len)) {
+		} else {
 			shiva_debug("Calling shiva_tf_relink_global_branch\n");
-			res = shiva_tf_relink_global_branch(linker,
-			    transform, branch);
+			res = shiva_tf_relink_global_branch(linker, transform, branch,
+			    new_off);
 			if (res == false) {
 				fprintf(stderr,
 				    "shiva_tf_relink_global_branch() failed\n");
@@ -537,15 +624,21 @@ shiva_tf_relink_new_func(struct shiva_module *linker,
 	 * must re-link any references to variables with the
 	 * correct offsets, etc.
 	 */
-	TAILQ_FOREACH(xref, &transform->xref_list, _linkage) {
-		if ((xref->adrp_site < transform->target_symbol.value + transform->offset) ||
-		    (xref->adrp_site >= transform->target_symbol.value + transform->offset + transform->old_len)) {
-			res = shiva_tf_relink_xref(linker, transform, xref);
-			if (res == false) {
-				fprintf(stderr,
-				    "shiva_tf_relink_xrefs() failed\n");
-				return false;
-			}
+	memset(&cursor, 0, sizeof(cursor));
+	cursor.group = group;
+	cursor.count = count;
+	for (i = 0; i < transform->xref_count; i++) {
+		xref = &transform->xrefs[i];
+		if ((xref->flags & SHIVA_XREF_F_SRC_SYMINFO) == 0)
+			continue;
+		site_off = xref->adrp_site - func;
+		if (shiva_tf_cursor_next(&cursor, site_off, &new_off) == false)
+			continue;
+		res = shiva_tf_relink_xref(linker, transform, xref, new_off);
+		if (res == false) {
+			fprintf(stderr,
+			    "shiva_tf_relink_xrefs() failed\n");
+			return false;
 		}
 	}
 	return true;
@@ -562,42 +655,471 @@ bool
 shiva_tf_process_transforms(struct shiva_module *linker, uint8_t *dst,
     struct elf_section section, uint64_t *segment_offset)
 {
-	uint8_t *ptr;
-	bool res = false;
-	struct shiva_transform *transform;
-	elf_symtab_iterator_t symtab;
-	struct elf_symbol symbol;
+	struct shiva_transform *transform, **group, **member;
+	size_t count, len, i;
+	bool res = true;
 
 	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
 		switch(transform->type) {
 		case SHIVA_TRANSFORM_SPLICE_FUNCTION:
+			/*
+			 * Only the primary splice of a function copies it,
+			 * along with the rest of the group. Splices that
+			 * were written in place need no room in the module.
+			 */
+			if (transform->splice.primary != transform ||
+			    (transform->flags & SHIVA_TRANSFORM_F_INPLACE))
+				break;
 			shiva_debug("Calling shiva_tf_splice_function\n");
 			shiva_debug("Transform offset: %#lx (%zu)\n", transform->offset,
 			    transform->offset);
-			if (transform->flags & SHIVA_TRANSFORM_F_EXTEND) {
-				res = shiva_tf_splice_function_extend(linker, transform, dst);
-				if (res == true ) {
-					transform->segment_offset = *segment_offset;
-					*segment_offset += transform->target_symbol.size;
-					*segment_offset += transform->source_symbol.size;
-					*segment_offset += transform->ext_len;
-					shiva_debug("setting segment_offset to %#lx\n", *segment_offset);
-					if (*segment_offset % ARM_INSN_LEN != 0) {
-						shiva_debug("Aligning *segment_offset to 4\n");
-						*segment_offset = *segment_offset + 4 & ~3;
-					}
-					shiva_debug("Calling shiva_tf_relink_new_func\n");
-					res = shiva_tf_relink_new_func(linker, transform);
-				}
-				break;
+			group = shiva_tf_splice_group(linker, transform, &count);
+			len = shiva_tf_splice_function(linker, group, count,
+			    &dst[*segment_offset]);
+			for (member = group, i = 0; i < count; i++, member++)
+				(*member)->segment_offset = *segment_offset;
+			*segment_offset += len;
+			shiva_debug("setting segment_offset to %#lx\n", *segment_offset);
+			if (*segment_offset % ARM_INSN_LEN != 0) {
+				shiva_debug("Aligning *segment_offset to 4\n");
+				*segment_offset = *segment_offset + 4 & ~3;
 			}
+			shiva_debug("Calling shiva_tf_relink_new_func\n");
+			res = shiva_tf_relink_new_func(linker, group, count);
+			free(group);
+			if (res == false)
+				goto done;
 			break;
 		case SHIVA_TRANSFORM_EMIT_BYTECODE:
+			/*
+			 * Emits are written into the target, and their
+			 * islands by shiva_tf_queue_inplace().
+			 */
 		default:
 			break;
 		}
 	}
+done:
 	linker->tf_text_offset = *segment_offset;
 	test_mark();
 	return res;
 }
+
+/*
+ * Returns the name of the target function that symname, the name of a
+ * splice source function, splices into. Or NULL if symname isn't one:
+ * __shiva_splice_fn_name_<function> (SHIVA_T_SPLICE_FUNCTION)
+ * __shiva_splice_n<N>_fn_name_<function> (SHIVA_T_SPLICE_FUNCTION_AT)
+ */
+static const char *
+shiva_tf_numbered_target(const char *symname, const char *id, const char *infix)
+{
+	const char *p;
+
+	if (strncmp(symname, id, strlen(id)) != 0)
+		return NULL;
+	p = symname + strlen(id);
+	if (*p < '0' || *p > '9')
+		return NULL;
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (strncmp(p, infix, strlen(infix)) != 0)
+		return NULL;
+	return p + strlen(infix);
+}
+
+const char *
+shiva_tf_splice_target(const char *symname)
+{
+	if (strncmp(symname, SHIVA_T_SPLICE_FUNC_ID, strlen(SHIVA_T_SPLICE_FUNC_ID)) == 0)
+		return symname + strlen(SHIVA_T_SPLICE_FUNC_ID);
+	return shiva_tf_numbered_target(symname, SHIVA_T_SPLICE_AT_ID, "_fn_name_");
+}
+
+/*
+ * Returns the name of the target function that symname, the bytecode of
+ * an emit, is written into. Or NULL if symname isn't one:
+ * __shiva_emit_n<N>_code_<function> (SHIVA_T_EMIT_BYTECODE)
+ */
+const char *
+shiva_tf_emit_target(const char *symname)
+{
+	return shiva_tf_numbered_target(symname, SHIVA_T_EMIT_ID, "_code_");
+}
+
+/*
+ * Can the patch code of transform run from the address of the code it
+ * replaces? Not if anything in it must be relocated, or if it contains
+ * PC-relative code that reaches outside of itself.
+ */
+static bool
+shiva_tf_self_contained(struct shiva_module *linker, struct shiva_transform *transform)
+{
+	struct elf_relocation_iterator rel_iter;
+	struct elf_relocation rel;
+	uint64_t start = transform->source_symbol.value;
+	uint64_t end = start + transform->source_symbol.size + transform->ext_len;
+	char *shdrname;
+#if __aarch64__
+	struct shiva_aarch64_insn insn;
+	uint32_t raw;
+	int64_t target;
+	size_t off;
+#endif
+
+	elf_relocation_iterator_init(&linker->elfobj, &rel_iter);
+	while (elf_relocation_iterator_next(&rel_iter, &rel) == ELF_ITER_OK) {
+		shdrname = strrchr(rel.shdrname, '.');
+		if (shdrname == NULL || strcmp(shdrname, ".text") != 0)
+			continue;
+		if (rel.offset >= start && rel.offset < end) {
+			shiva_debug("%s has a relocation at %#lx\n",
+			    transform->source_symbol.name, rel.offset);
+			return false;
+		}
+	}
+#if __aarch64__
+	for (off = 0; off + 4 <= transform->new_len; off += 4) {
+		memcpy(&raw, &transform->ptr[off], sizeof(raw));
+		/*
+		 * adr, and the literal loads (ldr, ldrsw, prfm and the
+		 * SIMD/FP loads)
+		 */
+		if ((raw & 0x9f000000) == 0x10000000 ||
+		    (raw & 0x3b000000) == 0x18000000)
+			return false;
+		shiva_aarch64_decode(raw, &insn);
+		switch(insn.type) {
+		case SHIVA_AARCH64_INSN_ADRP:
+		case SHIVA_AARCH64_INSN_BL:
+			return false;
+		case SHIVA_AARCH64_INSN_B:
+		case SHIVA_AARCH64_INSN_BCOND:
+		case SHIVA_AARCH64_INSN_CB:
+		case SHIVA_AARCH64_INSN_TB:
+			target = (int64_t)off + insn.imm;
+			if (target < 0 || target > (int64_t)transform->new_len)
+				return false;
+			break;
+		default:
+			break;
+		}
+	}
+	return true;
+#else
+	/*
+	 * In place splicing is only implemented for aarch64
+	 */
+	return false;
+#endif
+}
+
+/*
+ * Check that an emit can be applied, and decide whether it's written in
+ * place. Bytecode that runs from the island must not be PC-relative,
+ * except for b/bl, which are relinked, and branches within itself.
+ * Nothing may branch into the code an emit replaces, past its first
+ * instruction.
+ */
+static bool
+shiva_tf_plan_emit(struct shiva_module *linker, struct shiva_transform *transform)
+{
+	struct shiva_transform *other;
+	uint64_t site = transform->target_symbol.value + transform->offset;
+	size_t i;
+#if __aarch64__
+	struct shiva_aarch64_insn insn;
+	uint32_t raw;
+	int64_t target;
+	size_t off;
+#endif
+
+	if (transform->new_len == 0 || transform->old_len == 0 ||
+	    (transform->offset | transform->old_len | transform->new_len) % 4 != 0) {
+		fprintf(stderr, "Emit %s is not made of whole instructions\n",
+		    transform->source_symbol.name);
+		return false;
+	}
+	if (transform->offset + transform->old_len > transform->target_symbol.size) {
+		fprintf(stderr, "Emit %s reaches beyond the end of %s\n",
+		    transform->source_symbol.name, transform->name);
+		return false;
+	}
+	TAILQ_FOREACH(other, &linker->tailq.transform_list, _linkage) {
+		if (other == transform ||
+		    other->target_symbol.value != transform->target_symbol.value)
+			continue;
+		/*
+		 * An emit into a function that is copied would be lost.
+		 */
+		if (other->type == SHIVA_TRANSFORM_SPLICE_FUNCTION &&
+		    (other->flags & SHIVA_TRANSFORM_F_INPLACE) == 0) {
+			fprintf(stderr, "Emit %s cannot be applied to %s, which is copied "
+			    "by splice %s\n", transform->source_symbol.name, transform->name,
+			    other->source_symbol.name);
+			return false;
+		}
+		if (other->offset < transform->offset + transform->old_len &&
+		    transform->offset < other->offset + other->old_len) {
+			fprintf(stderr, "Transforms %s and %s overlap within %s\n",
+			    transform->source_symbol.name, other->source_symbol.name,
+			    transform->name);
+			return false;
+		}
+	}
+	for (i = 0; i < transform->branch_count; i++) {
+		if (transform->branches[i].target_vaddr > site &&
+		    transform->branches[i].target_vaddr < site + transform->old_len) {
+			fprintf(stderr, "Branch at %#lx lands within emit %s\n",
+			    transform->branches[i].branch_site, transform->source_symbol.name);
+			return false;
+		}
+	}
+	if ((transform->flags & SHIVA_TRANSFORM_F_EXTEND) == 0) {
+		transform->flags |= SHIVA_TRANSFORM_F_INPLACE;
+		return true;
+	}
+#if __aarch64__
+	for (off = 0; off < transform->new_len; off += 4) {
+		memcpy(&raw, &transform->ptr[off], sizeof(raw));
+		if ((raw & 0x9f000000) == 0x10000000 ||
+		    (raw & 0x3b000000) == 0x18000000)
+			goto pcrel;
+		shiva_aarch64_decode(raw, &insn);
+		switch(insn.type) {
+		case SHIVA_AARCH64_INSN_ADRP:
+			goto pcrel;
+		case SHIVA_AARCH64_INSN_BCOND:
+		case SHIVA_AARCH64_INSN_CB:
+		case SHIVA_AARCH64_INSN_TB:
+			target = (int64_t)off + insn.imm;
+			if (target < 0 || target > (int64_t)transform->new_len)
+				goto pcrel;
+			break;
+		default:
+			break;
+		}
+	}
+	return true;
+pcrel:
+	fprintf(stderr, "Emit %s doesn't fit in %lu bytes, and has PC-relative code at "
+	    "+%#lx that can't be moved to the branch island\n",
+	    transform->source_symbol.name, transform->old_len, off);
+	return false;
+#else
+	fprintf(stderr, "Emit %s doesn't fit in %lu bytes, branch islands are only "
+	    "implemented for aarch64\n", transform->source_symbol.name, transform->old_len);
+	return false;
+#endif
+}
+
+/*
+ * Group the splices of each target function together, and decide how
+ * each group is applied. Then plan each emit. Called once every
+ * transform record is filled out.
+ */
+bool
+shiva_tf_plan_splices(struct shiva_module *linker)
+{
+	struct shiva_transform *transform, *other, **group;
+	size_t count, i;
+	bool inplace;
+
+	/*
+	 * attribute((naked)) does not work with gcc aarch64.
+	 * Our patch functions are compiled with a 4 byte prologue
+	 * that we must NOP out. As well as an 8 byte epilogue.
+	 */
+	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
+		if (transform->type != SHIVA_TRANSFORM_SPLICE_FUNCTION)
+			continue;
+		if (transform->offset + transform->old_len > transform->target_symbol.size) {
+			fprintf(stderr, "Splice %s reaches beyond the end of %s\n",
+			    transform->source_symbol.name, transform->name);
+			return false;
+		}
+#ifdef __aarch64__
+		if (transform->new_len < 12) {
+			fprintf(stderr, "Splice %s is too small\n",
+			    transform->source_symbol.name);
+			return false;
+		}
+		*(uint32_t *)&transform->ptr[0] = AARCH64_NOP;
+		*(uint32_t *)&transform->ptr[transform->new_len - 4] = AARCH64_NOP;
+		*(uint32_t *)&transform->ptr[transform->new_len - 8] = AARCH64_NOP;
+#endif
+		/*
+		 * The splice with the lowest offset into a function is the
+		 * primary of its group.
+		 */
+		transform->splice.primary = transform;
+		TAILQ_FOREACH(other, &linker->tailq.transform_list, _linkage) {
+			if (other == transform || other->type != SHIVA_TRANSFORM_SPLICE_FUNCTION ||
+			    other->target_symbol.value != transform->target_symbol.value)
+				continue;
+			if (other->offset < transform->offset + transform->old_len &&
+			    transform->offset < other->offset + other->old_len) {
+				fprintf(stderr, "Splices %s and %s overlap within %s\n",
+				    transform->source_symbol.name, other->source_symbol.name,
+				    transform->name);
+				return false;
+			}
+			if (other->offset < transform->splice.primary->offset)
+				transform->splice.primary = other;
+		}
+	}
+	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
+		if (transform->type != SHIVA_TRANSFORM_SPLICE_FUNCTION ||
+		    transform->splice.primary != transform)
+			continue;
+		/*
+		 * A live patch is linked into a running process, after the
+		 * callers could have been relinked to a copy of the function,
+		 * so it always makes a copy.
+		 */
+		group = shiva_tf_splice_group(linker, transform, &count);
+		inplace = (linker->flags & SHIVA_MODULE_F_LIVE) == 0;
+		for (i = 0; i < count && inplace == true; i++) {
+			if (group[i]->flags & SHIVA_TRANSFORM_F_EXTEND)
+				inplace = false;
+			else if (shiva_tf_self_contained(linker, group[i]) == false)
+				inplace = false;
+		}
+		for (i = 0; i < count && inplace == true; i++)
+			group[i]->flags |= SHIVA_TRANSFORM_F_INPLACE;
+		shiva_debug("%zu splice(s) of %s are applied %s\n", count, transform->name,
+		    inplace == true ? "in place" : "to a copy");
+		free(group);
+	}
+	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
+		if (transform->type != SHIVA_TRANSFORM_EMIT_BYTECODE)
+			continue;
+		if (shiva_tf_plan_emit(linker, transform) == false)
+			return false;
+		shiva_debug("Emit %s into %s is applied %s\n", transform->source_symbol.name,
+		    transform->name, (transform->flags & SHIVA_TRANSFORM_F_INPLACE) ?
+		    "in place" : "from the branch island");
+	}
+	return true;
+}
+
+/*
+ * Bytes of the branch island that the emits which don't fit in place
+ * need: their bytecode and a b back.
+ */
+size_t
+shiva_tf_island_size(struct shiva_module *linker)
+{
+	struct shiva_transform *transform;
+	size_t size = 0;
+
+	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
+		if (transform->type == SHIVA_TRANSFORM_EMIT_BYTECODE &&
+		    (transform->flags & SHIVA_TRANSFORM_F_INPLACE) == 0)
+			size += transform->new_len + 4;
+	}
+	return size;
+}
+
+#if __aarch64__
+/*
+ * Copy the bytecode of an emit that didn't fit at addr into the branch
+ * island, relinking the b/bl that leave it, and branch back to the code
+ * after the one it replaces (See shiva_tf_plan_emit).
+ */
+static bool
+shiva_tf_emit_island(struct shiva_module *linker, struct shiva_transform *transform,
+    uint64_t addr)
+{
+	struct shiva_aarch64_insn insn;
+	uint8_t *island;
+	uint32_t raw;
+	int64_t target;
+	size_t off;
+
+	island = shiva_module_island_alloc(linker, transform->new_len + 4);
+	if (island == NULL) {
+		fprintf(stderr, "No branch island room for emit %s\n",
+		    transform->source_symbol.name);
+		return false;
+	}
+	for (off = 0; off < transform->new_len; off += 4) {
+		memcpy(&raw, &transform->ptr[off], sizeof(raw));
+		shiva_aarch64_emit_insn(&island[off], raw);
+		shiva_aarch64_decode(raw, &insn);
+		if (insn.type != SHIVA_AARCH64_INSN_B && insn.type != SHIVA_AARCH64_INSN_BL)
+			continue;
+		target = (int64_t)off + insn.imm;
+		if (target >= 0 && target <= (int64_t)transform->new_len)
+			continue;
+		shiva_aarch64_emit_b(&island[off], insn.type == SHIVA_AARCH64_INSN_BL,
+		    (int64_t)(addr + target - (uint64_t)&island[off]));
+	}
+	shiva_aarch64_emit_b(&island[off], false,
+	    (int64_t)(addr + transform->old_len - (uint64_t)&island[off]));
+	transform->island = (uint64_t)island;
+	return true;
+}
+#endif
+
+/*
+ * Queue the in-place splices and the emits into txn: the patch code
+ * overwrites the code it replaces, and the rest of it is padded with
+ * nops. An emit that didn't fit is replaced by a b to its island.
+ */
+bool
+shiva_tf_queue_inplace(struct shiva_module *linker, struct shiva_patch_txn *txn)
+{
+	struct shiva_transform *transform;
+	shiva_error_t error;
+	uint64_t addr;
+	uint32_t nop = AARCH64_NOP;
+	uint8_t *code;
+	size_t off, len, code_len;
+#if __aarch64__
+	uint32_t b_island;
+#endif
+
+	TAILQ_FOREACH(transform, &linker->tailq.transform_list, _linkage) {
+		if (transform->type == SHIVA_TRANSFORM_SPLICE_FUNCTION &&
+		    (transform->flags & SHIVA_TRANSFORM_F_INPLACE) == 0)
+			continue;
+		if (transform->type != SHIVA_TRANSFORM_SPLICE_FUNCTION &&
+		    transform->type != SHIVA_TRANSFORM_EMIT_BYTECODE)
+			continue;
+		addr = linker->target_base + transform->target_symbol.value + transform->offset;
+		code = transform->ptr;
+		code_len = transform->new_len;
+#if __aarch64__
+		if ((transform->flags & SHIVA_TRANSFORM_F_INPLACE) == 0) {
+			if (shiva_tf_emit_island(linker, transform, addr) == false)
+				return false;
+			shiva_aarch64_emit_b((uint8_t *)&b_island, false,
+			    (int64_t)(transform->island - addr));
+			code = (uint8_t *)&b_island;
+			code_len = sizeof(b_island);
+		}
+#endif
+		shiva_debug("Writing %s into %s in place at %#lx\n",
+		    transform->source_symbol.name, transform->name, addr);
+		for (off = 0; off < transform->old_len; off += len) {
+			if (off < code_len) {
+				len = code_len - off;
+				if (len > SHIVA_PATCH_WRITE_MAX)
+					len = SHIVA_PATCH_WRITE_MAX;
+				if (shiva_patch_txn_write(txn, addr + off, &code[off],
+				    len, &error) == false)
+					goto fail;
+			} else {
+				len = sizeof(nop);
+				if (shiva_patch_txn_write(txn, addr + off, &nop, len,
+				    &error) == false)
+					goto fail;
+			}
+		}
+	}
+	return true;
+fail:
+	fprintf(stderr, "shiva_patch_txn_write failed: %s\n", shiva_error_msg(&error));
+	return false;
+}
@@ -1,16 +1,47 @@
 #include "shiva.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #define SHIVA_AUXV_COUNT 19
 
+/*
+ * The stack of the target is sized like the kernel sizes the stack of a
+ * new process: from RLIMIT_STACK, up to SHIVA_STACK_MAX. It's reserved
+ * with MAP_NORESERVE and pages are only faulted in as they're touched,
+ * so before the target runs only the pages holding the argv/envp/auxv
+ * image at the top are. The page below the stack is a PROT_NONE guard,
+ * so that an overflow faults instead of running into whatever is mapped
+ * below it.
+ */
 uint8_t *
 shiva_ulexec_allocstack(struct shiva_ctx *ctx)
 {
-	ctx->ulexec.stack = mmap(NULL, SHIVA_STACK_SIZE, PROT_READ|PROT_WRITE,
-	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_GROWSDOWN, -1, 0);
-	assert(ctx->ulexec.stack != MAP_FAILED);
+	struct rlimit rl;
+	size_t size = SHIVA_STACK_SIZE;
+	uint8_t *mem;
+
+	if (getrlimit(RLIMIT_STACK, &rl) == 0) {
+		if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > SHIVA_STACK_MAX)
+			size = SHIVA_STACK_MAX;
+		else if (rl.rlim_cur >= PAGE_SIZE * 4)
+			size = ELF_PAGEALIGN(rl.rlim_cur, PAGE_SIZE);
+	}
+	mem = mmap(NULL, size + PAGE_SIZE, PROT_NONE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_STACK, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	if (mprotect(mem + PAGE_SIZE, size, PROT_READ|PROT_WRITE) < 0) {
+		perror("mprotect");
+		(void) munmap(mem, size + PAGE_SIZE);
+		return NULL;
+	}
+	ctx->ulexec.stack = mem + PAGE_SIZE;
+	ctx->ulexec.stack_size = size;
 	shiva_debug("STACK: %#lx - %#lx\n", (uint64_t)ctx->ulexec.stack,
-	    (uint64_t)ctx->ulexec.stack + (size_t)SHIVA_STACK_SIZE);
-	return (ctx->ulexec.stack + SHIVA_STACK_SIZE);
+	    (uint64_t)ctx->ulexec.stack + size);
+	return (ctx->ulexec.stack + size);
 }
 /*
  * Remember the layout:
@@ -186,43 +217,27 @@ shiva_ulexec_make_prot(uint32_t p_flags)
 
 /*
  * Copy p_filesz bytes of the PT_LOAD segment (3rd arg) into
- * the buffer specified by dst (2nd arg).
+ * the buffer specified by dst (2nd arg). The segments are copied
+ * in bulk out of the objects file mapping. Note that
+ * shiva_ulexec_load_elf_binary() maps the segments directly from
+ * the file and does not need to copy them.
  */
 static bool
 shiva_ulexec_segment_copy(elfobj_t *elfobj, uint8_t *dst,
     struct elf_segment segment)
 {
-	size_t rem = segment.filesz % sizeof(uint64_t);
-	uint64_t qword;
-	bool res;
-	size_t i = 0;
+	uint8_t *src;
 
-	shiva_debug("Remainder: %d bytes\n", rem);
 	shiva_debug("Reading from address %#lx - %#lx\n", segment.vaddr,
 	    segment.vaddr + segment.filesz);
-	for (i = 0; i < segment.filesz; i += sizeof(uint64_t)) {
-		if (i + sizeof(uint64_t) >= segment.filesz) {
-			size_t j;
-
-			for (j = 0; j < rem; j++) {
-				res = elf_read_address(elfobj, segment.vaddr + i + j,
-				    &qword, ELF_BYTE);
-				if (res == false) {
-					shiva_debug("shiva_ulexec_segment_copy "
-					    "failed at %#lx\n", segment.vaddr + i + j);
-					return false;
-				}
-				dst[i + j] = (uint8_t)qword;
-			}
-			break;
-		}
-		res = elf_read_address(elfobj, segment.vaddr + i, &qword, ELF_QWORD);
-		if (res == false) {
-			shiva_debug("elf_read_address failed at %#lx\n", segment.vaddr + i);
-			return false;
-		}
-		*(uint64_t *)&dst[i] = qword;
+	src = elf_offset_pointer(elfobj, segment.offset);
+	if (src == NULL || segment.offset + segment.filesz < segment.offset ||
+	    segment.offset + segment.filesz > elf_size(elfobj)) {
+		shiva_debug("shiva_ulexec_segment_copy failed at %#lx\n",
+		    segment.vaddr);
+		return false;
 	}
+	memcpy(dst, src, segment.filesz);
 	return true;
 }
 
@@ -439,6 +454,151 @@ shiva_ulexec_load_elf_binary(struct shiva_ctx *ctx, elfobj_t *elfobj, bool inter
 	return true;
 }
 
+/*
+ * Lean version of shiva_ulexec_load_elf_binary() for the interpreter in
+ * interp mode. Only the ELF header and program headers of LDSO are read
+ * with pread(2), rather than parsing the whole object with libelfmaster
+ * (Section headers, symbol tables, etc.) which LDSO doesn't need from us.
+ * The span of the PT_LOAD segments is reserved once, and each segment is
+ * mapped into it.
+ */
+#define SHIVA_LDSO_MAX_PHDRS	32
+
+bool
+shiva_ulexec_load_ldso(struct shiva_ctx *ctx, const char *path)
+{
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdrs[SHIVA_LDSO_MAX_PHDRS], *phdr;
+	uint64_t span = 0, base, seg_start, seg_end, file_end, bss_start;
+	uint8_t *mem;
+	ssize_t len;
+	int fd, i, prot;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return false;
+	}
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+	    memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_type != ET_DYN ||
+	    ehdr.e_phentsize != sizeof(Elf64_Phdr) ||
+	    ehdr.e_phnum == 0 || ehdr.e_phnum > SHIVA_LDSO_MAX_PHDRS) {
+		fprintf(stderr, "%s: unsupported ELF header\n", path);
+		goto fail;
+	}
+	len = ehdr.e_phnum * sizeof(Elf64_Phdr);
+	if (pread(fd, phdrs, len, ehdr.e_phoff) != len) {
+		fprintf(stderr, "%s: cannot read program headers\n", path);
+		goto fail;
+	}
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_vaddr + phdrs[i].p_memsz > span)
+			span = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+	}
+	if (span == 0) {
+		fprintf(stderr, "%s: no PT_LOAD segments\n", path);
+		goto fail;
+	}
+	span = ELF_PAGEALIGN(span, PAGE_SIZE);
+	mem = mmap((void *)SHIVA_LDSO_BASE, span, PROT_NONE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		goto fail;
+	}
+	base = (uint64_t)mem;
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		phdr = &phdrs[i];
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		prot = shiva_ulexec_make_prot(phdr->p_flags);
+		seg_start = ELF_PAGESTART(base + phdr->p_vaddr);
+		file_end = base + phdr->p_vaddr + phdr->p_filesz;
+		seg_end = ELF_PAGEALIGN(base + phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+		if (phdr->p_filesz > 0) {
+			mem = mmap((void *)seg_start, file_end - seg_start, prot,
+			    MAP_PRIVATE|MAP_FIXED, fd, phdr->p_offset - ELF_PAGEOFFSET(phdr->p_vaddr));
+			if (mem == MAP_FAILED) {
+				perror("mmap");
+				goto fail;
+			}
+		}
+		if (phdr->p_memsz <= phdr->p_filesz)
+			continue;
+		/*
+		 * Zero the .bss on the last file backed page, and map the
+		 * rest of it anonymously.
+		 */
+		bss_start = ELF_PAGEALIGN(file_end, PAGE_SIZE);
+		if (phdr->p_filesz > 0 && ELF_PAGEOFFSET(file_end) != 0) {
+			if ((prot & PROT_WRITE) == 0) {
+				fprintf(stderr, "%s: .bss in a read-only segment\n", path);
+				goto fail;
+			}
+			memset((void *)file_end, 0, bss_start - file_end);
+		} else if (phdr->p_filesz == 0) {
+			bss_start = seg_start;
+		}
+		if (seg_end > bss_start) {
+			mem = mmap((void *)bss_start, seg_end - bss_start, prot,
+			    MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+			if (mem == MAP_FAILED) {
+				perror("mmap .bss");
+				goto fail;
+			}
+		}
+	}
+	/*
+	 * The mappings keep their own reference to the file.
+	 */
+	close(fd);
+	shiva_debug("Mapped interpreter %s at %#lx - %#lx\n", path, base, base + span);
+	ctx->ulexec.ldso.entry_point = base + ehdr.e_entry;
+	ctx->ulexec.ldso.base_vaddr = base;
+	ctx->ulexec.ldso.phdr_vaddr = base + ehdr.e_phoff;
+	return true;
+fail:
+	close(fd);
+	return false;
+}
+
+/*
+ * Build a fresh stack for the target from the argument and environment
+ * strings in ctx->ulexec, which the caller has replaced since
+ * shiva_ulexec_prep(). Used by the children of a zygote (See
+ * shiva_zygote.c), each of which also gets AT_RANDOM bytes of its own,
+ * since the canary and pointer guard that libc derives from them would
+ * otherwise be shared by every process that the zygote spawns.
+ */
+bool
+shiva_ulexec_respawn(struct shiva_ctx *ctx)
+{
+	shiva_auxv_iterator_t a_iter;
+	struct shiva_auxv_entry a_entry;
+
+	if (ctx->ulexec.stack != NULL) {
+		(void) munmap(ctx->ulexec.stack - PAGE_SIZE, ctx->ulexec.stack_size + PAGE_SIZE);
+		ctx->ulexec.stack = NULL;
+	}
+	shiva_auxv_iterator_init(ctx, &a_iter, NULL);
+	while (shiva_auxv_iterator_next(&a_iter, &a_entry) == SHIVA_ITER_OK) {
+		if (a_entry.type != AT_RANDOM)
+			continue;
+		if (syscall(SYS_getrandom, (void *)a_entry.value, 16, 0) != 16) {
+			perror("getrandom");
+			return false;
+		}
+		break;
+	}
+	if (shiva_ulexec_build_auxv_stack(ctx, &ctx->ulexec.rsp_start,
+	    (Elf64_auxv_t **)&ctx->ulexec.auxv.vector) == false) {
+		fprintf(stderr, "shiva_ulexec_build_auxv_stack() failed\n");
+		return false;
+	}
+	return true;
+}
+
 bool
 shiva_ulexec_prep(struct shiva_ctx *ctx)
 {
@@ -32,6 +32,19 @@ shiva_malloc(size_t len)
 		perror("malloc");
 		exit(EXIT_FAILURE);
 	}
+	SHIVA_STATS_ALLOC(len);
+	return mem;
+}
+
+void *
+shiva_realloc(void *ptr, size_t len)
+{
+	void *mem = realloc(ptr, len);
+	if (mem == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	SHIVA_STATS_ALLOC(len);
 	return mem;
 }
 
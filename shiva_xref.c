@@ -3,19 +3,24 @@
 void
 shiva_xref_iterator_init(struct shiva_ctx *ctx, struct shiva_xref_iterator *iter)
 {
-	
-	assert(TAILQ_EMPTY(&ctx->tailq.xref_tqlist) == false);
-	iter->current = TAILQ_FIRST(&ctx->tailq.xref_tqlist);
+	/*
+	 * The array may legitimately be empty, i.e. SHIVA_ANALYZE_LAZY=1
+	 * with a patch that overrides no data.
+	 */
+	iter->index = 0;
 	iter->ctx = ctx;
 	return;
 }
 
+/*
+ * Sets *e to the next xref site within ctx->analysis.xrefs. The site
+ * points directly into the array and must not be freed.
+ */
 shiva_iterator_res_t
-shiva_xref_iterator_next(struct shiva_xref_iterator *iter, struct shiva_xref_site *e)
+shiva_xref_iterator_next(struct shiva_xref_iterator *iter, struct shiva_xref_site **e)
 {
-	if (iter->current == NULL)
+	if (iter->index >= iter->ctx->analysis.xref_count)
 		return SHIVA_ITER_DONE;
-	memcpy(e, iter->current, sizeof(*e));
-	iter->current = TAILQ_NEXT(iter->current, _linkage);
+	*e = &iter->ctx->analysis.xrefs[iter->index++];
 	return ELF_ITER_OK;
 }
@@ -0,0 +1,523 @@
+/*
+ * shiva_zygote.c - A resident Shiva that spawns pre-patched processes.
+ *
+ * SHIVA_ZYGOTE=<socket> makes a standalone Shiva do all of the work that
+ * doesn't depend on the arguments of the target once: open and analyze
+ * the target, link the patch, map the target and LDSO. Then instead of
+ * passing control to LDSO it listens on the UNIX socket <socket>, and
+ * forks for every request that "shiva -z <socket> <argv0> [args]" sends.
+ * The child takes the argv and envp of the request, and the stdin,
+ * stdout, stderr and working directory of the client, builds a fresh
+ * stack for the target (See shiva_ulexec_respawn()) and carries on
+ * where the zygote left off, so the fork is the only cost of the
+ * warm image.
+ *
+ * The warm image stops right before the LDSO handoff rather than at
+ * shiva_post_linker(): by then libc has already taken argv, envp and
+ * the auxiliary vector, so LDSO still relocates the shared objects in
+ * every child. The client stays connected until the child exits, and
+ * exits with its status, which the zygote reaps. SIGINT, SIGTERM,
+ * SIGHUP and SIGQUIT sent to the client are forwarded to the child.
+ *
+ * Request:	struct shiva_zygote_request, with SCM_RIGHTS of the fds,
+ *		followed by argv then envp, each string NUL terminated.
+ * Replies:	a SHIVA_ZYGOTE_REPLY_PID once the child is forked, then
+ *		SHIVA_ZYGOTE_REPLY_EXIT. Or a single _ERROR.
+ */
+#include "shiva.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SHIVA_ZYGOTE_MAGIC		0x5a594753 /* "SGYZ" */
+#define SHIVA_ZYGOTE_MAX_CHILDREN	256
+#define SHIVA_ZYGOTE_MAX_STRINGS	(1U << 20)
+#define SHIVA_ZYGOTE_FDS		4 /* stdin, stdout, stderr and the cwd */
+#define SHIVA_ZYGOTE_TIMEOUT		5 /* seconds a client may take to send its request */
+
+#define SHIVA_ZYGOTE_REPLY_PID		1
+#define SHIVA_ZYGOTE_REPLY_EXIT		2
+#define SHIVA_ZYGOTE_REPLY_ERROR	3
+
+struct shiva_zygote_request {
+	uint32_t magic;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t len; /* of the strings that follow */
+};
+
+struct shiva_zygote_reply {
+	uint32_t magic;
+	uint32_t type;
+	int32_t pid;
+	int32_t status; /* wait status for _EXIT, errno for _ERROR */
+};
+
+static struct {
+	struct {
+		pid_t pid;
+		int fd; /* of the client waiting for it */
+	} children[SHIVA_ZYGOTE_MAX_CHILDREN];
+	size_t count;
+	int listen_fd;
+	sigset_t o_mask;
+	volatile sig_atomic_t sigchld;
+	volatile sig_atomic_t stop;
+} zygote;
+
+static volatile sig_atomic_t zygote_client_sig;
+
+static void
+shiva_zygote_signal(int sig)
+{
+	if (sig == SIGCHLD)
+		zygote.sigchld = 1;
+	else
+		zygote.stop = 1;
+	return;
+}
+
+static void
+shiva_zygote_reply(int fd, uint32_t type, pid_t pid, int status)
+{
+	struct shiva_zygote_reply reply;
+
+	reply.magic = SHIVA_ZYGOTE_MAGIC;
+	reply.type = type;
+	reply.pid = pid;
+	reply.status = status;
+	if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply))
+		shiva_debug("Client of pid %d is gone\n", pid);
+	return;
+}
+
+/*
+ * Count the NUL terminated strings in buf, which must end with one.
+ */
+static size_t
+shiva_zygote_nstrings(const char *buf, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == '\0')
+			n++;
+	}
+	return (len == 0 || buf[len - 1] == '\0') ? n : SIZE_MAX;
+}
+
+static bool
+shiva_zygote_recv_request(int fd, struct shiva_zygote_request *req, int *fds,
+    char **strings)
+{
+	union {
+		char buf[CMSG_SPACE(SHIVA_ZYGOTE_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t n;
+	size_t i;
+
+	for (i = 0; i < SHIVA_ZYGOTE_FDS; i++)
+		fds[i] = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	n = recvmsg(fd, &msg, MSG_WAITALL|MSG_CMSG_CLOEXEC);
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		if (cmsg->cmsg_len == CMSG_LEN(SHIVA_ZYGOTE_FDS * sizeof(int)))
+			memcpy(fds, CMSG_DATA(cmsg), SHIVA_ZYGOTE_FDS * sizeof(int));
+	}
+	if (n != sizeof(*req) || req->magic != SHIVA_ZYGOTE_MAGIC) {
+		fprintf(stderr, "zygote: malformed request\n");
+		return false;
+	}
+	if (fds[3] < 0 || (msg.msg_flags & MSG_CTRUNC)) {
+		fprintf(stderr, "zygote: request without its file descriptors\n");
+		return false;
+	}
+	if (req->argc == 0 || req->len > SHIVA_ZYGOTE_MAX_STRINGS) {
+		fprintf(stderr, "zygote: request with %u args and %u bytes of strings\n",
+		    req->argc, req->len);
+		return false;
+	}
+	*strings = shiva_malloc(req->len);
+	n = recv(fd, *strings, req->len, MSG_WAITALL);
+	if (n != (ssize_t)req->len ||
+	    shiva_zygote_nstrings(*strings, req->len) != (size_t)req->argc + req->envc) {
+		fprintf(stderr, "zygote: truncated request\n");
+		free(*strings);
+		return false;
+	}
+	return true;
+}
+
+static void
+shiva_zygote_close_fds(int *fds)
+{
+	size_t i;
+
+	for (i = 0; i < SHIVA_ZYGOTE_FDS; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	return;
+}
+
+/*
+ * Runs in the child, right after the fork: drop what belongs to the
+ * zygote and take over the arguments, the fds and the cwd of the client.
+ */
+static bool
+shiva_zygote_child(struct shiva_ctx *ctx, struct shiva_zygote_request *req, int *fds,
+    char *strings)
+{
+	size_t i, len;
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	(void) sigprocmask(SIG_SETMASK, &zygote.o_mask, NULL);
+	close(zygote.listen_fd);
+	for (i = 0; i < zygote.count; i++)
+		close(zygote.children[i].fd);
+	for (i = 0; i < 3; i++) {
+		if (dup2(fds[i], i) < 0) {
+			perror("dup2");
+			return false;
+		}
+	}
+	if (fchdir(fds[3]) < 0) {
+		perror("fchdir");
+		return false;
+	}
+	shiva_zygote_close_fds(fds);
+
+	for (i = 0, len = 0; i < req->argc; i++)
+		len += strlen(&strings[len]) + 1;
+	ctx->argc = req->argc;
+	ctx->ulexec.argstr = strings;
+	ctx->ulexec.arglen = len;
+	ctx->ulexec.envstr = strings + len;
+	ctx->ulexec.envplen = req->len - len;
+	ctx->ulexec.envpcount = req->envc;
+	if (shiva_ulexec_respawn(ctx) == false) {
+		fprintf(stderr, "shiva_ulexec_respawn() failed\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Fork a child for the request on fd. Returns 0 within the child, the
+ * pid of the child in the zygote, and -1 if the request failed, which
+ * the client has been told.
+ */
+static pid_t
+shiva_zygote_spawn(struct shiva_ctx *ctx, int fd)
+{
+	struct shiva_zygote_request req;
+	int fds[SHIVA_ZYGOTE_FDS];
+	char *strings = NULL;
+	pid_t pid;
+	int err;
+
+	if (shiva_zygote_recv_request(fd, &req, fds, &strings) == false) {
+		shiva_zygote_close_fds(fds);
+		shiva_zygote_reply(fd, SHIVA_ZYGOTE_REPLY_ERROR, 0, EINVAL);
+		return -1;
+	}
+	if (zygote.count == SHIVA_ZYGOTE_MAX_CHILDREN) {
+		err = EAGAIN;
+		goto fail;
+	}
+	pid = fork();
+	if (pid < 0) {
+		err = errno;
+		perror("fork");
+		goto fail;
+	}
+	if (pid == 0) {
+		if (shiva_zygote_child(ctx, &req, fds, strings) == false)
+			_exit(127);
+		return 0;
+	}
+	shiva_debug("zygote: spawned %d, argv[0] %s\n", pid, strings);
+	shiva_zygote_close_fds(fds);
+	free(strings);
+	zygote.children[zygote.count].pid = pid;
+	zygote.children[zygote.count].fd = fd;
+	zygote.count++;
+	shiva_zygote_reply(fd, SHIVA_ZYGOTE_REPLY_PID, pid, 0);
+	return pid;
+fail:
+	shiva_zygote_close_fds(fds);
+	free(strings);
+	shiva_zygote_reply(fd, SHIVA_ZYGOTE_REPLY_ERROR, 0, err);
+	return -1;
+}
+
+static void
+shiva_zygote_reap(void)
+{
+	int status;
+	pid_t pid;
+	size_t i;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < zygote.count; i++) {
+			if (zygote.children[i].pid != pid)
+				continue;
+			shiva_debug("zygote: %d exited with status %#x\n", pid, status);
+			shiva_zygote_reply(zygote.children[i].fd, SHIVA_ZYGOTE_REPLY_EXIT,
+			    pid, status);
+			close(zygote.children[i].fd);
+			zygote.children[i] = zygote.children[--zygote.count];
+			break;
+		}
+	}
+	return;
+}
+
+/*
+ * Called right before control is passed to LDSO. Returns right away
+ * unless SHIVA_ZYGOTE is set. Otherwise it only ever returns within a
+ * child that is ready to run the target, the zygote itself exits once
+ * it receives SIGINT or SIGTERM.
+ */
+bool
+shiva_zygote_serve(struct shiva_ctx *ctx)
+{
+	char *path = getenv("SHIVA_ZYGOTE");
+	struct sockaddr_un addr;
+	struct sigaction act;
+	struct timeval tv;
+	struct pollfd pfd;
+	sigset_t mask;
+	size_t i;
+	int fd;
+
+	if (path == NULL || path[0] == '\0')
+		return true;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "SHIVA_ZYGOTE: path too long: %s\n", path);
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	zygote.listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (zygote.listen_fd < 0) {
+		perror("socket");
+		return false;
+	}
+	(void) unlink(path);
+	if (bind(zygote.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    chmod(path, 0600) < 0 || listen(zygote.listen_fd, 64) < 0) {
+		fprintf(stderr, "SHIVA_ZYGOTE: %s: %s\n", path, strerror(errno));
+		close(zygote.listen_fd);
+		return false;
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = shiva_zygote_signal;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGCHLD, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	/*
+	 * The signals are only taken within ppoll(), so that none is lost
+	 * between checking the flags and going back to sleep.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	(void) sigprocmask(SIG_BLOCK, &mask, &zygote.o_mask);
+
+	fprintf(stderr, "Shiva zygote %d for %s listening on %s\n", getpid(),
+	    ctx->path, path);
+	pfd.fd = zygote.listen_fd;
+	pfd.events = POLLIN;
+	while (zygote.stop == 0) {
+		if (ppoll(&pfd, 1, NULL, &zygote.o_mask) < 0 && errno != EINTR) {
+			perror("ppoll");
+			break;
+		}
+		if (zygote.sigchld != 0) {
+			zygote.sigchld = 0;
+			shiva_zygote_reap();
+		}
+		if (zygote.stop != 0 || (pfd.revents & POLLIN) == 0)
+			continue;
+		fd = accept4(zygote.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				perror("accept4");
+			continue;
+		}
+		tv.tv_sec = SHIVA_ZYGOTE_TIMEOUT;
+		tv.tv_usec = 0;
+		(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		switch (shiva_zygote_spawn(ctx, fd)) {
+		case 0:
+			return true;
+		case -1:
+			close(fd);
+			break;
+		default:
+			break;
+		}
+	}
+	shiva_debug("zygote: exiting, %zu children still running\n", zygote.count);
+	close(zygote.listen_fd);
+	(void) unlink(path);
+	for (i = 0; i < zygote.count; i++)
+		close(zygote.children[i].fd);
+	exit(EXIT_SUCCESS);
+}
+
+static void
+shiva_zygote_client_signal(int sig)
+{
+	zygote_client_sig = sig;
+	return;
+}
+
+/*
+ * shiva -z <socket> <argv0> [args]
+ * Have the zygote listening on path spawn its target with argv, and
+ * our environment, fds and cwd. Returns the exit status of the target,
+ * 128 + signal number if it was killed, like a shell, or 127 if it
+ * couldn't be spawned.
+ */
+int
+shiva_zygote_request(const char *path, int argc, char **argv, char **envp)
+{
+	union {
+		char buf[CMSG_SPACE(SHIVA_ZYGOTE_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	int fds[SHIVA_ZYGOTE_FDS] = { 0, 1, 2, -1 };
+	struct shiva_zygote_request req;
+	struct shiva_zygote_reply reply;
+	struct sockaddr_un addr;
+	struct sigaction act;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char *strings, *s;
+	size_t len = 0;
+	pid_t pid = 0;
+	int fd, i, envc, ret = 127;
+	ssize_t n;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "zygote path too long: %s\n", path);
+		return 127;
+	}
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	for (envc = 0; envp[envc] != NULL; envc++)
+		len += strlen(envp[envc]) + 1;
+	if (len > SHIVA_ZYGOTE_MAX_STRINGS) {
+		fprintf(stderr, "Arguments and environment exceed %u bytes\n",
+		    SHIVA_ZYGOTE_MAX_STRINGS);
+		return 127;
+	}
+	strings = s = shiva_malloc(len == 0 ? 1 : len);
+	for (i = 0; i < argc; i++)
+		s = stpcpy(s, argv[i]) + 1;
+	for (i = 0; i < envc; i++)
+		s = stpcpy(s, envp[i]) + 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "connect(%s) failed: %s\n", path, strerror(errno));
+		goto done;
+	}
+	fds[3] = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fds[3] < 0) {
+		perror("open");
+		goto done;
+	}
+
+	req.magic = SHIVA_ZYGOTE_MAGIC;
+	req.argc = argc;
+	req.envc = envc;
+	req.len = len;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(SHIVA_ZYGOTE_FDS * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(req) ||
+	    send(fd, strings, len, MSG_NOSIGNAL) != (ssize_t)len) {
+		fprintf(stderr, "Sending the request to %s failed: %s\n", path,
+		    strerror(errno));
+		goto done;
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = shiva_zygote_client_signal;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGHUP, &act, NULL);
+	sigaction(SIGQUIT, &act, NULL);
+	for (;;) {
+		n = recv(fd, &reply, sizeof(reply), MSG_WAITALL);
+		if (n < 0 && errno == EINTR) {
+			if (pid > 0 && zygote_client_sig != 0)
+				(void) kill(pid, zygote_client_sig);
+			zygote_client_sig = 0;
+			continue;
+		}
+		if (n != sizeof(reply) || reply.magic != SHIVA_ZYGOTE_MAGIC) {
+			fprintf(stderr, "The zygote on %s went away%s\n", path,
+			    pid > 0 ? " before its child exited" : "");
+			break;
+		}
+		if (reply.type == SHIVA_ZYGOTE_REPLY_PID) {
+			pid = reply.pid;
+			shiva_debug("Spawned pid %d\n", pid);
+			continue;
+		}
+		if (reply.type == SHIVA_ZYGOTE_REPLY_ERROR) {
+			fprintf(stderr, "The zygote on %s failed to spawn %s: %s\n", path,
+			    argv[0], strerror(reply.status));
+			break;
+		}
+		if (WIFEXITED(reply.status))
+			ret = WEXITSTATUS(reply.status);
+		else if (WIFSIGNALED(reply.status))
+			ret = 128 + WTERMSIG(reply.status);
+		break;
+	}
+done:
+	if (fds[3] >= 0)
+		close(fds[3]);
+	if (fd >= 0)
+		close(fd);
+	free(strings);
+	return ret;
+}
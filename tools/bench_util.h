@@ -0,0 +1,57 @@
+#ifndef _SHIVA_BENCH_UTIL_H_
+#define _SHIVA_BENCH_UTIL_H_
+
+/*
+ * Helpers shared by the benchmarks in tools/, which take N samples of
+ * each measurement and report their p50/p99.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline int
+bench_u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Nearest rank percentile of a sorted array.
+ */
+static inline size_t
+bench_rank(int count, int pct)
+{
+	size_t rank = ((size_t)count * pct + 99) / 100;
+
+	return rank == 0 ? 0 : rank - 1;
+}
+
+/*
+ * Sorts the samples in place. Either of p50 and p99 may be NULL, both
+ * are 0 when there are no samples.
+ */
+static inline void
+bench_percentiles(uint64_t *samples, int count, uint64_t *p50, uint64_t *p99)
+{
+	if (count > 0)
+		qsort(samples, count, sizeof(*samples), bench_u64_cmp);
+	if (p50 != NULL)
+		*p50 = count > 0 ? samples[bench_rank(count, 50)] : 0;
+	if (p99 != NULL)
+		*p99 = count > 0 ? samples[bench_rank(count, 99)] : 0;
+	return;
+}
+
+#endif
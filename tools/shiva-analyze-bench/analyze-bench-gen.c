@@ -0,0 +1,102 @@
+/*
+ * analyze-bench-gen: generator of the synthetic binaries of
+ * shiva-analyze-bench.
+ *
+ * Writes AArch64 assembly of a program with -m MB of .text to stdout.
+ * The text is made of GEN_FUNC_SIZE byte functions, in which every
+ * group of sixteen instructions has a call, a conditional branch, a
+ * branch, two adrp xrefs (One with an add, one with a ldr) and ALU
+ * filler, which is about the density of the sites in compiled code.
+ * Each function calls its neighbours and refers to one of
+ * GEN_DATA_OBJECTS objects, so that the analyzers resolve a symbol for
+ * every site. Only main() is ever run.
+ *
+ * Usage: analyze-bench-gen [-m text_mb]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define GEN_DEFAULT_MB		1
+#define GEN_FUNC_SIZE		4096
+#define GEN_GROUP_INSNS		16
+#define GEN_DATA_OBJECTS	4096
+
+/*
+ * One group is GEN_GROUP_INSNS instructions.
+ */
+static void
+gen_group(long fn, long funcs)
+{
+	long obj = fn % GEN_DATA_OBJECTS;
+
+	printf("\tadd\tx2, x2, #1\n\teor\tx3, x3, x2\n\tcmp\tx2, x3\n"
+	    "\tb.eq\t1f\n\tmov\tx0, x2\n\tbl\tab_fn_%ld\n"
+	    "\tadrp\tx1, ab_obj_%ld\n\tadd\tx1, x1, :lo12:ab_obj_%ld\n"
+	    "\tadrp\tx4, ab_obj_%ld\n\tldr\tx4, [x4, :lo12:ab_obj_%ld]\n"
+	    "\tsub\tx3, x3, x4\n\tb\t2f\n1:\n\torr\tx3, x3, x1\n"
+	    "\tlsl\tx2, x2, #1\n\tand\tx3, x3, x2\n2:\n\tnop\n",
+	    (fn + 1) % funcs, obj, obj, (obj + 1) % GEN_DATA_OBJECTS,
+	    (obj + 1) % GEN_DATA_OBJECTS);
+	return;
+}
+
+static void
+gen_program(long mb)
+{
+	long funcs = mb * 1024 * 1024 / GEN_FUNC_SIZE, i;
+	/*
+	 * The prologue and epilogue are four instructions.
+	 */
+	long groups = (GEN_FUNC_SIZE / 4 - 4) / GEN_GROUP_INSNS;
+
+	printf("\t.text\n");
+	for (i = 0; i < funcs; i++) {
+		printf("\t.globl ab_fn_%ld\n\t.type ab_fn_%ld, %%function\n"
+		    "\t.p2align 4\nab_fn_%ld:\n\tstp\tx29, x30, [sp, #-16]!\n"
+		    "\tmov\tx29, sp\n\t.rept %ld\n", i, i, i, groups);
+		gen_group(i, funcs);
+		printf("\t.endr\n\tldp\tx29, x30, [sp], #16\n\tret\n"
+		    "\t.size ab_fn_%ld, .-ab_fn_%ld\n", i, i);
+	}
+	printf("\t.globl main\n\t.type main, %%function\n\t.p2align 2\n"
+	    "main:\n\tmov\tw0, #0\n\tret\n\t.size main, .-main\n");
+	printf("\t.data\n\t.p2align 3\n");
+	for (i = 0; i < GEN_DATA_OBJECTS; i++)
+		printf("\t.globl ab_obj_%ld\n\t.type ab_obj_%ld, %%object\n"
+		    "\t.size ab_obj_%ld, 8\nab_obj_%ld:\n\t.quad %ld\n", i, i, i, i, i);
+	printf("\t.section .note.GNU-stack,\"\",%%progbits\n");
+	return;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-m text_mb]\n", prog);
+	fprintf(stderr, "-m	MB of .text (default %d)\n", GEN_DEFAULT_MB);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	long mb = GEN_DEFAULT_MB;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mb = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (mb < 1)
+		usage(argv[0]);
+	gen_program(mb);
+	exit(EXIT_SUCCESS);
+}
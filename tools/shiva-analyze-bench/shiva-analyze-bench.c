@@ -0,0 +1,184 @@
+/*
+ * shiva-analyze-bench: benchmark of the analysis phase of Shiva.
+ *
+ * Runs only what the interpreter does to analyze a target before any
+ * module is loaded, shiva_build_trace_data() (elf_open_object() of the
+ * target) and shiva_analyze_run(), N times over each binary of a corpus,
+ * and reports the p50/p99 of both, the instructions scanned per second,
+ * the branch and xref sites found and the peak size of the site arrays
+ * (See shiva_analyze_merge_chunks). Each binary is measured in a child
+ * of its own, whose peak RSS is reported as well.
+ *
+ * The SHIVA_ANALYZE_* options apply as they do in the interpreter. A
+ * binary that was prelinked by shiva-ld is loaded from its table, which
+ * is reported as "prelinked".
+ *
+ * It is linked against the objects of the interpreter, see Makefile.
+ *
+ * Usage: shiva-analyze-bench [-n runs] <binary>...
+ */
+
+#include "../../shiva.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "../bench_util.h"
+
+#define ABENCH_DEFAULT_RUNS	10
+
+struct abench_result {
+	uint64_t *open_ns;
+	uint64_t *analyze_ns;
+	uint64_t insns;
+	size_t branches;
+	size_t xrefs;
+	size_t site_bytes;
+	bool prelinked;
+};
+
+static bool
+abench_run_once(char *path, char **envp, struct abench_result *res, int run)
+{
+	struct shiva_ctx ctx;
+	struct elf_section text;
+	uint64_t t0, t1, t2;
+	bool ret;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.path = path;
+	ctx.envp = envp;
+	shiva_init_lists(&ctx);
+	ctx_global = &ctx;
+
+	t0 = bench_now();
+	if (shiva_build_trace_data(&ctx) == false)
+		return false;
+	t1 = bench_now();
+	ret = shiva_analyze_run(&ctx) == true && shiva_analyze_wait(&ctx) == true;
+	t2 = bench_now();
+	if (ret == false) {
+		fprintf(stderr, "shiva_analyze_run(%s) failed\n", path);
+		return false;
+	}
+	res->open_ns[run] = t1 - t0;
+	res->analyze_ns[run] = t2 - t1;
+	if (elf_section_by_name(&ctx.elfobj, ".text", &text) == true)
+		res->insns = text.size / 4;
+	res->branches = ctx.analysis.branch_count;
+	res->xrefs = ctx.analysis.xref_count;
+	res->site_bytes = ctx.analysis.site_bytes;
+	/*
+	 * A scan always merges its chunks into site arrays, the prelinked
+	 * table is used in place.
+	 */
+	res->prelinked = shiva_target_has_prelinking(&ctx) == true &&
+	    ctx.analysis.site_bytes == 0;
+
+	ctx_global = NULL;
+	shiva_arena_destroy(&ctx.arena.analysis);
+	shiva_arena_destroy(&ctx.arena.module);
+	shiva_arena_destroy(&ctx.arena.trace);
+	elf_close_object(&ctx.elfobj);
+	return true;
+}
+
+static void
+abench_report(const char *path, struct abench_result *res, int runs)
+{
+	const char *name = strrchr(path, '/');
+	uint64_t open_p50, open_p99, p50, p99;
+	struct rusage ru;
+
+	name = name == NULL ? path : name + 1;
+	bench_percentiles(res->open_ns, runs, &open_p50, &open_p99);
+	bench_percentiles(res->analyze_ns, runs, &p50, &p99);
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%-16s text_kb=%lu runs=%d open_p50_us=%lu open_p99_us=%lu "
+	    "analyze_p50_us=%lu analyze_p99_us=%lu minsns_per_sec=%lu "
+	    "branches=%zu xrefs=%zu site_kb=%zu rss_peak_kb=%ld%s\n",
+	    name, res->insns * 4 / 1024, runs,
+	    open_p50 / 1000, open_p99 / 1000, p50 / 1000, p99 / 1000,
+	    p50 == 0 ? 0 : res->insns * 1000 / p50,
+	    res->branches, res->xrefs, res->site_bytes / 1024, ru.ru_maxrss,
+	    res->prelinked == true ? " prelinked" : "");
+	return;
+}
+
+/*
+ * The analysis is never torn down by the interpreter, so each binary
+ * is measured in a fresh process for its peak RSS to mean anything.
+ */
+static bool
+abench_binary(char *path, char **envp, int runs)
+{
+	struct abench_result res;
+	int i, status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return false;
+	}
+	if (pid == 0) {
+		memset(&res, 0, sizeof(res));
+		res.open_ns = calloc(runs, sizeof(uint64_t));
+		res.analyze_ns = calloc(runs, sizeof(uint64_t));
+		if (res.open_ns == NULL || res.analyze_ns == NULL) {
+			perror("calloc");
+			_exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < runs; i++) {
+			if (abench_run_once(path, envp, &res, i) == false)
+				_exit(EXIT_FAILURE);
+		}
+		abench_report(path, &res, runs);
+		fflush(stdout);
+		_exit(EXIT_SUCCESS);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		return false;
+	}
+	if (WIFEXITED(status) == 0 || WEXITSTATUS(status) != 0) {
+		printf("%-16s failed (status %#x)\n", path, status);
+		return false;
+	}
+	return true;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n runs] <binary>...\n", prog);
+	fprintf(stderr, "-n	runs per binary (default %d)\n", ABENCH_DEFAULT_RUNS);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv, char **envp)
+{
+	int opt, runs = ABENCH_DEFAULT_RUNS, failed = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 1 || runs < 1)
+		usage(argv[0]);
+	for (; optind < argc; optind++) {
+		if (access(argv[optind], R_OK) != 0) {
+			printf("%-16s skipped: %s\n", argv[optind], strerror(errno));
+			continue;
+		}
+		if (abench_binary(argv[optind], envp, runs) == false)
+			failed++;
+	}
+	exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
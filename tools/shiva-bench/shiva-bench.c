@@ -0,0 +1,283 @@
+/*
+ * shiva-bench: startup benchmark of the Shiva loader.
+ *
+ * Runs a program N times in each of three modes and reports the p50/p99
+ * latency from exec to main(), and the peak RSS:
+ *
+ *	native	the unpatched program, loaded by the kernel and LDSO
+ *	ulexec	the unpatched program, loaded by "shiva -u" (SHIVA_OPTS_F_ULEXEC_ONLY)
+ *	interp	the program prelinked by shiva-ld, with Shiva as its PT_INTERP
+ *
+ * main() is detected by shiva_bench_hook.so, which is LD_PRELOAD'd into the
+ * program and writes a CLOCK_MONOTONIC timestamp into a pipe on entry to
+ * main(), through its __libc_start_main() wrapper. The time is measured
+ * from right before fork(2), so the cost of the fork is included in all
+ * three modes alike.
+ *
+ * Usage: shiva-bench [-n runs] [-i shiva] [-k hook.so] [-v] <native> <patched> [args...]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../bench_util.h"
+
+#define BENCH_DEFAULT_RUNS	100
+#define BENCH_DEFAULT_SHIVA	"/lib/shiva"
+#define BENCH_FD		200 /* out of the way of the programs own fds */
+
+typedef enum bench_mode {
+	BENCH_NATIVE = 0,
+	BENCH_ULEXEC,
+	BENCH_INTERP,
+	BENCH_MODE_COUNT
+} bench_mode_t;
+
+static const char *bench_mode_names[BENCH_MODE_COUNT] = {
+	[BENCH_NATIVE] = "native",
+	[BENCH_ULEXEC] = "ulexec",
+	[BENCH_INTERP] = "interp"
+};
+
+struct bench_opts {
+	int runs;
+	bool verbose;
+	char *shiva;
+	char *hook;
+	char *native;
+	char *patched;
+	char **args;
+	int argc;
+};
+
+struct bench_result {
+	uint64_t *latency; /* ns */
+	long *maxrss; /* KB */
+	int ok;
+	int failed;
+};
+
+static int
+long_cmp(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+bench_exec(struct bench_opts *opts, bench_mode_t mode, int fd)
+{
+	char **argv, fdstr[16];
+	int i, n = 0, null;
+
+	argv = calloc(opts->argc + 4, sizeof(char *));
+	if (argv == NULL)
+		_exit(127);
+	switch (mode) {
+	case BENCH_NATIVE:
+		argv[n++] = opts->native;
+		break;
+	case BENCH_ULEXEC:
+		argv[n++] = opts->shiva;
+		argv[n++] = "-u";
+		argv[n++] = opts->native;
+		break;
+	case BENCH_INTERP:
+	default:
+		argv[n++] = opts->patched;
+		break;
+	}
+	for (i = 0; i < opts->argc; i++)
+		argv[n++] = opts->args[i];
+	argv[n] = NULL;
+
+	if (dup2(fd, BENCH_FD) < 0)
+		_exit(127);
+	if (fd != BENCH_FD)
+		close(fd);
+	snprintf(fdstr, sizeof(fdstr), "%d", BENCH_FD);
+	setenv("SHIVA_BENCH_FD", fdstr, 1);
+	setenv("LD_PRELOAD", opts->hook, 1);
+	if (opts->verbose == false) {
+		null = open("/dev/null", O_RDWR);
+		if (null >= 0) {
+			dup2(null, STDIN_FILENO);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+			if (null > STDERR_FILENO)
+				close(null);
+		}
+	}
+	execv(argv[0], argv);
+	_exit(127);
+}
+
+static bool
+bench_run_once(struct bench_opts *opts, bench_mode_t mode, uint64_t *latency,
+    long *maxrss)
+{
+	struct rusage ru;
+	uint64_t start, hit;
+	ssize_t len;
+	pid_t pid;
+	int pfd[2], status;
+
+	if (pipe2(pfd, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		return false;
+	}
+	/*
+	 * The write end must survive the exec, only close-on-exec the
+	 * read end.
+	 */
+	fcntl(pfd[1], F_SETFD, 0);
+	start = bench_now();
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(pfd[0]);
+		close(pfd[1]);
+		return false;
+	}
+	if (pid == 0) {
+		close(pfd[0]);
+		bench_exec(opts, mode, pfd[1]);
+	}
+	close(pfd[1]);
+	len = read(pfd[0], &hit, sizeof(hit));
+	close(pfd[0]);
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		return false;
+	}
+	if (len != sizeof(hit)) {
+		if (opts->verbose == true)
+			fprintf(stderr, "%s: %s never reached main (status %#x)\n",
+			    bench_mode_names[mode], opts->native, status);
+		return false;
+	}
+	*latency = hit - start;
+	*maxrss = ru.ru_maxrss;
+	return true;
+}
+
+static void
+bench_report(struct bench_opts *opts, bench_mode_t mode, struct bench_result *res)
+{
+	const char *name = strrchr(opts->native, '/');
+	uint64_t p50, p99;
+
+	name = name == NULL ? opts->native : name + 1;
+	if (res->ok == 0) {
+		printf("%-16s %-7s runs=%d failed=%d\n", name, bench_mode_names[mode],
+		    res->ok, res->failed);
+		return;
+	}
+	bench_percentiles(res->latency, res->ok, &p50, &p99);
+	qsort(res->maxrss, res->ok, sizeof(*res->maxrss), long_cmp);
+	printf("%-16s %-7s runs=%d failed=%d p50_us=%lu p99_us=%lu "
+	    "rss_p50_kb=%ld rss_peak_kb=%ld\n", name, bench_mode_names[mode],
+	    res->ok, res->failed, p50 / 1000, p99 / 1000,
+	    res->maxrss[bench_rank(res->ok, 50)], res->maxrss[res->ok - 1]);
+	return;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n runs] [-i shiva] [-k hook.so] [-v] "
+	    "<native> <patched> [args...]\n", prog);
+	fprintf(stderr, "-n	runs per mode (default %d)\n", BENCH_DEFAULT_RUNS);
+	fprintf(stderr, "-i	path to the Shiva interpreter (default %s)\n",
+	    BENCH_DEFAULT_SHIVA);
+	fprintf(stderr, "-k	path to shiva_bench_hook.so (default: next to %s)\n", prog);
+	fprintf(stderr, "-v	keep the output of the program\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_opts opts;
+	struct bench_result res;
+	char hook[PATH_MAX], *p;
+	bench_mode_t mode;
+	int opt, i, failed = 0;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.runs = BENCH_DEFAULT_RUNS;
+	opts.shiva = BENCH_DEFAULT_SHIVA;
+	while ((opt = getopt(argc, argv, "+n:i:k:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.runs = atoi(optarg);
+			break;
+		case 'i':
+			opts.shiva = optarg;
+			break;
+		case 'k':
+			opts.hook = optarg;
+			break;
+		case 'v':
+			opts.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2 || opts.runs < 1)
+		usage(argv[0]);
+	opts.native = argv[optind];
+	opts.patched = argv[optind + 1];
+	opts.args = &argv[optind + 2];
+	opts.argc = argc - optind - 2;
+
+	if (opts.hook == NULL) {
+		if (realpath("/proc/self/exe", hook) == NULL) {
+			perror("realpath");
+			exit(EXIT_FAILURE);
+		}
+		p = strrchr(hook, '/');
+		snprintf(p + 1, sizeof(hook) - (p + 1 - hook), "shiva_bench_hook.so");
+		opts.hook = hook;
+	}
+	if (access(opts.hook, R_OK) != 0) {
+		fprintf(stderr, "Cannot access %s: %s\n", opts.hook, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	res.latency = calloc(opts.runs, sizeof(*res.latency));
+	res.maxrss = calloc(opts.runs, sizeof(*res.maxrss));
+	if (res.latency == NULL || res.maxrss == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (mode = 0; mode < BENCH_MODE_COUNT; mode++) {
+		res.ok = res.failed = 0;
+		for (i = 0; i < opts.runs; i++) {
+			if (bench_run_once(&opts, mode, &res.latency[res.ok],
+			    &res.maxrss[res.ok]) == true)
+				res.ok++;
+			else
+				res.failed++;
+		}
+		bench_report(&opts, mode, &res);
+		failed += res.failed;
+	}
+	exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
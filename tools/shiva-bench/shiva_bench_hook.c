@@ -0,0 +1,60 @@
+/*
+ * Preloaded into every program that shiva-bench runs. It interposes
+ * __libc_start_main(), which the crt1 of the program calls once LDSO
+ * has loaded and relocated it, and has it call bench_main() instead of
+ * main(). bench_main() runs after every constructor of the program, on
+ * entry to main, and reports the time back to shiva-bench through the
+ * pipe at $SHIVA_BENCH_FD. Unless SHIVA_BENCH_EXIT=0 the program exits
+ * right there, so that servers such as sshd don't keep running.
+ */
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef int (*bench_main_t)(int, char **, char **);
+
+/*
+ * The arguments after main differ between glibc and musl, they are
+ * passed through as they are.
+ */
+typedef int (*bench_start_main_t)(bench_main_t, int, char **, void *, void *,
+    void *, void *);
+
+static bench_main_t real_main;
+
+static int
+bench_main(int argc, char **argv, char **envp)
+{
+	struct timespec ts;
+	uint64_t now;
+	char *fd, *ex;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	fd = getenv("SHIVA_BENCH_FD");
+	if (fd == NULL)
+		return real_main(argc, argv, envp);
+	(void) write(atoi(fd), &now, sizeof(now));
+	ex = getenv("SHIVA_BENCH_EXIT");
+	if (ex == NULL || strcmp(ex, "0") != 0)
+		_exit(0);
+	return real_main(argc, argv, envp);
+}
+
+int
+__libc_start_main(bench_main_t main_fn, int argc, char **argv, void *a3,
+    void *a4, void *a5, void *a6)
+{
+	bench_start_main_t next;
+
+	next = (bench_start_main_t)dlsym(RTLD_NEXT, "__libc_start_main");
+	if (next == NULL)
+		_exit(127);
+	real_main = main_fn;
+	return next(bench_main, argc, argv, a3, a4, a5, a6);
+}
@@ -8,13 +8,23 @@
  * 2. Creates a new PT_LOAD segment by overwriting PT_NOTE.
  * 3. Creates a new PT_DYNAMIC segment within the new PT_LOAD segment. It has two additional entries:
  *	3.1. SHIVA_DT_NEEDED holds the address of the string to the patch basename, i.e. "amp_patch1.o"
+ *	     or a ':' separated list of them when -p is given more than once, i.e. "fix1.o:fix2.o".
+ *	     The patches are linked in this order, and a later patch overrides an earlier one.
  *	3.2. SHIVA_DT_SEARCH holds the address of the string to the patch search path, i.e. "/opt/shiva/modules"
+ *	3.3. SHIVA_DT_ORIG_INTERP holds the address of the string to the original interpreter path
+ *	3.4. SHIVA_DT_XREF_TABLE holds the address of the prelinked branch/xref table (See shiva_prelink.h)
+ *	3.5. SHIVA_DT_PATCH_IMAGE and SHIVA_DT_PATCH_IMAGESZ hold the file offset and size of the relocated
+ *	     patch image that --static_link embeds (See shiva_prelink.h), or 0 without one.
+ *
+ * shiva-ld --index <dir> instead builds the module registry index of a module directory, which
+ * Shiva uses to locate patch modules without searching for them (See shiva_module_index.c).
  *
  * The Shiva linker parses these custom dynamic segment values to locate the patch object at runtime.
- * In the future shiva-ld will be able to generate ELF relocation data for the external linking process
- * at runtime. This meta-data will be stored in the executable and parsed at runtime, giving Shiva
- * a rich source of patching information. Currently Shiva has to perform runtime analysis to determine
- * where external linking patches go, and this can be slow for some programs.
+ * shiva-ld also precomputes every branch site and xref site within the .text of the executable and
+ * stores them in a table at the end of the new PT_LOAD segment. The table is keyed by the build-id
+ * of the executable, and Shiva will use it instead of performing the runtime analysis that it would
+ * otherwise need to determine where external linking patches go. If the table is missing or stale
+ * Shiva falls back to runtime analysis.
  *
  * See https://github.com/advanced-microcode-patching/shiva/issues/4
  *
@@ -24,6 +34,7 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,9 +44,13 @@
 #include <stdint.h>
 #include <elf.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <link.h>
 #include <getopt.h>
+#include <search.h>
+#include <dirent.h>
 
 #if defined(__ANDROID__) || defined(ANDROID)
 	#include "../../include/libelfmaster.h"
@@ -47,6 +62,35 @@
 #define SHIVA_DT_SEARCH DT_LOOS + 11
 #define SHIVA_DT_ORIG_INTERP DT_LOOS + 12
 
+#include "../../shiva_prelink.h"
+#include "../../shiva_aarch64.h"
+
+/*
+ * These must match the values in shiva.h
+ */
+#define SHIVA_BRANCH_JMP	0
+#define SHIVA_BRANCH_CALL	1
+
+#define SHIVA_BRANCH_F_PLTCALL		(1UL << 0)
+#define SHIVA_BRANCH_F_SRC_SYMINFO	(1UL << 1)
+#define SHIVA_BRANCH_F_DST_SYMINFO	(1UL << 2)
+
+#define SHIVA_XREF_TYPE_ADRP_LDR 1
+#define SHIVA_XREF_TYPE_ADRP_STR 2
+#define SHIVA_XREF_TYPE_ADRP_ADD 3
+#define SHIVA_XREF_TYPE_UNKNOWN 4
+
+#define SHIVA_XREF_F_INDIRECT		(1UL << 0)
+#define SHIVA_XREF_F_SRC_SYMINFO	(1UL << 1)
+
+#define ARM_INSN_LEN 4
+
+/*
+ * Max number of unique strings that are de-duplicated
+ * within the prelinked table strtab.
+ */
+#define SHIVA_PL_STRTAB_CACHE_MAX (4096 * 64)
+
 #define SHIVA_SIGNATURE 0x31f64
 
 #define ELF_MIN_ALIGN 4096
@@ -75,6 +119,7 @@ struct shiva_prelink_ctx {
 	char *search_path;
 	char *interp_path;
 	char *orig_interp_path;
+	char *patch_image;
 	struct {
 		elfobj_t elfobj;
 	} bin;
@@ -92,44 +137,530 @@ struct shiva_prelink_ctx {
 		uint64_t dyn_offset; /* offset of PT_DYNAMIC */
 		uint64_t search_path_offset; /* offset of module search path string */
 		uint64_t needed_offset; /* offset of module basename path's */
+		uint64_t xref_table_offset; /* offset of prelinked xref table */
 	} new_segment; // a new PT_LOAD segment for our new PT_DYNAMIC to point into
+	struct {
+		struct shiva_prelink_table_hdr hdr;
+		struct shiva_prelink_branch *branches;
+		struct shiva_prelink_xref *xrefs;
+		char *strtab;
+		size_t branch_max;
+		size_t xref_max;
+		size_t strtab_max;
+		struct hsearch_data strcache;
+		uint8_t *mem; /* final serialized table */
+		size_t size;
+	} xref_table;
+	struct {
+		uint8_t *mem;
+		size_t size;
+		uint64_t offset; /* page aligned, past the end of the new PT_LOAD */
+	} image; // relocated patch image for --static_link
 } shiva_prelink_ctx;
 
 static bool
 elf_segment_copy(elfobj_t *elfobj, uint8_t *dst, struct elf_segment segment)
 {
-	size_t rem = segment.filesz % sizeof(uint64_t);
-	uint64_t qword;
-	bool res;
-	size_t i = 0;
-
-	for (i = 0; i < segment.filesz; i += sizeof(uint64_t)) {
-		if (i + sizeof(uint64_t) >= segment.filesz) {
-			size_t j;
-
-			for (j = 0; j < rem; j++) {
-				res = elf_read_address(elfobj, segment.vaddr + i + j,
-				    &qword, ELF_BYTE);
-				if (res == false) {
-					fprintf(stderr, "elf_segment_copy "
-					    "failed at %#lx\n", segment.vaddr + i + j);
-					return false;
+	uint8_t *src;
+
+	if (segment.offset > elfobj->size || segment.filesz > elfobj->size - segment.offset ||
+	    (src = elf_offset_pointer(elfobj, segment.offset)) == NULL) {
+		fprintf(stderr, "elf_segment_copy failed at %#lx\n", segment.vaddr);
+		return false;
+	}
+	memcpy(dst, src, segment.filesz);
+	return true;
+}
+
+/*
+ * Add a string into the prelinked tables string table and return it's
+ * offset. Strings are de-duplicated since the same symbol names are
+ * referenced by many callsites.
+ */
+static bool
+shiva_pl_strtab_add(struct shiva_prelink_ctx *ctx, const char *str, uint32_t *out)
+{
+	ENTRY e, *ep = NULL;
+	size_t len;
+
+	if (str == NULL || *str == '\0') {
+		*out = 0;
+		return true;
+	}
+	e.key = (char *)str;
+	e.data = NULL;
+	if (hsearch_r(e, FIND, &ep, &ctx->xref_table.strcache) != 0) {
+		*out = (uint32_t)(uintptr_t)ep->data;
+		return true;
+	}
+	len = strlen(str) + 1;
+	if (ctx->xref_table.hdr.strtab_size + len > ctx->xref_table.strtab_max) {
+		size_t n_max = (ctx->xref_table.strtab_max + len) * 2;
+		char *p = realloc(ctx->xref_table.strtab, n_max);
+
+		if (p == NULL) {
+			perror("realloc");
+			return false;
+		}
+		ctx->xref_table.strtab = p;
+		ctx->xref_table.strtab_max = n_max;
+	}
+	*out = (uint32_t)ctx->xref_table.hdr.strtab_size;
+	memcpy(&ctx->xref_table.strtab[*out], str, len);
+	ctx->xref_table.hdr.strtab_size += len;
+
+	e.key = strdup(str);
+	if (e.key == NULL) {
+		perror("strdup");
+		return false;
+	}
+	e.data = (void *)(uintptr_t)*out;
+	/*
+	 * If the cache is full we simply stop de-duplicating.
+	 */
+	if (hsearch_r(e, ENTER, &ep, &ctx->xref_table.strcache) == 0)
+		free(e.key);
+	return true;
+}
+
+static bool
+shiva_pl_pack_sym(struct shiva_prelink_ctx *ctx, struct shiva_prelink_sym *dst,
+    struct elf_symbol *src)
+{
+	memset(dst, 0, sizeof(*dst));
+	if (shiva_pl_strtab_add(ctx, src->name, &dst->name) == false)
+		return false;
+	dst->value = src->value;
+	dst->size = src->size;
+	dst->shndx = src->shndx;
+	dst->bind = src->bind;
+	dst->type = src->type;
+	dst->visibility = src->visibility;
+	return true;
+}
+
+static struct shiva_prelink_branch *
+shiva_pl_new_branch(struct shiva_prelink_ctx *ctx)
+{
+	struct shiva_prelink_branch *b;
+
+	if (ctx->xref_table.hdr.branch_count == ctx->xref_table.branch_max) {
+		size_t n_max = ctx->xref_table.branch_max ? ctx->xref_table.branch_max * 2 : 1024;
+
+		b = realloc(ctx->xref_table.branches, n_max * sizeof(*b));
+		if (b == NULL) {
+			perror("realloc");
+			return NULL;
+		}
+		ctx->xref_table.branches = b;
+		ctx->xref_table.branch_max = n_max;
+	}
+	b = &ctx->xref_table.branches[ctx->xref_table.hdr.branch_count++];
+	memset(b, 0, sizeof(*b));
+	return b;
+}
+
+static struct shiva_prelink_xref *
+shiva_pl_new_xref(struct shiva_prelink_ctx *ctx)
+{
+	struct shiva_prelink_xref *x;
+
+	if (ctx->xref_table.hdr.xref_count == ctx->xref_table.xref_max) {
+		size_t n_max = ctx->xref_table.xref_max ? ctx->xref_table.xref_max * 2 : 1024;
+
+		x = realloc(ctx->xref_table.xrefs, n_max * sizeof(*x));
+		if (x == NULL) {
+			perror("realloc");
+			return NULL;
+		}
+		ctx->xref_table.xrefs = x;
+		ctx->xref_table.xref_max = n_max;
+	}
+	x = &ctx->xref_table.xrefs[ctx->xref_table.hdr.xref_count++];
+	memset(x, 0, sizeof(*x));
+	return x;
+}
+
+/*
+ * Records a branch site. The symbol resolution mirrors what
+ * shiva_analyze_find_calls() does at runtime.
+ */
+static bool
+shiva_pl_add_branch(struct shiva_prelink_ctx *ctx, uint64_t site, uint64_t target,
+    uint32_t insn, int type, const char *insn_string)
+{
+	elfobj_t *obj = &ctx->bin.elfobj;
+	struct shiva_prelink_branch *b;
+	struct elf_symbol symbol, src_func;
+	char tmp[512];
+
+	b = shiva_pl_new_branch(ctx);
+	if (b == NULL)
+		return false;
+	b->branch_site = site;
+	b->target_vaddr = target;
+	b->branch_type = type;
+	b->o_insn = insn;
+	if (shiva_pl_strtab_add(ctx, insn_string, &b->insn_string) == false)
+		return false;
+
+	if (type == SHIVA_BRANCH_CALL) {
+		b->retaddr = site + ARM_INSN_LEN;
+		memset(&symbol, 0, sizeof(symbol));
+		if (elf_symbol_by_value_lookup(obj, target, &symbol) == false) {
+			struct elf_plt plt_entry;
+			elf_plt_iterator_t plt_iter;
+
+			symbol.name = NULL;
+			elf_plt_iterator_init(obj, &plt_iter);
+			while (elf_plt_iterator_next(&plt_iter, &plt_entry) == ELF_ITER_OK) {
+				if (plt_entry.addr == target) {
+					snprintf(tmp, sizeof(tmp), "%s@plt", plt_entry.symname);
+					symbol.name = tmp;
+					symbol.type = STT_FUNC;
+					symbol.bind = STB_GLOBAL;
+					symbol.size = 0;
+					b->branch_flags |= SHIVA_BRANCH_F_PLTCALL;
 				}
-				dst[i + j] = (uint8_t)qword;
 			}
+			if (symbol.name == NULL) {
+				snprintf(tmp, sizeof(tmp), "fn_%#lx", target);
+				symbol.name = tmp;
+				symbol.value = target;
+				symbol.type = STT_FUNC;
+				symbol.bind = STB_GLOBAL;
+			}
+		}
+		b->branch_flags |= SHIVA_BRANCH_F_DST_SYMINFO;
+		if (shiva_pl_pack_sym(ctx, &b->symbol, &symbol) == false)
+			return false;
+	}
+	if (elf_symbol_by_range(obj, site, &src_func) == true) {
+		b->branch_flags |= SHIVA_BRANCH_F_SRC_SYMINFO;
+		if (shiva_pl_pack_sym(ctx, &b->current_function, &src_func) == false)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Records an adrp xref site. next_imm is the byte offset encoded within
+ * the add/ldr/str instruction that follows the adrp.
+ */
+static bool
+shiva_pl_add_xref(struct shiva_prelink_ctx *ctx, uint64_t adrp_site, int64_t adrp_imm,
+    uint64_t next_imm, uint32_t adrp_insn, uint32_t next_insn, int type)
+{
+	elfobj_t *obj = &ctx->bin.elfobj;
+	struct shiva_prelink_xref *x;
+	struct elf_symbol symbol, deref_symbol, src_func;
+	uint64_t target = (adrp_site & ~0xfffUL) + adrp_imm + next_imm;
+	uint64_t qword, xref_flags = 0;
+	char tmp[512];
+
+	memset(&deref_symbol, 0, sizeof(deref_symbol));
+	if (elf_read_address(obj, target, &qword, ELF_QWORD) == false)
+		return true;
+	if (elf_symbol_by_value_lookup(obj, target, &symbol) == false) {
+		struct elf_section shdr;
+		uint64_t shndx;
+
+		if (elf_section_by_address(obj, target, &shdr) == false) {
+			shiva_pl_debug("Unable to find section associated with addr: %#lx\n",
+			    target);
+			return true;
+		}
+		if (elf_section_index_by_name(obj, shdr.name, &shndx) == false)
+			return true;
+		snprintf(tmp, sizeof(tmp), "%s+%lx", shdr.name, target - shdr.address);
+		symbol.name = tmp;
+		symbol.value = target;
+		symbol.size = sizeof(uint64_t);
+		symbol.bind = STB_GLOBAL;
+		symbol.type = STT_OBJECT;
+		symbol.visibility = STV_PROTECTED;
+		symbol.shndx = shndx;
+	}
+	if (elf_symbol_by_value_lookup(obj, qword, &deref_symbol) == true)
+		xref_flags |= SHIVA_XREF_F_INDIRECT;
+
+	x = shiva_pl_new_xref(ctx);
+	if (x == NULL)
+		return false;
+	if (elf_symbol_by_range(obj, adrp_site + ARM_INSN_LEN, &src_func) == true) {
+		xref_flags |= SHIVA_XREF_F_SRC_SYMINFO;
+		if (shiva_pl_pack_sym(ctx, &x->current_function, &src_func) == false)
+			return false;
+	}
+	x->type = type;
+	x->flags = xref_flags;
+	x->adrp_site = adrp_site;
+	x->adrp_imm = adrp_imm;
+	x->adrp_o_insn = adrp_insn;
+	x->next_imm = next_imm;
+	x->next_o_insn = next_insn;
+	x->target_vaddr = target;
+	if (shiva_pl_pack_sym(ctx, &x->symbol, &symbol) == false)
+		return false;
+	if (xref_flags & SHIVA_XREF_F_INDIRECT) {
+		if (shiva_pl_pack_sym(ctx, &x->deref_symbol, &deref_symbol) == false)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Scan the .text of the target executable and build the same branch and
+ * xref records that shiva_analyze_find_calls() builds at runtime. Both
+ * use the same decoder (shiva_aarch64.h), so shiva-ld doesn't need to
+ * link against capstone.
+ */
+static bool
+shiva_prelink_build_xref_table(struct shiva_prelink_ctx *ctx)
+{
+	elfobj_t *obj = &ctx->bin.elfobj;
+	struct shiva_prelink_table_hdr *hdr = &ctx->xref_table.hdr;
+	uint32_t *code;
+	uint64_t off, site, target;
+	char insn_string[128];
+	int type;
+	uint8_t *mem;
+
+	if (elf_machine(obj) != EM_AARCH64) {
+		fprintf(stderr, "Prelinked xref tables are only supported on aarch64\n");
+		return false;
+	}
+	memset(hdr, 0, sizeof(*hdr));
+	if (shiva_prelink_target_key(obj, hdr) == false) {
+		fprintf(stderr, "shiva_prelink_target_key() failed\n");
+		return false;
+	}
+	code = elf_address_pointer(obj, hdr->text_vaddr);
+	if (code == NULL) {
+		fprintf(stderr, "elf_address_pointer(%p, %#lx) failed\n",
+		    obj, hdr->text_vaddr);
+		return false;
+	}
+	if (hcreate_r(SHIVA_PL_STRTAB_CACHE_MAX, &ctx->xref_table.strcache) == 0) {
+		perror("hcreate_r");
+		return false;
+	}
+	/*
+	 * strtab[0] is reserved for the empty string.
+	 */
+	ctx->xref_table.strtab = calloc(1, 4096);
+	if (ctx->xref_table.strtab == NULL) {
+		perror("calloc");
+		return false;
+	}
+	ctx->xref_table.strtab_max = 4096;
+	hdr->strtab_size = 1;
+
+	for (off = 0; off + ARM_INSN_LEN <= hdr->text_size; off += ARM_INSN_LEN) {
+		struct shiva_aarch64_insn insn, next;
+
+		site = hdr->text_vaddr + off;
+		if (shiva_aarch64_decode(code[off / ARM_INSN_LEN], &insn) == false)
+			continue;
+		switch(insn.type) {
+		case SHIVA_AARCH64_INSN_B:
+		case SHIVA_AARCH64_INSN_BCOND:
+		case SHIVA_AARCH64_INSN_CB:
+		case SHIVA_AARCH64_INSN_TB:
+		case SHIVA_AARCH64_INSN_BL:
+			target = site + insn.imm;
+			shiva_aarch64_branch_string(&insn, site, insn_string,
+			    sizeof(insn_string));
+			if (shiva_pl_add_branch(ctx, site, target, insn.raw,
+			    insn.type == SHIVA_AARCH64_INSN_BL ? SHIVA_BRANCH_CALL :
+			    SHIVA_BRANCH_JMP, insn_string) == false)
+				return false;
+			break;
+		case SHIVA_AARCH64_INSN_ADRP:
+			/*
+			 * adrp followed by add/ldr/str. The instruction after
+			 * the adrp is consumed just like the runtime analyzer does.
+			 */
+			if (off + (ARM_INSN_LEN * 2) > hdr->text_size)
+				break;
+			off += ARM_INSN_LEN;
+			if (shiva_aarch64_decode(code[off / ARM_INSN_LEN], &next) == false)
+				break;
+			switch(next.type) {
+			case SHIVA_AARCH64_INSN_ADD_IMM:
+				type = SHIVA_XREF_TYPE_ADRP_ADD;
+				break;
+			case SHIVA_AARCH64_INSN_LDR_IMM:
+				type = SHIVA_XREF_TYPE_ADRP_LDR;
+				break;
+			case SHIVA_AARCH64_INSN_STR_IMM:
+				type = SHIVA_XREF_TYPE_ADRP_STR;
+				break;
+			default:
+				continue;
+			}
+			if (shiva_pl_add_xref(ctx, site, insn.imm, next.imm, insn.raw,
+			    next.raw, type) == false)
+				return false;
+			break;
+		default:
 			break;
 		}
-		res = elf_read_address(elfobj, segment.vaddr + i, &qword, ELF_QWORD);
-		if (res == false) {
-			fprintf(stderr, "elf_read_address failed at %#lx\n", segment.vaddr + i);
+	}
+
+	/*
+	 * Serialize the table
+	 */
+	hdr->magic = SHIVA_PRELINK_TABLE_MAGIC;
+	hdr->version = SHIVA_PRELINK_TABLE_VERSION;
+	hdr->branch_offset = sizeof(*hdr);
+	hdr->xref_offset = hdr->branch_offset +
+	    hdr->branch_count * sizeof(struct shiva_prelink_branch);
+	hdr->strtab_offset = hdr->xref_offset +
+	    hdr->xref_count * sizeof(struct shiva_prelink_xref);
+	hdr->table_size = ELF_PAGEALIGN(hdr->strtab_offset + hdr->strtab_size, 8);
+
+	mem = calloc(1, hdr->table_size);
+	if (mem == NULL) {
+		perror("calloc");
+		return false;
+	}
+	memcpy(mem, hdr, sizeof(*hdr));
+	memcpy(&mem[hdr->branch_offset], ctx->xref_table.branches,
+	    hdr->branch_count * sizeof(struct shiva_prelink_branch));
+	memcpy(&mem[hdr->xref_offset], ctx->xref_table.xrefs,
+	    hdr->xref_count * sizeof(struct shiva_prelink_xref));
+	memcpy(&mem[hdr->strtab_offset], ctx->xref_table.strtab, hdr->strtab_size);
+	ctx->xref_table.mem = mem;
+	ctx->xref_table.size = hdr->table_size;
+
+	free(ctx->xref_table.branches);
+	free(ctx->xref_table.xrefs);
+	free(ctx->xref_table.strtab);
+	hdestroy_r(&ctx->xref_table.strcache);
+
+	printf("[+] Prelinked %lu branch sites and %lu xref sites (%zu bytes)\n",
+	    hdr->branch_count, hdr->xref_count, ctx->xref_table.size);
+	return true;
+}
+
+/*
+ * Read the relocated patch image that Shiva stored in SHIVA_MODULE_IMAGE
+ * after linking the patch into (A prelinked copy of) this executable
+ * once. It is only accepted when it was linked against the exact same
+ * .text, Shiva checks the rest of its key at runtime.
+ */
+static bool
+shiva_prelink_load_image(struct shiva_prelink_ctx *ctx)
+{
+	struct shiva_prelink_table_hdr key;
+	struct shiva_mcache_hdr *hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(ctx->patch_image, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return false;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return false;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "%s is not a Shiva patch image\n", ctx->patch_image);
+		close(fd);
+		return false;
+	}
+	ctx->image.mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ctx->image.mem == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	ctx->image.size = st.st_size;
+	hdr = (struct shiva_mcache_hdr *)ctx->image.mem;
+	if (hdr->magic != SHIVA_MCACHE_MAGIC || hdr->version != SHIVA_MCACHE_VERSION ||
+	    hdr->file_size != ctx->image.size) {
+		fprintf(stderr, "%s is not a version %d Shiva patch image\n",
+		    ctx->patch_image, SHIVA_MCACHE_VERSION);
+		return false;
+	}
+	memset(&key, 0, sizeof(key));
+	if (shiva_prelink_target_key(&ctx->bin.elfobj, &key) == false) {
+		fprintf(stderr, "shiva_prelink_target_key() failed\n");
+		return false;
+	}
+	if (hdr->target_key_type != key.key_type || hdr->target_key_len != key.key_len ||
+	    memcmp(hdr->target_key, key.key, key.key_len) != 0) {
+		fprintf(stderr, "%s was not linked against %s\n", ctx->patch_image,
+		    ctx->input_exec);
+		return false;
+	}
+	printf("[+] Embedding patch image %s: %lu fixup words, %lu target writes, %lu "
+	    "shared library symbols (%zu bytes)\n", ctx->patch_image, hdr->relr_count,
+	    hdr->write_count, hdr->delayed_count, ctx->image.size);
+	return true;
+}
+
+/*
+ * Copy the body of the input executable into fd. The file is unchanged
+ * except for the ELF header, and the program and section header tables
+ * that were modified in memory, so the kernel copies the file and only
+ * those are written from memory.
+ */
+static bool
+shiva_prelink_copy_body(struct shiva_prelink_ctx *ctx, int fd)
+{
+	elfobj_t *obj = &ctx->bin.elfobj;
+	struct {
+		uint64_t offset;
+		size_t len;
+	} hdrs[3];
+	size_t done = 0, i;
+	ssize_t b;
+	int in_fd;
+
+	hdrs[0].offset = 0;
+	hdrs[0].len = elf_ehsize(obj);
+	hdrs[1].offset = elf_phoff(obj);
+	hdrs[1].len = elf_segment_count(obj) * sizeof(ElfW(Phdr));
+	hdrs[2].offset = elf_shoff(obj);
+	hdrs[2].len = elf_shnum(obj) * sizeof(ElfW(Shdr));
+
+	in_fd = open(ctx->input_exec, O_RDONLY);
+	if (in_fd >= 0) {
+		while (done < obj->size) {
+			b = copy_file_range(in_fd, NULL, fd, NULL, obj->size - done, 0);
+			if (b <= 0)
+				break;
+			done += b;
+		}
+		close(in_fd);
+	}
+	if (done != obj->size) {
+		shiva_pl_debug("copy_file_range failed, writing %zu bytes\n", obj->size);
+		if (lseek(fd, 0, SEEK_SET) < 0 ||
+		    write(fd, obj->mem, obj->size) != (ssize_t)obj->size) {
+			perror("write");
+			return false;
+		}
+		return true;
+	}
+	for (i = 0; i < sizeof(hdrs) / sizeof(hdrs[0]); i++) {
+		if (hdrs[i].len == 0 || hdrs[i].offset + hdrs[i].len > obj->size)
+			continue;
+		if (pwrite(fd, &obj->mem[hdrs[i].offset], hdrs[i].len,
+		    hdrs[i].offset) != (ssize_t)hdrs[i].len) {
+			perror("pwrite");
 			return false;
 		}
-		*(uint64_t *)&dst[i] = qword;
 	}
 	return true;
 }
 
-#define NEW_DYN_COUNT 3
+#define NEW_DYN_COUNT 6
 
 bool
 shiva_prelink(struct shiva_prelink_ctx *ctx)
@@ -144,8 +675,7 @@ shiva_prelink(struct shiva_prelink_ctx *ctx)
 	bool found_note = false, found_dynamic = false;
 	uint8_t *mem;
 	char *target_path;
-	char template[] = "/tmp/elf.XXXXXX";
-	char null = 0;
+	char template[PATH_MAX];
 	struct stat st;
 	uint8_t *old_dynamic_segment;
 	size_t old_dynamic_size, dynamic_index;
@@ -167,6 +697,18 @@ shiva_prelink(struct shiva_prelink_ctx *ctx)
 		fprintf(stderr, "Currently we do not support static ELF executable\n");
 		return false;
 	}
+	if (ctx->patch_image != NULL && shiva_prelink_load_image(ctx) == false)
+		return false;
+	/*
+	 * The prelinked xref table is optional. If we fail to build it
+	 * then Shiva will simply perform it's analysis at runtime.
+	 */
+	if (shiva_prelink_build_xref_table(ctx) == false) {
+		fprintf(stderr, "Warning: failed to build the prelinked xref table,"
+		    " Shiva will analyze the executable at runtime\n");
+		ctx->xref_table.mem = NULL;
+		ctx->xref_table.size = 0;
+	}
 	/*
 	 * XXX:
 	 * We rely on the fact that by convention PT_DYNAMIC is typically before
@@ -208,6 +750,23 @@ shiva_prelink(struct shiva_prelink_ctx *ctx)
 			ctx->new_segment.filesz += strlen(ctx->input_patch) + 1;
 			ctx->new_segment.filesz += strlen(ctx->search_path) + 1;
 			ctx->new_segment.filesz += strlen(ctx->orig_interp_path) + 1;
+			/*
+			 * Make room for the prelinked xref table, which is placed
+			 * after the strings at an 8 byte aligned offset.
+			 */
+			if (ctx->xref_table.mem != NULL) {
+				size_t strings_end = ctx->new_segment.dyn_size +
+				    strlen(ctx->input_patch) + 1 +
+				    strlen(ctx->search_path) + 1 +
+				    strlen(ctx->orig_interp_path) + 1;
+
+				ctx->new_segment.xref_table_offset =
+				    ELF_PAGEALIGN(strings_end, 8);
+				if (ctx->new_segment.filesz < ctx->new_segment.xref_table_offset +
+				    ctx->xref_table.size)
+					ctx->new_segment.filesz = ctx->new_segment.xref_table_offset +
+					    ctx->xref_table.size;
+			}
 			/*
 			 * Mark the index of this segment so that we can modify it
 			 * to match the new dynamic segment location once we know it.
@@ -245,6 +804,13 @@ shiva_prelink(struct shiva_prelink_ctx *ctx)
 			ctx->new_segment.offset = n_segment.offset;
 			ctx->new_segment.filesz = n_segment.filesz;
 			ctx->new_segment.memsz = n_segment.memsz;
+			/*
+			 * The patch image is kept out of the PT_LOAD, Shiva maps
+			 * it from the file at the addresses it was linked for.
+			 */
+			if (ctx->image.mem != NULL)
+				ctx->image.offset = ELF_PAGEALIGN(n_segment.offset +
+				    n_segment.filesz, ELF_MIN_ALIGN);
 
 			dyn_segment.type = PT_DYNAMIC;
 			dyn_segment.flags = PF_R|PF_W;
@@ -308,27 +874,32 @@ shiva_prelink(struct shiva_prelink_ctx *ctx)
 		return false;
 	}
 
+	/*
+	 * The temporary file lives next to the output, so that the rename
+	 * is atomic and parallel runs (See --batch) never share a path.
+	 */
+	snprintf(template, sizeof(template), "%s.XXXXXX", ctx->output_exec);
 	fd = mkstemp(template);
 	if (fd < 0) {
 		perror("mkstemp");
-		return false;
+		goto fail;
 	}
 
 	shiva_pl_debug("Writing first %zu bytes of %s into tmpfile\n",
 	    ctx->bin.elfobj.size, ctx->bin.elfobj.path);
 
-	if (write(fd, ctx->bin.elfobj.mem, ctx->bin.elfobj.size) < 0) {
-		perror("write 1.");
-		return false;
-	}
+	if (shiva_prelink_copy_body(ctx, fd) == false)
+		goto fail;
 
 	shiva_pl_debug("s.offset: %#lx ctx->bin.elfobj.size: %#lx\n", n_segment.offset, ctx->bin.elfobj.size);
-	shiva_pl_debug("Writing extended sement of %zu bytes\n",
-	    n_segment.offset - ctx->bin.elfobj.size);
 
-	if (write(fd, &null, n_segment.offset - ctx->bin.elfobj.size) < 0) {
-		perror("write 2.");
-		return false;
+	/*
+	 * The gap up to the new segment is left as a hole, it reads back
+	 * as zeroes.
+	 */
+	if (lseek(fd, n_segment.offset, SEEK_SET) < 0) {
+		perror("lseek");
+		goto fail;
 	}
 
 	/*
@@ -338,16 +909,17 @@ shiva_prelink(struct shiva_prelink_ctx *ctx)
 	if (write(fd, old_dynamic_segment,
 	    old_dynamic_size - sizeof(ElfW(Dyn))) < 0) {
 		perror("write 3.");
-		return false;
+		goto fail;
 	}
 
-#define NEW_DYN_ENTRY_SZ 4
+#define NEW_DYN_ENTRY_SZ 7
 
 	ElfW(Dyn) dyn[NEW_DYN_ENTRY_SZ];
 
 	/*
-	 * Write out new dynamic entry for SHIVA_DT_SEARCH and
-	 * SHIVA_DT_NEEDED
+	 * Write out new dynamic entry for SHIVA_DT_SEARCH,
+	 * SHIVA_DT_NEEDED, SHIVA_DT_ORIG_INTERP, SHIVA_DT_XREF_TABLE and
+	 * SHIVA_DT_PATCH_IMAGE(SZ)
 	 */
 	dyn[0].d_tag = SHIVA_DT_SEARCH;
 	dyn[0].d_un.d_ptr = ctx->new_segment.vaddr + ctx->new_segment.dyn_size;
@@ -357,20 +929,27 @@ shiva_prelink(struct shiva_prelink_ctx *ctx)
 	dyn[2].d_tag = SHIVA_DT_ORIG_INTERP;
 	dyn[2].d_un.d_ptr = ctx->new_segment.vaddr + ctx->new_segment.dyn_size +
 	    strlen(ctx->search_path) + 1 + strlen(ctx->input_patch) + 1;
-	dyn[3].d_tag = DT_NULL;
-	dyn[3].d_un.d_ptr = 0x0;
+	dyn[3].d_tag = SHIVA_DT_XREF_TABLE;
+	dyn[3].d_un.d_ptr = ctx->xref_table.mem == NULL ? 0 :
+	    ctx->new_segment.vaddr + ctx->new_segment.xref_table_offset;
+	dyn[4].d_tag = SHIVA_DT_PATCH_IMAGE;
+	dyn[4].d_un.d_val = ctx->image.offset;
+	dyn[5].d_tag = SHIVA_DT_PATCH_IMAGESZ;
+	dyn[5].d_un.d_val = ctx->image.size;
+	dyn[6].d_tag = DT_NULL;
+	dyn[6].d_un.d_ptr = 0x0;
 
 	if (write(fd, &dyn[0], sizeof(dyn)) < 0) {
 		perror("write 4.");
-		return false;
+		goto fail;
 	}
 	if (write(fd, ctx->search_path, strlen(ctx->search_path) + 1) < 0) {
 		perror("write 5.");
-		return false;
+		goto fail;
 	}
 	if (write(fd, ctx->input_patch, strlen(ctx->input_patch) + 1) < 0) {
 		perror("write 6.");
-		return false;
+		goto fail;
 	}
 
 	printf("Writing out original interp path: %s\n", ctx->orig_interp_path);
@@ -378,32 +957,59 @@ shiva_prelink(struct shiva_prelink_ctx *ctx)
 	if (write(fd, ctx->orig_interp_path,
 	    strlen(ctx->orig_interp_path) + 1) < 0) {
 		perror("write 7.");
-		return false;
+		goto fail;
+	}
+	if (ctx->xref_table.mem != NULL) {
+		static const uint8_t zero[8] = {0};
+		size_t strings_end = ctx->new_segment.dyn_size +
+		    strlen(ctx->search_path) + 1 + strlen(ctx->input_patch) + 1 +
+		    strlen(ctx->orig_interp_path) + 1;
+
+		if (write(fd, zero, ctx->new_segment.xref_table_offset - strings_end) < 0) {
+			perror("write 8.");
+			goto fail;
+		}
+		if (write(fd, ctx->xref_table.mem, ctx->xref_table.size) < 0) {
+			perror("write 9.");
+			goto fail;
+		}
+	}
+	if (ctx->image.mem != NULL) {
+		if (lseek(fd, ctx->image.offset, SEEK_SET) < 0) {
+			perror("lseek");
+			goto fail;
+		}
+		if (write(fd, ctx->image.mem, ctx->image.size) != (ssize_t)ctx->image.size) {
+			perror("write 10.");
+			goto fail;
+		}
+		munmap(ctx->image.mem, ctx->image.size);
 	}
 	if (fchown(fd, st.st_uid, st.st_gid) < 0) {
 		perror("fchown");
-		return false;
+		goto fail;
 	}
 	if (fchmod(fd, st.st_mode) < 0) {
 		perror("fchmod");
-		return false;
+		goto fail;
 	}
 	close(fd);
 
 	target_path = strdup(elf_pathname(&ctx->bin.elfobj));
 	if (target_path == NULL) {
 		perror("strdup");
+		(void) unlink(template);
 		return false;
 	}
 
 	elf_close_object(&ctx->bin.elfobj);
-	rename(template, ctx->output_exec);
 
-	if (elf_open_object(ctx->output_exec, &ctx->bin.elfobj,
+	if (elf_open_object(template, &ctx->bin.elfobj,
 	    ELF_LOAD_F_MODIFY|ELF_LOAD_F_STRICT, &error) == false) {
 		fprintf(stderr, "elf_open_object(%s, ...) failed: %s\n",
-		    ctx->output_exec, elf_error_msg(&error));
+		    template, elf_error_msg(&error));
 		free(target_path);
+		(void) unlink(template);
 		return false;
 	}
 	free(target_path);
@@ -417,17 +1023,448 @@ shiva_prelink(struct shiva_prelink_ctx *ctx)
 	if (strlen(ctx->interp_path) > strlen(path)) {
 		fprintf(stderr, "PT_INTERP is only %zu bytes and cannot house the string %s\n",
 		    (size_t)strlen(path), ctx->interp_path);
+		elf_close_object(&ctx->bin.elfobj);
+		(void) unlink(template);
 		return false;
 	}
 	strcpy(path, ctx->interp_path);
+	elf_close_object(&ctx->bin.elfobj);
+	if (rename(template, ctx->output_exec) < 0) {
+		perror("rename");
+		(void) unlink(template);
+		return false;
+	}
+	return true;
+fail:
+	close(fd);
+	(void) unlink(template);
+	return false;
+}
+
+/*
+ * Prelink ctx->input_exec into ctx->output_exec.
+ */
+static bool
+shiva_prelink_exec(struct shiva_prelink_ctx *ctx)
+{
+	elf_error_t error;
+
+	/*
+	 * Open the target executable, with modification privileges.
+	 */
+	if (elf_open_object(ctx->input_exec, &ctx->bin.elfobj,
+		ELF_LOAD_F_STRICT|ELF_LOAD_F_MODIFY|ELF_LOAD_F_PRIV_MAP, &error) == false) {
+		fprintf(stderr, "elf_open_object(%s, ...) failed: %s\n",
+		    ctx->input_exec, elf_error_msg(&error));
+		return false;
+	}
+	printf("[+] Input executable: %s\n", ctx->input_exec);
+	printf("[+] Input search path for patch: %s\n", ctx->search_path);
+	printf("[+] Basename of patch(es): %s\n", ctx->input_patch);
+	printf("[+] Output executable: %s\n", ctx->output_exec);
+
+	if (shiva_prelink(ctx) == false) {
+		fprintf(stderr, "Failed to setup new LOAD segment with new DYNAMIC\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * A single line of a --batch manifest.
+ */
+struct shiva_prelink_item {
+	char *input_exec;
+	char *input_patch;
+	char *output_exec;
+	char *patch_image; /* optional */
+	pid_t pid;
+	int status;
+};
+
+static bool
+shiva_prelink_check_patch(const char *list, const char *image)
+{
+	if (image != NULL && strchr(list, ':') != NULL) {
+		fprintf(stderr, "--static_link only supports a single patch\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Manifest lines are "<exec> <patch[:patch...]> <output> [patch image]",
+ * blank lines and lines starting with '#' are skipped.
+ */
+static bool
+shiva_prelink_read_manifest(const char *path, struct shiva_prelink_item **items,
+    size_t *count)
+{
+	struct shiva_prelink_item *item;
+	char *line = NULL, *p, *save, *fields[4];
+	size_t len = 0, lineno = 0;
+	FILE *fp;
+	int i;
+
+	*items = NULL;
+	*count = 0;
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return false;
+	}
+	while (getline(&line, &len, fp) != -1) {
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		memset(fields, 0, sizeof(fields));
+		for (i = 0; i < 4; i++) {
+			fields[i] = strtok_r(i == 0 ? p : NULL, " \t\n", &save);
+			if (fields[i] == NULL)
+				break;
+		}
+		if (fields[2] == NULL || strtok_r(NULL, " \t\n", &save) != NULL) {
+			fprintf(stderr, "%s:%zu: expected <exec> <patch> <output> [image]\n",
+			    path, lineno);
+			goto fail;
+		}
+		if (shiva_prelink_check_patch(fields[1], fields[3]) == false) {
+			fprintf(stderr, "%s:%zu: invalid entry\n", path, lineno);
+			goto fail;
+		}
+		*items = realloc(*items, (*count + 1) * sizeof(**items));
+		if (*items == NULL) {
+			perror("realloc");
+			goto fail;
+		}
+		item = &(*items)[(*count)++];
+		memset(item, 0, sizeof(*item));
+		item->input_exec = strdup(fields[0]);
+		item->input_patch = strdup(fields[1]);
+		item->output_exec = strdup(fields[2]);
+		item->patch_image = fields[3] == NULL ? NULL : strdup(fields[3]);
+		if (item->input_exec == NULL || item->input_patch == NULL ||
+		    item->output_exec == NULL || (fields[3] != NULL && item->patch_image == NULL)) {
+			perror("strdup");
+			goto fail;
+		}
+	}
+	free(line);
+	fclose(fp);
+	if (*count == 0) {
+		fprintf(stderr, "%s lists no executables\n", path);
+		return false;
+	}
+	return true;
+fail:
+	free(line);
+	fclose(fp);
+	return false;
+}
+
+/*
+ * Prelink every executable in the manifest, up to jobs at a time, each
+ * in a worker process of its own. libelfmaster keeps per object state
+ * only, but a crash (or a leak) in one of them must not take the rest
+ * of the release down with it. A report of every item is printed once
+ * they are all done.
+ */
+static bool
+shiva_prelink_batch(struct shiva_prelink_ctx *tmpl, const char *manifest, int jobs)
+{
+	struct shiva_prelink_item *items, *item;
+	struct shiva_prelink_ctx ctx;
+	size_t count, next = 0, i, failed = 0;
+	int running = 0, status;
+	pid_t pid;
+
+	if (shiva_prelink_read_manifest(manifest, &items, &count) == false)
+		return false;
+	printf("[+] Prelinking %zu executables, %d at a time\n", count, jobs);
+	while (next < count || running > 0) {
+		while (running < jobs && next < count) {
+			item = &items[next++];
+			fflush(stdout);
+			fflush(stderr);
+			pid = fork();
+			if (pid < 0) {
+				perror("fork");
+				item->status = -1;
+				continue;
+			}
+			if (pid == 0) {
+				memcpy(&ctx, tmpl, sizeof(ctx));
+				ctx.input_exec = item->input_exec;
+				ctx.input_patch = item->input_patch;
+				ctx.output_exec = item->output_exec;
+				ctx.patch_image = item->patch_image;
+				exit(shiva_prelink_exec(&ctx) == true ? EXIT_SUCCESS : EXIT_FAILURE);
+			}
+			item->pid = pid;
+			running++;
+		}
+		if (running == 0)
+			break;
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("waitpid");
+			return false;
+		}
+		for (i = 0; i < count; i++) {
+			if (items[i].pid == pid) {
+				items[i].status = status;
+				running--;
+				break;
+			}
+		}
+	}
+	printf("\n");
+	for (i = 0; i < count; i++) {
+		item = &items[i];
+		status = item->status;
+		if (status == -1) {
+			printf("[FAILED] %s: could not fork\n", item->input_exec);
+		} else if (WIFSIGNALED(status)) {
+			printf("[FAILED] %s: killed by signal %d\n", item->input_exec,
+			    WTERMSIG(status));
+		} else if (WEXITSTATUS(status) != 0) {
+			printf("[FAILED] %s: exit status %d\n", item->input_exec,
+			    WEXITSTATUS(status));
+		} else {
+			printf("[OK] %s -> %s\n", item->input_exec, item->output_exec);
+			continue;
+		}
+		failed++;
+	}
+	printf("[+] %zu of %zu executables prelinked\n", count - failed, count);
+	return failed == 0;
+}
+
+struct shiva_prelink_index_item {
+	char *name;
+	char path[64];
+	uint64_t hash;
+	uint64_t size;
+};
+
+static int
+shiva_prelink_index_cmp(const void *a, const void *b)
+{
+	const struct shiva_prelink_index_item *x = a, *y = b;
+
+	return strcmp(x->name, y->name);
+}
+
+/*
+ * Store a copy of the module at path as objects/<hash>.o, unless there
+ * already is one. A hard link is enough, the module directory is only
+ * ever updated by replacing a module (i.e. with rename), never in place.
+ */
+static bool
+shiva_prelink_index_store(int dfd, const char *path, const char *objpath)
+{
+	int in, out;
+	ssize_t ret;
+
+	if (faccessat(dfd, objpath, F_OK, 0) == 0)
+		return true;
+	if (linkat(dfd, path, dfd, objpath, 0) == 0)
+		return true;
+	in = openat(dfd, path, O_RDONLY);
+	if (in < 0) {
+		perror("openat");
+		return false;
+	}
+	out = openat(dfd, objpath, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (out < 0) {
+		perror("openat");
+		close(in);
+		return false;
+	}
+	do {
+		ret = copy_file_range(in, NULL, out, NULL, 1 << 20, 0);
+	} while (ret > 0);
+	close(in);
+	close(out);
+	if (ret < 0) {
+		perror("copy_file_range");
+		(void) unlinkat(dfd, objpath, 0);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Build the module registry index of dir (See shiva_prelink.h). Every
+ * *.o within dir is hashed and stored under objects/ by its hash, and
+ * modules.idx maps the module name to it. The index gets the mtime of
+ * dir once it is in place, so any later change to dir marks it stale.
+ */
+static bool
+shiva_prelink_index(const char *dir)
+{
+	struct shiva_prelink_index_item *items = NULL, *item;
+	struct shiva_module_index_hdr hdr;
+	struct shiva_module_index_entry entry;
+	struct timespec times[2];
+	struct dirent *d;
+	struct stat st;
+	size_t count = 0, i, len, strtab_size;
+	uint32_t name_off;
+	char tmp[PATH_MAX], idx[PATH_MAX];
+	void *mem;
+	DIR *dp;
+	FILE *fp;
+	int dfd, fd;
+
+	if (snprintf(idx, sizeof(idx), "%s/%s", dir, SHIVA_MODULE_INDEX_NAME) >=
+	    (int)sizeof(idx) - 8) {
+		fprintf(stderr, "Module directory path is too long: %s\n", dir);
+		return false;
+	}
+	dp = opendir(dir);
+	if (dp == NULL) {
+		perror("opendir");
+		return false;
+	}
+	dfd = dirfd(dp);
+	if (mkdirat(dfd, SHIVA_MODULE_INDEX_OBJECTS, 0755) < 0 && errno != EEXIST) {
+		perror("mkdirat");
+		goto fail;
+	}
+	strtab_size = 1;
+	while ((d = readdir(dp)) != NULL) {
+		len = strlen(d->d_name);
+		if (len < 3 || strcmp(&d->d_name[len - 2], ".o") != 0)
+			continue;
+		if (fstatat(dfd, d->d_name, &st, 0) < 0 || S_ISREG(st.st_mode) == 0)
+			continue;
+		if (st.st_size == 0) {
+			fprintf(stderr, "Skipping empty module %s/%s\n", dir, d->d_name);
+			continue;
+		}
+		fd = openat(dfd, d->d_name, O_RDONLY);
+		if (fd < 0) {
+			perror("openat");
+			goto fail;
+		}
+		mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED) {
+			perror("mmap");
+			goto fail;
+		}
+		items = realloc(items, (count + 1) * sizeof(*items));
+		if (items == NULL) {
+			perror("realloc");
+			munmap(mem, st.st_size);
+			goto fail;
+		}
+		item = &items[count++];
+		item->name = strdup(d->d_name);
+		if (item->name == NULL) {
+			perror("strdup");
+			munmap(mem, st.st_size);
+			goto fail;
+		}
+		item->hash = shiva_module_index_hash(mem, st.st_size);
+		item->size = st.st_size;
+		munmap(mem, st.st_size);
+		snprintf(item->path, sizeof(item->path), "%s/%016lx.o",
+		    SHIVA_MODULE_INDEX_OBJECTS, item->hash);
+		if (shiva_prelink_index_store(dfd, item->name, item->path) == false) {
+			fprintf(stderr, "Unable to store %s/%s as %s\n", dir,
+			    item->name, item->path);
+			goto fail;
+		}
+		strtab_size += strlen(item->name) + 1 + strlen(item->path) + 1;
+	}
+	qsort(items, count, sizeof(*items), shiva_prelink_index_cmp);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SHIVA_MODULE_INDEX_MAGIC;
+	hdr.version = SHIVA_MODULE_INDEX_VERSION;
+	hdr.count = count;
+	hdr.entry_offset = sizeof(hdr);
+	hdr.strtab_offset = hdr.entry_offset + count * sizeof(entry);
+	hdr.strtab_size = strtab_size;
+	hdr.file_size = hdr.strtab_offset + strtab_size;
+
+	snprintf(tmp, sizeof(tmp), "%s/%s.XXXXXX", dir, SHIVA_MODULE_INDEX_NAME);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		perror("mkstemp");
+		goto fail;
+	}
+	(void) fchmod(fd, 0644);
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		perror("fdopen");
+		close(fd);
+		goto fail_unlink;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	/*
+	 * The strtab starts with an empty string, then the name and the
+	 * path of each entry, in order.
+	 */
+	name_off = 1;
+	for (i = 0; i < count; i++) {
+		memset(&entry, 0, sizeof(entry));
+		entry.name = name_off;
+		entry.path = name_off + strlen(items[i].name) + 1;
+		entry.hash = items[i].hash;
+		entry.size = items[i].size;
+		fwrite(&entry, sizeof(entry), 1, fp);
+		name_off = entry.path + strlen(items[i].path) + 1;
+	}
+	fputc('\0', fp);
+	for (i = 0; i < count; i++) {
+		fwrite(items[i].name, strlen(items[i].name) + 1, 1, fp);
+		fwrite(items[i].path, strlen(items[i].path) + 1, 1, fp);
+	}
+	if (ferror(fp) != 0 || fclose(fp) != 0) {
+		perror("fwrite");
+		goto fail_unlink;
+	}
+	if (rename(tmp, idx) < 0) {
+		perror("rename");
+		goto fail_unlink;
+	}
+	if (fstat(dfd, &st) < 0) {
+		perror("fstat");
+		goto fail;
+	}
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (utimensat(dfd, SHIVA_MODULE_INDEX_NAME, times, 0) < 0) {
+		perror("utimensat");
+		goto fail;
+	}
+	printf("[+] Indexed %zu modules in %s\n", count, idx);
+	for (i = 0; i < count; i++)
+		free(items[i].name);
+	free(items);
+	closedir(dp);
 	return true;
+fail_unlink:
+	(void) unlink(tmp);
+fail:
+	for (i = 0; i < count; i++)
+		free(items[i].name);
+	free(items);
+	closedir(dp);
+	return false;
 }
 
 int main(int argc, char **argv)
 {
-	int opt = 0, long_index = 0;
+	int opt = 0, long_index = 0, jobs = 0;
 	struct shiva_prelink_ctx ctx;
-	elf_error_t error;
+	char *manifest = NULL;
 
 	static struct option long_options[] = {
 		{"input_exec", required_argument, 0, 'e'},
@@ -435,6 +1472,10 @@ int main(int argc, char **argv)
 		{"output_exec", required_argument, 0, 'o'},
 		{"search_path", required_argument, 0, 's'},
 		{"interp_path", required_argument, 0, 'i'},
+		{"static_link", required_argument, 0, 'l'},
+		{"batch", required_argument, 0, 'b'},
+		{"jobs", required_argument, 0, 'j'},
+		{"index", required_argument, 0, 'x'},
 		{0,	0,	0,	0}
 	};
 
@@ -443,16 +1484,23 @@ usage:
 		printf("Usage: %s -e test_bin -p patch1.o -i /lib/shiva"
 		    "-s /opt/shiva/modules/ -o test_bin_final\n", argv[0]);
 		printf("[-e] --input_exec	Input ELF executable\n");
-		printf("[-p] --input_patch	Input ELF patch\n");
+		printf("[-p] --input_patch	Input ELF patch (May be repeated, later patches override earlier ones)\n");
 		printf("[-i] --interp_path	Interpreter search path, i.e. \"/lib/shiva\"\n");
 		printf("[-s] --search_path	Module search path (For patch object)\n");
 		printf("[-o] --output_exec	Output executable\n");
+		printf("[-l] --static_link	Embed the relocated patch image that was stored in SHIVA_MODULE_IMAGE\n");
+		printf("[-b] --batch		Prelink every \"<exec> <patch> <output> [image]\" line of a manifest,"
+		    " instead of -e/-p/-o/-l\n");
+		printf("[-j] --jobs		Number of executables prelinked in parallel with --batch"
+		    " (Default: one per CPU)\n");
+		printf("[-x] --index		Build the module registry index of a module directory, i.e."
+		    " \"/opt/shiva/modules\"\n");
 		exit(0);
 	}
 
 	memset(&ctx, 0, sizeof(ctx));
 
-	while ((opt = getopt_long(argc, argv, "e:p:i:s:o:",
+	while ((opt = getopt_long(argc, argv, "e:p:i:s:o:l:b:j:x:",
 	    long_options, &long_index)) != -1) {
 		switch(opt) {
 		case 'e':
@@ -467,7 +1515,20 @@ usage:
 			}
 			break;
 		case 'p':
-			ctx.input_patch = strdup(optarg);
+			if (strchr(optarg, ':') != NULL) {
+				fprintf(stderr, "Patch basename '%s' cannot contain ':'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			if (ctx.input_patch == NULL) {
+				ctx.input_patch = strdup(optarg);
+			} else {
+				char *list;
+
+				if (asprintf(&list, "%s:%s", ctx.input_patch, optarg) < 0)
+					list = NULL;
+				free(ctx.input_patch);
+				ctx.input_patch = list;
+			}
 			if (ctx.input_patch == NULL) {
 				perror("strdup");
 				exit(EXIT_FAILURE);
@@ -494,23 +1555,39 @@ usage:
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'l':
+			ctx.patch_image = strdup(optarg);
+			if (ctx.patch_image == NULL) {
+				perror("strdup");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			manifest = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'x':
+			exit(shiva_prelink_index(optarg) == true ?
+			    EXIT_SUCCESS : EXIT_FAILURE);
 		default:
 			break;
 		}
 	}
-	if (ctx.input_exec == NULL || ctx.input_patch == NULL ||
-	    ctx.interp_path == NULL || ctx.search_path == NULL || ctx.output_exec == NULL)
+	if (ctx.interp_path == NULL || ctx.search_path == NULL)
 		goto usage;
-
-	/*
-	 * Open the target executable, with modification privileges.
-	 */
-	if (elf_open_object(ctx.input_exec, &ctx.bin.elfobj,
-		ELF_LOAD_F_STRICT|ELF_LOAD_F_MODIFY|ELF_LOAD_F_PRIV_MAP, &error) == false) {
-		fprintf(stderr, "elf_open_object(%s, ...) failed: %s\n",
-		    ctx.input_exec, elf_error_msg(&error));
-		exit(EXIT_FAILURE);
+	if (manifest != NULL) {
+		if (jobs <= 0)
+			jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+			    sysconf(_SC_NPROCESSORS_ONLN) : 1;
+		exit(shiva_prelink_batch(&ctx, manifest, jobs) == true ?
+		    EXIT_SUCCESS : EXIT_FAILURE);
 	}
+	if (ctx.input_exec == NULL || ctx.input_patch == NULL || ctx.output_exec == NULL)
+		goto usage;
+	if (shiva_prelink_check_patch(ctx.input_patch, ctx.patch_image) == false)
+		exit(EXIT_FAILURE);
 
 	/*
 	 * Open the patch object
@@ -523,15 +1600,8 @@ usage:
 		exit(EXIT_FAILURE);
 	}
 #endif
-	printf("[+] Input executable: %s\n", ctx.input_exec);
-	printf("[+] Input search path for patch: %s\n", ctx.search_path);
-	printf("[+] Basename of patch: %s\n", ctx.input_patch);
-	printf("[+] Output executable: %s\n", ctx.output_exec);
-
-	if (shiva_prelink(&ctx) == false) {
-		fprintf(stderr, "Failed to setup new LOAD segment with new DYNAMIC\n");
+	if (shiva_prelink_exec(&ctx) == false)
 		exit(EXIT_FAILURE);
-	}
 	printf("Finished.\n");
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,184 @@
+/*
+ * linkbench-gen: generator of the synthetic inputs of shiva-linkbench.
+ *
+ * Writes AArch64 assembly to stdout, either of the fixed target (-t) or
+ * of a patch object that stresses one thing each in the Shiva linker:
+ *
+ *	-r relocs	relocations of each type that apply_relocation()
+ *			handles, i.e. R_AARCH64_CALL26, R_AARCH64_ADR_PREL_PG_HI21,
+ *			R_AARCH64_ADD_ABS_LO12_NC and R_AARCH64_ABS64
+ *	-g got		distinct functions of the target that the calls go
+ *			to, each is a PLT stub and a PLTGOT entry of the module
+ *	-b bss_kb	size of the SHN_COMMON blocks of the patch
+ *
+ * The target has the same -g functions, and lb_entry(), which the patch
+ * interposes so that shiva-ld links it in. None of the generated code is
+ * run, the patched lb_entry() returns right away.
+ *
+ * Usage: linkbench-gen -t [-g got]
+ *        linkbench-gen [-r relocs] [-g got] [-b bss_kb]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define GEN_DEFAULT_RELOCS	1000
+#define GEN_DEFAULT_GOT		4096
+#define GEN_DEFAULT_BSS_KB	65536
+#define GEN_FUNC_INSNS		4096 /* instructions per generated function */
+#define GEN_DATA_OBJECTS	1024 /* .data objects that adrp/add refer to */
+#define GEN_COMMON_BLOCKS	64
+
+static void
+gen_func_begin(const char *name, long n)
+{
+	printf("\t.globl %s%ld\n\t.type %s%ld, %%function\n\t.p2align 2\n%s%ld:\n",
+	    name, n, name, n, name, n);
+	return;
+}
+
+static void
+gen_func_end(const char *name, long n)
+{
+	printf("\tret\n\t.size %s%ld, .-%s%ld\n", name, n, name, n);
+	return;
+}
+
+static void
+gen_target(long got)
+{
+	long i;
+
+	printf("\t.text\n");
+	for (i = 0; i < got; i++) {
+		gen_func_begin("lb_target_", i);
+		gen_func_end("lb_target_", i);
+	}
+	printf("\t.globl lb_entry\n\t.type lb_entry, %%function\n\t.p2align 2\n"
+	    "lb_entry:\n\tmov\tw0, #1\n\tret\n\t.size lb_entry, .-lb_entry\n");
+	printf("\t.globl main\n\t.type main, %%function\n\t.p2align 2\n"
+	    "main:\n\tstp\tx29, x30, [sp, #-16]!\n\tmov\tx29, sp\n"
+	    "\tbl\tlb_entry\n\teor\tw0, w0, #1\n\tldp\tx29, x30, [sp], #16\n"
+	    "\tret\n\t.size main, .-main\n");
+	printf("\t.section .note.GNU-stack,\"\",%%progbits\n");
+	return;
+}
+
+/*
+ * Every instruction that carries a relocation is counted against the
+ * function it lives in, which is closed after GEN_FUNC_INSNS of them.
+ */
+static void
+gen_insn(long *insns, long *funcs, const char *fmt, ...)
+{
+	va_list va;
+
+	if (*insns == 0)
+		gen_func_begin("lb_body_", *funcs);
+	va_start(va, fmt);
+	vprintf(fmt, va);
+	va_end(va);
+	if (++*insns == GEN_FUNC_INSNS) {
+		gen_func_end("lb_body_", (*funcs)++);
+		*insns = 0;
+	}
+	return;
+}
+
+static void
+gen_patch(long relocs, long got, long bss_kb)
+{
+	long i, insns = 0, funcs = 0;
+
+	printf("\t.text\n");
+	printf("\t.globl lb_entry\n\t.type lb_entry, %%function\n\t.p2align 2\n"
+	    "lb_entry:\n\tmov\tw0, #0\n\tret\n\t.size lb_entry, .-lb_entry\n");
+	for (i = 0; i < relocs; i++)
+		gen_insn(&insns, &funcs, "\tbl\tlb_target_%ld\n", i % got);
+	/*
+	 * The pairs alternate between the .data objects of the patch and
+	 * its common blocks.
+	 */
+	for (i = 0; i < relocs; i++) {
+		const char *sym = (i & 1) ? "lb_common_" : "lb_data_";
+		long n = (i >> 1) % ((i & 1) ? GEN_COMMON_BLOCKS : GEN_DATA_OBJECTS);
+
+		gen_insn(&insns, &funcs, "\tadrp\tx0, %s%ld\n", sym, n);
+		gen_insn(&insns, &funcs, "\tadd\tx0, x0, :lo12:%s%ld\n", sym, n);
+	}
+	if (insns != 0)
+		gen_func_end("lb_body_", funcs++);
+
+	printf("\t.data\n\t.p2align 3\n");
+	for (i = 0; i < GEN_DATA_OBJECTS; i++)
+		printf("\t.globl lb_data_%ld\n\t.type lb_data_%ld, %%object\n"
+		    "\t.size lb_data_%ld, 8\nlb_data_%ld:\n\t.quad %ld\n", i, i, i, i, i);
+	printf("\t.globl lb_table\n\t.type lb_table, %%object\nlb_table:\n");
+	for (i = 0; i < relocs; i++) {
+		if (i & 1)
+			printf("\t.quad lb_body_%ld\n", (i >> 1) % funcs);
+		else
+			printf("\t.quad lb_target_%ld\n", (i >> 1) % got);
+	}
+	printf("\t.size lb_table, .-lb_table\n");
+
+	for (i = 0; i < GEN_COMMON_BLOCKS; i++)
+		printf("\t.comm lb_common_%ld, %ld, 16\n", i,
+		    bss_kb * 1024 / GEN_COMMON_BLOCKS);
+	printf("\t.section .note.GNU-stack,\"\",%%progbits\n");
+	return;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s -t [-g got]\n", prog);
+	fprintf(stderr, "       %s [-r relocs] [-g got] [-b bss_kb]\n", prog);
+	fprintf(stderr, "-t	write the fixed target instead of a patch\n");
+	fprintf(stderr, "-r	relocations of each type (default %d)\n", GEN_DEFAULT_RELOCS);
+	fprintf(stderr, "-g	distinct call targets, i.e. GOT entries (default %d)\n",
+	    GEN_DEFAULT_GOT);
+	fprintf(stderr, "-b	KB of common blocks in .bss (default %d)\n",
+	    GEN_DEFAULT_BSS_KB);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	long relocs = GEN_DEFAULT_RELOCS, got = GEN_DEFAULT_GOT;
+	long bss_kb = GEN_DEFAULT_BSS_KB;
+	bool target = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "tr:g:b:")) != -1) {
+		switch (opt) {
+		case 't':
+			target = true;
+			break;
+		case 'r':
+			relocs = atol(optarg);
+			break;
+		case 'g':
+			got = atol(optarg);
+			break;
+		case 'b':
+			bss_kb = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (relocs < 1 || got < 1 || bss_kb < 0)
+		usage(argv[0]);
+	if (target == true)
+		gen_target(got);
+	else
+		gen_patch(relocs, got, bss_kb);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,262 @@
+/*
+ * shiva-linkbench: linking benchmark of the Shiva loader.
+ *
+ * Runs a prelinked program N times with SHIVA_STATS set, and reports the
+ * p50/p99 of the time and the p50 of the bytes allocated in each phase
+ * that shiva_stats.c measures, followed by the counters of the first run.
+ * The module cache, module images and the zygote are turned off in the
+ * child so that every run links the patch from scratch.
+ *
+ * Usage: shiva-linkbench [-n runs] [-v] <patched> [args...]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../bench_util.h"
+
+#define LINKBENCH_DEFAULT_RUNS	20
+#define LINKBENCH_MAX_KEYS	64
+
+struct linkbench_key {
+	char name[64];
+	uint64_t *values;
+	int count;
+};
+
+struct linkbench_opts {
+	int runs;
+	bool verbose;
+	char *patched;
+	char **argv;
+};
+
+static void
+linkbench_exec(struct linkbench_opts *opts, const char *stats)
+{
+	int null;
+
+	setenv("SHIVA_STATS", stats, 1);
+	unsetenv("SHIVA_MODULE_CACHE");
+	unsetenv("SHIVA_MODULE_IMAGE");
+	unsetenv("SHIVA_ZYGOTE");
+	if (opts->verbose == false) {
+		null = open("/dev/null", O_RDWR);
+		if (null >= 0) {
+			dup2(null, STDIN_FILENO);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+			if (null > STDERR_FILENO)
+				close(null);
+		}
+	}
+	execv(opts->patched, opts->argv);
+	_exit(127);
+}
+
+static bool
+linkbench_run_once(struct linkbench_opts *opts, const char *stats)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return false;
+	}
+	if (pid == 0)
+		linkbench_exec(opts, stats);
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		return false;
+	}
+	if (WIFEXITED(status) == 0 || WEXITSTATUS(status) != 0) {
+		if (opts->verbose == true)
+			fprintf(stderr, "%s failed (status %#x)\n", opts->patched, status);
+		return false;
+	}
+	return true;
+}
+
+static struct linkbench_key *
+linkbench_key(struct linkbench_key *keys, int *nkeys, const char *name, int runs)
+{
+	int i;
+
+	for (i = 0; i < *nkeys; i++) {
+		if (strcmp(keys[i].name, name) == 0)
+			return &keys[i];
+	}
+	if (*nkeys == LINKBENCH_MAX_KEYS)
+		return NULL;
+	snprintf(keys[i].name, sizeof(keys[i].name), "%s", name);
+	keys[i].values = calloc(runs, sizeof(uint64_t));
+	if (keys[i].values == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	(*nkeys)++;
+	return &keys[i];
+}
+
+/*
+ * Each run appended a line of key=value pairs to the stats file (See
+ * shiva_stats_report), the pid and target aren't numbers.
+ */
+static int
+linkbench_parse(FILE *fp, struct linkbench_key *keys, int runs)
+{
+	struct linkbench_key *key;
+	char line[8192], *tok, *eq, *save;
+	int nkeys = 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "shiva-stats ", 12) != 0)
+			continue;
+		for (tok = strtok_r(line + 12, " \n", &save); tok != NULL;
+		    tok = strtok_r(NULL, " \n", &save)) {
+			eq = strchr(tok, '=');
+			if (eq == NULL || eq[1] == '\0')
+				continue;
+			*eq = '\0';
+			if (strcmp(tok, "pid") == 0 || strcmp(tok, "target") == 0)
+				continue;
+			key = linkbench_key(keys, &nkeys, tok, runs);
+			if (key == NULL || key->count == runs)
+				continue;
+			key->values[key->count++] = strtoull(eq + 1, NULL, 10);
+		}
+	}
+	return nkeys;
+}
+
+static bool
+linkbench_suffix(const char *name, const char *suffix)
+{
+	size_t len = strlen(name), slen = strlen(suffix);
+
+	return len > slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+static struct linkbench_key *
+linkbench_find(struct linkbench_key *keys, int nkeys, const char *name)
+{
+	int i;
+
+	for (i = 0; i < nkeys; i++) {
+		if (strcmp(keys[i].name, name) == 0)
+			return &keys[i];
+	}
+	return NULL;
+}
+
+static void
+linkbench_report(struct linkbench_opts *opts, struct linkbench_key *keys, int nkeys,
+    int ok, int failed)
+{
+	const char *name = strrchr(opts->patched, '/');
+	struct linkbench_key *alloc;
+	uint64_t p50, p99, alloc_p50;
+	char alloc_name[64];
+	int i;
+
+	name = name == NULL ? opts->patched : name + 1;
+	printf("%-24s runs=%d failed=%d\n", name, ok, failed);
+	for (i = 0; i < nkeys; i++) {
+		if (keys[i].count == 0 || linkbench_suffix(keys[i].name, "_us") == false)
+			continue;
+		bench_percentiles(keys[i].values, keys[i].count, &p50, &p99);
+		snprintf(alloc_name, sizeof(alloc_name), "%.*s_alloc",
+		    (int)strlen(keys[i].name) - 3, keys[i].name);
+		alloc = linkbench_find(keys, nkeys, alloc_name);
+		alloc_p50 = 0;
+		if (alloc != NULL)
+			bench_percentiles(alloc->values, alloc->count, &alloc_p50, NULL);
+		printf("  %-18.*s p50_us=%-8lu p99_us=%-8lu alloc_p50_kb=%lu\n",
+		    (int)strlen(keys[i].name) - 3, keys[i].name, p50, p99,
+		    alloc_p50 / 1024);
+	}
+	printf(" ");
+	for (i = 0; i < nkeys; i++) {
+		if (keys[i].count == 0 || linkbench_suffix(keys[i].name, "_us") == true ||
+		    linkbench_suffix(keys[i].name, "_alloc") == true)
+			continue;
+		printf(" %s=%lu", keys[i].name, keys[i].values[0]);
+	}
+	printf("\n");
+	return;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n runs] [-v] <patched> [args...]\n", prog);
+	fprintf(stderr, "-n	runs (default %d)\n", LINKBENCH_DEFAULT_RUNS);
+	fprintf(stderr, "-v	keep the output of the program\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct linkbench_key keys[LINKBENCH_MAX_KEYS];
+	struct linkbench_opts opts;
+	char stats[] = "/tmp/shiva-linkbench.XXXXXX";
+	int opt, fd, i, nkeys, ok = 0, failed = 0;
+	FILE *fp;
+
+	memset(&opts, 0, sizeof(opts));
+	memset(keys, 0, sizeof(keys));
+	opts.runs = LINKBENCH_DEFAULT_RUNS;
+	while ((opt = getopt(argc, argv, "+n:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.runs = atoi(optarg);
+			break;
+		case 'v':
+			opts.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 1 || opts.runs < 1)
+		usage(argv[0]);
+	opts.patched = argv[optind];
+	opts.argv = &argv[optind];
+
+	fd = mkstemp(stats);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	for (i = 0; i < opts.runs; i++) {
+		if (linkbench_run_once(&opts, stats) == true)
+			ok++;
+		else
+			failed++;
+	}
+	fp = fopen(stats, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "fopen(%s) failed: %s\n", stats, strerror(errno));
+		unlink(stats);
+		exit(EXIT_FAILURE);
+	}
+	nkeys = linkbench_parse(fp, keys, opts.runs);
+	fclose(fp);
+	unlink(stats);
+	linkbench_report(&opts, keys, nkeys, ok, failed);
+	exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
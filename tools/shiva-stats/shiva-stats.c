@@ -0,0 +1,193 @@
+/*
+ * shiva-stats: prints the hook statistics of a process that runs with
+ * SHIVA_HOOK_STATS=<path> (See shiva_hook_stats.h), one line per hook:
+ *
+ *	<type> <addr> <fn> <name> <hits> [<avg ns> <total ns>]
+ *
+ * Usage: shiva-stats [-l] [-i secs] <path>
+ *
+ * -l prints the latency histogram of each hook that was timed, -i keeps
+ * printing the hits of every interval until interrupted.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../../shiva_hook_stats.h"
+
+static volatile sig_atomic_t done;
+
+static void
+stats_stop(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static const char *
+stats_type_name(uint32_t type)
+{
+	switch (type) {
+	case SHIVA_HOOK_STATS_HANDLER:
+		return "handler";
+	case SHIVA_HOOK_STATS_PATCH:
+		return "patch";
+	default:
+		return "?";
+	}
+}
+
+static uint64_t
+stats_ns(struct shiva_hook_stats_hdr *hdr, uint64_t ticks)
+{
+	if (hdr->clock_freq == 0)
+		return ticks;
+	return (uint64_t)((double)ticks * 1000000000.0 / hdr->clock_freq);
+}
+
+static void
+stats_sum(struct shiva_hook_stats_entry *entry, uint64_t *hits, uint64_t *time)
+{
+	uint32_t i;
+
+	*hits = *time = 0;
+	for (i = 0; i < SHIVA_HOOK_STATS_STRIPES; i++) {
+		*hits += __atomic_load_n(&entry->stripes[i].hits, __ATOMIC_RELAXED);
+		*time += __atomic_load_n(&entry->stripes[i].time, __ATOMIC_RELAXED);
+	}
+	return;
+}
+
+static void
+stats_histogram(struct shiva_hook_stats_hdr *hdr, struct shiva_hook_stats_entry *entry)
+{
+	uint64_t count[SHIVA_HOOK_STATS_BUCKETS], max = 0;
+	int i, lo = -1, hi = -1, bar;
+
+	for (i = 0; i < SHIVA_HOOK_STATS_BUCKETS; i++) {
+		count[i] = __atomic_load_n(&entry->latency[i], __ATOMIC_RELAXED);
+		if (count[i] == 0)
+			continue;
+		if (lo < 0)
+			lo = i;
+		hi = i;
+		if (count[i] > max)
+			max = count[i];
+	}
+	for (i = lo; lo >= 0 && i <= hi; i++) {
+		bar = (int)(count[i] * 40 / max);
+		printf("\t%12lu ns | %-40.*s %lu\n", stats_ns(hdr, i == 0 ? 0 : 1UL << i),
+		    bar, "########################################", count[i]);
+	}
+	return;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-l] [-i secs] <path>\n", prog);
+	fprintf(stderr, "-l	print the latency histogram of each hook\n");
+	fprintf(stderr, "-i	print the hits of every interval until interrupted\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct shiva_hook_stats_hdr *hdr;
+	struct shiva_hook_stats_entry *entry;
+	bool histogram = false, latency;
+	unsigned int interval = 0;
+	uint64_t *last, hits, time;
+	struct stat st;
+	uint32_t i, used;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "li:")) != -1) {
+		switch (opt) {
+		case 'l':
+			histogram = true;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	if ((size_t)st.st_size < sizeof(*hdr) ||
+	    __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHIVA_HOOK_STATS_MAGIC ||
+	    hdr->version != SHIVA_HOOK_STATS_VERSION ||
+	    hdr->entry_size != sizeof(struct shiva_hook_stats_entry) ||
+	    hdr->stripes != SHIVA_HOOK_STATS_STRIPES ||
+	    hdr->entry_offset + (uint64_t)hdr->entry_size * hdr->entry_count >
+	    (uint64_t)st.st_size) {
+		fprintf(stderr, "%s: not a shiva hook stats file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	latency = (hdr->flags & SHIVA_HOOK_STATS_F_LATENCY) != 0;
+	last = calloc(hdr->entry_count, sizeof(*last));
+	if (last == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	signal(SIGINT, stats_stop);
+	signal(SIGTERM, stats_stop);
+	do {
+		used = __atomic_load_n(&hdr->entry_used, __ATOMIC_RELAXED);
+		if (used > hdr->entry_count)
+			used = hdr->entry_count;
+		for (i = 0; i < used; i++) {
+			entry = shiva_hook_stats_entry_by_index(hdr, i);
+			if (__atomic_load_n(&entry->type, __ATOMIC_ACQUIRE) == 0)
+				continue;
+			stats_sum(entry, &hits, &time);
+			printf("%-8s %#14lx %#14lx %-*.*s %12lu", stats_type_name(entry->type),
+			    entry->addr, entry->fn, SHIVA_HOOK_STATS_NAME_LEN,
+			    SHIVA_HOOK_STATS_NAME_LEN, entry->name[0] != '\0' ?
+			    entry->name : "?", interval != 0 ? hits - last[i] : hits);
+			if (latency == true && entry->type == SHIVA_HOOK_STATS_HANDLER &&
+			    hits != 0)
+				printf(" %10lu ns %14lu ns", stats_ns(hdr, time / hits),
+				    stats_ns(hdr, time));
+			printf("\n");
+			if (histogram == true && latency == true &&
+			    entry->type == SHIVA_HOOK_STATS_HANDLER)
+				stats_histogram(hdr, entry);
+			last[i] = hits;
+		}
+		if (interval != 0) {
+			printf("\n");
+			fflush(stdout);
+			sleep(interval);
+		}
+	} while (interval != 0 && done == 0);
+	fflush(stdout);
+	fprintf(stderr, "pid=%u hooks=%u dropped=%lu\n", hdr->pid, used,
+	    __atomic_load_n(&hdr->dropped, __ATOMIC_RELAXED));
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,181 @@
+/*
+ * shiva-trace: drains the shared memory trace buffer of a process that
+ * runs with SHIVA_TRACE_RING=<path> (See shiva_trace_ring.h), and prints
+ * one line per record:
+ *
+ *	<time> <thread> entry|exit|user <fn> <args...>
+ *
+ * Usage: shiva-trace [-f] [-b] [-i usecs] <path>
+ *
+ * -f keeps following the rings until interrupted, -b writes the raw
+ * struct shiva_trace_record's to stdout instead of text.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../../shiva_trace_ring.h"
+
+#define TRACE_DEFAULT_INTERVAL	1000 /* usecs between polls with -f */
+
+static volatile sig_atomic_t done;
+
+static void
+trace_stop(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static const char *
+trace_type_name(uint32_t type)
+{
+	switch (type) {
+	case SHIVA_TRACE_REC_ENTRY:
+		return "entry";
+	case SHIVA_TRACE_REC_EXIT:
+		return "exit";
+	case SHIVA_TRACE_REC_USER:
+		return "user";
+	default:
+		return "?";
+	}
+}
+
+static void
+trace_print(struct shiva_trace_ring_hdr *hdr, struct shiva_trace_record *rec, bool binary)
+{
+	if (binary == true) {
+		(void) fwrite(rec, sizeof(*rec), 1, stdout);
+		return;
+	}
+	if (hdr->clock_freq != 0)
+		printf("%lu.%09lu ", rec->time / hdr->clock_freq,
+		    (rec->time % hdr->clock_freq) * 1000000000UL / hdr->clock_freq);
+	else
+		printf("%lu ", rec->time);
+	printf("%#lx %s %#lx", rec->thread, trace_type_name(rec->type), rec->fn);
+	if (rec->type == SHIVA_TRACE_REC_EXIT)
+		printf(" = %#lx\n", rec->args[0]);
+	else
+		printf(" %#lx %#lx %#lx %#lx\n", rec->args[0], rec->args[1],
+		    rec->args[2], rec->args[3]);
+	return;
+}
+
+/*
+ * Consume every record that has been published in ring, and return the
+ * number of records consumed.
+ */
+static uint64_t
+trace_drain(struct shiva_trace_ring_hdr *hdr, struct shiva_trace_ring *ring, bool binary)
+{
+	struct shiva_trace_record rec;
+	uint64_t head, tail, n;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	for (n = 0; tail + n != head; n++) {
+		memcpy(&rec, &ring->records[(tail + n) & (hdr->ring_records - 1)],
+		    sizeof(rec));
+		trace_print(hdr, &rec, binary);
+	}
+	/*
+	 * Hand the slots back to the producer only once they are copied
+	 */
+	__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f] [-b] [-i usecs] <path>\n", prog);
+	fprintf(stderr, "-f	follow, keep draining until interrupted\n");
+	fprintf(stderr, "-b	write binary records instead of text\n");
+	fprintf(stderr, "-i	poll interval with -f (default %d)\n", TRACE_DEFAULT_INTERVAL);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct shiva_trace_ring_hdr *hdr;
+	struct shiva_trace_ring *ring;
+	bool follow = false, binary = false;
+	useconds_t interval = TRACE_DEFAULT_INTERVAL;
+	uint64_t total = 0, dropped = 0, n;
+	struct stat st;
+	uint32_t i, used;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "fbi:")) != -1) {
+		switch (opt) {
+		case 'f':
+			follow = true;
+			break;
+		case 'b':
+			binary = true;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	if ((size_t)st.st_size < sizeof(*hdr) ||
+	    __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHIVA_TRACE_RING_MAGIC ||
+	    hdr->version != SHIVA_TRACE_RING_VERSION ||
+	    hdr->record_size != sizeof(struct shiva_trace_record) ||
+	    hdr->ring_offset + hdr->ring_stride * hdr->ring_count > (uint64_t)st.st_size) {
+		fprintf(stderr, "%s: not a shiva trace ring\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	signal(SIGINT, trace_stop);
+	signal(SIGTERM, trace_stop);
+	do {
+		used = __atomic_load_n(&hdr->ring_used, __ATOMIC_RELAXED);
+		if (used > hdr->ring_count)
+			used = hdr->ring_count;
+		for (n = 0, i = 0; i < used; i++)
+			n += trace_drain(hdr, shiva_trace_ring_by_index(hdr, i), binary);
+		total += n;
+		if (n == 0 && follow == true)
+			usleep(interval);
+	} while (follow == true && done == 0);
+	fflush(stdout);
+
+	for (i = 0; i < used; i++) {
+		ring = shiva_trace_ring_by_index(hdr, i);
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+	fprintf(stderr, "pid=%u records=%lu rings=%u dropped=%lu dropped_noring=%lu\n",
+	    hdr->pid, total, used, dropped,
+	    __atomic_load_n(&hdr->dropped_noring, __ATOMIC_RELAXED));
+	exit(EXIT_SUCCESS);
+}